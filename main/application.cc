@@ -9,6 +9,24 @@
 #include "mcp_server.h"
 #include "assets.h"
 #include "settings.h"
+#include "dfs_policy.h"
+#include "usage_accounting.h"
+#include "init_scheduler.h"
+#include "i2c_device.h"
+#include "heap_placement.h"
+#include "heap_monitor.h"
+#include "quality_governor.h"
+#include "wake_word_arbiter.h"
+#include "task_factory.h"
+#include "trace.h"
+#include "deferred_log.h"
+#include "lvgl_glyph_cache.h"
+#if CONFIG_USE_DNS_PREFETCH
+#include "dns_prefetch.h"
+#endif
+#if CONFIG_USE_AUDIO_INJECTION
+#include "audio_injection.h"
+#endif
 
 #include <cstring>
 #include <esp_log.h>
@@ -16,9 +34,37 @@
 #include <driver/gpio.h>
 #include <arpa/inet.h>
 #include <font_awesome.h>
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <time.h>
+#endif
 
 #define TAG "Application"
 
+// Time the main task spends on UI and background callbacks in one round of events
+#define MAIN_TASK_BUDGET_US (20 * 1000)
+// The status bar clock can tick this late to share a wakeup with the other timers
+#define CLOCK_TICK_SLACK_US (100 * 1000)
+
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+#define RESUME_STATE_MAGIC 0x52534d31
+
+// In RTC memory, kept through deep sleep and lost on a reset or power cycle. The system time keeps
+// running on the RTC timer while asleep, so it stays valid too.
+struct ResumeState {
+    uint32_t magic;                 // Set once the device went idle, a resume needs a finished session
+    bool has_server_time;
+    time_t version_checked_at;      // System time of the last successful version check
+};
+RTC_DATA_ATTR static ResumeState resume_state;
+
+static void RecordVersionCheck(bool has_server_time) {
+    resume_state.has_server_time = has_server_time;
+    resume_state.version_checked_at = time(nullptr);
+}
+#endif
+
 
 Application::Application() {
     event_group_ = xEventGroupCreate();
@@ -33,24 +79,21 @@ Application::Application() {
     aec_mode_ = kAecOff;
 #endif
 
-    esp_timer_create_args_t clock_timer_args = {
-        .callback = [](void* arg) {
-            Application* app = (Application*)arg;
-            xEventGroupSetBits(app->event_group_, MAIN_EVENT_CLOCK_TICK);
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "clock_timer",
-        .skip_unhandled_events = true
-    };
-    esp_timer_create(&clock_timer_args, &clock_timer_handle_);
+    clock_timer_handle_ = TimerWheel::GetInstance().Create("clock_timer", [this]() {
+        xEventGroupSetBits(event_group_, MAIN_EVENT_CLOCK_TICK);
+    });
+#if CONFIG_USE_BARGE_IN
+    barge_in_timer_handle_ = TimerWheel::GetInstance().Create("barge_in_timer", [this]() {
+        Schedule([this]() {
+            HandleBargeIn();
+        }, kTaskPriorityAudio);
+    });
+#endif
 }
 
 Application::~Application() {
-    if (clock_timer_handle_ != nullptr) {
-        esp_timer_stop(clock_timer_handle_);
-        esp_timer_delete(clock_timer_handle_);
-    }
+    TimerWheel::GetInstance().Delete(clock_timer_handle_);
+    TimerWheel::GetInstance().Delete(barge_in_timer_handle_);
     vEventGroupDelete(event_group_);
 }
 
@@ -59,107 +102,215 @@ bool Application::SetDeviceState(DeviceState state) {
 }
 
 void Application::Initialize() {
+    Trace::Start();
+    DeferredLog::Start();
+    HeapMonitor::GetInstance().Start();
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+    resumed_ = esp_reset_reason() == ESP_RST_DEEPSLEEP && resume_state.magic == RESUME_STATE_MAGIC;
+    if (resumed_) {
+        ESP_LOGI(TAG, "Resuming from deep sleep");
+    }
+#endif
     auto& board = Board::GetInstance();
     SetDeviceState(kDeviceStateStarting);
 
-    // Setup the display
+    // Add state change listeners before any step can change the state
+    state_machine_.AddStateChangeListener([this](DeviceState old_state, DeviceState new_state) {
+        xEventGroupSetBits(event_group_, MAIN_EVENT_STATE_CHANGED);
+    });
+#if CONFIG_USE_DFS_POLICY
+    DfsPolicy::GetInstance().Start(state_machine_);
+#endif
+#if CONFIG_USE_USAGE_ACCOUNTING
+    UsageAccounting::GetInstance().Start(state_machine_);
+#endif
+#if CONFIG_USE_AUDIO_INJECTION
+    AudioInjection::GetInstance().Start(state_machine_);
+#endif
+
+    // The steps touch different peripherals, so they run side by side. The network starts as soon
+    // as the UI can show its notifications, and the WiFi scan overlaps the audio bring-up.
     auto display = board.GetDisplay();
-    display->SetupUI();
-    // Print board name/version info
-    display->SetChatMessage("system", SystemInfo::GetUserAgent().c_str());
+    InitScheduler init;
+    init.Add("init_display", [display]() {
+        // Setup the display
+        display->SetupUI();
+        // Print board name/version info
+        display->SetChatMessage("system", SystemInfo::GetUserAgent().c_str());
+    });
+    init.Add("init_audio", [this, &board]() {
+        // Setup the audio service
+        auto codec = board.GetAudioCodec();
+        audio_service_.Initialize(codec);
+        audio_service_.Start();
+#if CONFIG_USE_TASK_LATENCY_PROBE
+        TaskFactory::StartLatencyProbe();
+#endif
+        // Keep the UI feedback sounds decoded, so they play without decoder latency
+        audio_service_.PreloadSound(Lang::Sounds::OGG_POPUP);
+        audio_service_.PreloadSound(Lang::Sounds::OGG_SUCCESS);
+        audio_service_.PreloadSound(Lang::Sounds::OGG_VIBRATION);
+#if CONFIG_USE_TTS_CACHE
+        tts_cache_.Initialize();
+#endif
+#if CONFIG_USE_VOICE_MEMO
+        voice_memo_.Initialize();
+#endif
+    });
+    init.Add("init_mcp", []() {
+        // Add MCP common tools (only once during initialization)
+        auto& mcp_server = McpServer::GetInstance();
+        mcp_server.AddCommonTools();
+        mcp_server.AddUserOnlyTools();
+        // Some tools are only offered when the audio service found the hardware for them
+    }, {"init_audio"});
+    init.Add("init_network", [this, &board]() {
+        // Set network event callback for UI updates and network state handling
+        board.SetNetworkEventCallback([this](NetworkEvent event, const std::string& data) {
+            HandleNetworkEvent(event, data);
+        });
+        // Start network asynchronously
+        board.StartNetwork();
+#if CONFIG_USE_ACOUSTIC_WIFI_PROVISIONING
+    }, {"init_display", "init_audio"});
+#else
+    }, {"init_display"});
+#endif
+    init.Run();
 
-    // Setup the audio service
-    auto codec = board.GetAudioCodec();
-    audio_service_.Initialize(codec);
-    audio_service_.Start();
+    // Uplink audio is sent from its own task, so slow main loop work does not hold it back
+    audio_sender_task_handle_ = TaskFactory::Create("audio_sender", kTaskStackInternal, [this]() {
+        AudioSenderTask();
+    });
 
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+        if (preroll_active_) {
+            return;
+        }
+#endif
+        xTaskNotifyGive(audio_sender_task_handle_);
     };
     callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
     };
+    callbacks.on_command_detected = [this](const std::string& tool, const std::string& arguments) {
+        // Offline commands are handled on the device, without opening a session
+        Schedule([this, tool, arguments]() {
+            bool ok = McpServer::GetInstance().CallLocalTool(tool, arguments);
+            audio_service_.PlaySound(ok ? Lang::Sounds::OGG_POPUP : Lang::Sounds::OGG_EXCLAMATION);
+        }, kTaskPriorityAudio);
+    };
     callbacks.on_vad_change = [this](bool speaking) {
+#if CONFIG_USE_BARGE_IN
+        // Voice that lasts while the device speaks interrupts it
+        if (speaking && GetDeviceState() == kDeviceStateSpeaking && aec_mode_ == kAecOnDeviceSide) {
+            TimerWheel::GetInstance().StartOnce(barge_in_timer_handle_, CONFIG_BARGE_IN_MIN_SPEECH_MS * 1000);
+        } else if (!speaking) {
+            TimerWheel::GetInstance().Stop(barge_in_timer_handle_);
+        }
+#endif
         xEventGroupSetBits(event_group_, MAIN_EVENT_VAD_CHANGE);
     };
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+    callbacks.on_end_of_speech = [this]() {
+        Schedule([this]() {
+            if (GetDeviceState() == kDeviceStateListening && listening_mode_ == kListeningModeAutoStop && protocol_) {
+                // The uplink already stopped, the reply comes as usual
+                ESP_LOGI(TAG, "End of speech, stop listening");
+                protocol_->SendStopListening();
+            }
+        }, kTaskPriorityAudio);
+    };
+    EndOfSpeechConfig end_of_speech_config;
+    end_of_speech_config.hangover_ms = CONFIG_END_OF_SPEECH_HANGOVER_MS;
+    end_of_speech_config.min_speech_ms = CONFIG_END_OF_SPEECH_MIN_SPEECH_MS;
+    audio_service_.SetEndOfSpeechConfig(end_of_speech_config);
+#endif
+#if CONFIG_USE_VOICE_MEMO
+    callbacks.on_voice_memo_packet = [this](const AudioStreamPacket& packet) {
+        voice_memo_.Append(packet);
+    };
+#endif
     audio_service_.SetCallbacks(callbacks);
 
-    // Add state change listeners
-    state_machine_.AddStateChangeListener([this](DeviceState old_state, DeviceState new_state) {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_STATE_CHANGED);
-    });
-
     // Start the clock timer to update the status bar
-    esp_timer_start_periodic(clock_timer_handle_, 1000000);
+    TimerWheel::GetInstance().StartPeriodic(clock_timer_handle_, 1000000, CLOCK_TICK_SLACK_US);
 
-    // Add MCP common tools (only once during initialization)
-    auto& mcp_server = McpServer::GetInstance();
-    mcp_server.AddCommonTools();
-    mcp_server.AddUserOnlyTools();
+    // Update the status bar immediately to show the network state
+    display->UpdateStatusBar(true);
+}
 
-    // Set network event callback for UI updates and network state handling
-    board.SetNetworkEventCallback([this](NetworkEvent event, const std::string& data) {
-        auto display = Board::GetInstance().GetDisplay();
-        
-        switch (event) {
-            case NetworkEvent::Scanning:
-                display->ShowNotification(Lang::Strings::SCANNING_WIFI, 30000);
-                xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_DISCONNECTED);
-                break;
-            case NetworkEvent::Connecting: {
-                if (data.empty()) {
-                    // Cellular network - registering without carrier info yet
-                    display->SetStatus(Lang::Strings::REGISTERING_NETWORK);
-                } else {
-                    // WiFi or cellular with carrier info
-                    std::string msg = Lang::Strings::CONNECT_TO;
-                    msg += data;
-                    msg += "...";
-                    display->ShowNotification(msg.c_str(), 30000);
-                }
-                break;
-            }
-            case NetworkEvent::Connected: {
-                std::string msg = Lang::Strings::CONNECTED_TO;
+void Application::HandleNetworkEvent(NetworkEvent event, const std::string& data) {
+    auto display = Board::GetInstance().GetDisplay();
+    
+    switch (event) {
+        case NetworkEvent::Scanning:
+            display->ShowNotification(Lang::Strings::SCANNING_WIFI, 30000);
+            xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_DISCONNECTED);
+            break;
+        case NetworkEvent::Connecting: {
+            if (data.empty()) {
+                // Cellular network - registering without carrier info yet
+                display->SetStatus(Lang::Strings::REGISTERING_NETWORK);
+            } else {
+                // WiFi or cellular with carrier info
+                std::string msg = Lang::Strings::CONNECT_TO;
                 msg += data;
+                msg += "...";
                 display->ShowNotification(msg.c_str(), 30000);
-                xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_CONNECTED);
-                break;
             }
-            case NetworkEvent::Disconnected:
-                xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_DISCONNECTED);
-                break;
-            case NetworkEvent::WifiConfigModeEnter:
-                // WiFi config mode enter is handled by WifiBoard internally
-                break;
-            case NetworkEvent::WifiConfigModeExit:
-                // WiFi config mode exit is handled by WifiBoard internally
-                break;
-            // Cellular modem specific events
-            case NetworkEvent::ModemDetecting:
-                display->SetStatus(Lang::Strings::DETECTING_MODULE);
-                break;
-            case NetworkEvent::ModemErrorNoSim:
+            break;
+        }
+        case NetworkEvent::Connected: {
+            std::string msg = Lang::Strings::CONNECTED_TO;
+            msg += data;
+            display->ShowNotification(msg.c_str(), 30000);
+            audio_service_.StartAudioDebugger();
+            xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_CONNECTED);
+            break;
+        }
+        case NetworkEvent::Disconnected:
+            xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_DISCONNECTED);
+            break;
+        case NetworkEvent::Switched: {
+            std::string msg = Lang::Strings::CONNECTED_TO;
+            msg += data;
+            display->ShowNotification(msg.c_str(), 30000);
+            xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_CONNECTED | MAIN_EVENT_NETWORK_SWITCHED);
+            break;
+        }
+        case NetworkEvent::WifiConfigModeEnter:
+            // WiFi config mode enter is handled by WifiBoard internally
+            break;
+        case NetworkEvent::WifiConfigModeExit:
+            // WiFi config mode exit is handled by WifiBoard internally
+            break;
+        // Cellular modem specific events. The alerts play a sound, so they run on the main loop,
+        // which starts after the audio service is up even when the modem fails during bring-up.
+        case NetworkEvent::ModemDetecting:
+            display->SetStatus(Lang::Strings::DETECTING_MODULE);
+            break;
+        case NetworkEvent::ModemErrorNoSim:
+            Schedule([this]() {
                 Alert(Lang::Strings::ERROR, Lang::Strings::PIN_ERROR, "triangle_exclamation", Lang::Sounds::OGG_ERR_PIN);
-                break;
-            case NetworkEvent::ModemErrorRegDenied:
+            });
+            break;
+        case NetworkEvent::ModemErrorRegDenied:
+            Schedule([this]() {
                 Alert(Lang::Strings::ERROR, Lang::Strings::REG_ERROR, "triangle_exclamation", Lang::Sounds::OGG_ERR_REG);
-                break;
-            case NetworkEvent::ModemErrorInitFailed:
+            });
+            break;
+        case NetworkEvent::ModemErrorInitFailed:
+            Schedule([this]() {
                 Alert(Lang::Strings::ERROR, Lang::Strings::MODEM_INIT_ERROR, "triangle_exclamation", Lang::Sounds::OGG_EXCLAMATION);
-                break;
-            case NetworkEvent::ModemErrorTimeout:
-                display->SetStatus(Lang::Strings::REGISTERING_NETWORK);
-                break;
-        }
-    });
-
-    // Start network asynchronously
-    board.StartNetwork();
-
-    // Update the status bar immediately to show the network state
-    display->UpdateStatusBar(true);
+            });
+            break;
+        case NetworkEvent::ModemErrorTimeout:
+            display->SetStatus(Lang::Strings::REGISTERING_NETWORK);
+            break;
+    }
 }
 
 void Application::Run() {
@@ -168,13 +319,13 @@ void Application::Run() {
 
     const EventBits_t ALL_EVENTS = 
         MAIN_EVENT_SCHEDULE |
-        MAIN_EVENT_SEND_AUDIO |
         MAIN_EVENT_WAKE_WORD_DETECTED |
         MAIN_EVENT_VAD_CHANGE |
         MAIN_EVENT_CLOCK_TICK |
         MAIN_EVENT_ERROR |
         MAIN_EVENT_NETWORK_CONNECTED |
         MAIN_EVENT_NETWORK_DISCONNECTED |
+        MAIN_EVENT_NETWORK_SWITCHED |
         MAIN_EVENT_TOGGLE_CHAT |
         MAIN_EVENT_START_LISTENING |
         MAIN_EVENT_STOP_LISTENING |
@@ -197,6 +348,10 @@ void Application::Run() {
             HandleNetworkDisconnectedEvent();
         }
 
+        if (bits & MAIN_EVENT_NETWORK_SWITCHED) {
+            HandleNetworkSwitchedEvent();
+        }
+
         if (bits & MAIN_EVENT_ACTIVATION_DONE) {
             HandleActivationDoneEvent();
         }
@@ -217,14 +372,6 @@ void Application::Run() {
             HandleStopListeningEvent();
         }
 
-        if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (protocol_ && !protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
-        }
-
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
             HandleWakeWordDetectedEvent();
         }
@@ -237,27 +384,169 @@ void Application::Run() {
         }
 
         if (bits & MAIN_EVENT_SCHEDULE) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            auto tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
+            // Leftovers run in the next round, after the events that came in meanwhile
+            if (main_tasks_.RunPending(MAIN_TASK_BUDGET_US)) {
+                xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
             }
         }
 
         if (bits & MAIN_EVENT_CLOCK_TICK) {
             clock_ticks_++;
+            HeapMonitor::GetInstance().Check();
+#if CONFIG_USE_QUALITY_GOVERNOR
+            QualityGovernor::GetInstance().Check();
+#endif
             auto display = Board::GetInstance().GetDisplay();
             display->UpdateStatusBar();
+            if (protocol_) {
+                protocol_->KeepAlive();
+            }
+
+            // The modem answers the signal query over AT commands, so it is only asked every 10 seconds
+            if (clock_ticks_ % 10 == 1) {
+                signal_strength_ = Board::GetInstance().GetSignalStrength();
+            }
+            network_quality_.Update(audio_service_.GetDebugStatistics().jitter_buffer.jitter_ms, signal_strength_);
+            audio_service_.SetPoorNetwork(network_quality_.GetScore() < NETWORK_QUALITY_POOR_SCORE);
+#if CONFIG_USE_VOICE_MEMO
+            if (voice_memo_.recording() && voice_memo_.recorded_ms() >= CONFIG_VOICE_MEMO_MAX_SECONDS * 1000) {
+                StopVoiceMemo();
+            }
+            // Memos go out in batches while the device has nothing else to do on a good network
+            if (clock_ticks_ % VOICE_MEMO_UPLOAD_INTERVAL_S == 0 && protocol_ && GetDeviceState() == kDeviceStateIdle &&
+                !voice_memo_.recording() && network_quality_.GetScore() >= VOICE_MEMO_UPLOAD_MIN_SCORE) {
+                voice_memo_.StartUpload(CONFIG_VOICE_MEMO_UPLOAD_URL);
+            }
+#endif
         
             // Print debug info every 10 seconds
             if (clock_ticks_ % 10 == 0) {
                 SystemInfo::PrintHeapStats();
+                auto stats = audio_service_.GetDebugStatistics();
+                ESP_LOGI(TAG, "Audio pool hits: %lu, misses: %lu, deadline misses: encode %lu, decode %lu",
+                    stats.pool_hits, stats.pool_misses, stats.encode_deadline_misses, stats.decode_deadline_misses);
+                ESP_LOGI(TAG, "Jitter buffer depth: %lu/%lu, jitter: %lu ms, underruns: %lu, late: %lu, reordered: %lu",
+                    stats.jitter_buffer.depth, stats.jitter_buffer.target_depth, stats.jitter_buffer.jitter_ms,
+                    stats.jitter_buffer.underruns, stats.jitter_buffer.late_packets, stats.jitter_buffer.reordered_packets);
+                ESP_LOGI(TAG, "Send queue depth: %lu, stale drops: %lu, congested: %d, limited output: %lu ms",
+                    stats.send_queue_depth, stats.stale_send_drops, stats.uplink_congested, stats.limited_output_ms);
+                ESP_LOGI(TAG, "Audio input stalls: %lu, max gap: %lu ms, hot path cycles: %lu (min %lu, max %lu)",
+                    stats.input_stalls, stats.input_max_gap_ms, stats.input_cycles, stats.input_cycles_min, stats.input_cycles_max);
+                auto quality = network_quality_.GetStatistics();
+                ESP_LOGI(TAG, "Network quality: %d, rtt: %d ms, loss: %d%%, jitter: %d ms, signal: %d",
+                    quality.score, quality.rtt_ms, quality.loss_percent, quality.jitter_ms, quality.signal);
+#if CONFIG_USE_AUDIO_LATENCY_STATS
+                audio_service_.GetLatencyStats().Log(TAG);
+#endif
+                if (clock_ticks_ % 60 == 0) {
+                    HeapPlacement::PrintReport();
+                    HeapMonitor::GetInstance().PrintReport();
+                    TaskFactory::PrintReport();
+                    I2cDevice::PrintStatistics();
+#if CONFIG_USE_USAGE_ACCOUNTING
+                    UsageAccounting::GetInstance().PrintReport();
+#endif
+#if CONFIG_GLYPH_CACHE_SIZE_KB > 0
+                    LvglGlyphCache::GetInstance().PrintStatistics();
+#endif
+                }
+            }
+        }
+    }
+}
+
+void Application::AudioSenderTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Held while sending, so the protocol is not reset under us
+        std::lock_guard<std::mutex> lock(protocol_mutex_);
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+        if (preroll_active_) {
+            continue;
+        }
+#endif
+        SendQueuedAudio();
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+        // The stop of a press released early goes out after the captured speech
+        if (preroll_stop_after_send_.exchange(false)) {
+            StopListening();
+        }
+#endif
+    }
+}
+
+void Application::SendQueuedAudio() {
+    if (protocol_ && protocol_->audio_batch_enabled()) {
+        // After a stall the backlog goes out in batches so the queue catches up fast
+        auto& batch = send_batch_;
+        while (true) {
+            while (batch.size() < AUDIO_BATCH_MAX_PACKETS) {
+                auto packet = audio_service_.PopPacketFromSendQueue();
+                if (packet == nullptr) {
+                    break;
+                }
+                batch.push_back(std::move(packet));
+            }
+            if (batch.empty()) {
+                break;
+            }
+            int64_t send_start = esp_timer_get_time();
+            if (!protocol_->SendAudioBatch(batch)) {
+                break;
+            }
+            audio_service_.GetLatencyStats().Record(kAudioLatencySend, esp_timer_get_time() - send_start);
+        }
+    } else {
+        while (auto packet = audio_service_.PopPacketFromSendQueue()) {
+            if (!protocol_) {
+                audio_service_.ReleasePacket(std::move(packet));
+                continue;
+            }
+            int64_t send_start = esp_timer_get_time();
+            if (!protocol_->SendAudio(std::move(packet))) {
+                break;
             }
+            audio_service_.GetLatencyStats().Record(kAudioLatencySend, esp_timer_get_time() - send_start);
         }
     }
 }
 
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+void Application::StartPreroll() {
+    // The AFE warms up while the channel opens, and the encoded speech waits in the send queue.
+    // Once that is full the encoder waits, and the capture after it is dropped.
+    audio_service_.SetSendQueueMaxAge(0);
+    preroll_stop_pending_ = false;
+    preroll_active_ = true;
+    audio_service_.EnableVoiceProcessing(true);
+}
+
+void Application::FlushPreroll() {
+    // Up to a few seconds of audio, the sender task sends it so the main loop is not held up
+    if (preroll_stop_pending_) {
+        preroll_stop_pending_ = false;
+        preroll_stop_after_send_ = true;
+    }
+    preroll_active_ = false;
+    xTaskNotifyGive(audio_sender_task_handle_);
+}
+
+void Application::DiscardPreroll() {
+    if (!preroll_active_) {
+        return;
+    }
+    ESP_LOGW(TAG, "Audio channel did not open, dropping the captured audio");
+    std::lock_guard<std::mutex> lock(protocol_mutex_);
+    preroll_active_ = false;
+    preroll_stop_pending_ = false;
+    preroll_stop_after_send_ = false;
+    while (auto packet = audio_service_.PopPacketFromSendQueue()) {
+        audio_service_.ReleasePacket(std::move(packet));
+    }
+}
+#endif
+
 void Application::HandleNetworkConnectedEvent() {
     ESP_LOGI(TAG, "Network connected");
     auto state = GetDeviceState();
@@ -270,13 +559,19 @@ void Application::HandleNetworkConnectedEvent() {
             return;
         }
 
-        xTaskCreate([](void* arg) {
-            Application* app = static_cast<Application*>(arg);
-            app->ActivationTask();
-            app->activation_task_handle_ = nullptr;
-            vTaskDelete(NULL);
-        }, "activation", 4096 * 2, this, 2, &activation_task_handle_);
+        // Activation saves to NVS, which needs an internal stack
+        activation_task_handle_ = TaskFactory::Create("activation", kTaskStackInternal, [this]() {
+            ActivationTask();
+            activation_task_handle_ = nullptr;
+        });
+    }
+
+#if CONFIG_USE_WAKE_WORD_ARBITRATION
+    // ESP-NOW needs the Wi-Fi station, cellular boards answer every wake word themselves
+    if (Board::GetInstance().GetBoardType() == "wifi") {
+        WakeWordArbiter::GetInstance().Start();
     }
+#endif
 
     // Update the status bar immediately to show the network state
     auto display = Board::GetInstance().GetDisplay();
@@ -296,23 +591,62 @@ void Application::HandleNetworkDisconnectedEvent() {
     display->UpdateStatusBar(true);
 }
 
+void Application::HandleNetworkSwitchedEvent() {
+    if (!protocol_) {
+        return;
+    }
+
+    // The connections went down with the old interface, carry the conversation over to the new one
+    auto state = GetDeviceState();
+    bool in_conversation = state == kDeviceStateConnecting || state == kDeviceStateListening || state == kDeviceStateSpeaking;
+    if (in_conversation) {
+        ESP_LOGI(TAG, "Network switched, reopening the audio channel");
+        protocol_->CloseAudioChannel(false);
+    }
+    protocol_->ResetConnection();
+
+    if (in_conversation) {
+        auto mode = listening_mode_;
+        // Runs after the close above has brought the device back to idle
+        Schedule([this, mode]() {
+            if (GetDeviceState() != kDeviceStateIdle) {
+                return;
+            }
+            SetDeviceState(kDeviceStateConnecting);
+            ContinueOpenAudioChannel(mode);
+        });
+    }
+}
+
 void Application::HandleActivationDoneEvent() {
-    ESP_LOGI(TAG, "Activation done");
+    ESP_LOGI(TAG, "Activation done, ready %lld ms after boot", esp_timer_get_time() / 1000);
 
     SystemInfo::PrintHeapStats();
+    // The assets have set the models list by now, entering idle below only asks for the wake word
+    audio_service_.PreloadModels();
     SetDeviceState(kDeviceStateIdle);
 
     has_server_time_ = ota_->HasServerTime();
 
     auto display = Board::GetInstance().GetDisplay();
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+    resume_state.magic = RESUME_STATE_MAGIC;
+    if (resumed_) {
+        // The session goes on where it stopped, without the version banner and the ready sound
+        has_server_time_ = has_server_time_ || resume_state.has_server_time;
+        display->SetChatMessage("system", "");
+        ota_.reset();
+        UpdatePowerSaveLevel();
+        return;
+    }
+#endif
     std::string message = std::string(Lang::Strings::VERSION) + ota_->GetCurrentVersion();
     display->ShowNotification(message.c_str());
     display->SetChatMessage("system", "");
 
     // Release OTA object after activation is complete
     ota_.reset();
-    auto& board = Board::GetInstance();
-    board.SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
+    UpdatePowerSaveLevel();
 
     Schedule([this]() {
         // Play the success sound to indicate the device is ready
@@ -323,12 +657,40 @@ void Application::HandleActivationDoneEvent() {
 void Application::ActivationTask() {
     // Create OTA object for activation process
     ota_ = std::make_unique<Ota>();
+#if CONFIG_USE_DNS_PREFETCH
+    PrefetchServerAddresses();
+#endif
+
+#if CONFIG_USE_FAST_BOOT
+    if (HasFastBootCache()) {
+        ESP_LOGI(TAG, "Fast boot with the cached %s config, checking the version in the background", fast_boot_protocol_.c_str());
+        CheckAssetsVersion();
+        InitializeProtocol();
+        xEventGroupSetBits(event_group_, MAIN_EVENT_ACTIVATION_DONE);
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+        time_t since_check = time(nullptr) - resume_state.version_checked_at;
+        if (resumed_ && since_check >= 0 && since_check < CONFIG_DEEP_SLEEP_RESUME_CHECK_INTERVAL * 60) {
+            ESP_LOGI(TAG, "Version checked %lld s ago, not checking again", (long long)since_check);
+            return;
+        }
+#endif
+        CheckNewVersionInBackground();
+        return;
+    }
+#endif
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+    // The full path shows its progress, it ends like a cold boot
+    resumed_ = false;
+#endif
 
     // Check for new assets version
     CheckAssetsVersion();
 
     // Check for new firmware version
     CheckNewVersion();
+#if CONFIG_USE_FAST_BOOT
+    UpdateFastBootCache(*ota_);
+#endif
 
     // Initialize the protocol
     InitializeProtocol();
@@ -337,6 +699,127 @@ void Application::ActivationTask() {
     xEventGroupSetBits(event_group_, MAIN_EVENT_ACTIVATION_DONE);
 }
 
+#if CONFIG_USE_DNS_PREFETCH
+// The endpoints of the last activation, the version check that may change them runs meanwhile
+void Application::PrefetchServerAddresses() {
+    auto board_type = Board::GetInstance().GetBoardType();
+#if CONFIG_ML307_PPP_MODE
+    bool lwip_sockets = board_type == "wifi" || board_type == "ml307";
+#else
+    bool lwip_sockets = board_type == "wifi";
+#endif
+    if (!lwip_sockets) {
+        return;
+    }
+    DnsPrefetch::Start({
+        Settings("websocket", false).GetString("url"),
+        Settings("mqtt", false).GetString("endpoint"),
+        Settings("assets", false).GetString("download_url"),
+    });
+}
+#endif
+
+#if CONFIG_USE_FAST_BOOT
+// The device was activated by this firmware before and the protocol config is still in the settings
+bool Application::HasFastBootCache() {
+    Settings settings("fast_boot", false);
+    // The first boot of a new firmware goes the full way, so it is checked and marked valid before anything else
+    if (settings.GetString("version") != ota_->GetCurrentVersion()) {
+        return false;
+    }
+    // An assets download is pending, it shows progress and must run before the UI is used, unless it goes to the other slot
+    if (!Assets::GetInstance().dual_slot() && !Settings("assets", false).GetString("download_url").empty()) {
+        return false;
+    }
+    fast_boot_protocol_ = settings.GetString("protocol");
+    if (fast_boot_protocol_ == "mqtt") {
+        return !Settings("mqtt", false).GetString("endpoint").empty();
+    } else if (fast_boot_protocol_ == "websocket") {
+        return !Settings("websocket", false).GetString("url").empty();
+    }
+    return false;
+}
+
+void Application::UpdateFastBootCache(Ota& ota) {
+    if (!ota.HasMqttConfig() && !ota.HasWebsocketConfig()) {
+        // The check failed, keep what the last one found
+        return;
+    }
+    Settings settings("fast_boot", true);
+    if (ota.HasActivationCode() || ota.HasActivationChallenge()) {
+        settings.EraseKey("version");
+        return;
+    }
+    // Same preference as InitializeProtocol()
+    std::string protocol = ota.HasMqttConfig() ? "mqtt" : "websocket";
+    std::string cached = settings.GetString("protocol");
+    if (cached != protocol) {
+        if (!cached.empty()) {
+            ESP_LOGI(TAG, "Server moved from %s to %s, effective on the next boot", cached.c_str(), protocol.c_str());
+        }
+        settings.SetString("protocol", protocol);
+    }
+    if (settings.GetString("version") != ota.GetCurrentVersion()) {
+        settings.SetString("version", ota.GetCurrentVersion());
+    }
+}
+
+// CheckNewVersion() without the status, alerts and activation UI, the device is already idle and usable.
+// Upgrades and reboots wait for the device to be idle, so they never cut into a conversation.
+void Application::CheckNewVersionInBackground() {
+    const int MAX_RETRY = 10;
+    int retry_delay = 10; // Initial retry delay in seconds
+
+    auto wait_for_idle = [this]() {
+        while (GetDeviceState() != kDeviceStateIdle) {
+            vTaskDelay(pdMS_TO_TICKS(1000));
+        }
+    };
+
+    auto ota = std::make_unique<Ota>();
+    for (int retry_count = 1; ; retry_count++) {
+        esp_err_t err = ota->CheckVersion();
+        if (err == ESP_OK) {
+            break;
+        }
+        if (retry_count >= MAX_RETRY) {
+            ESP_LOGE(TAG, "Too many retries, exit background version check");
+            return;
+        }
+        ESP_LOGW(TAG, "Background version check failed, code=%d, retry in %d seconds (%d/%d)", err, retry_delay, retry_count, MAX_RETRY);
+        vTaskDelay(pdMS_TO_TICKS(retry_delay * 1000));
+        retry_delay *= 2; // Double the retry delay
+    }
+
+    Schedule([this, has_server_time = ota->HasServerTime()]() {
+        has_server_time_ = has_server_time;
+    });
+    UpdateFastBootCache(*ota);
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+    RecordVersionCheck(ota->HasServerTime());
+#endif
+
+    if (ota->HasActivationCode() || ota->HasActivationChallenge()) {
+        ESP_LOGW(TAG, "The server asks for activation, rebooting into the full activation");
+        wait_for_idle();
+        Schedule([this]() {
+            Reboot();
+        });
+        return;
+    }
+
+    if (ota->HasNewVersion()) {
+        wait_for_idle();
+        if (UpgradeFirmware(ota->GetFirmwareUrl(), ota->GetFirmwareVersion(), ota->GetFirmwarePatchUrl(),
+                ota->GetFirmwareSha256())) {
+            return; // This line will never be reached after reboot
+        }
+        SetDeviceState(kDeviceStateIdle);
+    }
+    ota->MarkCurrentVersionValid();
+}
+#endif
+
 void Application::CheckAssetsVersion() {
     // Only allow CheckAssetsVersion to be called once
     if (assets_version_checked_) {
@@ -357,6 +840,15 @@ void Application::CheckAssetsVersion() {
     // Check if there is a new assets need to be downloaded
     std::string download_url = settings.GetString("download_url");
 
+    if (!download_url.empty() && assets.dual_slot()) {
+        // The device starts on the slot in use and the other one is written in the background
+        assets.Apply();
+        display->SetChatMessage("system", "");
+        display->SetEmotion("microchip_ai");
+        UpdateAssetsInBackground(download_url);
+        return;
+    }
+
     if (!download_url.empty()) {
         settings.EraseKey("download_url");
 
@@ -367,8 +859,12 @@ void Application::CheckAssetsVersion() {
         // Wait for the audio service to be idle for 3 seconds
         vTaskDelay(pdMS_TO_TICKS(3000));
         SetDeviceState(kDeviceStateUpgrading);
-        board.SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
+        SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
         display->SetChatMessage("system", Lang::Strings::PLEASE_WAIT);
+#if CONFIG_LANG_SOUNDS_IN_ASSETS
+        // The sounds are read from the partition that is about to be rewritten
+        audio_service_.ForgetSounds();
+#endif
 
         bool success = assets.Download(download_url, [this, display](int progress, size_t speed) -> void {
             char buffer[32];
@@ -378,7 +874,7 @@ void Application::CheckAssetsVersion() {
             });
         });
 
-        board.SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
+        SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
         vTaskDelay(pdMS_TO_TICKS(1000));
 
         if (!success) {
@@ -395,6 +891,35 @@ void Application::CheckAssetsVersion() {
     display->SetEmotion("microchip_ai");
 }
 
+// The url stays set until the download ends, a reboot before then resumes it from the checkpoint
+void Application::UpdateAssetsInBackground(const std::string& url) {
+    TaskFactory::Create("assets_update", 4096 * 2, 1, kTaskStackInternal, [this, url]() {
+        auto& assets = Assets::GetInstance();
+        bool success = assets.Download(url, nullptr);
+        {
+            Settings settings("assets", true);
+            settings.EraseKey("download_url");
+        }
+        if (!success) {
+            ESP_LOGE(TAG, "Background assets update failed, keeping the current assets");
+            return;
+        }
+
+        // Themes and sounds change between conversations
+        while (GetDeviceState() != kDeviceStateIdle) {
+            vTaskDelay(pdMS_TO_TICKS(1000));
+        }
+        // On the main task, which owns the UI, instead of this one
+        Schedule([this]() {
+#if CONFIG_LANG_SOUNDS_IN_ASSETS
+            audio_service_.ForgetSounds();
+#endif
+            Assets::GetInstance().Apply();
+            ESP_LOGI(TAG, "Assets updated without a reboot");
+        });
+    });
+}
+
 void Application::CheckNewVersion() {
     const int MAX_RETRY = 10;
     int retry_count = 0;
@@ -431,9 +956,13 @@ void Application::CheckNewVersion() {
         }
         retry_count = 0;
         retry_delay = 10; // Reset retry delay
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+        RecordVersionCheck(ota_->HasServerTime());
+#endif
 
         if (ota_->HasNewVersion()) {
-            if (UpgradeFirmware(ota_->GetFirmwareUrl(), ota_->GetFirmwareVersion())) {
+            if (UpgradeFirmware(ota_->GetFirmwareUrl(), ota_->GetFirmwareVersion(), ota_->GetFirmwarePatchUrl(),
+                    ota_->GetFirmwareSha256())) {
                 return; // This line will never be reached after reboot
             }
             // If upgrade failed, continue to normal operation
@@ -470,6 +999,76 @@ void Application::CheckNewVersion() {
     }
 }
 
+static const char* GetPowerSaveLevelName(PowerSaveLevel level) {
+    switch (level) {
+        case PowerSaveLevel::LOW_POWER:
+            return "low power";
+        case PowerSaveLevel::BALANCED:
+            return "balanced";
+        default:
+            return "performance";
+    }
+}
+
+void Application::SetPowerSaveLevel(PowerSaveLevel level) {
+    std::lock_guard<std::mutex> lock(power_save_mutex_);
+    if (power_save_level_set_ && level == power_save_level_) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (power_save_level_set_) {
+        int64_t elapsed = now - power_save_level_since_us_;
+        power_save_residency_us_[static_cast<int>(power_save_level_)] += elapsed;
+        // Multiply the residency by the measured currents of each level to estimate the average draw
+        auto quality = network_quality_.GetStatistics();
+        ESP_LOGI(TAG, "Power save %s -> %s after %lld ms, rtt %d ms, jitter %d ms, residency low power %lld s, performance %lld s",
+            GetPowerSaveLevelName(power_save_level_), GetPowerSaveLevelName(level), elapsed / 1000, quality.rtt_ms, quality.jitter_ms,
+            power_save_residency_us_[static_cast<int>(PowerSaveLevel::LOW_POWER)] / 1000000,
+            power_save_residency_us_[static_cast<int>(PowerSaveLevel::PERFORMANCE)] / 1000000);
+    }
+    power_save_level_set_ = true;
+    power_save_level_ = level;
+    power_save_level_since_us_ = now;
+    Board::GetInstance().SetPowerSaveLevel(level);
+}
+
+// Modem sleep holds downlink packets for up to a DTIM period, so it is off while audio can flow
+void Application::UpdatePowerSaveLevel() {
+    switch (GetDeviceState()) {
+        case kDeviceStateUnknown:
+        case kDeviceStateStarting:
+        case kDeviceStateWifiConfiguring:
+            // The network is not up yet, or it is an access point
+            return;
+        case kDeviceStateConnecting:
+        case kDeviceStateListening:
+        case kDeviceStateSpeaking:
+        case kDeviceStateUpgrading:
+            SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
+            return;
+        default:
+            break;
+    }
+    bool channel_opened = protocol_ != nullptr && protocol_->IsAudioChannelOpened();
+    SetPowerSaveLevel(channel_opened ? PowerSaveLevel::PERFORMANCE : PowerSaveLevel::LOW_POWER);
+}
+
+AudioEncoderConfig Application::GetDefaultEncoderConfig() {
+    AudioEncoderConfig config;
+    config.complexity = audio_service_.GetProfiledEncoderComplexity();
+    auto board_type = Board::GetInstance().GetBoardType();
+    if (board_type == "ml307" || board_type == "nt26") {
+        // Cellular: bigger frames and a lower bitrate save airtime
+        config.frame_duration_ms = 120;
+        config.bitrate = 16000;
+    } else if (board_type == "wifi") {
+        // Short frames for lower turn-taking latency
+        config.frame_duration_ms = 20;
+    }
+    return config;
+}
+
 void Application::InitializeProtocol() {
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
@@ -477,15 +1076,27 @@ void Application::InitializeProtocol() {
 
     display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
 
-    if (ota_->HasMqttConfig()) {
-        protocol_ = std::make_unique<MqttProtocol>();
-    } else if (ota_->HasWebsocketConfig()) {
-        protocol_ = std::make_unique<WebsocketProtocol>();
+    bool use_mqtt = ota_->HasMqttConfig();
+    bool use_websocket = ota_->HasWebsocketConfig();
+#if CONFIG_USE_FAST_BOOT
+    if (!use_mqtt && !use_websocket) {
+        // Fast boot, the OTA check runs later
+        use_mqtt = fast_boot_protocol_ == "mqtt";
+        use_websocket = fast_boot_protocol_ == "websocket";
+    }
+#endif
+
+    if (use_mqtt) {
+        SetProtocol(std::make_unique<MqttProtocol>());
+    } else if (use_websocket) {
+        SetProtocol(std::make_unique<WebsocketProtocol>());
     } else {
         ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
-        protocol_ = std::make_unique<MqttProtocol>();
+        SetProtocol(std::make_unique<MqttProtocol>());
     }
 
+    audio_service_.SetEncoderConfig(GetDefaultEncoderConfig());
+
     protocol_->OnConnected([this]() {
         DismissAlert();
     });
@@ -496,75 +1107,85 @@ void Application::InitializeProtocol() {
     });
     
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
+#if CONFIG_USE_TTS_CACHE
+        if (tts_from_cache_) {
+            audio_service_.ReleasePacket(std::move(packet));
+            return;
+        }
+        // Also the packets that beat the speaking state, so the cached response is complete
+        tts_cache_.Record(*packet);
+#endif
         if (GetDeviceState() == kDeviceStateSpeaking) {
-            audio_service_.PushPacketToDecodeQueue(std::move(packet));
+            audio_service_.PushPacketToJitterBuffer(std::move(packet));
+        } else {
+            audio_service_.ReleasePacket(std::move(packet));
         }
     });
     
-    protocol_->OnAudioChannelOpened([this, codec, &board]() {
-        board.SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
+    protocol_->OnAudioChannelOpened([this, codec]() {
+        SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
+        if (audio_service_.GetDecodeSampleRate(protocol_->server_sample_rate()) != codec->output_sample_rate()) {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
+
+        // The server hello may override the uplink encoder settings we offered
+        auto& uplink = protocol_->server_uplink_params();
+        auto encoder_config = GetDefaultEncoderConfig();
+        if (uplink.frame_duration > 0) {
+            encoder_config.frame_duration_ms = uplink.frame_duration;
+        }
+        if (uplink.bitrate > 0) {
+            encoder_config.bitrate = uplink.bitrate;
+        }
+        if (uplink.complexity >= 0) {
+            encoder_config.complexity = uplink.complexity;
+        }
+        if (encoder_config != audio_service_.GetEncoderConfig() && !audio_service_.SetEncoderConfig(encoder_config)) {
+            ESP_LOGW(TAG, "Ignoring the uplink audio params requested by the server");
+        }
     });
     
-    protocol_->OnAudioChannelClosed([this, &board]() {
-        board.SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
+    protocol_->OnAudioChannelClosed([this]() {
+        audio_service_.SetEncoderConfig(GetDefaultEncoderConfig());
+#if CONFIG_USE_TTS_CACHE
+        tts_cache_.EndRecord(false);
+        tts_cache_.StopPlayback();
+        tts_from_cache_ = false;
+#endif
         Schedule([this]() {
             auto display = Board::GetInstance().GetDisplay();
             display->SetChatMessage("system", "");
             SetDeviceState(kDeviceStateIdle);
+            // Also when the device was idle already and the state does not change
+            UpdatePowerSaveLevel();
         });
     });
     
+    protocol_->OnIncomingMessage([this](const ServerMessage& message) {
+        HandleServerMessage(message);
+    });
+
     protocol_->OnIncomingJson([this, display](const cJSON* root) {
         // Parse JSON data
         auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
-                    SetDeviceState(kDeviceStateSpeaking);
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    if (GetDeviceState() == kDeviceStateSpeaking) {
-                        if (listening_mode_ == kListeningModeManualStop) {
-                            SetDeviceState(kDeviceStateIdle);
-                        } else {
-                            SetDeviceState(kDeviceStateListening);
-                        }
-                    }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
-                    });
-                }
-            }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
-                });
-            }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([display, emotion_str = std::string(emotion->valuestring)]() {
-                    display->SetEmotion(emotion_str.c_str());
-                });
-            }
+        if (strcmp(type->valuestring, "tts") == 0 || strcmp(type->valuestring, "stt") == 0 ||
+            strcmp(type->valuestring, "llm") == 0) {
+            // Only the ones the light parser gave up on, e.g. with a field that is not a string, come this way
+            auto field = [root](const char* name) {
+                auto item = cJSON_GetObjectItem(root, name);
+                return cJSON_IsString(item) ? std::string_view(item->valuestring) : std::string_view();
+            };
+            ServerMessage message;
+            message.type = type->valuestring;
+            message.state = field("state");
+            message.text = field("text");
+            message.emotion = field("emotion");
+            message.hash = field("hash");
+            HandleServerMessage(message);
         } else if (strcmp(type->valuestring, "mcp") == 0) {
             auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
+            if (cJSON_IsObject(payload) || cJSON_IsArray(payload)) {
                 McpServer::GetInstance().ParseMessage(payload);
             }
         } else if (strcmp(type->valuestring, "system") == 0) {
@@ -592,9 +1213,13 @@ void Application::InitializeProtocol() {
 #if CONFIG_RECEIVE_CUSTOM_MESSAGE
         } else if (strcmp(type->valuestring, "custom") == 0) {
             auto payload = cJSON_GetObjectItem(root, "payload");
-            ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
             if (cJSON_IsObject(payload)) {
-                Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
+                // Printed once, the display only needs the text
+                auto json_str = cJSON_PrintUnformatted(payload);
+                std::string payload_str(json_str);
+                cJSON_free(json_str);
+                ESP_LOGI(TAG, "Received custom message: %s", payload_str.c_str());
+                Schedule([display, payload_str = std::move(payload_str)]() {
                     display->SetChatMessage("system", payload_str.c_str());
                 });
             } else {
@@ -606,15 +1231,112 @@ void Application::InitializeProtocol() {
         }
     });
     
+#if CONFIG_USE_TTS_CACHE
+    protocol_->EnableTtsCache(tts_cache_.available());
+#endif
     protocol_->Start();
 }
 
+void Application::HandleServerMessage(const ServerMessage& message) {
+    auto display = Board::GetInstance().GetDisplay();
+    if (message.type == "tts") {
+        TRACE_INSTANT(kTracePointTts, message.state == "start" ? 0 : message.state == "stop" ? 2 : 1);
+        if (message.state == "start") {
+#if CONFIG_USE_TTS_CACHE
+            // Decided here on the network task, before the first packet of the response comes in
+            std::string hash(message.hash);
+            bool cached = !hash.empty() && tts_cache_.Contains(hash);
+            tts_from_cache_ = cached;
+            tts_cache_.BeginRecord(cached ? "" : hash);
+            Schedule([this, cached, hash = std::move(hash)]() {
+                aborted_ = false;
+                tts_stop_pending_ = false;
+                SetDeviceState(kDeviceStateSpeaking);
+                if (!cached) {
+                    return;
+                }
+                // After the state change, which resets the decoder
+                if (tts_cache_.Play(hash, audio_service_, [this]() {
+                    Schedule([this]() {
+                        if (tts_stop_pending_) {
+                            tts_stop_pending_ = false;
+                            HandleTtsStop();
+                        }
+                    }, kTaskPriorityAudio);
+                })) {
+                    protocol_->SendTtsCached(hash);
+                } else {
+                    // The server keeps sending the audio, only what came meanwhile is lost
+                    tts_from_cache_ = false;
+                }
+            }, kTaskPriorityAudio);
+#else
+            Schedule([this]() {
+                aborted_ = false;
+                SetDeviceState(kDeviceStateSpeaking);
+            }, kTaskPriorityAudio);
+#endif
+        } else if (message.state == "stop") {
+            Schedule([this]() {
+#if CONFIG_USE_TTS_CACHE
+                tts_cache_.EndRecord(!aborted_);
+                if (tts_cache_.playing()) {
+                    tts_stop_pending_ = true;
+                    return;
+                }
+#endif
+                HandleTtsStop();
+            }, kTaskPriorityAudio);
+        } else if (message.state == "sentence_start" && message.text.data() != nullptr) {
+            ESP_LOGI(TAG, "<< %.*s", (int)message.text.size(), message.text.data());
+            ShowWithSpeech([display, text = std::string(message.text)]() {
+                display->SetChatMessage("assistant", text.c_str());
+            });
+        }
+    } else if (message.type == "stt") {
+        if (message.text.data() != nullptr) {
+            ESP_LOGI(TAG, ">> %.*s", (int)message.text.size(), message.text.data());
+            Schedule([display, text = std::string(message.text)]() {
+                display->SetChatMessage("user", text.c_str());
+            });
+        }
+    } else if (message.type == "llm") {
+        if (message.emotion.data() != nullptr) {
+            ShowWithSpeech([display, emotion = std::string(message.emotion)]() {
+                display->SetEmotion(emotion.c_str());
+            });
+        }
+    }
+}
+
+// Network task, the audio the server sends after the message is what it goes with
+void Application::ShowWithSpeech(std::function<void()> update) {
+#if CONFIG_USE_PLAYBACK_CUES
+    audio_service_.QueueCue([this, update = std::move(update)]() mutable {
+        Schedule(std::move(update));
+    });
+#else
+    Schedule(std::move(update));
+#endif
+}
+
+void Application::HandleTtsStop() {
+    if (GetDeviceState() == kDeviceStateSpeaking) {
+        if (listening_mode_ == kListeningModeManualStop) {
+            SetDeviceState(kDeviceStateIdle);
+        } else {
+            SetDeviceState(kDeviceStateListening);
+        }
+    }
+}
+
 void Application::ShowActivationCode(const std::string& code, const std::string& message) {
+    // Looked up on each call, the sounds may come from the assets partition
     struct digit_sound {
         char digit;
-        const std::string_view& sound;
+        std::string_view sound;
     };
-    static const std::array<digit_sound, 10> digit_sounds{{
+    const std::array<digit_sound, 10> digit_sounds{{
         digit_sound{'0', Lang::Sounds::OGG_0},
         digit_sound{'1', Lang::Sounds::OGG_1}, 
         digit_sound{'2', Lang::Sounds::OGG_2},
@@ -674,6 +1396,13 @@ void Application::StopListening() {
 void Application::HandleToggleChatEvent() {
     auto state = GetDeviceState();
     
+#if CONFIG_USE_VOICE_MEMO
+    if (voice_memo_.recording() || voice_memo_pending_) {
+        voice_memo_pending_ = false;
+        StopVoiceMemo();
+        return;
+    }
+#endif
     if (state == kDeviceStateActivating) {
         SetDeviceState(kDeviceStateIdle);
         return;
@@ -699,7 +1428,7 @@ void Application::HandleToggleChatEvent() {
             // Schedule to let the state change be processed first (UI update)
             Schedule([this, mode]() {
                 ContinueOpenAudioChannel(mode);
-            });
+            }, kTaskPriorityAudio);
             return;
         }
         SetListeningMode(mode);
@@ -745,10 +1474,14 @@ void Application::HandleStartListeningEvent() {
     if (state == kDeviceStateIdle) {
         if (!protocol_->IsAudioChannelOpened()) {
             SetDeviceState(kDeviceStateConnecting);
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+            // Capture from the press on, the first words would be lost while the channel opens
+            StartPreroll();
+#endif
             // Schedule to let the state change be processed first (UI update)
             Schedule([this]() {
                 ContinueOpenAudioChannel(kListeningModeManualStop);
-            });
+            }, kTaskPriorityAudio);
             return;
         }
         SetListeningMode(kListeningModeManualStop);
@@ -770,6 +1503,11 @@ void Application::HandleStopListeningEvent() {
             protocol_->SendStopListening();
         }
         SetDeviceState(kDeviceStateIdle);
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+    } else if (state == kDeviceStateConnecting && preroll_active_) {
+        // A short press still sends what was said, the stop follows once the channel is open
+        preroll_stop_pending_ = true;
+#endif
     }
 }
 
@@ -781,29 +1519,54 @@ void Application::HandleWakeWordDetectedEvent() {
     auto state = GetDeviceState();
     auto wake_word = audio_service_.GetLastWakeWord();
     ESP_LOGI(TAG, "Wake word detected: %s (state: %d)", wake_word.c_str(), (int)state);
+    TRACE_INSTANT(kTracePointWakeWord, state);
+#if CONFIG_USE_VOICE_MEMO
+    if (voice_memo_.recording()) {
+        StopVoiceMemo();
+        return;
+    }
+#endif
+#if CONFIG_USE_AUDIO_INJECTION
+    AudioInjection::GetInstance().Mark(kAudioInjectionWakeWord);
+#endif
 
     if (state == kDeviceStateIdle) {
-        audio_service_.EncodeWakeWord();
-        auto wake_word = audio_service_.GetLastWakeWord();
-
-        if (!protocol_->IsAudioChannelOpened()) {
-            SetDeviceState(kDeviceStateConnecting);
-            // Schedule to let the state change be processed first (UI update),
-            // then continue with OpenAudioChannel which may block for ~1 second
-            Schedule([this, wake_word]() {
-                ContinueWakeWordInvoke(wake_word);
-            });
+#if CONFIG_USE_WAKE_WORD_ARBITRATION
+        // Devices that heard the same wake word agree on the nearest one, the others stay idle
+        bool arbitrating = WakeWordArbiter::GetInstance().Arbitrate(audio_service_.GetWakeWordLevel(), [this](bool won) {
+            Schedule([this, won]() {
+                if (GetDeviceState() != kDeviceStateIdle) {
+                    return;
+                }
+                if (won) {
+                    StartWakeWordSession();
+                } else {
+                    ESP_LOGI(TAG, "Another device answers the wake word");
+                    UpdatePowerSaveLevel();
+                    audio_service_.EnableWakeWordDetection(true);
+                }
+            }, kTaskPriorityAudio);
+        });
+        if (arbitrating) {
+            // The other devices are only heard with the radio awake
+            SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
             return;
         }
-        // Channel already opened, continue directly
-        ContinueWakeWordInvoke(wake_word);
+#endif
+        StartWakeWordSession();
     } else if (state == kDeviceStateSpeaking || state == kDeviceStateListening) {
         AbortSpeaking(kAbortReasonWakeWordDetected);
+        audio_service_.FlushPlayback();
         // Clear send queue to avoid sending residues to server
-        while (audio_service_.PopPacketFromSendQueue());
+        while (auto packet = audio_service_.PopPacketFromSendQueue()) {
+            audio_service_.ReleasePacket(std::move(packet));
+        }
 
         if (state == kDeviceStateListening) {
             protocol_->SendStartListening(GetDefaultListeningMode());
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+            audio_service_.EnableEndOfSpeechDetection(listening_mode_ == kListeningModeAutoStop);
+#endif
             audio_service_.ResetDecoder();
             audio_service_.PlaySound(Lang::Sounds::OGG_POPUP);
             // Re-enable wake word detection as it was stopped by the detection itself
@@ -819,6 +1582,36 @@ void Application::HandleWakeWordDetectedEvent() {
     }
 }
 
+void Application::HandleBargeIn() {
+    if (GetDeviceState() != kDeviceStateSpeaking || !audio_service_.IsVoiceDetected()) {
+        return;
+    }
+    ESP_LOGI(TAG, "Barge-in, user talks over the reply");
+    AbortSpeaking(kAbortReasonNone);
+    audio_service_.FlushPlayback();
+    // The uplink kept running while speaking, so the words since the barge-in are already on their way
+    SetListeningMode(listening_mode_);
+}
+
+void Application::StartWakeWordSession() {
+    // A sleeping modem needs a moment to wake up, let it do so while the wake word is encoded
+    SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
+    audio_service_.EncodeWakeWord();
+    auto wake_word = audio_service_.GetLastWakeWord();
+
+    if (!protocol_->IsAudioChannelOpened()) {
+        SetDeviceState(kDeviceStateConnecting);
+        // Schedule to let the state change be processed first (UI update),
+        // then continue with OpenAudioChannel which may block for ~1 second
+        Schedule([this, wake_word]() {
+            ContinueWakeWordInvoke(wake_word);
+        }, kTaskPriorityAudio);
+        return;
+    }
+    // Channel already opened, continue directly
+    ContinueWakeWordInvoke(wake_word);
+}
+
 void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
     // Check state again in case it was changed during scheduling
     if (GetDeviceState() != kDeviceStateConnecting) {
@@ -860,6 +1653,12 @@ void Application::HandleStateChangedEvent() {
     auto display = board.GetDisplay();
     auto led = board.GetLed();
     led->OnStateChanged();
+    UpdatePowerSaveLevel();
+#if CONFIG_USE_VOICE_MEMO
+    if (new_state != kDeviceStateIdle) {
+        StopVoiceMemo();
+    }
+#endif
     
     switch (new_state) {
         case kDeviceStateUnknown:
@@ -868,7 +1667,16 @@ void Application::HandleStateChangedEvent() {
             display->ClearChatMessages();  // Clear messages first
             display->SetEmotion("neutral"); // Then set emotion (wechat mode checks child count)
             audio_service_.EnableVoiceProcessing(false);
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+            DiscardPreroll();
+#endif
             audio_service_.EnableWakeWordDetection(true);
+#if CONFIG_USE_VOICE_MEMO
+            if (voice_memo_pending_) {
+                voice_memo_pending_ = false;
+                BeginVoiceMemo();
+            }
+#endif
             break;
         case kDeviceStateConnecting:
             display->SetStatus(Lang::Strings::CONNECTING);
@@ -879,6 +1687,16 @@ void Application::HandleStateChangedEvent() {
             display->SetStatus(Lang::Strings::LISTENING);
             display->SetEmotion("neutral");
 
+#if CONFIG_USE_END_OF_SPEECH_DETECTION
+            audio_service_.EnableEndOfSpeechDetection(listening_mode_ == kListeningModeAutoStop);
+#endif
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+            if (preroll_active_) {
+                // The processor runs since the press, its audio goes out right behind the start
+                protocol_->SendStartListening(listening_mode_);
+                FlushPreroll();
+            } else
+#endif
             // Make sure the audio processor is running
             if (play_popup_on_listening_ || !audio_service_.IsAudioProcessorRunning()) {
                 // For auto mode, wait for playback queue to be empty before enabling voice processing
@@ -926,17 +1744,62 @@ void Application::HandleStateChangedEvent() {
     }
 }
 
-void Application::Schedule(std::function<void()>&& callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
+#if CONFIG_USE_VOICE_MEMO
+bool Application::StartVoiceMemo() {
+    if (!voice_memo_.available() || voice_memo_.recording() || voice_memo_pending_) {
+        return false;
+    }
+    auto state = GetDeviceState();
+    if (state == kDeviceStateIdle) {
+        BeginVoiceMemo();
+        return voice_memo_.recording();
     }
-    xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
+    if (state != kDeviceStateConnecting && state != kDeviceStateListening && state != kDeviceStateSpeaking) {
+        return false;
+    }
+    // The channel closed callback takes the device to idle, where the memo begins
+    voice_memo_pending_ = true;
+    protocol_->CloseAudioChannel();
+    return true;
 }
 
+void Application::BeginVoiceMemo() {
+    if (!voice_memo_.Begin(16000)) {
+        return;
+    }
+    // Only the AFE wake word runs next to the audio processor, it ends the memo
+    audio_service_.EnableWakeWordDetection(audio_service_.IsAfeWakeWord());
+    audio_service_.EnableVoiceMemo(true);
+    audio_service_.EnableVoiceProcessing(true);
+    audio_service_.PlaySound(Lang::Sounds::OGG_POPUP);
+    Board::GetInstance().GetDisplay()->SetStatus(Lang::Strings::RECORDING_MEMO);
+}
+
+void Application::StopVoiceMemo() {
+    if (!voice_memo_.recording()) {
+        return;
+    }
+    audio_service_.EnableVoiceProcessing(false);
+    audio_service_.EnableVoiceMemo(false);
+    voice_memo_.End();
+    if (GetDeviceState() == kDeviceStateIdle) {
+        audio_service_.EnableWakeWordDetection(true);
+        audio_service_.PlaySound(Lang::Sounds::OGG_SUCCESS);
+        Board::GetInstance().GetDisplay()->SetStatus(Lang::Strings::STANDBY);
+    }
+}
+#endif
+
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+#if CONFIG_USE_TTS_CACHE
+    tts_cache_.StopPlayback();
+    tts_from_cache_ = false;
+#endif
+#if CONFIG_USE_AUDIO_INJECTION
+    AudioInjection::GetInstance().Mark(kAudioInjectionAbort);
+#endif
     if (protocol_) {
         protocol_->SendAbortSpeaking(reason);
     }
@@ -944,6 +1807,8 @@ void Application::AbortSpeaking(AbortReason reason) {
 
 void Application::SetListeningMode(ListeningMode mode) {
     listening_mode_ = mode;
+    // Realtime conversations drop audio that fell behind, the other modes send every word
+    audio_service_.SetSendQueueMaxAge(mode == kListeningModeRealtime ? CONFIG_SEND_QUEUE_MAX_AGE_REALTIME_MS : 0);
     SetDeviceState(kDeviceStateListening);
 }
 
@@ -957,14 +1822,15 @@ void Application::Reboot() {
     if (protocol_ && protocol_->IsAudioChannelOpened()) {
         protocol_->CloseAudioChannel();
     }
-    protocol_.reset();
+    SetProtocol(nullptr);
     audio_service_.Stop();
 
     vTaskDelay(pdMS_TO_TICKS(1000));
     esp_restart();
 }
 
-bool Application::UpgradeFirmware(const std::string& url, const std::string& version) {
+bool Application::UpgradeFirmware(const std::string& url, const std::string& version, const std::string& patch_url,
+    const std::string& sha256) {
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
 
@@ -986,23 +1852,23 @@ bool Application::UpgradeFirmware(const std::string& url, const std::string& ver
     std::string message = std::string(Lang::Strings::NEW_VERSION) + version_info;
     display->SetChatMessage("system", message.c_str());
 
-    board.SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
+    SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
     audio_service_.Stop();
     vTaskDelay(pdMS_TO_TICKS(1000));
 
-    bool upgrade_success = Ota::Upgrade(upgrade_url, [this, display](int progress, size_t speed) {
+    bool upgrade_success = Ota::Upgrade(upgrade_url, [this, display](int progress, size_t speed, size_t write_speed) {
         char buffer[32];
         snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
         Schedule([display, message = std::string(buffer)]() {
             display->SetChatMessage("system", message.c_str());
         });
-    });
+    }, patch_url, sha256);
 
     if (!upgrade_success) {
         // Upgrade failed, restart audio service and continue running
         ESP_LOGE(TAG, "Firmware upgrade failed, restarting audio service and continuing operation...");
         audio_service_.Start(); // Restart audio service
-        board.SetPowerSaveLevel(PowerSaveLevel::LOW_POWER); // Restore power save level
+        UpdatePowerSaveLevel(); // Restore power save level
         Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
         vTaskDelay(pdMS_TO_TICKS(3000));
         return false;
@@ -1031,7 +1897,7 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
             // Schedule to let the state change be processed first (UI update)
             Schedule([this, wake_word]() {
                 ContinueWakeWordInvoke(wake_word);
-            });
+            }, kTaskPriorityAudio);
             return;
         }
         // Channel already opened, continue directly
@@ -1039,7 +1905,7 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
     } else if (state == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kTaskPriorityAudio);
     } else if (state == kDeviceStateListening) {   
         Schedule([this]() {
             if (protocol_) {
@@ -1062,6 +1928,12 @@ bool Application::CanEnterSleepMode() {
         return false;
     }
 
+#if CONFIG_USE_VOICE_MEMO
+    if (voice_memo_.recording()) {
+        return false;
+    }
+#endif
+
     // Now it is safe to enter sleep mode
     return true;
 }
@@ -1075,6 +1947,25 @@ void Application::SendMcpMessage(const std::string& payload) {
     });
 }
 
+void Application::SendMcpMessage(TextPartsWriter payload_writer) {
+    Schedule([this, payload_writer = std::move(payload_writer)]() {
+        // A fragmented message must not have audio frames in between
+        std::lock_guard<std::mutex> lock(protocol_mutex_);
+        if (protocol_) {
+            protocol_->SendMcpMessage(payload_writer);
+        }
+    });
+}
+
+bool Application::SendVideoFrame(const std::string& jpeg) {
+    // Same locking as the audio sender task, the frames go out between audio packets
+    std::lock_guard<std::mutex> lock(protocol_mutex_);
+    if (!protocol_ || !protocol_->video_stream_enabled() || !protocol_->IsAudioChannelOpened()) {
+        return false;
+    }
+    return protocol_->SendVideoFrame((const uint8_t*)jpeg.data(), jpeg.size(), esp_timer_get_time() / 1000);
+}
+
 void Application::SetAecMode(AecMode mode) {
     aec_mode_ = mode;
     Schedule([this]() {
@@ -1106,6 +1997,12 @@ void Application::PlaySound(const std::string_view& sound) {
     audio_service_.PlaySound(sound);
 }
 
+// Only the main task changes protocol_, the audio sender task reads it under protocol_mutex_
+void Application::SetProtocol(std::unique_ptr<Protocol> protocol) {
+    std::lock_guard<std::mutex> lock(protocol_mutex_);
+    protocol_ = std::move(protocol);
+}
+
 void Application::ResetProtocol() {
     Schedule([this]() {
         // Close audio channel if opened
@@ -1113,7 +2010,7 @@ void Application::ResetProtocol() {
             protocol_->CloseAudioChannel();
         }
         // Reset protocol
-        protocol_.reset();
+        SetProtocol(nullptr);
     });
 }
 
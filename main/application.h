@@ -9,17 +9,27 @@
 #include <string>
 #include <mutex>
 #include <deque>
+#include <functional>
 #include <memory>
 
+#include "board.h"
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
+#include "network_quality.h"
 #include "device_state.h"
 #include "device_state_machine.h"
+#include "main_task_scheduler.h"
+#include "timer_wheel.h"
+#if CONFIG_USE_TTS_CACHE
+#include "tts_cache.h"
+#endif
+#if CONFIG_USE_VOICE_MEMO
+#include "voice_memo.h"
+#endif
 
 // Main event bits
 #define MAIN_EVENT_SCHEDULE             (1 << 0)
-#define MAIN_EVENT_SEND_AUDIO           (1 << 1)
 #define MAIN_EVENT_WAKE_WORD_DETECTED   (1 << 2)
 #define MAIN_EVENT_VAD_CHANGE           (1 << 3)
 #define MAIN_EVENT_ERROR                (1 << 4)
@@ -31,6 +41,7 @@
 #define MAIN_EVENT_START_LISTENING      (1 << 10)
 #define MAIN_EVENT_STOP_LISTENING       (1 << 11)
 #define MAIN_EVENT_STATE_CHANGED        (1 << 12)
+#define MAIN_EVENT_NETWORK_SWITCHED     (1 << 13)
 
 
 enum AecMode {
@@ -74,8 +85,13 @@ public:
 
     /**
      * Schedule a callback to be executed in the main task
+     * Audio callbacks run before the others and are never held back by the per-round time budget
      */
-    void Schedule(std::function<void()>&& callback);
+    template<typename F>
+    void Schedule(F&& callback, TaskPriority priority = kTaskPriorityUi) {
+        main_tasks_.Push(priority, std::forward<F>(callback));
+        xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
+    }
 
     /**
      * Alert with status, message, emotion and optional sound
@@ -105,13 +121,27 @@ public:
 
     void Reboot();
     void WakeWordInvoke(const std::string& wake_word);
-    bool UpgradeFirmware(const std::string& url, const std::string& version = "");
+    bool UpgradeFirmware(const std::string& url, const std::string& version = "", const std::string& patch_url = "",
+        const std::string& sha256 = "");
     bool CanEnterSleepMode();
     void SendMcpMessage(const std::string& payload);
+    void SendMcpMessage(TextPartsWriter payload_writer);
+    // Sends one camera JPEG frame from the calling task, false unless the server accepted the video stream
+    bool SendVideoFrame(const std::string& jpeg);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
     void PlaySound(const std::string_view& sound);
     AudioService& GetAudioService() { return audio_service_; }
+    NetworkQuality& GetNetworkQuality() { return network_quality_; }
+#if CONFIG_USE_VOICE_MEMO
+    /**
+     * Record the microphone into flash, main task only. A conversation is closed first.
+     * The button, the wake word or CONFIG_VOICE_MEMO_MAX_SECONDS end the memo.
+     */
+    bool StartVoiceMemo();
+    void StopVoiceMemo();
+    VoiceMemoStatus GetVoiceMemoStatus() { return voice_memo_.GetStatus(); }
+#endif
     
     /**
      * Reset protocol resources (thread-safe)
@@ -124,24 +154,59 @@ private:
     Application();
     ~Application();
 
-    std::mutex mutex_;
-    std::deque<std::function<void()>> main_tasks_;
+    MainTaskScheduler main_tasks_;
+    std::mutex protocol_mutex_;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
-    esp_timer_handle_t clock_timer_handle_ = nullptr;
+    TimerWheel::Handle clock_timer_handle_ = nullptr;
+    TimerWheel::Handle barge_in_timer_handle_ = nullptr;
     DeviceStateMachine state_machine_;
     ListeningMode listening_mode_ = kListeningModeAutoStop;
     AecMode aec_mode_ = kAecOff;
     std::string last_error_message_;
     AudioService audio_service_;
+    NetworkQuality network_quality_;
+    int signal_strength_ = -1;
     std::unique_ptr<Ota> ota_;
 
     bool has_server_time_ = false;
     bool aborted_ = false;
+#if CONFIG_USE_TTS_CACHE
+    TtsCache tts_cache_;
+    // The current response plays from the cache, its audio from the server is dropped
+    std::atomic<bool> tts_from_cache_{false};
+    // The tts stop came while cached packets were still being queued, handled once they are
+    bool tts_stop_pending_ = false;
+#endif
+#if CONFIG_USE_VOICE_MEMO
+    VoiceMemoStore voice_memo_;
+    // StartVoiceMemo() closed the conversation, the memo starts once the device is idle
+    bool voice_memo_pending_ = false;
+#endif
     bool assets_version_checked_ = false;
+#if CONFIG_USE_FAST_BOOT
+    std::string fast_boot_protocol_;  // "mqtt" or "websocket", from the last full activation
+#endif
+#if CONFIG_USE_DEEP_SLEEP_RESUME
+    bool resumed_ = false;  // Woke from deep sleep after a session that had gone idle
+#endif
     bool play_popup_on_listening_ = false;  // Flag to play popup sound after state changes to listening
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+    // Press to talk captures while the channel opens, the sender holds the packets until then
+    std::atomic<bool> preroll_active_{false};
+    bool preroll_stop_pending_ = false;  // Released before the channel opened
+    std::atomic<bool> preroll_stop_after_send_{false};  // The sender task stops listening once the preroll is out
+#endif
     int clock_ticks_ = 0;
     TaskHandle_t activation_task_handle_ = nullptr;
+    TaskHandle_t audio_sender_task_handle_ = nullptr;
+    std::vector<std::unique_ptr<AudioStreamPacket>> send_batch_;  // Kept for its capacity, used with protocol_mutex_ held
+    // Network power save level, with the time spent in each one for the log
+    std::mutex power_save_mutex_;
+    bool power_save_level_set_ = false;
+    PowerSaveLevel power_save_level_ = PowerSaveLevel::PERFORMANCE;
+    int64_t power_save_level_since_us_ = 0;
+    int64_t power_save_residency_us_[3] = {};
 
 
     // Event handlers
@@ -151,21 +216,57 @@ private:
     void HandleStopListeningEvent();
     void HandleNetworkConnectedEvent();
     void HandleNetworkDisconnectedEvent();
+    void HandleNetworkSwitchedEvent();
+    // Called by the board from its network task
+    void HandleNetworkEvent(NetworkEvent event, const std::string& data);
     void HandleActivationDoneEvent();
     void HandleWakeWordDetectedEvent();
+    void HandleBargeIn();
+    // tts / stt / llm messages, from the light parser or from cJSON
+    void HandleServerMessage(const ServerMessage& message);
+    // Schedules a caption or emotion change, with CONFIG_USE_PLAYBACK_CUES once the speech it belongs to plays
+    void ShowWithSpeech(std::function<void()> update);
+    // Leaves the speaking state at the end of a response
+    void HandleTtsStop();
+#if CONFIG_USE_VOICE_MEMO
+    void BeginVoiceMemo();
+#endif
     void ContinueOpenAudioChannel(ListeningMode mode);
+    void StartWakeWordSession();
     void ContinueWakeWordInvoke(const std::string& wake_word);
 
     // Activation task (runs in background)
     void ActivationTask();
+    // Sends the uplink audio, woken by the audio service when packets are queued
+    void AudioSenderTask();
+    // Sends what is in the send queue, with protocol_mutex_ held
+    void SendQueuedAudio();
+#if CONFIG_USE_PRESS_TO_TALK_PREROLL
+    void StartPreroll();
+    void FlushPreroll();
+    void DiscardPreroll();
+#endif
 
     // Helper methods
     void CheckAssetsVersion();
+    void UpdateAssetsInBackground(const std::string& url);
     void CheckNewVersion();
+#if CONFIG_USE_DNS_PREFETCH
+    void PrefetchServerAddresses();
+#endif
+#if CONFIG_USE_FAST_BOOT
+    bool HasFastBootCache();
+    void UpdateFastBootCache(Ota& ota);
+    void CheckNewVersionInBackground();
+#endif
     void InitializeProtocol();
+    void SetProtocol(std::unique_ptr<Protocol> protocol);
     void ShowActivationCode(const std::string& code, const std::string& message);
     void SetListeningMode(ListeningMode mode);
     ListeningMode GetDefaultListeningMode() const;
+    AudioEncoderConfig GetDefaultEncoderConfig();
+    void SetPowerSaveLevel(PowerSaveLevel level);
+    void UpdatePowerSaveLevel();
     
     // State change handler called by state machine
     void OnStateChanged(DeviceState old_state, DeviceState new_state);
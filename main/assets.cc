@@ -5,48 +5,132 @@
 #include "lvgl_theme.h"
 #include "emote_display.h"
 #include "expression_emote.h"
+#include "download_checkpoint.h"
+#include "assets_delta.h"
+#include "settings.h"
 #if HAVE_LVGL
 #include "display/lcd_display.h"
+#include "lvgl_animation.h"
 #include <spi_flash_mmap.h>
 #endif
+#if HAVE_LVGL && CONFIG_USE_COMPRESSED_ASSETS
+#include <rom/miniz.h>
+#endif
 
 #include <esp_log.h>
 #include <esp_timer.h>
 #include <esp_heap_caps.h>
 #include <cbin_font.h>
+#include <mbedtls/sha256.h>
+#include <cstring>
+#include <algorithm>
 
 
 #define TAG "Assets"
 #define PARTITION_LABEL "assets"
-
-struct mmap_assets_table {
-    char asset_name[32];          /*!< Name of the asset */
-    uint32_t asset_size;          /*!< Size of the asset */
-    uint32_t asset_offset;        /*!< Offset of the asset */
-    uint16_t asset_width;         /*!< Width of the asset */
-    uint16_t asset_height;        /*!< Height of the asset */
-};
+#define PARTITION_LABEL_B "assets_b"
+#define ASSETS_MMAP_PAGE_SIZE (64 * 1024)
 
 Assets::Assets() {
-#if HAVE_LVGL
-    strategy_ = std::make_unique<Assets::LvglStrategy>();
-#else
-    strategy_ = std::make_unique<Assets::EmoteStrategy>();
-#endif
+    strategy_ = CreateStrategy();
     // Initialize the partition
-    InitializePartition();
+    if (!InitializePartition() && dual_slot()) {
+        // A slot that fails its checksum, after a swap that was cut short, falls back to the other one
+        int slot = active_slot_;
+        ESP_LOGW(TAG, "Assets in %s are not valid, trying the other slot", partition_->label);
+        if (!UseSlot(1 - slot)) {
+            UseSlot(slot);
+        }
+    }
 }
 
 Assets::~Assets() {
     UnApplyPartition();
+    if (retired_strategy_) {
+        retired_strategy_->UnApplyPartition(this);
+    }
+}
+
+std::unique_ptr<Assets::AssetStrategy> Assets::CreateStrategy() {
+#if HAVE_LVGL
+    return std::make_unique<Assets::LvglStrategy>();
+#else
+    return std::make_unique<Assets::EmoteStrategy>();
+#endif
 }
 
 bool Assets::FindPartition(Assets* assets) {
-    assets->partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, PARTITION_LABEL);
-    if (assets->partition_ == nullptr) {
+    assets->slots_[0] = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, PARTITION_LABEL);
+    assets->slots_[1] = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, PARTITION_LABEL_B);
+    if (assets->slots_[0] == nullptr) {
         ESP_LOGI(TAG, "No assets partition found");
+        assets->slots_[1] = nullptr;
+        assets->partition_ = nullptr;
+        return false;
+    }
+    assets->active_slot_ = 0;
+    if (assets->slots_[1] != nullptr && Settings("assets", false).GetInt("slot", 0) == 1) {
+        assets->active_slot_ = 1;
+    }
+    assets->partition_ = assets->slots_[assets->active_slot_];
+    return true;
+}
+
+// The slot is stored first, a reboot in between comes up on it too
+bool Assets::UseSlot(int slot) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    {
+        Settings settings("assets", true);
+        settings.SetInt("slot", slot);
+    }
+    UnApplyPartition();
+    return InitializePartition();
+}
+
+// Makes the slot that was just written the active one, keeping the old one as it is when the new one is not valid
+bool Assets::SwapSlots() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    int old_slot = active_slot_;
+    bool old_valid = partition_valid_;
+#if !HAVE_LVGL
+    if (models_list_ != nullptr) {
+        // The speech models are read from the mounted partition, it cannot be unmounted under them
+        Settings settings("assets", true);
+        settings.SetInt("slot", 1 - old_slot);
+        ESP_LOGI(TAG, "Assets in %s are used from the next boot", slots_[1 - old_slot]->label);
+        return true;
+    }
+#endif
+    auto old_strategy = std::move(strategy_);
+    strategy_ = CreateStrategy();
+#if !HAVE_LVGL
+    // The emote engine mounts one partition at a time, the old one goes before the new one is mounted
+    old_strategy->UnApplyPartition(this);
+#endif
+    {
+        Settings settings("assets", true);
+        settings.SetInt("slot", 1 - old_slot);
+    }
+    if (!strategy_->InitializePartition(this)) {
+        ESP_LOGE(TAG, "The downloaded assets in %s are not valid, staying on %s", partition_->label, slots_[old_slot]->label);
+        strategy_->UnApplyPartition(this);
+        strategy_ = std::move(old_strategy);
+        {
+            Settings settings("assets", true);
+            settings.SetInt("slot", old_slot);
+        }
+        FindPartition(this);
+        partition_valid_ = old_valid;
+#if !HAVE_LVGL
+        strategy_->InitializePartition(this);
+#endif
         return false;
     }
+    ESP_LOGI(TAG, "Assets switched from %s to %s", slots_[old_slot]->label, partition_->label);
+#if HAVE_LVGL
+    retired_strategy_ = std::move(old_strategy);
+#endif
+    models_pinned_ = models_list_ != nullptr;
     return true;
 }
 
@@ -55,19 +139,38 @@ bool Assets::Apply() {
 }
 
 bool Assets::InitializePartition() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     return strategy_ ? strategy_->InitializePartition(this) : false;
 }
 
 void Assets::UnApplyPartition() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     if (strategy_) {
         strategy_->UnApplyPartition(this);
     }
 }
 
 bool Assets::GetAssetData(const std::string& name, void*& ptr, size_t& size) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     return strategy_ ? strategy_->GetAssetData(this, name, ptr, size) : false;
 }
 
+// The asset is used from the mapping, what it cost in RAM is the heap taken since free_before
+void Assets::ReportInPlace(const char* kind, const std::string& name, size_t size, size_t free_before) {
+#if CONFIG_USE_ASSETS_XIP
+    int ram = (int)free_before - (int)heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    in_place_bytes_ += size;
+    in_place_ram_ += ram;
+    ESP_LOGI(TAG, "XIP %s %s: %u bytes stay in flash, %d bytes of RAM used, %d bytes saved",
+        kind, name.c_str(), (unsigned)size, ram, (int)size - ram);
+#else
+    (void)kind;
+    (void)name;
+    (void)size;
+    (void)free_before;
+#endif
+}
+
 bool Assets::LoadSrmodelsFromIndex(Assets* assets, cJSON* root) {
     void* ptr = nullptr;
     size_t size = 0;
@@ -89,15 +192,20 @@ bool Assets::LoadSrmodelsFromIndex(Assets* assets, cJSON* root) {
     }
 
     cJSON* srmodels = cJSON_GetObjectItem(root, "srmodels");
-    if (cJSON_IsString(srmodels)) {
+    if (cJSON_IsString(srmodels) && assets->models_pinned_) {
+        // The wake word and the AFE were set up from the old slot, they are not rebuilt while running
+        ESP_LOGI(TAG, "The speech models of the new assets are used from the next boot");
+    } else if (cJSON_IsString(srmodels)) {
         std::string srmodels_file = srmodels->valuestring;
         if (assets->GetAssetData(srmodels_file, ptr, size)) {
             if (assets->models_list_ != nullptr) {
                 esp_srmodel_deinit(assets->models_list_);
                 assets->models_list_ = nullptr;
             }
+            size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
             assets->models_list_ = srmodel_load(static_cast<uint8_t*>(ptr));
             if (assets->models_list_ != nullptr) {
+                assets->ReportInPlace("models", srmodels_file, size, free_before);
                 auto& app = Application::GetInstance();
                 app.GetAudioService().SetModelsList(assets->models_list_);
                 if (need_delete_root) {
@@ -127,90 +235,291 @@ uint32_t Assets::LvglStrategy::CalculateChecksum(const char* data, uint32_t leng
     return checksum & 0xFFFF;
 }
 
+// SHA-256 of where the partition is and of its header and table. Download() drops the stored stamp
+// before it writes the slot in use, and the stamp is always that of the slot in use, so it only
+// matches content that passed the checksum since its last write.
+std::string Assets::LvglStrategy::PartitionStamp(const esp_partition_t* partition, const char* root, uint32_t files) {
+    uint8_t digest[32];
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, (const unsigned char*)&partition->address, sizeof(partition->address));
+    mbedtls_sha256_update(&ctx, (const unsigned char*)&partition->size, sizeof(partition->size));
+    mbedtls_sha256_update(&ctx, (const unsigned char*)root, 12 + sizeof(mmap_assets_table) * files);
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+
+    char hex[sizeof(digest) * 2 + 1];
+    for (size_t i = 0; i < sizeof(digest); i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    return std::string(hex);
+}
+
+// Same sum read through a small buffer, when the partition is not mapped as a whole
+uint32_t Assets::LvglStrategy::CalculateChecksum(const esp_partition_t* partition, size_t offset, uint32_t length) {
+    const size_t chunk_size = 4096;
+    char* buffer = (char*)heap_caps_malloc(chunk_size, MALLOC_CAP_INTERNAL);
+    if (buffer == nullptr) {
+        return UINT32_MAX;
+    }
+    // UINT32_MAX never matches a stored checksum
+    uint32_t checksum = 0;
+    while (length > 0) {
+        size_t n = std::min<size_t>(length, chunk_size);
+        if (esp_partition_read(partition, offset, buffer, n) != ESP_OK) {
+            heap_caps_free(buffer);
+            return UINT32_MAX;
+        }
+        for (size_t i = 0; i < n; i++) {
+            checksum += buffer[i];
+        }
+        offset += n;
+        length -= n;
+    }
+    heap_caps_free(buffer);
+    return checksum & 0xFFFF;
+}
+
 bool Assets::LvglStrategy::InitializePartition(Assets* assets) {
     assets->partition_valid_ = false;
-    assets_.clear();
+    table_ = nullptr;
+    table_files_ = 0;
 
     if (!Assets::FindPartition(assets)) {
         return false;
     }
 
     int free_pages = spi_flash_mmap_get_free_pages(SPI_FLASH_MMAP_DATA);
-    uint32_t storage_size = free_pages * 64 * 1024;
+    uint32_t storage_size = free_pages * ASSETS_MMAP_PAGE_SIZE;
     ESP_LOGI(TAG, "The storage free size is %ld KB", storage_size / 1024);
     ESP_LOGI(TAG, "The partition size is %ld KB", assets->partition_->size / 1024);
-    if (storage_size < assets->partition_->size) {
-        ESP_LOGE(TAG, "The free size %ld KB is less than assets partition required %ld KB", storage_size / 1024, assets->partition_->size / 1024);
+    bool windowed = storage_size < assets->partition_->size;
+    if (windowed) {
+        ESP_LOGW(TAG, "The free size %ld KB is less than assets partition required %ld KB, mapping assets on demand",
+            storage_size / 1024, assets->partition_->size / 1024);
+    } else if (Map(assets->partition_, 0, assets->partition_->size) == nullptr) {
         return false;
     }
 
-    esp_err_t err = esp_partition_mmap(assets->partition_, 0, assets->partition_->size, ESP_PARTITION_MMAP_DATA, (const void**)&mmap_root_, &mmap_handle_);
+    uint32_t header[3];
+    esp_err_t err = esp_partition_read(assets->partition_, 0, header, sizeof(header));
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to mmap assets partition: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Failed to read assets header: %s", esp_err_to_name(err));
         return false;
     }
 
     assets->partition_valid_ = true;
 
-    uint32_t stored_files = *(uint32_t*)(mmap_root_ + 0);
-    uint32_t stored_chksum = *(uint32_t*)(mmap_root_ + 4);
-    uint32_t stored_len = *(uint32_t*)(mmap_root_ + 8);
+    uint32_t stored_files = header[0];
+    uint32_t stored_chksum = header[1];
+    uint32_t stored_len = header[2];
 
     if (stored_len > assets->partition_->size - 12) {
         ESP_LOGD(TAG, "The stored_len (0x%lx) is greater than the partition size (0x%lx) - 12", stored_len, assets->partition_->size);
         return false;
     }
 
-    auto start_time = esp_timer_get_time();
-    uint32_t calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len);
-    auto end_time = esp_timer_get_time();
-    ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
+    if (sizeof(mmap_assets_table) * stored_files > stored_len) {
+        ESP_LOGE(TAG, "The table of %lu files does not fit in stored_len (0x%lx)", stored_files, stored_len);
+        return false;
+    }
 
-    if (calculated_checksum != stored_chksum) {
-        ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+    auto root = Map(assets->partition_, 0, 12 + sizeof(mmap_assets_table) * stored_files);
+    if (root == nullptr) {
         return false;
     }
 
+    // The full checksum runs once per content, later boots only compare the stamp of the header and table
+    std::string stamp = PartitionStamp(assets->partition_, root, stored_files);
+    Settings settings("assets", false);
+    if (settings.GetString("verified") == stamp) {
+        ESP_LOGI(TAG, "Assets partition already verified, skipping checksum");
+    } else {
+        auto start_time = esp_timer_get_time();
+        uint32_t calculated_checksum = windowed ? CalculateChecksum(assets->partition_, 12, stored_len)
+            : CalculateChecksum(root + 12, stored_len);
+        auto end_time = esp_timer_get_time();
+        ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
+
+        if (calculated_checksum != stored_chksum) {
+            ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+            return false;
+        }
+        Settings rw_settings("assets", true);
+        rw_settings.SetString("verified", stamp);
+    }
+
     checksum_valid_ = true;
 
-    for (uint32_t i = 0; i < stored_files; i++) {
-        auto item = (const mmap_assets_table*)(mmap_root_ + 12 + i * sizeof(mmap_assets_table));
-        auto asset = Asset{
-            .size = static_cast<size_t>(item->asset_size),
-            .offset = static_cast<size_t>(12 + sizeof(mmap_assets_table) * stored_files + item->asset_offset)
-        };
-        assets_[item->asset_name] = asset;
+    // Lookups run straight over the mapped table, binary search when the packer wrote it sorted
+    table_ = (const mmap_assets_table*)(root + 12);
+    table_files_ = stored_files;
+    table_sorted_ = true;
+    for (uint32_t i = 1; i < stored_files; i++) {
+        if (strncmp(table_[i - 1].asset_name, table_[i].asset_name, sizeof(table_[i].asset_name)) > 0) {
+            ESP_LOGW(TAG, "The assets table is not sorted, falling back to linear lookups");
+            table_sorted_ = false;
+            break;
+        }
     }
     return checksum_valid_;
 }
 
+// Returns the range from a window that covers it, or maps a new window
+const char* Assets::LvglStrategy::Map(const esp_partition_t* partition, size_t offset, size_t size) {
+    if (offset + size > partition->size) {
+        ESP_LOGE(TAG, "The range 0x%x+0x%x is outside the assets partition", offset, size);
+        return nullptr;
+    }
+    for (auto& window : windows_) {
+        if (offset >= window.offset && offset + size <= window.offset + window.size) {
+            return window.data + (offset - window.offset);
+        }
+    }
+
+    size_t start = offset / ASSETS_MMAP_PAGE_SIZE * ASSETS_MMAP_PAGE_SIZE;
+    size_t end = std::min<size_t>((offset + size + ASSETS_MMAP_PAGE_SIZE - 1) / ASSETS_MMAP_PAGE_SIZE * ASSETS_MMAP_PAGE_SIZE, partition->size);
+    MappedWindow window = { .offset = start, .size = end - start, .data = nullptr, .handle = 0 };
+    esp_err_t err = esp_partition_mmap(partition, window.offset, window.size, ESP_PARTITION_MMAP_DATA, (const void**)&window.data, &window.handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mmap assets 0x%x+0x%x: %s, %d pages free", window.offset, window.size,
+            esp_err_to_name(err), spi_flash_mmap_get_free_pages(SPI_FLASH_MMAP_DATA));
+        return nullptr;
+    }
+    windows_.push_back(window);
+    return window.data + (offset - window.offset);
+}
+
+const mmap_assets_table* Assets::LvglStrategy::FindAsset(const std::string& name) const {
+    // Names fill the whole field when they are that long, without a terminator
+    const size_t name_size = sizeof(mmap_assets_table::asset_name);
+    if (name.size() > name_size) {
+        return nullptr;
+    }
+    auto compare = [&name, name_size](const mmap_assets_table& item) {
+        return strncmp(item.asset_name, name.c_str(), name_size);
+    };
+    if (!table_sorted_) {
+        for (uint32_t i = 0; i < table_files_; i++) {
+            if (compare(table_[i]) == 0) {
+                return &table_[i];
+            }
+        }
+        return nullptr;
+    }
+    uint32_t low = 0;
+    uint32_t high = table_files_;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        int result = compare(table_[mid]);
+        if (result == 0) {
+            return &table_[mid];
+        }
+        if (result < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return nullptr;
+}
+
 void Assets::LvglStrategy::UnApplyPartition(Assets* assets) {
-    if (mmap_handle_ != 0) {
-        esp_partition_munmap(mmap_handle_);
-        mmap_handle_ = 0;
-        mmap_root_ = nullptr;
+    for (auto& window : windows_) {
+        esp_partition_munmap(window.handle);
+    }
+    windows_.clear();
+    for (auto& asset : inflated_) {
+        heap_caps_free(asset.data);
     }
+    inflated_.clear();
     checksum_valid_ = false;
-    assets_.clear();
+    table_ = nullptr;
+    table_files_ = 0;
     (void)assets; // Unused parameter
 }
 
 bool Assets::LvglStrategy::GetAssetData(Assets* assets, const std::string& name, void*& ptr, size_t& size) {
-    auto asset = assets_.find(name);
-    if (asset == assets_.end()) {
+    auto item = FindAsset(name);
+    if (item == nullptr) {
+        return false;
+    }
+    auto data = Map(assets->partition_, 12 + sizeof(mmap_assets_table) * table_files_ + item->asset_offset, item->asset_size + 2);
+    if (data == nullptr) {
         return false;
     }
-    auto data = (const char*)(mmap_root_ + asset->second.offset);
-    if (data[0] != 'Z' || data[1] != 'Z') {
+    if (data[0] != 'Z' || (data[1] != 'Z' && data[1] != 'C')) {
         ESP_LOGE(TAG, "The asset %s is not valid with magic %02x%02x", name.c_str(), data[0], data[1]);
         return false;
     }
+    if (data[1] == 'C') {
+#if CONFIG_USE_COMPRESSED_ASSETS
+        return Inflate(item, data + 2, ptr, size);
+#else
+        ESP_LOGE(TAG, "The asset %s is compressed, enable USE_COMPRESSED_ASSETS", name.c_str());
+        return false;
+#endif
+    }
 
     ptr = static_cast<void*>(const_cast<char*>(data + 2));
-    size = asset->second.size;
+    size = item->asset_size;
     return true;
 }
 
+#if CONFIG_USE_COMPRESSED_ASSETS
+// Inflated once with the miniz of the ROM, later lookups return the same copy
+bool Assets::LvglStrategy::Inflate(const mmap_assets_table* item, const char* data, void*& ptr, size_t& size) {
+    for (auto& asset : inflated_) {
+        if (asset.item == item) {
+            ptr = asset.data;
+            size = asset.size;
+            return true;
+        }
+    }
+    const int name_size = sizeof(item->asset_name);
+    if (item->asset_size < 4) {
+        ESP_LOGE(TAG, "The compressed asset %.*s is truncated", name_size, item->asset_name);
+        return false;
+    }
+    uint32_t inflated_size;
+    memcpy(&inflated_size, data, sizeof(inflated_size));
+
+    char* buffer = (char*)heap_caps_malloc(inflated_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (buffer == nullptr) {
+        buffer = (char*)heap_caps_malloc(inflated_size, MALLOC_CAP_8BIT);
+    }
+    auto inflator = (tinfl_decompressor*)heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_8BIT);
+    if (buffer == nullptr || inflator == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %lu bytes to inflate %.*s", inflated_size, name_size, item->asset_name);
+        heap_caps_free(buffer);
+        heap_caps_free(inflator);
+        return false;
+    }
+
+    auto start_time = esp_timer_get_time();
+    tinfl_init(inflator);
+    size_t in_size = item->asset_size - 4;
+    size_t out_size = inflated_size;
+    tinfl_status status = tinfl_decompress(inflator, (const mz_uint8*)data + 4, &in_size, (mz_uint8*)buffer, (mz_uint8*)buffer,
+        &out_size, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    heap_caps_free(inflator);
+    if (status != TINFL_STATUS_DONE || out_size != inflated_size) {
+        ESP_LOGE(TAG, "Failed to inflate %.*s: status %d, %u of %lu bytes", name_size, item->asset_name, (int)status,
+            out_size, inflated_size);
+        heap_caps_free(buffer);
+        return false;
+    }
+    ESP_LOGI(TAG, "Inflated %.*s from %lu to %lu bytes in %d ms", name_size, item->asset_name, item->asset_size,
+        inflated_size, int((esp_timer_get_time() - start_time) / 1000));
+
+    inflated_.push_back(InflatedAsset{ .item = item, .data = buffer, .size = inflated_size });
+    ptr = buffer;
+    size = inflated_size;
+    return true;
+}
+#endif
+
 bool Assets::LvglStrategy::Apply(Assets* assets) {
     void* ptr = nullptr;
     size_t size = 0;
@@ -233,21 +542,36 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
         }
     }
 
+    assets->in_place_bytes_ = 0;
+    assets->in_place_ram_ = 0;
     Assets::LoadSrmodelsFromIndex(assets, root);
 
+    // LVGL must not draw from the old font and emoji images while they are swapped, and they live on
+    // until the labels and the emoji image are restyled below
+    auto display = Board::GetInstance().GetDisplay();
+    DisplayLockGuard lock(display);
     auto& theme_manager = LvglThemeManager::GetInstance();
     auto light_theme = theme_manager.GetTheme("light");
     auto dark_theme = theme_manager.GetTheme("dark");
+    std::vector<std::shared_ptr<void>> retired;
+    for (auto theme : {light_theme, dark_theme}) {
+        if (theme != nullptr) {
+            retired.push_back(theme->text_font());
+            retired.push_back(theme->emoji_collection());
+        }
+    }
 
     cJSON* font = cJSON_GetObjectItem(root, "text_font");
     if (cJSON_IsString(font)) {
         std::string fonts_text_file = font->valuestring;
         if (assets->GetAssetData(fonts_text_file, ptr, size)) {
+            size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
             auto text_font = std::make_shared<LvglCBinFont>(ptr);
             if (text_font->font() == nullptr) {
                 ESP_LOGE(TAG, "Failed to load fonts.bin");
                 return false;
             }
+            assets->ReportInPlace("font", fonts_text_file, size, free_before);
             if (light_theme != nullptr) {
                 light_theme->set_text_font(text_font);
             }
@@ -261,7 +585,28 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
 
     cJSON* emoji_collection = cJSON_GetObjectItem(root, "emoji_collection");
     if (cJSON_IsArray(emoji_collection)) {
-        auto custom_emoji_collection = std::make_shared<EmojiCollection>();
+        // 表情图片在第一次显示时才创建
+        auto custom_emoji_collection = std::make_shared<LazyEmojiCollection>([assets](const std::string& file) -> LvglImage* {
+            void* ptr = nullptr;
+            size_t size = 0;
+            if (!assets->GetAssetData(file, ptr, size)) {
+                ESP_LOGE(TAG, "Emoji image file %s is not found", file.c_str());
+                return nullptr;
+            }
+#if CONFIG_USE_ASSETS_XIP
+            if (LvglBinImage::IsBinImage(ptr, size)) {
+                size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+                auto image = new LvglBinImage(ptr, size);
+                assets->ReportInPlace("emoji", file, size, free_before);
+                return image;
+            }
+            // Animations copy their frames from flash, only the canvas is in RAM
+            if (!LvglAnimation::IsAnimation(ptr, size)) {
+                ESP_LOGW(TAG, "Emoji %s is not an uncompressed LVGL .bin image, it is decoded into RAM when shown", file.c_str());
+            }
+#endif
+            return new LvglRawImage(ptr, size);
+        });
         int emoji_count = cJSON_GetArraySize(emoji_collection);
         for (int i = 0; i < emoji_count; i++) {
             cJSON* emoji = cJSON_GetArrayItem(emoji_collection, i);
@@ -270,11 +615,7 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
                 cJSON* file = cJSON_GetObjectItem(emoji, "file");
                 cJSON* eaf = cJSON_GetObjectItem(emoji, "eaf");
                 if (cJSON_IsString(name) && cJSON_IsString(file) && (NULL== eaf)) {
-                    if (!assets->GetAssetData(file->valuestring, ptr, size)) {
-                        ESP_LOGE(TAG, "Emoji %s image file %s is not found", name->valuestring, file->valuestring);
-                        continue;
-                    }
-                    custom_emoji_collection->AddEmoji(name->valuestring, new LvglRawImage(ptr, size));
+                    custom_emoji_collection->AddEmojiFile(name->valuestring, file->valuestring);
                 }
             }
         }
@@ -305,8 +646,10 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
                     ESP_LOGE(TAG, "The background image file %s is not found", background_image->valuestring);
                     return false;
                 }
-                auto background_image = std::make_shared<LvglCBinImage>(ptr);
-                light_theme->set_background_image(background_image);
+                size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+                auto image = std::make_shared<LvglCBinImage>(ptr);
+                assets->ReportInPlace("background", background_image->valuestring, size, free_before);
+                light_theme->set_background_image(image);
             }
         }
         cJSON* dark_skin = cJSON_GetObjectItem(skin, "dark");
@@ -326,18 +669,21 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
                     ESP_LOGE(TAG, "The background image file %s is not found", background_image->valuestring);
                     return false;
                 }
-                auto background_image = std::make_shared<LvglCBinImage>(ptr);
-                dark_theme->set_background_image(background_image);
+                size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+                auto image = std::make_shared<LvglCBinImage>(ptr);
+                assets->ReportInPlace("background", background_image->valuestring, size, free_before);
+                dark_theme->set_background_image(image);
             }
         }
     }
 
-    auto display = Board::GetInstance().GetDisplay();
     ESP_LOGI(TAG, "Refreshing display theme...");
 
     auto current_theme = display->GetTheme();
     if (current_theme != nullptr) {
         display->SetTheme(current_theme);
+        // The emoji image still shows an image of the old collection, assets are applied while idle
+        display->SetEmotion("neutral");
     }
 
     // Parse hide_subtitle configuration
@@ -351,6 +697,9 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
         }
     }
     
+#if CONFIG_USE_ASSETS_XIP
+    ESP_LOGI(TAG, "Assets in place: %u KB in flash, %d bytes of RAM for descriptors", (unsigned)(assets->in_place_bytes_ / 1024), assets->in_place_ram_);
+#endif
     cJSON_Delete(root);
     return true;
 }
@@ -370,7 +719,7 @@ bool Assets::EmoteStrategy::InitializePartition(Assets* assets) {
         const emote_data_t data = {
             .type = EMOTE_SOURCE_PARTITION,
             .source = {
-                .partition_label = PARTITION_LABEL,
+                .partition_label = assets->partition_->label,
             },
             .flags = {
                 .mmap_enable = true, //must be true here!!!
@@ -419,6 +768,8 @@ bool Assets::EmoteStrategy::Apply(Assets* assets) {
 
     if (emote_display && emote_display->GetEmoteHandle() != nullptr) {
         emote_load_assets(emote_display->GetEmoteHandle());
+        // The cached emotion and message may be drawn from the old assets
+        emote_display->RefreshAll();
     }
     return true;
 }
@@ -426,31 +777,60 @@ bool Assets::EmoteStrategy::Apply(Assets* assets) {
 bool Assets::Download(std::string url, std::function<void(int progress, size_t speed)> progress_callback) {
     ESP_LOGI(TAG, "Downloading new version of assets from %s", url.c_str());
 
-    // 取消当前资源分区的内存映射
-    UnApplyPartition();
+    const esp_partition_t* target = partition_;
+    if (dual_slot()) {
+        // The retired slot is still mapped and in use, it is only written again after a reboot
+        if (retired_strategy_) {
+            ESP_LOGE(TAG, "Assets were already switched since boot, reboot before the next update");
+            return false;
+        }
+        target = slots_[1 - active_slot_];
+        ESP_LOGI(TAG, "Writing %s, assets in %s stay in use", target->label, partition_->label);
+    } else {
+        // 取消当前资源分区的内存映射
+        UnApplyPartition();
 
-    // 下载新的资源文件
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    
-    if (!http->Open("GET", url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
-        return false;
+        // 分区内容即将改变，下次初始化时重新完整校验
+        Settings settings("assets", true);
+        settings.EraseKey("verified");
     }
 
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get assets, status code: %d", http->GetStatusCode());
-        return false;
+    // 清单地址：只下载内容有变化的资源，放不下时退回完整下载
+    if (url.size() > 5 && url.compare(url.size() - 5, 5, ".json") == 0) {
+        AssetsDelta delta(target);
+        auto result = delta.Update(url, progress_callback);
+        if (result == AssetsDelta::kFailed) {
+            return false;
+        }
+        if (result == AssetsDelta::kDone) {
+            if (dual_slot()) {
+                return SwapSlots();
+            }
+            if (!InitializePartition()) {
+                ESP_LOGE(TAG, "Failed to re-initialize assets partition");
+                return false;
+            }
+            return true;
+        }
+        url = delta.image_url();
+        ESP_LOGI(TAG, "Falling back to full download from %s", url.c_str());
     }
 
-    size_t content_length = http->GetBodyLength();
+    // 下载新的资源文件，中断后从已写入的位置继续
+    DownloadCheckpoint checkpoint("assets_resume", url, target);
+    auto network = Board::GetInstance().GetNetwork();
+    auto http = network->CreateHttp(0);
+    size_t content_length = 0;
+    if (!checkpoint.Open(http.get(), content_length)) {
+        return false;
+    }
     if (content_length == 0) {
         ESP_LOGE(TAG, "Failed to get content length");
         return false;
     }
 
-    if (content_length > partition_->size) {
-        ESP_LOGE(TAG, "Assets file size (%u) is larger than partition size (%lu)", content_length, partition_->size);
+    if (content_length > target->size) {
+        ESP_LOGE(TAG, "Assets file size (%u) is larger than partition size (%lu)", content_length, target->size);
         return false;
     }
 
@@ -470,9 +850,10 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
         ESP_LOGE(TAG, "Failed to allocate buffer");
         return false;
     }
-    size_t total_written = 0;
+    // 续传时已写入部分所在的扇区都已擦除过
+    size_t total_written = checkpoint.offset();
     size_t recent_written = 0;
-    size_t current_sector = 0;
+    size_t current_sector = (total_written + SECTOR_SIZE - 1) / SECTOR_SIZE;
     auto last_calc_time = esp_timer_get_time();
     
     while (true) {
@@ -480,6 +861,7 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
         if (ret < 0) {
             ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
             heap_caps_free(buffer);
+            checkpoint.Save();
             return false;
         }
 
@@ -497,17 +879,19 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
             size_t sector_end = (current_sector + 1) * SECTOR_SIZE;
             
             // 确保擦除范围不超过分区大小
-            if (sector_end > partition_->size) {
-                ESP_LOGE(TAG, "Sector end (%u) exceeds partition size (%lu)", sector_end, partition_->size);
+            if (sector_end > target->size) {
+                ESP_LOGE(TAG, "Sector end (%u) exceeds partition size (%lu)", sector_end, target->size);
                 heap_caps_free(buffer);
+                checkpoint.Clear();
                 return false;
             }
             
             ESP_LOGD(TAG, "Erasing sector %u (offset: %u, size: %u)", current_sector, sector_start, SECTOR_SIZE);
-            esp_err_t err = esp_partition_erase_range(partition_, sector_start, SECTOR_SIZE);
+            esp_err_t err = esp_partition_erase_range(target, sector_start, SECTOR_SIZE);
             if (err != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to erase sector %u at offset %u: %s", current_sector, sector_start, esp_err_to_name(err));
                 heap_caps_free(buffer);
+                checkpoint.Clear();
                 return false;
             }
             
@@ -515,13 +899,15 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
         }
 
         // 写入数据到分区
-        esp_err_t err = esp_partition_write(partition_, total_written, buffer, ret);
+        esp_err_t err = esp_partition_write(target, total_written, buffer, ret);
         if (err != ESP_OK) {
             ESP_LOGE(TAG, "Failed to write to assets partition at offset %u: %s", total_written, esp_err_to_name(err));
             heap_caps_free(buffer);
+            checkpoint.Clear();
             return false;
         }
 
+        checkpoint.Update(buffer, ret);
         total_written += ret;
         recent_written += ret;
 
@@ -544,12 +930,19 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
 
     if (total_written != content_length) {
         ESP_LOGE(TAG, "Downloaded size (%u) does not match expected size (%u)", total_written, content_length);
+        // 连接提前关闭，下次从这里继续
+        checkpoint.Save();
         return false;
     }
+    checkpoint.Clear();
 
     ESP_LOGI(TAG, "Assets download completed, total written: %u bytes, total sectors erased: %u", 
              total_written, current_sector);
 
+    if (dual_slot()) {
+        return SwapSlots();
+    }
+
     // 重新初始化资源分区
     if (!InitializePartition()) {
         ESP_LOGE(TAG, "Failed to re-initialize assets partition");
@@ -4,20 +4,27 @@
 #include <string>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <cJSON.h>
 #include <esp_partition.h>
 #include <model_path.h>
-#include <map>
 #include <string>
 
 #if HAVE_LVGL
 #include <spi_flash_mmap.h>
 #endif
 
-struct Asset {
-    size_t size;
-    size_t offset;
+// Partition layout: |files 4u|checksum 4u|length 4u|mmap_assets_table x files|data|, the checksum and
+// length cover the table and data, each asset in data is prefixed with 0x5A5A. A compressed asset has
+// the prefix 0x5A43 and is stored as |inflated size 4u|raw deflate|, asset_size being the stored size.
+struct mmap_assets_table {
+    char asset_name[32];          /*!< Name of the asset */
+    uint32_t asset_size;          /*!< Size of the asset */
+    uint32_t asset_offset;        /*!< Offset of the asset */
+    uint16_t asset_width;         /*!< Width of the asset */
+    uint16_t asset_height;        /*!< Height of the asset */
 };
 
 class Assets {
@@ -30,10 +37,14 @@ public:
 
     bool Download(std::string url, std::function<void(int progress, size_t speed)> progress_callback);
     bool Apply();
+    // Thread safe, the locale sounds are looked up from whichever task plays them
     bool GetAssetData(const std::string& name, void*& ptr, size_t& size);
 
     inline bool partition_valid() const { return partition_valid_; }
     inline std::string default_assets_url() const { return default_assets_url_; }
+    // With an "assets_b" partition next to "assets" a download goes to the slot not in use, the
+    // device keeps running on the other one, and the slots swap once the new content is verified
+    inline bool dual_slot() const { return slots_[1] != nullptr; }
 
 private:
     Assets();
@@ -42,8 +53,11 @@ private:
 
     bool InitializePartition();
     void UnApplyPartition();
+    bool UseSlot(int slot);
+    bool SwapSlots();
     static bool FindPartition(Assets* assets);
     static bool LoadSrmodelsFromIndex(Assets* assets, cJSON* root = nullptr);
+    void ReportInPlace(const char* kind, const std::string& name, size_t size, size_t free_before);
   
     class AssetStrategy {
     public:
@@ -61,10 +75,34 @@ private:
         void UnApplyPartition(Assets* assets) override;
         bool GetAssetData(Assets* assets, const std::string& name, void*& ptr, size_t& size) override;
     private:
+        // A mapped part of the partition, whole 64 KB MMU pages
+        struct MappedWindow {
+            size_t offset;
+            size_t size;
+            const char* data;
+            esp_partition_mmap_handle_t handle;
+        };
+
         static uint32_t CalculateChecksum(const char* data, uint32_t length);
-        std::map<std::string, Asset> assets_;
-        esp_partition_mmap_handle_t mmap_handle_ = 0;
-        const char* mmap_root_ = nullptr;
+        static uint32_t CalculateChecksum(const esp_partition_t* partition, size_t offset, uint32_t length);
+        static std::string PartitionStamp(const esp_partition_t* partition, const char* root, uint32_t files);
+        const mmap_assets_table* FindAsset(const std::string& name) const;
+        const char* Map(const esp_partition_t* partition, size_t offset, size_t size);
+        bool Inflate(const mmap_assets_table* item, const char* data, void*& ptr, size_t& size);
+        // Points into the mapping, valid while it is
+        const mmap_assets_table* table_ = nullptr;
+        uint32_t table_files_ = 0;
+        bool table_sorted_ = false;
+        // The whole partition as one window, or when MMU pages are short one window per asset in use.
+        // Windows stay mapped until UnApplyPartition, the pointers handed out are kept by the themes.
+        std::vector<MappedWindow> windows_;
+        // Compressed assets inflated on first use, freed with the windows
+        struct InflatedAsset {
+            const mmap_assets_table* item;
+            char* data;
+            size_t size;
+        };
+        std::vector<InflatedAsset> inflated_;
         bool checksum_valid_ = false;
     };
     
@@ -76,14 +114,27 @@ private:
         bool GetAssetData(Assets* assets, const std::string& name, void*& ptr, size_t& size) override;
     };
     
+    static std::unique_ptr<AssetStrategy> CreateStrategy();
+
     // Strategy instance
     std::unique_ptr<AssetStrategy> strategy_;
+    // The slot in use before a swap, left mapped until reboot for the themes and speech models pointing into it
+    std::unique_ptr<AssetStrategy> retired_strategy_;
+    // Guards the mapped windows, recursive as the strategies look assets up while they initialize
+    std::recursive_mutex mutex_;
 
 protected:
     const esp_partition_t* partition_ = nullptr;
+    const esp_partition_t* slots_[2] = {};
+    int active_slot_ = 0;
     bool partition_valid_ = false;
+    // The audio service runs on the speech models of the retired slot, a swap does not replace them
+    bool models_pinned_ = false;
     std::string default_assets_url_;
     srmodel_list_t* models_list_ = nullptr;
+    // Totals of ReportInPlace, bytes used from flash and the RAM their descriptors took
+    size_t in_place_bytes_ = 0;
+    int in_place_ram_ = 0;
 };
 
 #endif
@@ -0,0 +1,428 @@
+#include "assets_delta.h"
+#include "assets.h"
+#include "board.h"
+#if CONFIG_OTA_COMPACT_VERSION_CHECK
+#include "gzip_stream.h"
+#endif
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
+#include <cJSON.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "AssetsDelta"
+
+#define ASSETS_HEADER_SIZE 12
+#define ASSETS_PREFIX_SIZE 2
+#define ASSETS_MAX_FILES 4096
+
+static std::string ToHex(const uint8_t* data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(size * 2);
+    for (size_t i = 0; i < size; i++) {
+        hex.push_back(digits[data[i] >> 4]);
+        hex.push_back(digits[data[i] & 0x0F]);
+    }
+    return hex;
+}
+
+AssetsDelta::AssetsDelta(const esp_partition_t* partition) : partition_(partition) {
+    sector_size_ = esp_partition_get_main_flash_sector_size();
+    sector_buffer_ = (char*)heap_caps_malloc(sector_size_, MALLOC_CAP_INTERNAL);
+}
+
+AssetsDelta::~AssetsDelta() {
+    heap_caps_free(sector_buffer_);
+}
+
+AssetsDelta::Result AssetsDelta::Update(const std::string& manifest_url, std::function<void(int progress, size_t speed)> progress_callback) {
+    if (sector_buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate sector buffer");
+        return kFailed;
+    }
+
+    std::vector<Entry> entries;
+    if (!LoadManifest(manifest_url, entries)) {
+        return kFailed;
+    }
+    std::vector<Entry> current;
+    if (!LoadTable(current)) {
+        ESP_LOGW(TAG, "No usable assets table in the partition");
+        return kFullDownload;
+    }
+
+    // Keep the entries that are unchanged and not in the way of the new table
+    uint32_t table_end = ASSETS_HEADER_SIZE + sizeof(mmap_assets_table) * entries.size();
+    size_t total = 0;
+    int kept = 0;
+    for (auto& entry : entries) {
+        auto it = std::find_if(current.begin(), current.end(), [&entry](const Entry& e) {
+            return e.name == entry.name && e.size == entry.size;
+        });
+        if (it != current.end() && it->position >= table_end && HashEntry(*it) == entry.sha256) {
+            entry.source = 0;
+            entry.position = it->position;
+            kept++;
+        } else {
+            entry.source = entry.position;
+            entry.position = 0;
+            total += ASSETS_PREFIX_SIZE + entry.size;
+        }
+    }
+    ESP_LOGI(TAG, "%d of %u assets unchanged, %u bytes to download", kept, entries.size(), total);
+
+    if (!Place(entries, table_end)) {
+        ESP_LOGW(TAG, "Changed assets do not fit in the free space");
+        return kFullDownload;
+    }
+
+    // The old table stops matching the content from the first write on, an interrupted update
+    // leaves a partition that fails its checksum and the next one fetches what does not hash right
+    size_t done = 0;
+    for (auto& entry : entries) {
+        if (entry.source != 0 && !Fetch(entry, done, total, progress_callback)) {
+            return kFailed;
+        }
+    }
+    if (!WriteTable(entries, table_end)) {
+        return kFailed;
+    }
+    ESP_LOGI(TAG, "Assets updated, %u bytes downloaded", total);
+    return kDone;
+}
+
+bool AssetsDelta::LoadManifest(const std::string& url, std::vector<Entry>& entries) {
+    auto network = Board::GetInstance().GetNetwork();
+    auto http = network->CreateHttp(0);
+#if CONFIG_OTA_COMPACT_VERSION_CHECK
+    http->SetHeader("Accept-Encoding", "gzip");
+#endif
+    if (!http->Open("GET", url)) {
+        ESP_LOGE(TAG, "Failed to open %s", url.c_str());
+        return false;
+    }
+    if (http->GetStatusCode() != 200) {
+        ESP_LOGE(TAG, "Failed to get manifest, status code: %d", http->GetStatusCode());
+        http->Close();
+        return false;
+    }
+#if CONFIG_OTA_COMPACT_VERSION_CHECK
+    std::string data;
+    if (!GzipStream::ReadAll(http.get(), data)) {
+        ESP_LOGE(TAG, "Failed to read manifest");
+        http->Close();
+        return false;
+    }
+#else
+    auto data = http->ReadAll();
+#endif
+    http->Close();
+
+    cJSON* root = cJSON_Parse(data.c_str());
+    if (root == nullptr) {
+        ESP_LOGE(TAG, "Failed to parse manifest");
+        return false;
+    }
+
+    bool ok = true;
+    auto image = cJSON_GetObjectItem(root, "url");
+    auto files = cJSON_GetObjectItem(root, "files");
+    if (!cJSON_IsString(image) || !cJSON_IsArray(files) || cJSON_GetArraySize(files) > ASSETS_MAX_FILES) {
+        ESP_LOGE(TAG, "Invalid manifest");
+        ok = false;
+    } else {
+        // A relative url is next to the manifest
+        image_url_ = image->valuestring;
+        if (image_url_.find("://") == std::string::npos) {
+            image_url_ = url.substr(0, url.rfind('/') + 1) + image_url_;
+        }
+        cJSON* item;
+        cJSON_ArrayForEach(item, files) {
+            auto name = cJSON_GetObjectItem(item, "name");
+            auto offset = cJSON_GetObjectItem(item, "offset");
+            auto size = cJSON_GetObjectItem(item, "size");
+            auto width = cJSON_GetObjectItem(item, "width");
+            auto height = cJSON_GetObjectItem(item, "height");
+            auto sha256 = cJSON_GetObjectItem(item, "sha256");
+            if (!cJSON_IsString(name) || !cJSON_IsNumber(offset) || !cJSON_IsNumber(size) || !cJSON_IsString(sha256)
+                || strlen(name->valuestring) >= sizeof(mmap_assets_table::asset_name) || offset->valuedouble < ASSETS_HEADER_SIZE) {
+                ESP_LOGE(TAG, "Invalid manifest entry");
+                ok = false;
+                break;
+            }
+            entries.push_back(Entry{
+                .name = name->valuestring,
+                .position = (uint32_t)offset->valuedouble,
+                .size = (uint32_t)size->valuedouble,
+                .width = (uint16_t)(cJSON_IsNumber(width) ? width->valueint : 0),
+                .height = (uint16_t)(cJSON_IsNumber(height) ? height->valueint : 0),
+                .sha256 = sha256->valuestring,
+            });
+        }
+    }
+    cJSON_Delete(root);
+    return ok;
+}
+
+bool AssetsDelta::LoadTable(std::vector<Entry>& entries) {
+    uint32_t header[3];
+    if (esp_partition_read(partition_, 0, header, sizeof(header)) != ESP_OK) {
+        return false;
+    }
+    uint32_t files = header[0];
+    uint32_t data_start = ASSETS_HEADER_SIZE + sizeof(mmap_assets_table) * files;
+    if (files == 0 || files > ASSETS_MAX_FILES || data_start > partition_->size) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < files; i++) {
+        mmap_assets_table item;
+        if (esp_partition_read(partition_, ASSETS_HEADER_SIZE + sizeof(item) * i, &item, sizeof(item)) != ESP_OK) {
+            return false;
+        }
+        item.asset_name[sizeof(item.asset_name) - 1] = '\0';
+        uint64_t end = (uint64_t)data_start + item.asset_offset + ASSETS_PREFIX_SIZE + item.asset_size;
+        if (end > partition_->size) {
+            continue;
+        }
+        entries.push_back(Entry{
+            .name = item.asset_name,
+            .position = data_start + item.asset_offset,
+            .size = item.asset_size,
+            .width = item.asset_width,
+            .height = item.asset_height,
+        });
+    }
+    return true;
+}
+
+// Hash of the content after the prefix, empty if the prefix is not there
+std::string AssetsDelta::HashEntry(const Entry& entry) {
+    uint8_t prefix[ASSETS_PREFIX_SIZE];
+    if (esp_partition_read(partition_, entry.position, prefix, sizeof(prefix)) != ESP_OK
+        || prefix[0] != 0x5A || (prefix[1] != 0x5A && prefix[1] != 0x43)) {
+        return "";
+    }
+
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    size_t offset = entry.position + ASSETS_PREFIX_SIZE;
+    size_t remaining = entry.size;
+    bool ok = true;
+    while (remaining > 0) {
+        size_t n = std::min(remaining, sector_size_);
+        if (esp_partition_read(partition_, offset, sector_buffer_, n) != ESP_OK) {
+            ok = false;
+            break;
+        }
+        mbedtls_sha256_update(&ctx, (const unsigned char*)sector_buffer_, n);
+        offset += n;
+        remaining -= n;
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+    return ok ? ToHex(digest, sizeof(digest)) : "";
+}
+
+// First fit of the changed entries, largest first, into the gaps between the kept ones
+bool AssetsDelta::Place(std::vector<Entry>& entries, uint32_t table_end) {
+    std::vector<std::pair<uint32_t, uint32_t>> used;
+    for (auto& entry : entries) {
+        if (entry.source == 0) {
+            used.emplace_back(entry.position, entry.position + ASSETS_PREFIX_SIZE + entry.size);
+        }
+    }
+    std::sort(used.begin(), used.end());
+
+    std::vector<std::pair<uint32_t, uint32_t>> gaps;
+    uint32_t start = table_end;
+    for (auto& [begin, end] : used) {
+        if (begin > start) {
+            gaps.emplace_back(start, begin);
+        }
+        start = std::max(start, end);
+    }
+    if (partition_->size > start) {
+        gaps.emplace_back(start, partition_->size);
+    }
+
+    std::vector<Entry*> changed;
+    for (auto& entry : entries) {
+        if (entry.source != 0) {
+            changed.push_back(&entry);
+        }
+    }
+    std::sort(changed.begin(), changed.end(), [](const Entry* a, const Entry* b) {
+        return a->size > b->size;
+    });
+    for (auto entry : changed) {
+        uint32_t length = ASSETS_PREFIX_SIZE + entry->size;
+        auto gap = std::find_if(gaps.begin(), gaps.end(), [length](const std::pair<uint32_t, uint32_t>& g) {
+            return g.second - g.first >= length;
+        });
+        if (gap == gaps.end()) {
+            return false;
+        }
+        entry->position = gap->first;
+        gap->first += length;
+    }
+    return true;
+}
+
+bool AssetsDelta::Fetch(const Entry& entry, size_t& done, size_t total,
+    std::function<void(int progress, size_t speed)>& progress_callback) {
+    size_t length = ASSETS_PREFIX_SIZE + entry.size;
+    auto network = Board::GetInstance().GetNetwork();
+    auto http = network->CreateHttp(0);
+    http->SetHeader("Range", "bytes=" + std::to_string(entry.source) + "-" + std::to_string(entry.source + length - 1));
+    if (!http->Open("GET", image_url_)) {
+        ESP_LOGE(TAG, "Failed to open %s", image_url_.c_str());
+        return false;
+    }
+    if (http->GetStatusCode() != 206 || http->GetBodyLength() != length) {
+        ESP_LOGE(TAG, "Range request for %s failed, status code: %d", entry.name.c_str(), http->GetStatusCode());
+        http->Close();
+        return false;
+    }
+
+    char* buffer = (char*)heap_caps_malloc(sector_size_, MALLOC_CAP_INTERNAL);
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate buffer");
+        http->Close();
+        return false;
+    }
+
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    size_t written = 0;
+    size_t recent_written = 0;
+    auto last_calc_time = esp_timer_get_time();
+    bool ok = true;
+    while (written < length) {
+        int ret = http->Read(buffer, std::min(sector_size_, length - written));
+        if (ret <= 0) {
+            ESP_LOGE(TAG, "Failed to read %s at %u", entry.name.c_str(), written);
+            ok = false;
+            break;
+        }
+        // The prefix is not part of the hash
+        size_t skip = written < ASSETS_PREFIX_SIZE ? std::min((size_t)ret, ASSETS_PREFIX_SIZE - written) : 0;
+        mbedtls_sha256_update(&ctx, (const unsigned char*)buffer + skip, ret - skip);
+        if (!Write(entry.position + written, buffer, ret)) {
+            ok = false;
+            break;
+        }
+        written += ret;
+        recent_written += ret;
+
+        if (esp_timer_get_time() - last_calc_time >= 1000000) {
+            if (progress_callback) {
+                progress_callback((done + written) * 100 / total, recent_written);
+            }
+            last_calc_time = esp_timer_get_time();
+            recent_written = 0;
+        }
+    }
+    http->Close();
+    heap_caps_free(buffer);
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+    if (ok && ToHex(digest, sizeof(digest)) != entry.sha256) {
+        ESP_LOGE(TAG, "SHA-256 mismatch for %s", entry.name.c_str());
+        ok = false;
+    }
+    done += written;
+    return ok;
+}
+
+bool AssetsDelta::WriteTable(const std::vector<Entry>& entries, uint32_t table_end) {
+    if (!Flush()) {
+        return false;
+    }
+
+    std::string table(table_end, '\0');
+    uint32_t data_end = table_end;
+    for (size_t i = 0; i < entries.size(); i++) {
+        auto& entry = entries[i];
+        auto item = (mmap_assets_table*)&table[ASSETS_HEADER_SIZE + sizeof(mmap_assets_table) * i];
+        strncpy(item->asset_name, entry.name.c_str(), sizeof(item->asset_name) - 1);
+        item->asset_size = entry.size;
+        item->asset_offset = entry.position - table_end;
+        item->asset_width = entry.width;
+        item->asset_height = entry.height;
+        data_end = std::max(data_end, entry.position + ASSETS_PREFIX_SIZE + entry.size);
+    }
+
+    // The checksum covers the gaps as well, whatever they hold
+    uint32_t checksum = 0;
+    for (size_t i = ASSETS_HEADER_SIZE; i < table.size(); i++) {
+        checksum += (uint8_t)table[i];
+    }
+    for (size_t offset = table_end; offset < data_end; ) {
+        size_t n = std::min(sector_size_, (size_t)data_end - offset);
+        if (esp_partition_read(partition_, offset, sector_buffer_, n) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read partition at %u", offset);
+            return false;
+        }
+        for (size_t i = 0; i < n; i++) {
+            checksum += (uint8_t)sector_buffer_[i];
+        }
+        offset += n;
+    }
+
+    uint32_t header[3] = { (uint32_t)entries.size(), checksum & 0xFFFF, data_end - ASSETS_HEADER_SIZE };
+    memcpy(&table[0], header, sizeof(header));
+    return Write(0, table.data(), table.size()) && Flush();
+}
+
+// Read-modify-write through one sector, what else is in the sectors touched is kept
+bool AssetsDelta::Write(size_t offset, const void* data, size_t size) {
+    auto bytes = (const char*)data;
+    while (size > 0) {
+        size_t sector = offset / sector_size_ * sector_size_;
+        if (sector != buffered_sector_) {
+            if (!Flush()) {
+                return false;
+            }
+            if (esp_partition_read(partition_, sector, sector_buffer_, sector_size_) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to read sector at %u", sector);
+                return false;
+            }
+            buffered_sector_ = sector;
+        }
+        size_t n = std::min(size, sector + sector_size_ - offset);
+        memcpy(sector_buffer_ + offset - sector, bytes, n);
+        sector_dirty_ = true;
+        offset += n;
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool AssetsDelta::Flush() {
+    if (sector_dirty_) {
+        esp_err_t err = esp_partition_erase_range(partition_, buffered_sector_, sector_size_);
+        if (err == ESP_OK) {
+            err = esp_partition_write(partition_, buffered_sector_, sector_buffer_, sector_size_);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write sector at %u: %s", buffered_sector_, esp_err_to_name(err));
+            return false;
+        }
+        sector_dirty_ = false;
+    }
+    // The buffer is reused for reads, it no longer holds the sector
+    buffered_sector_ = SIZE_MAX;
+    return true;
+}
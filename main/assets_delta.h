@@ -0,0 +1,64 @@
+#ifndef ASSETS_DELTA_H
+#define ASSETS_DELTA_H
+
+#include <esp_partition.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ * Differential update of the assets partition from a manifest written next to assets.bin by
+ * scripts/spiffs_assets: { "url", "size", "files": [{ "name", "offset", "size", "width", "height", "sha256" }] }
+ *
+ * Entries whose name, size and SHA-256 match what is in the partition stay where they are. The
+ * others are fetched from the image with Range requests and written into the free space between
+ * the kept ones, then the table and the header are rewritten. When the new entries do not fit,
+ * the caller falls back to downloading the whole image, which compacts the layout.
+ */
+class AssetsDelta {
+public:
+    enum Result {
+        kDone,
+        kFailed,
+        // The partition is untouched or of no use anymore, download image_url() in full
+        kFullDownload,
+    };
+
+    explicit AssetsDelta(const esp_partition_t* partition);
+    ~AssetsDelta();
+
+    Result Update(const std::string& manifest_url, std::function<void(int progress, size_t speed)> progress_callback);
+    const std::string& image_url() const { return image_url_; }
+
+private:
+    struct Entry {
+        std::string name;
+        uint32_t position;      // Absolute offset in the partition of the 0x5A5A prefix
+        uint32_t size;          // Without the prefix
+        uint16_t width;
+        uint16_t height;
+        std::string sha256;     // Hex, only set for manifest entries
+        uint32_t source = 0;    // Offset in the image to fetch from, 0 for kept entries
+    };
+
+    const esp_partition_t* partition_;
+    std::string image_url_;
+    char* sector_buffer_ = nullptr;
+    size_t sector_size_;
+    size_t buffered_sector_ = SIZE_MAX;
+    bool sector_dirty_ = false;
+
+    bool LoadManifest(const std::string& url, std::vector<Entry>& entries);
+    bool LoadTable(std::vector<Entry>& entries);
+    std::string HashEntry(const Entry& entry);
+    bool Place(std::vector<Entry>& entries, uint32_t table_end);
+    bool Fetch(const Entry& entry, size_t& done, size_t total,
+        std::function<void(int progress, size_t speed)>& progress_callback);
+    bool WriteTable(const std::vector<Entry>& entries, uint32_t table_end);
+    bool Write(size_t offset, const void* data, size_t size);
+    bool Flush();
+};
+
+#endif // ASSETS_DELTA_H
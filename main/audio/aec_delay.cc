@@ -0,0 +1,198 @@
+#include "aec_delay.h"
+#include "audio_kernels.h"
+#include "settings.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cmath>
+
+#define TAG "AecDelay"
+
+#define AEC_DELAY_EVENT_CAPTURED (1 << 0)
+// Sweep of the chirp, inside what small speakers play and the AFE runs at
+#define AEC_DELAY_CHIRP_LOW_HZ 300
+#define AEC_DELAY_CHIRP_HIGH_HZ 6000
+#define AEC_DELAY_CHIRP_AMPLITUDE 12000
+// The correlation peak has to stand out this many times above the mean, or the result is dropped
+#define AEC_DELAY_MIN_PEAK_RATIO 4
+// Correlated 16 kHz frames are scaled down by this shift, so a block of them sums in 32 bits
+#define AEC_DELAY_SAMPLE_SHIFT 4
+#define AEC_DELAY_BLOCK_FRAMES 256
+
+AecDelay::AecDelay() {
+    event_group_ = xEventGroupCreate();
+}
+
+AecDelay::~AecDelay() {
+    vEventGroupDelete(event_group_);
+}
+
+void AecDelay::Initialize(const std::string& input_format, int output_sample_rate) {
+    channels_ = input_format.size();
+    auto mic = input_format.find('M');
+    auto reference = input_format.find('R');
+    mic_channel_ = mic == std::string::npos ? 0 : (int)mic;
+    reference_channel_ = reference == std::string::npos ? -1 : (int)reference;
+    output_sample_rate_ = output_sample_rate;
+    if (!supported()) {
+        return;
+    }
+
+    // Linear sweep with a short fade at both ends, so it starts and stops without a click
+    size_t samples = output_sample_rate_ * AEC_DELAY_CHIRP_MS / 1000;
+    size_t fade = output_sample_rate_ / 200;
+    chirp_.resize(samples);
+    double duration = AEC_DELAY_CHIRP_MS / 1000.0;
+    double sweep = (AEC_DELAY_CHIRP_HIGH_HZ - AEC_DELAY_CHIRP_LOW_HZ) / duration;
+    for (size_t i = 0; i < samples; i++) {
+        double t = (double)i / output_sample_rate_;
+        double phase = 2 * M_PI * (AEC_DELAY_CHIRP_LOW_HZ * t + sweep * t * t / 2);
+        double gain = std::min({1.0, (double)i / fade, (double)(samples - i) / fade});
+        chirp_[i] = (int16_t)(std::sin(phase) * AEC_DELAY_CHIRP_AMPLITUDE * gain);
+    }
+    chirp_offset_ = chirp_.size();
+
+    Settings settings("audio", false);
+    int frames = settings.GetInt("aec_delay", -1);
+    if (frames >= 0) {
+        calibrated_ = true;
+        SetDelay(frames);
+        ESP_LOGI(TAG, "Reference delayed by %d ms", delay_ms());
+    }
+}
+
+void AecDelay::SetDelay(int frames) {
+    delay_frames_ = std::clamp(frames, 0, AEC_DELAY_MAX_MS * 16);
+    delay_line_.assign(delay_frames_, 0);
+    delay_position_ = 0;
+}
+
+void AecDelay::ProcessInput(std::vector<int16_t>& data) {
+    if (!supported()) {
+        return;
+    }
+    size_t frames = data.size() / channels_;
+    int pending = pending_delay_.exchange(-1);
+    if (pending >= 0) {
+        SetDelay(pending);
+    }
+    if (capturing_) {
+        size_t count = std::min(capture_size_ - capture_.size(), data.size());
+        capture_.insert(capture_.end(), data.begin(), data.begin() + count);
+        if (capture_.size() == capture_size_) {
+            capturing_ = false;
+            xEventGroupSetBits(event_group_, AEC_DELAY_EVENT_CAPTURED);
+        }
+        return;
+    }
+    if (delay_frames_ == 0) {
+        return;
+    }
+    int16_t* reference = data.data() + reference_channel_;
+    for (size_t i = 0; i < frames; i++, reference += channels_) {
+        int16_t delayed = delay_line_[delay_position_];
+        delay_line_[delay_position_] = *reference;
+        *reference = delayed;
+        if (++delay_position_ == delay_line_.size()) {
+            delay_position_ = 0;
+        }
+    }
+}
+
+bool AecDelay::ReadChirp(std::vector<int16_t>& pcm, size_t samples) {
+    size_t offset = chirp_offset_;
+    if (offset >= chirp_.size()) {
+        return false;
+    }
+    size_t count = std::min(samples, chirp_.size() - offset);
+    pcm.insert(pcm.end(), chirp_.begin() + offset, chirp_.begin() + offset + count);
+    chirp_offset_ = offset + count;
+    return true;
+}
+
+bool AecDelay::StartCalibration() {
+    if (!supported() || capturing_ || chirp_playing()) {
+        return false;
+    }
+    xEventGroupClearBits(event_group_, AEC_DELAY_EVENT_CAPTURED);
+    capture_size_ = 16 * AEC_DELAY_CAPTURE_MS * channels_;
+    capture_.clear();
+    capture_.reserve(capture_size_);
+    capturing_ = true;
+    chirp_offset_ = 0;
+    return true;
+}
+
+bool AecDelay::FinishCalibration(int& delay_ms) {
+    // The input task stopping would leave the recording short, which is a failure as well
+    auto bits = xEventGroupWaitBits(event_group_, AEC_DELAY_EVENT_CAPTURED, pdTRUE, pdTRUE,
+        pdMS_TO_TICKS(AEC_DELAY_CAPTURE_MS * 3));
+    if (!(bits & AEC_DELAY_EVENT_CAPTURED)) {
+        capturing_ = false;
+        ESP_LOGE(TAG, "Calibration: the microphone is not running");
+        return false;
+    }
+
+    int lag = 0;
+    bool ok = Measure(lag);
+    std::vector<int16_t>().swap(capture_);
+    if (!ok) {
+        return false;
+    }
+    // The input task swaps the delay line on its next read
+    int frames = std::clamp(lag - AEC_DELAY_MARGIN_MS * 16, 0, AEC_DELAY_MAX_MS * 16);
+    pending_delay_ = frames;
+    calibrated_ = true;
+    Settings settings("audio", true);
+    settings.SetInt("aec_delay", frames);
+    delay_ms = frames / 16;
+    ESP_LOGI(TAG, "Echo %d ms behind the reference, reference delayed by %d ms", lag / 16, delay_ms);
+    return true;
+}
+
+bool AecDelay::Measure(int& lag_frames) {
+    size_t frames = capture_.size() / channels_;
+    int max_lag = AEC_DELAY_MAX_MS * 16;
+    if (frames <= (size_t)max_lag + AEC_DELAY_BLOCK_FRAMES) {
+        return false;
+    }
+    std::vector<int16_t> mic(frames);
+    std::vector<int16_t> reference(frames);
+    AudioKernels::ExtractChannel(capture_.data(), mic.data(), frames, channels_, mic_channel_);
+    AudioKernels::ExtractChannel(capture_.data(), reference.data(), frames, channels_, reference_channel_);
+    for (size_t i = 0; i < frames; i++) {
+        mic[i] >>= AEC_DELAY_SAMPLE_SHIFT;
+        reference[i] >>= AEC_DELAY_SAMPLE_SHIFT;
+    }
+    if (AudioKernels::PeakAbs(reference.data(), frames) < (AEC_DELAY_CHIRP_AMPLITUDE >> AEC_DELAY_SAMPLE_SHIFT) / 16) {
+        ESP_LOGE(TAG, "Calibration: the chirp is missing from the reference channel");
+        return false;
+    }
+
+    // Echo lag = where the microphone matches the reference best, the reference never leads by more than max_lag
+    size_t length = frames - max_lag;
+    int best_lag = 0;
+    int64_t best = 0;
+    int64_t total = 0;
+    for (int lag = 0; lag <= max_lag; lag++) {
+        int64_t sum = 0;
+        for (size_t i = 0; i < length; i += AEC_DELAY_BLOCK_FRAMES) {
+            size_t block = std::min<size_t>(AEC_DELAY_BLOCK_FRAMES, length - i);
+            sum += AudioKernels::Dot(reference.data() + i, mic.data() + i + lag, block);
+        }
+        sum = std::abs(sum);
+        total += sum;
+        if (sum > best) {
+            best = sum;
+            best_lag = lag;
+        }
+    }
+    int64_t mean = total / (max_lag + 1);
+    if (best == 0 || best < mean * AEC_DELAY_MIN_PEAK_RATIO) {
+        ESP_LOGE(TAG, "Calibration: no clear echo, peak %lld mean %lld", best, mean);
+        return false;
+    }
+    lag_frames = best_lag;
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef AEC_DELAY_H
+#define AEC_DELAY_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Chirp played for the calibration and the input recorded around it, at 16 kHz
+#define AEC_DELAY_CHIRP_MS 300
+#define AEC_DELAY_CAPTURE_MS 900
+// Longest echo delay looked for
+#define AEC_DELAY_MAX_MS 80
+// The reference is left this far ahead of the echo, the AEC filter has to start before it
+#define AEC_DELAY_MARGIN_MS 2
+
+/**
+ * AecDelay - Lines up the playback reference channel with the microphone for the device AEC
+ *
+ * The codec's reference channel leaves the DMA a codec and buffer latency before the echo of
+ * the same sound reaches the microphone. Delaying the reference by that much lets the AEC
+ * filter cover only the room, so it converges faster and a shorter one does.
+ *
+ * Calibrate() plays a chirp through the sound mixer input, records the input while it plays and
+ * cross-correlates the microphone with the reference channel. The delay is kept in Settings
+ * ("audio", "aec_delay" in 16 kHz frames) and applied to every input read from then on.
+ */
+class AecDelay {
+public:
+    AecDelay();
+    ~AecDelay();
+
+    // input_format as from AudioCodec::GetInputFormat(), 'M' microphones and 'R' references
+    void Initialize(const std::string& input_format, int output_sample_rate);
+    inline bool supported() const { return reference_channel_ >= 0; }
+    inline bool calibrated() const { return calibrated_; }
+    inline int delay_ms() const { return delay_frames_ / 16; }
+
+    // Input task, interleaved 16 kHz frames: recorded while calibrating, then the reference is delayed
+    void ProcessInput(std::vector<int16_t>& data);
+    // Decoder task, appends the next samples of the chirp at the output rate, false once it is played
+    bool ReadChirp(std::vector<int16_t>& pcm, size_t samples);
+    inline bool chirp_playing() const { return chirp_offset_ < chirp_.size(); }
+
+    // Arms the recording and the chirp, the caller wakes the decoder task to play it
+    bool StartCalibration();
+    // Blocks until the recording is complete, measures, stores and applies the delay
+    bool FinishCalibration(int& delay_ms);
+
+private:
+    EventGroupHandle_t event_group_ = nullptr;
+    int channels_ = 1;
+    int mic_channel_ = 0;
+    int reference_channel_ = -1;
+    int output_sample_rate_ = 16000;
+    bool calibrated_ = false;
+
+    // Reference delay line, input task only, a new delay is handed over through pending_delay_
+    std::atomic<int> pending_delay_{-1};
+    std::atomic<int> delay_frames_{0};
+    std::vector<int16_t> delay_line_;
+    size_t delay_position_ = 0;
+
+    std::vector<int16_t> chirp_;
+    std::atomic<size_t> chirp_offset_{0};
+    std::vector<int16_t> capture_;
+    size_t capture_size_ = 0;
+    std::atomic<bool> capturing_{false};
+
+    void SetDelay(int frames);
+    bool Measure(int& lag_frames);
+};
+
+#endif // AEC_DELAY_H
@@ -0,0 +1,67 @@
+#ifndef AUDIO_BUFFER_POOL_H
+#define AUDIO_BUFFER_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * A fixed-capacity free list of heap objects.
+ *
+ * Objects are allocated once and then recycled, so the buffers they own (e.g. the
+ * payload vector of an AudioStreamPacket) keep their capacity between frames and the
+ * steady-state audio path does not touch the heap.
+ *
+ * Acquire() never fails: when the free list is empty a new object is allocated and
+ * counted as a miss. Release() puts the object back, or frees it if the pool is full.
+ * Objects that are dropped without Release() are simply freed by their unique_ptr.
+ */
+template <typename T>
+class AudioBufferPool {
+public:
+    explicit AudioBufferPool(size_t capacity) : capacity_(capacity) {
+        free_list_.reserve(capacity_);
+        for (size_t i = 0; i < capacity_; i++) {
+            free_list_.push_back(std::make_unique<T>());
+        }
+    }
+
+    std::unique_ptr<T> Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_list_.empty()) {
+                auto object = std::move(free_list_.back());
+                free_list_.pop_back();
+                hits_++;
+                return object;
+            }
+            misses_++;
+        }
+        return std::make_unique<T>();
+    }
+
+    void Release(std::unique_ptr<T> object) {
+        if (object == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_list_.size() < capacity_) {
+            free_list_.push_back(std::move(object));
+        }
+    }
+
+    size_t capacity() const { return capacity_; }
+    uint32_t hits() const { return hits_; }
+    uint32_t misses() const { return misses_; }
+
+private:
+    const size_t capacity_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<T>> free_list_;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+};
+
+#endif // AUDIO_BUFFER_POOL_H
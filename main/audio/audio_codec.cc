@@ -1,6 +1,7 @@
 #include "audio_codec.h"
 #include "board.h"
 #include "settings.h"
+#include "playback_clock.h"
 
 #include <esp_log.h>
 #include <cstring>
@@ -14,18 +15,6 @@ AudioCodec::AudioCodec() {
 AudioCodec::~AudioCodec() {
 }
 
-void AudioCodec::OutputData(std::vector<int16_t>& data) {
-    Write(data.data(), data.size());
-}
-
-bool AudioCodec::InputData(std::vector<int16_t>& data) {
-    int samples = Read(data.data(), data.size());
-    if (samples > 0) {
-        return true;
-    }
-    return false;
-}
-
 void AudioCodec::Start() {
     Settings settings("audio", false);
     output_volume_ = settings.GetInt("output_volume", output_volume_);
@@ -37,6 +26,26 @@ void AudioCodec::Start() {
     ESP_LOGI(TAG, "Audio codec started");
 }
 
+bool AudioCodec::AttachPlaybackClock(PlaybackClock& clock) {
+    clock.SetSampleRates(output_sample_rate_, input_sample_rate_);
+    return clock.Attach(tx_handle_, rx_handle_);
+}
+
+std::string AudioCodec::GetInputFormat() const {
+    if (!input_format_.empty()) {
+        return input_format_;
+    }
+    int ref_num = input_reference_ ? 1 : 0;
+    std::string input_format(input_channels_ - ref_num, 'M');
+    input_format.append(ref_num, 'R');
+    return input_format;
+}
+
+int AudioCodec::GetPrimaryMicChannel() const {
+    auto position = GetInputFormat().find('M');
+    return position == std::string::npos ? 0 : (int)position;
+}
+
 void AudioCodec::SetOutputVolume(int volume) {
     output_volume_ = volume;
     ESP_LOGI(TAG, "Set output volume to %d", output_volume_);
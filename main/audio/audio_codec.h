@@ -11,8 +11,21 @@
 
 #include "board.h"
 
+class PlaybackClock;
+
+// I2S DMA depth of the latency profile, see AudioLatencyProfile in audio_service.h
+#if CONFIG_AUDIO_LATENCY_PROFILE_LOW_LATENCY
+#define AUDIO_CODEC_DMA_DESC_NUM 4
+#define AUDIO_CODEC_DMA_FRAME_NUM 120
+#elif CONFIG_AUDIO_LATENCY_PROFILE_POWER_SAVING
+#define AUDIO_CODEC_DMA_DESC_NUM 8
+#define AUDIO_CODEC_DMA_FRAME_NUM 480
+#else
 #define AUDIO_CODEC_DMA_DESC_NUM 6
 #define AUDIO_CODEC_DMA_FRAME_NUM 240
+#endif
+// Frames the DMA ring holds, so how long the input can go unread
+#define AUDIO_CODEC_DMA_RING_FRAMES (AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM)
 
 class AudioCodec {
 public:
@@ -24,9 +37,16 @@ public:
     virtual void EnableInput(bool enable);
     virtual void EnableOutput(bool enable);
 
-    virtual void OutputData(std::vector<int16_t>& data);
-    virtual bool InputData(std::vector<int16_t>& data);
+    // Called for every frame. Not virtual, so they inline into the audio service and the only
+    // dispatch per frame is the Read() / Write() of the codec
+    inline void OutputData(std::vector<int16_t>& data) { Write(data.data(), data.size()); }
+    inline bool InputData(std::vector<int16_t>& data) { return Read(data.data(), data.size()) > 0; }
     virtual void Start();
+    bool AttachPlaybackClock(PlaybackClock& clock);
+    // AFE input format of the interleaved input channels: M microphone, R playback reference, N unused
+    std::string GetInputFormat() const;
+    // The input channel that carries the first microphone, for consumers that only take one
+    int GetPrimaryMicChannel() const;
 
     inline bool duplex() const { return duplex_; }
     inline bool input_reference() const { return input_reference_; }
@@ -35,6 +55,8 @@ public:
     inline int input_channels() const { return input_channels_; }
     inline int output_channels() const { return output_channels_; }
     inline int output_volume() const { return output_volume_; }
+    // The audio service applies output_volume() to the samples, the codec has no volume control of its own
+    inline bool software_volume() const { return software_volume_; }
     inline float input_gain() const { return input_gain_; }
     inline bool input_enabled() const { return input_enabled_; }
     inline bool output_enabled() const { return output_enabled_; }
@@ -47,9 +69,12 @@ protected:
     bool input_reference_ = false;
     bool input_enabled_ = false;
     bool output_enabled_ = false;
+    bool software_volume_ = false;
     int input_sample_rate_ = 0;
     int output_sample_rate_ = 0;
     int input_channels_ = 1;
+    // Set by codecs whose channels are not the microphones followed by the reference
+    std::string input_format_;
     int output_channels_ = 1;
     int output_volume_ = 70;
     float input_gain_ = 0.0;
@@ -0,0 +1,151 @@
+#include "audio_injection.h"
+#include "application.h"
+#include "board.h"
+#include "device_state_machine.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cJSON.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "AudioInjection"
+
+void AudioInjection::Start(DeviceStateMachine& state_machine) {
+    run_timer_ = TimerWheel::GetInstance().Create("audio_injection", []() {
+        Application::GetInstance().Schedule([]() {
+            AudioInjection::GetInstance().StartRun();
+        });
+    });
+    state_machine.AddStateChangeListener([this](DeviceState old_state, DeviceState new_state) {
+        OnStateChanged(new_state);
+    });
+    ESP_LOGI(TAG, "Injecting %s after %d ms idle", CONFIG_AUDIO_INJECTION_URL, CONFIG_AUDIO_INJECTION_INTERVAL_MS);
+}
+
+void AudioInjection::OnStateChanged(DeviceState new_state) {
+    Mark(kAudioInjectionState, new_state);
+    if (new_state == kDeviceStateSpeaking) {
+        playback_pending_ = true;
+    }
+
+    if (new_state != kDeviceStateIdle) {
+        TimerWheel::GetInstance().Stop(run_timer_);
+        return;
+    }
+    // Idle between the turns of a run keeps feeding
+    if (feeding_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (run_pending_report_) {
+        run_pending_report_ = false;
+        Application::GetInstance().Schedule([this]() {
+            SendReport();
+        });
+    }
+    TimerWheel::GetInstance().StartOnce(run_timer_, CONFIG_AUDIO_INJECTION_INTERVAL_MS * 1000ULL);
+}
+
+// 16 kHz mono 16-bit PCM, the whole file is kept in memory
+bool AudioInjection::Load() {
+    auto http = Board::GetInstance().GetNetwork()->CreateHttp(0);
+    if (!http->Open("GET", CONFIG_AUDIO_INJECTION_URL)) {
+        ESP_LOGE(TAG, "Failed to open %s", CONFIG_AUDIO_INJECTION_URL);
+        return false;
+    }
+    if (http->GetStatusCode() != 200) {
+        ESP_LOGE(TAG, "Failed to get %s, status code: %d", CONFIG_AUDIO_INJECTION_URL, http->GetStatusCode());
+        return false;
+    }
+    auto data = http->ReadAll();
+    http->Close();
+    if (data.size() < sizeof(int16_t)) {
+        ESP_LOGE(TAG, "Empty injection file");
+        return false;
+    }
+    pcm_.resize(data.size() / sizeof(int16_t));
+    memcpy(pcm_.data(), data.data(), pcm_.size() * sizeof(int16_t));
+    ESP_LOGI(TAG, "Loaded %u ms of audio", (unsigned)(pcm_.size() / 16));
+    return true;
+}
+
+void AudioInjection::StartRun() {
+    if (Application::GetInstance().GetDeviceState() != kDeviceStateIdle) {
+        return;
+    }
+    if (pcm_.empty() && !Load()) {
+        TimerWheel::GetInstance().StartOnce(run_timer_, CONFIG_AUDIO_INJECTION_INTERVAL_MS * 1000ULL);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_.clear();
+        start_us_ = esp_timer_get_time();
+        run_pending_report_ = true;
+    }
+    position_ = 0;
+    playback_pending_ = false;
+    feeding_ = true;
+    ESP_LOGI(TAG, "Run started");
+}
+
+void AudioInjection::Feed(std::vector<int16_t>& data, int channels) {
+    if (!feeding_.load(std::memory_order_acquire)) {
+        return;
+    }
+    size_t samples = data.size() / channels;
+    for (size_t i = 0; i < samples; i++) {
+        data[i * channels] = position_ < pcm_.size() ? pcm_[position_++] : 0;
+    }
+    if (position_ >= pcm_.size()) {
+        feeding_ = false;
+        Mark(kAudioInjectionEnd);
+    }
+}
+
+void AudioInjection::Mark(AudioInjectionEvent event, int value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!run_pending_report_ || events_.size() >= AUDIO_INJECTION_MAX_EVENTS) {
+        return;
+    }
+    events_.push_back({(uint32_t)((esp_timer_get_time() - start_us_) / 1000), event, value});
+}
+
+void AudioInjection::SendReport() {
+    static const char* const EVENT_NAMES[] = {"wake_word", "state", "playback", "abort", "end"};
+
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "samples", pcm_.size());
+    cJSON* events = cJSON_CreateArray();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& event : events_) {
+            cJSON* item = cJSON_CreateArray();
+            cJSON_AddItemToArray(item, cJSON_CreateNumber(event.time_ms));
+            cJSON_AddItemToArray(item, cJSON_CreateString(EVENT_NAMES[event.event]));
+            if (event.event == kAudioInjectionState) {
+                cJSON_AddItemToArray(item, cJSON_CreateString(DeviceStateMachine::GetStateName((DeviceState)event.value)));
+            }
+            cJSON_AddItemToArray(events, item);
+        }
+    }
+    cJSON_AddItemToObject(root, "events", events);
+    char* json = cJSON_PrintUnformatted(root);
+    std::string body(json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+
+    std::string url = CONFIG_AUDIO_INJECTION_URL;
+    url = url.substr(0, url.rfind('/') + 1) + "report";
+    auto http = Board::GetInstance().GetNetwork()->CreateHttp(0);
+    http->SetHeader("Content-Type", "application/json");
+    http->SetContent(std::move(body));
+    if (!http->Open("POST", url) || http->GetStatusCode() != 200) {
+        ESP_LOGW(TAG, "Failed to post the report to %s", url.c_str());
+        return;
+    }
+    http->Close();
+    ESP_LOGI(TAG, "Report sent");
+}
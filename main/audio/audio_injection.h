@@ -0,0 +1,89 @@
+#ifndef AUDIO_INJECTION_H
+#define AUDIO_INJECTION_H
+
+#include "device_state.h"
+#include "timer_wheel.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class DeviceStateMachine;
+
+// Events marked on the timeline of a run, in ms since the injection started
+enum AudioInjectionEvent {
+    kAudioInjectionWakeWord,
+    kAudioInjectionState,     // value is the new DeviceState
+    kAudioInjectionPlayback,  // First block written to the speaker after entering speaking
+    kAudioInjectionAbort,
+    kAudioInjectionEnd,       // The whole file has been fed
+};
+
+// Timeline entries kept per run, a run with more is cut short
+#define AUDIO_INJECTION_MAX_EVENTS 64
+
+/**
+ * AudioInjection - Feeds a known PCM file as the microphone input for latency regression runs
+ *
+ * The file is 16 kHz mono 16-bit PCM fetched once from CONFIG_AUDIO_INJECTION_URL. Every time the
+ * device has been idle for CONFIG_AUDIO_INJECTION_INTERVAL_MS, a run starts: the file replaces the
+ * microphone channel of the input while wake word detections, state changes, the first playback of
+ * each answer and aborts are marked on a timeline. Once the device is idle again after the file
+ * ended, the timeline is posted as JSON to the "report" path next to the file:
+ * {"samples":n,"events":[[ms,"wake_word"],[ms,"state","listening"],[ms,"playback"],...]}
+ *
+ * scripts/latency_mock_server.py serves the file, plays the server side of the conversation and
+ * turns the reports into wake-to-listen, end-of-speech-to-first-audio and barge-in latencies.
+ */
+class AudioInjection {
+public:
+    static AudioInjection& GetInstance() {
+        static AudioInjection instance;
+        return instance;
+    }
+
+    AudioInjection(const AudioInjection&) = delete;
+    AudioInjection& operator=(const AudioInjection&) = delete;
+
+    // Follows the state machine to start runs and send their reports
+    void Start(DeviceStateMachine& state_machine);
+
+    // Replaces the first channel of a 16 kHz input block while a run is feeding
+    void Feed(std::vector<int16_t>& data, int channels);
+    // Called after every speaker write, cheap unless an answer has just started
+    inline void OnOutput() {
+        if (playback_pending_.load(std::memory_order_relaxed)) {
+            playback_pending_ = false;
+            Mark(kAudioInjectionPlayback);
+        }
+    }
+    void Mark(AudioInjectionEvent event, int value = 0);
+
+private:
+    AudioInjection() = default;
+
+    struct Event {
+        uint32_t time_ms;
+        AudioInjectionEvent event;
+        int value;
+    };
+
+    std::vector<int16_t> pcm_;
+    std::atomic<bool> feeding_ = false;
+    std::atomic<bool> playback_pending_ = false;
+    size_t position_ = 0;
+    bool run_pending_report_ = false;
+    int64_t start_us_ = 0;
+    std::mutex mutex_;
+    std::vector<Event> events_;
+    TimerWheel::Handle run_timer_ = nullptr;
+
+    void OnStateChanged(DeviceState new_state);
+    bool Load();
+    void StartRun();
+    void SendReport();
+};
+
+#endif // AUDIO_INJECTION_H
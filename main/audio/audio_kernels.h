@@ -0,0 +1,118 @@
+#ifndef AUDIO_KERNELS_H
+#define AUDIO_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+/*
+ * Sample loops shared by the codecs, the audio processors and the wake word feeders.
+ *
+ * They are kept branch free over plain pointers, so the compiler can turn them into
+ * zero-overhead hardware loops and auto-vectorize where the target supports it. See
+ * "Sample Kernels" in README.md for why there is no esp-dsp path.
+ */
+namespace AudioKernels {
+
+// Copy one channel out of interleaved samples, out may be the same buffer as in
+inline void ExtractChannel(const int16_t* in, int16_t* out, size_t frames, int channels, int channel) {
+    in += channel;
+    for (size_t i = 0; i < frames; i++) {
+        out[i] = in[i * channels];
+    }
+}
+
+// Integer gain with saturation to +-INT16_MAX
+inline void ApplyGain(int16_t* data, size_t samples, int32_t gain) {
+    for (size_t i = 0; i < samples; i++) {
+        data[i] = (int16_t)std::clamp<int32_t>(data[i] * gain, -INT16_MAX, INT16_MAX);
+    }
+}
+
+// Widen to 32-bit I2S slots, factor is Q16 and at most 65536 so the product cannot overflow
+inline void ScaleToInt32(const int16_t* in, int32_t* out, size_t samples, int32_t factor) {
+    for (size_t i = 0; i < samples; i++) {
+        out[i] = int32_t(in[i]) * factor;
+    }
+}
+
+// Narrow 32-bit I2S slots with an arithmetic shift and saturation to +-INT16_MAX
+inline void ShiftToInt16(const int32_t* in, int16_t* out, size_t samples, int shift) {
+    for (size_t i = 0; i < samples; i++) {
+        out[i] = (int16_t)std::clamp<int32_t>(in[i] >> shift, -INT16_MAX, INT16_MAX);
+    }
+}
+
+// Linear ramp from full scale down to silence over the block
+inline void FadeOut(int16_t* data, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        data[i] = (int16_t)(int32_t(data[i]) * int32_t(samples - i) / int32_t(samples));
+    }
+}
+
+// Mean absolute amplitude, a cheap loudness measure for gating
+inline int32_t MeanAbs(const int16_t* data, size_t samples) {
+    if (samples == 0) {
+        return 0;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < samples; i++) {
+        sum += (uint32_t)std::abs((int32_t)data[i]);
+    }
+    return (int32_t)(sum / samples);
+}
+
+// Root mean square and peak of every stride-th sample, for level meters
+inline void Envelope(const int16_t* data, size_t frames, int stride, int32_t* rms, int32_t* peak) {
+    uint64_t sum = 0;
+    int32_t max_abs = 0;
+    for (size_t i = 0; i < frames; i++) {
+        int32_t sample = data[i * stride];
+        sum += (uint32_t)(sample * sample);
+        max_abs = std::max(max_abs, std::abs(sample));
+    }
+    *rms = frames == 0 ? 0 : (int32_t)sqrtf((float)(sum / frames));
+    *peak = max_abs;
+}
+
+// Largest absolute sample value
+inline int32_t PeakAbs(const int16_t* data, size_t samples) {
+    int32_t peak = 0;
+    for (size_t i = 0; i < samples; i++) {
+        peak = std::max(peak, std::abs((int32_t)data[i]));
+    }
+    return peak;
+}
+
+// Gain ramp in Q23, at most 1 << 23, added step per sample, with saturation to +-INT16_MAX
+inline void ApplyGainRamp(int16_t* data, size_t samples, int32_t gain, int32_t step) {
+    for (size_t i = 0; i < samples; i++) {
+        int32_t sample = (int32_t(data[i]) * (gain >> 8) + (1 << 14)) >> 15;
+        data[i] = (int16_t)std::clamp<int32_t>(sample, -INT16_MAX, INT16_MAX);
+        gain += step;
+    }
+}
+
+// Q15 dot product of taps coefficients with every stride-th sample, rounded and saturated to int16
+inline int16_t DotQ15(const int16_t* coefficients, const int16_t* data, int taps, int stride) {
+    int32_t sum = 1 << 14;
+    for (int i = 0; i < taps; i++) {
+        sum += int32_t(coefficients[i]) * data[i * stride];
+    }
+    return (int16_t)std::clamp<int32_t>(sum >> 15, INT16_MIN, INT16_MAX);
+}
+
+// Plain dot product, the caller keeps n small enough for the products to sum in 32 bits
+inline int32_t Dot(const int16_t* a, const int16_t* b, size_t n) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += int32_t(a[i]) * b[i];
+    }
+    return sum;
+}
+
+} // namespace AudioKernels
+
+#endif // AUDIO_KERNELS_H
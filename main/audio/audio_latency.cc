@@ -0,0 +1,105 @@
+#include "audio_latency.h"
+
+#include <esp_log.h>
+#include <cJSON.h>
+#include <algorithm>
+
+static const char* const kStageNames[kAudioLatencyStageCount] = {
+    "input_read",
+    "process",
+    "encode_queue",
+    "encode",
+    "send_queue",
+    "send",
+    "receive",
+    "decode",
+    "playback_queue",
+    "output_write",
+};
+
+const char* AudioLatencyStats::StageName(AudioLatencyStage stage) {
+    return kStageNames[stage];
+}
+
+void AudioLatencyStats::RecordSample(AudioLatencyStage stage, int64_t us) {
+    auto& histogram = histograms_[stage];
+    uint32_t value = (uint32_t)std::clamp<int64_t>(us, 0, UINT32_MAX);
+    uint32_t ms = value / 1000;
+    int bucket = 0;
+    while (bucket < AUDIO_LATENCY_BUCKETS - 1 && ms >= (1u << bucket)) {
+        bucket++;
+    }
+    histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    histogram.total_us.fetch_add(value, std::memory_order_relaxed);
+    uint32_t max = histogram.max_us.load(std::memory_order_relaxed);
+    while (value > max && !histogram.max_us.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+void AudioLatencyStats::Reset() {
+    for (auto& histogram : histograms_) {
+        for (auto& bucket : histogram.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.max_us.store(0, std::memory_order_relaxed);
+        histogram.total_us.store(0, std::memory_order_relaxed);
+    }
+}
+
+int AudioLatencyStats::Percentile(const Histogram& histogram, int percent) const {
+    uint32_t count = histogram.count.load(std::memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t target = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+    uint32_t seen = 0;
+    for (int i = 0; i < AUDIO_LATENCY_BUCKETS - 1; i++) {
+        seen += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            return 1 << i;
+        }
+    }
+    return -1;
+}
+
+void AudioLatencyStats::Log(const char* tag) const {
+    for (int i = 0; i < kAudioLatencyStageCount; i++) {
+        auto& histogram = histograms_[i];
+        uint32_t count = histogram.count.load(std::memory_order_relaxed);
+        if (count == 0) {
+            continue;
+        }
+        ESP_LOGI(tag, "Latency %-14s n=%lu avg=%lu us max=%lu us p50<%d p90<%d p99<%d ms", kStageNames[i],
+            count, (uint32_t)(histogram.total_us.load(std::memory_order_relaxed) / count),
+            histogram.max_us.load(std::memory_order_relaxed),
+            Percentile(histogram, 50), Percentile(histogram, 90), Percentile(histogram, 99));
+    }
+}
+
+std::string AudioLatencyStats::ToJson() const {
+    cJSON* root = cJSON_CreateObject();
+    for (int i = 0; i < kAudioLatencyStageCount; i++) {
+        auto& histogram = histograms_[i];
+        uint32_t count = histogram.count.load(std::memory_order_relaxed);
+        cJSON* stage = cJSON_CreateObject();
+        cJSON_AddNumberToObject(stage, "count", count);
+        cJSON_AddNumberToObject(stage, "avg_us", count > 0 ? histogram.total_us.load(std::memory_order_relaxed) / count : 0);
+        cJSON_AddNumberToObject(stage, "max_us", histogram.max_us.load(std::memory_order_relaxed));
+        cJSON_AddNumberToObject(stage, "p50_ms", Percentile(histogram, 50));
+        cJSON_AddNumberToObject(stage, "p90_ms", Percentile(histogram, 90));
+        cJSON_AddNumberToObject(stage, "p99_ms", Percentile(histogram, 99));
+        cJSON* buckets = cJSON_CreateArray();
+        for (auto& bucket : histogram.buckets) {
+            cJSON_AddItemToArray(buckets, cJSON_CreateNumber(bucket.load(std::memory_order_relaxed)));
+        }
+        cJSON_AddItemToObject(stage, "buckets", buckets);
+        cJSON_AddItemToObject(root, kStageNames[i], stage);
+    }
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
+}
@@ -0,0 +1,63 @@
+#ifndef AUDIO_LATENCY_H
+#define AUDIO_LATENCY_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Stages of the uplink (microphone to network) and downlink (network to speaker) paths
+enum AudioLatencyStage {
+    kAudioLatencyInputRead = 0,     // I2S read of one input block
+    kAudioLatencyProcess,           // Latest microphone read to audio processor output
+    kAudioLatencyEncodeQueue,       // Waiting in the encode queue
+    kAudioLatencyEncode,            // Opus encode
+    kAudioLatencySendQueue,         // Waiting in the send queue
+    kAudioLatencySend,              // Protocol::SendAudio / SendAudioBatch
+    kAudioLatencyReceive,           // OnIncomingAudio to decode, jitter buffer included
+    kAudioLatencyDecode,            // Opus decode and resampling
+    kAudioLatencyPlaybackQueue,     // Waiting in the playback queue
+    kAudioLatencyOutputWrite,       // I2S write of one mixed block
+    kAudioLatencyStageCount,
+};
+
+// Bucket i counts samples below 2^i ms, the last one everything longer
+#define AUDIO_LATENCY_BUCKETS 12
+
+/*
+ * Per-stage latency histograms of the audio pipeline.
+ *
+ * Record() is called by the pipeline tasks with the time a frame spent in one stage, and
+ * compiles to nothing unless CONFIG_USE_AUDIO_LATENCY_STATS is set. The counters are relaxed
+ * atomics, a snapshot taken while frames are recorded may be off by a few samples.
+ */
+class AudioLatencyStats {
+public:
+    inline void Record(AudioLatencyStage stage, int64_t us) {
+#if CONFIG_USE_AUDIO_LATENCY_STATS
+        RecordSample(stage, us);
+#endif
+    }
+
+    void Reset();
+    // One line per stage with samples: count, average, max and the 50th / 90th / 99th percentile bounds
+    void Log(const char* tag) const;
+    // {"stage": {"count", "avg_us", "max_us", "p50_ms", "p90_ms", "p99_ms", "buckets": [...]}, ...}
+    std::string ToJson() const;
+
+    static const char* StageName(AudioLatencyStage stage);
+
+private:
+    struct Histogram {
+        std::atomic<uint32_t> buckets[AUDIO_LATENCY_BUCKETS] = {};
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint32_t> max_us{0};
+        std::atomic<uint64_t> total_us{0};
+    };
+    Histogram histograms_[kAudioLatencyStageCount];
+
+    void RecordSample(AudioLatencyStage stage, int64_t us);
+    // Upper bound in ms of the bucket holding the given percentile, -1 if open-ended
+    int Percentile(const Histogram& histogram, int percent) const;
+};
+
+#endif // AUDIO_LATENCY_H
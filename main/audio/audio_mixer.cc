@@ -0,0 +1,102 @@
+#include "audio_mixer.h"
+#include <algorithm>
+#include <cstring>
+
+#define AUDIO_MIXER_UNITY_GAIN (1 << 15)
+
+static_assert(kAudioMixerStreamCount <= 32, "ducked_by is a 32 bit mask");
+
+static int32_t PercentToGain(int percent) {
+    return std::clamp(percent, 0, 200) * AUDIO_MIXER_UNITY_GAIN / 100;
+}
+
+void AudioMixer::Initialize(int sample_rate) {
+    int ramp_samples = std::max(sample_rate / 1000 * AUDIO_MIXER_RAMP_MS, 1);
+    ramp_step_ = std::max((AUDIO_MIXER_UNITY_GAIN << 8) / ramp_samples, 1);
+}
+
+void AudioMixer::SetGain(AudioMixerStream stream, int percent) {
+    streams_[stream].gain = PercentToGain(percent);
+}
+
+void AudioMixer::SetDucking(AudioMixerStream stream, int percent, uint32_t ducked_by) {
+    streams_[stream].duck_gain = PercentToGain(percent);
+    streams_[stream].ducked_by = ducked_by & ~(1u << stream);
+}
+
+void AudioMixer::Mix(const int16_t* const (&inputs)[kAudioMixerStreamCount], size_t samples, int16_t* output) {
+    uint32_t playing = 0;
+    for (int i = 0; i < kAudioMixerStreamCount; i++) {
+        if (inputs[i] != nullptr) {
+            playing |= 1u << i;
+        }
+    }
+
+    // Work out the target gain of every stream, and whether anything has to be scaled at all
+    int32_t targets[kAudioMixerStreamCount];
+    int active = 0;
+    bool unity = true;
+    for (int i = 0; i < kAudioMixerStreamCount; i++) {
+        auto& stream = streams_[i];
+        targets[i] = (playing & stream.ducked_by) ? stream.duck_gain.load() * stream.gain.load() / AUDIO_MIXER_UNITY_GAIN
+                                                  : stream.gain.load();
+        if (inputs[i] == nullptr) {
+            // Silent streams jump to their target, they fade in from there when they start
+            stream.current_gain = targets[i] << 8;
+            continue;
+        }
+        active++;
+        if (stream.current_gain != AUDIO_MIXER_UNITY_GAIN << 8 || targets[i] != AUDIO_MIXER_UNITY_GAIN) {
+            unity = false;
+        }
+    }
+
+    if (active == 0) {
+        memset(output, 0, samples * sizeof(int16_t));
+        return;
+    }
+    if (active == 1 && unity) {
+        for (int i = 0; i < kAudioMixerStreamCount; i++) {
+            if (inputs[i] != nullptr) {
+                memcpy(output, inputs[i], samples * sizeof(int16_t));
+            }
+        }
+        return;
+    }
+
+    accumulator_.assign(samples, 0);
+    int32_t* acc = accumulator_.data();
+    for (int i = 0; i < kAudioMixerStreamCount; i++) {
+        const int16_t* in = inputs[i];
+        if (in == nullptr) {
+            continue;
+        }
+        auto& stream = streams_[i];
+        int32_t target = targets[i] << 8;
+        size_t n = 0;
+        // Ramp towards the target gain first, then scale the rest with a constant gain
+        while (n < samples && stream.current_gain != target) {
+            if (stream.current_gain < target) {
+                stream.current_gain = std::min(stream.current_gain + ramp_step_, target);
+            } else {
+                stream.current_gain = std::max(stream.current_gain - ramp_step_, target);
+            }
+            acc[n] += (in[n] * (stream.current_gain >> 8)) >> 15;
+            n++;
+        }
+        int32_t gain = stream.current_gain >> 8;
+        if (gain == AUDIO_MIXER_UNITY_GAIN) {
+            for (; n < samples; n++) {
+                acc[n] += in[n];
+            }
+        } else {
+            for (; n < samples; n++) {
+                acc[n] += (in[n] * gain) >> 15;
+            }
+        }
+    }
+
+    for (size_t n = 0; n < samples; n++) {
+        output[n] = (int16_t)std::clamp<int32_t>(acc[n], INT16_MIN, INT16_MAX);
+    }
+}
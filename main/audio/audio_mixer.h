@@ -0,0 +1,54 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Inputs of the output mixer, a lower index has the higher priority
+enum AudioMixerStream {
+    kAudioMixerStreamSound = 0,
+    kAudioMixerStreamTts,
+    kAudioMixerStreamMusic,
+    kAudioMixerStreamCount,
+};
+
+// Gain changes (ducking) are ramped over this time to avoid clicks
+#define AUDIO_MIXER_RAMP_MS 20
+
+/*
+ * Software mixer in front of AudioCodec::OutputData.
+ *
+ * Every stream has a gain, and a ducking gain that applies while any of the streams in its
+ * ducked_by mask is playing. The inputs are scaled with Q15 gains and summed in int32, then
+ * saturated back to int16. A single stream at unity gain is copied as is. That is the usual case
+ * (TTS alone), so the summing loop only runs while sounds or music overlap.
+ *
+ * Mix() is only called by the output task, the gains may be changed from any task.
+ */
+class AudioMixer {
+public:
+    void Initialize(int sample_rate);
+    void SetGain(AudioMixerStream stream, int percent);
+    void SetDucking(AudioMixerStream stream, int percent, uint32_t ducked_by);
+
+    // inputs[i] holds samples of stream i, or nullptr if the stream has nothing to play
+    void Mix(const int16_t* const (&inputs)[kAudioMixerStreamCount], size_t samples, int16_t* output);
+
+private:
+    struct Stream {
+        std::atomic<int32_t> gain{1 << 15};
+        std::atomic<int32_t> duck_gain{1 << 15};
+        std::atomic<uint32_t> ducked_by{0};
+        // Gain applied right now, Q23 so the ramp steps do not round to zero
+        int32_t current_gain = 1 << 23;
+    };
+
+    std::array<Stream, kAudioMixerStreamCount> streams_;
+    std::vector<int32_t> accumulator_;
+    int32_t ramp_step_ = 1;
+};
+
+#endif // AUDIO_MIXER_H
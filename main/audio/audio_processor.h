@@ -21,6 +21,8 @@ public:
     virtual void OnVadStateChange(std::function<void(bool speaking)> callback) = 0;
     virtual size_t GetFeedSize() = 0;
     virtual void EnableDeviceAec(bool enable) = 0;
+    // Noise suppression is on by default where the processor has it, may be called before Initialize()
+    virtual void EnableNoiseSuppression(bool enable) {}
 };
 
 #endif
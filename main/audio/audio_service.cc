@@ -1,25 +1,36 @@
 #include "audio_service.h"
+#include "audio_kernels.h"
+#include "metrics.h"
+#include "trace.h"
+#include "deferred_log.h"
+#include "task_factory.h"
+#include "opus_packet.h"
+#include "heap_monitor.h"
+#include "settings.h"
+#include "benchmark.h"
+#if CONFIG_USE_AUDIO_INJECTION
+#include "audio_injection.h"
+#endif
 #include <esp_log.h>
+#include <esp_app_desc.h>
+#include <esp_cpu.h>
 #include <cstring>
-
-#define RATE_CVT_CFG(_src_rate, _dest_rate, _channel)        \
-    (esp_ae_rate_cvt_cfg_t)                                  \
-    {                                                        \
-        .src_rate        = (uint32_t)(_src_rate),            \
-        .dest_rate       = (uint32_t)(_dest_rate),           \
-        .channel         = (uint8_t)(_channel),              \
-        .bits_per_sample = ESP_AUDIO_BIT16,                  \
-        .complexity      = 2,                                \
-        .perf_type       = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,  \
-    }
-
-#define OPUS_DEC_CFG(_sample_rate, _frame_duration_ms)                                                    \
-    (esp_opus_dec_cfg_t)                                                                                  \
-    {                                                                                                     \
-        .sample_rate    = (uint32_t)(_sample_rate),                                                       \
-        .channel        = ESP_AUDIO_MONO,                                                                 \
-        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(_frame_duration_ms),  \
-        .self_delimited = false,                                                                          \
+#include <algorithm>
+
+// Stored before the encoder profile runs and replaced once it finished
+#define OPUS_PROFILE_PENDING_SUFFIX "/pending"
+// Stack in bytes a profiled complexity must leave free on the encoder task
+#define OPUS_PROFILE_STACK_MARGIN 1024
+
+// Opened for the longest packet, the decoder wants an output buffer that holds one
+#define OPUS_DEC_MAX_FRAME_MS 120
+#define OPUS_DEC_CFG(_sample_rate)                                  \
+    (esp_opus_dec_cfg_t)                                            \
+    {                                                               \
+        .sample_rate    = (uint32_t)(_sample_rate),                 \
+        .channel        = ESP_AUDIO_MONO,                           \
+        .frame_duration = ESP_OPUS_DEC_FRAME_DURATION_120_MS,       \
+        .self_delimited = false,                                    \
     }
 
 #if CONFIG_USE_AUDIO_PROCESSOR
@@ -37,8 +48,25 @@
 
 #define TAG "AudioService"
 
+struct AudioLatencySettings {
+    int input_read_ms;
+    size_t playback_queue_depth;
+};
+
+static AudioLatencySettings GetLatencySettings(AudioLatencyProfile profile) {
+    switch (profile) {
+        case kAudioLatencyProfileLowLatency:
+            return {10, 1};
+        case kAudioLatencyProfilePowerSaving:
+            return {30, 4};
+        default:
+            return {10, 2};
+    }
+}
+
 AudioService::AudioService() {
     event_group_ = xEventGroupCreate();
+    SetLatencyProfile(AUDIO_DEFAULT_LATENCY_PROFILE);
 }
 
 AudioService::~AudioService() {
@@ -48,47 +76,55 @@ AudioService::~AudioService() {
     if (opus_encoder_ != nullptr) {
         esp_opus_enc_close(opus_encoder_);
     }
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
-    }
-    if (input_resampler_ != nullptr) {
-        esp_ae_rate_cvt_close(input_resampler_);
-    }
-    if (output_resampler_ != nullptr) {
-        esp_ae_rate_cvt_close(output_resampler_);
+    for (auto& entry : decoder_cache_) {
+        if (entry.decoder != nullptr) {
+            esp_opus_dec_close(entry.decoder);
+        }
     }
 }
 
 void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
+#if CONFIG_USE_SERVER_AEC
+    codec_->AttachPlaybackClock(playback_clock_);
+#endif
 
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
-    } else {
-        decoder_sample_rate_ = codec->output_sample_rate();
-        decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        decoder_frame_size_ = decoder_sample_rate_ / 1000 * OPUS_FRAME_DURATION_MS;
-    }
-    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
-    ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
-    if (opus_encoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
-    } else {
-        encoder_sample_rate_ = 16000;
-        encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
-        encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+    SetDecodeSampleRate(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+    OpenEncoder(requested_encoder_config_);
+    sound_player_.Initialize(codec->output_sample_rate());
+    // Decoded again the next time they are played
+    HeapMonitor::GetInstance().AddReleaser("sound_cache", [this](HeapPressure pressure) {
+        return sound_player_.ClearCache();
+    });
+    aec_delay_.Initialize(codec->GetInputFormat(), codec->output_sample_rate());
+    mixer_.Initialize(codec->output_sample_rate());
+    output_gain_.Initialize(codec->output_sample_rate());
+    jitter_buffer_.SetPrerollMs(CONFIG_AUDIO_TTS_PREROLL_MS);
+    if (DECODE_AHEAD_MS > 0) {
+        size_t samples_per_ms = codec->output_sample_rate() / 1000;
+        decode_ahead_reserve_ = samples_per_ms * DECODE_AHEAD_RESERVE_MS;
+        if (!decode_ahead_.Allocate(samples_per_ms * DECODE_AHEAD_MS + decode_ahead_reserve_)) {
+            ESP_LOGW(TAG, "Failed to allocate the decode-ahead buffer, decoding %d frames ahead only",
+                MAX_PLAYBACK_TASKS_IN_QUEUE);
+        }
     }
+    mixer_.SetDucking(kAudioMixerStreamTts, SOUND_DUCKING_GAIN_PERCENT, 1 << kAudioMixerStreamSound);
+    mixer_.SetDucking(kAudioMixerStreamMusic, MUSIC_DUCKING_GAIN_PERCENT,
+        (1 << kAudioMixerStreamSound) | (1 << kAudioMixerStreamTts));
+#if CONFIG_USE_MUSIC_PLAYER
+    music_player_.Initialize(codec->output_sample_rate());
+    music_player_.OnData([this]() {
+        if (opus_codec_task_handle_ != nullptr) {
+            xTaskNotifyGive(opus_codec_task_handle_);
+        }
+    });
+#endif
 
     if (codec->input_sample_rate() != 16000) {
-        esp_ae_rate_cvt_cfg_t input_resampler_cfg = RATE_CVT_CFG(
-            codec->input_sample_rate(), ESP_AUDIO_SAMPLE_RATE_16K, codec->input_channels());
-        auto resampler_ret = esp_ae_rate_cvt_open(&input_resampler_cfg, &input_resampler_);
-        if (input_resampler_ == nullptr) {
-            ESP_LOGE(TAG, "Failed to create input resampler, error code: %d", resampler_ret);
+        input_resampler_ = std::make_unique<Resampler>();
+        if (!input_resampler_->Open(codec->input_sample_rate(), 16000, codec->input_channels())) {
+            input_resampler_.reset();
         }
     }
 
@@ -97,8 +133,39 @@ void AudioService::Initialize(AudioCodec* codec) {
 #else
     audio_processor_ = std::make_unique<NoAudioProcessor>();
 #endif
-
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
+        latency_stats_.Record(kAudioLatencyProcess, esp_timer_get_time() - last_input_read_us_);
+#if CONFIG_USE_SERVER_AEC
+        // The processor puts out one sample per input sample, counted before anything is dropped
+        output_pcm_index_ = processed_samples_;
+        processed_samples_ += data.size();
+#endif
+#if CONFIG_USE_AUDIO_DEBUGGER
+        if (auto debugger = audio_debugger_.load(std::memory_order_acquire)) {
+            debugger->FeedProcessed(data, 16000);
+        }
+#endif
+        // A memo records everything until it is stopped
+        if (voice_memo_enabled_) {
+            PushTaskToEncodeQueue(kAudioTaskTypeEncodeToVoiceMemo, std::move(data));
+            return;
+        }
+        if (end_of_speech_enabled_) {
+            // Nothing after the end of the utterance is sent
+            if (end_of_speech_reached_) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(end_of_speech_mutex_);
+            if (end_of_speech_.Feed(data.data(), data.size(), voice_detected_)) {
+                lock.unlock();
+                end_of_speech_reached_ = true;
+                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
+                if (callbacks_.on_end_of_speech) {
+                    callbacks_.on_end_of_speech();
+                }
+                return;
+            }
+        }
         PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
     });
 
@@ -109,119 +176,172 @@ void AudioService::Initialize(AudioCodec* codec) {
         }
     });
 
-    esp_timer_create_args_t audio_power_timer_args = {
-        .callback = [](void* arg) {
-            AudioService* audio_service = (AudioService*)arg;
-            audio_service->CheckAndUpdateAudioPowerState();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "audio_power_timer",
-        .skip_unhandled_events = true,
-    };
-    esp_timer_create(&audio_power_timer_args, &audio_power_timer_);
+    audio_power_timer_ = TimerWheel::GetInstance().Create("audio_power_timer", [this]() {
+        CheckAndUpdateAudioPowerState();
+    });
+
+    RegisterMetrics();
+}
+
+// The statistics are kept by the audio tasks anyway, the gauges only read them on export
+void AudioService::RegisterMetrics() {
+    auto& metrics = Metrics::GetInstance();
+    metrics.AddGauge("audio.underruns", [this]() -> int64_t { return jitter_buffer_.GetStatistics().underruns; });
+    metrics.AddGauge("audio.late_packets", [this]() -> int64_t { return jitter_buffer_.GetStatistics().late_packets; });
+    metrics.AddGauge("audio.jitter_ms", [this]() -> int64_t { return jitter_buffer_.GetStatistics().jitter_ms; });
+    metrics.AddGauge("audio.concealed", [this]() -> int64_t { return debug_statistics_.concealed_frames; });
+    metrics.AddGauge("audio.encode_misses", [this]() -> int64_t { return debug_statistics_.encode_deadline_misses; });
+    metrics.AddGauge("audio.decode_misses", [this]() -> int64_t { return debug_statistics_.decode_deadline_misses; });
+    metrics.AddGauge("audio.stale_drops", [this]() -> int64_t { return debug_statistics_.stale_send_drops; });
+    metrics.AddGauge("audio.dtx_drops", [this]() -> int64_t { return debug_statistics_.dtx_drops; });
+    metrics.AddGauge("audio.limited_ms", [this]() -> int64_t { return output_gain_.limited_chunks(); });
+    metrics.AddGauge("audio.send_queue", [this]() -> int64_t { return audio_send_queue_.size(); });
+    metrics.AddGauge("audio.decode_ahead_ms", [this]() -> int64_t { return GetDebugStatistics().decode_ahead_ms; });
+    metrics.AddGauge("audio.input_stalls", [this]() -> int64_t { return debug_statistics_.input_stalls; });
+    metrics.AddGauge("audio.input_max_gap_ms", [this]() -> int64_t { return debug_statistics_.input_max_gap_ms; });
+    metrics.AddGauge("audio.input_cycles", [this]() -> int64_t { return GetDebugStatistics().input_cycles; });
+    metrics.AddGauge("audio.input_cycles_max", [this]() -> int64_t { return debug_statistics_.input_cycles_max; });
 }
 
 void AudioService::Start() {
     service_stopped_ = false;
     xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    esp_timer_start_periodic(audio_power_timer_, 1000000);
+    TimerWheel::GetInstance().StartPeriodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000, AUDIO_POWER_CHECK_SLACK_US);
 
-#if CONFIG_USE_AUDIO_PROCESSOR
+    // Core, priority and stack of each task are in the TaskFactory placement table
     /* Start the audio input task */
-    xTaskCreatePinnedToCore([](void* arg) {
-        AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioInputTask();
-        vTaskDelete(NULL);
-    }, "audio_input", 2048 * 3, this, 8, &audio_input_task_handle_, 0);
+    audio_input_task_handle_ = TaskFactory::Create("audio_input", kTaskStackInternal, [this]() {
+        AudioInputTask();
+    });
 
     /* Start the audio output task */
-    xTaskCreate([](void* arg) {
-        AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioOutputTask();
-        vTaskDelete(NULL);
-    }, "audio_output", 2048 * 2, this, 4, &audio_output_task_handle_);
-#else
-    /* Start the audio input task */
-    xTaskCreate([](void* arg) {
-        AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioInputTask();
-        vTaskDelete(NULL);
-    }, "audio_input", 2048 * 2, this, 8, &audio_input_task_handle_);
+    audio_output_task_handle_ = TaskFactory::Create("audio_output", kTaskStackInternal, [this]() {
+        AudioOutputTask();
+    });
 
-    /* Start the audio output task */
-    xTaskCreate([](void* arg) {
-        AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioOutputTask();
-        vTaskDelete(NULL);
-    }, "audio_output", 2048, this, 4, &audio_output_task_handle_);
-#endif
+    // The Opus tasks have the largest stacks and never touch flash, so they keep them in PSRAM
+#if CONFIG_USE_SPLIT_OPUS_CODEC_TASKS
+    /* Start the opus decoder and encoder tasks, pinned to their own cores */
+    opus_codec_task_handle_ = TaskFactory::Create("opus_decoder", kTaskStackPsram, [this]() {
+        OpusDecoderTask();
+    });
 
+    opus_encoder_task_handle_ = TaskFactory::Create("opus_encoder", kTaskStackPsram, [this]() {
+        OpusEncoderTask();
+    });
+#else
     /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
-        AudioService* audio_service = (AudioService*)arg;
-        audio_service->OpusCodecTask();
-        vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 12, this, 2, &opus_codec_task_handle_);
+    opus_codec_task_handle_ = TaskFactory::Create("opus_codec", kTaskStackPsram, [this]() {
+        OpusCodecTask();
+    });
+#endif
 }
 
 void AudioService::Stop() {
-    esp_timer_stop(audio_power_timer_);
+    TimerWheel::GetInstance().Stop(audio_power_timer_);
     service_stopped_ = true;
     xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    // Clearing also wakes up the consumer tasks so they can see service_stopped_
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_sound_queue_.Clear();
+    audio_testing_queue_.Clear();
+    jitter_buffer_.Clear([this](std::unique_ptr<AudioStreamPacket> packet) { ReleasePacket(std::move(packet)); });
+    {
+        std::lock_guard<std::mutex> decoder_lock(decoder_mutex_);
+        decode_ahead_.Clear();
+    }
+    sound_player_.Stop();
+#if CONFIG_USE_MUSIC_PLAYER
+    audio_music_queue_.Clear();
+    music_player_.Stop();
+#endif
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
     if (!codec_->input_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        TimerWheel::GetInstance().StartPeriodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000, AUDIO_POWER_CHECK_SLACK_US);
         codec_->EnableInput(true);
+#if CONFIG_USE_SERVER_AEC
+        playback_clock_.OnInputEnabled(input_frames_read_);
+#endif
+        previous_read_us_ = 0;
     }
 
     if (codec_->input_sample_rate() != sample_rate) {
         data.resize(samples * codec_->input_sample_rate() / sample_rate * codec_->input_channels());
+        int64_t read_start = esp_timer_get_time();
+        uint32_t read_cycles = esp_cpu_get_cycle_count();
         if (!codec_->InputData(data)) {
             return false;
         }
+        input_read_cycles_ = esp_cpu_get_cycle_count() - read_cycles;
+        latency_stats_.Record(kAudioLatencyInputRead, esp_timer_get_time() - read_start);
+#if CONFIG_USE_SERVER_AEC
+        input_frames_read_ += data.size() / codec_->input_channels();
+        playback_clock_.OnInputRead(input_frames_read_);
+#endif
         if (input_resampler_ != nullptr) {
             std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            uint32_t in_sample_num = data.size() / codec_->input_channels();
-            uint32_t output_samples = 0;
-            esp_ae_rate_cvt_get_max_out_sample_num(input_resampler_, in_sample_num, &output_samples);
-            auto resampled = std::vector<int16_t>(output_samples * codec_->input_channels());
-            uint32_t actual_output = output_samples;
-            esp_ae_rate_cvt_process(input_resampler_, (esp_ae_sample_t)data.data(), in_sample_num,
-                                   (esp_ae_sample_t)resampled.data(), &actual_output);
-            resampled.resize(actual_output * codec_->input_channels());
-            data = std::move(resampled);
+            size_t in_frames = data.size() / codec_->input_channels();
+            // The buffer swaps with data, both keep their capacity from one read to the next
+            input_resample_buffer_.resize(input_resampler_->MaxOutputFrames(in_frames) * codec_->input_channels());
+            size_t out_frames = input_resampler_->Process(data.data(), in_frames, input_resample_buffer_.data());
+            input_resample_buffer_.resize(out_frames * codec_->input_channels());
+            data.swap(input_resample_buffer_);
         }
     } else {
         data.resize(samples * codec_->input_channels());
+        int64_t read_start = esp_timer_get_time();
+        uint32_t read_cycles = esp_cpu_get_cycle_count();
         if (!codec_->InputData(data)) {
             return false;
         }
+        input_read_cycles_ = esp_cpu_get_cycle_count() - read_cycles;
+        latency_stats_.Record(kAudioLatencyInputRead, esp_timer_get_time() - read_start);
+#if CONFIG_USE_SERVER_AEC
+        input_frames_read_ += data.size() / codec_->input_channels();
+        playback_clock_.OnInputRead(input_frames_read_);
+#endif
+    }
+
+#if CONFIG_USE_AUDIO_INJECTION
+    if (sample_rate == 16000) {
+        AudioInjection::GetInstance().Feed(data, codec_->input_channels());
+    }
+#endif
+    if (sample_rate == 16000) {
+        aec_delay_.ProcessInput(data);
     }
 
+    // The first channel is the microphone, the others may carry the playback reference
+    input_envelope_ = PackEnvelope(data.data(), data.size() / codec_->input_channels(), codec_->input_channels());
+
     /* Update the last input time */
+    int64_t now = esp_timer_get_time();
     last_input_time_ = std::chrono::steady_clock::now();
+    last_input_read_us_ = now;
+    // The DMA buffers a read or two, a read completing later than that was held up
+    int64_t gap = now - previous_read_us_;
+    if (previous_read_us_ > 0 && gap < AUDIO_INPUT_PAUSE_US) {
+        if (gap > 2 * (int64_t)samples * 1000000 / sample_rate) {
+            debug_statistics_.input_stalls++;
+        }
+        debug_statistics_.input_max_gap_ms = std::max<uint32_t>(debug_statistics_.input_max_gap_ms, gap / 1000);
+    }
+    previous_read_us_ = now;
     debug_statistics_.input_count++;
 
 #if CONFIG_USE_AUDIO_DEBUGGER
     // 音频调试：发送原始音频数据
-    if (audio_debugger_ == nullptr) {
-        audio_debugger_ = std::make_unique<AudioDebugger>();
+    if (auto debugger = audio_debugger_.load(std::memory_order_acquire)) {
+        debugger->FeedInput(data, codec_->input_channels(), codec_->input_reference(), sample_rate);
     }
-    audio_debugger_->Feed(data);
 #endif
 
     return true;
@@ -239,12 +359,19 @@ void AudioService::AudioInputTask() {
         if (audio_input_need_warmup_) {
             audio_input_need_warmup_ = false;
             vTaskDelay(pdMS_TO_TICKS(120));
+            previous_read_us_ = 0;
             continue;
         }
+        if (reset_input_timing_.exchange(false)) {
+            debug_statistics_.input_stalls = 0;
+            debug_statistics_.input_max_gap_ms = 0;
+            input_cycles_total_ = 0;
+            input_cycles_count_ = 0;
+        }
 
         /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
         if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
+            if (audio_testing_queue_.full()) {
                 ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
                 EnableAudioTesting(false);
                 continue;
@@ -252,13 +379,12 @@ void AudioService::AudioInputTask() {
             std::vector<int16_t> data;
             int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
             if (ReadAudioData(data, 16000, samples)) {
-                // If input channels is 2, we need to fetch the left channel data
-                if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
+                // Only the first microphone is recorded
+                int channels = codec_->input_channels();
+                if (channels > 1) {
+                    size_t frames = data.size() / channels;
+                    AudioKernels::ExtractChannel(data.data(), data.data(), frames, channels, codec_->GetPrimaryMicChannel());
+                    data.resize(frames);
                 }
                 PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
                 continue;
@@ -267,15 +393,44 @@ void AudioService::AudioInputTask() {
 
         /* Feed the wake word and/or audio processor */
         if (bits & (AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING)) {
-            int samples = 160; // 10ms
+            bool wake_word_only = !(bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+            bool gated = idle_gate_enabled_ && wake_word_only;
+            if (!gated && !idle_gate_preroll_.empty()) {
+                idle_gate_preroll_.clear();
+            }
+            int read_ms = gated ? IDLE_GATE_READ_MS : input_read_ms_.load();
+#if CONFIG_USE_WAKE_WORD_BATCH_INPUT
+            if (wake_word_only) {
+                read_ms = std::max(read_ms, WAKE_WORD_BATCH_READ_MS);
+                WaitForInputBatch(read_ms);
+                // The audio processor may have started meanwhile, it wants the regular read size
+                const EventBits_t running = AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING;
+                if ((xEventGroupGetBits(event_group_) & running) != (bits & running)) {
+                    continue;
+                }
+            }
+#endif
+            int samples = read_ms * 16000 / 1000;
             std::vector<int16_t> data;
+            // The cycle counter is per core, a frame the task migrated during is not counted
+            int core = esp_cpu_get_core_id();
+            uint32_t start_cycles = esp_cpu_get_cycle_count();
             if (ReadAudioData(data, 16000, samples)) {
-                if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-                    wake_word_->Feed(data);
+                if ((bits & AS_EVENT_WAKE_WORD_RUNNING) && (!gated || PassIdleGate(data))) {
+                    FeedWakeWord(data);
                 }
                 if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
+#if CONFIG_USE_SERVER_AEC
+                    if (!processor_input_synced_.exchange(true)) {
+                        size_t frames = data.size() / codec_->input_channels() * codec_->input_sample_rate() / 16000;
+                        processor_input_base_ = input_frames_read_ - frames;
+                    }
+#endif
                     audio_processor_->Feed(std::move(data));
                 }
+                if (esp_cpu_get_core_id() == core) {
+                    RecordInputCycles(esp_cpu_get_cycle_count() - start_cycles - input_read_cycles_);
+                }
                 continue;
             }
         }
@@ -287,247 +442,925 @@ void AudioService::AudioInputTask() {
     ESP_LOGW(TAG, "Audio input task stopped");
 }
 
+void AudioService::RecordInputCycles(uint32_t cycles) {
+    auto& statistics = debug_statistics_;
+    if (input_cycles_count_ == 0) {
+        statistics.input_cycles_min = cycles;
+        statistics.input_cycles_max = cycles;
+    }
+    statistics.input_cycles_min = std::min(statistics.input_cycles_min, cycles);
+    statistics.input_cycles_max = std::max(statistics.input_cycles_max, cycles);
+    input_cycles_total_ += cycles;
+    input_cycles_count_++;
+}
+
+void AudioService::ResetInputTiming() {
+    // Applied by the input task, which owns the figures
+    reset_input_timing_ = true;
+}
+
 void AudioService::AudioOutputTask() {
+    auto self = xTaskGetCurrentTaskHandle();
+    audio_playback_queue_.SetConsumer(self);
+    audio_sound_queue_.SetConsumer(self);
+
+    // Mixer inputs, without the music player the music input stays empty
+    SpscQueue<std::unique_ptr<AudioTask>, MAX_PLAYBACK_TASKS_IN_QUEUE>* queues[kAudioMixerStreamCount] = {};
+    queues[kAudioMixerStreamSound] = &audio_sound_queue_;
+    queues[kAudioMixerStreamTts] = &audio_playback_queue_;
+#if CONFIG_USE_MUSIC_PLAYER
+    audio_music_queue_.SetConsumer(self);
+    queues[kAudioMixerStreamMusic] = &audio_music_queue_;
+#endif
+    std::unique_ptr<AudioTask> tasks[kAudioMixerStreamCount];
+    size_t offsets[kAudioMixerStreamCount] = {};
+    std::vector<int16_t> output;
+    int volume = -1;
+
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
         if (service_stopped_) {
             break;
         }
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
+        // Play the streams for as long as none of them runs out of samples
+        const int16_t* inputs[kAudioMixerStreamCount] = {};
+        size_t samples = SIZE_MAX;
+        uint32_t cue = 0;
+        for (int i = 0; i < kAudioMixerStreamCount; i++) {
+            if (tasks[i] != nullptr && offsets[i] >= tasks[i]->pcm.size()) {
+                ReleaseTask(std::move(tasks[i]));
+            }
+            if (tasks[i] == nullptr && queues[i] != nullptr && queues[i]->Pop(tasks[i])) {
+                offsets[i] = 0;
+                if (i == kAudioMixerStreamTts) {
+                    latency_stats_.Record(kAudioLatencyPlaybackQueue, esp_timer_get_time() - tasks[i]->queued_time_us);
+                    cue = tasks[i]->cue;
+                }
+            }
+            if (tasks[i] != nullptr) {
+                inputs[i] = tasks[i]->pcm.data() + offsets[i];
+                samples = std::min(samples, tasks[i]->pcm.size() - offsets[i]);
+            }
+        }
+        if (samples == SIZE_MAX) {
+            // Nothing is playing, so there is nothing to fade
+            fade_out_playback_ = false;
+            output_envelope_ = 0;
+            output_gain_.Reset();
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (samples == 0) {
+            continue;
+        }
+        bool fade_out = fade_out_playback_.exchange(false);
+        if (fade_out) {
+            samples = std::min<size_t>(samples, codec_->output_sample_rate() * PLAYBACK_FADE_OUT_MS / 1000);
+        }
 
         if (!codec_->output_enabled()) {
-            esp_timer_stop(audio_power_timer_);
-            esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+            TimerWheel::GetInstance().StartPeriodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000, AUDIO_POWER_CHECK_SLACK_US);
             codec_->EnableOutput(true);
         }
 
-        codec_->OutputData(task->pcm);
+#if CONFIG_USE_SERVER_AEC
+        // Server timestamp of the first TTS sample in this block
+        uint32_t timestamp = 0;
+        auto& tts = tasks[kAudioMixerStreamTts];
+        if (tts != nullptr && tts->timestamp != 0) {
+            timestamp = tts->timestamp + offsets[kAudioMixerStreamTts] * 1000 / codec_->output_sample_rate();
+        }
+#endif
+
+        output.resize(samples);
+        mixer_.Mix(inputs, samples, output.data());
+        for (int i = 0; i < kAudioMixerStreamCount; i++) {
+            if (inputs[i] != nullptr) {
+                offsets[i] += samples;
+            }
+        }
+        if (fade_out) {
+            // The rest of the blocks in hand goes with the queues that FlushPlayback() cleared,
+            // music is not flushed and goes on where it was
+            AudioKernels::FadeOut(output.data(), output.size());
+            for (int i = 0; i < kAudioMixerStreamCount; i++) {
+                if (tasks[i] != nullptr && i != kAudioMixerStreamMusic) {
+                    ReleaseTask(std::move(tasks[i]));
+                }
+            }
+        }
+        int target_volume = codec_->software_volume() ? codec_->output_volume() : 100;
+        if (target_volume != volume) {
+            volume = target_volume;
+            output_gain_.SetVolume(volume);
+        }
+        output_gain_.Process(output.data(), output.size());
+        output_envelope_ = PackEnvelope(output.data(), output.size(), 1);
+#if CONFIG_USE_SERVER_AEC
+        playback_clock_.Write(output.size(), timestamp);
+#endif
+        int64_t write_start = esp_timer_get_time();
+        codec_->OutputData(output);
+        latency_stats_.Record(kAudioLatencyOutputWrite, esp_timer_get_time() - write_start);
+        if (cue != 0) {
+            ReleaseCues(cue);
+        }
+#if CONFIG_USE_AUDIO_INJECTION
+        AudioInjection::GetInstance().OnOutput();
+#endif
+#if CONFIG_USE_AUDIO_DEBUGGER
+        if (auto debugger = audio_debugger_.load(std::memory_order_acquire)) {
+            debugger->FeedPlayback(output, codec_->output_sample_rate());
+        }
+#endif
 
         /* Update the last output time */
         last_output_time_ = std::chrono::steady_clock::now();
         debug_statistics_.playback_count++;
+    }
 
-#if CONFIG_USE_SERVER_AEC
-        /* Record the timestamp for server AEC */
-        if (task->timestamp > 0) {
-            lock.lock();
-            timestamp_queue_.push_back(task->timestamp);
+    for (auto& task : tasks) {
+        if (task != nullptr) {
+            ReleaseTask(std::move(task));
         }
-#endif
     }
-
     ESP_LOGW(TAG, "Audio output task stopped");
 }
 
 void AudioService::OpusCodecTask() {
+    auto self = xTaskGetCurrentTaskHandle();
+    audio_decode_queue_.SetConsumer(self);
+    audio_encode_queue_.SetConsumer(self);
+    audio_testing_queue_.SetConsumer(self);
+    audio_playback_queue_.SetProducer(self);
+    audio_sound_queue_.SetProducer(self);
+#if CONFIG_USE_MUSIC_PLAYER
+    audio_music_queue_.SetProducer(self);
+#endif
+    audio_send_queue_.SetProducer(self);
+#if CONFIG_USE_OPUS_ENCODER_PROFILE
+    // On the task that runs the encoder, to measure it with the stack it gets
+    ProfileEncoder();
+#endif
+
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
         if (service_stopped_) {
             break;
         }
+        bool busy = DecodeOneFrame();
+        busy |= EncodeOneFrame();
+        if (!busy) {
+            ulTaskNotifyTake(pdTRUE, GetDecoderIdleTimeout());
+        }
+    }
+
+    ESP_LOGW(TAG, "Opus codec task stopped");
+}
+
+#if CONFIG_USE_OPUS_ENCODER_PROFILE
+// Up to about a second at the first boot of a firmware, the result is kept for the next boots
+void AudioService::ProfileEncoder() {
+    std::string key = std::string(esp_app_get_description()->version) + "/" +
+        std::to_string(CONFIG_OPUS_ENCODER_BUDGET_PERCENT) + "/" + std::to_string(CONFIG_OPUS_ENCODER_MAX_COMPLEXITY);
+    Settings settings("audio", true);
+    auto profile = settings.GetString("opus_profile");
+    if (profile == key) {
+        profiled_encoder_complexity_ = settings.GetInt("opus_complexity", 0);
+        ESP_LOGI(TAG, "Opus encoder profile: complexity %d", profiled_encoder_complexity_.load());
+        return;
+    }
+    // A measurement that never finished crashed or overflowed the stack, do not run it again
+    if (profile == key + OPUS_PROFILE_PENDING_SUFFIX) {
+        ESP_LOGW(TAG, "Opus encoder profile did not finish last boot, keeping complexity 0");
+        settings.SetString("opus_profile", key);
+        settings.SetInt("opus_complexity", 0);
+        return;
+    }
+    settings.SetString("opus_profile", key + OPUS_PROFILE_PENDING_SUFFIX);
+    Settings::Flush();
+
+    int budget_us = 60 * 1000 * CONFIG_OPUS_ENCODER_BUDGET_PERCENT / 100;
+    std::vector<int> stack_free;
+    auto us = Benchmark::MeasureOpusComplexity(CONFIG_OPUS_ENCODER_MAX_COMPLEXITY, budget_us, &stack_free);
+    if (us.empty()) {
+        ESP_LOGW(TAG, "Opus encoder profile failed, keeping complexity 0");
+        settings.EraseKey("opus_profile");
+        return;
+    }
+    // Measuring stops after the first complexity over the budget, the higher ones also need more stack
+    int complexity = 0;
+    for (int i = 0; i < (int)us.size(); i++) {
+        if (us[i] > budget_us || stack_free[i] < OPUS_PROFILE_STACK_MARGIN) {
+            break;
+        }
+        complexity = i;
+    }
+    profiled_encoder_complexity_ = complexity;
+    settings.SetString("opus_profile", key);
+    settings.SetInt("opus_complexity", complexity);
+    ESP_LOGI(TAG, "Opus encoder profile: complexity %d, %d us of a %d us budget per 60 ms frame", complexity,
+        us[complexity], budget_us);
+}
+#endif
+
+#if CONFIG_USE_SPLIT_OPUS_CODEC_TASKS
+void AudioService::OpusDecoderTask() {
+    auto self = xTaskGetCurrentTaskHandle();
+    audio_decode_queue_.SetConsumer(self);
+    audio_testing_queue_.SetConsumer(self);
+    audio_playback_queue_.SetProducer(self);
+    audio_sound_queue_.SetProducer(self);
+#if CONFIG_USE_MUSIC_PLAYER
+    audio_music_queue_.SetProducer(self);
+#endif
+
+    while (!service_stopped_) {
+        if (!DecodeOneFrame()) {
+            ulTaskNotifyTake(pdTRUE, GetDecoderIdleTimeout());
+        }
+    }
+
+    ESP_LOGW(TAG, "Opus decoder task stopped");
+}
+
+void AudioService::OpusEncoderTask() {
+    auto self = xTaskGetCurrentTaskHandle();
+    audio_encode_queue_.SetConsumer(self);
+    audio_send_queue_.SetProducer(self);
+#if CONFIG_USE_OPUS_ENCODER_PROFILE
+    ProfileEncoder();
+#endif
+
+    while (!service_stopped_) {
+        if (!EncodeOneFrame()) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+
+    ESP_LOGW(TAG, "Opus encoder task stopped");
+}
+#endif
+
+// The jitter buffer may release a packet later without any new arrival
+TickType_t AudioService::GetDecoderIdleTimeout() {
+    if (audio_playback_queue_.full() && !DecodeAheadHasRoom()) {
+        return portMAX_DELAY;
+    }
+    int hold_ms = jitter_buffer_.GetHoldTimeMs();
+    if (hold_ms < 0) {
+        return portMAX_DELAY;
+    }
+    return std::max<TickType_t>(pdMS_TO_TICKS(hold_ms), 1);
+}
+
+bool AudioService::DecodeOneFrame() {
+    bool busy = DecodeSoundFrame();
+    busy |= DecodePacketFrame();
+#if CONFIG_USE_MUSIC_PLAYER
+    busy |= DecodeMusicFrame();
+#endif
+    return busy;
+}
+
+// The ring only stops taking frames while it still has room for the largest one
+bool AudioService::DecodeAheadHasRoom() const {
+    return decode_ahead_.capacity() > 0 && decode_ahead_.available() >= decode_ahead_reserve_;
+}
+
+// Move decoded-ahead audio into the playback queue, it always plays before newer frames
+bool AudioService::RefillPlaybackQueue() {
+    size_t chunk = codec_->output_sample_rate() / 1000 * OPUS_FRAME_DURATION_MS;
+    bool refilled = false;
+    while (!decode_ahead_.empty() && !audio_playback_queue_.full()) {
+        auto task = AcquireTask(kAudioTaskTypeDecodeToPlaybackQueue);
+        task->pcm.resize(chunk);
+        std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
+        size_t samples = decode_ahead_.Read(task->pcm.data(), chunk);
+        // The cue goes with the chunk its frame starts in
+        while (!ahead_cues_.empty() && ahead_cues_.front().offset < samples) {
+            task->cue = ahead_cues_.front().cue;
+            ahead_cues_.pop_front();
+        }
+        for (auto& cue : ahead_cues_) {
+            cue.offset -= samples;
+        }
+        decoder_lock.unlock();
+        if (samples == 0) {
+            // Cleared by ResetDecoder() in the meantime
+            ReleaseTask(std::move(task));
+            break;
+        }
+        task->pcm.resize(samples);
+        task->queued_time_us = esp_timer_get_time();
+        audio_playback_queue_.Push(std::move(task));
+        refilled = true;
+    }
+    return refilled;
+}
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_ != nullptr) {
-                task->pcm.resize(decoder_frame_size_);
-                esp_audio_dec_in_raw_t raw = {
-                    .buffer = (uint8_t *)(packet->payload.data()),
-                    .len = (uint32_t)(packet->payload.size()),
-                    .consumed = 0,
-                    .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
-                };
-                esp_audio_dec_out_frame_t out_frame = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(task->pcm.size() * sizeof(int16_t)),
-                    .decoded_size = 0,
-                };
-                esp_audio_dec_info_t dec_info = {};
+bool AudioService::DecodePacketFrame() {
+    /* Decode the audio from decode queue, or play back the recorded testing audio */
+    std::unique_ptr<AudioStreamPacket> packet;
+    bool refilled = RefillPlaybackQueue();
+    if (audio_playback_queue_.full() && !DecodeAheadHasRoom()) {
+        return refilled;
+    }
+    if (!audio_decode_queue_.Pop(packet)) {
+        // Running out of packets while decoded audio is still waiting is not an underrun
+        if (decode_ahead_.empty() || !jitter_buffer_.empty()) {
+            packet = jitter_buffer_.Pop();
+        }
+        if (packet == nullptr && !(audio_testing_playback_ && audio_testing_queue_.Pop(packet))) {
+            return refilled;
+        }
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    latency_stats_.Record(kAudioLatencyReceive, start_time - packet->queued_time_us);
+    int lost_frames = std::min(packet->lost_frames, MAX_CONCEALED_FRAMES);
+    // Lost packets are taken to be as long as this one
+    int packet_samples = OpusPacketSamples48k(packet->opus_data(), packet->opus_size());
+    int packet_duration = packet_samples > 0 ? packet_samples / 48 : packet->frame_duration;
+    int frame_duration = packet_duration * (lost_frames + 1);
+    auto task = AcquireTask(kAudioTaskTypeDecodeToPlaybackQueue);
+    task->timestamp = packet->timestamp;
+    task->cue = packet->cue;
+
+    SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
+    if (opus_decoder_ != nullptr) {
+        std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
+        // Fill the frames lost right before this packet into the same playback task,
+        // the last one is rebuilt from the in-band FEC data of this packet if the server sent any
+        for (int i = 0; i < lost_frames; i++) {
+            if (i == lost_frames - 1) {
+                DecodeOpusFrame(packet->opus_data(), packet->opus_size(), ESP_AUDIO_DEC_RECOVERY_FEC, task->pcm);
+            } else {
+                DecodeOpusFrame(nullptr, 0, ESP_AUDIO_DEC_RECOVERY_PLC, task->pcm);
+            }
+        }
+        if (lost_frames > 0) {
+            debug_statistics_.concealed_frames += lost_frames;
+        }
+        auto ret = DecodeOpusFrame(packet->opus_data(), packet->opus_size(), ESP_AUDIO_DEC_RECOVERY_NONE, task->pcm);
+        decoder_lock.unlock();
+        ReleasePacket(std::move(packet));
+        if (ret == ESP_AUDIO_ERR_OK) {
+            if (output_resampler_ != nullptr) {
+                // Reuse the scratch buffer, its capacity settles after the first frame
+                resample_buffer_.resize(output_resampler_->MaxOutputFrames(task->pcm.size()));
+                size_t actual_output = output_resampler_->Process(task->pcm.data(), task->pcm.size(),
+                    resample_buffer_.data());
+                task->pcm.assign(resample_buffer_.begin(), resample_buffer_.begin() + actual_output);
+            }
+            task->queued_time_us = esp_timer_get_time();
+            latency_stats_.Record(kAudioLatencyDecode, task->queued_time_us - start_time);
+            if (audio_playback_queue_.full() || !decode_ahead_.empty()) {
+                // Decoding ahead, the frame goes behind the ones already waiting
                 std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-                auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
+                size_t offset = decode_ahead_.size();
+                bool written = decode_ahead_.Write(task->pcm.data(), task->pcm.size());
+                if (written && task->cue != 0) {
+                    ahead_cues_.push_back({task->cue, offset});
+                }
                 decoder_lock.unlock();
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    task->pcm.resize(out_frame.decoded_size / sizeof(int16_t));
-                    if (decoder_sample_rate_ != codec_->output_sample_rate() && output_resampler_ != nullptr) {
-                        uint32_t target_size = 0;
-                        esp_ae_rate_cvt_get_max_out_sample_num(output_resampler_, task->pcm.size(), &target_size);
-                        std::vector<int16_t> resampled(target_size);
-                        uint32_t actual_output = target_size;
-                        esp_ae_rate_cvt_process(output_resampler_, (esp_ae_sample_t)task->pcm.data(), task->pcm.size(),
-                                                (esp_ae_sample_t)resampled.data(), &actual_output);
-                        resampled.resize(actual_output);
-                        task->pcm = std::move(resampled);
-                    }
-                    lock.lock();
-                    audio_playback_queue_.push_back(std::move(task));
-                    audio_queue_cv_.notify_all();
-                    debug_statistics_.decode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
-                    lock.lock();
+                if (!written) {
+                    DLOGW(TAG, "Decode-ahead buffer overflow, dropped %u samples", task->pcm.size());
                 }
+                ReleaseTask(std::move(task));
             } else {
-                ESP_LOGE(TAG, "Audio decoder is not configured");
-                lock.lock();
+                // This task is the only producer and the queue was not full, so it always fits
+                audio_playback_queue_.Push(std::move(task));
             }
             debug_statistics_.decode_count++;
+        } else {
+            DLOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
+            ReleaseTask(std::move(task));
         }
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
-            packet->sample_rate = 16000;
-            packet->timestamp = task->timestamp;
-
-            if (opus_encoder_ != nullptr && task->pcm.size() == encoder_frame_size_) {
-                std::vector<uint8_t> buf(encoder_outbuf_size_);
-                esp_audio_enc_in_frame_t in = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
-                };
-                esp_audio_enc_out_frame_t out = {
-                    .buffer = buf.data(),
-                    .len = (uint32_t)encoder_outbuf_size_,
-                    .encoded_bytes = 0,
-                };
-                auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    packet->payload.assign(buf.data(), buf.data() + out.encoded_bytes);
-
-                    if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                        {
-                            std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                            audio_send_queue_.push_back(std::move(packet));
-                        }
-                        if (callbacks_.on_send_queue_available) {
-                            callbacks_.on_send_queue_available();
-                        }
-                    } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                        std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                        audio_testing_queue_.push_back(std::move(packet));
-                    }
-                    debug_statistics_.encode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+    } else {
+        DLOGE(TAG, "Audio decoder is not configured");
+        ReleasePacket(std::move(packet));
+        ReleaseTask(std::move(task));
+    }
+    debug_statistics_.decode_count++;
+
+    if (esp_timer_get_time() - start_time > frame_duration * 1000) {
+        debug_statistics_.decode_deadline_misses++;
+    }
+    return true;
+}
+
+// Stream the local sound into its own mixer input
+bool AudioService::DecodeSoundFrame() {
+    if (audio_sound_queue_.full()) {
+        return false;
+    }
+    if (aec_delay_.chirp_playing()) {
+        auto task = AcquireTask(kAudioTaskTypeDecodeToPlaybackQueue);
+        aec_delay_.ReadChirp(task->pcm, codec_->output_sample_rate() / 1000 * OPUS_FRAME_DURATION_MS);
+        audio_sound_queue_.Push(std::move(task));
+        return true;
+    }
+    if (!sound_player_.active()) {
+        return false;
+    }
+    auto task = AcquireTask(kAudioTaskTypeDecodeToPlaybackQueue);
+    sound_player_.Read(task->pcm, codec_->output_sample_rate() / 1000 * OPUS_FRAME_DURATION_MS);
+    if (task->pcm.empty()) {
+        ReleaseTask(std::move(task));
+        return sound_player_.active();
+    }
+    // This task is the only producer and the queue was not full, so it always fits
+    audio_sound_queue_.Push(std::move(task));
+    return true;
+}
+
+#if CONFIG_USE_MUSIC_PLAYER
+// Stream the music into the lowest mixer input, the player wakes the task when data arrives
+bool AudioService::DecodeMusicFrame() {
+    if (!music_player_.playing() || audio_music_queue_.full()) {
+        return false;
+    }
+    auto task = AcquireTask(kAudioTaskTypeDecodeToPlaybackQueue);
+    music_player_.Read(task->pcm, codec_->output_sample_rate() / 1000 * OPUS_FRAME_DURATION_MS);
+    if (task->pcm.empty()) {
+        ReleaseTask(std::move(task));
+        return false;
+    }
+    // This task is the only producer and the queue was not full, so it always fits
+    audio_music_queue_.Push(std::move(task));
+    return true;
+}
+#endif
+
+// Decode one packet, of however many frames, and append the PCM to pcm, the caller holds decoder_mutex_.
+// Concealment and FEC stand in for a packet as long as the last one decoded.
+esp_audio_err_t AudioService::DecodeOpusFrame(const uint8_t* data, size_t size, esp_audio_dec_recovery_t recover, std::vector<int16_t>& pcm) {
+    // Room for the longest frame the decoder was opened for, the PCM is cut to what it decoded
+    size_t frame_size = (size_t)decoder_sample_rate_ / 1000 * OPUS_DEC_MAX_FRAME_MS;
+    size_t offset = pcm.size();
+    pcm.resize(offset + frame_size);
+    esp_audio_dec_in_raw_t raw = {
+        .buffer = (uint8_t *)data,
+        .len = (uint32_t)size,
+        .consumed = 0,
+        .frame_recover = recover,
+    };
+    esp_audio_dec_out_frame_t out_frame = {
+        .buffer = (uint8_t *)(pcm.data() + offset),
+        .len = (uint32_t)(frame_size * sizeof(int16_t)),
+        .decoded_size = 0,
+    };
+    esp_audio_dec_info_t dec_info = {};
+    TRACE_BEGIN(kTracePointDecode);
+    auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
+    TRACE_END(kTracePointDecode);
+    if (ret == ESP_AUDIO_ERR_OK) {
+        size_t decoded = out_frame.decoded_size / sizeof(int16_t);
+        if (recover == ESP_AUDIO_DEC_RECOVERY_NONE) {
+            last_packet_frame_size_ = decoded;
+        } else if (last_packet_frame_size_ > 0) {
+            decoded = std::min(decoded, (size_t)last_packet_frame_size_);
+        }
+        pcm.resize(offset + decoded);
+    } else {
+        pcm.resize(offset);
+    }
+    return ret;
+}
+
+bool AudioService::EncodeOneFrame() {
+    /* Encode the audio to send queue */
+    std::unique_ptr<AudioTask> task;
+    if (audio_send_queue_.full() || !audio_encode_queue_.Pop(task)) {
+        return false;
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    latency_stats_.Record(kAudioLatencyEncodeQueue, start_time - task->queued_time_us);
+    if (task->encoder_config != encoder_config_) {
+        OpenEncoder(task->encoder_config);
+    }
+
+    auto packet = AcquirePacket();
+    packet->frame_duration = encoder_config_.frame_duration_ms;
+    packet->sample_rate = 16000;
+    packet->timestamp = task->timestamp;
+
+    if (opus_encoder_ != nullptr && task->pcm.size() == encoder_frame_size_) {
+        // Encode straight into the pooled payload, leaving room for the transport header in front
+        packet->headroom = AUDIO_PACKET_HEADROOM;
+        packet->payload.resize(AUDIO_PACKET_HEADROOM + encoder_outbuf_size_);
+        esp_audio_enc_in_frame_t in = {
+            .buffer = (uint8_t *)(task->pcm.data()),
+            .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
+        };
+        esp_audio_enc_out_frame_t out = {
+            .buffer = packet->opus_data(),
+            .len = (uint32_t)encoder_outbuf_size_,
+            .encoded_bytes = 0,
+        };
+        int64_t encode_start = esp_timer_get_time();
+        TRACE_BEGIN(kTracePointEncode);
+        auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
+        TRACE_END(kTracePointEncode);
+        if (ret == ESP_AUDIO_ERR_OK) {
+            packet->queued_time_us = esp_timer_get_time();
+            latency_stats_.Record(kAudioLatencyEncode, packet->queued_time_us - encode_start);
+            packet->payload.resize(AUDIO_PACKET_HEADROOM + out.encoded_bytes);
+
+            bool drop = false;
+#if CONFIG_OPUS_DROP_DTX_FRAMES
+            if (task->type == kAudioTaskTypeEncodeToSendQueue) {
+                // The comfort noise updates within a pause are single frames, they are sent and keep the pause going
+                bool dtx = out.encoded_bytes <= OPUS_DTX_FRAME_BYTES;
+                if (dtx) {
+                    dtx_silence_ms_ += encoder_config_.frame_duration_ms;
+                    dtx_audio_frames_ = 0;
+                } else if (++dtx_audio_frames_ > 1) {
+                    dtx_silence_ms_ = 0;
                 }
-            } else {
-                ESP_LOGE(TAG, "Failed to encode audio: encoder not configured or invalid frame size (got %u, expected %u)",
-                         task->pcm.size(), encoder_frame_size_);
+                drop = dtx && dtx_silence_ms_ > CONFIG_OPUS_DTX_HANGOVER_MS;
             }
-            lock.lock();
+#endif
+            if (drop) {
+                debug_statistics_.dtx_drops++;
+                ReleasePacket(std::move(packet));
+            } else if (task->type == kAudioTaskTypeEncodeToSendQueue) {
+                audio_send_queue_.Push(std::move(packet));
+                if (callbacks_.on_send_queue_available) {
+                    callbacks_.on_send_queue_available();
+                }
+            } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
+                if (!audio_testing_queue_.Push(std::move(packet))) {
+                    ReleasePacket(std::move(packet));
+                }
+            } else if (task->type == kAudioTaskTypeEncodeToVoiceMemo) {
+                if (callbacks_.on_voice_memo_packet) {
+                    callbacks_.on_voice_memo_packet(*packet);
+                }
+                ReleasePacket(std::move(packet));
+            }
+            debug_statistics_.encode_count++;
+        } else {
+            DLOGE(TAG, "Failed to encode audio, error code: %d", ret);
+            ReleasePacket(std::move(packet));
         }
+    } else {
+        DLOGE(TAG, "Failed to encode audio: encoder not configured or invalid frame size (got %u, expected %u)",
+                 task->pcm.size(), encoder_frame_size_);
+        ReleasePacket(std::move(packet));
     }
+    ReleaseTask(std::move(task));
 
-    ESP_LOGW(TAG, "Opus codec task stopped");
+    if (esp_timer_get_time() - start_time > encoder_config_.frame_duration_ms * 1000) {
+        debug_statistics_.encode_deadline_misses++;
+    }
+    return true;
+}
+
+static bool IsOpusSampleRate(int sample_rate) {
+    return sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000 || sample_rate == 24000 ||
+        sample_rate == 48000;
+}
+
+int AudioService::GetPreferredDownlinkSampleRate() const {
+    for (int sample_rate : {8000, 12000, 16000, 24000, 48000}) {
+        if (sample_rate >= codec_->output_sample_rate()) {
+            return sample_rate;
+        }
+    }
+    return 48000;
 }
 
+int AudioService::GetDecodeSampleRate(int sample_rate) const {
+    return IsOpusSampleRate(codec_->output_sample_rate()) ? codec_->output_sample_rate() : sample_rate;
+}
+
+// sample_rate is the rate of the stream, Opus decodes it straight to the codec rate where it can.
+// A change of frame duration alone keeps the decoder, it only sizes the concealment of a lost packet.
 void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (decoder_sample_rate_ == sample_rate && decoder_duration_ms_ == frame_duration) {
+    sample_rate = GetDecodeSampleRate(sample_rate);
+    if (decoder_sample_rate_ == sample_rate) {
+        if (decoder_duration_ms_ != frame_duration) {
+            std::lock_guard<std::mutex> decoder_lock(decoder_mutex_);
+            decoder_duration_ms_ = frame_duration;
+            decoder_frame_size_ = decoder_sample_rate_ / 1000 * frame_duration;
+        }
         return;
     }
-    std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
-        opus_decoder_ = nullptr;
+
+    // Switch to a cached decoder for this format, or replace the least recently used one
+    DecoderCacheEntry* entry = nullptr;
+    for (auto& candidate : decoder_cache_) {
+        if (candidate.decoder != nullptr && candidate.sample_rate == sample_rate) {
+            entry = &candidate;
+            break;
+        }
     }
-    decoder_lock.unlock();
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(sample_rate, frame_duration);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
-        return;
+    if (entry != nullptr) {
+        // It still holds the state of the stream it decoded last
+        esp_opus_dec_reset(entry->decoder);
+        if (entry->resampler != nullptr) {
+            entry->resampler->Reset();
+        }
+    } else {
+        entry = &decoder_cache_[0];
+        for (auto& candidate : decoder_cache_) {
+            if (candidate.decoder == nullptr) {
+                entry = &candidate;
+                break;
+            }
+            if (candidate.last_used < entry->last_used) {
+                entry = &candidate;
+            }
+        }
+
+        void* decoder = nullptr;
+        esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(sample_rate);
+        auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &decoder);
+        if (decoder == nullptr) {
+            ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
+            return;
+        }
+        std::unique_ptr<Resampler> resampler;
+        if (sample_rate != codec_->output_sample_rate()) {
+            resampler = std::make_unique<Resampler>();
+            if (!resampler->Open(sample_rate, codec_->output_sample_rate(), 1)) {
+                resampler.reset();
+            }
+        }
+
+        std::lock_guard<std::mutex> decoder_lock(decoder_mutex_);
+        if (opus_decoder_ == entry->decoder) {
+            opus_decoder_ = nullptr;
+            output_resampler_ = nullptr;
+        }
+        if (entry->decoder != nullptr) {
+            esp_opus_dec_close(entry->decoder);
+        }
+        entry->sample_rate = sample_rate;
+        entry->decoder = decoder;
+        entry->resampler = std::move(resampler);
     }
+    entry->last_used = ++decoder_cache_clock_;
+
+    std::lock_guard<std::mutex> decoder_lock(decoder_mutex_);
+    opus_decoder_ = entry->decoder;
+    output_resampler_ = entry->resampler.get();
     decoder_sample_rate_ = sample_rate;
     decoder_duration_ms_ = frame_duration;
     decoder_frame_size_ = decoder_sample_rate_ / 1000 * frame_duration;
+    last_packet_frame_size_ = 0;
+    if (decoder_sample_rate_ != codec_->output_sample_rate()) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", decoder_sample_rate_, codec_->output_sample_rate());
+    }
+}
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (decoder_sample_rate_ != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", decoder_sample_rate_, codec->output_sample_rate());
-        if (output_resampler_ != nullptr) {
-            esp_ae_rate_cvt_close(output_resampler_);
-            output_resampler_ = nullptr;
-        }
-        esp_ae_rate_cvt_cfg_t output_resampler_cfg = RATE_CVT_CFG(
-            decoder_sample_rate_, codec->output_sample_rate(), ESP_AUDIO_MONO);
-        auto resampler_ret = esp_ae_rate_cvt_open(&output_resampler_cfg, &output_resampler_);
-        if (output_resampler_ == nullptr) {
-            ESP_LOGE(TAG, "Failed to create output resampler, error code: %d", resampler_ret);
-        }
+bool AudioService::OpenEncoder(const AudioEncoderConfig& config) {
+    if (opus_encoder_ != nullptr) {
+        esp_opus_enc_close(opus_encoder_);
+        opus_encoder_ = nullptr;
+    }
+
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+    opus_enc_cfg.frame_duration = (esp_opus_enc_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(config.frame_duration_ms);
+    opus_enc_cfg.bitrate = config.bitrate;
+    opus_enc_cfg.complexity = config.complexity;
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
+    // Remember the settings even on failure, so we do not retry on every frame
+    encoder_config_ = config;
+    if (opus_encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+        return false;
+    }
+    encoder_sample_rate_ = 16000;
+    esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
+    encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+    ESP_LOGI(TAG, "Opus encoder: frame %d ms, bitrate %d, complexity %d",
+        config.frame_duration_ms, config.bitrate, config.complexity);
+    return true;
+}
+
+bool AudioService::SetEncoderConfig(const AudioEncoderConfig& config) {
+    if (AS_OPUS_GET_FRAME_DRU_ENUM(config.frame_duration_ms) < 0) {
+        ESP_LOGE(TAG, "Unsupported encoder frame duration: %d", config.frame_duration_ms);
+        return false;
+    }
+    if (config.complexity < 0 || config.complexity > 10) {
+        ESP_LOGE(TAG, "Invalid encoder complexity: %d", config.complexity);
+        return false;
     }
+    if (config.bitrate != ESP_OPUS_BITRATE_AUTO && (config.bitrate < 6000 || config.bitrate > 510000)) {
+        ESP_LOGE(TAG, "Invalid encoder bitrate: %d", config.bitrate);
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(requested_encoder_config_mutex_);
+    requested_encoder_config_ = config;
+    return true;
+}
+
+AudioEncoderConfig AudioService::GetEncoderConfig() {
+    std::lock_guard<std::mutex> lock(requested_encoder_config_mutex_);
+    return requested_encoder_config_;
 }
 
 void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
-    auto task = std::make_unique<AudioTask>();
-    task->type = type;
-    task->pcm = std::move(pcm);
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-
-    /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+    // Testing audio is only played back locally, it always uses the default settings
+    AudioEncoderConfig config = type == kAudioTaskTypeEncodeToTestingQueue ? AudioEncoderConfig() : GetEncoderConfig();
+    if (type == kAudioTaskTypeEncodeToVoiceMemo) {
+        config = AudioEncoderConfig();
+        config.bitrate = VOICE_MEMO_BITRATE;
+    }
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        // Lower the bitrate while the network falls behind, before the send queue overflows
+        size_t depth = audio_send_queue_.size();
+        if (!uplink_congested_ && depth >= SEND_QUEUE_CONGESTION_HIGH) {
+            ESP_LOGW(TAG, "Uplink congested, send queue depth %u, capping bitrate at %d", depth, UPLINK_CONGESTED_BITRATE);
+            uplink_congested_ = true;
+        } else if (uplink_congested_ && depth <= SEND_QUEUE_CONGESTION_LOW) {
+            ESP_LOGI(TAG, "Uplink recovered, send queue depth %u", depth);
+            uplink_congested_ = false;
+        }
+        if ((uplink_congested_ || poor_network_) && (config.bitrate == ESP_OPUS_BITRATE_AUTO || config.bitrate > UPLINK_CONGESTED_BITRATE)) {
+            config.bitrate = UPLINK_CONGESTED_BITRATE;
         }
-        timestamp_queue_.pop_front();
+        config.complexity = std::min(config.complexity, encoder_complexity_cap_.load());
+    }
+    size_t frame_samples = config.frame_duration_ms * 16000 / 1000;
+
+    // Fast path, the input is already one frame
+    if (encoder_pcm_buffer_.empty() && pcm.size() == frame_samples) {
+        encoder_pcm_type_ = type;
+#if CONFIG_USE_SERVER_AEC
+        encoder_pcm_index_ = output_pcm_index_;
+#endif
+        PushFrameToEncodeQueue(type, config, pcm.data(), pcm.size());
+        return;
+    }
+
+    // Cut the input into frames of the requested duration, leftovers wait for the next call
+    if (type != encoder_pcm_type_) {
+        encoder_pcm_buffer_.clear();
+        encoder_pcm_type_ = type;
     }
+#if CONFIG_USE_SERVER_AEC
+    encoder_pcm_index_ = output_pcm_index_ - encoder_pcm_buffer_.size();
+#endif
+    encoder_pcm_buffer_.insert(encoder_pcm_buffer_.end(), pcm.begin(), pcm.end());
+    size_t offset = 0;
+    while (encoder_pcm_buffer_.size() - offset >= frame_samples) {
+        PushFrameToEncodeQueue(type, config, encoder_pcm_buffer_.data() + offset, frame_samples);
+        offset += frame_samples;
+    }
+    encoder_pcm_buffer_.erase(encoder_pcm_buffer_.begin(), encoder_pcm_buffer_.begin() + offset);
+}
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+void AudioService::PushFrameToEncodeQueue(AudioTaskType type, const AudioEncoderConfig& config, const int16_t* pcm, size_t samples) {
+    auto task = AcquireTask(type);
+    // Copy into the pooled buffer so its capacity is kept for the next frame
+    task->pcm.assign(pcm, pcm + samples);
+    task->encoder_config = config;
+
+#if CONFIG_USE_SERVER_AEC
+    /* Tell the server which part of its playback was coming out of the speaker when the frame was captured */
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        uint64_t frame = processor_input_base_ + encoder_pcm_index_ * codec_->input_sample_rate() / 16000;
+        task->timestamp = playback_clock_.TimestampOfInput(frame);
+    }
+    encoder_pcm_index_ += samples;
+#endif
+
+    /* Push the task to the encode queue, wait for the codec task if it is full */
+    task->queued_time_us = esp_timer_get_time();
+    while (!audio_encode_queue_.Push(std::move(task))) {
+        if (service_stopped_) {
+            ReleaseTask(std::move(task));
+            return;
+        }
+        audio_encode_queue_.WaitForPop(pdMS_TO_TICKS(OPUS_FRAME_DURATION_MS));
+    }
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+    packet->queued_time_us = esp_timer_get_time();
+    TagCue(*packet);
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(decode_queue_producer_mutex_);
+            if (audio_decode_queue_.Push(std::move(packet))) {
+                return true;
+            }
+        }
+        if (!wait || service_stopped_) {
+            UntagCue(*packet);
+            ReleasePacket(std::move(packet));
             return false;
         }
+        audio_decode_queue_.WaitForPop(pdMS_TO_TICKS(OPUS_FRAME_DURATION_MS));
+    }
+}
+
+bool AudioService::PushPacketToJitterBuffer(std::unique_ptr<AudioStreamPacket> packet) {
+    packet->queued_time_us = esp_timer_get_time();
+    TagCue(*packet);
+    if (!jitter_buffer_.Push(packet)) {
+        UntagCue(*packet);
+        ReleasePacket(std::move(packet));
+        return false;
+    }
+    if (opus_codec_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_codec_task_handle_);
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
     return true;
 }
 
+void AudioService::QueueCue(std::function<void()> action) {
+    {
+        std::lock_guard<std::mutex> lock(cues_mutex_);
+        uint32_t id = ++next_cue_id_;
+        cues_.push_back({id, esp_timer_get_time(), std::move(action)});
+        untagged_cue_.store(id, std::memory_order_release);
+    }
+    ReleaseCues(0);
+}
+
+// The packets pushed in between carry nothing, the cue waits for the first one after it
+void AudioService::TagCue(AudioStreamPacket& packet) {
+    uint32_t cue = untagged_cue_.exchange(0, std::memory_order_acq_rel);
+    if (cue != 0) {
+        packet.cue = cue;
+        tagged_cue_.store(cue, std::memory_order_release);
+    }
+}
+
+// A dropped packet hands its cue to the next one, unless a newer cue came meanwhile
+void AudioService::UntagCue(const AudioStreamPacket& packet) {
+    uint32_t none = 0;
+    if (packet.cue != 0) {
+        untagged_cue_.compare_exchange_strong(none, packet.cue, std::memory_order_acq_rel);
+    }
+}
+
+void AudioService::ReleaseCues(uint32_t id) {
+    std::vector<std::function<void()>> actions;
+    {
+        std::lock_guard<std::mutex> lock(cues_mutex_);
+        int64_t stale_us = esp_timer_get_time() - PLAYBACK_CUE_MAX_DELAY_MS * 1000LL;
+        // In order of arrival, so the ids and the times only grow
+        while (!cues_.empty() && (cues_.front().id <= id || cues_.front().queued_us < stale_us)) {
+            actions.push_back(std::move(cues_.front().action));
+            cues_.pop_front();
+        }
+    }
+    for (auto& action : actions) {
+        action();
+    }
+}
+
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
-        return nullptr;
+    std::unique_ptr<AudioStreamPacket> packet;
+    int64_t max_age_us = send_queue_max_age_ms_ * 1000LL;
+    while (audio_send_queue_.Pop(packet)) {
+        int64_t age_us = esp_timer_get_time() - packet->queued_time_us;
+        // Stale audio after a stall is worth less than catching up with the live input
+        if (max_age_us > 0 && age_us > max_age_us) {
+            debug_statistics_.stale_send_drops++;
+            ReleasePacket(std::move(packet));
+            continue;
+        }
+        latency_stats_.Record(kAudioLatencySendQueue, age_us);
+        break;
     }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
     return packet;
 }
 
+void AudioService::SetSendQueueMaxAge(int max_age_ms) {
+    send_queue_max_age_ms_ = max_age_ms;
+}
+
+void AudioService::SetPoorNetwork(bool poor) {
+    if (poor_network_.exchange(poor) != poor) {
+        ESP_LOGI(TAG, "Poor network %s, uplink bitrate cap %s", poor ? "detected" : "cleared", poor ? "on" : "off");
+    }
+}
+
+void AudioService::SetEncoderComplexityCap(int cap) {
+    encoder_complexity_cap_ = std::clamp(cap, 0, 10);
+}
+
+void AudioService::StartAudioDebugger() {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    if (audio_debugger_.load(std::memory_order_acquire) == nullptr) {
+        audio_debugger_.store(new AudioDebugger(), std::memory_order_release);
+    }
+#endif
+}
+
+void AudioService::EnableNoiseSuppression(bool enable) {
+    ESP_LOGI(TAG, "%s noise suppression", enable ? "Enabling" : "Disabling");
+    audio_processor_->EnableNoiseSuppression(enable);
+}
+
 void AudioService::EncodeWakeWord() {
     if (wake_word_) {
         wake_word_->EncodeWakeWordData();
@@ -539,10 +1372,11 @@ const std::string& AudioService::GetLastWakeWord() const {
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
-    auto packet = std::make_unique<AudioStreamPacket>();
+    auto packet = AcquirePacket();
     if (wake_word_->GetWakeWordOpus(packet->payload)) {
         return packet;
     }
+    ReleasePacket(std::move(packet));
     return nullptr;
 }
 
@@ -552,37 +1386,109 @@ void AudioService::EnableWakeWordDetection(bool enable) {
     }
 
     ESP_LOGD(TAG, "%s wake word detection", enable ? "Enabling" : "Disabling");
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    wake_word_wanted_ = enable;
     if (enable) {
         if (!wake_word_initialized_) {
+            if (models_preloading_) {
+                ESP_LOGI(TAG, "Wake word detection starts once the models are loaded");
+                return;
+            }
             if (!wake_word_->Initialize(codec_, models_list_)) {
                 ESP_LOGE(TAG, "Failed to initialize wake word");
                 return;
             }
             wake_word_initialized_ = true;
         }
-        // Reset input resampler to clear cached data from previous mode (e.g. AudioProcessor)
-        // This prevents buffer overflow when switching between different feed sizes
-        {
-            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            if (input_resampler_ != nullptr) {
-                esp_ae_rate_cvt_reset(input_resampler_);
-            }
-        }
-        wake_word_->Start();
-        xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+        StartWakeWord();
     } else {
         wake_word_->Stop();
         xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
     }
 }
 
+// The caller holds models_mutex_
+void AudioService::StartWakeWord() {
+    // Reset input resampler to clear cached data from previous mode (e.g. AudioProcessor)
+    // This prevents buffer overflow when switching between different feed sizes
+    {
+        std::lock_guard<std::mutex> lock(input_resampler_mutex_);
+        if (input_resampler_ != nullptr) {
+            input_resampler_->Reset();
+        }
+    }
+    wake_word_->Start();
+    xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+}
+
+// Waits for the preload task if it has the processor still to do
+void AudioService::InitializeAudioProcessor() {
+    std::unique_lock<std::mutex> lock(models_mutex_);
+    if (audio_processor_initialized_) {
+        return;
+    }
+    if (models_preloading_) {
+        lock.unlock();
+        xEventGroupWaitBits(event_group_, AS_EVENT_MODELS_READY, pdFALSE, pdTRUE, portMAX_DELAY);
+        return;
+    }
+    audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+    audio_processor_initialized_ = true;
+}
+
+void AudioService::PreloadModels() {
+    {
+        std::lock_guard<std::mutex> lock(models_mutex_);
+        if (models_preloading_ || (audio_processor_initialized_ && (wake_word_ == nullptr || wake_word_initialized_))) {
+            return;
+        }
+        models_preloading_ = true;
+        xEventGroupClearBits(event_group_, AS_EVENT_MODELS_READY);
+    }
+
+    // Mapping the model partition briefly disables the flash cache, so the stack stays internal
+    auto task = TaskFactory::Create("preload_models", 4096 * 2, 1, kTaskStackInternal, [this]() {
+        PreloadModelsTask();
+    });
+    if (task == nullptr) {
+        ESP_LOGW(TAG, "Failed to create the preload task, the models load on first use");
+        std::lock_guard<std::mutex> lock(models_mutex_);
+        models_preloading_ = false;
+        xEventGroupSetBits(event_group_, AS_EVENT_MODELS_READY);
+    }
+}
+
+// Nobody else initializes while models_preloading_ is set, so the lock is only held to publish the results
+void AudioService::PreloadModelsTask() {
+    int64_t start_time = esp_timer_get_time();
+    if (wake_word_ != nullptr && !wake_word_initialized_) {
+        bool ok = wake_word_->Initialize(codec_, models_list_);
+        std::lock_guard<std::mutex> lock(models_mutex_);
+        if (ok) {
+            wake_word_initialized_ = true;
+            if (wake_word_wanted_) {
+                StartWakeWord();
+            }
+        } else {
+            ESP_LOGE(TAG, "Failed to initialize wake word");
+        }
+        ESP_LOGI(TAG, "Wake word ready after %lld ms", (esp_timer_get_time() - start_time) / 1000);
+    }
+
+    if (!audio_processor_initialized_) {
+        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+    }
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    audio_processor_initialized_ = true;
+    models_preloading_ = false;
+    xEventGroupSetBits(event_group_, AS_EVENT_MODELS_READY);
+    ESP_LOGI(TAG, "Models preloaded in %lld ms", (esp_timer_get_time() - start_time) / 1000);
+}
+
 void AudioService::EnableVoiceProcessing(bool enable) {
     ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
     if (enable) {
-        if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
-            audio_processor_initialized_ = true;
-        }
+        InitializeAudioProcessor();
 
         /* We should make sure no audio is playing */
         ResetDecoder();
@@ -592,9 +1498,19 @@ void AudioService::EnableVoiceProcessing(bool enable) {
         {
             std::lock_guard<std::mutex> lock(input_resampler_mutex_);
             if (input_resampler_ != nullptr) {
-                esp_ae_rate_cvt_reset(input_resampler_);
+                input_resampler_->Reset();
             }
         }
+        {
+            std::lock_guard<std::mutex> lock(end_of_speech_mutex_);
+            end_of_speech_.Reset();
+            end_of_speech_reached_ = false;
+        }
+#if CONFIG_USE_SERVER_AEC
+        // The processor is stopped, nothing is counted until the first block it gets
+        processed_samples_ = 0;
+        processor_input_synced_ = false;
+#endif
         audio_processor_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
@@ -603,25 +1519,29 @@ void AudioService::EnableVoiceProcessing(bool enable) {
     }
 }
 
+void AudioService::EnableVoiceMemo(bool enable) {
+    ESP_LOGI(TAG, "%s voice memo", enable ? "Enabling" : "Disabling");
+    voice_memo_enabled_ = enable;
+}
+
 void AudioService::EnableAudioTesting(bool enable) {
     ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
     if (enable) {
+        audio_testing_playback_ = false;
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        /* Let the codec task play back audio_testing_queue_ after the decode queue */
+        audio_testing_playback_ = true;
+        if (opus_codec_task_handle_ != nullptr) {
+            xTaskNotifyGive(opus_codec_task_handle_);
+        }
     }
 }
 
 void AudioService::EnableDeviceAec(bool enable) {
     ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
-    if (!audio_processor_initialized_) {
-        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
-        audio_processor_initialized_ = true;
-    }
+    InitializeAudioProcessor();
 
     audio_processor_->EnableDeviceAec(enable);
 }
@@ -632,51 +1552,203 @@ void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
 
 void AudioService::PlaySound(const std::string_view& ogg) {
     if (!codec_->output_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        TimerWheel::GetInstance().StartPeriodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000, AUDIO_POWER_CHECK_SLACK_US);
         codec_->EnableOutput(true);
     }
 
-    const auto* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
+    // Only a reference is queued, the decoder task reads the packets straight from the asset
+    if (sound_player_.Play(ogg) && opus_codec_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_codec_task_handle_);
+    }
+}
 
-    auto demuxer = std::make_unique<OggDemuxer>();
-    demuxer->OnDemuxerFinished([this](const uint8_t* data, int sample_rate, size_t size){
-        auto packet = std::make_unique<AudioStreamPacket>();
-        packet->sample_rate = sample_rate;
-        packet->frame_duration = 60;
-        packet->payload.resize(size);
-        std::memcpy(packet->payload.data(), data, size);
-        PushPacketToDecodeQueue(std::move(packet), true);
-    });
-    demuxer->Reset();
-    demuxer->Process(buf, size);
+bool AudioService::CalibrateAecDelay(int& delay_ms) {
+    if (!IsWakeWordRunning() && !IsAudioProcessorRunning()) {
+        ESP_LOGE(TAG, "AEC calibration needs the microphone running");
+        return false;
+    }
+    if (!codec_->output_enabled()) {
+        TimerWheel::GetInstance().StartPeriodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000, AUDIO_POWER_CHECK_SLACK_US);
+        codec_->EnableOutput(true);
+    }
+    if (!aec_delay_.StartCalibration()) {
+        return false;
+    }
+    if (opus_codec_task_handle_ != nullptr) {
+        xTaskNotifyGive(opus_codec_task_handle_);
+    }
+    return aec_delay_.FinishCalibration(delay_ms);
+}
+
+bool AudioService::PreloadSound(const std::string_view& ogg) {
+    return sound_player_.Preload(ogg);
+}
+
+void AudioService::ForgetSounds() {
+    sound_player_.Stop();
+    sound_player_.ClearCache();
+}
+
+#if CONFIG_USE_MUSIC_PLAYER
+// The output task turns the codec output on by itself once the first music block is queued
+bool AudioService::PlayMusic(const std::string& url) {
+    return music_player_.Play(url);
+}
+
+void AudioService::PauseMusic(bool pause) {
+    music_player_.Pause(pause);
+}
+
+bool AudioService::SeekMusic(int64_t position_ms) {
+    return music_player_.Seek(position_ms);
+}
+
+void AudioService::StopMusic() {
+    music_player_.Stop();
+}
+#endif
+
+void AudioService::SetStreamGain(AudioMixerStream stream, int percent) {
+    mixer_.SetGain(stream, percent);
+}
+
+void AudioService::SetLatencyProfile(AudioLatencyProfile profile) {
+    auto settings = GetLatencySettings(profile);
+    latency_profile_ = profile;
+    input_read_ms_ = settings.input_read_ms;
+    audio_playback_queue_.SetLimit(settings.playback_queue_depth);
+    audio_sound_queue_.SetLimit(settings.playback_queue_depth);
+    ESP_LOGI(TAG, "Latency profile %d: input read %d ms, playback queue depth %u",
+        profile, settings.input_read_ms, settings.playback_queue_depth);
 }
 
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() &&
+        audio_sound_queue_.empty() && audio_testing_queue_.empty() && jitter_buffer_.empty() && decode_ahead_.empty() &&
+#if CONFIG_USE_MUSIC_PLAYER
+        audio_music_queue_.empty() && !music_player_.playing() &&
+#endif
+        !sound_player_.active();
 }
 
 void AudioService::WaitForPlaybackQueueEmpty() {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    audio_queue_cv_.wait(lock, [this]() { 
-        return service_stopped_ || (audio_decode_queue_.empty() && audio_playback_queue_.empty()); 
-    });
+    while (!service_stopped_ && !(audio_decode_queue_.empty() && jitter_buffer_.empty() && !sound_player_.active() &&
+        decode_ahead_.empty() && audio_playback_queue_.empty() && audio_sound_queue_.empty())) {
+        audio_playback_queue_.WaitForPop(pdMS_TO_TICKS(OPUS_FRAME_DURATION_MS));
+    }
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
     std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
     if (opus_decoder_ != nullptr) {
         esp_opus_dec_reset(opus_decoder_);
     }
+    decode_ahead_.Clear();
+    ahead_cues_.clear();
     decoder_lock.unlock();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    // The flushed audio will not play, a cue no packet took yet waits for the next one
+    ReleaseCues(tagged_cue_.load(std::memory_order_acquire));
+    // The consumers drop the cleared items, packets pushed after this point are kept
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_sound_queue_.Clear();
+    audio_testing_queue_.Clear();
+    jitter_buffer_.Clear([this](std::unique_ptr<AudioStreamPacket> packet) { ReleasePacket(std::move(packet)); });
+    sound_player_.Stop();
+}
+
+void AudioService::EnableIdleGate(bool enable) {
+    ESP_LOGI(TAG, "%s idle gate", enable ? "Enabling" : "Disabling");
+    idle_gate_enabled_ = enable;
+}
+
+bool AudioService::PassIdleGate(std::vector<int16_t>& data) {
+    int64_t now = esp_timer_get_time();
+    if (AudioKernels::MeanAbs(data.data(), data.size()) >= CONFIG_WAKE_WORD_IDLE_GATE_THRESHOLD) {
+        if (now >= idle_gate_open_until_us_) {
+            ESP_LOGD(TAG, "Idle gate opened");
+        }
+        idle_gate_open_until_us_ = now + IDLE_GATE_HOLD_MS * 1000LL;
+    }
+
+    if (now < idle_gate_open_until_us_) {
+        // The start of the wake word came before the block that opened the gate
+        for (auto& block : idle_gate_preroll_) {
+            FeedWakeWord(block);
+        }
+        idle_gate_preroll_.clear();
+        return true;
+    }
+
+    // Blocks are bigger than IDLE_GATE_READ_MS when the input is read in batches
+    size_t block_ms = std::max<size_t>(1, data.size() / (16 * codec_->input_channels()));
+    size_t max_blocks = std::max<size_t>(1, IDLE_GATE_PREROLL_MS / block_ms);
+    idle_gate_preroll_.push_back(std::move(data));
+    while (idle_gate_preroll_.size() > max_blocks) {
+        idle_gate_preroll_.pop_front();
+    }
+    return false;
+}
+
+// Big blocks go in pieces of the engine's chunk size, so that they fit its staging buffer
+void AudioService::FeedWakeWord(const std::vector<int16_t>& data) {
+#if CONFIG_USE_WAKE_WORD_ARBITRATION
+    {
+        int channels = codec_->input_channels();
+        size_t block_frames = data.size() / channels;
+        int32_t rms, peak;
+        AudioKernels::Envelope(data.data() + codec_->GetPrimaryMicChannel(), block_frames, channels, &rms, &peak);
+        float alpha = std::min(1.0f, block_frames / (16.0f * WAKE_WORD_LEVEL_TIME_CONSTANT_MS));
+        wake_word_energy_ += alpha * ((float)rms * rms - wake_word_energy_);
+        wake_word_level_ = (int)(100.0f * log10f(std::max(wake_word_energy_, 1.0f) / (32768.0f * 32768.0f)));
+    }
+#endif
+    size_t frames = wake_word_->GetFeedSize();
+    if (frames == 0) {
+        // The AFE front end takes its chunks from the same pipeline, 32 ms at 16 kHz
+        frames = 512;
+    }
+    size_t piece = frames * codec_->input_channels();
+    if (data.size() <= piece) {
+        wake_word_->Feed(data);
+        return;
+    }
+    std::vector<int16_t> block;
+    for (size_t offset = 0; offset < data.size(); offset += piece) {
+        size_t n = std::min(piece, data.size() - offset);
+        block.assign(data.begin() + offset, data.begin() + offset + n);
+        wake_word_->Feed(block);
+    }
+}
+
+// Sleeps while the DMA ring collects the next batch, so that the read returns at once instead of
+// waking the task on every DMA buffer. One buffer of the ring is kept free, so it never overruns.
+void AudioService::WaitForInputBatch(int batch_ms) {
+    int ring_ms = (AUDIO_CODEC_DMA_RING_FRAMES - AUDIO_CODEC_DMA_FRAME_NUM) * 1000 / codec_->input_sample_rate();
+    int sleep_ms = std::min(batch_ms, ring_ms);
+    int64_t wait_us = last_input_read_us_ + sleep_ms * 1000LL - esp_timer_get_time();
+    if (codec_->input_enabled() && wait_us >= 1000) {
+        vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+    }
+}
+
+void AudioService::EnableEndOfSpeechDetection(bool enable) {
+    // Enabling starts a new utterance
+    std::lock_guard<std::mutex> lock(end_of_speech_mutex_);
+    end_of_speech_.Reset();
+    end_of_speech_reached_ = false;
+    end_of_speech_enabled_ = enable;
+}
+
+void AudioService::SetEndOfSpeechConfig(const EndOfSpeechConfig& config) {
+    std::lock_guard<std::mutex> lock(end_of_speech_mutex_);
+    end_of_speech_.SetConfig(config);
+}
+
+void AudioService::FlushPlayback() {
+    ResetDecoder();
+    // Only takes effect if the output task holds a block, it drops the flag when it goes idle
+    fade_out_playback_ = true;
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
@@ -690,18 +1762,36 @@ void AudioService::CheckAndUpdateAudioPowerState() {
         codec_->EnableOutput(false);
     }
     if (!codec_->input_enabled() && !codec_->output_enabled()) {
-        esp_timer_stop(audio_power_timer_);
+        TimerWheel::GetInstance().Stop(audio_power_timer_);
     }
+    ReleaseCues(0);
 }
 
 void AudioService::SetModelsList(srmodel_list_t* models_list) {
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    if (models_preloading_) {
+        // The preload task holds the current wake word
+        ESP_LOGW(TAG, "Models are being preloaded, ignoring the new models list");
+        return;
+    }
     models_list_ = models_list;
 
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
     if (esp_srmodel_filter(models_list_, ESP_MN_PREFIX, NULL) != nullptr) {
         wake_word_ = std::make_unique<CustomWakeWord>();
     } else if (esp_srmodel_filter(models_list_, ESP_WN_PREFIX, NULL) != nullptr) {
+#if CONFIG_USE_SHARED_AFE
+        // Wake word and voice processing run together in listening mode, let them share one AFE
+        if (!audio_processor_initialized_) {
+            auto front_end = std::make_shared<AfeFrontEnd>();
+            static_cast<AfeAudioProcessor*>(audio_processor_.get())->SetFrontEnd(front_end);
+            wake_word_ = std::make_unique<AfeWakeWord>(front_end);
+        } else {
+            wake_word_ = std::make_unique<AfeWakeWord>();
+        }
+#else
         wake_word_ = std::make_unique<AfeWakeWord>();
+#endif
     } else {
         wake_word_ = nullptr;
     }
@@ -719,9 +1809,22 @@ void AudioService::SetModelsList(srmodel_list_t* models_list) {
                 callbacks_.on_wake_word_detected(wake_word);
             }
         });
+        wake_word_->OnCommandDetected([this](const std::string& tool, const std::string& arguments) {
+            if (callbacks_.on_command_detected) {
+                callbacks_.on_command_detected(tool, arguments);
+            }
+        });
     }
 }
 
+std::vector<WakeWordModelInfo> AudioService::GetWakeWordModels() {
+    return wake_word_ != nullptr ? wake_word_->GetModels() : std::vector<WakeWordModelInfo>();
+}
+
+bool AudioService::SetWakeWordThreshold(int model, float threshold) {
+    return wake_word_ != nullptr && wake_word_->SetModelThreshold(model, threshold);
+}
+
 bool AudioService::IsAfeWakeWord() {
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
     return wake_word_ != nullptr && dynamic_cast<AfeWakeWord*>(wake_word_.get()) != nullptr;
@@ -729,3 +1832,67 @@ bool AudioService::IsAfeWakeWord() {
     return false;
 #endif
 }
+
+std::unique_ptr<AudioStreamPacket> AudioService::AcquirePacket() {
+    auto packet = packet_pool_.Acquire();
+    packet->sample_rate = 0;
+    packet->frame_duration = 0;
+    packet->timestamp = 0;
+    packet->sequence = 0;
+    packet->lost_frames = 0;
+    packet->headroom = 0;
+    packet->cue = 0;
+    packet->payload.clear();
+    return packet;
+}
+
+void AudioService::ReleasePacket(std::unique_ptr<AudioStreamPacket> packet) {
+    packet_pool_.Release(std::move(packet));
+}
+
+std::unique_ptr<AudioTask> AudioService::AcquireTask(AudioTaskType type) {
+    auto task = task_pool_.Acquire();
+    task->type = type;
+    task->timestamp = 0;
+    task->cue = 0;
+    task->pcm.clear();
+    return task;
+}
+
+void AudioService::ReleaseTask(std::unique_ptr<AudioTask> task) {
+    task_pool_.Release(std::move(task));
+}
+
+uint32_t AudioService::PackEnvelope(const int16_t* data, size_t frames, int stride) {
+    int32_t rms, peak;
+    AudioKernels::Envelope(data, frames, stride, &rms, &peak);
+    return (uint32_t)std::min<int32_t>(rms, UINT16_MAX) << 16 | (uint32_t)std::min<int32_t>(peak, UINT16_MAX);
+}
+
+AudioEnvelope AudioService::GetEnvelope() const {
+    uint32_t input = input_envelope_.load(std::memory_order_relaxed);
+    uint32_t output = output_envelope_.load(std::memory_order_relaxed);
+    AudioEnvelope envelope;
+    envelope.input_rms = input >> 16;
+    envelope.input_peak = input & 0xFFFF;
+    envelope.output_rms = output >> 16;
+    envelope.output_peak = output & 0xFFFF;
+    return envelope;
+}
+
+DebugStatistics AudioService::GetDebugStatistics() const {
+    DebugStatistics statistics = debug_statistics_;
+    statistics.pool_hits = packet_pool_.hits() + task_pool_.hits();
+    statistics.pool_misses = packet_pool_.misses() + task_pool_.misses();
+    statistics.jitter_buffer = jitter_buffer_.GetStatistics();
+    statistics.send_queue_depth = audio_send_queue_.size();
+    statistics.uplink_congested = uplink_congested_;
+    statistics.limited_output_ms = output_gain_.limited_chunks();
+    if (input_cycles_count_ > 0) {
+        statistics.input_cycles = input_cycles_total_ / input_cycles_count_;
+    }
+    if (codec_ != nullptr && codec_->output_sample_rate() >= 1000) {
+        statistics.decode_ahead_ms = decode_ahead_.size() / (codec_->output_sample_rate() / 1000);
+    }
+    return statistics;
+}
@@ -2,10 +2,14 @@
 #define AUDIO_SERVICE_H
 
 #include <memory>
-#include <deque>
-#include <condition_variable>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <mutex>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <cmath>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -15,7 +19,6 @@
 #include "esp_audio_enc.h"
 #include "esp_opus_enc.h"
 #include "esp_opus_dec.h"
-#include "esp_ae_rate_cvt.h"
 #include "esp_audio_types.h"
 
 #include "audio_codec.h"
@@ -23,34 +26,139 @@
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
 #include "protocol.h"
-#include "ogg_demuxer.h"
+#include "sound_player.h"
+#include "resampler.h"
+#include "audio_buffer_pool.h"
+#include "pcm_ring_buffer.h"
+#include "spsc_queue.h"
+#include "jitter_buffer.h"
+#include "audio_mixer.h"
+#include "output_gain.h"
+#include "audio_latency.h"
+#include "end_of_speech_detector.h"
+#include "playback_clock.h"
+#include "aec_delay.h"
+#include "timer_wheel.h"
+#if CONFIG_USE_MUSIC_PLAYER
+#include "music_player.h"
+#endif
 
 /*
  * There are two types of audio data flow:
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
- * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
+ * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> [Mixer] -> (Speaker)
  *
  * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
+ * With CONFIG_USE_SPLIT_OPUS_CODEC_TASKS the encoder and decoder run in two tasks pinned to
+ * different cores, so a slow decode does not hold back the uplink in full-duplex mode.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
- * 
+ *
+ * Every queue is a lock-free SPSC ring, tasks sleep on direct task notifications instead of sharing
+ * one mutex, so the high priority input/output tasks never wait on a lock held by the codec task.
+ * The decode queue may have more than one producer, they only serialize between
+ * themselves on decode_queue_producer_mutex_. Server audio goes through the jitter buffer instead.
+ *
+ * PlaySound() does not go through the decode queue, the decoder task streams the sound from the
+ * asset with SoundPlayer into the Sound Queue. The output task mixes the Playback Queue (TTS) and
+ * the Sound Queue with AudioMixer, TTS is ducked while a sound plays.
+ * Short sounds are kept decoded, PreloadSound() fills that cache ahead of time.
+ * With CONFIG_USE_MUSIC_PLAYER, PlayMusic() streams an Ogg Opus URL the same way into the Music
+ * Queue, the third mixer input, which is ducked under TTS and sounds.
+ * With EnableVoiceMemo() the encoded input goes to on_voice_memo_packet instead of the Send Queue.
+ *
+ * The playback queue is only a few frames deep. When it is full the decoder keeps decoding TTS
+ * into the decode-ahead ring (CONFIG_AUDIO_TTS_DECODE_AHEAD_MS) while packets keep arriving, and
+ * refills the queue from the ring first, so the next sentence is ready when the current one ends.
+ *
+ * QueueCue() holds an action, e.g. a caption, until the TTS audio that arrives after it plays. The next
+ * packet pushed into the decode queue or the jitter buffer carries the cue, the decoder hands it to the
+ * frame decoded from it, through the decode-ahead ring too, and the output task runs it once that frame
+ * has been written to the codec. Cues whose audio is flushed run at ResetDecoder(), and none waits
+ * longer than PLAYBACK_CUE_MAX_DELAY_MS.
  */
 
 #define OPUS_FRAME_DURATION_MS 60
 #define MAX_ENCODE_TASKS_IN_QUEUE 2
-#define MAX_PLAYBACK_TASKS_IN_QUEUE 2
+// Capacity of the playback queues, the latency profile sets the depth in use
+#define MAX_PLAYBACK_TASKS_IN_QUEUE 4
+#if CONFIG_USE_LOW_MEMORY_PROFILE
+// Internal RAM one queued packet holds: the object, its payload and the heap headers
+#define AUDIO_PACKET_RAM_ESTIMATE 384
+#define MAX_DECODE_PACKETS_IN_QUEUE (CONFIG_LOW_MEMORY_AUDIO_BUDGET_KB * 1024 / AUDIO_PACKET_RAM_ESTIMATE / 2)
+#define MAX_SEND_PACKETS_IN_QUEUE (CONFIG_LOW_MEMORY_AUDIO_BUDGET_KB * 1024 / AUDIO_PACKET_RAM_ESTIMATE / 2)
+#else
 #define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
 #define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+#endif
+// Send queue depths that raise and clear the uplink congestion bitrate cap
+#define SEND_QUEUE_CONGESTION_HIGH (MAX_SEND_PACKETS_IN_QUEUE / 4)
+#define SEND_QUEUE_CONGESTION_LOW 1
+#define UPLINK_CONGESTED_BITRATE 12000
+// An Opus frame this short carries no audio, it is a DTX frame of silence
+#define OPUS_DTX_FRAME_BYTES 2
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
-#define MAX_TIMESTAMPS_IN_QUEUE 3
+#define AUDIO_TESTING_MAX_PACKETS (AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS)
+// Voice memos are kept in flash, speech needs no more than this
+#define VOICE_MEMO_BITRATE 16000
+// Smoothing of the level fed to the wake word, long enough to hold the word until it is detected
+#define WAKE_WORD_LEVEL_TIME_CONSTANT_MS 300
+// A cue runs by then even if its audio never plays, e.g. a response without audio
+#define PLAYBACK_CUE_MAX_DELAY_MS 8000
+// Longer gaps are not worth concealing, they are played as silence
+#define MAX_CONCEALED_FRAMES 3
+#ifdef CONFIG_AUDIO_TTS_DECODE_AHEAD_MS
+#define DECODE_AHEAD_MS CONFIG_AUDIO_TTS_DECODE_AHEAD_MS
+#else
+#define DECODE_AHEAD_MS 0
+#endif
+// The decode-ahead buffer stops taking frames this far below its top, room for the longest
+// packet (120 ms) with its concealed frames, so a decoded frame always fits
+#define DECODE_AHEAD_RESERVE_MS (120 * (MAX_CONCEALED_FRAMES + 1))
+// Decoder / resampler pairs kept open for the sample rates seen last
+#define DECODER_CACHE_SIZE 3
+// TTS volume while a local sound is mixed over it
+#define SOUND_DUCKING_GAIN_PERCENT 40
+// Music volume while TTS or a local sound is mixed over it
+#define MUSIC_DUCKING_GAIN_PERCENT 20
+// Objects in flight outside the queues (being encoded, decoded, sent or played)
+#define AUDIO_POOL_IN_FLIGHT_SLACK 4
+#define AUDIO_PACKET_POOL_SIZE (MAX_DECODE_PACKETS_IN_QUEUE + MAX_SEND_PACKETS_IN_QUEUE + AUDIO_POOL_IN_FLIGHT_SLACK)
+// Playback tasks are queued for every mixer input (TTS, sounds and music)
+#if CONFIG_USE_MUSIC_PLAYER
+#define AUDIO_PLAYBACK_QUEUES 3
+#else
+#define AUDIO_PLAYBACK_QUEUES 2
+#endif
+#define AUDIO_TASK_POOL_SIZE (MAX_ENCODE_TASKS_IN_QUEUE + MAX_PLAYBACK_TASKS_IN_QUEUE * AUDIO_PLAYBACK_QUEUES + AUDIO_POOL_IN_FLIGHT_SLACK)
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
+#define AUDIO_POWER_CHECK_SLACK_US (500 * 1000)
+
+// A gap between two reads longer than this is the input having been paused, not a stall
+#define AUDIO_INPUT_PAUSE_US (1000 * 1000)
+
+// Playback cut short by FlushPlayback() is faded out over this much audio
+#define PLAYBACK_FADE_OUT_MS 10
+
+// While the idle gate is closed the microphone is read in big blocks and only measured
+#define IDLE_GATE_READ_MS 100
+// Audio kept while the gate is closed, fed to the wake word first when it opens
+#define IDLE_GATE_PREROLL_MS 400
+// How long the gate stays open after the last loud block
+#define IDLE_GATE_HOLD_MS 2000
+
+#if CONFIG_USE_WAKE_WORD_BATCH_INPUT
+// While only the wake word listens, the input task sleeps until the DMA ring holds this much audio
+#define WAKE_WORD_BATCH_READ_MS CONFIG_WAKE_WORD_BATCH_READ_MS
+#endif
 
 #define AS_EVENT_AUDIO_TESTING_RUNNING      (1 << 0)
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_MODELS_READY               (1 << 4)
 
 #define AS_OPUS_GET_FRAME_DRU_ENUM(duration_ms)                   \
     ((duration_ms) == 5 ? ESP_OPUS_ENC_FRAME_DURATION_5_MS :      \
@@ -62,6 +170,12 @@
      (duration_ms) == 100 ? ESP_OPUS_ENC_FRAME_DURATION_100_MS :  \
      (duration_ms) == 120 ? ESP_OPUS_ENC_FRAME_DURATION_120_MS : -1)
 
+#if CONFIG_OPUS_ENCODER_ENABLE_FEC
+#define AS_OPUS_ENABLE_FEC true
+#else
+#define AS_OPUS_ENABLE_FEC false
+#endif
+
 #define AS_OPUS_ENC_CONFIG() {                                                                                    \
         .sample_rate        = ESP_AUDIO_SAMPLE_RATE_16K,                                                          \
         .channel            = ESP_AUDIO_MONO,                                                                     \
@@ -70,22 +184,57 @@
         .frame_duration     = (esp_opus_enc_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(OPUS_FRAME_DURATION_MS),  \
         .application_mode   = ESP_OPUS_ENC_APPLICATION_AUDIO,                                                     \
         .complexity         = 0,                                                                                  \
-        .enable_fec         = false,                                                                              \
+        .enable_fec         = AS_OPUS_ENABLE_FEC,                                                                 \
         .enable_dtx         = true,                                                                               \
         .enable_vbr         = true,                                                                               \
     }
 
+// Uplink encoder settings, can be changed at runtime with SetEncoderConfig()
+struct AudioEncoderConfig {
+    int frame_duration_ms = OPUS_FRAME_DURATION_MS;
+    int bitrate = ESP_OPUS_BITRATE_AUTO;
+    int complexity = 0;
+
+    bool operator==(const AudioEncoderConfig& other) const {
+        return frame_duration_ms == other.frame_duration_ms && bitrate == other.bitrate && complexity == other.complexity;
+    }
+    bool operator!=(const AudioEncoderConfig& other) const { return !(*this == other); }
+};
+
+/*
+ * Trades latency for fewer wakeups. A profile sets the microphone read size and the playback
+ * queue depth at runtime, and the I2S DMA depth (AUDIO_CODEC_DMA_*) when the codec is created.
+ */
+enum AudioLatencyProfile {
+    kAudioLatencyProfileLowLatency,
+    kAudioLatencyProfileBalanced,
+    kAudioLatencyProfilePowerSaving,
+};
+
+#if CONFIG_AUDIO_LATENCY_PROFILE_LOW_LATENCY
+#define AUDIO_DEFAULT_LATENCY_PROFILE kAudioLatencyProfileLowLatency
+#elif CONFIG_AUDIO_LATENCY_PROFILE_POWER_SAVING
+#define AUDIO_DEFAULT_LATENCY_PROFILE kAudioLatencyProfilePowerSaving
+#else
+#define AUDIO_DEFAULT_LATENCY_PROFILE kAudioLatencyProfileBalanced
+#endif
+
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
+    std::function<void(const std::string& tool, const std::string& arguments)> on_command_detected;
     std::function<void(bool)> on_vad_change;
+    std::function<void(void)> on_end_of_speech;
     std::function<void(void)> on_audio_testing_queue_full;
+    // Encoder task, the packet is released when this returns
+    std::function<void(const AudioStreamPacket&)> on_voice_memo_packet;
 };
 
 
 enum AudioTaskType {
     kAudioTaskTypeEncodeToSendQueue,
     kAudioTaskTypeEncodeToTestingQueue,
+    kAudioTaskTypeEncodeToVoiceMemo,
     kAudioTaskTypeDecodeToPlaybackQueue,
 };
 
@@ -93,6 +242,9 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    uint32_t cue = 0;   // Playback cue to run once this frame is played, 0 for none
+    AudioEncoderConfig encoder_config; // The encoder settings this frame was cut for
+    int64_t queued_time_us = 0; // Local time it entered its current queue, for the latency stats
 };
 
 struct DebugStatistics {
@@ -100,8 +252,52 @@ struct DebugStatistics {
     uint32_t decode_count = 0;
     uint32_t encode_count = 0;
     uint32_t playback_count = 0;
+    uint32_t pool_hits = 0;
+    uint32_t pool_misses = 0;
+    // Frames that took longer than their own duration to encode / decode
+    uint32_t encode_deadline_misses = 0;
+    uint32_t decode_deadline_misses = 0;
+    // Downlink frames rebuilt with PLC / FEC after a sequence gap
+    uint32_t concealed_frames = 0;
+    // Uplink packets dropped for exceeding the send queue age limit
+    uint32_t stale_send_drops = 0;
+    // Uplink DTX frames of silence not sent, see CONFIG_OPUS_DROP_DTX_FRAMES
+    uint32_t dtx_drops = 0;
+    // Milliseconds of output the limiter turned down below the volume
+    uint32_t limited_output_ms = 0;
+    uint32_t send_queue_depth = 0;
+    // Decoded TTS waiting behind the playback queue
+    uint32_t decode_ahead_ms = 0;
+    // Reads that completed more than a read later than the one before, e.g. held up by a flash
+    // write, and the longest gap between two reads
+    uint32_t input_stalls = 0;
+    uint32_t input_max_gap_ms = 0;
+    // CPU cycles of the input hot path per read (resampling, envelope and the feeds, the read
+    // itself not counted). The minimum runs from a warm cache, the spread up to the mean and the
+    // maximum is mostly instruction cache misses and preemption.
+    uint32_t input_cycles = 0;
+    uint32_t input_cycles_min = 0;
+    uint32_t input_cycles_max = 0;
+    bool uplink_congested = false;
+    JitterBufferStatistics jitter_buffer;
 };
 
+// Loudness of the last frame in each direction, for visualizers
+struct AudioEnvelope {
+    uint16_t input_rms = 0;
+    uint16_t input_peak = 0;
+    uint16_t output_rms = 0;
+    uint16_t output_peak = 0;
+};
+
+// Maps an RMS amplitude to 0..1 over the range speech usually covers
+inline float AudioLoudness(uint16_t rms) {
+    constexpr float kFloorDb = 40.0f;
+    constexpr float kRangeDb = 36.0f;
+    float db = rms > 0 ? 20.0f * log10f(rms) : 0.0f;
+    return std::clamp((db - kFloorDb) / kRangeDb, 0.0f, 1.0f);
+}
+
 class AudioService {
 public:
     AudioService();
@@ -113,49 +309,196 @@ public:
     void EncodeWakeWord();
     std::unique_ptr<AudioStreamPacket> PopWakeWordPacket();
     const std::string& GetLastWakeWord() const;
+#if CONFIG_USE_WAKE_WORD_ARBITRATION
+    // Level of the microphone fed to the wake word in 0.1 dBFS, how loud the last word arrived
+    int GetWakeWordLevel() const { return wake_word_level_; }
+#endif
     bool IsVoiceDetected() const { return voice_detected_; }
     bool IsIdle();
     void WaitForPlaybackQueueEmpty();
     bool IsWakeWordRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING; }
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
     bool IsAfeWakeWord();
+    // Preloaded and failed to load both count as ready, the enable calls then behave as before
+    bool IsModelsReady() const { return xEventGroupGetBits(event_group_) & AS_EVENT_MODELS_READY; }
+    std::vector<WakeWordModelInfo> GetWakeWordModels();
+    bool SetWakeWordThreshold(int model, float threshold);
+    // Ends the utterance on the device while voice processing runs. Once the end is found the uplink
+    // stops until this or EnableVoiceProcessing(true) is called again.
+    void EnableEndOfSpeechDetection(bool enable);
+    void SetEndOfSpeechConfig(const EndOfSpeechConfig& config);
 
     void EnableWakeWordDetection(bool enable);
     void EnableVoiceProcessing(bool enable);
     void EnableAudioTesting(bool enable);
+    // Hands the processed input to on_voice_memo_packet instead of the send queue, at
+    // VOICE_MEMO_BITRATE. Voice processing has to be enabled as well.
+    void EnableVoiceMemo(bool enable);
     void EnableDeviceAec(bool enable);
+    // Feeds the wake word only around loud input, for power save mode. Voice processing ignores the gate.
+    void EnableIdleGate(bool enable);
+    bool IsIdleGateEnabled() const { return idle_gate_enabled_; }
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
 
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
+    // Downlink audio from the server, reordered and buffered against network jitter
+    bool PushPacketToJitterBuffer(std::unique_ptr<AudioStreamPacket> packet);
+    // Runs action on the output task once the TTS audio pushed after this call starts playing,
+    // call it from the task that pushes the packets to keep their order
+    void QueueCue(std::function<void()> action);
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
+    // Packets that waited longer than max_age_ms in the send queue are dropped, 0 keeps everything
+    void SetSendQueueMaxAge(int max_age_ms);
+    // A poor network quality score caps the uplink bitrate like a backed up send queue
+    void SetPoorNetwork(bool poor);
+    // Caps the complexity of the uplink encoder below what SetEncoderConfig() asked for, 10 lifts the cap
+    void SetEncoderComplexityCap(int cap);
+    // Starts streaming the taps with CONFIG_USE_AUDIO_DEBUGGER, its socket needs the network up
+    void StartAudioDebugger();
+    // The uplink complexity the boot benchmark picked for this chip, 0 until it ran or without
+    // CONFIG_USE_OPUS_ENCODER_PROFILE
+    int GetProfiledEncoderComplexity() const { return profiled_encoder_complexity_; }
+    void EnableNoiseSuppression(bool enable);
     void PlaySound(const std::string_view& sound);
+    // Decode a short sound into the PCM cache on the calling task, so its first play is instant
+    bool PreloadSound(const std::string_view& sound);
+    // Stops the sounds and forgets the decoded ones, before the assets they come from are remapped
+    void ForgetSounds();
+#if CONFIG_USE_MUSIC_PLAYER
+    // Streams an Ogg Opus file over HTTP into the music input, replacing what was playing
+    bool PlayMusic(const std::string& url);
+    void PauseMusic(bool pause);
+    bool SeekMusic(int64_t position_ms);
+    void StopMusic();
+    MusicPlayerStatus GetMusicStatus() { return music_player_.GetStatus(); }
+#endif
+    // Volume of one mixer input in percent
+    void SetStreamGain(AudioMixerStream stream, int percent);
+    void SetLatencyProfile(AudioLatencyProfile profile);
+    AudioLatencyProfile GetLatencyProfile() const { return latency_profile_; }
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // ResetDecoder() and fade out the block being played instead of letting it run out, for barge-in
+    void FlushPlayback();
+    // Takes effect on the next frame, frames already queued are still encoded with the old settings
+    bool SetEncoderConfig(const AudioEncoderConfig& config);
+    AudioEncoderConfig GetEncoderConfig();
+    // The downlink rate offered in the hello, a rate Opus decodes to natively and the closest one to the codec
+    int GetPreferredDownlinkSampleRate() const;
+    // Rate of the PCM decoded from a stream at sample_rate, the codec rate whenever Opus can decode to it
+    int GetDecodeSampleRate(int sample_rate) const;
     void SetModelsList(srmodel_list_t* models_list);
+    // Initializes the wake word and the audio processor on a low priority task, so neither the
+    // first wake nor the first listen waits for the models. Meanwhile EnableWakeWordDetection(true)
+    // is remembered and takes effect when the wake word is ready, and voice processing waits for it.
+    void PreloadModels();
+
+    // Pooled packets for the protocols, return them with ReleasePacket() when done
+    std::unique_ptr<AudioStreamPacket> AcquirePacket();
+    void ReleasePacket(std::unique_ptr<AudioStreamPacket> packet);
+    DebugStatistics GetDebugStatistics() const;
+    // Lock-free snapshot of the envelopes, any task may poll it at its own rate.
+    // The output reads 0 while nothing plays, the input keeps its last frame while the mic is off.
+    AudioEnvelope GetEnvelope() const;
+    AudioLatencyStats& GetLatencyStats() { return latency_stats_; }
+    // Starts the stall and hot path cycle figures over
+    void ResetInputTiming();
+    // Plays a chirp and lines the reference channel up with its echo, on a task that may block for
+    // a second. The microphone has to be running (wake word or voice processing), false without a
+    // reference channel or a clear echo.
+    bool CalibrateAecDelay(int& delay_ms);
+    bool HasAecReference() const { return aec_delay_.supported(); }
 
 private:
     AudioCodec* codec_ = nullptr;
     AudioServiceCallbacks callbacks_;
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
-    std::unique_ptr<AudioDebugger> audio_debugger_;
+    // Created once the network is up, the taps read it from their own tasks and it is never freed
+    std::atomic<AudioDebugger*> audio_debugger_{nullptr};
     void* opus_encoder_ = nullptr;
     void* opus_decoder_ = nullptr;
     std::mutex decoder_mutex_;
     std::mutex input_resampler_mutex_;
-    esp_ae_rate_cvt_handle_t input_resampler_ = nullptr;
-    esp_ae_rate_cvt_handle_t output_resampler_ = nullptr;
+    std::unique_ptr<Resampler> input_resampler_;
+    std::vector<int16_t> input_resample_buffer_;
+    Resampler* output_resampler_ = nullptr;
+
+    // opus_decoder_ and output_resampler_ point into this cache, owned by the decoder task
+    struct DecoderCacheEntry {
+        int sample_rate = 0;
+        void* decoder = nullptr;
+        std::unique_ptr<Resampler> resampler;
+        uint32_t last_used = 0;
+    };
+    std::array<DecoderCacheEntry, DECODER_CACHE_SIZE> decoder_cache_;
+    uint32_t decoder_cache_clock_ = 0;
     
     // Encoder/Decoder state
     int encoder_sample_rate_ = 16000;
-    int encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int encoder_frame_size_ = 0;
+    AudioEncoderConfig encoder_config_;
+    std::mutex requested_encoder_config_mutex_;
+    AudioEncoderConfig requested_encoder_config_;
+    // Input PCM waiting to be cut into frames of the requested encoder duration
+    std::vector<int16_t> encoder_pcm_buffer_;
+    AudioTaskType encoder_pcm_type_ = kAudioTaskTypeEncodeToSendQueue;
     int encoder_outbuf_size_ = 0;
     int decoder_sample_rate_ = 0;
+    // Frame duration of the stream, the packets themselves may be longer or shorter
     int decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int decoder_frame_size_ = 0;
+    // Samples of the last packet decoded, what a lost packet is concealed with
+    int last_packet_frame_size_ = 0;
+    std::atomic<AudioLatencyProfile> latency_profile_{AUDIO_DEFAULT_LATENCY_PROFILE};
+    // Microphone read size for the wake word / audio processor, follows the latency profile
+    std::atomic<int> input_read_ms_{10};
     DebugStatistics debug_statistics_;
+    std::atomic<int> send_queue_max_age_ms_{0};
+    // Set by the input task while the send queue backs up, caps the uplink bitrate
+    std::atomic<bool> uplink_congested_{false};
+    std::atomic<bool> poor_network_{false};
+    std::atomic<int> encoder_complexity_cap_{10};
+    std::atomic<int> profiled_encoder_complexity_{0};
+#if CONFIG_OPUS_DROP_DTX_FRAMES
+    // Encoder task only: DTX silence since the audio stopped, and the frames with audio in a row since
+    int dtx_silence_ms_ = 0;
+    int dtx_audio_frames_ = 0;
+#endif
+    AudioLatencyStats latency_stats_;
+    std::atomic<int64_t> last_input_read_us_{0};
+    // Input task only: end of the previous read while reading continuously, 0 after a pause
+    int64_t previous_read_us_ = 0;
+    uint32_t input_read_cycles_ = 0;
+    std::atomic<bool> reset_input_timing_{false};
+    uint64_t input_cycles_total_ = 0;
+    uint32_t input_cycles_count_ = 0;
+    std::atomic<bool> idle_gate_enabled_{false};
+    std::atomic<bool> fade_out_playback_{false};
+    // RMS in the high half and peak in the low half, so each direction is read in one load
+    std::atomic<uint32_t> input_envelope_{0};
+#if CONFIG_USE_WAKE_WORD_ARBITRATION
+    float wake_word_energy_ = 0;  // Smoothed mean square, input task only
+    std::atomic<int> wake_word_level_{-1000};
+#endif
+    std::atomic<uint32_t> output_envelope_{0};
+    static uint32_t PackEnvelope(const int16_t* data, size_t frames, int stride);
+    std::mutex end_of_speech_mutex_;
+    EndOfSpeechDetector end_of_speech_;
+    std::atomic<bool> end_of_speech_enabled_{false};
+    std::atomic<bool> end_of_speech_reached_{false};
+    std::atomic<bool> voice_memo_enabled_{false};
+    // Owned by the input task
+    std::deque<std::vector<int16_t>> idle_gate_preroll_;
+    int64_t idle_gate_open_until_us_ = 0;
+    AudioBufferPool<AudioStreamPacket> packet_pool_{AUDIO_PACKET_POOL_SIZE};
+    AudioBufferPool<AudioTask> task_pool_{AUDIO_TASK_POOL_SIZE};
+    std::vector<int16_t> resample_buffer_;
+    SoundPlayer sound_player_;
+    AecDelay aec_delay_;
+    AudioMixer mixer_;
+    OutputGain output_gain_;
     srmodel_list_t* models_list_ = nullptr;
 
     EventGroupHandle_t event_group_;
@@ -163,33 +506,115 @@ private:
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
+    // The decoder task when CONFIG_USE_SPLIT_OPUS_CODEC_TASKS is enabled
     TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
-    // For server AEC
-    std::deque<uint32_t> timestamp_queue_;
+    TaskHandle_t opus_encoder_task_handle_ = nullptr;
+    std::mutex decode_queue_producer_mutex_;
+    SpscQueue<std::unique_ptr<AudioStreamPacket>, MAX_DECODE_PACKETS_IN_QUEUE> audio_decode_queue_;
+    JitterBuffer jitter_buffer_{MAX_DECODE_PACKETS_IN_QUEUE};
+    SpscQueue<std::unique_ptr<AudioStreamPacket>, MAX_SEND_PACKETS_IN_QUEUE> audio_send_queue_;
+    SpscQueue<std::unique_ptr<AudioStreamPacket>, AUDIO_TESTING_MAX_PACKETS> audio_testing_queue_;
+    SpscQueue<std::unique_ptr<AudioTask>, MAX_ENCODE_TASKS_IN_QUEUE> audio_encode_queue_;
+    SpscQueue<std::unique_ptr<AudioTask>, MAX_PLAYBACK_TASKS_IN_QUEUE> audio_playback_queue_;
+    SpscQueue<std::unique_ptr<AudioTask>, MAX_PLAYBACK_TASKS_IN_QUEUE> audio_sound_queue_;
+#if CONFIG_USE_MUSIC_PLAYER
+    // Always at full depth, music has no latency to save and the network jitter to hide
+    SpscQueue<std::unique_ptr<AudioTask>, MAX_PLAYBACK_TASKS_IN_QUEUE> audio_music_queue_;
+    MusicPlayer music_player_;
+#endif
+    // Decoded TTS that did not fit into the playback queue, in order in front of newer frames.
+    // Guarded by decoder_mutex_, left unallocated when DECODE_AHEAD_MS is 0
+    PcmRingBuffer decode_ahead_;
+    size_t decode_ahead_reserve_ = 0;
+    // Cues of the frames in decode_ahead_, with the samples in front of each, guarded by decoder_mutex_
+    struct AheadCue {
+        uint32_t cue;
+        size_t offset;
+    };
+    std::deque<AheadCue> ahead_cues_;
+
+    struct PlaybackCue {
+        uint32_t id;
+        int64_t queued_us;
+        std::function<void()> action;
+    };
+    std::mutex cues_mutex_;
+    std::deque<PlaybackCue> cues_;
+    uint32_t next_cue_id_ = 0;
+    // The newest cue no packet carries yet, and the newest one a packet took
+    std::atomic<uint32_t> untagged_cue_{0};
+    std::atomic<uint32_t> tagged_cue_{0};
+#if CONFIG_USE_SERVER_AEC
+    // Where the speaker was when each mic frame was captured
+    PlaybackClock playback_clock_;
+    // Codec input frames read so far, owned by the input task
+    uint64_t input_frames_read_ = 0;
+    // The codec input frame the audio processor got first since it started
+    std::atomic<uint64_t> processor_input_base_{0};
+    std::atomic<bool> processor_input_synced_{false};
+    // Processed samples since the audio processor started, of the last output block and of encoder_pcm_buffer_[0]
+    uint64_t processed_samples_ = 0;
+    uint64_t output_pcm_index_ = 0;
+    uint64_t encoder_pcm_index_ = 0;
+#endif
+    // Set when the recorded testing audio should be played back by the codec task
+    std::atomic<bool> audio_testing_playback_{false};
 
+    // Guards the initialized flags against the preload task
+    std::mutex models_mutex_;
+    bool models_preloading_ = false;
+    bool wake_word_wanted_ = false;
     bool wake_word_initialized_ = false;
     bool audio_processor_initialized_ = false;
     bool voice_detected_ = false;
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
 
-    esp_timer_handle_t audio_power_timer_ = nullptr;
+    TimerWheel::Handle audio_power_timer_ = nullptr;
     std::chrono::steady_clock::time_point last_input_time_;
     std::chrono::steady_clock::time_point last_output_time_;
 
     void AudioInputTask();
     void AudioOutputTask();
+    void PreloadModelsTask();
+    void InitializeAudioProcessor();
+    void StartWakeWord();
     void OpusCodecTask();
+#if CONFIG_USE_OPUS_ENCODER_PROFILE
+    void ProfileEncoder();
+#endif
+#if CONFIG_USE_SPLIT_OPUS_CODEC_TASKS
+    void OpusDecoderTask();
+    void OpusEncoderTask();
+#endif
+    bool DecodeOneFrame();
+    bool DecodePacketFrame();
+    bool DecodeSoundFrame();
+#if CONFIG_USE_MUSIC_PLAYER
+    bool DecodeMusicFrame();
+#endif
+    TickType_t GetDecoderIdleTimeout();
+    bool DecodeAheadHasRoom() const;
+    bool RefillPlaybackQueue();
+    bool EncodeOneFrame();
+    esp_audio_err_t DecodeOpusFrame(const uint8_t* data, size_t size, esp_audio_dec_recovery_t recover, std::vector<int16_t>& pcm);
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
+    void PushFrameToEncodeQueue(AudioTaskType type, const AudioEncoderConfig& config, const int16_t* pcm, size_t samples);
+    bool OpenEncoder(const AudioEncoderConfig& config);
+    std::unique_ptr<AudioTask> AcquireTask(AudioTaskType type);
+    void ReleaseTask(std::unique_ptr<AudioTask> task);
+    void TagCue(AudioStreamPacket& packet);
+    void UntagCue(const AudioStreamPacket& packet);
+    // Runs the cues up to id and the ones older than PLAYBACK_CUE_MAX_DELAY_MS
+    void ReleaseCues(uint32_t id);
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckAndUpdateAudioPowerState();
+    void RegisterMetrics();
+    // True if the block should go to the wake word, preroll held back by the gate is fed first
+    bool PassIdleGate(std::vector<int16_t>& data);
+    void FeedWakeWord(const std::vector<int16_t>& data);
+    void RecordInputCycles(uint32_t cycles);
+    void WaitForInputBatch(int batch_ms);
 };
 
 #endif
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "box_audio_codec.h"
 
 #include <esp_log.h>
+#include <algorithm>
+#include <cstring>
 #include <driver/i2c_master.h>
 #include <driver/i2s_tdm.h>
 
@@ -15,6 +17,16 @@ BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
     input_gain_ = 30;
+#ifdef CONFIG_AUDIO_INPUT_FORMAT
+    // One interleaved channel per TDM slot of the layout, microphones and reference wherever the board has them
+    if (strlen(CONFIG_AUDIO_INPUT_FORMAT) > 0) {
+        input_format_ = CONFIG_AUDIO_INPUT_FORMAT;
+        input_channels_ = std::min<int>(input_format_.size(), 4);
+        input_format_.resize(input_channels_);
+        input_reference_ = input_format_.find('R') != std::string::npos;
+        ESP_LOGI(TAG, "Input format %s", input_format_.c_str());
+    }
+#endif
 
     CreateDuplexChannels(mclk, bclk, ws, dout, din);
 
@@ -199,11 +211,21 @@ void BoxAudioCodec::EnableInput(bool enable) {
             .sample_rate = (uint32_t)output_sample_rate_,
             .mclk_multiple = 0,
         };
-        if (input_reference_) {
+        uint16_t mic_mask = ESP_CODEC_DEV_MAKE_CHANNEL_MASK(0);
+        if (!input_format_.empty()) {
+            fs.channel_mask = 0;
+            mic_mask = 0;
+            for (int i = 0; i < (int)input_format_.size(); i++) {
+                fs.channel_mask |= ESP_CODEC_DEV_MAKE_CHANNEL_MASK(i);
+                if (input_format_[i] == 'M') {
+                    mic_mask |= ESP_CODEC_DEV_MAKE_CHANNEL_MASK(i);
+                }
+            }
+        } else if (input_reference_) {
             fs.channel_mask |= ESP_CODEC_DEV_MAKE_CHANNEL_MASK(1);
         }
         ESP_ERROR_CHECK(esp_codec_dev_open(input_dev_, &fs));
-        ESP_ERROR_CHECK(esp_codec_dev_set_in_channel_gain(input_dev_, ESP_CODEC_DEV_MAKE_CHANNEL_MASK(0), input_gain_));
+        ESP_ERROR_CHECK(esp_codec_dev_set_in_channel_gain(input_dev_, mic_mask, input_gain_));
     } else {
         ESP_ERROR_CHECK(esp_codec_dev_close(input_dev_));
     }
@@ -5,8 +5,8 @@
 
 class DummyAudioCodec : public AudioCodec {
 private:
-    virtual int Read(int16_t* dest, int samples) override;
-    virtual int Write(const int16_t* data, int samples) override;
+    virtual int Read(int16_t* dest, int samples) override final;
+    virtual int Write(const int16_t* data, int samples) override final;
 
 public:
     DummyAudioCodec(int input_sample_rate, int output_sample_rate);
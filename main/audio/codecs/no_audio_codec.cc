@@ -1,7 +1,8 @@
 #include "no_audio_codec.h"
+#include "audio_kernels.h"
 
 #include <esp_log.h>
-#include <cmath>
+#include <algorithm>
 #include <cstring>
 
 #define TAG "NoAudioCodec"
@@ -17,6 +18,7 @@ NoAudioCodec::~NoAudioCodec() {
 
 NoAudioCodecDuplex::NoAudioCodecDuplex(int input_sample_rate, int output_sample_rate, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din) {
     duplex_ = true;
+    software_volume_ = true;
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
 
@@ -72,11 +74,15 @@ NoAudioCodecDuplex::NoAudioCodecDuplex(int input_sample_rate, int output_sample_
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
     ESP_LOGI(TAG, "Duplex channels created");
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    AttachReference();
+#endif
 }
 
 
 NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sample_rate, gpio_num_t spk_bclk, gpio_num_t spk_ws, gpio_num_t spk_dout, gpio_num_t mic_sck, gpio_num_t mic_ws, gpio_num_t mic_din) {
     duplex_ = false;
+    software_volume_ = true;
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
 
@@ -142,10 +148,14 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
     std_cfg.gpio_cfg.din = mic_din;
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
     ESP_LOGI(TAG, "Simplex channels created");
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    AttachReference();
+#endif
 }
 
 NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sample_rate, gpio_num_t spk_bclk, gpio_num_t spk_ws, gpio_num_t spk_dout, i2s_std_slot_mask_t spk_slot_mask, gpio_num_t mic_sck, gpio_num_t mic_ws, gpio_num_t mic_din, i2s_std_slot_mask_t mic_slot_mask){
     duplex_ = false;
+    software_volume_ = true;
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
 
@@ -212,45 +222,60 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
     std_cfg.gpio_cfg.din = mic_din;
     ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
     ESP_LOGI(TAG, "Simplex channels created");
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    AttachReference();
+#endif
 }
 
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+void NoAudioCodec::AttachReference() {
+    if (reference_.Initialize(output_sample_rate_, input_sample_rate_, tx_handle_, rx_handle_)) {
+        input_channels_ = 2;
+        input_reference_ = true;
+    }
+}
+#endif
+
 int NoAudioCodec::Write(const int16_t* data, int samples) {
     std::lock_guard<std::mutex> lock(data_if_mutex_);
-    std::vector<int32_t> buffer(samples);
-
-    // output_volume_: 0-100
-    // volume_factor_: 0-65536
-    int32_t volume_factor = pow(double(output_volume_) / 100.0, 2) * 65536;
-    for (int i = 0; i < samples; i++) {
-        int64_t temp = int64_t(data[i]) * volume_factor; // 使用 int64_t 进行乘法运算
-        if (temp > INT32_MAX) {
-            buffer[i] = INT32_MAX;
-        } else if (temp < INT32_MIN) {
-            buffer[i] = INT32_MIN;
-        } else {
-            buffer[i] = static_cast<int32_t>(temp);
-        }
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    if (input_reference_) {
+        reference_.OnWrite(data, samples);
     }
+#endif
+    write_buffer_.resize(samples);
+
+    // The audio service has applied the volume already
+    AudioKernels::ScaleToInt32(data, write_buffer_.data(), samples, 65536);
 
     size_t bytes_written;
-    ESP_ERROR_CHECK(i2s_channel_write(tx_handle_, buffer.data(), samples * sizeof(int32_t), &bytes_written, portMAX_DELAY));
+    ESP_ERROR_CHECK(i2s_channel_write(tx_handle_, write_buffer_.data(), samples * sizeof(int32_t), &bytes_written, portMAX_DELAY));
     return bytes_written / sizeof(int32_t);
 }
 
 int NoAudioCodec::Read(int16_t* dest, int samples) {
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    if (input_reference_) {
+        mic_buffer_.resize(samples / 2);
+        int frames = ReadInput(mic_buffer_.data(), mic_buffer_.size());
+        reference_.Interleave(mic_buffer_.data(), dest, frames);
+        return frames * 2;
+    }
+#endif
+    return ReadInput(dest, samples);
+}
+
+int NoAudioCodec::ReadInput(int16_t* dest, int samples) {
     size_t bytes_read;
 
-    std::vector<int32_t> bit32_buffer(samples);
-    if (i2s_channel_read(rx_handle_, bit32_buffer.data(), samples * sizeof(int32_t), &bytes_read, portMAX_DELAY) != ESP_OK) {
+    read_buffer_.resize(samples);
+    if (i2s_channel_read(rx_handle_, read_buffer_.data(), samples * sizeof(int32_t), &bytes_read, portMAX_DELAY) != ESP_OK) {
         ESP_LOGE(TAG, "Read Failed!");
         return 0;
     }
 
     samples = bytes_read / sizeof(int32_t);
-    for (int i = 0; i < samples; i++) {
-        int32_t value = bit32_buffer[i] >> 12;
-        dest[i] = (value > INT16_MAX) ? INT16_MAX : (value < -INT16_MAX) ? -INT16_MAX : (int16_t)value;
-    }
+    AudioKernels::ShiftToInt16(read_buffer_.data(), dest, samples, 12);
     return samples;
 }
 
@@ -261,6 +286,9 @@ void NoAudioCodec::EnableInput(bool enable) {
     }
     if (enable) {
         ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+        reference_.OnInputEnabled();
+#endif
     } else {
         ESP_ERROR_CHECK(i2s_channel_disable(rx_handle_));
     }
@@ -288,6 +316,7 @@ NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output
 
 NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output_sample_rate, gpio_num_t spk_bclk, gpio_num_t spk_ws, gpio_num_t spk_dout, i2s_std_slot_mask_t spk_slot_mask, gpio_num_t mic_sck, gpio_num_t mic_din) {
     duplex_ = false;
+    software_volume_ = true;
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
 
@@ -362,9 +391,12 @@ NoAudioCodecSimplexPdm::NoAudioCodecSimplexPdm(int input_sample_rate, int output
     ESP_LOGE(TAG, "PDM is not supported");
 #endif
     ESP_LOGI(TAG, "Simplex channels created");
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    AttachReference();
+#endif
 }
 
-int NoAudioCodecSimplexPdm::Read(int16_t* dest, int samples) {
+int NoAudioCodecSimplexPdm::ReadInput(int16_t* dest, int samples) {
     size_t bytes_read;
 
     // PDM 解调后的数据位宽为 16 位，直接读取到目标缓冲区
@@ -375,11 +407,7 @@ int NoAudioCodecSimplexPdm::Read(int16_t* dest, int samples) {
 
     samples = bytes_read / sizeof(int16_t);
     if (input_gain_ > 0) {
-        int gain_factor = (int)input_gain_;
-        for (int i = 0; i < samples; i++) {
-            int32_t amplified = dest[i] * gain_factor;
-            dest[i] = (amplified > INT16_MAX) ? INT16_MAX : (amplified < -INT16_MAX) ? -INT16_MAX : (int16_t)amplified;
-        }
+        AudioKernels::ApplyGain(dest, samples, (int32_t)input_gain_);
     }
     return samples;
 }
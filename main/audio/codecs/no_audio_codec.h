@@ -2,17 +2,31 @@
 #define _NO_AUDIO_CODEC_H
 
 #include "audio_codec.h"
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+#include "software_reference.h"
+#endif
 
 #include <driver/gpio.h>
 #include <driver/i2s_pdm.h>
 #include <mutex>
+#include <vector>
 
 class NoAudioCodec : public AudioCodec {
 protected:
     std::mutex data_if_mutex_;
-
-    virtual int Write(const int16_t* data, int samples) override;
-    virtual int Read(int16_t* dest, int samples) override;
+    // 32-bit I2S slots, kept between calls so their capacity settles after the first frame
+    std::vector<int32_t> write_buffer_;
+    std::vector<int32_t> read_buffer_;
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+    SoftwareReference reference_;
+    std::vector<int16_t> mic_buffer_;
+    // End of the constructors, once the channels exist. The input gets a second, reference channel
+    void AttachReference();
+#endif
+    virtual int Write(const int16_t* data, int samples) override final;
+    virtual int Read(int16_t* dest, int samples) override final;
+    // Mono microphone samples, Read() adds the reference to them
+    virtual int ReadInput(int16_t* dest, int samples);
     virtual void EnableInput(bool enable) override;
     virtual void EnableOutput(bool enable) override;
 
@@ -35,7 +49,7 @@ class NoAudioCodecSimplexPdm : public NoAudioCodec {
 public:
     NoAudioCodecSimplexPdm(int input_sample_rate, int output_sample_rate, gpio_num_t spk_bclk, gpio_num_t spk_ws, gpio_num_t spk_dout, gpio_num_t mic_sck,  gpio_num_t mic_din);
     NoAudioCodecSimplexPdm(int input_sample_rate, int output_sample_rate, gpio_num_t spk_bclk, gpio_num_t spk_ws, gpio_num_t spk_dout, i2s_std_slot_mask_t spk_slot_mask, gpio_num_t mic_sck,  gpio_num_t mic_din);
-    int Read(int16_t* dest, int samples);
+    int ReadInput(int16_t* dest, int samples) override final;
 };
 
 #endif // _NO_AUDIO_CODEC_H
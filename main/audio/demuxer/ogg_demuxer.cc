@@ -22,6 +22,9 @@ void OggDemuxer::Reset()
     ctx_.body_size = 0;
     ctx_.body_offset = 0;
     ctx_.packet_continued = false;
+    ctx_.skip_packet = false;
+    ctx_.page_offset = 0;
+    stream_offset_ = 0;
     
     // 清空缓冲区数据
     memset(ctx_.header, 0, sizeof(ctx_.header));
@@ -29,11 +32,70 @@ void OggDemuxer::Reset()
     memset(ctx_.packet_buf, 0, sizeof(ctx_.packet_buf));
 }
 
+/// @brief 丢弃解析状态并重新寻找页头，保留Opus头信息
+void OggDemuxer::Resync()
+{
+    state_ = ParseState::FIND_PAGE;
+    ctx_.packet_len = 0;
+    ctx_.seg_count = 0;
+    ctx_.seg_index = 0;
+    ctx_.data_offset = 0;
+    ctx_.bytes_needed = 4;
+    ctx_.seg_remaining = 0;
+    ctx_.body_size = 0;
+    ctx_.body_offset = 0;
+    ctx_.packet_continued = false;
+    ctx_.skip_packet = false;
+    ctx_.page_offset = 0;
+    stream_offset_ = 0;
+}
+
+/// @brief 一个完整的包：先识别OpusHead/OpusTags，其余作为音频包回调
+void OggDemuxer::EmitPacket(const uint8_t* data, size_t len)
+{
+    if (ctx_.skip_packet) {
+        // 重新同步后第一页开头的续包，前半部分已经丢失
+        ctx_.skip_packet = false;
+        return;
+    }
+    if (!opus_info_.head_seen) {
+        if (len >= 8 && memcmp(data, "OpusHead", 8) == 0) {
+            opus_info_.head_seen = true;
+            if (len >= 19) {
+                opus_info_.sample_rate = data[12] | (data[13] << 8) | (data[14] << 16) | (data[15] << 24);
+                ESP_LOGI(TAG, "OpusHead found, sample_rate=%d", opus_info_.sample_rate);
+            }
+            return;
+        }
+    }
+    if (!opus_info_.tags_seen) {
+        if (len >= 8 && memcmp(data, "OpusTags", 8) == 0) {
+            opus_info_.tags_seen = true;
+            ESP_LOGI(TAG, "OpusTags found.");
+            return;
+        }
+    }
+    if (opus_info_.head_seen && opus_info_.tags_seen) {
+        if (on_demuxer_finished_) {
+            on_demuxer_finished_(data, opus_info_.sample_rate, len);
+        }
+    } else {
+        ESP_LOGW(TAG, "当前Ogg容器未解析到OpusHead/OpusTags，丢弃");
+    }
+}
+
 /// @brief 处理数据块
 /// @param data 输入数据
 /// @param size 输入数据大小
 /// @return 已处理的字节数
 size_t OggDemuxer::Process(const uint8_t* data, size_t size)
+{
+    size_t processed = Parse(data, size);
+    stream_offset_ += processed;
+    return processed;
+}
+
+size_t OggDemuxer::Parse(const uint8_t* data, size_t size)
 {
     size_t processed = 0;  // 已处理的字节数
     
@@ -52,6 +114,7 @@ size_t OggDemuxer::Process(const uint8_t* data, size_t size)
                 if (ctx_.bytes_needed == 0) {
                     // 检查是否匹配"OggS"
                     if (memcmp(ctx_.header, "OggS", 4) == 0) {
+                        ctx_.page_offset = stream_offset_ + processed - 4;
                         state_ = ParseState::PARSE_HEADER;
                         ctx_.data_offset = 4;
                         ctx_.bytes_needed = 27 - 4;  // 还需要23字节完成页头
@@ -81,6 +144,7 @@ size_t OggDemuxer::Process(const uint8_t* data, size_t size)
                 if (found) {
                     // 找到"OggS"，跳过已搜索的字节
                     processed += i;
+                    ctx_.page_offset = stream_offset_ + processed;
                     
                     // 不记录找到的"OggS"，无必要
                     // memcpy(ctx_.header, data + processed, 4);
@@ -140,6 +204,18 @@ size_t OggDemuxer::Process(const uint8_t* data, size_t size)
                     break;
                 }
                 
+                if (on_page_) {
+                    int64_t granule = 0;
+                    for (int i = 13; i >= 6; i--) {
+                        granule = (granule << 8) | ctx_.header[i];
+                    }
+                    on_page_(ctx_.page_offset, granule);
+                }
+                // 续页的开头属于上一页的包，如果没有收到它的前半部分就丢弃
+                if ((ctx_.header[5] & 0x01) && ctx_.packet_len == 0 && !ctx_.packet_continued) {
+                    ctx_.skip_packet = true;
+                }
+
                 ctx_.seg_count = ctx_.header[26];
                 if (ctx_.seg_count > 0 && ctx_.seg_count <= 255) {
                     state_ = ParseState::PARSE_SEGMENTS;
@@ -197,6 +273,29 @@ size_t OggDemuxer::Process(const uint8_t* data, size_t size)
             
           case ParseState::PARSE_DATA: {
             while (ctx_.seg_index < ctx_.seg_count && processed < size) {
+                // 零拷贝：包从这里开始、在本页结束，并且完整地在data中，直接回调指向data的指针
+                if (ctx_.packet_len == 0 && ctx_.seg_remaining == 0) {
+                    size_t end = ctx_.seg_index;
+                    size_t len = 0;
+                    while (end < ctx_.seg_count && ctx_.seg_table[end] == 255) {
+                        len += 255;
+                        end++;
+                    }
+                    if (end < ctx_.seg_count && len + ctx_.seg_table[end] <= size - processed) {
+                        len += ctx_.seg_table[end];
+                        const uint8_t* packet = data + processed;
+                        processed += len;
+                        ctx_.body_offset += len;
+                        ctx_.seg_index = end + 1;
+                        if (len > 0) {
+                            EmitPacket(packet, len);
+                        } else {
+                            ctx_.skip_packet = false;
+                        }
+                        continue;
+                    }
+                }
+
                 uint8_t seg_len = ctx_.seg_table[ctx_.seg_index];
                 
                 // 检查段数据是否已经部分读取
@@ -208,7 +307,14 @@ size_t OggDemuxer::Process(const uint8_t* data, size_t size)
                 
                 // 检查缓冲区是否足够
                 if (ctx_.packet_len + seg_len > sizeof(ctx_.packet_buf)) {
-                    ESP_LOGE(TAG, "包缓冲区溢出: %zu + %u > %zu", ctx_.packet_len, seg_len, sizeof(ctx_.packet_buf));
+                    if (opus_info_.head_seen && !opus_info_.tags_seen && ctx_.packet_len >= 8 &&
+                        memcmp(ctx_.packet_buf, "OpusTags", 8) == 0) {
+                        // 元数据不需要，丢弃其余部分（下一页的续包会被跳过），音频照常解析
+                        opus_info_.tags_seen = true;
+                        ESP_LOGW(TAG, "OpusTags超过包缓冲区，已跳过");
+                    } else {
+                        ESP_LOGE(TAG, "包缓冲区溢出: %zu + %u > %zu", ctx_.packet_len, seg_len, sizeof(ctx_.packet_buf));
+                    }
                     state_ = ParseState::FIND_PAGE;
                     ctx_.packet_len = 0;
                     ctx_.packet_continued = false;
@@ -238,41 +344,9 @@ size_t OggDemuxer::Process(const uint8_t* data, size_t size)
                 if (!seg_continued) {
                     // 包结束
                     if (ctx_.packet_len) {
-                        if (!opus_info_.head_seen) {
-                            if (ctx_.packet_len >=8 && memcmp(ctx_.packet_buf, "OpusHead", 8) == 0) {
-                                opus_info_.head_seen = true;
-                                if (ctx_.packet_len >= 19) {
-                                    opus_info_.sample_rate = ctx_.packet_buf[12] | 
-                                                            (ctx_.packet_buf[13] << 8) | 
-                                                            (ctx_.packet_buf[14] << 16) | 
-                                                            (ctx_.packet_buf[15] << 24);
-                                    ESP_LOGI(TAG, "OpusHead found, sample_rate=%d", opus_info_.sample_rate);
-                                }
-                                ctx_.packet_len = 0;
-                                ctx_.packet_continued = false;
-                                ctx_.seg_index++;
-                                ctx_.seg_remaining = 0;
-                                continue;
-                            }
-                        }
-                        if (!opus_info_.tags_seen) {
-                            if (ctx_.packet_len >= 8 && memcmp(ctx_.packet_buf, "OpusTags", 8) == 0) {
-                                opus_info_.tags_seen = true;
-                                ESP_LOGI(TAG, "OpusTags found.");
-                                ctx_.packet_len = 0;
-                                ctx_.packet_continued = false;
-                                ctx_.seg_index++;
-                                ctx_.seg_remaining = 0;
-                                continue;  
-                            }
-                        }
-                        if (opus_info_.head_seen && opus_info_.tags_seen) {
-                            if (on_demuxer_finished_) {
-                                on_demuxer_finished_(ctx_.packet_buf, opus_info_.sample_rate, ctx_.packet_len);
-                            }
-                        } else {
-                            ESP_LOGW(TAG, "当前Ogg容器未解析到OpusHead/OpusTags，丢弃");
-                        }
+                        EmitPacket(ctx_.packet_buf, ctx_.packet_len);
+                    } else {
+                        ctx_.skip_packet = false;
                     }
                     ctx_.packet_len = 0;
                     ctx_.packet_continued = false;
@@ -6,6 +6,15 @@
 #include <cstring>
 #include <vector>
 
+#include <sdkconfig.h>
+
+// 单个Opus包最多120ms，2KB在136kbps以下都够用；只有带封面的OpusTags会更大
+#if CONFIG_USE_LOW_MEMORY_PROFILE
+#define OGG_PACKET_BUFFER_SIZE 2048
+#else
+#define OGG_PACKET_BUFFER_SIZE 8192
+#endif
+
 class OggDemuxer {
 private:
     enum ParseState : int8_t {
@@ -25,9 +34,10 @@ private:
     // 使用固定大小的缓冲区避免动态分配
     struct context_t {
         bool packet_continued{false};   // 当前包是否跨多个段
+        bool skip_packet{false};        // 当前包的开头在重新同步之前，整包丢弃
         uint8_t header[27];             // Ogg页头
         uint8_t seg_table[255];         // 当前存储的段表
-        uint8_t packet_buf[8192];       // 8KB包缓冲区
+        uint8_t packet_buf[OGG_PACKET_BUFFER_SIZE];  // 包缓冲区
         size_t packet_len = 0;          // 缓冲区中累计的数据长度
         size_t seg_count = 0;           // 当前页段数
         size_t seg_index = 0;           // 当前处理的段索引
@@ -36,6 +46,7 @@ private:
         size_t seg_remaining = 0;       // 当前段剩余需要读取的字节数
         size_t body_size = 0;           // 数据体总大小
         size_t body_offset = 0;         // 数据体已读取的字节数
+        size_t page_offset = 0;         // 当前页在流中的起始位置
     };
     
 public:
@@ -44,7 +55,12 @@ public:
     }
     
     void Reset();
+
+    /// @brief 丢弃当前解析状态，从下一个页头继续（跳转后使用），已解析的OpusHead/OpusTags保留
+    void Resync();
     
+    /// @brief 处理数据块。完全位于data内的包直接以指向data的指针回调，不复制；
+    ///        只有跨越数据块或跨页的包才复制到packet_buf
     size_t Process(const uint8_t* data, size_t size);
 
     /// @brief 设置解封装完毕后回调处理函数
@@ -52,12 +68,24 @@ public:
     void OnDemuxerFinished(std::function<void(const uint8_t* data, int sample_rate, size_t len)> on_demuxer_finished) {
         on_demuxer_finished_ = on_demuxer_finished;
     }
+
+    /// @brief 设置页头回调，用于建立页索引（跳转）
+    /// @param on_page 参数为页在流中的起始位置（自Reset/Resync以来处理的字节数）和页的granule position，
+    ///                没有包在该页结束时granule为-1
+    void OnPage(std::function<void(size_t offset, int64_t granule)> on_page) {
+        on_page_ = on_page;
+    }
 private:
+    void EmitPacket(const uint8_t* data, size_t len);
+    size_t Parse(const uint8_t* data, size_t size);
+
 
     ParseState  state_ = ParseState::FIND_PAGE;
     context_t   ctx_;
     Opus_t      opus_info_;
     std::function<void(const uint8_t*, int, size_t)> on_demuxer_finished_;
+    std::function<void(size_t, int64_t)> on_page_;
+    size_t stream_offset_ = 0;      // 自Reset/Resync以来处理的字节数
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "ogg_reader.h"
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "OggReader"
+
+#define OGG_PAGE_HEADER_SIZE 27
+// Same limit as the packet buffer of OggDemuxer
+#define OGG_READER_MAX_PACKET_SIZE 8192
+
+void OggReader::Open(std::string_view ogg) {
+    Close();
+    data_ = reinterpret_cast<const uint8_t*>(ogg.data());
+    size_ = ogg.size();
+}
+
+void OggReader::Close() {
+    data_ = nullptr;
+    size_ = 0;
+    offset_ = 0;
+    seg_table_ = nullptr;
+    seg_count_ = 0;
+    seg_index_ = 0;
+    body_ = nullptr;
+    continued_.clear();
+    head_seen_ = false;
+    sample_rate_ = 48000;
+}
+
+bool OggReader::NextPacket(const uint8_t*& data, size_t& size) {
+    while (NextRawPacket(data, size)) {
+        if (size >= 8 && memcmp(data, "OpusHead", 8) == 0) {
+            head_seen_ = true;
+            if (size >= 19) {
+                sample_rate_ = data[12] | (data[13] << 8) | (data[14] << 16) | (data[15] << 24);
+            }
+            continue;
+        }
+        if (size >= 8 && memcmp(data, "OpusTags", 8) == 0) {
+            continue;
+        }
+        if (!head_seen_) {
+            ESP_LOGW(TAG, "Packet before OpusHead, dropped");
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool OggReader::NextRawPacket(const uint8_t*& data, size_t& size) {
+    continued_.clear();
+    while (true) {
+        if (seg_index_ >= seg_count_ && !NextPage()) {
+            return false;
+        }
+
+        // A packet is a run of 255 byte segments closed by a shorter one, contiguous within a page
+        const uint8_t* start = body_;
+        size_t length = 0;
+        bool complete = false;
+        while (seg_index_ < seg_count_) {
+            uint8_t seg_len = seg_table_[seg_index_++];
+            length += seg_len;
+            if (seg_len < 255) {
+                complete = true;
+                break;
+            }
+        }
+        body_ += length;
+
+        if (complete && continued_.empty()) {
+            data = start;
+            size = length;
+            return true;
+        }
+
+        // The packet continues on the next page, gather it
+        if (continued_.size() + length > OGG_READER_MAX_PACKET_SIZE) {
+            ESP_LOGE(TAG, "Packet too large: %u + %u", continued_.size(), length);
+            continued_.clear();
+            continue;
+        }
+        continued_.insert(continued_.end(), start, start + length);
+        if (complete) {
+            data = continued_.data();
+            size = continued_.size();
+            return true;
+        }
+    }
+}
+
+bool OggReader::NextPage() {
+    while (data_ != nullptr && offset_ + OGG_PAGE_HEADER_SIZE <= size_) {
+        const uint8_t* page = data_ + offset_;
+        if (memcmp(page, "OggS", 4) != 0 || page[4] != 0) {
+            // Not at a page boundary, resync
+            offset_++;
+            continue;
+        }
+
+        size_t seg_count = page[26];
+        if (offset_ + OGG_PAGE_HEADER_SIZE + seg_count > size_) {
+            break;
+        }
+        const uint8_t* seg_table = page + OGG_PAGE_HEADER_SIZE;
+        size_t body_size = 0;
+        for (size_t i = 0; i < seg_count; i++) {
+            body_size += seg_table[i];
+        }
+        size_t page_size = OGG_PAGE_HEADER_SIZE + seg_count + body_size;
+        if (offset_ + page_size > size_) {
+            ESP_LOGW(TAG, "Truncated page at %u", offset_);
+            break;
+        }
+
+        seg_table_ = seg_table;
+        seg_count_ = seg_count;
+        seg_index_ = 0;
+        body_ = seg_table + seg_count;
+        offset_ += page_size;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,46 @@
+#ifndef OGG_READER_H_
+#define OGG_READER_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+/*
+ * Pull based Ogg Opus reader over a stream that is fully in memory (embedded or
+ * memory mapped assets).
+ *
+ * Unlike OggDemuxer it does not copy the packets: NextPacket() returns a pointer into
+ * the stream itself. Only a packet that continues on the next page is gathered into an
+ * internal buffer, which stays valid until the next call.
+ */
+class OggReader {
+public:
+    // The stream has to stay valid while packets are read from it
+    void Open(std::string_view ogg);
+    void Close();
+
+    // Returns the next Opus audio packet, the OpusHead / OpusTags headers are skipped
+    bool NextPacket(const uint8_t*& data, size_t& size);
+
+    // Valid once the first audio packet has been returned
+    int sample_rate() const { return sample_rate_; }
+    bool is_open() const { return data_ != nullptr; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    size_t offset_ = 0;             // Start of the next page
+    const uint8_t* seg_table_ = nullptr;
+    size_t seg_count_ = 0;
+    size_t seg_index_ = 0;
+    const uint8_t* body_ = nullptr; // Read position in the current page body
+    std::vector<uint8_t> continued_;
+    bool head_seen_ = false;
+    int sample_rate_ = 48000;
+
+    bool NextPage();
+    bool NextRawPacket(const uint8_t*& data, size_t& size);
+};
+
+#endif
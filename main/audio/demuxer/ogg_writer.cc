@@ -0,0 +1,115 @@
+#include "ogg_writer.h"
+#include <cstring>
+
+#define OGG_PAGE_HEADER_SIZE 27
+#define OGG_MAX_SEGMENTS 255
+#define OGG_FLAG_BOS 0x02
+#define OGG_FLAG_EOS 0x04
+
+// CRC-32 of the page with polynomial 0x04C11DB7, not reflected, no initial or final xor
+static uint32_t OggCrc(const uint8_t* data, size_t size) {
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t r = i << 24;
+            for (int j = 0; j < 8; j++) {
+                r = (r & 0x80000000) ? (r << 1) ^ 0x04C11DB7 : r << 1;
+            }
+            table[i] = r;
+        }
+        table_ready = true;
+    }
+    uint32_t crc = 0;
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc << 8) ^ table[((crc >> 24) ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+static void PutLe16(uint8_t* p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void PutLe32(uint8_t* p, uint32_t value) {
+    PutLe16(p, value);
+    PutLe16(p + 2, value >> 16);
+}
+
+void OggWriter::Begin(uint32_t serial, int sample_rate, Sink sink) {
+    sink_ = sink;
+    serial_ = serial;
+    page_sequence_ = 0;
+    granule_ = 0;
+    page_start_granule_ = 0;
+    lacing_.clear();
+    body_.clear();
+
+    // Mono, no pre-skip and no gain, the decoders of the device add no delay to drop
+    uint8_t head[19] = {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, 1};
+    PutLe32(head + 12, sample_rate);
+    body_.assign(head, head + sizeof(head));
+    lacing_.push_back(sizeof(head));
+    WritePage(OGG_FLAG_BOS);
+
+    static const char vendor[] = "xiaozhi";
+    uint8_t tags[8 + 4 + sizeof(vendor) - 1 + 4];
+    memcpy(tags, "OpusTags", 8);
+    PutLe32(tags + 8, sizeof(vendor) - 1);
+    memcpy(tags + 12, vendor, sizeof(vendor) - 1);
+    PutLe32(tags + 12 + sizeof(vendor) - 1, 0);
+    body_.assign(tags, tags + sizeof(tags));
+    lacing_.push_back(sizeof(tags));
+    WritePage(0);
+}
+
+void OggWriter::AddPacket(const uint8_t* data, size_t size, int duration_ms) {
+    // A packet of n bytes takes n / 255 + 1 segments, the last one shorter than 255
+    size_t segments = size / 255 + 1;
+    if (!lacing_.empty() && lacing_.size() + segments > OGG_MAX_SEGMENTS) {
+        WritePage(0);
+    }
+    for (size_t i = 0; i + 1 < segments; i++) {
+        lacing_.push_back(255);
+    }
+    lacing_.push_back(size % 255);
+    body_.insert(body_.end(), data, data + size);
+    granule_ += duration_ms * 48;
+    if (granule_ - page_start_granule_ >= OGG_WRITER_PAGE_DURATION_MS * 48) {
+        WritePage(0);
+    }
+}
+
+void OggWriter::Finish() {
+    // An empty page still carries the end of stream flag
+    WritePage(OGG_FLAG_EOS);
+    sink_ = nullptr;
+}
+
+void OggWriter::WritePage(uint8_t flags) {
+    page_.resize(OGG_PAGE_HEADER_SIZE + lacing_.size() + body_.size());
+    uint8_t* p = page_.data();
+    memcpy(p, "OggS", 4);
+    p[4] = 0;
+    p[5] = flags;
+    PutLe32(p + 6, (uint32_t)granule_);
+    PutLe32(p + 10, (uint32_t)(granule_ >> 32));
+    PutLe32(p + 14, serial_);
+    PutLe32(p + 18, page_sequence_++);
+    PutLe32(p + 22, 0);
+    p[26] = lacing_.size();
+    if (!lacing_.empty()) {
+        memcpy(p + OGG_PAGE_HEADER_SIZE, lacing_.data(), lacing_.size());
+    }
+    if (!body_.empty()) {
+        memcpy(p + OGG_PAGE_HEADER_SIZE + lacing_.size(), body_.data(), body_.size());
+    }
+    PutLe32(p + 22, OggCrc(p, page_.size()));
+    lacing_.clear();
+    body_.clear();
+    page_start_granule_ = granule_;
+    if (sink_) {
+        sink_(page_.data(), page_.size());
+    }
+}
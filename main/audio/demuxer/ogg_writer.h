@@ -0,0 +1,44 @@
+#ifndef OGG_WRITER_H_
+#define OGG_WRITER_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// A page is closed once it holds this much audio, bounds what a cut off stream loses
+#define OGG_WRITER_PAGE_DURATION_MS 1000
+
+/*
+ * Push based Ogg Opus writer, the counterpart of OggDemuxer.
+ *
+ * Begin() puts out the OpusHead and OpusTags pages, AddPacket() gathers the packets into pages
+ * and Finish() closes the last one with the end of stream flag. Every page is handed to the sink
+ * in one call as soon as it is complete, so the stream can be stored or sent while it grows.
+ */
+class OggWriter {
+public:
+    using Sink = std::function<void(const uint8_t* data, size_t size)>;
+
+    void Begin(uint32_t serial, int sample_rate, Sink sink);
+    void AddPacket(const uint8_t* data, size_t size, int duration_ms);
+    void Finish();
+
+    // Audio written so far
+    int64_t duration_ms() const { return granule_ / 48; }
+
+private:
+    Sink sink_;
+    uint32_t serial_ = 0;
+    uint32_t page_sequence_ = 0;
+    // Granule positions count 48 kHz samples whatever the input rate
+    int64_t granule_ = 0;
+    int64_t page_start_granule_ = 0;
+    std::vector<uint8_t> lacing_;
+    std::vector<uint8_t> body_;
+    std::vector<uint8_t> page_;
+
+    void WritePage(uint8_t flags);
+};
+
+#endif
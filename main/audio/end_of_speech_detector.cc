@@ -0,0 +1,47 @@
+#include "end_of_speech_detector.h"
+#include "audio_kernels.h"
+
+#include <esp_log.h>
+
+#define TAG "EndOfSpeech"
+
+// Floor of the noise estimate, so that digital silence does not make every frame voiced
+#define EOS_MIN_NOISE_FLOOR 30
+
+bool EndOfSpeechDetector::Feed(const int16_t* data, size_t samples, bool vad_speaking) {
+    if (ended_ || samples == 0) {
+        return false;
+    }
+
+    // Processed audio is 16 kHz mono
+    int frame_ms = samples / 16;
+    int32_t energy = AudioKernels::MeanAbs(data, samples);
+    if (noise_floor_ == 0) {
+        noise_floor_ = std::max<int32_t>(energy, EOS_MIN_NOISE_FLOOR);
+    }
+
+    bool voiced = vad_speaking && energy >= noise_floor_ * config_.speech_ratio;
+    if (voiced) {
+        speech_ms_ += frame_ms;
+        silence_ms_ = 0;
+    } else {
+        // Falls quickly and rises slowly, so speech pauses do not lift the floor
+        int shift = energy < noise_floor_ ? 2 : 5;
+        noise_floor_ = std::max<int32_t>(noise_floor_ + ((energy - noise_floor_) >> shift), EOS_MIN_NOISE_FLOOR);
+        silence_ms_ += frame_ms;
+    }
+
+    if (speech_ms_ >= config_.min_speech_ms && silence_ms_ >= config_.hangover_ms) {
+        ESP_LOGI(TAG, "End of speech after %d ms of speech, noise floor %ld", speech_ms_, (long)noise_floor_);
+        ended_ = true;
+        return true;
+    }
+    return false;
+}
+
+void EndOfSpeechDetector::Reset() {
+    noise_floor_ = 0;
+    speech_ms_ = 0;
+    silence_ms_ = 0;
+    ended_ = false;
+}
@@ -0,0 +1,36 @@
+#ifndef END_OF_SPEECH_DETECTOR_H
+#define END_OF_SPEECH_DETECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct EndOfSpeechConfig {
+    int hangover_ms = 700;      // Silence after speech that ends the utterance
+    int min_speech_ms = 300;    // Voiced audio needed before an end can be reported
+    int speech_ratio = 3;       // Frames this many times above the noise floor count as voiced
+};
+
+/*
+ * Device-side end of utterance detection for the auto stop listening mode.
+ *
+ * Frames count as voiced when the audio processor VAD says so and they stand out from the noise
+ * floor, which follows the unvoiced frames, so steady background noise that keeps the VAD on does
+ * not hold the turn open. Feed() returns true once, on the frame that ends the utterance.
+ */
+class EndOfSpeechDetector {
+public:
+    void SetConfig(const EndOfSpeechConfig& config) { config_ = config; }
+    const EndOfSpeechConfig& config() const { return config_; }
+
+    bool Feed(const int16_t* data, size_t samples, bool vad_speaking);
+    void Reset();
+
+private:
+    EndOfSpeechConfig config_;
+    int32_t noise_floor_ = 0;
+    int speech_ms_ = 0;
+    int silence_ms_ = 0;
+    bool ended_ = false;
+};
+
+#endif // END_OF_SPEECH_DETECTOR_H
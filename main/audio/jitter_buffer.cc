@@ -0,0 +1,187 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cmath>
+
+#define TAG "JitterBuffer"
+
+// Gaps longer than this are not reported as lost frames
+#define JITTER_BUFFER_MAX_LOST_FRAMES 1000
+
+static int64_t NowMs() {
+    return esp_timer_get_time() / 1000;
+}
+
+JitterBuffer::JitterBuffer(size_t capacity) : capacity_(capacity) {
+}
+
+bool JitterBuffer::Push(std::unique_ptr<AudioStreamPacket>& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = NowMs();
+    uint32_t sequence = packet->sequence;
+
+    // Too late, we have already played past it
+    if (sequence != 0 && has_next_sequence_ && (int32_t)(sequence - next_sequence_) < 0) {
+        statistics_.late_packets++;
+        return false;
+    }
+    if (packets_.size() >= capacity_) {
+        return false;
+    }
+
+    UpdateJitter(*packet, now);
+    if (!playing_ && packets_.empty()) {
+        buffering_since_ms_ = now;
+    }
+
+    if (sequence == 0 || packets_.empty() || packets_.back()->sequence == 0 ||
+        (int32_t)(sequence - packets_.back()->sequence) > 0) {
+        packets_.push_back(std::move(packet));
+        return true;
+    }
+
+    // Out of order, find its place from the back
+    auto it = packets_.end();
+    while (it != packets_.begin() && (int32_t)(sequence - (*(it - 1))->sequence) < 0) {
+        --it;
+    }
+    if (it != packets_.begin() && (*(it - 1))->sequence == sequence) {
+        statistics_.late_packets++;
+        return false;
+    }
+    packets_.insert(it, std::move(packet));
+    statistics_.reordered_packets++;
+    return true;
+}
+
+std::unique_ptr<AudioStreamPacket> JitterBuffer::Pop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = NowMs();
+
+    if (packets_.empty()) {
+        if (playing_) {
+            playing_ = false;
+            statistics_.underruns++;
+            ESP_LOGD(TAG, "Underrun, target depth %u", target_depth_);
+        }
+        return nullptr;
+    }
+
+    if (!playing_) {
+        // Short clips never reach the target depth, start them after the hold time anyway
+        size_t start_depth = GetStartDepth();
+        if (packets_.size() < start_depth && now - buffering_since_ms_ < (int64_t)start_depth * frame_duration_ms_) {
+            return nullptr;
+        }
+        playing_ = true;
+    }
+
+    auto& front = packets_.front();
+    if (front->sequence != 0 && has_next_sequence_ && front->sequence != next_sequence_) {
+        // The next packet is missing, give it one frame to show up unless we are already deep enough
+        if (packets_.size() < target_depth_) {
+            if (missing_since_ms_ == 0) {
+                missing_since_ms_ = now;
+            }
+            if (now - missing_since_ms_ < frame_duration_ms_) {
+                return nullptr;
+            }
+        }
+        uint32_t gap = front->sequence - next_sequence_;
+        front->lost_frames = std::min<uint32_t>(gap, JITTER_BUFFER_MAX_LOST_FRAMES);
+    }
+    missing_since_ms_ = 0;
+    return PopFront();
+}
+
+std::unique_ptr<AudioStreamPacket> JitterBuffer::PopFront() {
+    auto packet = std::move(packets_.front());
+    packets_.pop_front();
+    if (packet->sequence != 0) {
+        next_sequence_ = packet->sequence + 1;
+        has_next_sequence_ = true;
+    }
+    return packet;
+}
+
+void JitterBuffer::Clear(std::function<void(std::unique_ptr<AudioStreamPacket>)> release) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!packets_.empty()) {
+        auto packet = std::move(packets_.front());
+        packets_.pop_front();
+        release(std::move(packet));
+    }
+    playing_ = false;
+    has_next_sequence_ = false;
+    missing_since_ms_ = 0;
+    has_last_arrival_ = false;
+}
+
+bool JitterBuffer::empty() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return packets_.empty();
+}
+
+void JitterBuffer::SetPrerollMs(int preroll_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    preroll_ms_ = std::max(preroll_ms, 0);
+}
+
+// Packets needed before playback starts, the caller holds mutex_
+size_t JitterBuffer::GetStartDepth() const {
+    size_t preroll = (preroll_ms_ + frame_duration_ms_ - 1) / frame_duration_ms_;
+    return std::max(target_depth_, preroll);
+}
+
+int JitterBuffer::GetHoldTimeMs() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (packets_.empty()) {
+        return -1;
+    }
+    int64_t now = NowMs();
+    int64_t remaining = 0;
+    if (!playing_) {
+        remaining = (int64_t)GetStartDepth() * frame_duration_ms_ - (now - buffering_since_ms_);
+    } else if (missing_since_ms_ != 0) {
+        remaining = frame_duration_ms_ - (now - missing_since_ms_);
+    }
+    return std::max<int64_t>(remaining, 0);
+}
+
+JitterBufferStatistics JitterBuffer::GetStatistics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    JitterBufferStatistics statistics = statistics_;
+    statistics.depth = packets_.size();
+    statistics.target_depth = target_depth_;
+    statistics.jitter_ms = (uint32_t)jitter_ms_;
+    return statistics;
+}
+
+void JitterBuffer::UpdateJitter(const AudioStreamPacket& packet, int64_t now_ms) {
+    if (packet.frame_duration > 0) {
+        frame_duration_ms_ = packet.frame_duration;
+    }
+
+    // Media time of the packet: sequence number, then timestamp, then arrival order
+    int64_t media_ms;
+    if (packet.sequence != 0) {
+        media_ms = (int64_t)packet.sequence * frame_duration_ms_;
+    } else if (packet.timestamp != 0) {
+        media_ms = packet.timestamp;
+    } else {
+        media_ms = (int64_t)(++arrival_index_) * frame_duration_ms_;
+    }
+
+    if (has_last_arrival_) {
+        float d = (float)((now_ms - last_arrival_ms_) - (media_ms - last_media_ms_));
+        jitter_ms_ += (std::fabs(d) - jitter_ms_) / 16.0f;
+    }
+    has_last_arrival_ = true;
+    last_arrival_ms_ = now_ms;
+    last_media_ms_ = media_ms;
+
+    size_t target = 1 + (size_t)std::ceil(3.0f * jitter_ms_ / frame_duration_ms_);
+    target_depth_ = std::clamp<size_t>(target, JITTER_BUFFER_MIN_DEPTH, JITTER_BUFFER_MAX_DEPTH);
+}
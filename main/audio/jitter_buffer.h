@@ -0,0 +1,77 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <functional>
+
+#include "protocol.h"
+
+#define JITTER_BUFFER_MIN_DEPTH 1
+#define JITTER_BUFFER_MAX_DEPTH 10
+
+struct JitterBufferStatistics {
+    uint32_t depth = 0;
+    uint32_t target_depth = 0;
+    uint32_t jitter_ms = 0;
+    uint32_t underruns = 0;
+    uint32_t late_packets = 0;
+    uint32_t reordered_packets = 0;
+};
+
+/*
+ * Downlink jitter buffer between Protocol::OnIncomingAudio and the Opus decoder.
+ *
+ * Push() is called by the network task, Pop() by the decoder task. Packets are kept in
+ * sequence order (transports without sequence numbers keep arrival order), and playback
+ * only starts once the buffer holds the target depth, which follows the measured arrival
+ * jitter (RFC 3550 style estimate), or the pre-roll if that is deeper. Running empty while
+ * playing counts as an underrun and the buffer refills to that depth before it releases
+ * packets again.
+ */
+class JitterBuffer {
+public:
+    explicit JitterBuffer(size_t capacity);
+
+    // Returns false if the packet was dropped, the caller still owns it then
+    bool Push(std::unique_ptr<AudioStreamPacket>& packet);
+    // Returns nullptr while buffering, sets lost_frames when it skips over missing packets
+    std::unique_ptr<AudioStreamPacket> Pop();
+    void Clear(std::function<void(std::unique_ptr<AudioStreamPacket>)> release);
+
+    bool empty() const;
+    // Audio held back before playback starts even when the measured jitter asks for less
+    void SetPrerollMs(int preroll_ms);
+    // Time in ms after which Pop() may release a packet even if nothing else arrives
+    int GetHoldTimeMs();
+    JitterBufferStatistics GetStatistics() const;
+
+private:
+    mutable std::mutex mutex_;
+    const size_t capacity_;
+    std::deque<std::unique_ptr<AudioStreamPacket>> packets_;
+    bool playing_ = false;
+    bool has_next_sequence_ = false;
+    uint32_t next_sequence_ = 0;
+    int64_t buffering_since_ms_ = 0;
+    int64_t missing_since_ms_ = 0;
+    int frame_duration_ms_ = 60;
+    int preroll_ms_ = 0;
+
+    // Jitter estimate
+    bool has_last_arrival_ = false;
+    int64_t last_arrival_ms_ = 0;
+    int64_t last_media_ms_ = 0;
+    uint32_t arrival_index_ = 0;
+    float jitter_ms_ = 0;
+    size_t target_depth_ = JITTER_BUFFER_MIN_DEPTH;
+
+    JitterBufferStatistics statistics_;
+
+    void UpdateJitter(const AudioStreamPacket& packet, int64_t now_ms);
+    size_t GetStartDepth() const;
+    std::unique_ptr<AudioStreamPacket> PopFront();
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,476 @@
+#include "music_player.h"
+#include "board.h"
+#include "heap_placement.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "MusicPlayer"
+
+#define MUSIC_READER_STACK_SIZE (4096 * 2)
+#define MUSIC_HTTP_CHUNK 2048
+// Fed to the demuxer straight from the ring, packets inside one chunk are not copied. Small
+// enough that one chunk does not demux into much more PCM than a playback task holds
+#define MUSIC_DEMUX_CHUNK 1024
+
+MusicPlayer::~MusicPlayer() {
+    Stop();
+    HeapPlacement::Free(kHeapSubsystemAudio, ring_);
+}
+
+void MusicPlayer::Initialize(int output_sample_rate) {
+    output_sample_rate_ = output_sample_rate;
+    // Opus decodes to any of its own rates directly, whatever the OpusHead says the source was
+    switch (output_sample_rate) {
+        case 8000:
+        case 12000:
+        case 16000:
+        case 24000:
+        case 48000:
+            decode_sample_rate_ = output_sample_rate;
+            break;
+        default:
+            decode_sample_rate_ = 48000;
+            break;
+    }
+    demuxer_.OnDemuxerFinished([this](const uint8_t* data, int sample_rate, size_t len) {
+        decoder_.Decode(data, len, decode_sample_rate_, output_sample_rate_, pcm_);
+    });
+    demuxer_.OnPage([this](size_t offset, int64_t granule) {
+        OnPage(offset, granule);
+    });
+}
+
+bool MusicPlayer::Play(const std::string& url) {
+    {
+        // The reader and decoder tasks take ring_ under the lock too
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ring_ == nullptr) {
+            ring_ = (uint8_t*)HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemAudio, MUSIC_PREFETCH_BYTES);
+            if (ring_ == nullptr) {
+                ESP_LOGE(TAG, "Failed to allocate the %u byte prefetch buffer", MUSIC_PREFETCH_BYTES);
+                return false;
+            }
+        }
+        generation_++;
+        url_ = url;
+        content_length_ = 0;
+        ResetRingLocked();
+        reader_done_ = false;
+        buffering_ = true;
+        underruns_ = 0;
+        index_.clear();
+        index_interval_ms_ = MUSIC_INDEX_INTERVAL_MS;
+        // Set under the lock, so the decoder task never sees the new generation without it
+        reset_ = kResetStream;
+    }
+    space_cv_.notify_all();
+    position_ms_ = 0;
+    bytes_per_second_ = 0;
+    state_ = kMusicPlayerStatePlaying;
+    ESP_LOGI(TAG, "Playing %s", url.c_str());
+    if (!StartReader(0)) {
+        state_ = kMusicPlayerStateIdle;
+        return false;
+    }
+    return true;
+}
+
+void MusicPlayer::Pause(bool pause) {
+    if (state_ == kMusicPlayerStateIdle) {
+        return;
+    }
+    // The reader keeps prefetching until the ring is full
+    state_ = pause ? kMusicPlayerStatePaused : kMusicPlayerStatePlaying;
+    if (!pause && on_data_) {
+        on_data_();
+    }
+}
+
+bool MusicPlayer::Seek(int64_t position_ms) {
+    if (state_ == kMusicPlayerStateIdle) {
+        return false;
+    }
+    if (position_ms < 0) {
+        position_ms = 0;
+    }
+    size_t offset;
+    bool exact;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // The last indexed page starting at or before the target
+        auto it = std::upper_bound(index_.begin(), index_.end(), position_ms, [](int64_t ms, const IndexEntry& entry) {
+            return ms < entry.position_ms;
+        });
+        IndexEntry base = {0, 0};
+        if (it != index_.begin()) {
+            base = *(it - 1);
+        }
+        exact = it != index_.begin() && position_ms - base.position_ms <= 2 * index_interval_ms_;
+        if (exact) {
+            offset = base.offset;
+            seek_skip_samples_ = (position_ms - base.position_ms) * output_sample_rate_ / 1000;
+        } else {
+            uint32_t bytes_per_second = bytes_per_second_;
+            if (bytes_per_second == 0) {
+                ESP_LOGW(TAG, "The bitrate is not known yet, cannot seek");
+                return false;
+            }
+            offset = base.offset + (position_ms - base.position_ms) * bytes_per_second / 1000;
+            seek_skip_samples_ = 0;
+        }
+        if (content_length_ > 0 && offset >= content_length_) {
+            ESP_LOGW(TAG, "Seek to %lld ms is past the end", position_ms);
+            return false;
+        }
+        seek_offset_ = offset;
+        seek_position_ms_ = position_ms;
+        seek_exact_ = exact;
+        generation_++;
+        ResetRingLocked();
+        reader_done_ = false;
+        buffering_ = true;
+        reset_ = kResetSeek;
+    }
+    space_cv_.notify_all();
+    position_ms_ = position_ms;
+    ESP_LOGI(TAG, "Seeking to %lld ms, byte %u%s", position_ms, offset, exact ? " (indexed)" : "");
+    return StartReader(offset);
+}
+
+void MusicPlayer::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation_++;
+        url_.clear();
+        ResetRingLocked();
+        reader_done_ = true;
+        index_.clear();
+        reset_ = kResetStream;
+    }
+    space_cv_.notify_all();
+    state_ = kMusicPlayerStateIdle;
+}
+
+MusicPlayerStatus MusicPlayer::GetStatus() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    MusicPlayerStatus status;
+    status.state = state_;
+    status.url = url_;
+    status.position_ms = position_ms_;
+    status.buffered_bytes = ring_size_;
+    status.buffering = buffering_;
+    status.underruns = underruns_;
+    return status;
+}
+
+struct MusicReaderArgs {
+    MusicPlayer* player;
+    uint32_t generation;
+    std::string url;
+    size_t offset;
+};
+
+bool MusicPlayer::StartReader(size_t offset) {
+    auto args = new MusicReaderArgs{this, 0, "", offset};
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        args->generation = generation_;
+        args->url = url_;
+    }
+    // The task of a stopped stream ends on its own once its download returns
+    if (xTaskCreate([](void* arg) {
+        auto args = static_cast<MusicReaderArgs*>(arg);
+        args->player->ReaderTask(args->generation, std::move(args->url), args->offset);
+        delete args;
+        vTaskDelete(NULL);
+    }, "music_reader", MUSIC_READER_STACK_SIZE, args, 3, nullptr) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the reader task");
+        delete args;
+        return false;
+    }
+    return true;
+}
+
+// offset is always the next byte of the file the ring needs, so a reconnect resumes there
+void MusicPlayer::ReaderTask(uint32_t generation, std::string url, size_t offset) {
+    auto network = Board::GetInstance().GetNetwork();
+    std::vector<uint8_t> buffer(MUSIC_HTTP_CHUNK);
+    int retries = 0;
+    bool ended = false;
+    auto is_current = [this, generation]() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return generation_ == generation;
+    };
+
+    while (!ended && is_current()) {
+        auto http = network->CreateHttp(0);
+        if (offset > 0) {
+            http->SetHeader("Range", "bytes=" + std::to_string(offset) + "-");
+        }
+        if (http->Open("GET", url)) {
+            int status = http->GetStatusCode();
+            if (status != 200 && status != 206) {
+                ESP_LOGE(TAG, "Failed to get %s, status code: %d", url.c_str(), status);
+                break;
+            }
+            // A server that ignores the Range sends the whole file, the bytes before offset are skipped
+            size_t body_offset = status == 206 ? offset : 0;
+            size_t body_length = http->GetBodyLength();
+            size_t body_end = body_offset + body_length;
+            if (body_length > 0) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (generation_ == generation) {
+                    content_length_ = body_end;
+                }
+            }
+            while (true) {
+                int ret = http->Read((char*)buffer.data(), buffer.size());
+                if (ret < 0) {
+                    break;
+                }
+                if (ret == 0) {
+                    // Without a length only the server knows, otherwise a short body is a broken download
+                    ended = body_length == 0 || body_offset >= body_end;
+                    break;
+                }
+                retries = 0;
+                size_t end = body_offset + ret;
+                if (end > offset) {
+                    size_t skip = offset > body_offset ? offset - body_offset : 0;
+                    if (!WriteRing(generation, buffer.data() + skip, ret - skip)) {
+                        // Stopped, or replaced by another stream or seek
+                        http->Close();
+                        return;
+                    }
+                    offset = end;
+                }
+                body_offset = end;
+            }
+            http->Close();
+        } else {
+            ESP_LOGE(TAG, "Failed to open %s", url.c_str());
+        }
+        if (!ended) {
+            if (++retries > MUSIC_HTTP_RETRIES) {
+                ESP_LOGE(TAG, "Download broken at byte %u, giving up", offset);
+                break;
+            }
+            ESP_LOGW(TAG, "Download broken at byte %u, reconnecting", offset);
+            vTaskDelay(pdMS_TO_TICKS(1000 * retries));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (generation_ != generation) {
+            return;
+        }
+        reader_done_ = true;
+    }
+    ESP_LOGI(TAG, "Download finished at byte %u", offset);
+    if (on_data_) {
+        on_data_();
+    }
+}
+
+// Waits while the ring is full, returns false once the stream was stopped or replaced
+bool MusicPlayer::WriteRing(uint32_t generation, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_cv_.wait(lock, [this, generation]() {
+            return generation_ != generation || ring_size_ + ring_held_ < MUSIC_PREFETCH_BYTES;
+        });
+        if (generation_ != generation) {
+            return false;
+        }
+        size_t count = std::min(size, MUSIC_PREFETCH_BYTES - ring_size_ - ring_held_);
+        size_t write = (ring_read_ + ring_size_) % MUSIC_PREFETCH_BYTES;
+        size_t first = std::min(count, MUSIC_PREFETCH_BYTES - write);
+        memcpy(ring_ + write, data, first);
+        memcpy(ring_, data + first, count - first);
+        ring_size_ += count;
+        bool wake = !buffering_ || ring_size_ >= MUSIC_START_BYTES;
+        lock.unlock();
+        data += count;
+        size -= count;
+        if (wake && on_data_) {
+            on_data_();
+        }
+    }
+    return true;
+}
+
+// Points data at the next contiguous part of the ring without taking it out. Runs dry into
+// buffering (an underrun) until MUSIC_START_BYTES are there again, or into the end
+size_t MusicPlayer::PeekInput(const uint8_t*& data, uint32_t& generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffering_) {
+        if (ring_size_ < MUSIC_START_BYTES && !reader_done_) {
+            return 0;
+        }
+        buffering_ = false;
+    }
+    size_t count = std::min<size_t>({MUSIC_DEMUX_CHUNK, ring_size_, MUSIC_PREFETCH_BYTES - ring_read_});
+    data = ring_ + ring_read_;
+    generation = generation_;
+    ring_peeked_ = count;
+    if (count == 0) {
+        if (reader_done_) {
+            ESP_LOGI(TAG, "Finished %s", url_.c_str());
+            url_.clear();
+            state_ = kMusicPlayerStateIdle;
+        } else {
+            ESP_LOGW(TAG, "Underrun, buffering");
+            buffering_ = true;
+            underruns_++;
+        }
+    }
+    return count;
+}
+
+// The reader never writes into data that has not been consumed, not even after a seek or stop
+// replaced the stream. Returns false then, and the chunk just processed is thrown away by the reset
+bool MusicPlayer::ConsumeInput(uint32_t generation, size_t size) {
+    bool current;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        current = generation_ == generation;
+        if (current) {
+            ring_read_ = (ring_read_ + size) % MUSIC_PREFETCH_BYTES;
+            ring_size_ -= size;
+            ring_peeked_ = 0;
+        } else {
+            ring_held_ = 0;
+        }
+    }
+    space_cv_.notify_all();
+    return current;
+}
+
+// The next stream starts behind the chunk the decoder may still be demuxing, which stays held
+// until it is consumed
+void MusicPlayer::ResetRingLocked() {
+    ring_read_ = (ring_read_ + ring_peeked_) % MUSIC_PREFETCH_BYTES;
+    ring_held_ += ring_peeked_;
+    ring_peeked_ = 0;
+    ring_size_ = 0;
+}
+
+// Called by the demuxer at every page header, offset counts from the last reset
+void MusicPlayer::OnPage(size_t offset, int64_t granule) {
+    // A page starts where the previous one ended, which is unknown for the first page after a resync
+    if (last_granule_ >= 0 && granule > 0) {
+        uint32_t position_ms = last_granule_ / 48;
+        if (!position_synced_) {
+            // Nothing before this page has been played since the seek, apart from pcm_ already taken
+            int64_t pending = pcm_.size() - pcm_offset_;
+            position_samples_ = (int64_t)position_ms * output_sample_rate_ / 1000 - pending;
+            position_synced_ = true;
+            ESP_LOGI(TAG, "Position synced to %lu ms", position_ms);
+        }
+        AddIndexEntry(position_ms, stream_offset_ + offset);
+    }
+    if (granule >= 0) {
+        last_granule_ = granule;
+    }
+}
+
+void MusicPlayer::AddIndexEntry(uint32_t position_ms, size_t offset) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Only extends the index, pages played again after a seek back are already there
+    if (!index_.empty() && position_ms < index_.back().position_ms + index_interval_ms_) {
+        return;
+    }
+    if (index_.size() >= MUSIC_INDEX_MAX_ENTRIES) {
+        // Keep every other entry and index at half the rate from now on
+        size_t kept = 0;
+        for (size_t i = 0; i < index_.size(); i += 2) {
+            index_[kept++] = index_[i];
+        }
+        index_.resize(kept);
+        index_interval_ms_ *= 2;
+        if (position_ms < index_.back().position_ms + index_interval_ms_) {
+            return;
+        }
+    }
+    index_.push_back({position_ms, (uint32_t)offset});
+}
+
+void MusicPlayer::ApplyReset() {
+    int reset = reset_.exchange(kResetNone);
+    if (reset == kResetNone) {
+        return;
+    }
+    if (reset == kResetStream) {
+        demuxer_.Reset();
+        measured_bytes_ = 0;
+        measured_samples_ = 0;
+        stream_offset_ = 0;
+        position_samples_ = 0;
+        position_synced_ = true;
+        skip_samples_ = 0;
+    } else {
+        // Same stream, the OpusHead seen at the start still applies
+        demuxer_.Resync();
+        std::lock_guard<std::mutex> lock(mutex_);
+        stream_offset_ = seek_offset_;
+        position_samples_ = seek_position_ms_ * output_sample_rate_ / 1000;
+        // Landing on an indexed page, the audio up to the target is decoded and dropped
+        position_synced_ = seek_exact_;
+        skip_samples_ = seek_skip_samples_;
+    }
+    last_granule_ = -1;
+    decoder_.Reset();
+    pcm_.clear();
+    pcm_offset_ = 0;
+}
+
+size_t MusicPlayer::Read(std::vector<int16_t>& pcm, size_t samples) {
+    ApplyReset();
+    if (!playing()) {
+        return 0;
+    }
+
+    size_t appended = 0;
+    while (appended < samples) {
+        if (pcm_offset_ < pcm_.size() && skip_samples_ > 0) {
+            size_t count = std::min(skip_samples_, pcm_.size() - pcm_offset_);
+            pcm_offset_ += count;
+            skip_samples_ -= count;
+            continue;
+        }
+        if (pcm_offset_ < pcm_.size()) {
+            size_t count = std::min(samples - appended, pcm_.size() - pcm_offset_);
+            pcm.insert(pcm.end(), pcm_.begin() + pcm_offset_, pcm_.begin() + pcm_offset_ + count);
+            pcm_offset_ += count;
+            appended += count;
+            position_samples_ += count;
+            continue;
+        }
+        pcm_.clear();
+        pcm_offset_ = 0;
+        // The demuxer callback decodes every packet completed by this chunk into pcm_
+        const uint8_t* data = nullptr;
+        uint32_t generation = 0;
+        size_t size = PeekInput(data, generation);
+        if (size == 0) {
+            break;
+        }
+        demuxer_.Process(data, size);
+        if (!ConsumeInput(generation, size)) {
+            break;
+        }
+        measured_bytes_ += size;
+    }
+
+    position_ms_ = position_samples_ * 1000 / output_sample_rate_;
+    measured_samples_ += appended;
+    if (measured_samples_ >= (size_t)output_sample_rate_) {
+        bytes_per_second_ = (uint64_t)measured_bytes_ * output_sample_rate_ / measured_samples_;
+    }
+    return appended;
+}
@@ -0,0 +1,150 @@
+#ifndef MUSIC_PLAYER_H
+#define MUSIC_PLAYER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ogg_demuxer.h"
+#include "sound_player.h"
+
+// Compressed stream kept ahead of the decoder, the only buffer that grows with the bitrate
+#define MUSIC_PREFETCH_BYTES (CONFIG_MUSIC_PREFETCH_KB * 1024)
+// Playback (re)starts once this much is buffered, or the whole file if it is shorter
+#define MUSIC_START_BYTES (MUSIC_PREFETCH_BYTES / 4)
+// Reconnects, resuming with a Range request, before a broken download ends the stream
+#define MUSIC_HTTP_RETRIES 3
+// Page index for seeking, one entry per interval, the interval doubles whenever the index is full
+#define MUSIC_INDEX_MAX_ENTRIES 512
+#define MUSIC_INDEX_INTERVAL_MS 1000
+
+enum MusicPlayerState {
+    kMusicPlayerStateIdle,
+    kMusicPlayerStatePlaying,
+    kMusicPlayerStatePaused,
+};
+
+struct MusicPlayerStatus {
+    MusicPlayerState state = kMusicPlayerStateIdle;
+    std::string url;
+    int64_t position_ms = 0;
+    size_t buffered_bytes = 0;
+    bool buffering = false;
+    uint32_t underruns = 0;
+};
+
+/*
+ * Streams Ogg Opus music or podcasts from an HTTP URL into the music input of the mixer.
+ *
+ * A reader task downloads the file into a prefetch ring of MUSIC_PREFETCH_BYTES (PSRAM where
+ * available) and waits while the ring is full, so memory stays bounded whatever the file size.
+ * Read() is called by the decoder task like SoundPlayer::Read(): it feeds the ring through
+ * OggDemuxer::Process() in small chunks and decodes the packets with a decoder of its own.
+ *
+ * The start offset and time of the pages played so far are kept in a bounded index. Seek() into
+ * that range restarts the download with a Range request at the page before the target and drops
+ * the decoded audio up to it. Further ahead the offset is estimated from the average bitrate, the
+ * demuxer resyncs on the next page and the position is corrected from its granule position.
+ *
+ * Play(), Pause(), Seek() and Stop() may be called from any task.
+ */
+class MusicPlayer {
+public:
+    ~MusicPlayer();
+
+    void Initialize(int output_sample_rate);
+
+    bool Play(const std::string& url);
+    void Pause(bool pause);
+    bool Seek(int64_t position_ms);
+    void Stop();
+    MusicPlayerStatus GetStatus();
+    // Playing and not paused, the decoder task only reads while this is set
+    bool playing() const { return state_ == kMusicPlayerStatePlaying; }
+
+    // Called on the reader task whenever new data may let Read() go on
+    void OnData(std::function<void()> callback) { on_data_ = callback; }
+
+    // Decoder task only: appends up to samples of mono PCM at the output sample rate,
+    // returns the number of samples appended, 0 while buffering or paused
+    size_t Read(std::vector<int16_t>& pcm, size_t samples);
+
+private:
+    enum Reset {
+        kResetNone,
+        kResetSeek,
+        kResetStream,
+    };
+
+    int output_sample_rate_ = 16000;
+    int decode_sample_rate_ = 48000;
+    std::function<void()> on_data_;
+
+    // Guarded by mutex_, a reader task only writes while generation_ still matches its own
+    std::mutex mutex_;
+    std::condition_variable space_cv_;
+    uint8_t* ring_ = nullptr;
+    size_t ring_read_ = 0;
+    size_t ring_size_ = 0;
+    // Bytes at ring_read_ the decoder demuxes outside the lock, and those of a replaced stream
+    // right before ring_read_ that it has not let go of yet. The reader writes into neither.
+    size_t ring_peeked_ = 0;
+    size_t ring_held_ = 0;
+    uint32_t generation_ = 0;
+    bool reader_done_ = false;
+    bool buffering_ = true;
+    std::string url_;
+    size_t content_length_ = 0;
+    uint32_t underruns_ = 0;
+
+    std::atomic<MusicPlayerState> state_{kMusicPlayerStateIdle};
+    std::atomic<int> reset_{kResetNone};
+    std::atomic<int64_t> position_ms_{0};
+    // Average bitrate measured while playing, for the seek estimate
+    std::atomic<uint32_t> bytes_per_second_{0};
+
+    // Time at the start of a page and the offset of the page in the file, guarded by mutex_
+    struct IndexEntry {
+        uint32_t position_ms;
+        uint32_t offset;
+    };
+    std::vector<IndexEntry> index_;
+    uint32_t index_interval_ms_ = MUSIC_INDEX_INTERVAL_MS;
+    // Where the last Seek() restarts, picked up by the decoder task, guarded by mutex_
+    size_t seek_offset_ = 0;
+    size_t seek_skip_samples_ = 0;
+    int64_t seek_position_ms_ = 0;
+    bool seek_exact_ = false;
+
+    // Owned by the decoder task
+    OggDemuxer demuxer_;
+    SoundDecoder decoder_;
+    std::vector<int16_t> pcm_;
+    size_t pcm_offset_ = 0;
+    size_t measured_bytes_ = 0;
+    size_t measured_samples_ = 0;
+    // Output samples up to the one Read() hands out next
+    int64_t position_samples_ = 0;
+    // File offset of the first byte fed to the demuxer since the last reset
+    size_t stream_offset_ = 0;
+    int64_t last_granule_ = -1;
+    bool position_synced_ = true;
+    size_t skip_samples_ = 0;
+
+    bool StartReader(size_t offset);
+    void ReaderTask(uint32_t generation, std::string url, size_t offset);
+    bool WriteRing(uint32_t generation, const uint8_t* data, size_t size);
+    size_t PeekInput(const uint8_t*& data, uint32_t& generation);
+    bool ConsumeInput(uint32_t generation, size_t size);
+    void ResetRingLocked();
+    void OnPage(size_t offset, int64_t granule);
+    void AddIndexEntry(uint32_t position_ms, size_t offset);
+    void ApplyReset();
+};
+
+#endif // MUSIC_PLAYER_H
@@ -0,0 +1,58 @@
+#ifndef OPUS_PACKET_H
+#define OPUS_PACKET_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Longest packet RFC 6716 allows, 120 ms in samples at 48 kHz
+#define OPUS_MAX_PACKET_SAMPLES_48K 5760
+
+/*
+ * Duration of an Opus packet from its TOC byte, and the frame count byte of a code 3 packet
+ * (RFC 6716 section 3.1). Whatever mode, frame size and frame count the sender picked, the
+ * decoder output can be sized for the packet before decoding it.
+ * Returns samples at 48 kHz, 0 if the packet is empty or malformed.
+ */
+inline int OpusPacketSamples48k(const uint8_t* data, size_t size) {
+    if (data == nullptr || size == 0) {
+        return 0;
+    }
+    uint8_t toc = data[0];
+    int config = toc >> 3;
+    int frame_samples;
+    if (config < 12) {
+        // SILK: 10, 20, 40, 60 ms
+        static const int kSilkFrameSamples[] = {480, 960, 1920, 2880};
+        frame_samples = kSilkFrameSamples[config & 3];
+    } else if (config < 16) {
+        // Hybrid: 10, 20 ms
+        frame_samples = (config & 1) ? 960 : 480;
+    } else {
+        // CELT: 2.5, 5, 10, 20 ms
+        frame_samples = 120 << (config & 3);
+    }
+
+    int frames;
+    switch (toc & 3) {
+    case 0:
+        frames = 1;
+        break;
+    case 1:
+    case 2:
+        frames = 2;
+        break;
+    default:
+        if (size < 2) {
+            return 0;
+        }
+        frames = data[1] & 0x3F;
+        break;
+    }
+    int samples = frames * frame_samples;
+    if (frames == 0 || samples > OPUS_MAX_PACKET_SAMPLES_48K) {
+        return 0;
+    }
+    return samples;
+}
+
+#endif // OPUS_PACKET_H
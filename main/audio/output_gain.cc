@@ -0,0 +1,63 @@
+#include "output_gain.h"
+#include "audio_kernels.h"
+
+#include <sdkconfig.h>
+
+#include <algorithm>
+
+// Shift of the release step, the gain closes 1/64 of the distance to unity per chunk
+#define OUTPUT_GAIN_RELEASE_SHIFT 6
+
+void OutputGain::Initialize(int sample_rate) {
+    chunk_samples_ = std::max(sample_rate / 1000, 1);
+#if CONFIG_USE_OUTPUT_LIMITER
+    ceiling_ = INT16_MAX * CONFIG_OUTPUT_LIMITER_CEILING_PERCENT / 100;
+#endif
+    Reset();
+}
+
+void OutputGain::SetVolume(int volume) {
+    volume = std::clamp(volume, 0, 100);
+    volume_gain_ = (int64_t)OUTPUT_GAIN_UNITY * volume * volume / (100 * 100);
+}
+
+void OutputGain::Reset() {
+    gain_ = volume_gain_;
+}
+
+// The highest gain that keeps the chunk under the ceiling, at most the volume
+int32_t OutputGain::TargetGain(const int16_t* data, size_t samples) {
+    int32_t peak = AudioKernels::PeakAbs(data, samples);
+    if ((int64_t)peak * volume_gain_ <= (int64_t)ceiling_ * OUTPUT_GAIN_UNITY) {
+        return volume_gain_;
+    }
+    limited_chunks_++;
+    return (int64_t)ceiling_ * OUTPUT_GAIN_UNITY / peak;
+}
+
+void OutputGain::Process(int16_t* data, size_t samples) {
+    if (samples == 0) {
+        return;
+    }
+    // A volume change or a peak right at the start of the block takes effect at once
+    int32_t target = TargetGain(data, std::min<size_t>(chunk_samples_, samples));
+    int32_t gain = std::min(gain_, target);
+    for (size_t offset = 0; offset < samples; offset += chunk_samples_) {
+        size_t length = std::min<size_t>(chunk_samples_, samples - offset);
+        size_t next = offset + length;
+        // Ramp towards min(release, this chunk, the next chunk), the block end has no next chunk
+        int32_t end = std::min(gain + ((OUTPUT_GAIN_UNITY - gain) >> OUTPUT_GAIN_RELEASE_SHIFT), target);
+        int32_t next_target = target;
+        if (next < samples) {
+            next_target = TargetGain(data + next, std::min<size_t>(chunk_samples_, samples - next));
+            end = std::min(end, next_target);
+        }
+        // Full volume below the ceiling leaves the samples as they are
+        if (gain != OUTPUT_GAIN_UNITY || end != OUTPUT_GAIN_UNITY) {
+            AudioKernels::ApplyGainRamp(data + offset, length, gain, (end - gain) / (int32_t)length);
+        }
+        gain = end;
+        target = next_target;
+    }
+    gain_ = gain;
+}
@@ -0,0 +1,43 @@
+#ifndef OUTPUT_GAIN_H
+#define OUTPUT_GAIN_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Gain in Q23, 1 << 23 is unity
+#define OUTPUT_GAIN_UNITY (1 << 23)
+
+/**
+ * OutputGain - Volume and peak limiting of the mixed output, once per block before it goes to the codec
+ *
+ * The block is split into 1 ms chunks. The gain at every chunk boundary is low enough for the peaks of
+ * the chunks on both sides, so the linear ramp between two boundaries never lets a sample past the
+ * ceiling: the limiter looks ahead over the block it is about to write and adds no delay. It releases
+ * back towards the volume with a time constant of about 64 ms.
+ *
+ * The volume is only applied for codecs without hardware volume (AudioCodec::software_volume()),
+ * the others get the limiter alone at unity gain.
+ */
+class OutputGain {
+public:
+    void Initialize(int sample_rate);
+    // 0-100, squared like the volume curve of the codec chips
+    void SetVolume(int volume);
+    void Reset();
+    void Process(int16_t* data, size_t samples);
+
+    // Chunks that were turned down below the volume, for the debug statistics
+    inline uint32_t limited_chunks() const { return limited_chunks_; }
+
+private:
+    int chunk_samples_ = 16;
+    int32_t ceiling_ = INT16_MAX;
+    int32_t volume_gain_ = OUTPUT_GAIN_UNITY;
+    // Gain at the start of the next block
+    int32_t gain_ = OUTPUT_GAIN_UNITY;
+    uint32_t limited_chunks_ = 0;
+
+    int32_t TargetGain(const int16_t* data, size_t samples);
+};
+
+#endif // OUTPUT_GAIN_H
@@ -0,0 +1,91 @@
+#ifndef PCM_RING_BUFFER_H
+#define PCM_RING_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "heap_placement.h"
+
+/*
+ * Fixed circular buffer of decoded PCM, allocated in PSRAM where available.
+ *
+ * The decoder task writes the frames it decoded while the playback queue was full and moves
+ * them into playback tasks once the queue has room again, so it can run ahead of the output
+ * by much more than the queue depth. Unlike StagingBuffer nothing is ever dropped: the writer
+ * checks available() first.
+ *
+ * Not thread safe, the owner guards it with its decoder mutex. size() may be read from any task.
+ */
+class PcmRingBuffer {
+public:
+    PcmRingBuffer() = default;
+    ~PcmRingBuffer() {
+        HeapPlacement::Free(kHeapSubsystemAudio, buffer_);
+    }
+
+    PcmRingBuffer(const PcmRingBuffer&) = delete;
+    PcmRingBuffer& operator=(const PcmRingBuffer&) = delete;
+
+    bool Allocate(size_t samples) {
+        HeapPlacement::Free(kHeapSubsystemAudio, buffer_);
+        capacity_ = 0;
+        buffer_ = (int16_t*)HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemAudio, samples * sizeof(int16_t));
+        if (buffer_ == nullptr) {
+            return false;
+        }
+        capacity_ = samples;
+        Clear();
+        return true;
+    }
+
+    void Clear() {
+        read_ = 0;
+        size_ = 0;
+    }
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const { return size_; }
+    size_t available() const { return capacity_ - size_; }
+    bool empty() const { return size_ == 0; }
+
+    // Returns false and writes nothing if the samples do not fit
+    bool Write(const int16_t* data, size_t samples) {
+        if (samples > available()) {
+            return false;
+        }
+        if (samples == 0) {
+            return true;
+        }
+        size_t write = (read_ + size_) % capacity_;
+        size_t first = std::min(samples, capacity_ - write);
+        memcpy(buffer_ + write, data, first * sizeof(int16_t));
+        memcpy(buffer_, data + first, (samples - first) * sizeof(int16_t));
+        size_ += samples;
+        return true;
+    }
+
+    // Returns the number of samples read, at most samples
+    size_t Read(int16_t* data, size_t samples) {
+        samples = std::min<size_t>(samples, size_);
+        if (samples == 0) {
+            return 0;
+        }
+        size_t first = std::min(samples, capacity_ - read_);
+        memcpy(data, buffer_ + read_, first * sizeof(int16_t));
+        memcpy(data + first, buffer_, (samples - first) * sizeof(int16_t));
+        read_ = (read_ + samples) % capacity_;
+        size_ -= samples;
+        return samples;
+    }
+
+private:
+    int16_t* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    size_t read_ = 0;
+    std::atomic<size_t> size_{0};
+};
+
+#endif // PCM_RING_BUFFER_H
@@ -0,0 +1,193 @@
+#include "playback_clock.h"
+#include "audio_codec.h"
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+
+#define TAG "PlaybackClock"
+
+void PlaybackClock::SetSampleRates(int output_sample_rate, int input_sample_rate) {
+    output_sample_rate_ = output_sample_rate;
+    input_sample_rate_ = input_sample_rate;
+    start_us_ = esp_timer_get_time();
+}
+
+// Callbacks can only be registered while the channel is stopped, the codecs enable theirs when created
+esp_err_t PlaybackClock::Register(i2s_chan_handle_t handle, const i2s_event_callbacks_t* callbacks, void* user_ctx) {
+    esp_err_t err = i2s_channel_register_event_callback(handle, callbacks, user_ctx);
+    if (err == ESP_ERR_INVALID_STATE) {
+        ESP_ERROR_CHECK(i2s_channel_disable(handle));
+        err = i2s_channel_register_event_callback(handle, callbacks, user_ctx);
+        ESP_ERROR_CHECK(i2s_channel_enable(handle));
+    }
+    return err;
+}
+
+bool PlaybackClock::Attach(i2s_chan_handle_t tx_handle, i2s_chan_handle_t rx_handle) {
+    if (tx_handle == nullptr || rx_handle == nullptr) {
+        ESP_LOGW(TAG, "The codec has no I2S channels, positions follow the read time of the input");
+        return false;
+    }
+    i2s_event_callbacks_t tx_callbacks = {};
+    tx_callbacks.on_sent = OnSent;
+    i2s_event_callbacks_t rx_callbacks = {};
+    rx_callbacks.on_recv = OnReceived;
+    rx_callbacks.on_recv_q_ovf = OnReceiveOverflow;
+    esp_err_t err = Register(tx_handle, &tx_callbacks, this);
+    if (err == ESP_OK) {
+        err = Register(rx_handle, &rx_callbacks, this);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register the I2S callbacks: %s", esp_err_to_name(err));
+        return false;
+    }
+    attached_ = true;
+    ESP_LOGI(TAG, "Tracking the I2S DMA, %d frames per descriptor", AUDIO_CODEC_DMA_FRAME_NUM);
+    return true;
+}
+
+bool IRAM_ATTR PlaybackClock::OnSent(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto clock = static_cast<PlaybackClock*>(user_ctx);
+    portENTER_CRITICAL_ISR(&clock->lock_);
+    clock->sent_frames_ += AUDIO_CODEC_DMA_FRAME_NUM;
+    clock->last_sent_us_ = esp_timer_get_time();
+    portEXIT_CRITICAL_ISR(&clock->lock_);
+    return false;
+}
+
+bool IRAM_ATTR PlaybackClock::OnReceived(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto clock = static_cast<PlaybackClock*>(user_ctx);
+    portENTER_CRITICAL_ISR(&clock->lock_);
+    clock->captures_[clock->received_descriptors_ % PLAYBACK_CLOCK_CAPTURES] = clock->OutputPositionLocked();
+    clock->received_descriptors_++;
+    portEXIT_CRITICAL_ISR(&clock->lock_);
+    return false;
+}
+
+bool IRAM_ATTR PlaybackClock::OnReceiveOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    // The driver drops the oldest descriptor nobody has read
+    auto clock = static_cast<PlaybackClock*>(user_ctx);
+    portENTER_CRITICAL_ISR(&clock->lock_);
+    clock->dropped_descriptors_++;
+    portEXIT_CRITICAL_ISR(&clock->lock_);
+    return false;
+}
+
+// Called with lock_ held. The descriptor after sent_frames_ is on its way out, how much of it has been played is interpolated
+uint64_t IRAM_ATTR PlaybackClock::OutputPositionLocked() {
+    int64_t elapsed = esp_timer_get_time() - last_sent_us_;
+    uint64_t played = std::min<int64_t>(elapsed * output_sample_rate_ / 1000000, AUDIO_CODEC_DMA_FRAME_NUM);
+    return sent_frames_ + played;
+}
+
+uint64_t PlaybackClock::OutputPosition() {
+    if (!attached_) {
+        return (esp_timer_get_time() - start_us_) * output_sample_rate_ / 1000000;
+    }
+    portENTER_CRITICAL(&lock_);
+    uint64_t position = OutputPositionLocked();
+    portEXIT_CRITICAL(&lock_);
+    return position;
+}
+
+uint64_t PlaybackClock::Write(size_t frames, uint32_t timestamp) {
+    uint64_t next_free;
+    if (attached_) {
+        portENTER_CRITICAL(&lock_);
+        next_free = sent_frames_ + AUDIO_CODEC_DMA_FRAME_NUM;
+        portEXIT_CRITICAL(&lock_);
+    } else {
+        next_free = OutputPosition();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Back to back blocks follow each other, after an underrun the block goes to the next free descriptor.
+    // Nothing can be queued further ahead than the DMA ring, e.g. after the output was disabled.
+    uint64_t start = std::clamp<uint64_t>(next_write_position_, next_free, next_free + AUDIO_CODEC_DMA_RING_FRAMES);
+    next_write_position_ = start + frames;
+
+    if (segment_count_ > 0) {
+        auto& last = segments_[(segment_head_ + PLAYBACK_CLOCK_SEGMENTS - 1) % PLAYBACK_CLOCK_SEGMENTS];
+        // Blocks cut from the same frame extend it
+        if (last.timestamp != 0 && timestamp != 0 && last.start + last.frames == start &&
+            timestamp == last.timestamp + (uint64_t)last.frames * 1000 / output_sample_rate_) {
+            last.frames += frames;
+            return start;
+        }
+    }
+    segments_[segment_head_] = {start, (uint32_t)frames, timestamp};
+    segment_head_ = (segment_head_ + 1) % PLAYBACK_CLOCK_SEGMENTS;
+    segment_count_ = std::min<size_t>(segment_count_ + 1, PLAYBACK_CLOCK_SEGMENTS);
+    return start;
+}
+
+void PlaybackClock::OnInputEnabled(uint64_t frames) {
+    // Enabling the channel restarts its DMA, the next descriptor it receives is the next one read
+    portENTER_CRITICAL(&lock_);
+    input_base_frame_ = frames;
+    input_base_descriptor_ = received_descriptors_;
+    input_base_dropped_ = dropped_descriptors_;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void PlaybackClock::OnInputRead(uint64_t frames) {
+    if (attached_) {
+        return;
+    }
+    uint64_t position = OutputPosition();
+    std::lock_guard<std::mutex> lock(mutex_);
+    last_read_frame_ = frames;
+    last_read_position_ = position;
+}
+
+bool PlaybackClock::PositionOfInput(uint64_t frame, uint64_t& position) {
+    bool found = false;
+    if (attached_ && frame >= input_base_frame_) {
+        portENTER_CRITICAL(&lock_);
+        uint32_t descriptor = input_base_descriptor_ + (dropped_descriptors_ - input_base_dropped_) +
+            (frame - input_base_frame_) / AUDIO_CODEC_DMA_FRAME_NUM;
+        uint32_t offset = (frame - input_base_frame_) % AUDIO_CODEC_DMA_FRAME_NUM;
+        // Still in the ring and completed
+        if (received_descriptors_ - descriptor - 1 < PLAYBACK_CLOCK_CAPTURES) {
+            // The descriptor completed when its last frame came in
+            uint64_t end = captures_[descriptor % PLAYBACK_CLOCK_CAPTURES];
+            uint64_t before = (uint64_t)(AUDIO_CODEC_DMA_FRAME_NUM - 1 - offset) * output_sample_rate_ / input_sample_rate_;
+            position = end > before ? end - before : 0;
+            found = true;
+        }
+        portEXIT_CRITICAL(&lock_);
+    }
+
+    if (found) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (attached_ || frame > last_read_frame_) {
+        return false;
+    }
+    uint64_t before = (last_read_frame_ - frame) * output_sample_rate_ / input_sample_rate_;
+    position = last_read_position_ > before ? last_read_position_ - before : 0;
+    return true;
+}
+
+uint32_t PlaybackClock::TimestampOfInput(uint64_t frame) {
+    // The speaker position in output frames at the moment the input frame was captured
+    uint64_t position;
+    if (!PositionOfInput(frame, position)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < segment_count_; i++) {
+        auto& segment = segments_[(segment_head_ + PLAYBACK_CLOCK_SEGMENTS - 1 - i) % PLAYBACK_CLOCK_SEGMENTS];
+        if (position >= segment.start && position < segment.start + segment.frames) {
+            if (segment.timestamp == 0) {
+                return 0;
+            }
+            return segment.timestamp + (uint32_t)((position - segment.start) * 1000 / output_sample_rate_);
+        }
+    }
+    return 0;
+}
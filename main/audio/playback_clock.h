@@ -0,0 +1,90 @@
+#ifndef PLAYBACK_CLOCK_H
+#define PLAYBACK_CLOCK_H
+
+#include <freertos/FreeRTOS.h>
+#include <driver/i2s_common.h>
+
+#include <cstdint>
+#include <mutex>
+
+// Blocks written to the codec that are looked up, about two seconds of 60 ms frames
+#define PLAYBACK_CLOCK_SEGMENTS 32
+// Received microphone DMA descriptors whose playback position is kept
+#define PLAYBACK_CLOCK_CAPTURES 64
+
+/**
+ * PlaybackClock - Maps microphone samples to the timestamp of the playback heard while they were captured
+ *
+ * The I2S event callbacks count the DMA descriptors sent to the speaker and received from the microphone,
+ * between two callbacks the position is interpolated with esp_timer. Write() places every block handed to
+ * the codec on the speaker timeline together with the server timestamp of its first sample, and each mic
+ * descriptor remembers where the speaker was when it completed. TimestampOfInput() combines the two, so
+ * server-side AEC gets the reference position to the sample instead of one timestamp per played frame.
+ * Codecs without I2S channels fall back to the time an input block is read, which is only as exact as
+ * the DMA depth.
+ */
+class PlaybackClock {
+public:
+    PlaybackClock() = default;
+    PlaybackClock(const PlaybackClock&) = delete;
+    PlaybackClock& operator=(const PlaybackClock&) = delete;
+
+    void SetSampleRates(int output_sample_rate, int input_sample_rate);
+    bool Attach(i2s_chan_handle_t tx_handle, i2s_chan_handle_t rx_handle);
+
+    // Output task, before the block goes to the codec, 0 for audio that has no server timestamp.
+    // Returns the speaker position of the first frame of the block
+    uint64_t Write(size_t frames, uint32_t timestamp);
+    // Input task, frames counts every frame read from the codec so far
+    void OnInputEnabled(uint64_t frames);
+    void OnInputRead(uint64_t frames);
+    // Speaker position in output frames when that input frame was captured, false if it is no longer known
+    bool PositionOfInput(uint64_t frame, uint64_t& position);
+    // Timestamp in ms of the playback that left the DMA when that input frame was captured, 0 if none
+    uint32_t TimestampOfInput(uint64_t frame);
+
+    inline bool attached() const { return attached_; }
+
+private:
+    struct Segment {
+        uint64_t start;
+        uint32_t frames;
+        uint32_t timestamp;
+    };
+
+    static bool OnSent(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    static bool OnReceived(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    static bool OnReceiveOverflow(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
+    static esp_err_t Register(i2s_chan_handle_t handle, const i2s_event_callbacks_t* callbacks, void* user_ctx);
+    uint64_t OutputPosition();
+    uint64_t OutputPositionLocked();
+
+    int output_sample_rate_ = 16000;
+    int input_sample_rate_ = 16000;
+    bool attached_ = false;
+
+    // Written by the I2S interrupts
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+    uint64_t sent_frames_ = 0;
+    int64_t last_sent_us_ = 0;
+    uint32_t received_descriptors_ = 0;
+    uint32_t dropped_descriptors_ = 0;
+    uint64_t captures_[PLAYBACK_CLOCK_CAPTURES] = {};
+
+    // The first input frame after the input was enabled is the first frame of descriptor input_base_descriptor_
+    uint64_t input_base_frame_ = 0;
+    uint32_t input_base_descriptor_ = 0;
+    uint32_t input_base_dropped_ = 0;
+    // Without interrupts, the end of the last read and where the speaker was then
+    uint64_t last_read_frame_ = 0;
+    uint64_t last_read_position_ = 0;
+
+    std::mutex mutex_;
+    Segment segments_[PLAYBACK_CLOCK_SEGMENTS] = {};
+    size_t segment_count_ = 0;
+    size_t segment_head_ = 0;
+    uint64_t next_write_position_ = 0;
+    int64_t start_us_ = 0;
+};
+
+#endif // PLAYBACK_CLOCK_H
@@ -0,0 +1,139 @@
+#ifndef POLYPHASE_RESAMPLER_H
+#define POLYPHASE_RESAMPLER_H
+
+#include "audio_kernels.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class PolyphaseResamplerBase {
+public:
+    virtual ~PolyphaseResamplerBase() = default;
+    // Interleaved frames in and out, returns the frames written
+    virtual size_t Process(const int16_t* in, size_t frames, int16_t* out) = 0;
+    virtual size_t MaxOutputFrames(size_t frames) const = 0;
+    virtual void Reset() = 0;
+};
+
+/*
+ * Rational resampler by Up / Down with a fixed Kaiser windowed sinc of Up * Taps taps.
+ *
+ * Each output sample is one Taps long Q15 dot product over the input, the coefficients of
+ * every phase are designed once per ratio and shared by all instances. The cutoff sits at
+ * the lower of the two Nyquist rates, with about 60 dB of stopband for Taps of 32. Only Taps
+ * of the Up * Taps coefficients are used per output sample, so 24 to 48 kHz costs 32
+ * multiply-accumulates a sample instead of the 64 of a plain FIR at the output rate.
+ */
+template <int Up, int Down, int Taps>
+class PolyphaseResampler : public PolyphaseResamplerBase {
+    static_assert(Up > 0 && Down > 0 && Taps > 1, "invalid ratio");
+
+public:
+    explicit PolyphaseResampler(int channels) : channels_(channels), history_((Taps - 1) * channels, 0) {}
+
+    size_t MaxOutputFrames(size_t frames) const override {
+        return (frames * Up + Down - 1) / Down + 1;
+    }
+
+    void Reset() override {
+        std::fill(history_.begin(), history_.end(), 0);
+        phase_ = 0;
+    }
+
+    size_t Process(const int16_t* in, size_t frames, int16_t* out) override {
+        // The last Taps - 1 frames of the previous block followed by this one, the capacity is kept between blocks
+        window_.resize((Taps - 1 + frames) * channels_);
+        std::copy(history_.begin(), history_.end(), window_.begin());
+        std::copy(in, in + frames * channels_, window_.begin() + history_.size());
+
+        const auto& coefficients = Coefficients();
+        size_t produced = 0;
+        size_t t = phase_;
+        for (; t < frames * Up; t += Down) {
+            // window_[n] is Taps - 1 frames before the newest input sample of this output
+            const int16_t* x = window_.data() + (t / Up) * channels_;
+            const int16_t* h = coefficients[t % Up].data();
+            if (channels_ == 1) {
+                out[produced] = AudioKernels::DotQ15(h, x, Taps, 1);
+            } else {
+                for (int channel = 0; channel < channels_; channel++) {
+                    out[produced * channels_ + channel] = AudioKernels::DotQ15(h, x + channel, Taps, channels_);
+                }
+            }
+            produced++;
+        }
+        phase_ = t - frames * Up;
+        std::copy(window_.end() - history_.size(), window_.end(), history_.begin());
+        return produced;
+    }
+
+private:
+    using Table = std::array<std::array<int16_t, Taps>, Up>;
+
+    int channels_;
+    std::vector<int16_t> history_;
+    std::vector<int16_t> window_;
+    // Position of the next output in input samples times Up, from the start of the next block
+    size_t phase_ = 0;
+
+    static const Table& Coefficients() {
+        static const Table table = Design();
+        return table;
+    }
+
+    static double BesselI0(double x) {
+        double sum = 1.0;
+        double term = 1.0;
+        for (int k = 1; k < 32; k++) {
+            term *= (x / (2 * k)) * (x / (2 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    static Table Design() {
+        constexpr int length = Up * Taps;
+        constexpr double beta = 5.65;
+        // Cycles per sample at Up times the input rate
+        const double cutoff = 0.5 / (Up > Down ? Up : Down);
+        std::vector<double> prototype(length);
+        for (int k = 0; k < length; k++) {
+            double m = k - (length - 1) / 2.0;
+            double sinc = m == 0 ? 2 * cutoff : std::sin(2 * M_PI * cutoff * m) / (M_PI * m);
+            double r = 2.0 * k / (length - 1) - 1;
+            prototype[k] = sinc * BesselI0(beta * std::sqrt(1 - r * r)) / BesselI0(beta);
+        }
+
+        // Tap i of phase p multiplies window_[n + i], which is input n - (Taps - 1 - i)
+        Table table;
+        for (int p = 0; p < Up; p++) {
+            double sum = 0;
+            for (int i = 0; i < Taps; i++) {
+                sum += prototype[p + (Taps - 1 - i) * Up];
+            }
+            // Every phase passes DC at unity, the rounding error goes to its largest tap.
+            // A phase that is a single tap of 1.0 ends up one LSB short, 32768 does not fit.
+            int32_t taps[Taps];
+            int32_t total = 0;
+            int largest = 0;
+            for (int i = 0; i < Taps; i++) {
+                taps[i] = std::lround(prototype[p + (Taps - 1 - i) * Up] / sum * 32768);
+                total += taps[i];
+                if (std::abs(taps[i]) > std::abs(taps[largest])) {
+                    largest = i;
+                }
+            }
+            taps[largest] += 32768 - total;
+            for (int i = 0; i < Taps; i++) {
+                table[p][i] = (int16_t)std::clamp<int32_t>(taps[i], INT16_MIN, INT16_MAX);
+            }
+        }
+        return table;
+    }
+};
+
+#endif // POLYPHASE_RESAMPLER_H
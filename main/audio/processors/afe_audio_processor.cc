@@ -1,5 +1,7 @@
 #include "afe_audio_processor.h"
+#include "task_factory.h"
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #define PROCESSOR_RUNNING 0x01
 
@@ -17,16 +19,21 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     // Pre-allocate output buffer capacity
     output_buffer_.reserve(frame_samples_);
 
-    int ref_num = codec_->input_reference() ? 1 : 0;
-
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
+    if (front_end_ != nullptr) {
+        if (!front_end_->Initialize(codec_, models_list)) {
+            return;
+        }
+        afe_iface_ = front_end_->afe_iface();
+        afe_data_ = front_end_->afe_data();
+        front_end_->EnableNoiseSuppression(ns_allowed_);
+        front_end_->OnFetch(kAfeConsumerVoiceProcessing, [this](afe_fetch_result_t* res) {
+            ProcessFetchResult(res);
+        });
+        return;
     }
 
+    std::string input_format = codec_->GetInputFormat();
+
     srmodel_list_t *models;
     if (models_list == nullptr) {
         models = esp_srmodel_init("model");
@@ -54,6 +61,8 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     }
 
     afe_config->agc_init = false;
+    // Two microphones or more are combined by speech enhancement into one channel
+    afe_config->se_init = afe_config->pcm_config.mic_num > 1;
     afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
 
 #ifdef CONFIG_USE_DEVICE_AEC
@@ -66,21 +75,29 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
 
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
-    
-    xTaskCreate([](void* arg) {
-        auto this_ = (AfeAudioProcessor*)arg;
-        this_->AudioProcessorTask();
-        vTaskDelete(NULL);
-    }, "audio_communication", 4096, this, 3, NULL);
+    input_buffer_.Initialize(afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels(), STAGING_BUFFER_CHUNKS);
+    cpu_cost_.Initialize("Audio processor", input_format);
+    ns_initialized_ = afe_config->ns_init;
+    if (ns_initialized_ && !ns_allowed_) {
+        afe_iface_->disable_ns(afe_data_);
+    }
+
+    TaskFactory::Create("audio_communication", 4096, 3, kTaskStackPsram, [this]() {
+        AudioProcessorTask();
+    });
 }
 
 AfeAudioProcessor::~AfeAudioProcessor() {
-    if (afe_data_ != nullptr) {
+    if (afe_data_ != nullptr && front_end_ == nullptr) {
         afe_iface_->destroy(afe_data_);
     }
     vEventGroupDelete(event_group_);
 }
 
+void AfeAudioProcessor::SetFrontEnd(std::shared_ptr<AfeFrontEnd> front_end) {
+    front_end_ = front_end;
+}
+
 size_t AfeAudioProcessor::GetFeedSize() {
     if (afe_data_ == nullptr) {
         return 0;
@@ -92,35 +109,54 @@ void AfeAudioProcessor::Feed(std::vector<int16_t>&& data) {
     if (afe_data_ == nullptr) {
         return;
     }
+    if (front_end_ != nullptr) {
+        front_end_->Feed(kAfeConsumerVoiceProcessing, data);
+        return;
+    }
 
     std::lock_guard<std::mutex> lock(input_buffer_mutex_);
     // Check running state inside lock to avoid TOCTOU race with Stop()
     if (!IsRunning()) {
         return;
     }
-    input_buffer_.insert(input_buffer_.end(), data.begin(), data.end());
-    size_t chunk_size = afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
-    while (input_buffer_.size() >= chunk_size) {
-        afe_iface_->feed(afe_data_, input_buffer_.data());
-        input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + chunk_size);
+    size_t dropped = input_buffer_.Write(data.data(), data.size());
+    if (dropped > 0) {
+        ESP_LOGW(TAG, "Input staging buffer overflow, dropped %u samples", dropped);
+    }
+    int64_t feed_start = esp_timer_get_time();
+    while (auto chunk = input_buffer_.Front()) {
+        afe_iface_->feed(afe_data_, chunk);
+        input_buffer_.Pop();
     }
+    cpu_cost_.AddFeed(esp_timer_get_time() - feed_start);
 }
 
 void AfeAudioProcessor::Start() {
+    if (front_end_ != nullptr) {
+        front_end_->Start(kAfeConsumerVoiceProcessing);
+        return;
+    }
     xEventGroupSetBits(event_group_, PROCESSOR_RUNNING);
 }
 
 void AfeAudioProcessor::Stop() {
+    if (front_end_ != nullptr) {
+        front_end_->Stop(kAfeConsumerVoiceProcessing);
+        return;
+    }
     xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
 
     std::lock_guard<std::mutex> lock(input_buffer_mutex_);
     if (afe_data_ != nullptr) {
         afe_iface_->reset_buffer(afe_data_);
     }
-    input_buffer_.clear();
+    input_buffer_.Clear();
 }
 
 bool AfeAudioProcessor::IsRunning() {
+    if (front_end_ != nullptr) {
+        return front_end_->IsRunning(kAfeConsumerVoiceProcessing);
+    }
     return xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING;
 }
 
@@ -152,40 +188,60 @@ void AfeAudioProcessor::AudioProcessorTask() {
             continue;
         }
 
-        // VAD state change
-        if (vad_state_change_callback_) {
-            if (res->vad_state == VAD_SPEECH && !is_speaking_) {
-                is_speaking_ = true;
-                vad_state_change_callback_(true);
-            } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
-                is_speaking_ = false;
-                vad_state_change_callback_(false);
-            }
+        cpu_cost_.OnFetched();
+        ProcessFetchResult(res);
+    }
+}
+
+void AfeAudioProcessor::ProcessFetchResult(afe_fetch_result_t* res) {
+    // VAD state change
+    if (vad_state_change_callback_) {
+        if (res->vad_state == VAD_SPEECH && !is_speaking_) {
+            is_speaking_ = true;
+            vad_state_change_callback_(true);
+        } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
+            is_speaking_ = false;
+            vad_state_change_callback_(false);
         }
+    }
 
-        if (output_callback_) {
-            size_t samples = res->data_size / sizeof(int16_t);
-            
-            // Add data to buffer
-            output_buffer_.insert(output_buffer_.end(), res->data, res->data + samples);
-            
-            // Output complete frames when buffer has enough data
-            while (output_buffer_.size() >= frame_samples_) {
-                if (output_buffer_.size() == frame_samples_) {
-                    // If buffer size equals frame size, move the entire buffer
-                    output_callback_(std::move(output_buffer_));
-                    output_buffer_.clear();
-                    output_buffer_.reserve(frame_samples_);
-                } else {
-                    // If buffer size exceeds frame size, copy one frame and remove it
-                    output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples_));
-                    output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
-                }
+    if (output_callback_) {
+        size_t samples = res->data_size / sizeof(int16_t);
+        
+        // Add data to buffer
+        output_buffer_.insert(output_buffer_.end(), res->data, res->data + samples);
+        
+        // Output complete frames when buffer has enough data
+        while (output_buffer_.size() >= frame_samples_) {
+            if (output_buffer_.size() == frame_samples_) {
+                // If buffer size equals frame size, move the entire buffer
+                output_callback_(std::move(output_buffer_));
+                output_buffer_.clear();
+                output_buffer_.reserve(frame_samples_);
+            } else {
+                // If buffer size exceeds frame size, copy one frame and remove it
+                output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples_));
+                output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
             }
         }
     }
 }
 
+void AfeAudioProcessor::EnableNoiseSuppression(bool enable) {
+    if (ns_allowed_.exchange(enable) == enable) {
+        return;
+    }
+    if (front_end_ != nullptr) {
+        front_end_->EnableNoiseSuppression(enable);
+    } else if (afe_data_ != nullptr && ns_initialized_) {
+        if (enable) {
+            afe_iface_->enable_ns(afe_data_);
+        } else {
+            afe_iface_->disable_ns(afe_data_);
+        }
+    }
+}
+
 void AfeAudioProcessor::EnableDeviceAec(bool enable) {
     if (enable) {
 #if CONFIG_USE_DEVICE_AEC
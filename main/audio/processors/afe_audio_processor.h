@@ -10,9 +10,14 @@
 #include <vector>
 #include <functional>
 #include <mutex>
+#include <memory>
+#include <atomic>
 
 #include "audio_processor.h"
 #include "audio_codec.h"
+#include "staging_buffer.h"
+#include "afe_front_end.h"
+#include "afe_cpu_cost.h"
 
 class AfeAudioProcessor : public AudioProcessor {
 public:
@@ -28,6 +33,10 @@ public:
     void OnVadStateChange(std::function<void(bool speaking)> callback) override;
     size_t GetFeedSize() override;
     void EnableDeviceAec(bool enable) override;
+    void EnableNoiseSuppression(bool enable) override;
+
+    // Run on a front end shared with the wake word instead of an AFE of its own, call before Initialize()
+    void SetFrontEnd(std::shared_ptr<AfeFrontEnd> front_end);
 
 private:
     EventGroupHandle_t event_group_ = nullptr;
@@ -38,11 +47,16 @@ private:
     AudioCodec* codec_ = nullptr;
     int frame_samples_ = 0;
     bool is_speaking_ = false;
-    std::vector<int16_t> input_buffer_;
+    bool ns_initialized_ = false;
+    std::atomic<bool> ns_allowed_{true};
+    StagingBuffer input_buffer_;
+    AfeCpuCost cpu_cost_;
     std::mutex input_buffer_mutex_;
     std::vector<int16_t> output_buffer_;
+    std::shared_ptr<AfeFrontEnd> front_end_;
 
     void AudioProcessorTask();
+    void ProcessFetchResult(afe_fetch_result_t* res);
 };
 
 #endif 
\ No newline at end of file
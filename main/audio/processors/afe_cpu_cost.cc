@@ -0,0 +1,51 @@
+#include "afe_cpu_cost.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+
+#define TAG "AfeCpuCost"
+
+// Fetches further apart than this mean the AFE was stopped in between
+#define AFE_CPU_COST_MAX_FETCH_GAP_US 1000000
+
+void AfeCpuCost::Initialize(const char* name, const std::string& input_format) {
+    name_ = name;
+    input_format_ = input_format;
+    int mics = std::count(input_format_.begin(), input_format_.end(), 'M');
+    ESP_LOGI(TAG, "%s input format %s, %d microphone(s)", name_, input_format_.c_str(), mics);
+}
+
+void AfeCpuCost::AddFeed(int64_t duration_us) {
+    feed_us_ += duration_us;
+}
+
+void AfeCpuCost::StartPeriod(int64_t now) {
+    period_start_us_ = now;
+    period_start_counter_ = portGET_RUN_TIME_COUNTER_VALUE();
+    period_start_task_counter_ = ulTaskGetRunTimeCounter(xTaskGetCurrentTaskHandle());
+    feed_us_ = 0;
+}
+
+void AfeCpuCost::OnFetched() {
+    int64_t now = esp_timer_get_time();
+    if (period_start_us_ == 0 || now - last_fetch_us_ > AFE_CPU_COST_MAX_FETCH_GAP_US) {
+        last_fetch_us_ = now;
+        StartPeriod(now);
+        return;
+    }
+    last_fetch_us_ = now;
+    int64_t elapsed_us = now - period_start_us_;
+    if (elapsed_us < AFE_CPU_COST_LOG_INTERVAL_MS * 1000LL) {
+        return;
+    }
+
+    uint32_t elapsed = (uint32_t)(portGET_RUN_TIME_COUNTER_VALUE() - period_start_counter_);
+    uint32_t fetch = (uint32_t)(ulTaskGetRunTimeCounter(xTaskGetCurrentTaskHandle()) - period_start_task_counter_);
+    int fetch_permille = elapsed > 0 ? (int)((uint64_t)fetch * 1000 / elapsed) : 0;
+    int feed_permille = (int)(feed_us_.load() * 1000 / elapsed_us);
+    ESP_LOGI(TAG, "%s %s: feed %d.%d%%, fetch %d.%d%% of one core", name_, input_format_.c_str(),
+        feed_permille / 10, feed_permille % 10, fetch_permille / 10, fetch_permille % 10);
+    StartPeriod(now);
+}
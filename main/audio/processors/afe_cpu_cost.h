@@ -0,0 +1,41 @@
+#ifndef AFE_CPU_COST_H
+#define AFE_CPU_COST_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#define AFE_CPU_COST_LOG_INTERVAL_MS 30000
+
+/**
+ * AfeCpuCost - CPU time taken by one AFE configuration, to weigh more microphones against their SNR gain
+ *
+ * The AEC runs inside feed(), so the feeding task times those calls. Everything else runs inside
+ * fetch(), which also waits for data, so the fetch task is measured with its FreeRTOS run time counter.
+ * Both are logged as a share of one core every AFE_CPU_COST_LOG_INTERVAL_MS of running, a pause in
+ * the fetches starts a new period.
+ */
+class AfeCpuCost {
+public:
+    void Initialize(const char* name, const std::string& input_format);
+    // Feeding task, around afe feed()
+    void AddFeed(int64_t duration_us);
+    // Fetch task, after every fetch
+    void OnFetched();
+
+private:
+    const char* name_ = "AFE";
+    std::string input_format_;
+    std::atomic<int64_t> feed_us_{0};
+    int64_t period_start_us_ = 0;
+    int64_t last_fetch_us_ = 0;
+    configRUN_TIME_COUNTER_TYPE period_start_counter_ = 0;
+    configRUN_TIME_COUNTER_TYPE period_start_task_counter_ = 0;
+
+    void StartPeriod(int64_t now);
+};
+
+#endif // AFE_CPU_COST_H
@@ -0,0 +1,241 @@
+#include "afe_front_end.h"
+#include "task_factory.h"
+#include "settings.h"
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+#include <algorithm>
+
+#define AFE_CONSUMERS_ALL (kAfeConsumerWakeWord | kAfeConsumerVoiceProcessing)
+
+#define TAG "AfeFrontEnd"
+
+// AEC filter length in frames once the reference is lined up with the echo (see AecDelay), the
+// codec and DMA latency then no longer has to fit into the filter
+#define AFE_CALIBRATED_AEC_FILTER_LENGTH 2
+
+AfeFrontEnd::AfeFrontEnd() {
+    event_group_ = xEventGroupCreate();
+}
+
+AfeFrontEnd::~AfeFrontEnd() {
+    if (afe_data_ != nullptr) {
+        afe_iface_->destroy(afe_data_);
+    }
+    vEventGroupDelete(event_group_);
+}
+
+bool AfeFrontEnd::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
+    if (afe_data_ != nullptr) {
+        return true;
+    }
+    codec_ = codec;
+    std::string input_format = codec_->GetInputFormat();
+
+    srmodel_list_t *models;
+    if (models_list == nullptr) {
+        models = esp_srmodel_init("model");
+    } else {
+        models = models_list;
+    }
+
+    char* wakenet_model_name = esp_srmodel_filter(models, ESP_WN_PREFIX, NULL);
+    char* ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
+    char* vad_model_name = esp_srmodel_filter(models, ESP_VADN_PREFIX, NULL);
+
+    // Voice communication pipeline with WakeNet on top, the wake word tolerates the VoIP AEC
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
+    afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
+    afe_config->vad_mode = VAD_MODE_0;
+    afe_config->vad_min_noise_ms = 100;
+    if (vad_model_name != nullptr) {
+        afe_config->vad_model_name = vad_model_name;
+    }
+
+    if (wakenet_model_name != nullptr) {
+        afe_config->wakenet_init = true;
+        afe_config->wakenet_model_name = wakenet_model_name;
+        // The AFE runs up to two wakenet models on the same features
+        for (int i = 0; i < models->num; i++) {
+            if (models->model_name[i] != wakenet_model_name && strstr(models->model_name[i], ESP_WN_PREFIX) != nullptr) {
+                afe_config->wakenet_model_name_2 = models->model_name[i];
+                break;
+            }
+        }
+    } else {
+        afe_config->wakenet_init = false;
+    }
+
+    if (ns_model_name != nullptr) {
+        afe_config->ns_init = true;
+        afe_config->ns_model_name = ns_model_name;
+        afe_config->afe_ns_mode = AFE_NS_MODE_NET;
+    } else {
+        afe_config->ns_init = false;
+    }
+
+    afe_config->agc_init = false;
+    // Two microphones or more go through blind source separation, the wake word picks the channel
+    afe_config->se_init = afe_config->pcm_config.mic_num > 1;
+    afe_config->afe_perferred_core = 1;
+    afe_config->afe_perferred_priority = 1;
+    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+
+#ifdef CONFIG_USE_DEVICE_AEC
+    afe_config->aec_init = true;
+    afe_config->vad_init = false;
+#else
+    afe_config->aec_init = codec_->input_reference();
+    afe_config->vad_init = true;
+#endif
+    if (afe_config->aec_init) {
+        Settings settings("audio", false);
+        if (settings.GetInt("aec_delay", -1) >= 0) {
+            afe_config->aec_filter_length = std::min(afe_config->aec_filter_length, AFE_CALIBRATED_AEC_FILTER_LENGTH);
+        }
+    }
+    ns_enabled_ = afe_config->ns_init;
+
+    afe_iface_ = esp_afe_handle_from_config(afe_config);
+    afe_data_ = afe_iface_->create_from_config(afe_config);
+    if (afe_data_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create AFE");
+        return false;
+    }
+    input_buffer_.Initialize(afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels(), STAGING_BUFFER_CHUNKS);
+    cpu_cost_.Initialize("Front end", input_format);
+
+    // Nothing runs until a consumer starts
+    if (wakenet_model_name != nullptr) {
+        afe_iface_->disable_wakenet(afe_data_);
+    }
+    if (ns_enabled_) {
+        afe_iface_->disable_ns(afe_data_);
+    }
+
+    // Only waits on the AFE and computes, never with the flash cache disabled
+    TaskFactory::Create("audio_front_end", 4096, 3, kTaskStackPsram, [this]() {
+        FetchTask();
+    });
+    return true;
+}
+
+size_t AfeFrontEnd::GetFeedSize() {
+    if (afe_data_ == nullptr) {
+        return 0;
+    }
+    return afe_iface_->get_feed_chunksize(afe_data_);
+}
+
+void AfeFrontEnd::Feed(AfeConsumer consumer, const std::vector<int16_t>& data) {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(input_buffer_mutex_);
+    // Check running state inside lock to avoid TOCTOU race with Stop()
+    auto bits = xEventGroupGetBits(event_group_);
+    if ((bits & consumer) == 0) {
+        return;
+    }
+    // Both consumers are fed the same frame, only pass it to the AFE once
+    if (consumer == kAfeConsumerWakeWord && (bits & kAfeConsumerVoiceProcessing)) {
+        return;
+    }
+
+    size_t dropped = input_buffer_.Write(data.data(), data.size());
+    if (dropped > 0) {
+        ESP_LOGW(TAG, "Input staging buffer overflow, dropped %u samples", dropped);
+    }
+    int64_t feed_start = esp_timer_get_time();
+    while (auto chunk = input_buffer_.Front()) {
+        afe_iface_->feed(afe_data_, chunk);
+        input_buffer_.Pop();
+    }
+    cpu_cost_.AddFeed(esp_timer_get_time() - feed_start);
+}
+
+void AfeFrontEnd::Start(AfeConsumer consumer) {
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    if (consumer == kAfeConsumerWakeWord) {
+        afe_iface_->enable_wakenet(afe_data_);
+    } else if (consumer == kAfeConsumerVoiceProcessing && ns_enabled_ && ns_allowed_) {
+        afe_iface_->enable_ns(afe_data_);
+    }
+    xEventGroupSetBits(event_group_, consumer);
+}
+
+void AfeFrontEnd::Stop(AfeConsumer consumer) {
+    auto bits = xEventGroupClearBits(event_group_, consumer) & ~consumer;
+    if (afe_data_ == nullptr) {
+        return;
+    }
+    if (consumer == kAfeConsumerWakeWord) {
+        afe_iface_->disable_wakenet(afe_data_);
+    } else if (consumer == kAfeConsumerVoiceProcessing && ns_enabled_) {
+        afe_iface_->disable_ns(afe_data_);
+    }
+
+    // Keep the buffered audio while the other consumer still runs
+    if ((bits & AFE_CONSUMERS_ALL) == 0) {
+        std::lock_guard<std::mutex> lock(input_buffer_mutex_);
+        afe_iface_->reset_buffer(afe_data_);
+        input_buffer_.Clear();
+    }
+}
+
+void AfeFrontEnd::EnableNoiseSuppression(bool enable) {
+    ns_allowed_ = enable;
+    if (afe_data_ == nullptr || !ns_enabled_ || !IsRunning(kAfeConsumerVoiceProcessing)) {
+        return;
+    }
+    if (enable) {
+        afe_iface_->enable_ns(afe_data_);
+    } else {
+        afe_iface_->disable_ns(afe_data_);
+    }
+}
+
+bool AfeFrontEnd::IsRunning(AfeConsumer consumer) {
+    return xEventGroupGetBits(event_group_) & consumer;
+}
+
+void AfeFrontEnd::OnFetch(AfeConsumer consumer, std::function<void(afe_fetch_result_t* result)> callback) {
+    if (consumer == kAfeConsumerWakeWord) {
+        wake_word_callback_ = callback;
+    } else {
+        voice_processing_callback_ = callback;
+    }
+}
+
+void AfeFrontEnd::FetchTask() {
+    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
+    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
+    ESP_LOGI(TAG, "Audio front end task started, feed size: %d fetch size: %d",
+        feed_size, fetch_size);
+
+    while (true) {
+        xEventGroupWaitBits(event_group_, AFE_CONSUMERS_ALL, pdFALSE, pdFALSE, portMAX_DELAY);
+
+        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
+        if (res == nullptr || res->ret_value == ESP_FAIL) {
+            if (res != nullptr) {
+                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
+            }
+            continue;
+        }
+
+        cpu_cost_.OnFetched();
+
+        // Check again, a consumer may have stopped while fetch was blocked
+        auto bits = xEventGroupGetBits(event_group_);
+        if ((bits & kAfeConsumerWakeWord) && wake_word_callback_) {
+            wake_word_callback_(res);
+        }
+        if ((bits & kAfeConsumerVoiceProcessing) && voice_processing_callback_) {
+            voice_processing_callback_(res);
+        }
+    }
+}
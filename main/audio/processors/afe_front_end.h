@@ -0,0 +1,70 @@
+#ifndef AFE_FRONT_END_H
+#define AFE_FRONT_END_H
+
+#include <esp_afe_sr_models.h>
+#include <model_path.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+#include "audio_codec.h"
+#include "staging_buffer.h"
+#include "afe_cpu_cost.h"
+
+enum AfeConsumer {
+    kAfeConsumerWakeWord = 1 << 0,
+    kAfeConsumerVoiceProcessing = 1 << 1,
+};
+
+/*
+ * One AFE instance shared by AfeWakeWord and AfeAudioProcessor.
+ *
+ * The AFE runs AEC/NS/VAD and WakeNet on a single feed, and every fetch result goes to
+ * the consumers that are running: the wake word looks at the wakenet state, voice processing
+ * sends the cleaned stream. When both run, both get fed the same frame by the input task,
+ * only the voice processing feed is passed to the AFE.
+ *
+ * WakeNet and NS are switched on and off with their consumer, so the wake word alone does
+ * not pay for noise suppression.
+ */
+class AfeFrontEnd {
+public:
+    AfeFrontEnd();
+    ~AfeFrontEnd();
+
+    // The first consumer to initialize creates the AFE, later calls are no-ops
+    bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
+    void Feed(AfeConsumer consumer, const std::vector<int16_t>& data);
+    void Start(AfeConsumer consumer);
+    void Stop(AfeConsumer consumer);
+    bool IsRunning(AfeConsumer consumer);
+    // Called on the fetch task while the consumer is running
+    void OnFetch(AfeConsumer consumer, std::function<void(afe_fetch_result_t* result)> callback);
+    size_t GetFeedSize();
+    // Noise suppression runs with voice processing unless disabled here
+    void EnableNoiseSuppression(bool enable);
+
+    const esp_afe_sr_iface_t* afe_iface() const { return afe_iface_; }
+    esp_afe_sr_data_t* afe_data() const { return afe_data_; }
+
+private:
+    EventGroupHandle_t event_group_ = nullptr;
+    const esp_afe_sr_iface_t* afe_iface_ = nullptr;
+    esp_afe_sr_data_t* afe_data_ = nullptr;
+    AudioCodec* codec_ = nullptr;
+    bool ns_enabled_ = false;
+    std::atomic<bool> ns_allowed_{true};
+    std::function<void(afe_fetch_result_t* result)> wake_word_callback_;
+    std::function<void(afe_fetch_result_t* result)> voice_processing_callback_;
+    StagingBuffer input_buffer_;
+    AfeCpuCost cpu_cost_;
+    std::mutex input_buffer_mutex_;
+
+    void FetchTask();
+};
+
+#endif
@@ -3,15 +3,30 @@
 
 #if CONFIG_USE_AUDIO_DEBUGGER
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
 #include <string>
+#include <algorithm>
 #endif
 
 #define TAG "AudioDebugger"
 
+#if CONFIG_USE_AUDIO_DEBUGGER
+#define AUDIO_DEBUG_DROP_LOG_INTERVAL_US (5 * 1000 * 1000)
+
+static const int16_t ADPCM_STEPS[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+static const int8_t ADPCM_INDEX_STEPS[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+#endif
 
 AudioDebugger::AudioDebugger() {
 #if CONFIG_USE_AUDIO_DEBUGGER
@@ -20,16 +35,16 @@ AudioDebugger::AudioDebugger() {
         // 解析配置的服务器地址 "IP:PORT"
         std::string server_addr = CONFIG_AUDIO_DEBUG_UDP_SERVER;
         size_t colon_pos = server_addr.find(':');
-        
+
         if (colon_pos != std::string::npos) {
             std::string ip = server_addr.substr(0, colon_pos);
             int port = std::stoi(server_addr.substr(colon_pos + 1));
-            
+
             memset(&udp_server_addr_, 0, sizeof(udp_server_addr_));
             udp_server_addr_.sin_family = AF_INET;
             udp_server_addr_.sin_port = htons(port);
             inet_pton(AF_INET, ip.c_str(), &udp_server_addr_.sin_addr);
-            
+
             ESP_LOGI(TAG, "Initialized server address: %s", CONFIG_AUDIO_DEBUG_UDP_SERVER);
         } else {
             ESP_LOGW(TAG, "Invalid server address: %s, should be IP:PORT", CONFIG_AUDIO_DEBUG_UDP_SERVER);
@@ -39,11 +54,27 @@ AudioDebugger::AudioDebugger() {
     } else {
         ESP_LOGW(TAG, "Failed to create UDP socket: %d", errno);
     }
+    if (udp_sockfd_ < 0) {
+        return;
+    }
+
+    packet_.reserve(sizeof(AudioDebugHeader) + AUDIO_DEBUG_MAX_PAYLOAD);
+    budget_time_us_ = esp_timer_get_time();
+    xTaskCreate([](void* arg) {
+        AudioDebugger* debugger = (AudioDebugger*)arg;
+        debugger->SenderTask();
+    }, "audio_debug", 4096, this, 1, &sender_task_);
+    for (auto& queue : queues_) {
+        queue.SetConsumer(sender_task_);
+    }
 #endif
 }
 
 AudioDebugger::~AudioDebugger() {
 #if CONFIG_USE_AUDIO_DEBUGGER
+    if (sender_task_ != nullptr) {
+        vTaskDelete(sender_task_);
+    }
     if (udp_sockfd_ >= 0) {
         close(udp_sockfd_);
         ESP_LOGI(TAG, "Closed UDP socket");
@@ -51,18 +82,204 @@ AudioDebugger::~AudioDebugger() {
 #endif
 }
 
-void AudioDebugger::Feed(const std::vector<int16_t>& data) {
+void AudioDebugger::FeedInput(const std::vector<int16_t>& data, int channels, bool has_reference, int sample_rate) {
+#if CONFIG_AUDIO_DEBUG_STREAM_MIC || CONFIG_AUDIO_DEBUG_STREAM_REFERENCE
+    Push(kTapInput, kAudioDebugStreamMic, data.data(), data.size(), channels, has_reference && channels > 1, sample_rate);
+#endif
+}
+
+void AudioDebugger::FeedProcessed(const std::vector<int16_t>& data, int sample_rate) {
+#if CONFIG_AUDIO_DEBUG_STREAM_PROCESSED
+    Push(kTapProcessed, kAudioDebugStreamProcessed, data.data(), data.size(), 1, false, sample_rate);
+#endif
+}
+
+void AudioDebugger::FeedPlayback(const std::vector<int16_t>& data, int sample_rate) {
+#if CONFIG_AUDIO_DEBUG_STREAM_PLAYBACK
+    Push(kTapPlayback, kAudioDebugStreamPlayback, data.data(), data.size(), 1, false, sample_rate);
+#endif
+}
+
 #if CONFIG_USE_AUDIO_DEBUGGER
-    if (udp_sockfd_ >= 0) {
-        ssize_t sent = sendto(udp_sockfd_, data.data(), data.size() * sizeof(int16_t), 0,
+// Runs on the producer's task, so nothing but the copy
+void AudioDebugger::Push(Tap tap, AudioDebugStream stream, const int16_t* data, size_t size, int channels, bool has_reference, int sample_rate) {
+    auto& queue = queues_[tap];
+    if (udp_sockfd_ < 0 || size == 0) {
+        return;
+    }
+    if (queue.full()) {
+        queue_drops_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Chunk chunk;
+    chunk.pcm.assign(data, data + size);
+    chunk.sample_rate = sample_rate;
+    chunk.channels = channels;
+    chunk.stream = stream;
+    chunk.has_reference = has_reference;
+    queue.Push(std::move(chunk));
+}
+
+void AudioDebugger::SenderTask() {
+    int64_t last_log_us = 0;
+    uint32_t logged_drops = 0;
+    Chunk chunk;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        bool popped;
+        do {
+            popped = false;
+            for (auto& queue : queues_) {
+                if (queue.Pop(chunk)) {
+                    SendChunk(chunk);
+                    popped = true;
+                }
+            }
+        } while (popped);
+
+        int64_t now = esp_timer_get_time();
+        uint32_t queue_drops = queue_drops_.load(std::memory_order_relaxed);
+        if (queue_drops + rate_drops_ != logged_drops && now - last_log_us >= AUDIO_DEBUG_DROP_LOG_INTERVAL_US) {
+            ESP_LOGW(TAG, "Dropped %lu blocks with the queue full, %lu packets over %d kbps",
+                (unsigned long)queue_drops, (unsigned long)rate_drops_, CONFIG_AUDIO_DEBUG_MAX_KBPS);
+            logged_drops = queue_drops + rate_drops_;
+            last_log_us = now;
+        }
+    }
+}
+
+void AudioDebugger::SendChunk(const Chunk& chunk) {
+    size_t frames = chunk.pcm.size() / chunk.channels;
+    if (!chunk.has_reference) {
+#if !CONFIG_AUDIO_DEBUG_STREAM_MIC
+        if (chunk.stream == kAudioDebugStreamMic) {
+            return;
+        }
+#endif
+        SendStream(chunk.stream, chunk.pcm.data(), frames, chunk.channels, chunk.sample_rate);
+        return;
+    }
+
+    // Split the interleaved input into the mic channels followed by the reference channel
+    int mic_channels = chunk.channels - 1;
+    scratch_.resize(frames * chunk.channels);
+    int16_t* mic = scratch_.data();
+    int16_t* reference = scratch_.data() + frames * mic_channels;
+    for (size_t i = 0; i < frames; i++) {
+        const int16_t* frame = chunk.pcm.data() + i * chunk.channels;
+        std::copy(frame, frame + mic_channels, mic + i * mic_channels);
+        reference[i] = frame[mic_channels];
+    }
+#if CONFIG_AUDIO_DEBUG_STREAM_MIC
+    SendStream(kAudioDebugStreamMic, mic, frames, mic_channels, chunk.sample_rate);
+#endif
+#if CONFIG_AUDIO_DEBUG_STREAM_REFERENCE
+    SendStream(kAudioDebugStreamReference, reference, frames, 1, chunk.sample_rate);
+#endif
+}
+
+static uint8_t AdpcmEncode(int16_t& predictor, uint8_t& index, int sample) {
+    int step = ADPCM_STEPS[index];
+    int diff = sample - predictor;
+    uint8_t code = 0;
+    if (diff < 0) {
+        code = 8;
+        diff = -diff;
+    }
+    int delta = step >> 3;
+    if (diff >= step) {
+        code |= 4;
+        diff -= step;
+        delta += step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        code |= 2;
+        diff -= step;
+        delta += step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        code |= 1;
+        delta += step;
+    }
+    predictor = std::clamp(predictor + ((code & 8) ? -delta : delta), -32768, 32767);
+    index = std::clamp(index + ADPCM_INDEX_STEPS[code], 0, 88);
+    return code;
+}
+
+void AudioDebugger::SendStream(AudioDebugStream stream, const int16_t* pcm, size_t samples, int channels, int sample_rate) {
+    auto& state = streams_[stream];
+#if CONFIG_AUDIO_DEBUG_ADPCM
+    bool adpcm = channels <= (int)(sizeof(state.adpcm) / sizeof(state.adpcm[0]));
+#else
+    bool adpcm = false;
+#endif
+    size_t max_samples = adpcm ? (AUDIO_DEBUG_MAX_PAYLOAD - 4 * channels) * 2 / channels
+                               : AUDIO_DEBUG_MAX_PAYLOAD / (sizeof(int16_t) * channels);
+
+    for (size_t offset = 0; offset < samples; offset += max_samples) {
+        size_t count = std::min(max_samples, samples - offset);
+        const int16_t* block = pcm + offset * channels;
+        size_t payload_size = adpcm ? 4 * channels + (count * channels + 1) / 2 : count * channels * sizeof(int16_t);
+
+        AudioDebugHeader header = {
+            .magic = AUDIO_DEBUG_MAGIC,
+            .stream = stream,
+            .codec = adpcm ? kAudioDebugCodecAdpcm : kAudioDebugCodecPcm,
+            .channels = (uint8_t)channels,
+            .sample_rate = (uint16_t)sample_rate,
+            .samples = (uint16_t)count,
+            .sequence = state.sequence++,
+            .position = state.position,
+        };
+        state.position += count;
+
+        packet_.resize(sizeof(header) + payload_size);
+        memcpy(packet_.data(), &header, sizeof(header));
+        uint8_t* payload = packet_.data() + sizeof(header);
+        if (adpcm) {
+            // The coder state at the start of the packet, so a lost packet does not break the next one
+            for (int c = 0; c < channels; c++) {
+                memcpy(payload, &state.adpcm[c].predictor, sizeof(int16_t));
+                payload[2] = state.adpcm[c].index;
+                payload[3] = 0;
+                payload += 4;
+            }
+            memset(payload, 0, (count * channels + 1) / 2);
+            for (size_t i = 0; i < count * channels; i++) {
+                auto& coder = state.adpcm[i % channels];
+                uint8_t code = AdpcmEncode(coder.predictor, coder.index, block[i]);
+                payload[i / 2] |= (i & 1) ? code << 4 : code;
+            }
+        } else {
+            memcpy(payload, block, payload_size);
+        }
+
+        // The coder state moves on even for a dropped packet, the next one carries it
+        if (!TakeBudget(packet_.size())) {
+            rate_drops_++;
+            continue;
+        }
+        ssize_t sent = sendto(udp_sockfd_, packet_.data(), packet_.size(), 0,
                              (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
         if (sent < 0) {
-            ESP_LOGW(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
-        } else {
-            ESP_LOGD(TAG, "Sent %d bytes audio data to %s", sent, CONFIG_AUDIO_DEBUG_UDP_SERVER);
+            ESP_LOGD(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
         }
     }
-#endif
 }
 
- 
\ No newline at end of file
+// Token bucket of CONFIG_AUDIO_DEBUG_MAX_KBPS, holding at most a quarter second of burst
+bool AudioDebugger::TakeBudget(size_t bytes) {
+    const int64_t bytes_per_second = CONFIG_AUDIO_DEBUG_MAX_KBPS * 1000LL / 8;
+    int64_t now = esp_timer_get_time();
+    budget_bytes_ = std::min(budget_bytes_ + (now - budget_time_us_) * bytes_per_second / 1000000,
+                             bytes_per_second / 4);
+    budget_time_us_ = now;
+    if (budget_bytes_ < (int64_t)bytes) {
+        return false;
+    }
+    budget_bytes_ -= bytes;
+    return true;
+}
+#endif
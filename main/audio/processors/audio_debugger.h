@@ -3,20 +3,107 @@
 
 #include <vector>
 #include <cstdint>
+#include <cstddef>
+#include <atomic>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
+#include "spsc_queue.h"
+
+// Stream IDs on the wire, scripts/audio_debug_server.py writes one WAV file per stream
+enum AudioDebugStream : uint8_t {
+    kAudioDebugStreamMic = 0,        // Raw microphone channels
+    kAudioDebugStreamReference = 1,  // Playback reference channel of the input, for AEC
+    kAudioDebugStreamProcessed = 2,  // Audio processor (AFE) output
+    kAudioDebugStreamPlayback = 3,   // Decoded and mixed audio written to the speaker
+};
+
+enum AudioDebugCodec : uint8_t {
+    kAudioDebugCodecPcm = 0,
+    kAudioDebugCodecAdpcm = 1,       // IMA ADPCM, 4 bits per sample
+};
+
+// Little endian, followed by the payload
+struct AudioDebugHeader {
+    uint8_t magic;                   // AUDIO_DEBUG_MAGIC
+    uint8_t stream;
+    uint8_t codec;
+    uint8_t channels;
+    uint16_t sample_rate;
+    uint16_t samples;                // Per channel
+    uint32_t sequence;               // Per stream, gaps are lost packets
+    uint32_t position;               // Per stream, index of the first sample
+} __attribute__((packed));
+
+#define AUDIO_DEBUG_MAGIC 0xAD
+#define AUDIO_DEBUG_MAX_PAYLOAD 1400
+#define AUDIO_DEBUG_QUEUE_DEPTH 16
+
+/**
+ * AudioDebugger - Streams taps of the audio pipeline over UDP for debugging AEC in the field
+ *
+ * Feed() only copies the block into the queue of its tap and returns, a full queue drops the
+ * block. A low priority task splits the input into the mic and reference streams, optionally
+ * compresses them with IMA ADPCM and sends them to CONFIG_AUDIO_DEBUG_UDP_SERVER, capped at
+ * CONFIG_AUDIO_DEBUG_MAX_KBPS. Every packet is decodable on its own: ADPCM payloads start with
+ * the coder state of each channel, and the position lets the receiver fill lost packets with
+ * silence so the streams stay aligned.
+ *
+ * Each tap has a single producer: the input tap is fed by the audio input task, the processed
+ * tap by the audio processor and the playback tap by the audio output task.
+ */
 class AudioDebugger {
 public:
     AudioDebugger();
     ~AudioDebugger();
 
-    void Feed(const std::vector<int16_t>& data);
+    // Interleaved input as read from the codec, the last channel is the reference if has_reference
+    void FeedInput(const std::vector<int16_t>& data, int channels, bool has_reference, int sample_rate);
+    void FeedProcessed(const std::vector<int16_t>& data, int sample_rate);
+    void FeedPlayback(const std::vector<int16_t>& data, int sample_rate);
 
 private:
+    struct Chunk {
+        std::vector<int16_t> pcm;
+        uint16_t sample_rate = 0;
+        uint8_t channels = 0;
+        AudioDebugStream stream = kAudioDebugStreamMic;
+        bool has_reference = false;
+    };
+
+    struct AdpcmState {
+        int16_t predictor = 0;
+        uint8_t index = 0;
+    };
+
+    struct StreamState {
+        uint32_t sequence = 0;
+        uint32_t position = 0;
+        AdpcmState adpcm[4];
+    };
+
+    enum Tap { kTapInput, kTapProcessed, kTapPlayback, kTapCount };
+
     int udp_sockfd_ = -1;
     struct sockaddr_in udp_server_addr_;
+    TaskHandle_t sender_task_ = nullptr;
+    SpscQueue<Chunk, AUDIO_DEBUG_QUEUE_DEPTH> queues_[kTapCount];
+    std::atomic<uint32_t> queue_drops_{0};
+    uint32_t rate_drops_ = 0;
+    StreamState streams_[4];
+    int64_t budget_bytes_ = 0;
+    int64_t budget_time_us_ = 0;
+    std::vector<int16_t> scratch_;
+    std::vector<uint8_t> packet_;
+
+    void Push(Tap tap, AudioDebugStream stream, const int16_t* data, size_t size, int channels, bool has_reference, int sample_rate);
+    void SenderTask();
+    void SendChunk(const Chunk& chunk);
+    void SendStream(AudioDebugStream stream, const int16_t* pcm, size_t samples, int channels, int sample_rate);
+    bool TakeBudget(size_t bytes);
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -1,4 +1,5 @@
 #include "no_audio_processor.h"
+#include "audio_kernels.h"
 #include <esp_log.h>
 
 #define TAG "NoAudioProcessor"
@@ -13,13 +14,13 @@ void NoAudioProcessor::Feed(std::vector<int16_t>&& data) {
         return;
     }
 
-    if (codec_->input_channels() == 2) {
-        // If input channels is 2, we need to fetch the left channel data
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
-        }
-        output_callback_(std::move(mono_data));
+    int channels = codec_->input_channels();
+    if (channels > 1) {
+        // Only the first microphone is passed on
+        size_t frames = data.size() / channels;
+        AudioKernels::ExtractChannel(data.data(), data.data(), frames, channels, codec_->GetPrimaryMicChannel());
+        data.resize(frames);
+        output_callback_(std::move(data));
     } else {
         output_callback_(std::move(data));
     }
@@ -0,0 +1,87 @@
+#include "resampler.h"
+
+#include <esp_audio_types.h>
+#include <esp_log.h>
+#include <sdkconfig.h>
+
+#define TAG "Resampler"
+
+Resampler::~Resampler() {
+    Close();
+}
+
+bool Resampler::Open(int src_rate, int dest_rate, int channels, bool allow_polyphase) {
+    Close();
+#if CONFIG_USE_POLYPHASE_RESAMPLER
+    if (allow_polyphase) {
+        // Decimation by 3 has a single phase, it gets the taps of all of them
+        if (src_rate == 24000 && dest_rate == 48000) {
+            polyphase_ = std::make_unique<PolyphaseResampler<2, 1, 32>>(channels);
+        } else if (src_rate == 24000 && dest_rate == 16000) {
+            polyphase_ = std::make_unique<PolyphaseResampler<2, 3, 32>>(channels);
+        } else if (src_rate == 48000 && dest_rate == 16000) {
+            polyphase_ = std::make_unique<PolyphaseResampler<1, 3, 64>>(channels);
+        } else if (src_rate == 16000 && dest_rate == 48000) {
+            polyphase_ = std::make_unique<PolyphaseResampler<3, 1, 32>>(channels);
+        } else if (src_rate == 16000 && dest_rate == 24000) {
+            polyphase_ = std::make_unique<PolyphaseResampler<3, 2, 32>>(channels);
+        }
+        if (polyphase_ != nullptr) {
+            return true;
+        }
+    }
+#endif
+    esp_ae_rate_cvt_cfg_t cfg = {
+        .src_rate = (uint32_t)src_rate,
+        .dest_rate = (uint32_t)dest_rate,
+        .channel = (uint8_t)channels,
+        .bits_per_sample = ESP_AUDIO_BIT16,
+        .complexity = 2,
+        .perf_type = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,
+    };
+    auto ret = esp_ae_rate_cvt_open(&cfg, &generic_);
+    if (generic_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create the %d -> %d resampler, error code: %d", src_rate, dest_rate, ret);
+        return false;
+    }
+    return true;
+}
+
+void Resampler::Close() {
+    polyphase_.reset();
+    if (generic_ != nullptr) {
+        esp_ae_rate_cvt_close(generic_);
+        generic_ = nullptr;
+    }
+}
+
+void Resampler::Reset() {
+    if (polyphase_ != nullptr) {
+        polyphase_->Reset();
+    } else if (generic_ != nullptr) {
+        esp_ae_rate_cvt_reset(generic_);
+    }
+}
+
+size_t Resampler::MaxOutputFrames(size_t frames) {
+    if (polyphase_ != nullptr) {
+        return polyphase_->MaxOutputFrames(frames);
+    }
+    uint32_t out_frames = 0;
+    if (generic_ != nullptr) {
+        esp_ae_rate_cvt_get_max_out_sample_num(generic_, frames, &out_frames);
+    }
+    return out_frames;
+}
+
+size_t Resampler::Process(const int16_t* in, size_t frames, int16_t* out) {
+    if (polyphase_ != nullptr) {
+        return polyphase_->Process(in, frames, out);
+    }
+    if (generic_ == nullptr) {
+        return 0;
+    }
+    uint32_t out_frames = MaxOutputFrames(frames);
+    esp_ae_rate_cvt_process(generic_, (esp_ae_sample_t)in, frames, (esp_ae_sample_t)out, &out_frames);
+    return out_frames;
+}
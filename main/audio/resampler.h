@@ -0,0 +1,40 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include "polyphase_resampler.h"
+
+#include <esp_ae_rate_cvt.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Resampler - Sample rate conversion of interleaved 16-bit PCM
+ *
+ * The fixed ratios the audio service meets all the time (24 kHz server audio to a 16 or 48 kHz
+ * codec, 48 kHz microphones to 16 kHz, ...) run on a PolyphaseResampler built for that ratio. Any
+ * other ratio, or every ratio without CONFIG_USE_POLYPHASE_RESAMPLER, goes to esp_ae_rate_cvt.
+ */
+class Resampler {
+public:
+    Resampler() = default;
+    ~Resampler();
+    Resampler(const Resampler&) = delete;
+    Resampler& operator=(const Resampler&) = delete;
+
+    bool Open(int src_rate, int dest_rate, int channels, bool allow_polyphase = true);
+    void Close();
+    void Reset();
+    size_t MaxOutputFrames(size_t frames);
+    // Returns the frames written to out, which has room for MaxOutputFrames(frames)
+    size_t Process(const int16_t* in, size_t frames, int16_t* out);
+
+    inline bool polyphase() const { return polyphase_ != nullptr; }
+
+private:
+    std::unique_ptr<PolyphaseResamplerBase> polyphase_;
+    esp_ae_rate_cvt_handle_t generic_ = nullptr;
+};
+
+#endif // RESAMPLER_H
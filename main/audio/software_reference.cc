@@ -0,0 +1,77 @@
+#include "software_reference.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "SoftwareReference"
+
+bool SoftwareReference::Initialize(int output_sample_rate, int input_sample_rate, i2s_chan_handle_t tx_handle,
+    i2s_chan_handle_t rx_handle) {
+    clock_.SetSampleRates(output_sample_rate, input_sample_rate);
+    if (!clock_.Attach(tx_handle, rx_handle)) {
+        return false;
+    }
+    step_ = ((uint64_t)output_sample_rate << 16) / input_sample_rate;
+    ring_.assign(SOFTWARE_REFERENCE_FRAMES, 0);
+    ESP_LOGI(TAG, "Reference from the playback, %d Hz to %d Hz", output_sample_rate, input_sample_rate);
+    return true;
+}
+
+void SoftwareReference::OnWrite(const int16_t* data, size_t frames) {
+    uint64_t start = clock_.Write(frames, 0);
+    // Older than the ring can hold is never looked up
+    if (frames > SOFTWARE_REFERENCE_FRAMES) {
+        data += frames - SOFTWARE_REFERENCE_FRAMES;
+        start += frames - SOFTWARE_REFERENCE_FRAMES;
+        frames = SOFTWARE_REFERENCE_FRAMES;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The speaker played silence between the previous block and this one
+    uint64_t gap_start = std::max<uint64_t>(end_, start > SOFTWARE_REFERENCE_FRAMES ? start - SOFTWARE_REFERENCE_FRAMES : 0);
+    for (uint64_t position = gap_start; position < start; position++) {
+        ring_[position % SOFTWARE_REFERENCE_FRAMES] = 0;
+    }
+    size_t offset = start % SOFTWARE_REFERENCE_FRAMES;
+    size_t first = std::min<size_t>(frames, SOFTWARE_REFERENCE_FRAMES - offset);
+    memcpy(&ring_[offset], data, first * sizeof(int16_t));
+    memcpy(&ring_[0], data + first, (frames - first) * sizeof(int16_t));
+    end_ = std::max(end_, start + frames);
+}
+
+void SoftwareReference::OnInputEnabled() {
+    clock_.OnInputEnabled(input_frames_);
+}
+
+// Called with mutex_ held
+int16_t SoftwareReference::SampleAt(uint64_t position) const {
+    if (position >= end_ || position + SOFTWARE_REFERENCE_FRAMES < end_) {
+        return 0;
+    }
+    return ring_[position % SOFTWARE_REFERENCE_FRAMES];
+}
+
+void SoftwareReference::Interleave(const int16_t* mic, int16_t* dest, size_t frames) {
+    uint64_t position = 0;
+    bool known = clock_.PositionOfInput(input_frames_, position);
+    input_frames_ += frames;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Positions of the following frames step at the rate ratio, in 16.16 from the first one
+    uint64_t fraction = 0;
+    for (size_t i = 0; i < frames; i++) {
+        dest[2 * i] = mic[i];
+        if (!known) {
+            dest[2 * i + 1] = 0;
+            continue;
+        }
+        uint64_t at = position + (fraction >> 16);
+        int32_t weight = fraction & 0xFFFF;
+        int32_t a = SampleAt(at);
+        int32_t b = SampleAt(at + 1);
+        dest[2 * i + 1] = (int16_t)(a + (((b - a) * weight) >> 16));
+        fraction += step_;
+    }
+}
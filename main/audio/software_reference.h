@@ -0,0 +1,51 @@
+#ifndef SOFTWARE_REFERENCE_H
+#define SOFTWARE_REFERENCE_H
+
+#include "playback_clock.h"
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Output frames of playback kept, a power of two. Covers the speaker DMA ahead of the speaker and
+// the microphone DMA behind it at the deepest latency profile
+#define SOFTWARE_REFERENCE_FRAMES 16384
+
+/**
+ * SoftwareReference - The AEC reference channel of codecs that cannot loop the speaker back
+ *
+ * Every block the codec writes is kept by its speaker position, as placed by a PlaybackClock on the
+ * codec's own I2S channels. For each microphone frame read, the clock tells where the speaker was
+ * when the frame was captured, and the playback at that position, resampled to the input rate, is
+ * the reference sample. Positions the speaker played nothing at, e.g. after an underrun, are silent.
+ *
+ * The reference is what left the DMA, so the amplifier and the room are left for the AEC filter
+ * and the AecDelay calibration, the same as with a hardware loopback channel.
+ */
+class SoftwareReference {
+public:
+    // False if the clock could not follow the channels, there is no reference then
+    bool Initialize(int output_sample_rate, int input_sample_rate, i2s_chan_handle_t tx_handle, i2s_chan_handle_t rx_handle);
+
+    // Output task, mono playback before it goes to the DMA
+    void OnWrite(const int16_t* data, size_t frames);
+    // Input task, right after the channel was enabled
+    void OnInputEnabled();
+    // Input task, interleaves the frames read from the microphone with their reference into dest
+    void Interleave(const int16_t* mic, int16_t* dest, size_t frames);
+
+private:
+    PlaybackClock clock_;
+    // Output frames per input frame in 16.16
+    uint32_t step_ = 1 << 16;
+    uint64_t input_frames_ = 0;
+
+    std::mutex mutex_;
+    std::vector<int16_t> ring_;
+    // One past the last output frame written
+    uint64_t end_ = 0;
+
+    int16_t SampleAt(uint64_t position) const;
+};
+
+#endif // SOFTWARE_REFERENCE_H
@@ -0,0 +1,307 @@
+#include "sound_player.h"
+#include "heap_placement.h"
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#include "esp_opus_dec.h"
+#include "esp_audio_types.h"
+
+#define TAG "SoundPlayer"
+
+// Opus allows up to 120 ms per packet, the sound assets use 60 ms
+#define SOUND_MAX_FRAME_DURATION_MS 120
+
+SoundDecoder::~SoundDecoder() {
+    Close();
+}
+
+bool SoundDecoder::Decode(const uint8_t* data, size_t size, int sample_rate, int output_sample_rate, std::vector<int16_t>& pcm) {
+    if ((sample_rate != sample_rate_ || output_sample_rate != output_sample_rate_) && !Open(sample_rate, output_sample_rate)) {
+        return false;
+    }
+
+    frame_.resize(frame_size_);
+    esp_audio_dec_in_raw_t raw = {
+        .buffer = (uint8_t *)data,
+        .len = (uint32_t)size,
+        .consumed = 0,
+        .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
+    };
+    esp_audio_dec_out_frame_t out_frame = {
+        .buffer = (uint8_t *)frame_.data(),
+        .len = (uint32_t)(frame_.size() * sizeof(int16_t)),
+        .decoded_size = 0,
+    };
+    esp_audio_dec_info_t dec_info = {};
+    auto ret = esp_opus_dec_decode(decoder_, &raw, &out_frame, &dec_info);
+    if (ret != ESP_AUDIO_ERR_OK) {
+        ESP_LOGW(TAG, "Failed to decode sound packet, error code: %d", ret);
+        return false;
+    }
+    uint32_t decoded = out_frame.decoded_size / sizeof(int16_t);
+
+    if (resampler_ != nullptr) {
+        size_t offset = pcm.size();
+        pcm.resize(offset + resampler_->MaxOutputFrames(decoded));
+        size_t actual_output = resampler_->Process(frame_.data(), decoded, pcm.data() + offset);
+        pcm.resize(offset + actual_output);
+    } else {
+        pcm.insert(pcm.end(), frame_.begin(), frame_.begin() + decoded);
+    }
+    return true;
+}
+
+void SoundDecoder::Reset() {
+    if (decoder_ != nullptr) {
+        esp_opus_dec_reset(decoder_);
+    }
+    if (resampler_ != nullptr) {
+        resampler_->Reset();
+    }
+}
+
+bool SoundDecoder::Open(int sample_rate, int output_sample_rate) {
+    Close();
+
+    esp_opus_dec_cfg_t opus_dec_cfg = {
+        .sample_rate = (uint32_t)sample_rate,
+        .channel = ESP_AUDIO_MONO,
+        .frame_duration = ESP_OPUS_DEC_FRAME_DURATION_120_MS,
+        .self_delimited = false,
+    };
+    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &decoder_);
+    if (decoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create sound decoder, error code: %d", ret);
+        return false;
+    }
+    sample_rate_ = sample_rate;
+    output_sample_rate_ = output_sample_rate;
+    frame_size_ = sample_rate / 1000 * SOUND_MAX_FRAME_DURATION_MS;
+
+    if (sample_rate != output_sample_rate) {
+        resampler_ = std::make_unique<Resampler>();
+        if (!resampler_->Open(sample_rate, output_sample_rate, 1)) {
+            resampler_.reset();
+        }
+    }
+    return true;
+}
+
+void SoundDecoder::Close() {
+    if (decoder_ != nullptr) {
+        esp_opus_dec_close(decoder_);
+        decoder_ = nullptr;
+    }
+    resampler_.reset();
+    sample_rate_ = 0;
+    output_sample_rate_ = 0;
+    frame_size_ = 0;
+}
+
+CachedSound::~CachedSound() {
+    HeapPlacement::Free(kHeapSubsystemAudio, pcm);
+}
+
+void SoundPlayer::Initialize(int output_sample_rate) {
+    output_sample_rate_ = output_sample_rate;
+}
+
+bool SoundPlayer::Play(std::string_view ogg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.size() >= MAX_PENDING_SOUNDS) {
+        ESP_LOGW(TAG, "Too many pending sounds, dropped");
+        return false;
+    }
+    pending_.push_back(ogg);
+    active_ = true;
+    return true;
+}
+
+void SoundPlayer::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.clear();
+    // The decoder task drops the current sound on its next Read()
+    stop_requested_ = true;
+}
+
+size_t SoundPlayer::ClearCache() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t bytes = cache_bytes_;
+    cache_.clear();
+    cache_bytes_ = 0;
+    return bytes;
+}
+
+bool SoundPlayer::Preload(std::string_view ogg) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (FindCachedSound(ogg) != nullptr) {
+            return true;
+        }
+    }
+
+    OggReader reader;
+    SoundDecoder decoder;
+    std::vector<int16_t> pcm;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    reader.Open(ogg);
+    while (reader.NextPacket(data, size)) {
+        decoder.Decode(data, size, reader.sample_rate(), output_sample_rate_, pcm);
+        if (!IsCacheable(pcm.size())) {
+            ESP_LOGW(TAG, "Sound is too long to be preloaded");
+            return false;
+        }
+    }
+    if (pcm.empty()) {
+        return false;
+    }
+    AddCachedSound(ogg, pcm);
+    return true;
+}
+
+size_t SoundPlayer::Read(std::vector<int16_t>& pcm, size_t samples) {
+    if (stop_requested_.exchange(false)) {
+        CloseSound();
+    }
+
+    size_t appended = 0;
+    while (appended < samples) {
+        if (cached_ != nullptr) {
+            size_t count = std::min(samples - appended, cached_->samples - cached_offset_);
+            pcm.insert(pcm.end(), cached_->pcm + cached_offset_, cached_->pcm + cached_offset_ + count);
+            cached_offset_ += count;
+            appended += count;
+            if (cached_offset_ >= cached_->samples) {
+                CloseSound();
+            }
+            continue;
+        }
+        if (pcm_offset_ < pcm_.size()) {
+            size_t count = std::min(samples - appended, pcm_.size() - pcm_offset_);
+            pcm.insert(pcm.end(), pcm_.begin() + pcm_offset_, pcm_.begin() + pcm_offset_ + count);
+            pcm_offset_ += count;
+            appended += count;
+            continue;
+        }
+        if (!reader_.is_open()) {
+            if (!OpenNextSound()) {
+                break;
+            }
+            continue;
+        }
+        if (!DecodeNextPacket()) {
+            // End of this sound, go on with the next one
+            if (recording_enabled_) {
+                AddCachedSound(current_, recording_);
+            }
+            CloseSound();
+        }
+    }
+    return appended;
+}
+
+bool SoundPlayer::OpenNextSound() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.empty()) {
+        active_ = false;
+        return false;
+    }
+    current_ = pending_.front();
+    pending_.pop_front();
+
+    cached_ = FindCachedSound(current_);
+    if (cached_ != nullptr) {
+        // Played from the cache, cached_ stands in for the open reader
+        cached_offset_ = 0;
+        return true;
+    }
+    reader_.Open(current_);
+    decoder_.Reset();
+    recording_enabled_ = true;
+    return true;
+}
+
+bool SoundPlayer::DecodeNextPacket() {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    if (!reader_.NextPacket(data, size)) {
+        return false;
+    }
+
+    pcm_.clear();
+    pcm_offset_ = 0;
+    if (!decoder_.Decode(data, size, reader_.sample_rate(), output_sample_rate_, pcm_)) {
+        // Skip the broken packet, the rest of the sound may still be fine
+        return true;
+    }
+    if (recording_enabled_) {
+        if (IsCacheable(recording_.size() + pcm_.size())) {
+            recording_.insert(recording_.end(), pcm_.begin(), pcm_.end());
+        } else {
+            recording_enabled_ = false;
+            std::vector<int16_t>().swap(recording_);
+        }
+    }
+    return true;
+}
+
+void SoundPlayer::CloseSound() {
+    reader_.Close();
+    cached_.reset();
+    cached_offset_ = 0;
+    pcm_.clear();
+    pcm_offset_ = 0;
+    current_ = std::string_view();
+    recording_enabled_ = false;
+    std::vector<int16_t>().swap(recording_);
+}
+
+bool SoundPlayer::IsCacheable(size_t samples) const {
+    return samples <= (size_t)output_sample_rate_ / 1000 * SOUND_CACHE_MAX_SOUND_MS &&
+        samples * sizeof(int16_t) <= SOUND_CACHE_MAX_BYTES;
+}
+
+// The caller holds mutex_
+std::shared_ptr<CachedSound> SoundPlayer::FindCachedSound(std::string_view ogg) {
+    for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+        if ((*it)->key == ogg.data() && (*it)->size == ogg.size()) {
+            auto sound = *it;
+            cache_.splice(cache_.begin(), cache_, it);
+            return sound;
+        }
+    }
+    return nullptr;
+}
+
+void SoundPlayer::AddCachedSound(std::string_view ogg, const std::vector<int16_t>& pcm) {
+    if (pcm.empty() || !IsCacheable(pcm.size())) {
+        return;
+    }
+
+    size_t bytes = pcm.size() * sizeof(int16_t);
+    auto sound = std::make_shared<CachedSound>();
+    sound->pcm = (int16_t*)HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemAudio, bytes);
+    if (sound->pcm == nullptr) {
+        ESP_LOGW(TAG, "No memory to cache sound (%u bytes)", bytes);
+        return;
+    }
+    memcpy(sound->pcm, pcm.data(), bytes);
+    sound->key = ogg.data();
+    sound->size = ogg.size();
+    sound->samples = pcm.size();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (FindCachedSound(ogg) != nullptr) {
+        return;
+    }
+    // Evict the least recently used sounds, the ones being played stay alive until they finish
+    while (!cache_.empty() && cache_bytes_ + bytes > SOUND_CACHE_MAX_BYTES) {
+        cache_bytes_ -= cache_.back()->samples * sizeof(int16_t);
+        cache_.pop_back();
+    }
+    cache_.push_front(sound);
+    cache_bytes_ += bytes;
+    ESP_LOGI(TAG, "Cached sound: %u samples, cache %u bytes", sound->samples, cache_bytes_);
+}
@@ -0,0 +1,119 @@
+#ifndef SOUND_PLAYER_H
+#define SOUND_PLAYER_H
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "ogg_reader.h"
+#include "resampler.h"
+
+#define MAX_PENDING_SOUNDS 16
+
+// Sounds up to this length are kept decoded after they have been played once
+#define SOUND_CACHE_MAX_SOUND_MS 1500
+#if CONFIG_SPIRAM
+#define SOUND_CACHE_MAX_BYTES (256 * 1024)
+#else
+#define SOUND_CACHE_MAX_BYTES (32 * 1024)
+#endif
+
+// Opus decoder for local sounds, resamples to the output sample rate
+class SoundDecoder {
+public:
+    ~SoundDecoder();
+
+    // Appends the PCM of one packet, returns false if it could not be decoded
+    bool Decode(const uint8_t* data, size_t size, int sample_rate, int output_sample_rate, std::vector<int16_t>& pcm);
+    void Reset();
+
+private:
+    void* decoder_ = nullptr;
+    int sample_rate_ = 0;
+    int output_sample_rate_ = 0;
+    int frame_size_ = 0;
+    std::unique_ptr<Resampler> resampler_;
+    std::vector<int16_t> frame_;
+
+    bool Open(int sample_rate, int output_sample_rate);
+    void Close();
+};
+
+// Decoded PCM of a short sound, kept in PSRAM where available
+struct CachedSound {
+    const char* key = nullptr;
+    size_t size = 0;
+    int16_t* pcm = nullptr;
+    size_t samples = 0;
+
+    ~CachedSound();
+};
+
+/*
+ * Streams local OGG sounds (PlaySound) on the decoder task.
+ *
+ * Play() only queues a reference to the sound, the data has to stay valid until it
+ * has been played, which holds for the embedded and memory mapped assets. Read() is
+ * called by the decoder task whenever it needs more PCM, it pulls the next packets
+ * straight out of the asset and decodes them with a decoder of its own, so the TTS
+ * decoder state is left untouched and the two can be mixed.
+ *
+ * Short sounds are decoded once and then played from an LRU cache of PCM at the output
+ * sample rate, either after they were first played or when preloaded with Preload().
+ */
+class SoundPlayer {
+public:
+    void Initialize(int output_sample_rate);
+
+    // Thread safe, sounds are played one after another
+    bool Play(std::string_view ogg);
+    // Thread safe, drops the current sound and everything queued so far
+    void Stop();
+    // Thread safe, drops the decoded sounds, which are keyed by the address of their data.
+    // Returns the bytes they held, a sound still playing frees its PCM when it ends.
+    size_t ClearCache();
+    // Decode a sound into the cache on the calling task
+    bool Preload(std::string_view ogg);
+    // Playing or queued
+    bool active() const { return active_; }
+
+    // Decoder task only: appends up to samples of mono PCM at the output sample rate,
+    // returns the number of samples appended
+    size_t Read(std::vector<int16_t>& pcm, size_t samples);
+
+private:
+    int output_sample_rate_ = 16000;
+    std::mutex mutex_;
+    std::deque<std::string_view> pending_;
+    std::atomic<bool> active_{false};
+    std::atomic<bool> stop_requested_{false};
+    // Most recently used first, guarded by mutex_
+    std::list<std::shared_ptr<CachedSound>> cache_;
+    size_t cache_bytes_ = 0;
+
+    // Owned by the decoder task
+    std::string_view current_;
+    OggReader reader_;
+    SoundDecoder decoder_;
+    std::shared_ptr<CachedSound> cached_;
+    size_t cached_offset_ = 0;
+    // Decoded samples not read yet
+    std::vector<int16_t> pcm_;
+    size_t pcm_offset_ = 0;
+    // PCM of the current sound so far, kept if it is short enough for the cache
+    std::vector<int16_t> recording_;
+    bool recording_enabled_ = false;
+
+    bool OpenNextSound();
+    bool DecodeNextPacket();
+    void CloseSound();
+    bool IsCacheable(size_t samples) const;
+    std::shared_ptr<CachedSound> FindCachedSound(std::string_view ogg);
+    void AddCachedSound(std::string_view ogg, const std::vector<int16_t>& pcm);
+};
+
+#endif // SOUND_PLAYER_H
@@ -0,0 +1,133 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/*
+ * Lock-free single-producer / single-consumer ring buffer.
+ *
+ * Push() may only be called by one task at a time and Pop() only by the consumer task.
+ * Head and tail are free-running counters, the slot index is the counter modulo N.
+ *
+ * Wakeups use direct task notifications instead of a shared condition variable:
+ * - Push() notifies the consumer task registered with SetConsumer()
+ * - Pop() notifies the producer task registered with SetProducer() when the ring was full,
+ *   and the one task currently blocked in WaitForPop(), if any
+ *
+ * Clear() may be called from any task. It does not touch the slots, it only marks everything
+ * pushed so far as discarded; the consumer drops those items on its next Pop(). Items pushed
+ * after Clear() are preserved.
+ *
+ * SetLimit() lowers the usable depth below N at runtime, full() and the producer wakeup follow it.
+ */
+template <typename T, size_t N>
+class SpscQueue {
+public:
+    static_assert(N > 0, "SpscQueue capacity must be positive");
+
+    void SetConsumer(TaskHandle_t task) { consumer_task_.store(task, std::memory_order_release); }
+    void SetProducer(TaskHandle_t task) { producer_task_.store(task, std::memory_order_release); }
+    void SetLimit(size_t limit) {
+        limit_.store(limit < 1 ? 1 : limit > N ? N : limit, std::memory_order_release);
+        Notify(producer_task_);
+    }
+
+    bool Push(T&& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        if (head - tail >= limit_.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        slots_[head % N] = std::move(item);
+        head_.store(head + 1, std::memory_order_release);
+        Notify(consumer_task_);
+        return true;
+    }
+
+    bool Pop(T& item) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        bool was_full = head - tail >= limit_.load(std::memory_order_relaxed);
+
+        // Drop the items discarded by Clear()
+        uint32_t discard = discard_.load(std::memory_order_acquire);
+        while (tail != head && (int32_t)(discard - tail) > 0) {
+            slots_[tail % N] = T();
+            tail++;
+        }
+
+        bool popped = false;
+        if (tail != head) {
+            item = std::move(slots_[tail % N]);
+            slots_[tail % N] = T();
+            tail++;
+            popped = true;
+        }
+        tail_.store(tail, std::memory_order_release);
+
+        if (was_full) {
+            Notify(producer_task_);
+        }
+        auto waiter = waiter_task_.exchange(nullptr, std::memory_order_acq_rel);
+        if (waiter != nullptr) {
+            xTaskNotifyGive(waiter);
+        }
+        return popped;
+    }
+
+    void Clear() {
+        discard_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+        Notify(consumer_task_);
+    }
+
+    // Block the calling task until the consumer pops an item, or the timeout elapses
+    void WaitForPop(TickType_t ticks) {
+        waiter_task_.store(xTaskGetCurrentTaskHandle(), std::memory_order_release);
+        ulTaskNotifyTake(pdTRUE, ticks);
+    }
+
+    size_t size() const {
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t discard = discard_.load(std::memory_order_acquire);
+        if ((int32_t)(discard - tail) > 0) {
+            tail = discard;
+        }
+        return head - tail;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    // Full from the producer's point of view, discarded items still hold their slots
+    bool full() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire) >=
+            limit_.load(std::memory_order_relaxed);
+    }
+
+    static constexpr size_t capacity() { return N; }
+
+private:
+    std::array<T, N> slots_;
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> discard_{0};
+    std::atomic<uint32_t> limit_{N};
+    std::atomic<TaskHandle_t> consumer_task_{nullptr};
+    std::atomic<TaskHandle_t> producer_task_{nullptr};
+    std::atomic<TaskHandle_t> waiter_task_{nullptr};
+
+    static void Notify(const std::atomic<TaskHandle_t>& task_handle) {
+        auto task = task_handle.load(std::memory_order_acquire);
+        if (task != nullptr) {
+            xTaskNotifyGive(task);
+        }
+    }
+};
+
+#endif // SPSC_QUEUE_H
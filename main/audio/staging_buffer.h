@@ -0,0 +1,106 @@
+#ifndef STAGING_BUFFER_H
+#define STAGING_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#include "audio_kernels.h"
+#include "heap_placement.h"
+
+// Room for the largest input frame (30 ms) plus a partial chunk, with headroom for a slow consumer
+#define STAGING_BUFFER_CHUNKS 4
+
+/*
+ * Fixed circular buffer that collects input frames of any size and hands them out again
+ * in chunks of the size the AFE / wakenet / multinet consumes.
+ *
+ * The capacity is a whole number of chunks and the read position only ever moves by one
+ * chunk, so Front() always points at a contiguous chunk and nothing is shifted; only the
+ * writes wrap around the end.
+ *
+ * When a write does not fit (the consumer fell behind, or stale input from a previous mode),
+ * the oldest whole chunks are dropped instead of growing the buffer.
+ *
+ * Not thread safe, the owners guard it with their input mutex.
+ */
+class StagingBuffer {
+public:
+    void Initialize(size_t chunk_size, size_t chunks) {
+        chunk_size_ = chunk_size;
+        buffer_.assign(chunk_size * std::max<size_t>(chunks, 2), 0);
+        Clear();
+    }
+
+    void Clear() {
+        read_ = 0;
+        size_ = 0;
+    }
+
+    // Returns the number of buffered samples dropped to make room
+    size_t Write(const int16_t* data, size_t samples) {
+        size_t dropped = MakeRoom(samples);
+        if (samples > buffer_.size()) {
+            data += samples - buffer_.size();
+            samples = buffer_.size();
+        }
+        size_t write = (read_ + size_) % buffer_.size();
+        size_t first = std::min(samples, buffer_.size() - write);
+        memcpy(buffer_.data() + write, data, first * sizeof(int16_t));
+        memcpy(buffer_.data(), data + first, (samples - first) * sizeof(int16_t));
+        size_ += samples;
+        return dropped;
+    }
+
+    // Same as Write() for one channel of interleaved frames
+    size_t WriteChannel(const int16_t* data, size_t frames, int channels, int channel) {
+        size_t dropped = MakeRoom(frames);
+        if (frames > buffer_.size()) {
+            data += (frames - buffer_.size()) * channels;
+            frames = buffer_.size();
+        }
+        size_t write = (read_ + size_) % buffer_.size();
+        size_t first = std::min(frames, buffer_.size() - write);
+        AudioKernels::ExtractChannel(data, buffer_.data() + write, first, channels, channel);
+        AudioKernels::ExtractChannel(data + first * channels, buffer_.data(), frames - first, channels, channel);
+        size_ += frames;
+        return dropped;
+    }
+
+    // The oldest full chunk, or nullptr if less than a chunk is buffered
+    int16_t* Front() {
+        return chunk_size_ > 0 && size_ >= chunk_size_ ? buffer_.data() + read_ : nullptr;
+    }
+
+    void Pop() {
+        read_ = (read_ + chunk_size_) % buffer_.size();
+        size_ -= chunk_size_;
+    }
+
+    size_t size() const { return size_; }
+    size_t chunk_size() const { return chunk_size_; }
+
+private:
+    PsramVector<int16_t, kHeapSubsystemAudio> buffer_;
+    size_t chunk_size_ = 0;
+    size_t read_ = 0;
+    size_t size_ = 0;
+
+    size_t MakeRoom(size_t samples) {
+        size_t dropped = 0;
+        while (size_ + samples > buffer_.size() && size_ >= chunk_size_) {
+            Pop();
+            dropped += chunk_size_;
+        }
+        if (size_ + samples > buffer_.size()) {
+            // Only a partial chunk left, which cannot be completed in order anyway
+            dropped += size_;
+            Clear();
+        }
+        return dropped;
+    }
+};
+
+#endif // STAGING_BUFFER_H
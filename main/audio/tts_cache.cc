@@ -0,0 +1,320 @@
+#include "tts_cache.h"
+#include "audio_service.h"
+#include "heap_placement.h"
+
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "TtsCache"
+
+#define TTS_CACHE_MAGIC 0x31435454  // "TTC1"
+#define TTS_CACHE_SECTOR_SIZE 4096
+#define TTS_CACHE_TASK_STACK_SIZE 4096
+
+static uint32_t AlignToSector(uint32_t size) {
+    return (size + TTS_CACHE_SECTOR_SIZE - 1) / TTS_CACHE_SECTOR_SIZE * TTS_CACHE_SECTOR_SIZE;
+}
+
+TtsCache::~TtsCache() {
+    StopPlayback();
+}
+
+bool TtsCache::IsValidHash(std::string_view hash) {
+    if (hash.empty() || hash.size() > TTS_CACHE_MAX_HASH_LENGTH) {
+        return false;
+    }
+    return std::all_of(hash.begin(), hash.end(), [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_';
+    });
+}
+
+bool TtsCache::Initialize() {
+    partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, TTS_CACHE_PARTITION_LABEL);
+    if (partition_ == nullptr) {
+        ESP_LOGI(TAG, "No %s partition, the TTS cache is disabled", TTS_CACHE_PARTITION_LABEL);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t used = 0;
+    uint32_t offset = 0;
+    while (offset + sizeof(EntryHeader) <= partition_->size) {
+        EntryHeader header;
+        if (esp_partition_read(partition_, offset, &header, sizeof(header)) != ESP_OK) {
+            break;
+        }
+        if (header.magic != TTS_CACHE_MAGIC || header.hash_length > TTS_CACHE_MAX_HASH_LENGTH ||
+            !IsValidHash(std::string_view(header.hash, header.hash_length)) ||
+            header.data_size > partition_->size - offset - sizeof(header)) {
+            offset += TTS_CACHE_SECTOR_SIZE;
+            continue;
+        }
+        Entry entry = {std::string(header.hash, header.hash_length), offset, (uint32_t)sizeof(header) + header.data_size, header.sequence};
+        // A rewritten response whose old entry was not overwritten yet, the newer one counts
+        auto it = Find(entry.hash);
+        if (it == entries_.end() || it->sequence < entry.sequence) {
+            if (it != entries_.end()) {
+                *it = entry;
+            } else {
+                entries_.push_back(entry);
+            }
+        }
+        if (header.sequence >= next_sequence_) {
+            next_sequence_ = header.sequence + 1;
+            write_offset_ = offset + AlignToSector(entry.size);
+        }
+        used += AlignToSector(entry.size);
+        offset += AlignToSector(entry.size);
+    }
+    if (write_offset_ >= partition_->size) {
+        write_offset_ = 0;
+    }
+    ESP_LOGI(TAG, "%u cached responses, %u of %lu bytes used", entries_.size(), used, partition_->size);
+    return true;
+}
+
+std::vector<TtsCache::Entry>::iterator TtsCache::Find(const std::string& hash) {
+    return std::find_if(entries_.begin(), entries_.end(), [&hash](const Entry& entry) {
+        return entry.hash == hash;
+    });
+}
+
+bool TtsCache::Contains(const std::string& hash) {
+    if (partition_ == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Find(hash) != entries_.end();
+}
+
+void TtsCache::BeginRecord(const std::string& hash) {
+    std::lock_guard<std::mutex> lock(record_mutex_);
+    recording_ = partition_ != nullptr && IsValidHash(hash);
+    record_hash_ = hash;
+    record_data_.clear();
+    record_sample_rate_ = 0;
+    record_frame_duration_ = 0;
+    record_next_sequence_ = 0;
+}
+
+void TtsCache::Record(const AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(record_mutex_);
+    if (!recording_) {
+        return;
+    }
+    const char* reason = nullptr;
+    if (record_sample_rate_ == 0) {
+        record_sample_rate_ = packet.sample_rate;
+        record_frame_duration_ = packet.frame_duration;
+    } else if (packet.sample_rate != record_sample_rate_ || packet.frame_duration != record_frame_duration_) {
+        reason = "the format changed";
+    }
+    // Transports without sequence numbers deliver in order or not at all
+    if (packet.lost_frames > 0 || (packet.sequence != 0 && record_next_sequence_ != 0 && packet.sequence != record_next_sequence_)) {
+        reason = "packets were lost";
+    }
+    if (record_data_.size() + 2 + packet.opus_size() > TTS_CACHE_MAX_ENTRY_BYTES) {
+        reason = "it is too long";
+    }
+    if (reason != nullptr) {
+        ESP_LOGW(TAG, "Not caching response %s, %s", record_hash_.c_str(), reason);
+        recording_ = false;
+        std::vector<uint8_t>().swap(record_data_);
+        return;
+    }
+    if (packet.sequence != 0) {
+        record_next_sequence_ = packet.sequence + 1;
+    }
+    size_t size = packet.opus_size();
+    auto data = (const uint8_t*)packet.payload.data() + packet.headroom;
+    record_data_.push_back(size & 0xFF);
+    record_data_.push_back(size >> 8);
+    record_data_.insert(record_data_.end(), data, data + size);
+}
+
+void TtsCache::EndRecord(bool commit) {
+    std::vector<uint8_t> data;
+    EntryHeader header = {};
+    {
+        std::lock_guard<std::mutex> lock(record_mutex_);
+        if (!recording_) {
+            return;
+        }
+        recording_ = false;
+        data.swap(record_data_);
+        header.magic = TTS_CACHE_MAGIC;
+        header.data_size = data.size();
+        header.sample_rate = record_sample_rate_;
+        header.frame_duration = record_frame_duration_;
+        header.hash_length = record_hash_.size();
+        memcpy(header.hash, record_hash_.data(), record_hash_.size());
+    }
+    if (!commit || data.empty()) {
+        return;
+    }
+    header.crc = esp_rom_crc32_le(0, data.data(), data.size());
+
+    // Erasing takes tens of milliseconds per sector, too long for the task that ends the response
+    struct WriteArgs {
+        TtsCache* cache;
+        EntryHeader header;
+        std::vector<uint8_t> data;
+    };
+    auto args = new WriteArgs{this, header, std::move(data)};
+    if (xTaskCreate([](void* arg) {
+        auto args = static_cast<WriteArgs*>(arg);
+        args->cache->WriteTask(args->header, std::move(args->data));
+        delete args;
+        vTaskDelete(NULL);
+    }, "tts_cache_write", TTS_CACHE_TASK_STACK_SIZE, args, 1, nullptr) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the write task");
+        delete args;
+    }
+}
+
+void TtsCache::WriteTask(EntryHeader header, std::vector<uint8_t> data) {
+    std::string hash(header.hash, header.hash_length);
+    if (Write(header, data)) {
+        ESP_LOGI(TAG, "Cached response %s, %u bytes", hash.c_str(), data.size());
+    } else {
+        ESP_LOGW(TAG, "Failed to cache response %s", hash.c_str());
+    }
+}
+
+bool TtsCache::Write(const EntryHeader& entry_header, const std::vector<uint8_t>& data) {
+    // The region is taken out of the index first and written without holding mutex_
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+    EntryHeader header = entry_header;
+    uint32_t size = sizeof(header) + data.size();
+    uint32_t total = AlignToSector(size);
+    if (total > partition_->size) {
+        return false;
+    }
+    uint32_t offset;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (write_offset_ + total > partition_->size) {
+            write_offset_ = 0;
+        }
+        offset = write_offset_;
+        write_offset_ += total;
+        header.sequence = next_sequence_++;
+        std::string hash(header.hash, header.hash_length);
+        entries_.erase(std::remove_if(entries_.begin(), entries_.end(), [offset, total, &hash](const Entry& entry) {
+            uint32_t end = entry.offset + AlignToSector(entry.size);
+            return entry.hash == hash || (entry.offset < offset + total && end > offset);
+        }), entries_.end());
+    }
+
+    // The header goes last, until then the entry does not exist
+    if (esp_partition_erase_range(partition_, offset, total) != ESP_OK ||
+        esp_partition_write(partition_, offset + sizeof(header), data.data(), data.size()) != ESP_OK ||
+        esp_partition_write(partition_, offset, &header, sizeof(header)) != ESP_OK) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_back({std::string(header.hash, header.hash_length), offset, size, header.sequence});
+    return true;
+}
+
+bool TtsCache::Play(const std::string& hash, AudioService& audio_service, std::function<void()> on_finished) {
+    if (partition_ == nullptr) {
+        return false;
+    }
+    EntryHeader header;
+    uint8_t* data = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = Find(hash);
+        if (it == entries_.end()) {
+            return false;
+        }
+        bool valid = esp_partition_read(partition_, it->offset, &header, sizeof(header)) == ESP_OK &&
+            header.magic == TTS_CACHE_MAGIC && sizeof(header) + header.data_size == it->size;
+        if (valid) {
+            data = (uint8_t*)HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemAudio, header.data_size);
+            if (data == nullptr) {
+                ESP_LOGE(TAG, "Failed to allocate %lu bytes for response %s", header.data_size, hash.c_str());
+                return false;
+            }
+            valid = esp_partition_read(partition_, it->offset + sizeof(header), data, header.data_size) == ESP_OK &&
+                esp_rom_crc32_le(0, data, header.data_size) == header.crc;
+        }
+        if (!valid) {
+            ESP_LOGW(TAG, "Cached response %s is corrupted, dropping it", hash.c_str());
+            entries_.erase(it);
+            HeapPlacement::Free(kHeapSubsystemAudio, data);
+            return false;
+        }
+    }
+
+    uint32_t generation = ++play_generation_;
+    playing_ = true;
+    struct PlayArgs {
+        TtsCache* cache;
+        uint32_t generation;
+        EntryHeader header;
+        uint8_t* data;
+        AudioService* audio_service;
+        std::function<void()> on_finished;
+    };
+    auto args = new PlayArgs{this, generation, header, data, &audio_service, std::move(on_finished)};
+    if (xTaskCreate([](void* arg) {
+        auto args = static_cast<PlayArgs*>(arg);
+        args->cache->PlayTask(args->generation, args->header, args->data, args->audio_service, std::move(args->on_finished));
+        delete args;
+        vTaskDelete(NULL);
+    }, "tts_cache_play", TTS_CACHE_TASK_STACK_SIZE, args, 3, nullptr) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the playback task");
+        HeapPlacement::Free(kHeapSubsystemAudio, data);
+        delete args;
+        playing_ = false;
+        return false;
+    }
+    ESP_LOGI(TAG, "Playing cached response %s, %lu bytes", hash.c_str(), header.data_size);
+    return true;
+}
+
+// The task of the stopped playback no longer clears playing_, its generation is gone
+void TtsCache::StopPlayback() {
+    play_generation_++;
+    playing_ = false;
+}
+
+void TtsCache::PlayTask(uint32_t generation, EntryHeader header, uint8_t* data, AudioService* audio_service,
+    std::function<void()> on_finished) {
+    size_t pos = 0;
+    while (pos + 2 <= header.data_size && play_generation_ == generation) {
+        size_t size = data[pos] | (data[pos + 1] << 8);
+        pos += 2;
+        if (size > header.data_size - pos) {
+            break;
+        }
+        auto packet = audio_service->AcquirePacket();
+        packet->sample_rate = header.sample_rate;
+        packet->frame_duration = header.frame_duration;
+        packet->timestamp = 0;
+        packet->sequence = 0;
+        packet->lost_frames = 0;
+        packet->headroom = 0;
+        packet->payload.assign(data + pos, data + pos + size);
+        pos += size;
+        // Waits while the decode queue is full, so this task runs about as far ahead as the queue is deep
+        if (!audio_service->PushPacketToDecodeQueue(std::move(packet), true)) {
+            break;
+        }
+    }
+    HeapPlacement::Free(kHeapSubsystemAudio, data);
+    if (play_generation_ == generation) {
+        playing_ = false;
+    }
+    if (on_finished) {
+        on_finished();
+    }
+}
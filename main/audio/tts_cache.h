@@ -0,0 +1,110 @@
+#ifndef TTS_CACHE_H
+#define TTS_CACHE_H
+
+#include <esp_partition.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define TTS_CACHE_PARTITION_LABEL "tts_cache"
+#define TTS_CACHE_MAX_HASH_LENGTH 64
+// A response is recorded in RAM up to this size, longer ones are not cached
+#define TTS_CACHE_MAX_ENTRY_BYTES (CONFIG_TTS_CACHE_MAX_ENTRY_KB * 1024)
+
+struct AudioStreamPacket;
+class AudioService;
+
+/*
+ * Content-addressed cache of TTS responses in the "tts_cache" data partition.
+ *
+ * The server tags a response it allows to be cached with a hash in the tts start message. On a
+ * miss the packets that arrive are recorded and written to flash when the response ends, on a
+ * hit Play() pushes the stored packets into the decode queue and the server is told it need not
+ * send the audio.
+ *
+ * The partition is a log of entries, each starting on a sector boundary with a header followed by
+ * the packets as |length 2u|opus data|. New entries go after the newest one and wrap around to
+ * the start, erasing the oldest ones they overwrite. The header is written last, so an entry cut
+ * short by a power loss is never found. Only the headers are read at boot, the data CRC is
+ * checked when an entry is played.
+ *
+ * Record() runs on the network task, flash writes and playback on short-lived tasks of their own.
+ */
+class TtsCache {
+public:
+    ~TtsCache();
+
+    // Scans the partition, false if there is none
+    bool Initialize();
+    bool available() const { return partition_ != nullptr; }
+    // 1 to TTS_CACHE_MAX_HASH_LENGTH ASCII letters, digits, '-' or '_'
+    static bool IsValidHash(std::string_view hash);
+    bool Contains(const std::string& hash);
+
+    // Starts recording the response with this hash, dropping one that was not ended
+    void BeginRecord(const std::string& hash);
+    // Packets in arrival order until EndRecord(), a gap in the sequence drops the recording
+    void Record(const AudioStreamPacket& packet);
+    // Writes the recorded response to flash unless commit is false
+    void EndRecord(bool commit);
+
+    // Reads and checks the entry, then queues its packets for decoding in the background.
+    // on_finished runs on that task once all are queued or StopPlayback() was called.
+    bool Play(const std::string& hash, AudioService& audio_service, std::function<void()> on_finished);
+    void StopPlayback();
+    bool playing() const { return playing_; }
+
+private:
+    struct EntryHeader {
+        uint32_t magic;
+        uint32_t sequence;
+        uint32_t data_size;
+        uint32_t crc;
+        uint32_t sample_rate;
+        uint16_t frame_duration;
+        uint16_t hash_length;
+        char hash[TTS_CACHE_MAX_HASH_LENGTH];
+    };
+
+    struct Entry {
+        std::string hash;
+        uint32_t offset;
+        uint32_t size;      // Header and data
+        uint32_t sequence;
+    };
+
+    const esp_partition_t* partition_ = nullptr;
+
+    // Guards the index and the write offset, write_mutex_ keeps one write at a time
+    std::mutex mutex_;
+    std::mutex write_mutex_;
+    std::vector<Entry> entries_;
+    uint32_t write_offset_ = 0;
+    uint32_t next_sequence_ = 1;
+
+    // Owned by the network task between BeginRecord() and EndRecord()
+    std::mutex record_mutex_;
+    bool recording_ = false;
+    std::string record_hash_;
+    std::vector<uint8_t> record_data_;
+    int record_sample_rate_ = 0;
+    int record_frame_duration_ = 0;
+    uint32_t record_next_sequence_ = 0;
+
+    std::atomic<bool> playing_{false};
+    std::atomic<uint32_t> play_generation_{0};
+
+    std::vector<Entry>::iterator Find(const std::string& hash);
+    bool Write(const EntryHeader& header, const std::vector<uint8_t>& data);
+    void WriteTask(EntryHeader header, std::vector<uint8_t> data);
+    void PlayTask(uint32_t generation, EntryHeader header, uint8_t* data, AudioService* audio_service,
+        std::function<void()> on_finished);
+};
+
+#endif // TTS_CACHE_H
@@ -0,0 +1,403 @@
+#include "voice_memo.h"
+#include "audio_service.h"
+#include "board.h"
+#include "system_info.h"
+#include "heap_placement.h"
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "VoiceMemo"
+
+#define VOICE_MEMO_MAGIC 0x314D4D56  // "VMM1"
+#define VOICE_MEMO_SECTOR_PAYLOAD (VOICE_MEMO_SECTOR_SIZE - sizeof(SectorHeader))
+#define VOICE_MEMO_WRITER_STACK_SIZE 4096
+#define VOICE_MEMO_UPLOAD_STACK_SIZE (4096 + 2048)
+
+static uint8_t* AllocateSector() {
+    auto data = (uint8_t*)HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemAudio, VOICE_MEMO_SECTOR_SIZE);
+    return data;
+}
+
+VoiceMemoStore::~VoiceMemoStore() {
+    End();
+    std::unique_lock<std::mutex> lock(mutex_);
+    writer_idle_cv_.wait(lock, [this]() { return !writer_running_; });
+}
+
+bool VoiceMemoStore::Initialize() {
+    partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, VOICE_MEMO_PARTITION_LABEL);
+    if (partition_ == nullptr) {
+        ESP_LOGI(TAG, "No %s partition, voice memos are disabled", VOICE_MEMO_PARTITION_LABEL);
+        return false;
+    }
+    sector_count_ = partition_->size / VOICE_MEMO_SECTOR_SIZE;
+
+    struct ScannedSector {
+        uint32_t index;
+        SectorHeader header;
+    };
+    std::vector<ScannedSector> sectors;
+    for (uint32_t i = 0; i < sector_count_; i++) {
+        SectorHeader header;
+        if (esp_partition_read(partition_, SectorOffset(i), &header, sizeof(header)) != ESP_OK) {
+            break;
+        }
+        if (header.magic == VOICE_MEMO_MAGIC && header.used <= VOICE_MEMO_SECTOR_PAYLOAD) {
+            sectors.push_back({i, header});
+        }
+    }
+    std::sort(sectors.begin(), sectors.end(), [](const ScannedSector& a, const ScannedSector& b) {
+        return a.header.sequence < b.header.sequence;
+    });
+
+    // Oldest first. The tail of a memo whose first sector was overwritten is of no use
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& sector : sectors) {
+        auto& header = sector.header;
+        if (!(header.flags & kSectorFlagFirst)) {
+            memos_.push_back({header.memo_id, sector.index, 1, header.used, !(header.flags & kSectorFlagLast),
+                !(header.flags & kSectorFlagUploaded)});
+        } else if (!memos_.empty() && memos_.back().id == header.memo_id && !memos_.back().complete &&
+                   (memos_.back().first_sector + memos_.back().sectors) % sector_count_ == sector.index) {
+            memos_.back().sectors++;
+            memos_.back().bytes += header.used;
+            memos_.back().complete = !(header.flags & kSectorFlagLast);
+        }
+        next_sequence_ = header.sequence + 1;
+        next_memo_id_ = header.memo_id + 1;
+        write_sector_ = (sector.index + 1) % sector_count_;
+    }
+    // Nothing records across a reboot, a memo cut off by it ends where it was cut
+    size_t pending = 0;
+    for (auto& memo : memos_) {
+        memo.complete = true;
+        pending += memo.uploaded ? 0 : 1;
+    }
+    if (next_memo_id_ == 0) {
+        next_memo_id_ = 1;
+    }
+    ESP_LOGI(TAG, "%u voice memos, %u not uploaded, %lu sectors", memos_.size(), pending, sector_count_);
+    return true;
+}
+
+bool VoiceMemoStore::Begin(int sample_rate) {
+    if (partition_ == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(record_mutex_);
+    if (recording_) {
+        return false;
+    }
+    sector_ = AllocateSector();
+    if (sector_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the sector buffer");
+        return false;
+    }
+    sector_used_ = 0;
+    {
+        std::lock_guard<std::mutex> memo_lock(mutex_);
+        record_memo_id_ = next_memo_id_++;
+        if (next_memo_id_ == 0) {
+            next_memo_id_ = 1;
+        }
+    }
+    record_first_ = true;
+    record_bytes_ = 0;
+    record_full_ = false;
+    recorded_ms_ = 0;
+    ogg_writer_.Begin(esp_random(), sample_rate, [this](const uint8_t* data, size_t size) {
+        AddToSector(data, size);
+    });
+    recording_ = true;
+    ESP_LOGI(TAG, "Recording voice memo %u", record_memo_id_);
+    return true;
+}
+
+void VoiceMemoStore::Append(const AudioStreamPacket& packet) {
+    std::lock_guard<std::mutex> lock(record_mutex_);
+    // DTX may leave nothing to store, an empty packet is not valid Ogg Opus
+    if (!recording_ || packet.opus_size() == 0) {
+        return;
+    }
+    // Room for the pages still open and the last sector
+    if (record_bytes_ + packet.opus_size() + 2 * VOICE_MEMO_SECTOR_SIZE > partition_->size) {
+        if (!record_full_) {
+            ESP_LOGW(TAG, "Memo %u fills the partition, the rest is not recorded", record_memo_id_);
+            record_full_ = true;
+        }
+        return;
+    }
+    ogg_writer_.AddPacket(packet.opus_data(), packet.opus_size(), packet.frame_duration);
+    recorded_ms_ = ogg_writer_.duration_ms();
+}
+
+void VoiceMemoStore::End() {
+    std::lock_guard<std::mutex> lock(record_mutex_);
+    if (!recording_) {
+        return;
+    }
+    ogg_writer_.Finish();
+    QueueSector(true);
+    recording_ = false;
+    ESP_LOGI(TAG, "Voice memo %u ended, %lld ms", record_memo_id_, recorded_ms_.load());
+}
+
+void VoiceMemoStore::AddToSector(const uint8_t* data, size_t size) {
+    record_bytes_ += size;
+    while (size > 0) {
+        if (sector_ == nullptr) {
+            // A sector could not be allocated, the memo goes on once one can
+            sector_ = AllocateSector();
+            sector_used_ = 0;
+            if (sector_ == nullptr) {
+                return;
+            }
+        }
+        size_t n = std::min(size, VOICE_MEMO_SECTOR_PAYLOAD - sector_used_);
+        memcpy(sector_ + sizeof(SectorHeader) + sector_used_, data, n);
+        sector_used_ += n;
+        data += n;
+        size -= n;
+        if (sector_used_ == VOICE_MEMO_SECTOR_PAYLOAD) {
+            QueueSector(false);
+            sector_ = AllocateSector();
+            sector_used_ = 0;
+        }
+    }
+}
+
+void VoiceMemoStore::QueueSector(bool last) {
+    if (sector_ == nullptr) {
+        return;
+    }
+    uint16_t flags = 0xFFFF;
+    if (record_first_) {
+        flags &= ~kSectorFlagFirst;
+    }
+    if (last) {
+        flags &= ~kSectorFlagLast;
+    }
+    PendingSector sector = {record_memo_id_, flags, (uint16_t)sector_used_, sector_};
+    sector_ = nullptr;
+    sector_used_ = 0;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The last sector is always kept, it ends the memo
+    if (pending_.size() >= VOICE_MEMO_MAX_PENDING_SECTORS && !last) {
+        // The flash fell behind, the Ogg stream resyncs on the next page
+        ESP_LOGW(TAG, "Writer behind, dropping a sector of memo %u", record_memo_id_);
+        HeapPlacement::Free(kHeapSubsystemAudio, sector.data);
+        return;
+    }
+    record_first_ = false;
+    pending_.push_back(sector);
+    if (writer_running_) {
+        return;
+    }
+    writer_running_ = true;
+    if (xTaskCreate([](void* arg) {
+        static_cast<VoiceMemoStore*>(arg)->WriterTask();
+        vTaskDelete(NULL);
+    }, "voice_memo_write", VOICE_MEMO_WRITER_STACK_SIZE, this, 1, nullptr) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the writer task");
+        for (auto& pending : pending_) {
+            HeapPlacement::Free(kHeapSubsystemAudio, pending.data);
+        }
+        pending_.clear();
+        writer_running_ = false;
+    }
+}
+
+void VoiceMemoStore::WriterTask() {
+    while (true) {
+        PendingSector sector;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.empty()) {
+                writer_running_ = false;
+                writer_idle_cv_.notify_all();
+                return;
+            }
+            sector = pending_.front();
+            pending_.pop_front();
+        }
+        if (!WriteSector(sector)) {
+            ESP_LOGE(TAG, "Failed to write a sector of memo %u", sector.memo_id);
+        }
+        HeapPlacement::Free(kHeapSubsystemAudio, sector.data);
+    }
+}
+
+bool VoiceMemoStore::WriteSector(const PendingSector& sector) {
+    uint32_t index;
+    SectorHeader header = {VOICE_MEMO_MAGIC, 0, sector.memo_id, sector.used, sector.flags, 0xFFFF};
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        index = write_sector_;
+        if (!memos_.empty()) {
+            auto& oldest = memos_.front();
+            if ((index + sector_count_ - oldest.first_sector) % sector_count_ < oldest.sectors) {
+                // Only if sectors of the memo were dropped while the writer fell behind
+                if (oldest.id == sector.memo_id) {
+                    oldest.complete = !(sector.flags & kSectorFlagLast);
+                    return true;
+                }
+                if (!oldest.uploaded) {
+                    ESP_LOGW(TAG, "Overwriting voice memo %u before it was uploaded", oldest.id);
+                }
+                memos_.pop_front();
+            }
+        }
+        header.sequence = next_sequence_++;
+        write_sector_ = (index + 1) % sector_count_;
+    }
+
+    // The header goes last, a sector cut off by a power loss is not found at boot
+    memcpy(sector.data, &header, sizeof(header));
+    uint32_t offset = SectorOffset(index);
+    if (esp_partition_erase_range(partition_, offset, VOICE_MEMO_SECTOR_SIZE) != ESP_OK ||
+        esp_partition_write(partition_, offset + sizeof(header), sector.data + sizeof(header), sector.used) != ESP_OK ||
+        esp_partition_write(partition_, offset, &header, sizeof(header)) != ESP_OK) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool last = !(sector.flags & kSectorFlagLast);
+    if (!(sector.flags & kSectorFlagFirst)) {
+        memos_.push_back({sector.memo_id, index, 1, sector.used, last, false});
+    } else if (!memos_.empty() && memos_.back().id == sector.memo_id) {
+        memos_.back().sectors++;
+        memos_.back().bytes += sector.used;
+        memos_.back().complete = last;
+    }
+    return true;
+}
+
+bool VoiceMemoStore::StartUpload(const std::string& url) {
+    if (partition_ == nullptr || url.empty() || uploading_) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (std::none_of(memos_.begin(), memos_.end(), [](const Memo& memo) { return memo.complete && !memo.uploaded; })) {
+            return false;
+        }
+    }
+
+    struct UploadArgs {
+        VoiceMemoStore* store;
+        std::string url;
+    };
+    uploading_ = true;
+    auto args = new UploadArgs{this, url};
+    if (xTaskCreate([](void* arg) {
+        auto args = static_cast<UploadArgs*>(arg);
+        args->store->UploadTask(std::move(args->url));
+        delete args;
+        vTaskDelete(NULL);
+    }, "voice_memo_upload", VOICE_MEMO_UPLOAD_STACK_SIZE, args, 1, nullptr) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the upload task");
+        delete args;
+        uploading_ = false;
+        return false;
+    }
+    return true;
+}
+
+void VoiceMemoStore::UploadTask(std::string url) {
+    // One batch, oldest first, a failure leaves the rest for the next one
+    size_t uploaded = 0;
+    while (true) {
+        Memo memo;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = std::find_if(memos_.begin(), memos_.end(), [](const Memo& memo) { return memo.complete && !memo.uploaded; });
+            if (it == memos_.end()) {
+                break;
+            }
+            memo = *it;
+        }
+        if (!UploadMemo(memo, url)) {
+            break;
+        }
+        uploaded++;
+
+        // Clearing a bit needs no erase
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::find_if(memos_.begin(), memos_.end(), [&memo](const Memo& m) {
+            return m.id == memo.id && m.first_sector == memo.first_sector;
+        });
+        if (it == memos_.end()) {
+            continue;
+        }
+        it->uploaded = true;
+        SectorHeader header;
+        uint32_t offset = SectorOffset(memo.first_sector);
+        if (esp_partition_read(partition_, offset, &header, sizeof(header)) == ESP_OK) {
+            header.flags &= ~kSectorFlagUploaded;
+            esp_partition_write(partition_, offset + offsetof(SectorHeader, flags), &header.flags, sizeof(header.flags));
+        }
+    }
+    ESP_LOGI(TAG, "Uploaded %u voice memos", uploaded);
+    uploading_ = false;
+}
+
+bool VoiceMemoStore::UploadMemo(const Memo& memo, const std::string& url) {
+    uint8_t* buffer = AllocateSector();
+    if (buffer == nullptr) {
+        return false;
+    }
+
+    auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
+    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+    http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+    http->SetHeader("Memo-Id", std::to_string(memo.id));
+    http->SetHeader("Content-Type", "audio/ogg");
+    http->SetHeader("Transfer-Encoding", "chunked");
+    bool ok = http->Open("POST", url);
+    for (uint32_t i = 0; ok && i < memo.sectors; i++) {
+        uint32_t index = (memo.first_sector + i) % sector_count_;
+        auto header = reinterpret_cast<SectorHeader*>(buffer);
+        // The writer may have come round to the memo meanwhile
+        ok = esp_partition_read(partition_, SectorOffset(index), buffer, VOICE_MEMO_SECTOR_SIZE) == ESP_OK &&
+            header->magic == VOICE_MEMO_MAGIC && header->memo_id == memo.id && header->used <= VOICE_MEMO_SECTOR_PAYLOAD;
+        if (ok) {
+            ok = http->Write((const char*)buffer + sizeof(SectorHeader), header->used) >= 0;
+        }
+    }
+    HeapPlacement::Free(kHeapSubsystemAudio, buffer);
+    if (ok) {
+        http->Write("", 0);
+        ok = http->GetStatusCode() == 200;
+    }
+    http->Close();
+    if (!ok) {
+        ESP_LOGW(TAG, "Failed to upload voice memo %u", memo.id);
+        return false;
+    }
+    ESP_LOGI(TAG, "Uploaded voice memo %u, %lu bytes", memo.id, memo.bytes);
+    return true;
+}
+
+VoiceMemoStatus VoiceMemoStore::GetStatus() {
+    VoiceMemoStatus status;
+    status.available = partition_ != nullptr;
+    status.recording = recording_;
+    status.uploading = uploading_;
+    if (partition_ == nullptr) {
+        return status;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    status.memos = memos_.size();
+    for (auto& memo : memos_) {
+        status.pending += memo.uploaded ? 0 : 1;
+        status.used_bytes += memo.sectors * VOICE_MEMO_SECTOR_SIZE;
+    }
+    status.capacity_bytes = partition_->size;
+    return status;
+}
@@ -0,0 +1,144 @@
+#ifndef VOICE_MEMO_H
+#define VOICE_MEMO_H
+
+#include <esp_partition.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ogg_writer.h"
+
+#define VOICE_MEMO_PARTITION_LABEL "voice_memo"
+#define VOICE_MEMO_SECTOR_SIZE 4096
+// Full sectors waiting for the writer task, about 16 seconds at the memo bitrate
+#define VOICE_MEMO_MAX_PENDING_SECTORS 8
+// How often the memos waiting are offered for upload, and the network quality score it takes
+#define VOICE_MEMO_UPLOAD_INTERVAL_S 30
+#define VOICE_MEMO_UPLOAD_MIN_SCORE 70
+
+struct AudioStreamPacket;
+
+struct VoiceMemoStatus {
+    bool available = false;
+    bool recording = false;
+    bool uploading = false;
+    size_t memos = 0;
+    // Recorded but not uploaded yet
+    size_t pending = 0;
+    size_t used_bytes = 0;
+    size_t capacity_bytes = 0;
+};
+
+/*
+ * Voice memos recorded as Ogg Opus into the "voice_memo" data partition and uploaded later.
+ *
+ * The partition is a ring of sectors, each starting with a small header followed by the Ogg
+ * bytes of one memo, so a memo is a run of consecutive sectors. Sectors are only ever written
+ * whole, in order around the ring, and each is erased right before it is written again: every
+ * sector wears the same and a power loss costs no more than the sector being filled. When the
+ * ring is full the oldest memo is overwritten. At boot the memos are rebuilt from the headers.
+ *
+ * Append() runs on the encoder task and only copies into the sector being filled, full sectors
+ * go to a writer task of their own. An uploaded memo is marked by clearing a flag in its first
+ * header, which needs no erase.
+ *
+ * The same log can hold any uplink audio, e.g. utterances recorded while the network is down.
+ */
+class VoiceMemoStore {
+public:
+    ~VoiceMemoStore();
+
+    // Scans the partition, false if there is none
+    bool Initialize();
+    bool available() const { return partition_ != nullptr; }
+
+    // Starts a new memo of Opus packets at sample_rate, one at a time
+    bool Begin(int sample_rate);
+    void Append(const AudioStreamPacket& packet);
+    // Closes the Ogg stream and queues its last sector
+    void End();
+    bool recording() const { return recording_; }
+    int64_t recorded_ms() const { return recorded_ms_; }
+
+    // Posts the memos not uploaded yet to url one after another on a task of its own,
+    // false if there is nothing to do or an upload is still running
+    bool StartUpload(const std::string& url);
+    VoiceMemoStatus GetStatus();
+
+private:
+    struct SectorHeader {
+        uint32_t magic;
+        uint32_t sequence;
+        uint16_t memo_id;
+        uint16_t used;      // Ogg bytes after the header
+        uint16_t flags;     // Bits are cleared, never set, see kSectorFlag*
+        uint16_t reserved;
+    };
+
+    // Cleared flag bits
+    enum SectorFlag : uint16_t {
+        kSectorFlagFirst = 1 << 0,
+        kSectorFlagLast = 1 << 1,
+        kSectorFlagUploaded = 1 << 2,
+    };
+
+    struct Memo {
+        uint16_t id;
+        uint32_t first_sector;
+        uint32_t sectors;
+        uint32_t bytes;
+        bool complete;
+        bool uploaded;
+    };
+
+    // A sector filled by the recording side, data is freed by the writer task
+    struct PendingSector {
+        uint16_t memo_id;
+        uint16_t flags;
+        uint16_t used;
+        uint8_t* data;
+    };
+
+    const esp_partition_t* partition_ = nullptr;
+    uint32_t sector_count_ = 0;
+
+    // Guards the memo list, the write position and the pending sectors
+    std::mutex mutex_;
+    std::deque<Memo> memos_;
+    uint32_t write_sector_ = 0;
+    uint32_t next_sequence_ = 1;
+    uint16_t next_memo_id_ = 1;
+    std::deque<PendingSector> pending_;
+    bool writer_running_ = false;
+    std::condition_variable writer_idle_cv_;
+    std::atomic<bool> uploading_{false};
+
+    // Owned by the recording side between Begin() and End()
+    std::mutex record_mutex_;
+    std::atomic<bool> recording_{false};
+    std::atomic<int64_t> recorded_ms_{0};
+    uint16_t record_memo_id_ = 0;
+    bool record_first_ = true;
+    uint8_t* sector_ = nullptr;
+    size_t sector_used_ = 0;
+    // Ogg bytes of the memo so far, it stops growing before it would overwrite its own start
+    size_t record_bytes_ = 0;
+    bool record_full_ = false;
+    OggWriter ogg_writer_;
+
+    void AddToSector(const uint8_t* data, size_t size);
+    void QueueSector(bool last);
+    void WriterTask();
+    bool WriteSector(const PendingSector& sector);
+    void UploadTask(std::string url);
+    bool UploadMemo(const Memo& memo, const std::string& url);
+    uint32_t SectorOffset(uint32_t sector) const { return sector * VOICE_MEMO_SECTOR_SIZE; }
+};
+
+#endif // VOICE_MEMO_H
@@ -7,6 +7,16 @@
 
 #include <model_path.h>
 #include "audio_codec.h"
+#include "settings.h"
+#include "heap_placement.h"
+
+struct WakeWordModelInfo {
+    std::string name;
+    std::string words;          // Separated by ';'
+    float threshold = 0;        // 0 while the model default is used
+    uint32_t detections = 0;
+    int64_t last_detection_us = 0;
+};
 
 class WakeWord {
 public:
@@ -15,12 +25,29 @@ public:
     virtual bool Initialize(AudioCodec* codec, srmodel_list_t* models_list) = 0;
     virtual void Feed(const std::vector<int16_t>& data) = 0;
     virtual void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) = 0;
+    // Offline commands mapped to an MCP tool, arguments is a JSON object. Not every engine has them.
+    virtual void OnCommandDetected(std::function<void(const std::string& tool, const std::string& arguments)> callback) {}
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual size_t GetFeedSize() = 0;
     virtual void EncodeWakeWordData() = 0;
-    virtual bool GetWakeWordOpus(std::vector<uint8_t>& opus) = 0;
+    virtual bool GetWakeWordOpus(PsramVector<uint8_t, kHeapSubsystemAudio>& opus) = 0;
     virtual const std::string& GetLastDetectedWakeWord() const = 0;
+    // The models running side by side, indexed like SetModelThreshold()
+    virtual std::vector<WakeWordModelInfo> GetModels() { return {}; }
+    // Detection threshold of one model, kept in the settings across reboots
+    virtual bool SetModelThreshold(int model, float threshold) { return false; }
+
+protected:
+    // Saved thresholds are percents, 0 if none was set
+    static float LoadModelThreshold(int model) {
+        Settings settings("wake_word");
+        return settings.GetInt("threshold_" + std::to_string(model), 0) / 100.0f;
+    }
+    static void SaveModelThreshold(int model, float threshold) {
+        Settings settings("wake_word", true);
+        settings.SetInt("threshold_" + std::to_string(model), (int)(threshold * 100 + 0.5f));
+    }
 };
 
 #endif
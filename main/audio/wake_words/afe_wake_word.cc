@@ -1,33 +1,28 @@
 #include "afe_wake_word.h"
 #include "audio_service.h"
+#include "task_factory.h"
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
 #include <sstream>
+#include <algorithm>
 
 #define DETECTION_RUNNING_EVENT 1
 
 #define TAG "AfeWakeWord"
 
-AfeWakeWord::AfeWakeWord()
+AfeWakeWord::AfeWakeWord(std::shared_ptr<AfeFrontEnd> front_end)
     : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
+      front_end_(front_end) {
 
     event_group_ = xEventGroupCreate();
 }
 
 AfeWakeWord::~AfeWakeWord() {
-    if (afe_data_ != nullptr) {
+    if (afe_data_ != nullptr && front_end_ == nullptr) {
         afe_iface_->destroy(afe_data_);
     }
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
-    }
-
-    if (wake_word_encode_task_buffer_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_buffer_);
-    }
-
     if (models_ != nullptr) {
         esp_srmodel_deinit(models_);
     }
@@ -37,7 +32,6 @@ AfeWakeWord::~AfeWakeWord() {
 
 bool AfeWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
     codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
 
     if (models_list == nullptr) {
         models_ = esp_srmodel_init("model");
@@ -51,78 +45,172 @@ bool AfeWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
     }
     for (int i = 0; i < models_->num; i++) {
         ESP_LOGI(TAG, "Model %d: %s", i, models_->model_name[i]);
-        if (strstr(models_->model_name[i], ESP_WN_PREFIX) != NULL) {
-            wakenet_model_ = models_->model_name[i];
-            auto words = esp_srmodel_get_wake_words(models_, wakenet_model_);
-            // split by ";" to get all wake words
-            std::stringstream ss(words);
-            std::string word;
-            while (std::getline(ss, word, ';')) {
-                wake_words_.push_back(word);
-            }
+        if (strstr(models_->model_name[i], ESP_WN_PREFIX) == NULL) {
+            continue;
+        }
+        if (wakenet_models_.size() == 2) {
+            ESP_LOGW(TAG, "The AFE runs two wakenet models, %s is not used", models_->model_name[i]);
+            continue;
+        }
+        char* model_name = models_->model_name[i];
+        wakenet_models_.push_back(model_name);
+        auto words = esp_srmodel_get_wake_words(models_, model_name);
+        WakeWordModelInfo info;
+        info.name = model_name;
+        info.words = words;
+        models_info_.push_back(info);
+        // split by ";" to get all wake words
+        std::vector<std::string> model_words;
+        std::stringstream ss(words);
+        std::string word;
+        while (std::getline(ss, word, ';')) {
+            model_words.push_back(word);
         }
+        wake_words_.push_back(std::move(model_words));
     }
 
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
+#if CONFIG_SEND_WAKE_WORD_DATA
+    preroll_.Initialize();
+#endif
+
+    if (front_end_ != nullptr) {
+        if (!front_end_->Initialize(codec_, models_)) {
+            return false;
+        }
+        afe_iface_ = front_end_->afe_iface();
+        afe_data_ = front_end_->afe_data();
+        front_end_->OnFetch(kAfeConsumerWakeWord, [this](afe_fetch_result_t* res) {
+            ProcessFetchResult(res);
+        });
+        LoadThresholds();
+        return true;
     }
+
+    std::string input_format = codec_->GetInputFormat();
     afe_config_t* afe_config = afe_config_init(input_format.c_str(), models_, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
     afe_config->aec_init = codec_->input_reference();
     afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
     afe_config->afe_perferred_core = 1;
     afe_config->afe_perferred_priority = 1;
     afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+    if (!wakenet_models_.empty()) {
+        afe_config->wakenet_model_name = wakenet_models_[0];
+        afe_config->wakenet_model_name_2 = wakenet_models_.size() > 1 ? wakenet_models_[1] : nullptr;
+    }
     
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
+    LoadThresholds();
+    input_buffer_.Initialize(afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels(), STAGING_BUFFER_CHUNKS);
+    cpu_cost_.Initialize("Wake word", input_format);
 
-    xTaskCreate([](void* arg) {
-        auto this_ = (AfeWakeWord*)arg;
-        this_->AudioDetectionTask();
-        vTaskDelete(NULL);
-    }, "audio_detection", 4096, this, 3, nullptr);
+    TaskFactory::Create("audio_detection", 4096, 3, kTaskStackPsram, [this]() {
+        AudioDetectionTask();
+    });
 
     return true;
 }
 
+void AfeWakeWord::LoadThresholds() {
+    for (int i = 0; i < (int)models_info_.size(); i++) {
+        float threshold = LoadModelThreshold(i);
+        if (threshold > 0) {
+            SetModelThreshold(i, threshold);
+        }
+    }
+}
+
+void AfeWakeWord::ApplyThresholds() {
+    auto afe_data = front_end_->afe_data();
+    if (afe_data == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    for (int i = 0; i < (int)models_info_.size(); i++) {
+        if (models_info_[i].threshold > 0) {
+            front_end_->afe_iface()->set_wakenet_threshold(afe_data, i + 1, models_info_[i].threshold);
+        }
+    }
+}
+
+std::vector<WakeWordModelInfo> AfeWakeWord::GetModels() {
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    return models_info_;
+}
+
+bool AfeWakeWord::SetModelThreshold(int model, float threshold) {
+    // The shared front end owns the AFE, whichever consumer created it
+    auto afe_iface = front_end_ != nullptr ? front_end_->afe_iface() : afe_iface_;
+    auto afe_data = front_end_ != nullptr ? front_end_->afe_data() : afe_data_;
+    if (afe_data == nullptr || model < 0 || model >= (int)models_info_.size()) {
+        return false;
+    }
+    // The AFE numbers its wakenet models from 1. The shared one refuses while WakeNet is off,
+    // the threshold is kept and set by Start().
+    if (afe_iface->set_wakenet_threshold(afe_data, model + 1, threshold) < 0 && front_end_ == nullptr) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(models_mutex_);
+    if (models_info_[model].threshold != threshold) {
+        models_info_[model].threshold = threshold;
+        SaveModelThreshold(model, threshold);
+    }
+    ESP_LOGI(TAG, "Wake word(%s) threshold %.2f", models_info_[model].name.c_str(), threshold);
+    return true;
+}
+
 void AfeWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
     wake_word_detected_callback_ = callback;
 }
 
 void AfeWakeWord::Start() {
+    preroll_.Clear();
+    if (front_end_ != nullptr) {
+        front_end_->Start(kAfeConsumerWakeWord);
+        ApplyThresholds();
+        return;
+    }
     xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
 }
 
 void AfeWakeWord::Stop() {
+    if (front_end_ != nullptr) {
+        front_end_->Stop(kAfeConsumerWakeWord);
+        return;
+    }
     xEventGroupClearBits(event_group_, DETECTION_RUNNING_EVENT);
 
     std::lock_guard<std::mutex> lock(input_buffer_mutex_);
     if (afe_data_ != nullptr) {
         afe_iface_->reset_buffer(afe_data_);
     }
-    input_buffer_.clear();
+    input_buffer_.Clear();
 }
 
 void AfeWakeWord::Feed(const std::vector<int16_t>& data) {
     if (afe_data_ == nullptr) {
         return;
     }
+    if (front_end_ != nullptr) {
+        front_end_->Feed(kAfeConsumerWakeWord, data);
+        return;
+    }
 
     std::lock_guard<std::mutex> lock(input_buffer_mutex_);
     // Check running state inside lock to avoid TOCTOU race with Stop()
     if (!(xEventGroupGetBits(event_group_) & DETECTION_RUNNING_EVENT)) {
         return;
     }
-    input_buffer_.insert(input_buffer_.end(), data.begin(), data.end());
-    size_t chunk_size = afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
-    while (input_buffer_.size() >= chunk_size) {
-        afe_iface_->feed(afe_data_, input_buffer_.data());
-        input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + chunk_size);
+    size_t dropped = input_buffer_.Write(data.data(), data.size());
+    if (dropped > 0) {
+        ESP_LOGW(TAG, "Input staging buffer overflow, dropped %u samples", dropped);
     }
+    int64_t feed_start = esp_timer_get_time();
+    while (auto chunk = input_buffer_.Front()) {
+        afe_iface_->feed(afe_data_, chunk);
+        input_buffer_.Pop();
+    }
+    cpu_cost_.AddFeed(esp_timer_get_time() - feed_start);
 }
 
 size_t AfeWakeWord::GetFeedSize() {
@@ -146,118 +234,47 @@ void AfeWakeWord::AudioDetectionTask() {
             continue;;
         }
 
-        // Store the wake word data for voice recognition, like who is speaking
-        StoreWakeWordData(res->data, res->data_size / sizeof(int16_t));
-
-        if (res->wakeup_state == WAKENET_DETECTED) {
-            Stop();
-            last_detected_wake_word_ = wake_words_[res->wakenet_model_index - 1];
-
-            if (wake_word_detected_callback_) {
-                wake_word_detected_callback_(last_detected_wake_word_);
-            }
-        }
+        cpu_cost_.OnFetched();
+        ProcessFetchResult(res);
     }
 }
 
-void AfeWakeWord::StoreWakeWordData(const int16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
+void AfeWakeWord::ProcessFetchResult(afe_fetch_result_t* res) {
+    // Store the wake word data for voice recognition, like who is speaking
+    preroll_.Feed(res->data, res->data_size / sizeof(int16_t));
+
+    if (res->wakeup_state == WAKENET_DETECTED) {
+        Stop();
+        int model = res->wakenet_model_index - 1;
+        int word = res->wake_word_index - 1;
+        if (model < 0 || model >= (int)wake_words_.size() || word < 0 || word >= (int)wake_words_[model].size()) {
+            ESP_LOGW(TAG, "Unknown wake word %d of model %d", res->wake_word_index, res->wakenet_model_index);
+            return;
+        }
+        last_detected_wake_word_ = wake_words_[model][word];
+        {
+            std::lock_guard<std::mutex> lock(models_mutex_);
+            models_info_[model].detections++;
+            models_info_[model].last_detection_us = esp_timer_get_time();
+            ESP_LOGI(TAG, "Wake word(%s) detected: %s, detections: %lu", models_info_[model].name.c_str(),
+                last_detected_wake_word_.c_str(), (unsigned long)models_info_[model].detections);
+        }
+        auto input_format = codec_->GetInputFormat();
+        if (std::count(input_format.begin(), input_format.end(), 'M') > 1) {
+            // With several microphones the AFE follows the separated channel that woke up
+            ESP_LOGI(TAG, "Wake word from channel %d", res->trigger_channel_id);
+        }
+
+        if (wake_word_detected_callback_) {
+            wake_word_detected_callback_(last_detected_wake_word_);
+        }
     }
 }
 
 void AfeWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 6;
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
-        assert(wake_word_encode_task_stack_ != nullptr);
-    }
-    if (wake_word_encode_task_buffer_ == nullptr) {
-        wake_word_encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
-        assert(wake_word_encode_task_buffer_ != nullptr);
-    }
-
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (AfeWakeWord*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            // Create encoder
-            esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
-            void* encoder_handle = nullptr;
-            auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_handle);
-            if (encoder_handle == nullptr) {
-                ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
-                std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-                this_->wake_word_cv_.notify_all();
-                return;
-            }
-            
-            // Get frame size
-            int frame_size = 0;
-            int outbuf_size = 0;
-            esp_opus_enc_get_frame_size(encoder_handle, &frame_size, &outbuf_size);
-            frame_size = frame_size / sizeof(int16_t);
-            
-            // Encode all PCM data
-            int packets = 0;
-            std::vector<int16_t> in_buffer;
-            esp_audio_enc_in_frame_t in = {};
-            esp_audio_enc_out_frame_t out = {};
-            
-            for (auto& pcm: this_->wake_word_pcm_) {
-                if (in_buffer.empty()) {
-                    in_buffer = std::move(pcm);
-                } else {
-                    in_buffer.reserve(in_buffer.size() + pcm.size());
-                    in_buffer.insert(in_buffer.end(), pcm.begin(), pcm.end());
-                }
-                
-                while (in_buffer.size() >= frame_size) {
-                    std::vector<uint8_t> opus_buf(outbuf_size);
-                    in.buffer = (uint8_t *)(in_buffer.data());
-                    in.len = (uint32_t)(frame_size * sizeof(int16_t));
-                    out.buffer = opus_buf.data();
-                    out.len = outbuf_size;
-                    out.encoded_bytes = 0;
-                    
-                    ret = esp_opus_enc_process(encoder_handle, &in, &out);
-                    if (ret == ESP_AUDIO_ERR_OK) {
-                        std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                        this_->wake_word_opus_.emplace_back(opus_buf.data(), opus_buf.data() + out.encoded_bytes);
-                        this_->wake_word_cv_.notify_all();
-                        packets++;
-                    } else {
-                        ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
-                    }
-                    
-                    in_buffer.erase(in_buffer.begin(), in_buffer.begin() + frame_size);
-                }
-            }
-            this_->wake_word_pcm_.clear();
-            // Close encoder
-            esp_opus_enc_close(encoder_handle);
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((end_time - start_time) / 1000));
-
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    preroll_.Finish();
 }
 
-bool AfeWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+bool AfeWakeWord::GetWakeWordOpus(PsramVector<uint8_t, kHeapSubsystemAudio>& opus) {
+    return preroll_.Pop(opus);
 }
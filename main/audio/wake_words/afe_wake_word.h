@@ -9,19 +9,23 @@
 #include <esp_nsn_models.h>
 #include <model_path.h>
 
-#include <deque>
 #include <string>
 #include <vector>
 #include <functional>
 #include <mutex>
-#include <condition_variable>
+#include <memory>
 
 #include "audio_codec.h"
+#include "staging_buffer.h"
+#include "processors/afe_front_end.h"
+#include "processors/afe_cpu_cost.h"
 #include "wake_word.h"
+#include "wake_word_preroll.h"
 
 class AfeWakeWord : public WakeWord {
 public:
-    AfeWakeWord();
+    // With a front end the detection runs on the AFE shared with the audio processor
+    explicit AfeWakeWord(std::shared_ptr<AfeFrontEnd> front_end = nullptr);
     ~AfeWakeWord();
 
     bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
@@ -31,32 +35,36 @@ public:
     void Stop();
     size_t GetFeedSize();
     void EncodeWakeWordData();
-    bool GetWakeWordOpus(std::vector<uint8_t>& opus);
+    bool GetWakeWordOpus(PsramVector<uint8_t, kHeapSubsystemAudio>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
+    std::vector<WakeWordModelInfo> GetModels();
+    bool SetModelThreshold(int model, float threshold);
 
 private:
     srmodel_list_t *models_ = nullptr;
     const esp_afe_sr_iface_t* afe_iface_ = nullptr;
     esp_afe_sr_data_t* afe_data_ = nullptr;
-    char* wakenet_model_ = NULL;
-    std::vector<std::string> wake_words_;
+    // The AFE runs at most two wakenet models, wake_words_[model][word]
+    std::vector<char*> wakenet_models_;
+    std::vector<std::vector<std::string>> wake_words_;
+    std::mutex models_mutex_;
+    std::vector<WakeWordModelInfo> models_info_;
     EventGroupHandle_t event_group_;
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
-    std::vector<int16_t> input_buffer_;
+    StagingBuffer input_buffer_;
+    AfeCpuCost cpu_cost_;
     std::mutex input_buffer_mutex_;
+    std::shared_ptr<AfeFrontEnd> front_end_;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::deque<std::vector<int16_t>> wake_word_pcm_;
-    std::deque<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    WakeWordPreroll preroll_;
 
-    void StoreWakeWordData(const int16_t* data, size_t size);
     void AudioDetectionTask();
+    void ProcessFetchResult(afe_fetch_result_t* res);
+    void LoadThresholds();
+    // Sets the kept thresholds on the shared AFE once its WakeNet runs
+    void ApplyThresholds();
 };
 
 #endif
@@ -11,8 +11,7 @@
 
 #define TAG "CustomWakeWord"
 
-CustomWakeWord::CustomWakeWord()
-    : wake_word_pcm_(), wake_word_opus_() {
+CustomWakeWord::CustomWakeWord() {
 }
 
 CustomWakeWord::~CustomWakeWord() {
@@ -21,14 +20,6 @@ CustomWakeWord::~CustomWakeWord() {
         multinet_model_data_ = nullptr;
     }
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
-    }
-
-    if (wake_word_encode_task_buffer_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_buffer_);
-    }
-
     if (models_ != nullptr) {
         esp_srmodel_deinit(models_);
     }
@@ -71,8 +62,27 @@ void CustomWakeWord::ParseWakenetModelConfig() {
                     cJSON* text = cJSON_GetObjectItem(command, "text");
                     cJSON* action = cJSON_GetObjectItem(command, "action");
                     if (cJSON_IsString(command_name) && cJSON_IsString(text) && cJSON_IsString(action)) {
-                        commands_.push_back({command_name->valuestring, text->valuestring, action->valuestring});
-                        ESP_LOGI(TAG, "Command: %s, Text: %s, Action: %s", command_name->valuestring, text->valuestring, action->valuestring);
+                        Command entry = {command_name->valuestring, text->valuestring, action->valuestring};
+                        // { "action": "tool", "tool": "self.audio_speaker.set_volume", "arguments": { "volume": 80 } }
+                        if (entry.action == "tool") {
+                            cJSON* tool = cJSON_GetObjectItem(command, "tool");
+                            cJSON* arguments = cJSON_GetObjectItem(command, "arguments");
+                            if (!cJSON_IsString(tool)) {
+                                ESP_LOGW(TAG, "Command %s has no tool, skipped", command_name->valuestring);
+                                continue;
+                            }
+                            entry.tool = tool->valuestring;
+                            if (cJSON_IsObject(arguments)) {
+                                char* json = cJSON_PrintUnformatted(arguments);
+                                entry.arguments = json;
+                                cJSON_free(json);
+                            } else {
+                                entry.arguments = "{}";
+                            }
+                        }
+                        ESP_LOGI(TAG, "Command: %s, Text: %s, Action: %s %s", command_name->valuestring, text->valuestring,
+                            action->valuestring, entry.tool.c_str());
+                        commands_.push_back(std::move(entry));
                     }
                 }
             }
@@ -118,6 +128,7 @@ bool CustomWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list)
     multinet_ = esp_mn_handle_from_name(mn_name_);
     multinet_model_data_ = multinet_->create(mn_name_, duration_);
     multinet_->set_det_threshold(multinet_model_data_, threshold_);
+    input_buffer_.Initialize(multinet_->get_samp_chunksize(multinet_model_data_), STAGING_BUFFER_CHUNKS);
     esp_mn_commands_clear();
     for (int i = 0; i < commands_.size(); i++) {
         esp_mn_commands_add(i + 1, commands_[i].command.c_str());
@@ -125,6 +136,9 @@ bool CustomWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list)
     esp_mn_commands_update();
     
     multinet_->print_active_speech_commands(multinet_model_data_);
+#if CONFIG_SEND_WAKE_WORD_DATA
+    preroll_.Initialize();
+#endif
     return true;
 }
 
@@ -132,7 +146,12 @@ void CustomWakeWord::OnWakeWordDetected(std::function<void(const std::string& wa
     wake_word_detected_callback_ = callback;
 }
 
+void CustomWakeWord::OnCommandDetected(std::function<void(const std::string& tool, const std::string& arguments)> callback) {
+    command_detected_callback_ = callback;
+}
+
 void CustomWakeWord::Start() {
+    preroll_.Clear();
     running_ = true;
 }
 
@@ -140,7 +159,7 @@ void CustomWakeWord::Stop() {
     running_ = false;
 
     std::lock_guard<std::mutex> lock(input_buffer_mutex_);
-    input_buffer_.clear();
+    input_buffer_.Clear();
 }
 
 void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
@@ -154,21 +173,22 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         return;
     }
 
-    // If input channels is 2, we need to fetch the left channel data
-    if (codec_->input_channels() == 2) {
-        for (size_t i = 0; i < data.size(); i += 2) {
-            input_buffer_.push_back(data[i]);
-        }
+    // Only the first microphone is fed
+    size_t dropped;
+    int channels = codec_->input_channels();
+    if (channels > 1) {
+        dropped = input_buffer_.WriteChannel(data.data(), data.size() / channels, channels, codec_->GetPrimaryMicChannel());
     } else {
-        input_buffer_.insert(input_buffer_.end(), data.begin(), data.end());
+        dropped = input_buffer_.Write(data.data(), data.size());
     }
-    
-    int chunksize = multinet_->get_samp_chunksize(multinet_model_data_);
-    while (input_buffer_.size() >= chunksize) {
-        std::vector<int16_t> chunk(input_buffer_.begin(), input_buffer_.begin() + chunksize);
-        StoreWakeWordData(chunk);
+    if (dropped > 0) {
+        ESP_LOGW(TAG, "Input staging buffer overflow, dropped %u samples", dropped);
+    }
+
+    while (auto chunk = input_buffer_.Front()) {
+        preroll_.Feed(chunk, input_buffer_.chunk_size());
         
-        esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, chunk.data());
+        esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, chunk);
         
         if (mn_state == ESP_MN_STATE_DETECTED) {
             esp_mn_results_t *mn_result = multinet_->get_results(multinet_model_data_);
@@ -179,11 +199,16 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
                 if (command.action == "wake") {
                     last_detected_wake_word_ = command.text;
                     running_ = false;
-                    input_buffer_.clear();
+                    input_buffer_.Clear();
                     
                     if (wake_word_detected_callback_) {
                         wake_word_detected_callback_(last_detected_wake_word_);
                     }
+                } else if (command.action == "tool") {
+                    // Keeps listening, the next command can follow right away
+                    if (command_detected_callback_) {
+                        command_detected_callback_(command.tool, command.arguments);
+                    }
                 }
             }
             multinet_->clean(multinet_model_data_);
@@ -195,7 +220,7 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         if (!running_) {
             break;
         }
-        input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + chunksize);
+        input_buffer_.Pop();
     }
 }
 
@@ -206,98 +231,10 @@ size_t CustomWakeWord::GetFeedSize() {
     return multinet_->get_samp_chunksize(multinet_model_data_);
 }
 
-void CustomWakeWord::StoreWakeWordData(const std::vector<int16_t>& data) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.push_back(data);
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
-    }
-}
-
 void CustomWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 7;
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
-        assert(wake_word_encode_task_stack_ != nullptr);
-    }
-    if (wake_word_encode_task_buffer_ == nullptr) {
-        wake_word_encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
-        assert(wake_word_encode_task_buffer_ != nullptr);
-    }
-
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (CustomWakeWord*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            // Create encoder
-            esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
-            void* encoder_handle = nullptr;
-            auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_handle);
-            if (encoder_handle == nullptr) {
-                ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
-                std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-                this_->wake_word_cv_.notify_all();
-                return;
-            }
-            // Get frame size
-            int frame_size = 0;
-            int outbuf_size = 0;
-            esp_opus_enc_get_frame_size(encoder_handle, &frame_size, &outbuf_size);
-            frame_size = frame_size / sizeof(int16_t);
-            // Encode all PCM data
-            int packets = 0;
-            std::vector<int16_t> in_buffer;
-            esp_audio_enc_in_frame_t in = {};
-            esp_audio_enc_out_frame_t out = {};
-            for (auto& pcm: this_->wake_word_pcm_) {
-                if (in_buffer.empty()) {
-                    in_buffer = std::move(pcm);
-                } else {
-                    in_buffer.reserve(in_buffer.size() + pcm.size());
-                    in_buffer.insert(in_buffer.end(), pcm.begin(), pcm.end());
-                }
-                while (in_buffer.size() >= frame_size) {
-                    std::vector<uint8_t> opus_buf(outbuf_size);
-                    in.buffer = (uint8_t *)(in_buffer.data());
-                    in.len = (uint32_t)(frame_size * sizeof(int16_t));
-                    out.buffer = opus_buf.data();
-                    out.len = outbuf_size;
-                    out.encoded_bytes = 0;
-                    ret = esp_opus_enc_process(encoder_handle, &in, &out);
-                    if (ret == ESP_AUDIO_ERR_OK) {
-                        std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                        this_->wake_word_opus_.emplace_back(opus_buf.data(), opus_buf.data() + out.encoded_bytes);
-                        this_->wake_word_cv_.notify_all();
-                        packets++;
-                    } else {
-                        ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
-                    }
-                    in_buffer.erase(in_buffer.begin(), in_buffer.begin() + frame_size);
-                }
-            }
-            this_->wake_word_pcm_.clear();
-            // Close encoder
-            esp_opus_enc_close(encoder_handle);
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((end_time - start_time) / 1000));
-
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    preroll_.Finish();
 }
 
-bool CustomWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+bool CustomWakeWord::GetWakeWordOpus(PsramVector<uint8_t, kHeapSubsystemAudio>& opus) {
+    return preroll_.Pop(opus);
 }
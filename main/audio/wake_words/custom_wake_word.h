@@ -11,11 +11,12 @@
 #include <vector>
 #include <functional>
 #include <mutex>
-#include <condition_variable>
 #include <atomic>
 
 #include "audio_codec.h"
+#include "staging_buffer.h"
 #include "wake_word.h"
+#include "wake_word_preroll.h"
 
 class CustomWakeWord : public WakeWord {
 public:
@@ -25,18 +26,21 @@ public:
     bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
     void Feed(const std::vector<int16_t>& data);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    void OnCommandDetected(std::function<void(const std::string& tool, const std::string& arguments)> callback);
     void Start();
     void Stop();
     size_t GetFeedSize();
     void EncodeWakeWordData();
-    bool GetWakeWordOpus(std::vector<uint8_t>& opus);
+    bool GetWakeWordOpus(PsramVector<uint8_t, kHeapSubsystemAudio>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
 
 private:
     struct Command {
         std::string command;
         std::string text;
-        std::string action;
+        std::string action;     // "wake" opens a session, "tool" calls tool locally
+        std::string tool;
+        std::string arguments;  // JSON object
     };
 
     // multinet 相关成员变量
@@ -50,21 +54,15 @@ private:
     std::deque<Command> commands_;
  
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
+    std::function<void(const std::string& tool, const std::string& arguments)> command_detected_callback_;
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
     std::atomic<bool> running_ = false;
-    std::vector<int16_t> input_buffer_;
+    StagingBuffer input_buffer_;
     std::mutex input_buffer_mutex_;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::deque<std::vector<int16_t>> wake_word_pcm_;
-    std::deque<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    WakeWordPreroll preroll_;
 
-    void StoreWakeWordData(const std::vector<int16_t>& data);
     void ParseWakenetModelConfig();
 };
 
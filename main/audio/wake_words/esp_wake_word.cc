@@ -1,5 +1,7 @@
 #include "esp_wake_word.h"
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
 
 
 #define TAG "EspWakeWord"
@@ -8,8 +10,10 @@ EspWakeWord::EspWakeWord() {
 }
 
 EspWakeWord::~EspWakeWord() {
-    if (wakenet_data_ != nullptr) {
-        wakenet_iface_->destroy(wakenet_data_);
+    for (auto& model : models_) {
+        model.iface->destroy(model.data);
+    }
+    if (!models_.empty()) {
         esp_srmodel_deinit(wakenet_model_);
     }
 }
@@ -27,20 +31,75 @@ bool EspWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
         ESP_LOGE(TAG, "Failed to initialize wakenet model");
         return false;
     }
-    if(wakenet_model_->num > 1) {
-        ESP_LOGW(TAG, "More than one model found, using the first one");
-    } else if (wakenet_model_->num == 0) {
+
+    int audio_chunksize = 0;
+    for (int i = 0; i < wakenet_model_->num; i++) {
+        char* model_name = wakenet_model_->model_name[i];
+        if (strstr(model_name, ESP_WN_PREFIX) == nullptr) {
+            continue;
+        }
+        auto iface = (esp_wn_iface_t*)esp_wn_handle_from_name(model_name);
+        auto data = iface->create(model_name, DET_MODE_95);
+        int chunksize = iface->get_samp_chunksize(data);
+        // One staging buffer feeds them all
+        if (audio_chunksize != 0 && chunksize != audio_chunksize) {
+            ESP_LOGW(TAG, "Wake word(%s) chunksize %d differs from %d, skipped", model_name, chunksize, audio_chunksize);
+            iface->destroy(data);
+            continue;
+        }
+        audio_chunksize = chunksize;
+
+        Model model = {iface, data, {}};
+        model.info.name = model_name;
+        int word_num = iface->get_word_num(data);
+        for (int word = 1; word <= word_num; word++) {
+            if (word > 1) {
+                model.info.words += ";";
+            }
+            model.info.words += iface->get_word_name(data, word);
+        }
+        models_.push_back(std::move(model));
+
+        float threshold = LoadModelThreshold(models_.size() - 1);
+        if (threshold > 0) {
+            SetModelThreshold(models_.size() - 1, threshold);
+        }
+        ESP_LOGI(TAG, "Wake word(%s),freq: %d, chunksize: %d, words: %s", model_name,
+            iface->get_samp_rate(data), chunksize, models_.back().info.words.c_str());
+    }
+
+    if (models_.empty()) {
         ESP_LOGE(TAG, "No model found");
         return false;
     }
-    char *model_name = wakenet_model_->model_name[0];
-    wakenet_iface_ = (esp_wn_iface_t*)esp_wn_handle_from_name(model_name);
-    wakenet_data_ = wakenet_iface_->create(model_name, DET_MODE_95);
+    input_buffer_.Initialize(audio_chunksize, STAGING_BUFFER_CHUNKS);
+    return true;
+}
 
-    int frequency = wakenet_iface_->get_samp_rate(wakenet_data_);
-    int audio_chunksize = wakenet_iface_->get_samp_chunksize(wakenet_data_);
-    ESP_LOGI(TAG, "Wake word(%s),freq: %d, chunksize: %d", model_name, frequency, audio_chunksize);
+std::vector<WakeWordModelInfo> EspWakeWord::GetModels() {
+    std::lock_guard<std::mutex> lock(input_buffer_mutex_);
+    std::vector<WakeWordModelInfo> models;
+    for (auto& model : models_) {
+        models.push_back(model.info);
+    }
+    return models;
+}
 
+bool EspWakeWord::SetModelThreshold(int model, float threshold) {
+    if (model < 0 || model >= (int)models_.size()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(input_buffer_mutex_);
+    auto& entry = models_[model];
+    int word_num = entry.iface->get_word_num(entry.data);
+    for (int word = 1; word <= word_num; word++) {
+        entry.iface->set_det_threshold(entry.data, threshold, word);
+    }
+    if (entry.info.threshold != threshold) {
+        entry.info.threshold = threshold;
+        SaveModelThreshold(model, threshold);
+    }
+    ESP_LOGI(TAG, "Wake word(%s) threshold %.2f", entry.info.name.c_str(), threshold);
     return true;
 }
 
@@ -56,11 +115,11 @@ void EspWakeWord::Stop() {
     running_ = false;
 
     std::lock_guard<std::mutex> lock(input_buffer_mutex_);
-    input_buffer_.clear();
+    input_buffer_.Clear();
 }
 
 void EspWakeWord::Feed(const std::vector<int16_t>& data) {
-    if (wakenet_data_ == nullptr) {
+    if (models_.empty()) {
         return;
     }
 
@@ -70,41 +129,53 @@ void EspWakeWord::Feed(const std::vector<int16_t>& data) {
         return;
     }
 
-    if (codec_->input_channels() == 2) {
-        for (size_t i = 0; i < data.size(); i += 2) {
-            input_buffer_.push_back(data[i]);
-        }
+    size_t dropped;
+    int channels = codec_->input_channels();
+    if (channels > 1) {
+        dropped = input_buffer_.WriteChannel(data.data(), data.size() / channels, channels, codec_->GetPrimaryMicChannel());
     } else {
-        input_buffer_.insert(input_buffer_.end(), data.begin(), data.end());
+        dropped = input_buffer_.Write(data.data(), data.size());
+    }
+    if (dropped > 0) {
+        ESP_LOGW(TAG, "Input staging buffer overflow, dropped %u samples", dropped);
     }
 
-    int chunksize = wakenet_iface_->get_samp_chunksize(wakenet_data_);
-    while (input_buffer_.size() >= chunksize) {
-        int res = wakenet_iface_->detect(wakenet_data_, input_buffer_.data());
-        if (res > 0) {
-            last_detected_wake_word_ = wakenet_iface_->get_word_name(wakenet_data_, res);
+    while (auto chunk = input_buffer_.Front()) {
+        for (auto& model : models_) {
+            int res = model.iface->detect(model.data, chunk);
+            if (res <= 0) {
+                continue;
+            }
+            last_detected_wake_word_ = model.iface->get_word_name(model.data, res);
+            model.info.detections++;
+            model.info.last_detection_us = esp_timer_get_time();
+            ESP_LOGI(TAG, "Wake word(%s) detected: %s, detections: %lu", model.info.name.c_str(),
+                last_detected_wake_word_.c_str(), (unsigned long)model.info.detections);
             running_ = false;
-            input_buffer_.clear();
+            input_buffer_.Clear();
+            for (auto& other : models_) {
+                other.iface->clean(other.data);
+            }
 
             if (wake_word_detected_callback_) {
                 wake_word_detected_callback_(last_detected_wake_word_);
             }
-            break;
+            return;
         }
-        input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + chunksize);
+        input_buffer_.Pop();
     }
 }
 
 size_t EspWakeWord::GetFeedSize() {
-    if (wakenet_data_ == nullptr) {
+    if (models_.empty()) {
         return 0;
     }
-    return wakenet_iface_->get_samp_chunksize(wakenet_data_);
+    return models_[0].iface->get_samp_chunksize(models_[0].data);
 }
 
 void EspWakeWord::EncodeWakeWordData() {
 }
 
-bool EspWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
+bool EspWakeWord::GetWakeWordOpus(PsramVector<uint8_t, kHeapSubsystemAudio>& opus) {
     return false;
 }
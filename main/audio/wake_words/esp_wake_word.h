@@ -12,6 +12,7 @@
 #include <mutex>
 
 #include "audio_codec.h"
+#include "staging_buffer.h"
 #include "wake_word.h"
 
 class EspWakeWord : public WakeWord {
@@ -26,19 +27,26 @@ public:
     void Stop();
     size_t GetFeedSize();
     void EncodeWakeWordData();
-    bool GetWakeWordOpus(std::vector<uint8_t>& opus);
+    bool GetWakeWordOpus(PsramVector<uint8_t, kHeapSubsystemAudio>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
+    std::vector<WakeWordModelInfo> GetModels();
+    bool SetModelThreshold(int model, float threshold);
 
 private:
-    esp_wn_iface_t *wakenet_iface_ = nullptr;
-    model_iface_data_t *wakenet_data_ = nullptr;
+    // Every wakenet model in the list runs on the same staged chunks
+    struct Model {
+        esp_wn_iface_t* iface;
+        model_iface_data_t* data;
+        WakeWordModelInfo info;
+    };
+    std::vector<Model> models_;
     srmodel_list_t *wakenet_model_ = nullptr;
     AudioCodec* codec_ = nullptr;
     std::atomic<bool> running_ = false;
 
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
     std::string last_detected_wake_word_;
-    std::vector<int16_t> input_buffer_;
+    StagingBuffer input_buffer_;
     std::mutex input_buffer_mutex_;
 };
 
@@ -0,0 +1,137 @@
+#include "wake_word_preroll.h"
+#include "audio_service.h"
+#include "task_factory.h"
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "WakeWordPreroll"
+
+#define WAKE_WORD_PREROLL_TASK_STACK_SIZE (4096 * 7)
+
+WakeWordPreroll::~WakeWordPreroll() {
+    TaskFactory::Delete(encode_task_);
+    if (encoder_ != nullptr) {
+        esp_opus_enc_close(encoder_);
+    }
+}
+
+void WakeWordPreroll::Initialize() {
+    if (encode_task_ != nullptr) {
+        return;
+    }
+
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+        return;
+    }
+    esp_opus_enc_get_frame_size(encoder_, &frame_size_, &outbuf_size_);
+    frame_size_ = frame_size_ / sizeof(int16_t);
+
+    pcm_.Initialize(frame_size_, STAGING_BUFFER_CHUNKS);
+    packets_.resize(WAKE_WORD_PREROLL_MS / OPUS_FRAME_DURATION_MS);
+
+    // The Opus encoder needs a large stack, keep it in PSRAM
+    encode_task_ = TaskFactory::Create("encode_wake_word", WAKE_WORD_PREROLL_TASK_STACK_SIZE, 2, kTaskStackPsram, [this]() {
+        EncodeTask();
+    });
+}
+
+void WakeWordPreroll::Feed(const int16_t* data, size_t samples) {
+    if (encode_task_ == nullptr) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The encoder falling behind only costs the oldest PCM frames
+    pcm_.Write(data, samples);
+    if (pcm_.Front() != nullptr) {
+        xTaskNotifyGive(encode_task_);
+    }
+}
+
+void WakeWordPreroll::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pcm_.Clear();
+    packet_head_ = 0;
+    packet_count_ = 0;
+}
+
+void WakeWordPreroll::Finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_.clear();
+    if (encode_task_ == nullptr) {
+        output_.emplace_back();
+        cv_.notify_all();
+        return;
+    }
+    // The encoder task takes the snapshot once it has caught up with the PCM
+    finish_requested_ = true;
+    xTaskNotifyGive(encode_task_);
+}
+
+bool WakeWordPreroll::Pop(PsramVector<uint8_t, kHeapSubsystemAudio>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() {
+        return !output_.empty();
+    });
+    opus.swap(output_.front());
+    output_.pop_front();
+    return !opus.empty();
+}
+
+void WakeWordPreroll::EncodeTask() {
+    std::vector<int16_t> frame(frame_size_);
+    std::vector<uint8_t> opus(outbuf_size_);
+    esp_audio_enc_in_frame_t in = {};
+    esp_audio_enc_out_frame_t out = {};
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto chunk = pcm_.Front();
+                if (chunk == nullptr) {
+                    if (finish_requested_) {
+                        finish_requested_ = false;
+                        // Copy, so the ring slots keep their capacity
+                        for (size_t i = 0; i < packet_count_; i++) {
+                            output_.push_back(packets_[(packet_head_ + i) % packets_.size()]);
+                        }
+                        ESP_LOGI(TAG, "Wake word pre-roll: %u packets", packet_count_);
+                        output_.emplace_back();
+                        packet_head_ = 0;
+                        packet_count_ = 0;
+                        pcm_.Clear();
+                        cv_.notify_all();
+                    }
+                    break;
+                }
+                memcpy(frame.data(), chunk, frame_size_ * sizeof(int16_t));
+                pcm_.Pop();
+            }
+
+            in.buffer = (uint8_t *)frame.data();
+            in.len = (uint32_t)(frame_size_ * sizeof(int16_t));
+            out.buffer = opus.data();
+            out.len = outbuf_size_;
+            out.encoded_bytes = 0;
+            auto ret = esp_opus_enc_process(encoder_, &in, &out);
+            if (ret != ESP_AUDIO_ERR_OK) {
+                ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (packet_count_ == packets_.size()) {
+                packet_head_ = (packet_head_ + 1) % packets_.size();
+                packet_count_--;
+            }
+            packets_[(packet_head_ + packet_count_) % packets_.size()].assign(opus.data(), opus.data() + out.encoded_bytes);
+            packet_count_++;
+        }
+    }
+}
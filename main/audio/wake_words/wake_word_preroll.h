@@ -0,0 +1,64 @@
+#ifndef WAKE_WORD_PREROLL_H
+#define WAKE_WORD_PREROLL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "staging_buffer.h"
+#include "heap_placement.h"
+
+// Audio kept before the wake word is detected, sent to the server for voice recognition
+#define WAKE_WORD_PREROLL_MS 2000
+
+/*
+ * Opus pre-roll of the wake word.
+ *
+ * The detection task feeds every checked chunk into a small PCM staging ring, and a task with
+ * one persistent encoder keeps encoding it into a fixed ring of Opus packets covering the last
+ * WAKE_WORD_PREROLL_MS. On detection, Finish() hands over the packets encoded so far plus the
+ * few frames still in flight, so the first uplink packets are ready almost at once.
+ *
+ * The packets come from one continuous stream, the oldest one may depend on a packet that
+ * has already been dropped, which the decoder only notices for its first frame.
+ */
+class WakeWordPreroll {
+public:
+    ~WakeWordPreroll();
+
+    // Starts the encoder task, Feed() does nothing before
+    void Initialize();
+    // Detection task: append mono 16 kHz PCM
+    void Feed(const int16_t* data, size_t samples);
+    // Drop everything buffered so far, on restart of the detection
+    void Clear();
+    // Snapshot the pre-roll for Pop(), call once the wake word is detected
+    void Finish();
+    // Blocks until the next packet of the snapshot, returns false at its end
+    bool Pop(PsramVector<uint8_t, kHeapSubsystemAudio>& opus);
+
+private:
+    TaskHandle_t encode_task_ = nullptr;
+    void* encoder_ = nullptr;
+    int frame_size_ = 0;
+    int outbuf_size_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    StagingBuffer pcm_;
+    // Fixed ring of encoded packets, the slots keep their capacity
+    std::vector<PsramVector<uint8_t, kHeapSubsystemAudio>> packets_;
+    size_t packet_head_ = 0;
+    size_t packet_count_ = 0;
+    bool finish_requested_ = false;
+    // Snapshot handed out by Pop(), an empty packet marks its end
+    std::deque<PsramVector<uint8_t, kHeapSubsystemAudio>> output_;
+
+    void EncodeTask();
+};
+
+#endif // WAKE_WORD_PREROLL_H
@@ -0,0 +1,696 @@
+#include "benchmark.h"
+#include "board.h"
+#include "display.h"
+#include "lvgl_display.h"
+#include "dfs_policy.h"
+#include "audio_service.h"
+#include "application.h"
+#include "settings.h"
+#include "ogg_demuxer.h"
+#include "resampler.h"
+#include "codecs/dummy_audio_codec.h"
+#include "gif/gifdec.h"
+#include "assets/lang_config.h"
+#include "pixel_swap.h"
+#ifndef CONFIG_IDF_TARGET_ESP32
+#include "jpg/image_to_jpeg.h"
+#endif
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+#include <esp_app_desc.h>
+#include <mbedtls/aes.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define TAG "Benchmark"
+
+// A case stops after this many iterations or this much measured time, whichever comes first
+#define BENCHMARK_MAX_ITERATIONS 200
+#define BENCHMARK_MAX_US (1000 * 1000)
+// NVS commits of the flash stall case, spaced so the audio input keeps reading in between
+#define BENCHMARK_FLASH_COMMITS 20
+#define BENCHMARK_FLASH_COMMIT_INTERVAL_MS 100
+// Frames encoded per complexity by MeasureOpusComplexity(), the fastest one counts
+#define BENCHMARK_COMPLEXITY_FRAMES 4
+#define BENCHMARK_COMPLEXITY_FRAME_MS 60
+
+namespace {
+
+struct HeapUsage {
+    int internal;
+    int spiram;
+};
+
+// Free heap at construction, Used() is what has been allocated since
+class HeapMark {
+public:
+    HeapMark() : internal_(heap_caps_get_free_size(MALLOC_CAP_INTERNAL)), spiram_(heap_caps_get_free_size(MALLOC_CAP_SPIRAM)) {}
+
+    HeapUsage Used() const {
+        return {(int)internal_ - (int)heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+                (int)spiram_ - (int)heap_caps_get_free_size(MALLOC_CAP_SPIRAM)};
+    }
+
+private:
+    size_t internal_;
+    size_t spiram_;
+};
+
+class CaseTimer {
+public:
+    inline void Begin() {
+        start_us_ = esp_timer_get_time();
+        start_cycles_ = esp_cpu_get_cycle_count();
+    }
+
+    inline void End() {
+        uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles_;
+        total_us_ += esp_timer_get_time() - start_us_;
+        total_cycles_ += cycles;
+        min_cycles_ = std::min(min_cycles_, cycles);
+        max_cycles_ = std::max(max_cycles_, cycles);
+        iterations_++;
+    }
+
+    bool Done() const { return iterations_ >= BENCHMARK_MAX_ITERATIONS || total_us_ >= BENCHMARK_MAX_US; }
+
+    // bytes is the input size of one iteration, for the throughput of the byte oriented cases
+    void Report(cJSON* results, const std::string& name, const HeapUsage& heap, size_t bytes = 0) const {
+        if (iterations_ == 0) {
+            ESP_LOGW(TAG, "%s: no iteration completed", name.c_str());
+            return;
+        }
+        cJSON* json = cJSON_CreateObject();
+        cJSON_AddStringToObject(json, "case", name.c_str());
+        cJSON_AddNumberToObject(json, "iterations", iterations_);
+        cJSON_AddNumberToObject(json, "cycles", (double)(total_cycles_ / iterations_));
+        cJSON_AddNumberToObject(json, "cycles_min", min_cycles_);
+        cJSON_AddNumberToObject(json, "cycles_max", max_cycles_);
+        cJSON_AddNumberToObject(json, "us", (double)(total_us_ / iterations_));
+        cJSON_AddNumberToObject(json, "heap_internal", heap.internal);
+        cJSON_AddNumberToObject(json, "heap_spiram", heap.spiram);
+        if (bytes > 0) {
+            cJSON_AddNumberToObject(json, "bytes", bytes);
+        }
+        char* line = cJSON_PrintUnformatted(json);
+        printf("BENCH:%s\n", line);
+        cJSON_free(line);
+        cJSON_AddItemToArray(results, json);
+    }
+
+private:
+    int64_t start_us_ = 0;
+    uint32_t start_cycles_ = 0;
+    int iterations_ = 0;
+    int64_t total_us_ = 0;
+    uint64_t total_cycles_ = 0;
+    uint32_t min_cycles_ = UINT32_MAX;
+    uint32_t max_cycles_ = 0;
+};
+
+// A 440 Hz tone under noise at 16 kHz, so the encoder neither idles on silence nor sees pure noise
+void FillPcm(std::vector<int16_t>& pcm, uint32_t& sample) {
+    for (auto& value : pcm) {
+        uint32_t noise = sample * 1664525u + 1013904223u;
+        value = (int16_t)(std::sin(2 * M_PI * 440 * sample / 16000) * 8000) + (int16_t)(noise >> 16) / 16;
+        sample++;
+    }
+}
+
+void RunOpus(cJSON* results) {
+    const int durations[] = {5, 10, 20, 40, 60, 80, 100, 120};
+    for (int duration : durations) {
+        HeapMark encoder_heap;
+        esp_opus_enc_config_t enc_cfg = AS_OPUS_ENC_CONFIG();
+        enc_cfg.frame_duration = (esp_opus_enc_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(duration);
+        enc_cfg.enable_dtx = false;
+        void* encoder = nullptr;
+        esp_opus_enc_open(&enc_cfg, sizeof(esp_opus_enc_config_t), &encoder);
+        if (encoder == nullptr) {
+            ESP_LOGE(TAG, "Failed to open the %d ms encoder", duration);
+            continue;
+        }
+        HeapUsage encoder_used = encoder_heap.Used();
+        int frame_size = 0, outbuf_size = 0;
+        esp_opus_enc_get_frame_size(encoder, &frame_size, &outbuf_size);
+        std::vector<int16_t> pcm(frame_size / sizeof(int16_t));
+        std::vector<uint8_t> out(outbuf_size);
+        std::vector<std::vector<uint8_t>> packets;
+
+        CaseTimer encode;
+        uint32_t sample = 0;
+        while (!encode.Done()) {
+            FillPcm(pcm, sample);
+            esp_audio_enc_in_frame_t in = {
+                .buffer = (uint8_t*)pcm.data(),
+                .len = (uint32_t)frame_size,
+            };
+            esp_audio_enc_out_frame_t frame = {
+                .buffer = out.data(),
+                .len = (uint32_t)out.size(),
+                .encoded_bytes = 0,
+            };
+            encode.Begin();
+            auto ret = esp_opus_enc_process(encoder, &in, &frame);
+            encode.End();
+            if (ret != ESP_AUDIO_ERR_OK) {
+                ESP_LOGE(TAG, "Opus encode failed: %d", ret);
+                break;
+            }
+            packets.emplace_back(out.begin(), out.begin() + frame.encoded_bytes);
+        }
+        encode.Report(results, "opus_enc_" + std::to_string(duration) + "ms", encoder_used, frame_size);
+        esp_opus_enc_close(encoder);
+
+        HeapMark decoder_heap;
+        esp_opus_dec_cfg_t dec_cfg = {
+            .sample_rate = 16000,
+            .channel = ESP_AUDIO_MONO,
+            .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(duration),
+            .self_delimited = false,
+        };
+        void* decoder = nullptr;
+        esp_opus_dec_open(&dec_cfg, sizeof(esp_opus_dec_cfg_t), &decoder);
+        if (decoder == nullptr) {
+            ESP_LOGE(TAG, "Failed to open the %d ms decoder", duration);
+            continue;
+        }
+        HeapUsage decoder_used = decoder_heap.Used();
+        CaseTimer decode;
+        for (auto& packet : packets) {
+            esp_audio_dec_in_raw_t raw = {
+                .buffer = packet.data(),
+                .len = (uint32_t)packet.size(),
+                .consumed = 0,
+                .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
+            };
+            esp_audio_dec_out_frame_t frame = {
+                .buffer = (uint8_t*)pcm.data(),
+                .len = (uint32_t)(pcm.size() * sizeof(int16_t)),
+                .decoded_size = 0,
+            };
+            esp_audio_dec_info_t info = {};
+            decode.Begin();
+            auto ret = esp_opus_dec_decode(decoder, &raw, &frame, &info);
+            decode.End();
+            if (ret != ESP_AUDIO_ERR_OK) {
+                ESP_LOGE(TAG, "Opus decode failed: %d", ret);
+                break;
+            }
+        }
+        decode.Report(results, "opus_dec_" + std::to_string(duration) + "ms", decoder_used);
+        esp_opus_dec_close(decoder);
+    }
+}
+
+void RunOpusComplexity(cJSON* results) {
+    auto us = Benchmark::MeasureOpusComplexity(10);
+    if (us.empty()) {
+        return;
+    }
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "case", "opus_enc_60ms_complexity");
+    cJSON_AddItemToObject(json, "us", cJSON_CreateIntArray(us.data(), us.size()));
+    char* line = cJSON_PrintUnformatted(json);
+    printf("BENCH:%s\n", line);
+    cJSON_free(line);
+    cJSON_AddItemToArray(results, json);
+}
+
+// 20 ms mono blocks, as the audio service feeds them, through esp_ae_rate_cvt and the polyphase filters
+void RunResample(cJSON* results) {
+    const struct {
+        int src;
+        int dest;
+    } rates[] = {{16000, 24000}, {16000, 48000}, {24000, 16000}, {24000, 48000}, {48000, 16000}};
+    for (auto& rate : rates) {
+        for (bool polyphase : {false, true}) {
+            HeapMark heap;
+            Resampler resampler;
+            if (!resampler.Open(rate.src, rate.dest, 1, polyphase)) {
+                ESP_LOGE(TAG, "Failed to open the %d -> %d resampler", rate.src, rate.dest);
+                continue;
+            }
+            if (resampler.polyphase() != polyphase) {
+                continue;
+            }
+            std::vector<int16_t> in(rate.src / 50);
+            uint32_t sample = 0;
+            FillPcm(in, sample);
+            std::vector<int16_t> out(resampler.MaxOutputFrames(in.size()));
+            // The first block builds the coefficient tables of the ratio
+            resampler.Process(in.data(), in.size(), out.data());
+            HeapUsage used = heap.Used();
+
+            CaseTimer timer;
+            while (!timer.Done()) {
+                timer.Begin();
+                resampler.Process(in.data(), in.size(), out.data());
+                timer.End();
+            }
+            timer.Report(results, std::string(polyphase ? "resample_poly_" : "resample_") + std::to_string(rate.src / 1000) +
+                "k_" + std::to_string(rate.dest / 1000) + "k", used, in.size() * sizeof(int16_t));
+        }
+    }
+}
+
+// What the audio service pays per frame to reach the board codec: one virtual Read() behind the
+// inlined InputData(), here on a codec that returns at once. The pointer is opaque to the compiler,
+// which would otherwise devirtualize the call as it does for a build specialized to the board.
+void RunCodecDispatch(cJSON* results) {
+    HeapMark heap;
+    DummyAudioCodec dummy(16000, 16000);
+    AudioCodec* volatile codec = &dummy;
+    std::vector<int16_t> data(160);
+    HeapUsage used = heap.Used();
+
+    CaseTimer timer;
+    while (!timer.Done()) {
+        timer.Begin();
+        for (int i = 0; i < 64; i++) {
+            codec->InputData(data);
+        }
+        timer.End();
+    }
+    timer.Report(results, "codec_dispatch_x64", used);
+}
+
+// The camera frame copy with its byte order swapped, PSRAM to PSRAM as from the capture buffer,
+// against the halfword loop it replaced and a plain memcpy of the same frame
+void RunPixelSwap(cJSON* results) {
+    struct Resolution {
+        int width;
+        int height;
+    };
+    const Resolution resolutions[] = {{320, 240}, {640, 480}, {1280, 720}};
+    for (auto& resolution : resolutions) {
+        size_t pixels = (size_t)resolution.width * resolution.height;
+        std::string name = std::to_string(resolution.width) + "x" + std::to_string(resolution.height);
+        HeapMark heap;
+        auto src = (uint16_t*)heap_caps_aligned_alloc(64, pixels * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        auto dst = (uint16_t*)heap_caps_aligned_alloc(64, pixels * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (src == nullptr || dst == nullptr) {
+            ESP_LOGW(TAG, "pixel_swap %s: not enough PSRAM", name.c_str());
+            heap_caps_free(src);
+            heap_caps_free(dst);
+            continue;
+        }
+        HeapUsage used = heap.Used();
+        for (size_t i = 0; i < pixels; i++) {
+            src[i] = (uint16_t)(i * 2654435761u >> 16);
+        }
+
+        CaseTimer swap_timer;
+        while (!swap_timer.Done()) {
+            swap_timer.Begin();
+            SwapPixelBytes(src, dst, pixels);
+            swap_timer.End();
+        }
+        swap_timer.Report(results, "pixel_swap_" + name, used, pixels * 2);
+
+        CaseTimer scalar_timer;
+        while (!scalar_timer.Done()) {
+            scalar_timer.Begin();
+            for (size_t i = 0; i < pixels; i++) {
+                dst[i] = __builtin_bswap16(src[i]);
+            }
+            scalar_timer.End();
+        }
+        scalar_timer.Report(results, "pixel_swap_scalar_" + name, used, pixels * 2);
+
+        CaseTimer copy_timer;
+        while (!copy_timer.Done()) {
+            copy_timer.Begin();
+            memcpy(dst, src, pixels * 2);
+            copy_timer.End();
+        }
+        copy_timer.Report(results, "pixel_copy_" + name, used, pixels * 2);
+
+        heap_caps_free(src);
+        heap_caps_free(dst);
+    }
+}
+
+// The UDP audio channel encrypts every packet with AES-128-CTR
+void RunAesCtr(cJSON* results) {
+    const size_t sizes[] = {128, 1024};
+    const uint8_t key[16] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+    for (size_t size : sizes) {
+        HeapMark heap;
+        mbedtls_aes_context aes;
+        mbedtls_aes_init(&aes);
+        mbedtls_aes_setkey_enc(&aes, key, 128);
+        std::vector<uint8_t> in(size, 0x5a);
+        std::vector<uint8_t> out(size);
+        HeapUsage used = heap.Used();
+
+        CaseTimer timer;
+        while (!timer.Done()) {
+            uint8_t nonce[16] = {};
+            uint8_t stream_block[16] = {};
+            size_t nc_off = 0;
+            timer.Begin();
+            mbedtls_aes_crypt_ctr(&aes, size, &nc_off, nonce, stream_block, in.data(), out.data());
+            timer.End();
+        }
+        timer.Report(results, "aes_ctr_" + std::to_string(size) + "B", used, size);
+        mbedtls_aes_free(&aes);
+    }
+}
+
+void RunOggDemux(cJSON* results) {
+    auto ogg = Lang::Sounds::OGG_POPUP;
+    HeapMark heap;
+    auto demuxer = std::make_unique<OggDemuxer>();
+    int packets = 0;
+    demuxer->OnDemuxerFinished([&packets](const uint8_t* data, int sample_rate, size_t len) {
+        packets++;
+    });
+    HeapUsage used = heap.Used();
+
+    CaseTimer timer;
+    while (!timer.Done()) {
+        demuxer->Reset();
+        timer.Begin();
+        demuxer->Process((const uint8_t*)ogg.data(), ogg.size());
+        timer.End();
+    }
+    if (packets == 0) {
+        ESP_LOGW(TAG, "The Ogg demuxer found no packet");
+    }
+    timer.Report(results, "ogg_demux", used, ogg.size());
+}
+
+#ifndef CONFIG_IDF_TARGET_ESP32
+// An RGB565 gradient, smooth enough to compress like a camera frame
+void RunJpeg(cJSON* results) {
+    const uint16_t width = 320, height = 240;
+    std::vector<uint16_t> image(width * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            image[y * width + x] = ((x * 31 / width) << 11) | ((y * 63 / height) << 5) | ((x + y) & 31);
+        }
+    }
+
+    HeapMark heap;
+    size_t jpeg_size = 0;
+    auto count = [](void* arg, size_t index, const void* data, size_t len) -> size_t {
+        *(size_t*)arg += len;
+        return len;
+    };
+    CaseTimer timer;
+    while (!timer.Done()) {
+        jpeg_size = 0;
+        timer.Begin();
+        bool ok = image_to_jpeg_cb((uint8_t*)image.data(), image.size() * sizeof(uint16_t), width, height,
+            V4L2_PIX_FMT_RGB565, 80, count, &jpeg_size);
+        timer.End();
+        if (!ok) {
+            ESP_LOGE(TAG, "JPEG encode failed");
+            break;
+        }
+    }
+    // The hardware encoder keeps its engine and buffers once created, so they show as held
+#if CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
+    timer.Report(results, "jpeg_encode_hw_320x240", heap.Used(), image.size() * sizeof(uint16_t));
+#else
+    timer.Report(results, "jpeg_encode_sw_320x240", heap.Used(), image.size() * sizeof(uint16_t));
+#endif
+}
+#endif
+
+// A 128x128 four frame GIF with a 128 color palette. Every LZW code is a literal at 8 bits, with a
+// clear code before the table would grow to 9 bits, so no encoder is needed.
+std::vector<uint8_t> BuildGif(uint16_t width, uint16_t height, int frames) {
+    std::vector<uint8_t> gif = {'G', 'I', 'F', '8', '9', 'a'};
+    auto put16 = [&gif](uint16_t value) {
+        gif.push_back(value & 0xFF);
+        gif.push_back(value >> 8);
+    };
+    put16(width);
+    put16(height);
+    gif.insert(gif.end(), {0xF6, 0, 0});
+    for (int i = 0; i < 128; i++) {
+        gif.insert(gif.end(), {(uint8_t)(i * 2), (uint8_t)(255 - i * 2), (uint8_t)(i & 0x40 ? 255 : 0)});
+    }
+    // Loop forever
+    gif.insert(gif.end(), {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0, 0, 0});
+
+    for (int frame = 0; frame < frames; frame++) {
+        gif.insert(gif.end(), {0x21, 0xF9, 0x04, 0x00, 0x0A, 0x00, 0x00, 0x00});
+        gif.push_back(0x2C);
+        put16(0);
+        put16(0);
+        put16(width);
+        put16(height);
+        gif.push_back(0);
+        gif.push_back(7);
+
+        std::vector<uint8_t> codes;
+        for (int i = 0; i < width * height; i++) {
+            if (i % 100 == 0) {
+                codes.push_back(128);
+            }
+            codes.push_back((i % width + i / width + frame * 8) & 127);
+        }
+        codes.push_back(129);
+        for (size_t offset = 0; offset < codes.size(); offset += 255) {
+            size_t length = std::min<size_t>(255, codes.size() - offset);
+            gif.push_back(length);
+            gif.insert(gif.end(), codes.begin() + offset, codes.begin() + offset + length);
+        }
+        gif.push_back(0);
+    }
+    gif.push_back(0x3B);
+    return gif;
+}
+
+void RunGif(cJSON* results) {
+    auto data = BuildGif(128, 128, 4);
+    HeapMark heap;
+    gd_GIF* gif = gd_open_gif_data(data.data());
+    if (gif == nullptr) {
+        ESP_LOGE(TAG, "Failed to open the GIF");
+        return;
+    }
+    HeapUsage used = heap.Used();
+
+    CaseTimer timer;
+    while (!timer.Done()) {
+        timer.Begin();
+        if (gd_get_frame(gif) == 0) {
+            gd_rewind(gif);
+            gd_get_frame(gif);
+        }
+        gd_render_frame(gif, gif->canvas);
+        timer.End();
+    }
+    timer.Report(results, "gif_frame_128x128", used);
+    gd_close_gif(gif);
+}
+
+// A full screen refresh, rendering and flushing to the panel
+void RunLvglRefresh(cJSON* results) {
+    auto display = dynamic_cast<LvglDisplay*>(Board::GetInstance().GetDisplay());
+    if (display == nullptr) {
+        return;
+    }
+    HeapMark heap;
+    CaseTimer timer;
+    while (!timer.Done()) {
+        DisplayLockGuard lock(display);
+        lv_obj_invalidate(lv_screen_active());
+        timer.Begin();
+        lv_refr_now(nullptr);
+        timer.End();
+    }
+    auto screen = lv_display_get_default();
+    timer.Report(results, "lvgl_refresh_" + std::to_string(lv_display_get_horizontal_resolution(screen)) + "x" +
+        std::to_string(lv_display_get_vertical_resolution(screen)), heap.Used());
+}
+
+// Settings commits while the audio input runs, the reads they hold up are what a user would hear
+// as a glitch. Needs the microphone running, i.e. listening or waiting for the wake word.
+void RunFlashStall(cJSON* results) {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    audio_service.ResetInputTiming();
+    vTaskDelay(pdMS_TO_TICKS(BENCHMARK_FLASH_COMMIT_INTERVAL_MS));
+    auto before = audio_service.GetDebugStatistics();
+
+    int64_t start_us = esp_timer_get_time();
+    int64_t commit_us_max = 0;
+    for (int i = 0; i < BENCHMARK_FLASH_COMMITS; i++) {
+        {
+            Settings settings("benchmark", true);
+            settings.SetInt("commit", i);
+        }
+        int64_t commit_start = esp_timer_get_time();
+        Settings::Flush();
+        commit_us_max = std::max(commit_us_max, esp_timer_get_time() - commit_start);
+        vTaskDelay(pdMS_TO_TICKS(BENCHMARK_FLASH_COMMIT_INTERVAL_MS));
+    }
+    {
+        Settings settings("benchmark", true);
+        settings.EraseKey("commit");
+    }
+    Settings::Flush();
+    int64_t elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+
+    auto after = audio_service.GetDebugStatistics();
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "case", "flash_stall");
+    cJSON_AddNumberToObject(json, "commits", BENCHMARK_FLASH_COMMITS);
+    cJSON_AddNumberToObject(json, "commit_us_max", (double)commit_us_max);
+    cJSON_AddNumberToObject(json, "ms", (double)elapsed_ms);
+    cJSON_AddNumberToObject(json, "reads", after.input_count - before.input_count);
+    cJSON_AddNumberToObject(json, "stalls", after.input_stalls - before.input_stalls);
+    cJSON_AddNumberToObject(json, "max_gap_ms", after.input_max_gap_ms);
+    cJSON_AddNumberToObject(json, "input_cycles_min", after.input_cycles_min);
+    cJSON_AddNumberToObject(json, "input_cycles_max", after.input_cycles_max);
+#if CONFIG_AUDIO_HOT_PATH_IN_IRAM
+    cJSON_AddBoolToObject(json, "iram", true);
+#else
+    cJSON_AddBoolToObject(json, "iram", false);
+#endif
+    char* line = cJSON_PrintUnformatted(json);
+    printf("BENCH:%s\n", line);
+    cJSON_free(line);
+    cJSON_AddItemToArray(results, json);
+}
+
+} // namespace
+
+cJSON* Benchmark::Run() {
+    // Fixed CPU frequency, or the cycles would follow the DFS policy
+    DfsBoost boost;
+    cJSON* results = cJSON_CreateArray();
+
+    cJSON* info = cJSON_CreateObject();
+    cJSON_AddStringToObject(info, "chip", CONFIG_IDF_TARGET);
+    cJSON_AddNumberToObject(info, "cpu_mhz", CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+    cJSON_AddStringToObject(info, "version", esp_app_get_description()->version);
+    char* line = cJSON_PrintUnformatted(info);
+    printf("BENCH:%s\n", line);
+    cJSON_free(line);
+    cJSON_AddItemToArray(results, info);
+
+    ESP_LOGI(TAG, "Running benchmarks");
+    RunOpus(results);
+    RunOpusComplexity(results);
+    RunResample(results);
+    RunCodecDispatch(results);
+    RunAesCtr(results);
+    RunOggDemux(results);
+#ifndef CONFIG_IDF_TARGET_ESP32
+    RunJpeg(results);
+#endif
+    RunPixelSwap(results);
+    RunGif(results);
+    RunLvglRefresh(results);
+    RunFlashStall(results);
+    ESP_LOGI(TAG, "Benchmarks done");
+    return results;
+}
+
+std::vector<int> Benchmark::MeasureOpusComplexity(int max_complexity, int stop_us, std::vector<int>* stack_free) {
+    DfsBoost boost;
+    std::vector<int> results;
+    std::vector<int16_t> pcm;
+    std::vector<uint8_t> out;
+    uint32_t sample = 0;
+    for (int complexity = 0; complexity <= max_complexity; complexity++) {
+        esp_opus_enc_config_t enc_cfg = AS_OPUS_ENC_CONFIG();
+        enc_cfg.frame_duration = (esp_opus_enc_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(BENCHMARK_COMPLEXITY_FRAME_MS);
+        enc_cfg.complexity = complexity;
+        enc_cfg.enable_dtx = false;
+        void* encoder = nullptr;
+        esp_opus_enc_open(&enc_cfg, sizeof(esp_opus_enc_config_t), &encoder);
+        if (encoder == nullptr) {
+            ESP_LOGE(TAG, "Failed to open the encoder at complexity %d", complexity);
+            break;
+        }
+        int frame_size = 0, outbuf_size = 0;
+        esp_opus_enc_get_frame_size(encoder, &frame_size, &outbuf_size);
+        pcm.resize(frame_size / sizeof(int16_t));
+        out.resize(outbuf_size);
+
+        // The least of the frames leaves out preemption and the cold cache of the first one
+        uint32_t min_cycles = UINT32_MAX;
+        for (int i = 0; i < BENCHMARK_COMPLEXITY_FRAMES; i++) {
+            FillPcm(pcm, sample);
+            esp_audio_enc_in_frame_t in = {
+                .buffer = (uint8_t*)pcm.data(),
+                .len = (uint32_t)frame_size,
+            };
+            esp_audio_enc_out_frame_t frame = {
+                .buffer = out.data(),
+                .len = (uint32_t)out.size(),
+                .encoded_bytes = 0,
+            };
+            uint32_t start = esp_cpu_get_cycle_count();
+            auto ret = esp_opus_enc_process(encoder, &in, &frame);
+            uint32_t cycles = esp_cpu_get_cycle_count() - start;
+            if (ret != ESP_AUDIO_ERR_OK) {
+                ESP_LOGE(TAG, "Opus encode failed: %d", ret);
+                break;
+            }
+            min_cycles = std::min(min_cycles, cycles);
+        }
+        esp_opus_enc_close(encoder);
+        if (min_cycles == UINT32_MAX) {
+            break;
+        }
+        int us = min_cycles / CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+        results.push_back(us);
+        if (stack_free != nullptr) {
+            stack_free->push_back(uxTaskGetStackHighWaterMark(nullptr));
+        }
+        if (stop_us > 0 && us > stop_us) {
+            break;
+        }
+    }
+    return results;
+}
+
+// Measures the whole path from the link driver through lwIP and TLS to the application
+cJSON* Benchmark::RunDownload(const std::string& url, int max_seconds) {
+    auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
+    int64_t start_us = esp_timer_get_time();
+    if (!http->Open("GET", url)) {
+        ESP_LOGE(TAG, "Failed to open URL: %s", url.c_str());
+        return nullptr;
+    }
+    int status = http->GetStatusCode();
+
+    std::vector<char> buffer(16 * 1024);
+    size_t total = 0;
+    int64_t deadline_us = start_us + (int64_t)max_seconds * 1000000;
+    while (esp_timer_get_time() < deadline_us) {
+        int n = http->Read(buffer.data(), buffer.size());
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    int64_t elapsed_ms = std::max<int64_t>((esp_timer_get_time() - start_us) / 1000, 1);
+    http->Close();
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "case", "download");
+    cJSON_AddNumberToObject(json, "bytes", total);
+    cJSON_AddNumberToObject(json, "ms", elapsed_ms);
+    cJSON_AddNumberToObject(json, "kbps", (double)(total * 8 / elapsed_ms));
+    cJSON_AddNumberToObject(json, "status", status);
+    char* line = cJSON_PrintUnformatted(json);
+    printf("BENCH:%s\n", line);
+    cJSON_free(line);
+    return json;
+}
@@ -0,0 +1,44 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <cJSON.h>
+#include <string>
+#include <vector>
+
+/**
+ * Benchmark - Repeatable on-target microbenchmarks of the hot kernels
+ *
+ * Covers Opus encode and decode at every supported frame duration, resampling between 16k, 24k
+ * and 48k, AES-CTR as used by the UDP audio channel, the Ogg demuxer, JPEG encoding, the camera
+ * pixel byte swap at 320x240, 640x480 and 720p, GIF decoding and full LVGL refreshes. All inputs are synthetic or built into the firmware, so runs on the
+ * same chip and build compare directly.
+ *
+ * MeasureOpusComplexity() is the short encoder case the audio service runs at boot to pick the uplink
+ * complexity, Run() reports it for all complexities as opus_enc_60ms_complexity with "us" an array.
+ *
+ * Each case prints one "BENCH:" line of JSON on the console, for collecting runs from a serial
+ * log, and is returned in the array of Run():
+ * {"case":name,"iterations":n,"cycles":mean,"cycles_min":min,"cycles_max":max,"us":mean,
+ *  "heap_internal":bytes,"heap_spiram":bytes}
+ * where heap is what the case holds while it runs, e.g. the codec state. The first line carries
+ * the chip, CPU frequency and firmware version.
+ *
+ * The last case, flash_stall, commits Settings while the microphone runs and reports the audio
+ * input reads held up meanwhile and the hot path cycles, with and without AUDIO_HOT_PATH_IN_IRAM.
+ *
+ * Run() takes several seconds and must run on core 0, the cycle counter is per core.
+ */
+class Benchmark {
+public:
+    static cJSON* Run();
+    // Downloads the URL through the board network for at most max_seconds and discards the body:
+    // {"case":"download","bytes":n,"ms":t,"kbps":rate,"status":http_status}, nullptr if it cannot be opened
+    static cJSON* RunDownload(const std::string& url, int max_seconds);
+    // Encode time of a 60 ms frame, the least of a few, at each complexity from 0 up to max_complexity in
+    // microseconds at the default CPU frequency. Stops after the first one above stop_us, 0 measures all.
+    // Runs on the calling task, empty if no encoder could be opened. stack_free gets the stack high water
+    // mark of the calling task in bytes after each complexity.
+    static std::vector<int> MeasureOpusComplexity(int max_complexity, int stop_us = 0, std::vector<int>* stack_free = nullptr);
+};
+
+#endif // BENCHMARK_H
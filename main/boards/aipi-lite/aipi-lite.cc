@@ -20,6 +20,7 @@
 #include "power_save_timer.h"
 #include "system_reset.h"
 #include "wifi_board.h"
+#include "settings.h"
 
 #define TAG "AIPI-Lite"
 
@@ -59,6 +60,7 @@ class AIPILite : public WifiBoard {
             esp_lcd_panel_disp_on_off(panel_, false);  // 关闭显示
             rtc_gpio_set_level(POWER_CONTROL_PIN, 0);
             rtc_gpio_hold_dis(POWER_CONTROL_PIN);
+            Settings::Flush();
             esp_deep_sleep_start();
         });
         power_save_timer_->SetEnabled(true);
@@ -166,6 +168,7 @@ class AIPILite : public WifiBoard {
                 esp_lcd_panel_disp_on_off(panel_, false);  // 关闭显示
                 rtc_gpio_set_level(POWER_CONTROL_PIN, 0);
                 rtc_gpio_hold_dis(POWER_CONTROL_PIN);
+                Settings::Flush();
                 esp_deep_sleep_start();
             }
         });
@@ -23,6 +23,7 @@ class ATK_NoAudioCodecDuplex : public NoAudioCodec {
 public:
     ATK_NoAudioCodecDuplex(int input_sample_rate, int output_sample_rate, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din) {
         duplex_ = true;
+        software_volume_ = true;
         input_sample_rate_ = input_sample_rate;
         output_sample_rate_ = output_sample_rate;
     
@@ -76,6 +77,9 @@ public:
         ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle_, &std_cfg));
         ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle_, &std_cfg));
         ESP_LOGI(TAG, "Duplex channels created");
+#if CONFIG_USE_SOFTWARE_AEC_REFERENCE
+        AttachReference();
+#endif
     }
 };
 
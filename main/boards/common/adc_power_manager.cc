@@ -0,0 +1,170 @@
+#include "adc_power_manager.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+
+#define TAG "AdcPowerManager"
+
+// Sampling period while the filter fills up, then between two readings
+#define BATTERY_FILL_INTERVAL_US (1000 * 1000)
+#define BATTERY_READ_INTERVAL_US (60 * 1000 * 1000LL)
+#define BATTERY_READ_SLACK_US (10 * 1000 * 1000LL)
+// The charger indicator is read again this long after its last edge
+#define CHARGING_DEBOUNCE_US (50 * 1000)
+#define CHARGING_DEBOUNCE_SLACK_US (20 * 1000)
+
+AdcPowerManager::AdcPowerManager(const AdcPowerManagerConfig& config) : config_(config) {
+    // 初始化 ADC
+    adc_oneshot_unit_init_cfg_t init_config = {
+        .unit_id = config_.adc_unit,
+        .ulp_mode = ADC_ULP_MODE_DISABLE,
+    };
+    ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config, &adc_handle_));
+
+    adc_oneshot_chan_cfg_t chan_config = {
+        .atten = config_.adc_atten,
+        .bitwidth = config_.adc_bitwidth,
+    };
+    ESP_ERROR_CHECK(adc_oneshot_config_channel(adc_handle_, config_.adc_channel, &chan_config));
+
+    auto& wheel = TimerWheel::GetInstance();
+    battery_timer_ = wheel.Create("battery_check", [this]() {
+        ReadBatteryAdcData();
+    });
+
+    // 初始化充电引脚，充电状态变化由中断触发检查
+    if (config_.charging_pin != GPIO_NUM_NC) {
+        gpio_config_t io_conf = {};
+        io_conf.intr_type = GPIO_INTR_ANYEDGE;
+        io_conf.mode = GPIO_MODE_INPUT;
+        io_conf.pin_bit_mask = (1ULL << config_.charging_pin);
+        io_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
+        io_conf.pull_up_en = config_.charging_pull_up ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE;
+        ESP_ERROR_CHECK(gpio_config(&io_conf));
+
+        charging_timer_ = wheel.Create("charging_check", [this]() {
+            CheckChargingStatus();
+        });
+        esp_err_t err = gpio_install_isr_service(0);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            ESP_ERROR_CHECK(err);
+        }
+        ESP_ERROR_CHECK(gpio_isr_handler_add(config_.charging_pin, ChargingPinIsrHandler, this));
+        is_charging_ = gpio_get_level(config_.charging_pin) == config_.charging_active_level;
+    }
+
+    ReadBatteryAdcData();
+    wheel.StartPeriodic(battery_timer_, BATTERY_FILL_INTERVAL_US);
+}
+
+AdcPowerManager::~AdcPowerManager() {
+    if (config_.charging_pin != GPIO_NUM_NC) {
+        gpio_isr_handler_remove(config_.charging_pin);
+    }
+    auto& wheel = TimerWheel::GetInstance();
+    wheel.Delete(charging_timer_);
+    wheel.Delete(battery_timer_);
+    if (adc_handle_) {
+        adc_oneshot_del_unit(adc_handle_);
+    }
+}
+
+void IRAM_ATTR AdcPowerManager::ChargingPinIsrHandler(void* arg) {
+    // The timer wheel takes a mutex, so the debounce timer is started from the timer service task
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    xTimerPendFunctionCallFromISR(OnChargingPinChanged, arg, 0, &higher_priority_task_woken);
+    portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+
+void AdcPowerManager::OnChargingPinChanged(void* arg, uint32_t) {
+    auto self = static_cast<AdcPowerManager*>(arg);
+    TimerWheel::GetInstance().StartOnce(self->charging_timer_, CHARGING_DEBOUNCE_US, CHARGING_DEBOUNCE_SLACK_US);
+}
+
+void AdcPowerManager::CheckChargingStatus() {
+    if (config_.charging_pin == GPIO_NUM_NC) {
+        return;
+    }
+    bool new_charging_status = gpio_get_level(config_.charging_pin) == config_.charging_active_level;
+    if (new_charging_status != is_charging_) {
+        is_charging_ = new_charging_status;
+        if (on_charging_status_changed_) {
+            on_charging_status_changed_(is_charging_);
+        }
+        ReadBatteryAdcData();
+    }
+}
+
+void AdcPowerManager::ReadBatteryAdcData() {
+    int adc_value;
+    ESP_ERROR_CHECK(adc_oneshot_read(adc_handle_, config_.adc_channel, &adc_value));
+
+    bool was_full = adc_filter_.IsFull();
+    adc_filter_.Push(adc_value);
+    uint32_t average_adc = adc_filter_.Average();
+
+    const auto& levels = config_.levels;
+    const int count = sizeof(levels) / sizeof(levels[0]);
+    // 低于最低值时
+    if (average_adc < levels[0].adc) {
+        battery_level_ = 0;
+    }
+    // 高于最高值时
+    else if (average_adc >= levels[count - 1].adc) {
+        battery_level_ = 100;
+    } else {
+        // 线性插值计算中间值
+        for (int i = 0; i < count - 1; i++) {
+            if (average_adc >= levels[i].adc && average_adc < levels[i + 1].adc) {
+                float ratio = static_cast<float>(average_adc - levels[i].adc) / (levels[i + 1].adc - levels[i].adc);
+                battery_level_ = levels[i].level + ratio * (levels[i + 1].level - levels[i].level);
+                break;
+            }
+        }
+    }
+
+    // Check low battery status
+    if (adc_filter_.IsFull()) {
+        bool new_low_battery_status = battery_level_ <= config_.low_battery_level;
+        if (new_low_battery_status != is_low_battery_) {
+            is_low_battery_ = new_low_battery_status;
+            if (on_low_battery_status_changed_) {
+                on_low_battery_status_changed_(is_low_battery_);
+            }
+        }
+        // 电池电量数据充足后，降低采样频率
+        if (!was_full) {
+            TimerWheel::GetInstance().StartPeriodic(battery_timer_, BATTERY_READ_INTERVAL_US, BATTERY_READ_SLACK_US);
+        }
+    }
+
+    ESP_LOGI(TAG, "ADC value: %d average: %lu level: %u", adc_value, (unsigned long)average_adc, battery_level_);
+}
+
+bool AdcPowerManager::IsCharging() {
+    if (config_.charging_pin == GPIO_NUM_NC) {
+        return false;
+    }
+    // 如果电量已经满了，则不再显示充电中
+    if (config_.hide_charging_when_full && battery_level_ == 100) {
+        return false;
+    }
+    return is_charging_;
+}
+
+bool AdcPowerManager::IsDischarging() {
+    if (config_.charging_pin == GPIO_NUM_NC) {
+        return false;
+    }
+    // 没有区分充电和放电，所以直接返回相反状态
+    return !is_charging_;
+}
+
+void AdcPowerManager::OnLowBatteryStatusChanged(std::function<void(bool)> callback) {
+    on_low_battery_status_changed_ = callback;
+}
+
+void AdcPowerManager::OnChargingStatusChanged(std::function<void(bool)> callback) {
+    on_charging_status_changed_ = callback;
+}
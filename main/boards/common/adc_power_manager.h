@@ -0,0 +1,95 @@
+#ifndef ADC_POWER_MANAGER_H
+#define ADC_POWER_MANAGER_H
+
+#include <driver/gpio.h>
+#include <esp_adc/adc_oneshot.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "timer_wheel.h"
+
+// Fixed-size moving average, the oldest sample is overwritten once the ring is full
+template <typename T, size_t N>
+class RingAverageFilter {
+public:
+    void Push(T value) {
+        sum_ += value;
+        if (count_ == N) {
+            sum_ -= values_[index_];
+        } else {
+            count_++;
+        }
+        values_[index_] = value;
+        index_ = (index_ + 1) % N;
+    }
+    T Average() const { return count_ == 0 ? 0 : sum_ / count_; }
+    bool IsFull() const { return count_ == N; }
+    size_t Size() const { return count_; }
+
+private:
+    T values_[N] = {};
+    uint32_t sum_ = 0;
+    size_t index_ = 0;
+    size_t count_ = 0;
+};
+
+struct AdcBatteryLevel {
+    uint16_t adc;
+    uint8_t level;
+};
+
+struct AdcPowerManagerConfig {
+    gpio_num_t charging_pin = GPIO_NUM_NC;   // 充电指示引脚，NC 表示不检测充电状态
+    int charging_active_level = 1;
+    bool charging_pull_up = false;
+    bool hide_charging_when_full = true;     // 电量已满时不再显示充电中
+    adc_unit_t adc_unit = ADC_UNIT_1;
+    adc_channel_t adc_channel = ADC_CHANNEL_0;
+    adc_atten_t adc_atten = ADC_ATTEN_DB_12;
+    adc_bitwidth_t adc_bitwidth = ADC_BITWIDTH_12;
+    AdcBatteryLevel levels[6];               // ADC 值递增，电量 0 到 100
+    uint8_t low_battery_level = 20;
+};
+
+/*
+ * Battery level from a divided ADC reading and charger state from an indicator pin.
+ *
+ * The pin raises an interrupt on each edge and is checked after a short debounce, so the charger
+ * state costs no polling. The ADC is sampled on the shared TimerWheel, once a second until the
+ * filter is full and then once a minute with generous slack, so it ticks along with other timers.
+ */
+class AdcPowerManager {
+public:
+    AdcPowerManager(const AdcPowerManagerConfig& config);
+    virtual ~AdcPowerManager();
+
+    bool IsCharging();
+    bool IsDischarging();
+    uint8_t GetBatteryLevel() { return battery_level_; }
+
+    void OnLowBatteryStatusChanged(std::function<void(bool)> callback);
+    void OnChargingStatusChanged(std::function<void(bool)> callback);
+
+private:
+    static constexpr size_t kBatteryAdcDataCount = 3;
+
+    AdcPowerManagerConfig config_;
+    adc_oneshot_unit_handle_t adc_handle_ = nullptr;
+    TimerWheel::Handle battery_timer_ = nullptr;
+    TimerWheel::Handle charging_timer_ = nullptr;
+    RingAverageFilter<uint16_t, kBatteryAdcDataCount> adc_filter_;
+    std::function<void(bool)> on_charging_status_changed_;
+    std::function<void(bool)> on_low_battery_status_changed_;
+    uint8_t battery_level_ = 0;
+    bool is_charging_ = false;
+    bool is_low_battery_ = false;
+
+    static void IRAM_ATTR ChargingPinIsrHandler(void* arg);
+    static void OnChargingPinChanged(void* arg, uint32_t);
+    void CheckChargingStatus();
+    void ReadBatteryAdcData();
+};
+
+#endif // ADC_POWER_MANAGER_H
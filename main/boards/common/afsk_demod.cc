@@ -20,10 +20,18 @@ namespace audio_wifi_config
                                     )
     {
         const int kInputSampleRate = 16000;                                    // Input sampling rate
-        const float kDownsampleStep = static_cast<float>(kInputSampleRate) / static_cast<float>(kAudioSampleRate); // Downsampling step
+        const int kReadSamples = 480;                                          // 16kHz, 480 samples corresponds to 30ms data
         std::vector<int16_t> audio_data;
+        // Buffers are reused across reads, the loop doesn't allocate once they reach their size
+        std::vector<int16_t> downsampled_data;
+        downsampled_data.reserve(kReadSamples * kAudioSampleRate / kInputSampleRate + 1);
+        std::vector<int16_t> multi_tone_data;
+        multi_tone_data.reserve(kReadSamples * kMultiToneSampleRate / kInputSampleRate);
+        std::vector<float> probabilities;
+        probabilities.reserve(kReadSamples / (kInputSampleRate / kBitRate) + 1);
         AudioSignalProcessor signal_processor(kAudioSampleRate, kMarkFrequency, kSpaceFrequency, kBitRate, kWindowSize);
         AudioDataBuffer data_buffer;
+        MultiToneReceiver multi_tone_receiver;
 
         while (true)
         {
@@ -34,74 +42,70 @@ namespace audio_wifi_config
                 continue;
             }
             
-            if (!app->GetAudioService().ReadAudioData(audio_data, 16000, 480)) { // 16kHz, 480 samples corresponds to 30ms data
+            if (!app->GetAudioService().ReadAudioData(audio_data, kInputSampleRate, kReadSamples)) {
                 // 读取音频失败，短暂延迟后重试
                 ESP_LOGI(kLogTag, "Failed to read audio data, retrying.");
                 vTaskDelay(pdMS_TO_TICKS(10));
                 continue;
             }
 
-            if (input_channels == 2) { // 如果是双声道输入，转换为单声道
-                auto mono_data = std::vector<int16_t>(audio_data.size() / 2);
-                for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                    mono_data[i] = audio_data[j];
+            // Downsample the first channel, picking the first input sample of every output period
+            // 如果是双声道输入，只取第一个声道
+            size_t frames = audio_data.size() / input_channels;
+            downsampled_data.clear();
+            size_t next_index = 0;
+            for (size_t i = 0; i < frames; ++i) {
+                size_t sample_index = i * kAudioSampleRate / kInputSampleRate;
+                if (sample_index >= next_index) {
+                    downsampled_data.push_back(audio_data[i * input_channels]);
+                    next_index = sample_index + 1;
                 }
-                audio_data = std::move(mono_data);
             }
             
-            // Downsample the audio data
-            std::vector<float> downsampled_data;
-            size_t last_index = 0;
-
-            if (kDownsampleStep > 1.0f) {
-                downsampled_data.reserve(audio_data.size() / static_cast<size_t>(kDownsampleStep));
-                for (size_t i = 0; i < audio_data.size(); ++i) {
-                    size_t sample_index = static_cast<size_t>(i / kDownsampleStep);
-                    if ((sample_index + 1) > last_index) {
-                        downsampled_data.push_back(static_cast<float>(audio_data[i]));
-                        last_index = sample_index + 1;
-                    }
-                }
-            } else {
-                downsampled_data.reserve(audio_data.size());
-                for (int16_t sample : audio_data) {
-                    downsampled_data.push_back(static_cast<float>(sample));
-                }
+            // The multi-tone band goes up to 3.6 kHz, averaging sample pairs halves the rate and damps aliasing
+            multi_tone_data.clear();
+            for (size_t i = 0; i + 1 < frames; i += 2) {
+                multi_tone_data.push_back((audio_data[i * input_channels] + audio_data[(i + 1) * input_channels]) / 2);
             }
-            
+
             // Process audio samples to get probability data
-            auto probabilities = signal_processor.ProcessAudioSamples(downsampled_data);
+            signal_processor.ProcessAudioSamples(downsampled_data.data(), downsampled_data.size(), probabilities);
             
-            // Feed probability data to the data buffer
+            // Feed probability data to the data buffer, and the 8 kHz samples to the multi-tone receiver
+            std::optional<std::string> decoded_text;
             if (data_buffer.ProcessProbabilityData(probabilities, 0.5f)) {
-                // If complete data was received, extract WiFi credentials
-                if (data_buffer.decoded_text.has_value()) {
-                    ESP_LOGI(kLogTag, "Received text data: %s", data_buffer.decoded_text->c_str());
-                    display->SetChatMessage("system", data_buffer.decoded_text->c_str());
-                    
-                    // Split SSID and password by newline character
-                    std::string wifi_ssid, wifi_password;
-                    size_t newline_position = data_buffer.decoded_text->find('\n');
-                    if (newline_position != std::string::npos) {
-                        wifi_ssid = data_buffer.decoded_text->substr(0, newline_position);
-                        wifi_password = data_buffer.decoded_text->substr(newline_position + 1);
-                        ESP_LOGI(kLogTag, "WiFi SSID: %s, Password: %s", wifi_ssid.c_str(), wifi_password.c_str());
-                    } else {
-                        ESP_LOGE(kLogTag, "Invalid data format, no newline character found");
-                        continue;
-                    }
-                    
-                    // Save WiFi credentials using SsidManager
-                    auto& ssid_manager = SsidManager::GetInstance();
-                    ssid_manager.AddSsid(wifi_ssid, wifi_password);
-                    ESP_LOGI(kLogTag, "WiFi credentials saved successfully");
-                    
-                    // Exit config mode (triggers ConfigModeExit event)
-                    wifi_manager->StopConfigAp();
-                    
-                    data_buffer.decoded_text.reset();  // Clear processed data
-                    return;  // Exit the function
+                decoded_text = std::move(data_buffer.decoded_text);
+                data_buffer.decoded_text.reset();  // Clear processed data
+            } else if (multi_tone_receiver.ProcessAudioSamples(multi_tone_data.data(), multi_tone_data.size())) {
+                decoded_text = std::move(multi_tone_receiver.decoded_text);
+                multi_tone_receiver.decoded_text.reset();
+            }
+
+            // If complete data was received, extract WiFi credentials
+            if (decoded_text.has_value()) {
+                ESP_LOGI(kLogTag, "Received text data: %s", decoded_text->c_str());
+                display->SetChatMessage("system", decoded_text->c_str());
+                
+                // Split SSID and password by newline character
+                std::string wifi_ssid, wifi_password;
+                size_t newline_position = decoded_text->find('\n');
+                if (newline_position != std::string::npos) {
+                    wifi_ssid = decoded_text->substr(0, newline_position);
+                    wifi_password = decoded_text->substr(newline_position + 1);
+                    ESP_LOGI(kLogTag, "WiFi SSID: %s, Password: %s", wifi_ssid.c_str(), wifi_password.c_str());
+                } else {
+                    ESP_LOGE(kLogTag, "Invalid data format, no newline character found");
+                    continue;
                 }
+                
+                // Save WiFi credentials using SsidManager
+                auto& ssid_manager = SsidManager::GetInstance();
+                ssid_manager.AddSsid(wifi_ssid, wifi_password);
+                ESP_LOGI(kLogTag, "WiFi credentials saved successfully");
+                
+                // Exit config mode (triggers ConfigModeExit event)
+                wifi_manager->StopConfigAp();
+                return;  // Exit the function
             }
             vTaskDelay(pdMS_TO_TICKS(1));  // 1ms delay
         }
@@ -119,46 +123,27 @@ namespace audio_wifi_config
     // FrequencyDetector implementation
     FrequencyDetector::FrequencyDetector(float frequency, size_t window_size)
         : frequency_(frequency), window_size_(window_size) {
-        frequency_bin_ = std::floor(frequency_ * static_cast<float>(window_size_));
-        angular_frequency_ = 2.0f * M_PI * frequency_;
-        cos_coefficient_ = std::cos(angular_frequency_);
-        sin_coefficient_ = std::sin(angular_frequency_);
-        filter_coefficient_ = 2.0f * cos_coefficient_;
-
-        // Initialize state buffer
-        state_buffer_.push_back(0.0f);
-        state_buffer_.push_back(0.0f);
+        float angular_frequency = 2.0f * M_PI * frequency_;
+        cos_coefficient_ = std::cos(angular_frequency);
+        sin_coefficient_ = std::sin(angular_frequency);
+        filter_coefficient_ = static_cast<int32_t>(std::lround(2.0f * cos_coefficient_ * (1 << 14)));
     }
 
     void FrequencyDetector::Reset() {
-        state_buffer_.clear();
-        state_buffer_.push_back(0.0f);
-        state_buffer_.push_back(0.0f);
+        s_minus_1_ = 0;
+        s_minus_2_ = 0;
     }
 
-    void FrequencyDetector::ProcessSample(float sample) {
-        if (state_buffer_.size() < 2) {
-            return;
+    void FrequencyDetector::ProcessBlock(const int16_t* samples, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            ProcessSample(samples[i]);
         }
-
-        float s_minus_2 = state_buffer_.front();  // S[-2]
-        state_buffer_.pop_front();
-        float s_minus_1 = state_buffer_.front();  // S[-1]
-        state_buffer_.pop_front();
-
-        float s_current = sample + filter_coefficient_ * s_minus_1 - s_minus_2;
-
-        state_buffer_.push_back(s_minus_1);  // Put S[-1] back
-        state_buffer_.push_back(s_current);  // Add new S[0]
     }
 
     float FrequencyDetector::GetAmplitude() const {
-        if (state_buffer_.size() < 2) {
-            return 0.0f;
-        }
-
-        float s_minus_1 = state_buffer_[1];                      // S[-1]
-        float s_minus_2 = state_buffer_[0];                      // S[-2]
+        // Once per window, so float is cheap enough here even without an FPU
+        float s_minus_1 = static_cast<float>(s_minus_1_);
+        float s_minus_2 = static_cast<float>(s_minus_2_);
         float real_part = cos_coefficient_ * s_minus_1 - s_minus_2;  // Real part
         float imaginary_part = sin_coefficient_ * s_minus_1;         // Imaginary part
 
@@ -169,7 +154,8 @@ namespace audio_wifi_config
     // AudioSignalProcessor implementation
     AudioSignalProcessor::AudioSignalProcessor(size_t sample_rate, size_t mark_frequency, size_t space_frequency,
                                              size_t bit_rate, size_t window_size)
-        : input_buffer_size_(window_size), output_sample_count_(0) {
+        : input_buffer_(window_size), window_(window_size), input_buffer_size_(window_size),
+          input_buffer_fill_(0), input_buffer_index_(0), output_sample_count_(0) {
         if (sample_rate % bit_rate != 0) {
             // On ESP32 we can continue execution, but log the error
             ESP_LOGW(kLogTag, "Sample rate %zu is not divisible by bit rate %zu", sample_rate, bit_rate);
@@ -184,24 +170,27 @@ namespace audio_wifi_config
         samples_per_bit_ = sample_rate / bit_rate;  // Number of samples per bit
     }
 
-    std::vector<float> AudioSignalProcessor::ProcessAudioSamples(const std::vector<float> &samples) {
-        std::vector<float> result;
+    void AudioSignalProcessor::ProcessAudioSamples(const int16_t* samples, size_t count, std::vector<float> &result) {
+        result.clear();
 
-        for (float sample : samples) {
-            if (input_buffer_.size() < input_buffer_size_) {
-                input_buffer_.push_back(sample);  // Just add, don't process yet
+        for (size_t n = 0; n < count; ++n) {
+            input_buffer_[input_buffer_index_] = samples[n];
+            input_buffer_index_ = (input_buffer_index_ + 1) % input_buffer_size_;
+            if (input_buffer_fill_ < input_buffer_size_) {
+                input_buffer_fill_++;  // Just add, don't process yet
             } else {
-                // Input buffer is full, process the data
-                input_buffer_.pop_front();   // Remove oldest sample
-                input_buffer_.push_back(sample);  // Add new sample
+                // Input buffer is full, count the new sample
                 output_sample_count_++;
 
                 if (output_sample_count_ >= samples_per_bit_) {
+                    // Unroll the ring into time order, the oldest sample sits at the write position
+                    size_t head = input_buffer_size_ - input_buffer_index_;
+                    std::copy(input_buffer_.begin() + input_buffer_index_, input_buffer_.end(), window_.begin());
+                    std::copy(input_buffer_.begin(), input_buffer_.begin() + input_buffer_index_, window_.begin() + head);
+
                     // Process all samples in the window using Goertzel algorithm
-                    for (float window_sample : input_buffer_) {
-                        mark_detector_->ProcessSample(window_sample);
-                        space_detector_->ProcessSample(window_sample);
-                    }
+                    mark_detector_->ProcessBlock(window_.data(), input_buffer_size_);
+                    space_detector_->ProcessBlock(window_.data(), input_buffer_size_);
 
                     float mark_amplitude = mark_detector_->GetAmplitude();   // Mark amplitude
                     float space_amplitude = space_detector_->GetAmplitude(); // Space amplitude
@@ -218,8 +207,6 @@ namespace audio_wifi_config
                 }
             }
         }
-
-        return result;
     }
 
     // AudioDataBuffer implementation
@@ -372,4 +359,253 @@ namespace audio_wifi_config
 
         return bytes;
     }
-}
+
+    // GF(16) arithmetic for the Reed-Solomon code, primitive polynomial x^4 + x + 1
+    static uint8_t gf_exp[30];
+    static uint8_t gf_log[16];
+
+    static void InitializeGaloisField() {
+        if (gf_exp[0] != 0) {
+            return;
+        }
+        uint8_t x = 1;
+        for (int i = 0; i < 15; ++i) {
+            gf_exp[i] = x;
+            gf_log[x] = i;
+            x <<= 1;
+            if (x & 0x10) {
+                x ^= 0x13;
+            }
+        }
+        for (int i = 15; i < 30; ++i) {
+            gf_exp[i] = gf_exp[i - 15];
+        }
+    }
+
+    static inline uint8_t GfMul(uint8_t a, uint8_t b) {
+        return (a == 0 || b == 0) ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+    }
+
+    static inline uint8_t GfDiv(uint8_t a, uint8_t b) {
+        return a == 0 ? 0 : gf_exp[gf_log[a] + 15 - gf_log[b]];
+    }
+
+    // Syndromes S1..S4, symbol i of the block is the coefficient of x^(14 - i)
+    static bool ComputeSyndromes(const uint8_t* block, uint8_t* syndromes) {
+        bool clean = true;
+        for (int j = 0; j < 4; ++j) {
+            uint8_t alpha = gf_exp[j + 1];
+            uint8_t s = 0;
+            for (size_t i = 0; i < kRsBlockSymbols; ++i) {
+                s = GfMul(s, alpha) ^ block[i];
+            }
+            syndromes[j] = s;
+            clean = clean && s == 0;
+        }
+        return clean;
+    }
+
+    bool MultiToneReceiver::CorrectBlock(uint8_t* block) {
+        InitializeGaloisField();
+        uint8_t s[4];
+        if (ComputeSyndromes(block, s)) {
+            return true;
+        }
+
+        // Error locator 1 + L1 x + L2 x^2 from the Newton identities, Peterson's method for t = 2
+        uint8_t l1, l2;
+        int error_count;
+        uint8_t det = GfMul(s[1], s[1]) ^ GfMul(s[0], s[2]);
+        if (det != 0) {
+            l1 = GfDiv(GfMul(s[2], s[1]) ^ GfMul(s[0], s[3]), det);
+            l2 = GfDiv(GfMul(s[1], s[3]) ^ GfMul(s[2], s[2]), det);
+            error_count = 2;
+        } else if (s[0] != 0) {
+            l1 = GfDiv(s[1], s[0]);
+            l2 = 0;
+            error_count = 1;
+        } else {
+            return false;
+        }
+
+        // Chien search for the roots, then Forney for the error values
+        uint8_t omega0 = s[0];
+        uint8_t omega1 = s[1] ^ GfMul(l1, s[0]);
+        int found = 0;
+        for (size_t i = 0; i < kRsBlockSymbols; ++i) {
+            uint8_t x_inv = gf_exp[(i + 1) % 15];  // X^-1 for X = a^(14 - i)
+            uint8_t value = 1 ^ GfMul(l1, x_inv) ^ GfMul(l2, GfMul(x_inv, x_inv));
+            if (value != 0) {
+                continue;
+            }
+            if (l1 == 0) {
+                return false;
+            }
+            block[i] ^= GfDiv(omega0 ^ GfMul(omega1, x_inv), l1);
+            found++;
+        }
+        if (found != error_count) {
+            return false;
+        }
+        return ComputeSyndromes(block, s);
+    }
+
+    // Preamble tail and start identifier \x01\x02 as tones
+    static const uint8_t kMultiToneSync[] = {0, 15, 0, 15, 0, 1, 0, 2};
+
+    MultiToneReceiver::MultiToneReceiver()
+        : input_buffer_(kMultiToneWindowSize), window_(kMultiToneWindowSize) {
+        InitializeGaloisField();
+        detectors_.reserve(kToneCount);
+        for (size_t k = 0; k < kToneCount; ++k) {
+            detectors_.emplace_back(static_cast<float>(kFirstToneBin + k) / kMultiToneWindowSize, kMultiToneWindowSize);
+        }
+        symbols_.reserve(kRsBlockSymbols * ((2 * (kMaxTextLength + 2) + kRsDataSymbols - 1) / kRsDataSymbols));
+    }
+
+    void MultiToneReceiver::Reset() {
+        state_ = State::kSearching;
+        tone_history_ = {};
+        quality_history_ = {};
+        symbols_.clear();
+        expected_symbols_ = 0;
+    }
+
+    uint8_t MultiToneReceiver::DetectTone(float &quality) {
+        float best = 0.0f;
+        float total = std::numeric_limits<float>::epsilon();
+        uint8_t tone = 0;
+        for (size_t k = 0; k < kToneCount; ++k) {
+            detectors_[k].Reset();
+            detectors_[k].ProcessBlock(window_.data(), kMultiToneWindowSize);
+            float amplitude = detectors_[k].GetAmplitude();
+            total += amplitude;
+            if (amplitude > best) {
+                best = amplitude;
+                tone = k;
+            }
+        }
+        quality = best / total;
+        return tone;
+    }
+
+    bool MultiToneReceiver::ProcessAudioSamples(const int16_t* samples, size_t count) {
+        const size_t step = kMultiToneWindowSize / kSymbolPhases;
+        for (size_t n = 0; n < count; ++n) {
+            input_buffer_[input_buffer_index_] = samples[n];
+            input_buffer_index_ = (input_buffer_index_ + 1) % kMultiToneWindowSize;
+            if (input_buffer_fill_ < kMultiToneWindowSize) {
+                input_buffer_fill_++;
+                continue;
+            }
+            if (++step_count_ < step) {
+                continue;
+            }
+            step_count_ = 0;
+            size_t head = kMultiToneWindowSize - input_buffer_index_;
+            std::copy(input_buffer_.begin() + input_buffer_index_, input_buffer_.end(), window_.begin());
+            std::copy(input_buffer_.begin(), input_buffer_.begin() + input_buffer_index_, window_.begin() + head);
+            OnWindow(phase_);
+            phase_ = (phase_ + 1) % kSymbolPhases;
+            if (decoded_text.has_value()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void MultiToneReceiver::OnWindow(size_t phase) {
+        if (state_ == State::kReceiving) {
+            if (phase != locked_phase_) {
+                return;
+            }
+            float quality;
+            symbols_.push_back(DetectTone(quality));
+            if (symbols_.size() == kRsBlockSymbols && expected_symbols_ == 0) {
+                if (!DecodeFrame(true)) {
+                    Reset();
+                }
+            } else if (expected_symbols_ != 0 && symbols_.size() >= expected_symbols_) {
+                DecodeFrame(false);
+                Reset();
+            }
+            return;
+        }
+
+        float quality;
+        uint8_t tone = DetectTone(quality);
+        auto& tones = tone_history_[phase];
+        auto& qualities = quality_history_[phase];
+        std::copy(tones.begin() + 1, tones.end(), tones.begin());
+        std::copy(qualities.begin() + 1, qualities.end(), qualities.begin());
+        tones[kSyncLength - 1] = tone;
+        qualities[kSyncLength - 1] = quality;
+
+        // Neighbouring offsets may all see the sync, the one with the cleanest tones is the symbol timing
+        bool synced = std::equal(tones.begin(), tones.end(), kMultiToneSync);
+        float score = 0.0f;
+        if (synced) {
+            for (float q : qualities) {
+                score += q;
+            }
+        }
+        if (state_ == State::kLocking) {
+            if (synced && score > locked_score_) {
+                locked_phase_ = phase;
+                locked_score_ = score;
+            }
+            if (--lock_wait_ == 0) {
+                ESP_LOGI(kLogTag, "Multi-tone sync at offset %zu", locked_phase_);
+                state_ = State::kReceiving;
+                symbols_.clear();
+                expected_symbols_ = 0;
+            }
+        } else if (synced) {
+            // Every other offset gets one window to show its sync
+            state_ = State::kLocking;
+            lock_wait_ = kSymbolPhases - 1;
+            locked_phase_ = phase;
+            locked_score_ = score;
+        }
+    }
+
+    bool MultiToneReceiver::DecodeFrame(bool header_only) {
+        size_t blocks = header_only ? 1 : symbols_.size() / kRsBlockSymbols;
+        std::vector<uint8_t> nibbles;
+        nibbles.reserve(blocks * kRsDataSymbols);
+        for (size_t b = 0; b < blocks; ++b) {
+            uint8_t block[kRsBlockSymbols];
+            std::copy(symbols_.begin() + b * kRsBlockSymbols, symbols_.begin() + (b + 1) * kRsBlockSymbols, block);
+            if (!CorrectBlock(block)) {
+                ESP_LOGW(kLogTag, "Multi-tone block %zu uncorrectable", b);
+                return false;
+            }
+            nibbles.insert(nibbles.end(), block, block + kRsDataSymbols);
+        }
+
+        size_t length = (nibbles[0] << 4) | nibbles[1];
+        if (length == 0 || length > kMaxTextLength) {
+            ESP_LOGW(kLogTag, "Multi-tone length %zu out of range", length);
+            return false;
+        }
+        size_t data_nibbles = 2 * (length + 2);
+        if (header_only) {
+            expected_symbols_ = (data_nibbles + kRsDataSymbols - 1) / kRsDataSymbols * kRsBlockSymbols;
+            return true;
+        }
+
+        std::string text;
+        text.reserve(length);
+        for (size_t i = 1; i <= length; ++i) {
+            text.push_back(static_cast<char>((nibbles[2 * i] << 4) | nibbles[2 * i + 1]));
+        }
+        uint8_t received_checksum = (nibbles[data_nibbles - 2] << 4) | nibbles[data_nibbles - 1];
+        uint8_t calculated_checksum = AudioDataBuffer::CalculateChecksum(text);
+        if (received_checksum != calculated_checksum) {
+            ESP_LOGW(kLogTag, "Checksum mismatch: expected %d, got %d", received_checksum, calculated_checksum);
+            return false;
+        }
+        decoded_text = std::move(text);
+        return true;
+    }
+}
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <deque>
+#include <array>
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <optional>
@@ -16,6 +18,18 @@ const size_t kSpaceFrequency = 1500;
 const size_t kBitRate = 100;
 const size_t kWindowSize = 64;
 
+// Multi-tone mode: one of 16 tones per 5 ms symbol carries a nibble, tone k sits on Goertzel bin
+// kFirstToneBin + k of the symbol window, 600 Hz to 3600 Hz in 200 Hz steps
+const size_t kMultiToneSampleRate = 8000;
+const size_t kMultiToneWindowSize = 40;
+const size_t kToneCount = 16;
+const size_t kFirstToneBin = 3;
+// Symbol timing is searched at this many offsets per symbol
+const size_t kSymbolPhases = 4;
+// Reed-Solomon RS(15, 11) over GF(16), each block corrects two wrong symbols
+const size_t kRsBlockSymbols = 15;
+const size_t kRsDataSymbols = 11;
+
 namespace audio_wifi_config
 {
     // Main function to receive WiFi credentials through audio signal
@@ -25,18 +39,20 @@ namespace audio_wifi_config
     /**
      * Goertzel algorithm implementation for single frequency detection
      * Used to detect specific audio frequencies in the AFSK demodulation process
+     *
+     * The filter runs in fixed point (Q14 coefficient, 32-bit state), so boards without
+     * an FPU such as the ESP32-C3 spend a multiply and two adds per sample
      */
     class FrequencyDetector
     {
     private:
         float frequency_;              // Target frequency (normalized, i.e., f / fs)
         size_t window_size_;           // Window size for analysis
-        float frequency_bin_;          // Frequency bin
-        float angular_frequency_;      // Angular frequency
         float cos_coefficient_;        // cos(w)
         float sin_coefficient_;        // sin(w)
-        float filter_coefficient_;     // 2 * cos(w)
-        std::deque<float> state_buffer_;  // Circular buffer for storing S[-1] and S[-2]
+        int32_t filter_coefficient_;   // 2 * cos(w) in Q14
+        int32_t s_minus_1_ = 0;        // S[-1]
+        int32_t s_minus_2_ = 0;        // S[-2]
 
     public:
         /**
@@ -55,7 +71,18 @@ namespace audio_wifi_config
          * Process one audio sample
          * @param sample Input audio sample
          */
-        void ProcessSample(float sample);
+        inline void ProcessSample(int16_t sample) {
+            int32_t s_current = sample + static_cast<int32_t>((static_cast<int64_t>(filter_coefficient_) * s_minus_1_) >> 14) - s_minus_2_;
+            s_minus_2_ = s_minus_1_;
+            s_minus_1_ = s_current;
+        }
+
+        /**
+         * Process a block of audio samples
+         * @param samples Input audio samples
+         * @param count Number of samples
+         */
+        void ProcessBlock(const int16_t* samples, size_t count);
 
         /**
          * Calculate current amplitude
@@ -71,8 +98,11 @@ namespace audio_wifi_config
     class AudioSignalProcessor
     {
     private:
-        std::deque<float> input_buffer_;             // Input sample buffer
+        std::vector<int16_t> input_buffer_;          // Ring buffer holding the last window of samples
+        std::vector<int16_t> window_;                // The window in time order, handed to the detectors
         size_t input_buffer_size_;                   // Input buffer size = window size
+        size_t input_buffer_fill_;                   // Samples written into the ring so far, up to its size
+        size_t input_buffer_index_;                  // Next write position in the ring
         size_t output_sample_count_;                 // Output sample counter
         size_t samples_per_bit_;                     // Samples per bit threshold
         std::unique_ptr<FrequencyDetector> mark_detector_;   // Mark frequency detector
@@ -92,10 +122,11 @@ namespace audio_wifi_config
 
         /**
          * Process input audio samples
-         * @param samples Input audio sample vector
-         * @return Vector of Mark probability values (0.0 to 1.0)
+         * @param samples Input audio samples
+         * @param count Number of samples
+         * @param probabilities Receives the Mark probability values (0.0 to 1.0), cleared first
          */
-        std::vector<float> ProcessAudioSamples(const std::vector<float> &samples);
+        void ProcessAudioSamples(const int16_t* samples, size_t count, std::vector<float> &probabilities);
     };
 
     /**
@@ -171,6 +202,67 @@ namespace audio_wifi_config
         void ClearBuffers();
     };
 
+    /**
+     * Receiver for the multi-tone frame, fed the input at kMultiToneSampleRate
+     *
+     * Frame: alternating tones 0 and 15 for symbol timing, then the start identifier \x01\x02 as
+     * nibbles, then RS(15, 11) blocks carrying [length][text][checksum] high nibble first, then the
+     * end identifier \x03\x04. The legacy AFSK frame can be sent after it for older firmware.
+     */
+    class MultiToneReceiver
+    {
+    private:
+        static constexpr size_t kSyncLength = 8;  // Last preamble symbols plus the start identifier
+        static constexpr size_t kMaxTextLength = 96;
+
+        enum class State
+        {
+            kSearching,  // Looking for the preamble at every timing offset
+            kLocking,    // Preamble found, letting the other offsets show theirs
+            kReceiving   // Collecting symbols at the chosen offset
+        };
+
+        std::vector<FrequencyDetector> detectors_;
+        std::vector<int16_t> input_buffer_;      // Ring buffer holding the last window of samples
+        std::vector<int16_t> window_;            // The window in time order
+        size_t input_buffer_fill_ = 0;
+        size_t input_buffer_index_ = 0;
+        size_t step_count_ = 0;                  // Samples since the last window
+        size_t phase_ = 0;                       // Timing offset of the next window
+        State state_ = State::kSearching;
+        std::array<std::array<uint8_t, kSyncLength>, kSymbolPhases> tone_history_ = {};
+        std::array<std::array<float, kSyncLength>, kSymbolPhases> quality_history_ = {};
+        size_t locked_phase_ = 0;
+        float locked_score_ = 0.0f;
+        size_t lock_wait_ = 0;
+        std::vector<uint8_t> symbols_;
+        size_t expected_symbols_ = 0;
+
+        void OnWindow(size_t phase);
+        uint8_t DetectTone(float &quality);
+        bool DecodeFrame(bool header_only);
+        void Reset();
+
+    public:
+        std::optional<std::string> decoded_text; // Successfully decoded text data
+
+        MultiToneReceiver();
+
+        /**
+         * Process downsampled audio samples
+         * @param samples Input audio samples at kMultiToneSampleRate
+         * @param count Number of samples
+         * @return true if a complete frame was received and decoded
+         */
+        bool ProcessAudioSamples(const int16_t* samples, size_t count);
+
+        /**
+         * Correct a Reed-Solomon RS(15, 11) block in place, data symbols first
+         * @return false if the block has more errors than it can correct
+         */
+        static bool CorrectBlock(uint8_t* block);
+    };
+
     // Default start and end transmission identifiers
     extern const std::vector<uint8_t> kDefaultStartTransmissionPattern;
     extern const std::vector<uint8_t> kDefaultEndTransmissionPattern;
@@ -6,7 +6,11 @@
 
 #define TAG "Axp2101"
 
+// The charging state is asked for several times per battery poll
+#define STATUS_MAX_AGE_US (100 * 1000)
+
 Axp2101::Axp2101(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr) {
+    SetBurstWindow(0x00, 2, STATUS_MAX_AGE_US);
 }
 
 int Axp2101::GetBatteryCurrentDirection() {
@@ -3,9 +3,16 @@
 
 #include <esp_log.h>
 #include <driver/ledc.h>
+#include <cmath>
+#include <cstdlib>
 
 #define TAG "Backlight"
 
+// 软件渐变每 5ms 调整 1% 亮度，硬件渐变沿用相同的时长
+#define BACKLIGHT_STEP_INTERVAL_MS 5
+#define BACKLIGHT_GAMMA 2.2f
+#define BACKLIGHT_MAX_DUTY 1023
+
 
 Backlight::Backlight() {
     // 创建背光渐变定时器
@@ -60,9 +67,15 @@ void Backlight::SetBrightness(uint8_t brightness, bool permanent) {
     target_brightness_ = brightness;
     step_ = (target_brightness_ > brightness_) ? 1 : -1;
 
-    if (transition_timer_ != nullptr) {
+    uint32_t duration_ms = std::abs(target_brightness_ - brightness_) * BACKLIGHT_STEP_INTERVAL_MS;
+    if (StartTransition(brightness_, target_brightness_, duration_ms)) {
+        if (transition_timer_ != nullptr) {
+            esp_timer_stop(transition_timer_);
+        }
+        brightness_ = target_brightness_;
+    } else if (transition_timer_ != nullptr) {
         // 启动定时器，每 5ms 更新一次
-        esp_timer_start_periodic(transition_timer_, 5 * 1000);
+        esp_timer_start_periodic(transition_timer_, BACKLIGHT_STEP_INTERVAL_MS * 1000);
     }
     ESP_LOGI(TAG, "Set brightness to %d", brightness);
 }
@@ -82,6 +95,13 @@ void Backlight::OnTransitionTimer() {
 }
 
 PwmBacklight::PwmBacklight(gpio_num_t pin, bool output_invert, uint32_t freq_hz) : Backlight() {
+    // 人眼对亮度的感知是非线性的，按 gamma 曲线换算占空比，低亮度时也至少保留 1
+    duty_table_[0] = 0;
+    for (int i = 1; i <= 100; i++) {
+        float duty = powf(i / 100.0f, BACKLIGHT_GAMMA) * BACKLIGHT_MAX_DUTY;
+        duty_table_[i] = duty < 1.0f ? 1 : static_cast<uint16_t>(duty + 0.5f);
+    }
+
     const ledc_timer_config_t backlight_timer = {
         .speed_mode = LEDC_LOW_SPEED_MODE,
         .duty_resolution = LEDC_TIMER_10_BIT,
@@ -106,6 +126,13 @@ PwmBacklight::PwmBacklight(gpio_num_t pin, bool output_invert, uint32_t freq_hz)
         }
     };
     ESP_ERROR_CHECK(ledc_channel_config(&backlight_channel));
+
+    // 其他外设可能已经安装过渐变服务
+    esp_err_t err = ledc_fade_func_install(0);
+    fade_installed_ = err == ESP_OK || err == ESP_ERR_INVALID_STATE;
+    if (!fade_installed_) {
+        ESP_LOGW(TAG, "LEDC fade not available (%s), using software transitions", esp_err_to_name(err));
+    }
 }
 
 PwmBacklight::~PwmBacklight() {
@@ -114,8 +141,27 @@ PwmBacklight::~PwmBacklight() {
 
 void PwmBacklight::SetBrightnessImpl(uint8_t brightness) {
     // LEDC resolution set to 10bits, thus: 100% = 1023
-    uint32_t duty_cycle = (1023 * brightness) / 100;
-    ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty_cycle);
+    ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty_table_[brightness]);
     ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
 }
 
+bool PwmBacklight::StartTransition(uint8_t from, uint8_t to, uint32_t duration_ms) {
+    if (!fade_installed_) {
+        return false;
+    }
+#if SOC_LEDC_SUPPORT_FADE_STOP
+    // 打断正在进行的渐变，否则新的渐变要等它结束
+    ledc_fade_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
+#endif
+    // 硬件在两个 gamma 校正后的占空比之间线性渐变，全程不占用 CPU
+    esp_err_t err = ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty_table_[to], duration_ms);
+    if (err == ESP_OK) {
+        err = ledc_fade_start(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, LEDC_FADE_NO_WAIT);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "LEDC fade failed (%s), falling back to software", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
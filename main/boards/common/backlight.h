@@ -19,6 +19,8 @@ public:
 protected:
     void OnTransitionTimer();
     virtual void SetBrightnessImpl(uint8_t brightness) = 0;
+    // Hands the whole transition to the hardware, returns false to fall back to the step timer
+    virtual bool StartTransition(uint8_t from, uint8_t to, uint32_t duration_ms) { return false; }
 
     esp_timer_handle_t transition_timer_ = nullptr;
     uint8_t brightness_ = 0;
@@ -33,4 +35,12 @@ public:
     ~PwmBacklight();
 
     void SetBrightnessImpl(uint8_t brightness) override;
+
+protected:
+    bool StartTransition(uint8_t from, uint8_t to, uint32_t duration_ms) override;
+
+private:
+    // Gamma corrected duty for each brightness percent
+    uint16_t duty_table_[101];
+    bool fade_installed_ = false;
 };
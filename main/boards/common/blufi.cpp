@@ -6,6 +6,7 @@
 #include <vector>
 #include "esp_bt.h"
 #include "esp_event.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "esp_wifi.h"
@@ -104,6 +105,10 @@ Blufi::~Blufi() {
 
 esp_err_t Blufi::init() {
     esp_err_t ret = ESP_FAIL;
+    if (m_mem_released) {
+        ESP_LOGE(BLUFI_TAG, "Bluetooth memory has been released, Blufi needs a reboot");
+        return ESP_ERR_INVALID_STATE;
+    }
     inited_ = true;
     m_provisioned = false;
     m_deinited = false;
@@ -157,9 +162,29 @@ esp_err_t Blufi::deinit() {
         }
 #endif
     }
+    if (ret == ESP_OK) {
+        _release_memory();
+    }
     return ret;
 }
 
+// Only valid with the controller deinitialized or never started, there is no way back in this run
+void Blufi::_release_memory() {
+    if (m_mem_released) {
+        return;
+    }
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    esp_err_t ret = esp_bt_mem_release(ESP_BT_MODE_BTDM);
+    if (ret != ESP_OK) {
+        ESP_LOGW(BLUFI_TAG, "Failed to release Bluetooth memory: %s", esp_err_to_name(ret));
+        return;
+    }
+    m_mem_released = true;
+    size_t free_after = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    ESP_LOGI(BLUFI_TAG, "Released Bluetooth memory, %u bytes of internal RAM reclaimed, %u free",
+             (unsigned)(free_after - std::min(free_before, free_after)), (unsigned)free_after);
+}
+
 #ifdef CONFIG_BT_BLUEDROID_ENABLED
 esp_err_t Blufi::_host_init() {
     esp_err_t ret = esp_bluedroid_init();
@@ -37,10 +37,17 @@ public:
 
     /**
      * @brief Deinitializes Blufi and the Bluetooth stack.
+     * The memory of the controller and the host goes back to the heap, also when Blufi was never
+     * started, after which Bluetooth cannot be started again until the next boot.
      * @return ESP_OK on success, otherwise an error code.
      */
     esp_err_t deinit();
 
+    /**
+     * @brief Whether the Bluetooth memory has been handed back to the heap in this run.
+     */
+    bool mem_released() const { return m_mem_released; }
+
     // Delete copy constructor and assignment operator for singleton
     Blufi(const Blufi &) = delete;
 
@@ -66,6 +73,8 @@ private:
 
     static esp_err_t _host_and_cb_init();
 
+    void _release_memory();
+
     void _security_init();
 
     void _security_deinit();
@@ -134,6 +143,7 @@ private:
     bool m_sta_got_ip;
     bool m_provisioned;
     bool m_deinited;
+    bool m_mem_released = false;
     uint8_t m_sta_bssid[6]{};
     uint8_t m_sta_ssid[32]{};
     int m_sta_ssid_len;
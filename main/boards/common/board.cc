@@ -3,15 +3,21 @@
 #include "settings.h"
 #include "display/display.h"
 #include "display/oled_display.h"
+#include "audio_codec.h"
 #include "assets/lang_config.h"
+#include "metrics.h"
 
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_chip_info.h>
 #include <esp_random.h>
+#include <cJSON.h>
 
 #define TAG "Board"
 
+// Room for the status without metrics
+#define DEVICE_STATUS_JSON_RESERVE 512
+
 Board::Board() {
     Settings settings("board", true);
     uuid_ = settings.GetString("uuid");
@@ -107,9 +113,27 @@ std::string Board::GetSystemInfoJson() {
             }
         }
     */
-    std::string json = R"({"version":2,"language":")" + std::string(Lang::CODE) + R"(",)";
-    json += R"("flash_size":)" + std::to_string(SystemInfo::GetFlashSize()) + R"(,)";
-    json += R"("minimum_free_heap_size":")" + std::to_string(SystemInfo::GetMinimumFreeHeapSize()) + R"(",)";
+    std::call_once(system_info_once_, [this]() {
+        BuildSystemInfo();
+    });
+
+    auto board_json = GetBoardJson();
+    std::string json;
+    json.reserve(system_info_head_.size() + system_info_tail_.size() + board_json.size() + 16);
+    json += system_info_head_;
+    json += std::to_string(SystemInfo::GetMinimumFreeHeapSize());
+    json += system_info_tail_;
+    json += board_json;
+    json += '}';
+    return json;
+}
+
+void Board::BuildSystemInfo() {
+    system_info_head_ = R"({"version":2,"language":")" + std::string(Lang::CODE) + R"(",)";
+    system_info_head_ += R"("flash_size":)" + std::to_string(SystemInfo::GetFlashSize()) + R"(,)";
+    system_info_head_ += R"("minimum_free_heap_size":")";
+
+    std::string json = R"(",)";
     json += R"("mac_address":")" + SystemInfo::GetMacAddress() + R"(",)";
     json += R"("uuid":")" + uuid_ + R"(",)";
     json += R"("chip_model_name":")" + SystemInfo::GetChipModelName() + R"(",)";
@@ -170,9 +194,86 @@ std::string Board::GetSystemInfoJson() {
     }
     json += R"(},)";
 
-    json += R"("board":)" + GetBoardJson();
+    json += R"("board":)";
+    system_info_tail_ = std::move(json);
+}
+
+// The theme name is the only string here, it is written as is but kept valid JSON
+static void AppendJsonString(std::string& json, const std::string& value) {
+    json += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            json += '\\';
+            json += c;
+        } else if ((uint8_t)c >= 0x20) {
+            json += c;
+        }
+    }
+    json += '"';
+}
+
+std::string Board::CreateDeviceStatusJson(cJSON* network) {
+    auto& board = Board::GetInstance();
+    std::string json;
+    json.reserve(DEVICE_STATUS_JSON_RESERVE);
+    char buffer[64];
+
+    // Audio speaker
+    json += R"({"audio_speaker":{)";
+    if (auto codec = board.GetAudioCodec()) {
+        snprintf(buffer, sizeof(buffer), R"("volume":%d)", codec->output_volume());
+        json += buffer;
+    }
+
+    // Screen
+    json += R"(},"screen":{)";
+    bool first = true;
+    if (auto backlight = board.GetBacklight()) {
+        snprintf(buffer, sizeof(buffer), R"("brightness":%d)", backlight->brightness());
+        json += buffer;
+        first = false;
+    }
+    if (auto display = board.GetDisplay(); display && display->height() > 64) {
+        if (auto theme = display->GetTheme()) {
+            json += first ? R"("theme":)" : R"(,"theme":)";
+            AppendJsonString(json, theme->name());
+        }
+    }
+    json += '}';
+
+    // Battery
+    int level = 0;
+    bool charging = false, discharging = false;
+    if (board.GetBatteryLevel(level, charging, discharging)) {
+        snprintf(buffer, sizeof(buffer), R"(,"battery":{"level":%d,"charging":%s})", level, charging ? "true" : "false");
+        json += buffer;
+    }
+
+    // Network
+    if (network != nullptr) {
+        auto str = cJSON_PrintUnformatted(network);
+        json += R"(,"network":)";
+        json += str;
+        cJSON_free(str);
+        cJSON_Delete(network);
+    }
+
+    // Chip temperature
+    float temp = 0.0f;
+    if (board.GetTemperature(temp)) {
+        snprintf(buffer, sizeof(buffer), R"(,"chip":{"temperature":%.1f})", temp);
+        json += buffer;
+    }
+
+#if CONFIG_DEVICE_STATUS_METRICS
+    auto metrics = Metrics::GetInstance().CreateJson();
+    auto str = cJSON_PrintUnformatted(metrics);
+    json += R"(,"metrics":)";
+    json += str;
+    cJSON_free(str);
+    cJSON_Delete(metrics);
+#endif
 
-    // Close the JSON object
-    json += R"(})";
+    json += '}';
     return json;
 }
@@ -7,6 +7,7 @@
 #include <udp.h>
 #include <string>
 #include <functional>
+#include <mutex>
 #include <network_interface.h>
 
 #include "led/led.h"
@@ -29,7 +30,9 @@ enum class NetworkEvent {
     ModemErrorNoSim,       // No SIM card detected
     ModemErrorRegDenied,   // Network registration denied
     ModemErrorInitFailed,  // Modem initialization failed
-    ModemErrorTimeout      // Operation timeout
+    ModemErrorTimeout,     // Operation timeout
+    // Boards with more than one interface
+    Switched               // Traffic moved to another connected interface (data: network name), old connections are dead
 };
 
 // Power save level enumeration
@@ -46,11 +49,19 @@ using NetworkEventCallback = std::function<void(NetworkEvent event, const std::s
 void* create_board();
 class AudioCodec;
 class Display;
+struct cJSON;
 class Board {
 private:
     Board(const Board&) = delete; // 禁用拷贝构造函数
     Board& operator=(const Board&) = delete; // 禁用赋值操作
 
+    // The system info that never changes in a run, serialized on the first request
+    std::once_flag system_info_once_;
+    std::string system_info_head_;  // Up to the minimum free heap size
+    std::string system_info_tail_;  // From the MAC address up to the board object
+
+    void BuildSystemInfo();
+
 protected:
     Board();
     std::string GenerateUuid();
@@ -58,6 +69,10 @@ protected:
     // 软件生成的设备唯一标识
     std::string uuid_;
 
+    // Status of the volume, screen, battery and chip around the network object of the board,
+    // which it takes over. The sections only drawn from numbers are formatted without cJSON.
+    static std::string CreateDeviceStatusJson(cJSON* network);
+
 public:
     static Board& GetInstance() {
         static Board* instance = static_cast<Board*>(create_board());
@@ -77,6 +92,8 @@ public:
     virtual void StartNetwork() = 0;
     virtual void SetNetworkEventCallback(NetworkEventCallback callback) { (void)callback; }
     virtual const char* GetNetworkStateIcon() = 0;
+    // Signal strength 0-100 of the active link, -1 if unknown
+    virtual int GetSignalStrength() { return -1; }
     virtual bool GetBatteryLevel(int &level, bool& charging, bool& discharging);
     virtual std::string GetSystemInfoJson();
     virtual void SetPowerSaveLevel(PowerSaveLevel level) = 0;
@@ -10,7 +10,14 @@ public:
     virtual bool SetHMirror(bool enabled) = 0;
     virtual bool SetVFlip(bool enabled) = 0;
     virtual bool SetSwapBytes(bool enabled) { return false; }  // Optional, default no-op
-    virtual std::string Explain(const std::string& question) = 0;
+    // Longest side (0 keeps the capture size) and JPEG quality of the next Explain upload, optional
+    virtual void SetExplainQuality(int max_side, int quality) {}
+    // Keeps the sensor running at fps (0 stops) so that Capture() returns at once, and with upload set
+    // also sends the frames to the server if it accepted the video stream. Optional.
+    virtual bool SetStreaming(int fps, bool upload) { return false; }
+    // Asks the explain server about the captured frame. The result is the server response, or the error
+    // message if it returns false.
+    virtual bool Explain(const std::string& question, std::string& result) = 0;
 };
 
 #endif // CAMERA_H
@@ -40,6 +40,35 @@ void DualNetworkBoard::InitializeCurrentBoard() {
         ESP_LOGI(TAG, "Initialize WiFi board");
         current_board_ = std::make_unique<WifiBoard>();
     }
+
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    // The other network comes up as well, so a drop of the current one does not need a reboot
+    if (network_type_ == NetworkType::ML307) {
+        ESP_LOGI(TAG, "Initialize standby WiFi board");
+        auto wifi_board = std::make_unique<WifiBoard>();
+        wifi_board->SetStandby(true);
+        standby_board_ = std::move(wifi_board);
+    } else {
+        ESP_LOGI(TAG, "Initialize standby ML307 board");
+        standby_board_ = std::make_unique<Ml307Board>(ml307_tx_pin_, ml307_rx_pin_, ml307_dtr_pin_);
+    }
+    active_board_ = current_board_.get();
+#endif
+}
+
+Board* DualNetworkBoard::ActiveBoard() const {
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    return active_board_;
+#else
+    return current_board_.get();
+#endif
+}
+
+NetworkType DualNetworkBoard::GetActiveNetworkType() const {
+    if (ActiveBoard() == current_board_.get()) {
+        return network_type_;
+    }
+    return network_type_ == NetworkType::WIFI ? NetworkType::ML307 : NetworkType::WIFI;
 }
 
 void DualNetworkBoard::SwitchNetworkType() {
@@ -58,7 +87,7 @@ void DualNetworkBoard::SwitchNetworkType() {
 
  
 std::string DualNetworkBoard::GetBoardType() {
-    return current_board_->GetBoardType();
+    return ActiveBoard()->GetBoardType();
 }
 
 void DualNetworkBoard::StartNetwork() {
@@ -70,29 +99,101 @@ void DualNetworkBoard::StartNetwork() {
         display->SetStatus(Lang::Strings::DETECTING_MODULE);
     }
     current_board_->StartNetwork();
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    standby_board_->StartNetwork();
+#endif
 }
 
 void DualNetworkBoard::SetNetworkEventCallback(NetworkEventCallback callback) {
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    network_event_callback_ = std::move(callback);
+    current_board_->SetNetworkEventCallback([this](NetworkEvent event, const std::string& data) {
+        OnNetworkEvent(current_board_.get(), event, data);
+    });
+    standby_board_->SetNetworkEventCallback([this](NetworkEvent event, const std::string& data) {
+        OnNetworkEvent(standby_board_.get(), event, data);
+    });
+#else
     // Forward the callback to the current board
     current_board_->SetNetworkEventCallback(std::move(callback));
+#endif
 }
 
+#if CONFIG_DUAL_NETWORK_FAILOVER
+/*
+ * Only the active board's events reach the application. When it goes down while the other board is
+ * connected, or the other board connects while it is down, traffic moves over and the application
+ * gets a Switched event instead. There is no switching back while the active board stays up.
+ */
+void DualNetworkBoard::OnNetworkEvent(Board* board, NetworkEvent event, const std::string& data) {
+    bool forward = false;
+    bool switched = false;
+    std::string switched_name;
+    {
+        std::lock_guard<std::mutex> lock(failover_mutex_);
+        bool is_current = board == current_board_.get();
+        bool& connected = is_current ? current_connected_ : standby_connected_;
+        if (event == NetworkEvent::Connected) {
+            connected = true;
+            (is_current ? current_name_ : standby_name_) = data;
+        } else if (event == NetworkEvent::Disconnected) {
+            connected = false;
+        } else if (is_current && event == NetworkEvent::WifiConfigModeEnter) {
+            // No failover while the user sets up the WiFi, the device stays in config mode
+            config_mode_ = true;
+        } else if (is_current && event == NetworkEvent::WifiConfigModeExit) {
+            config_mode_ = false;
+        }
+
+        Board* other = is_current ? standby_board_.get() : current_board_.get();
+        bool other_connected = is_current ? standby_connected_ : current_connected_;
+        if (board == active_board_) {
+            if (event == NetworkEvent::Disconnected && other_connected && !config_mode_) {
+                active_board_ = other;
+                switched = true;
+                switched_name = is_current ? standby_name_ : current_name_;
+            } else {
+                forward = true;
+            }
+        } else if (event == NetworkEvent::Connected && !other_connected && !config_mode_) {
+            active_board_ = board;
+            switched = true;
+            switched_name = data;
+        }
+    }
+
+    if (!network_event_callback_) {
+        return;
+    }
+    if (switched) {
+        ESP_LOGW(TAG, "Network failover to %s", GetActiveNetworkType() == NetworkType::WIFI ? "WiFi" : "ML307");
+        network_event_callback_(NetworkEvent::Switched, switched_name);
+    } else if (forward) {
+        network_event_callback_(event, data);
+    }
+}
+#endif
+
 NetworkInterface* DualNetworkBoard::GetNetwork() {
-    return current_board_->GetNetwork();
+    return ActiveBoard()->GetNetwork();
 }
 
 const char* DualNetworkBoard::GetNetworkStateIcon() {
-    return current_board_->GetNetworkStateIcon();
+    return ActiveBoard()->GetNetworkStateIcon();
+}
+
+int DualNetworkBoard::GetSignalStrength() {
+    return ActiveBoard()->GetSignalStrength();
 }
 
 void DualNetworkBoard::SetPowerSaveLevel(PowerSaveLevel level) {
-    current_board_->SetPowerSaveLevel(level);
+    ActiveBoard()->SetPowerSaveLevel(level);
 }
 
 std::string DualNetworkBoard::GetBoardJson() {   
-    return current_board_->GetBoardJson();
+    return ActiveBoard()->GetBoardJson();
 }
 
 std::string DualNetworkBoard::GetDeviceStatusJson() {
-    return current_board_->GetDeviceStatusJson();
+    return ActiveBoard()->GetDeviceStatusJson();
 }
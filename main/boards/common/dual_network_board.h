@@ -5,6 +5,9 @@
 #include "wifi_board.h"
 #include "ml307_board.h"
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
 
 //enum NetworkType
 enum class NetworkType {
@@ -32,6 +35,25 @@ private:
 
     // 初始化当前网络类型对应的板卡
     void InitializeCurrentBoard();
+
+#if CONFIG_DUAL_NETWORK_FAILOVER
+    // The other network, kept connected next to the current one and used while the current one is down
+    std::unique_ptr<Board> standby_board_;
+    std::atomic<Board*> active_board_ = nullptr;
+    // Link state of both boards, from their Connected / Disconnected events
+    std::mutex failover_mutex_;
+    bool current_connected_ = false;
+    bool standby_connected_ = false;
+    bool config_mode_ = false;
+    std::string current_name_;
+    std::string standby_name_;
+    NetworkEventCallback network_event_callback_;
+
+    void OnNetworkEvent(Board* board, NetworkEvent event, const std::string& data);
+#endif
+
+    // The board whose network carries the traffic, the current one unless failover moved it
+    Board* ActiveBoard() const;
  
 public:
     DualNetworkBoard(gpio_num_t ml307_tx_pin, gpio_num_t ml307_rx_pin, gpio_num_t ml307_dtr_pin = GPIO_NUM_NC, int32_t default_net_type = 1);
@@ -45,6 +67,9 @@ public:
     
     // 获取当前活动的板卡引用
     Board& GetCurrentBoard() const { return *current_board_; }
+
+    // Network carrying the traffic, differs from GetNetworkType() while failed over
+    NetworkType GetActiveNetworkType() const;
     
     // 重写Board接口
     virtual std::string GetBoardType() override;
@@ -52,6 +77,7 @@ public:
     virtual void SetNetworkEventCallback(NetworkEventCallback callback) override;
     virtual NetworkInterface* GetNetwork() override;
     virtual const char* GetNetworkStateIcon() override;
+    virtual int GetSignalStrength() override;
     virtual void SetPowerSaveLevel(PowerSaveLevel level) override;
     virtual std::string GetBoardJson() override;
     virtual std::string GetDeviceStatusJson() override;
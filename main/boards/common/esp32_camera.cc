@@ -1,6 +1,7 @@
 #include "sdkconfig.h"
 
 #include <esp_heap_caps.h>
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <esp_log.h>
@@ -8,15 +9,24 @@
 
 #include "esp32_camera.h"
 #include "board.h"
+#include "deferred_log.h"
 #include "display.h"
 #include "lvgl_display.h"
 #include "mcp_server.h"
-#include "system_info.h"
 #include "jpg/image_to_jpeg.h"
+#include "dfs_policy.h"
+#include "task_factory.h"
 #include "esp_timer.h"
+#include "application.h"
+#include "pixel_swap.h"
 
 #define TAG "Esp32Camera"
 
+// Streaming mode limits, the uploaded frames are only meant to keep the server aware of the scene
+#define ESP32_CAMERA_STREAM_MAX_FPS 5
+#define ESP32_CAMERA_STREAM_MAX_SIDE 320
+#define ESP32_CAMERA_STREAM_QUALITY 50
+
 Esp32Camera::Esp32Camera(const camera_config_t &config) {
     esp_err_t err = esp_camera_init(&config);
     if (err != ESP_OK) {
@@ -37,15 +47,13 @@ Esp32Camera::Esp32Camera(const camera_config_t &config) {
 
 Esp32Camera::~Esp32Camera() {
     if (streaming_on_) {
-        if (current_fb_) {
-            esp_camera_fb_return(current_fb_);
-            current_fb_ = nullptr;
-        }
-        if (encode_buf_) {
-            heap_caps_free(encode_buf_);
-            encode_buf_ = nullptr;
-            encode_buf_size_ = 0;
+        SetStreaming(0, false);
+        if (encoder_thread_.joinable()) {
+            encoder_thread_.join();
         }
+        frame_ = Frame();
+        latest_frame_ = Frame();
+        spare_frame_ = Frame();
         esp_camera_deinit();
         streaming_on_ = false;
     }
@@ -56,6 +64,32 @@ void Esp32Camera::SetExplainUrl(const std::string &url, const std::string &token
     explain_token_ = token;
 }
 
+// The buffer is only reused when neither the preview nor the encoder still holds it
+bool Esp32Camera::CopyFrame(camera_fb_t *fb, Frame &frame) {
+    if (frame.data == nullptr || frame.data.use_count() > 1 || frame.capacity < fb->len) {
+        frame.data.reset();
+        frame.capacity = 0;
+        auto buf = (uint8_t *)heap_caps_malloc(fb->len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (buf == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate %zu bytes for the frame copy", fb->len);
+            return false;
+        }
+        frame.data = std::shared_ptr<uint8_t>(buf, heap_caps_free);
+        frame.capacity = fb->len;
+    }
+
+    if (fb->format == PIXFORMAT_RGB565 && swap_bytes_enabled_) {
+        SwapPixelBytes(fb->buf, frame.data.get(), fb->width * fb->height);
+    } else {
+        memcpy(frame.data.get(), fb->buf, fb->len);
+    }
+    frame.len = fb->len;
+    frame.width = fb->width;
+    frame.height = fb->height;
+    frame.format = fb->format;
+    return true;
+}
+
 bool Esp32Camera::Capture() {
     if (encoder_thread_.joinable()) {
         encoder_thread_.join();
@@ -65,70 +99,143 @@ bool Esp32Camera::Capture() {
         return false;
     }
 
-    // Get the latest frame, discard old frames for real-time performance
-    for (int i = 0; i < 2; i++) {
-        if (current_fb_) {
-            esp_camera_fb_return(current_fb_);
-        }
-        current_fb_ = esp_camera_fb_get();
-        if (!current_fb_) {
-            ESP_LOGE(TAG, "Camera capture failed");
-            return false;
+    bool captured = false;
+    if (stream_fps_ > 0) {
+        // The stream task keeps a frame at most one period old
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        if (latest_frame_.data != nullptr) {
+            frame_ = latest_frame_;
+            captured = true;
         }
     }
 
-    // Prepare encode buffer for RGB565 format (with optional byte swapping)
-    if (current_fb_->format == PIXFORMAT_RGB565) {
-        size_t pixel_count = current_fb_->width * current_fb_->height;
-        size_t data_size = pixel_count * 2;
-
-        // Allocate or reallocate encode buffer if needed
-        if (encode_buf_size_ < data_size) {
-            if (encode_buf_) {
-                heap_caps_free(encode_buf_);
+    if (!captured) {
+        // Get the latest frame, discard old frames for real-time performance
+        camera_fb_t *fb = nullptr;
+        for (int i = 0; i < 2; i++) {
+            if (fb) {
+                esp_camera_fb_return(fb);
             }
-            encode_buf_ = (uint8_t *)heap_caps_malloc(data_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-            if (encode_buf_ == nullptr) {
-                ESP_LOGE(TAG, "Failed to allocate memory for encode buffer");
-                encode_buf_size_ = 0;
+            fb = esp_camera_fb_get();
+            if (!fb) {
+                ESP_LOGE(TAG, "Camera capture failed");
                 return false;
             }
-            encode_buf_size_ = data_size;
         }
-
-        // Copy data to encode buffer with optional byte swapping
-        uint16_t *src = (uint16_t *)current_fb_->buf;
-        uint16_t *dst = (uint16_t *)encode_buf_;
-        if (swap_bytes_enabled_) {
-            for (size_t i = 0; i < pixel_count; i++) {
-                dst[i] = __builtin_bswap16(src[i]);
-            }
-        } else {
-            memcpy(encode_buf_, current_fb_->buf, data_size);
+        bool ok = CopyFrame(fb, frame_);
+        esp_camera_fb_return(fb);
+        if (!ok) {
+            return false;
         }
+    }
 
-        // Allocate separate buffer for preview display
-        uint8_t *preview_data = (uint8_t *)heap_caps_malloc(data_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-        if (preview_data != nullptr) {
-            memcpy(preview_data, encode_buf_, data_size);
-            auto display = dynamic_cast<LvglDisplay *>(Board::GetInstance().GetDisplay());
-            if (display != nullptr) {
-                display->SetPreviewImage(std::make_unique<LvglAllocatedImage>(preview_data, data_size, current_fb_->width, current_fb_->height, current_fb_->width * 2, LV_COLOR_FORMAT_RGB565));
-            } else {
-                heap_caps_free(preview_data);
-            }
+    if (frame_.format == PIXFORMAT_RGB565) {
+        // The preview shows the same buffer the encoder reads, no copy
+        auto display = dynamic_cast<LvglDisplay *>(Board::GetInstance().GetDisplay());
+        if (display != nullptr) {
+            display->SetPreviewImage(std::make_unique<LvglSharedImage>(frame_.data, frame_.len, frame_.width, frame_.height, frame_.width * 2, LV_COLOR_FORMAT_RGB565));
         }
-    } else if (current_fb_->format == PIXFORMAT_JPEG) {
+    } else if (frame_.format == PIXFORMAT_JPEG) {
         // JPEG format preview usually requires decoding, skip preview display for now, just log
-        ESP_LOGW(TAG, "JPEG capture success, len=%zu, but not supported for preview", current_fb_->len);
+        ESP_LOGW(TAG, "JPEG capture success, len=%zu, but not supported for preview", frame_.len);
     }
 
     ESP_LOGI(TAG, "Captured frame: %dx%d, len=%zu, format=%d",
-             current_fb_->width, current_fb_->height, current_fb_->len, current_fb_->format);
+             frame_.width, frame_.height, frame_.len, frame_.format);
+
+    return true;
+}
+
+bool Esp32Camera::SetStreaming(int fps, bool upload) {
+    if (!streaming_on_) {
+        return false;
+    }
 
+    fps = std::clamp(fps, 0, ESP32_CAMERA_STREAM_MAX_FPS);
+    std::unique_lock<std::mutex> task_lock(stream_task_mutex_);
+    stream_upload_ = upload;
+    stream_fps_ = fps;
+    if (fps == 0) {
+        // The task sees the zero within one period and clears the handle on its way out,
+        // unless streaming was started again in the meantime
+        while (stream_task_ != nullptr && stream_fps_ == 0) {
+            task_lock.unlock();
+            vTaskDelay(pdMS_TO_TICKS(10));
+            task_lock.lock();
+        }
+        if (stream_task_ == nullptr) {
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            latest_frame_ = Frame();
+            spare_frame_ = Frame();
+        }
+        return true;
+    }
+
+    if (stream_task_ == nullptr) {
+        xTaskCreate([](void *arg) {
+            auto camera = static_cast<Esp32Camera *>(arg);
+            while (true) {
+                camera->StreamTask();
+                // A SetStreaming() that raced the loop leaving keeps this task running
+                std::lock_guard<std::mutex> lock(camera->stream_task_mutex_);
+                if (camera->stream_fps_ == 0) {
+                    camera->stream_task_ = nullptr;
+                    break;
+                }
+            }
+            vTaskDelete(NULL);
+        }, "camera_stream", 4096 * 2, this, 2, &stream_task_);
+    }
+    ESP_LOGI(TAG, "Streaming at %d fps, upload %s", fps, upload ? "on" : "off");
     return true;
 }
 
+void Esp32Camera::StreamTask() {
+    std::string jpeg;
+    while (stream_fps_ > 0) {
+        int64_t start_time = esp_timer_get_time();
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (fb == nullptr) {
+            ESP_LOGE(TAG, "Camera capture failed");
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        Frame frame;
+        {
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            if (CopyFrame(fb, spare_frame_)) {
+                std::swap(latest_frame_, spare_frame_);
+            }
+            frame = latest_frame_;
+        }
+        esp_camera_fb_return(fb);
+
+        if (stream_upload_ && frame.data != nullptr) {
+            v4l2_pix_fmt_t enc_fmt = frame.format == PIXFORMAT_JPEG ? V4L2_PIX_FMT_JPEG : V4L2_PIX_FMT_RGB565;
+            if (frame.format == PIXFORMAT_JPEG || frame.format == PIXFORMAT_RGB565) {
+                DfsBoost boost;
+                jpeg.clear();
+                bool ok = image_to_jpeg_fit_cb(frame.data.get(), frame.len, frame.width, frame.height, enc_fmt,
+                    ESP32_CAMERA_STREAM_QUALITY, ESP32_CAMERA_STREAM_MAX_SIDE,
+                    [](void *arg, size_t index, const void *data, size_t len) -> size_t {
+                        if (data != nullptr) {
+                            static_cast<std::string *>(arg)->append((const char *)data, len);
+                        }
+                        return len;
+                    }, &jpeg, nullptr, nullptr);
+                if (ok && !jpeg.empty()) {
+                    Application::GetInstance().SendVideoFrame(jpeg);
+                }
+            }
+        }
+
+        int64_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+        int period_ms = 1000 / std::max(1, stream_fps_.load());
+        vTaskDelay(pdMS_TO_TICKS(std::max<int64_t>(10, period_ms - elapsed_ms)));
+    }
+}
+
 bool Esp32Camera::SetHMirror(bool enabled) {
     sensor_t *s = esp_camera_sensor_get();
     if (!s) {
@@ -152,171 +259,100 @@ bool Esp32Camera::SetSwapBytes(bool enabled) {
     return true;
 }
 
-std::string Esp32Camera::Explain(const std::string &question) {
+void Esp32Camera::SetExplainQuality(int max_side, int quality) {
+    explain_max_side_ = max_side;
+    explain_quality_ = quality;
+}
+
+bool Esp32Camera::Explain(const std::string &question, std::string &result) {
     if (explain_url_.empty()) {
-        throw std::runtime_error("Image explain URL or token is not set");
+        result = "Image explain URL or token is not set";
+        return false;
     }
 
-    if (current_fb_ == nullptr) {
-        throw std::runtime_error("No camera frame captured");
+    if (frame_.data == nullptr) {
+        result = "No camera frame captured";
+        return false;
     }
 
-    // Create local JPEG queue
-    QueueHandle_t jpeg_queue = xQueueCreate(40, sizeof(JpegChunk));
-    if (jpeg_queue == nullptr) {
-        ESP_LOGE(TAG, "Failed to create JPEG queue");
-        throw std::runtime_error("Failed to create JPEG queue");
+    v4l2_pix_fmt_t enc_fmt;
+    switch (frame_.format) {
+        case PIXFORMAT_RGB565:
+            enc_fmt = V4L2_PIX_FMT_RGB565;
+            break;
+        case PIXFORMAT_YUV422:
+            enc_fmt = V4L2_PIX_FMT_YUYV;  // YUV422 is actually YUYV format
+            break;
+        case PIXFORMAT_YUV420:
+            enc_fmt = V4L2_PIX_FMT_YUV420;
+            break;
+        case PIXFORMAT_GRAYSCALE:
+            enc_fmt = V4L2_PIX_FMT_GREY;
+            break;
+        case PIXFORMAT_JPEG:
+            enc_fmt = V4L2_PIX_FMT_JPEG;
+            break;
+        case PIXFORMAT_RGB888:
+            enc_fmt = V4L2_PIX_FMT_RGB24;
+            break;
+        default:
+            ESP_LOGE(TAG, "Unsupported pixel format: %d", frame_.format);
+            result = "Unsupported pixel format";
+            return false;
     }
 
-    // Start encoding thread
-    encoder_thread_ = std::thread([this, jpeg_queue]() {
-        int64_t start_time = esp_timer_get_time();
-        uint16_t w = current_fb_->width;
-        uint16_t h = current_fb_->height;
-        v4l2_pix_fmt_t enc_fmt;
-        switch (current_fb_->format) {
-            case PIXFORMAT_RGB565:
-                enc_fmt = V4L2_PIX_FMT_RGB565;
-                break;
-            case PIXFORMAT_YUV422:
-                enc_fmt = V4L2_PIX_FMT_YUYV;  // YUV422 is actually YUYV format
-                break;
-            case PIXFORMAT_YUV420:
-                enc_fmt = V4L2_PIX_FMT_YUV420;
-                break;
-            case PIXFORMAT_GRAYSCALE:
-                enc_fmt = V4L2_PIX_FMT_GREY;
-                break;
-            case PIXFORMAT_JPEG:
-                enc_fmt = V4L2_PIX_FMT_JPEG;
-                break;
-            case PIXFORMAT_RGB888:
-                enc_fmt = V4L2_PIX_FMT_RGB24;
-                break;
-            default:
-                ESP_LOGE(TAG, "Unsupported pixel format: %d", current_fb_->format);
-                return;
-        }
-
-        // Use encode buffer for RGB565, otherwise use original frame buffer
-        uint8_t *jpeg_src_buf = current_fb_->buf;
-        size_t jpeg_src_len = current_fb_->len;
-        if (current_fb_->format == PIXFORMAT_RGB565 && encode_buf_ != nullptr) {
-            jpeg_src_buf = encode_buf_;
-            jpeg_src_len = encode_buf_size_;
+    // Another question about the same scene refers to the last upload instead of sending it again
+    uint64_t hash = 0;
+    bool hashed = image_luma_hash(frame_.data.get(), frame_.len, frame_.width, frame_.height, enc_fmt, &hash);
+    if (hashed) {
+        auto image_ref = image_cache_.FindSimilar(hash, explain_max_side_);
+        if (!image_ref.empty()) {
+            if (PostExplainReference(explain_url_, explain_token_, question, image_ref, result)) {
+                DLOGI(TAG, "Explain unchanged scene by reference %s, question=%s\n%s",
+                      image_ref.c_str(), question.c_str(), result.c_str());
+                return true;
+            }
+            ESP_LOGW(TAG, "Image reference failed (%s), uploading the photo", result.c_str());
+            image_cache_.Forget();
         }
+    }
+    std::string image_id = hashed ? image_cache_.NewImageId(hash) : "";
 
-        bool ok = image_to_jpeg_cb(jpeg_src_buf, jpeg_src_len, w, h, enc_fmt, 80,
-            [](void* arg, size_t index, const void* data, size_t len) -> size_t {
-                auto jpeg_queue = static_cast<QueueHandle_t>(arg);
-                JpegChunk chunk = {.data = nullptr, .len = len};
-                if (index == 0 && data != nullptr && len > 0) {
-                    chunk.data = (uint8_t*)heap_caps_aligned_alloc(16, len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-                    if (chunk.data == nullptr) {
-                        ESP_LOGE(TAG, "Failed to allocate %zu bytes for JPEG chunk", len);
-                        chunk.len = 0;
-                    } else {
-                        memcpy(chunk.data, data, len);
-                    }
-                } else {
-                    chunk.len = 0;  // Sentinel or error
-                }
-                xQueueSend(jpeg_queue, &chunk, portMAX_DELAY);
-                return len;
-            }, jpeg_queue);
+    // The pool bounds the memory used while the encoder output is uploaded
+    JpegChunkStream stream;
 
+    // Start encoding thread, its stack only serves the encoder and can live in PSRAM
+    TaskFactory::SetThreadStack(kTaskStackPsram, "jpeg_encoder");
+    encoder_thread_ = std::thread([this, &stream, enc_fmt]() {
+        DfsBoost boost;
+        int64_t start_time = esp_timer_get_time();
+        uint16_t w = frame_.width;
+        uint16_t h = frame_.height;
+        uint16_t out_w = w, out_h = h;
+        bool ok = image_to_jpeg_fit_cb(frame_.data.get(), frame_.len, w, h, enc_fmt, explain_quality_, explain_max_side_,
+            JpegChunkStream::EncoderCallback, &stream, &out_w, &out_h);
         if (!ok) {
-            JpegChunk chunk = {.data = nullptr, .len = 0};
-            xQueueSend(jpeg_queue, &chunk, portMAX_DELAY);
+            stream.Finish(false);
         }
         int64_t end_time = esp_timer_get_time();
-        ESP_LOGI(TAG, "JPEG encoding time: %ld ms", int((end_time - start_time) / 1000));
+        ESP_LOGI(TAG, "JPEG encoding time: %ld ms, %ux%u, quality %d", int((end_time - start_time) / 1000),
+                 out_w, out_h, explain_quality_);
     });
+    TaskFactory::SetThreadStack(kTaskStackInternal);
 
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(3);
-    std::string boundary = "----ESP32_CAMERA_BOUNDARY";
-
-    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
-    http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
-    if (!explain_token_.empty()) {
-        http->SetHeader("Authorization", "Bearer " + explain_token_);
-    }
-    http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
-    http->SetHeader("Transfer-Encoding", "chunked");
-    if (!http->Open("POST", explain_url_)) {
-        ESP_LOGE(TAG, "Failed to connect to explain URL");
-        encoder_thread_.join();
-        JpegChunk chunk;
-        while (xQueueReceive(jpeg_queue, &chunk, portMAX_DELAY) == pdPASS) {
-            if (chunk.data != nullptr) {
-                heap_caps_free(chunk.data);
-            } else {
-                break;
-            }
-        }
-        vQueueDelete(jpeg_queue);
-        throw std::runtime_error("Failed to connect to explain URL");
-    }
-
-    {
-        std::string question_field;
-        question_field += "--" + boundary + "\r\n";
-        question_field += "Content-Disposition: form-data; name=\"question\"\r\n";
-        question_field += "\r\n";
-        question_field += question + "\r\n";
-        http->Write(question_field.c_str(), question_field.size());
-    }
-    {
-        std::string file_header;
-        file_header += "--" + boundary + "\r\n";
-        file_header += "Content-Disposition: form-data; name=\"file\"; filename=\"camera.jpg\"\r\n";
-        file_header += "Content-Type: image/jpeg\r\n";
-        file_header += "\r\n";
-        http->Write(file_header.c_str(), file_header.size());
-    }
-
+    // The stream is drained on every path, so the encoder always gets to the end
     size_t total_sent = 0;
-    bool saw_terminator = false;
-    while (true) {
-        JpegChunk chunk;
-        if (xQueueReceive(jpeg_queue, &chunk, portMAX_DELAY) != pdPASS) {
-            ESP_LOGE(TAG, "Failed to receive JPEG chunk");
-            break;
-        }
-        if (chunk.data == nullptr) {
-            saw_terminator = true;
-            break;
-        }
-        http->Write((const char *)chunk.data, chunk.len);
-        total_sent += chunk.len;
-        heap_caps_free(chunk.data);
-    }
+    bool ok = PostExplainRequest(explain_url_, explain_token_, question, stream, total_sent, result, image_id);
     encoder_thread_.join();
-    vQueueDelete(jpeg_queue);
-
-    if (!saw_terminator || total_sent == 0) {
-        ESP_LOGE(TAG, "JPEG encoder failed or produced empty output");
-        throw std::runtime_error("Failed to encode image to JPEG");
-    }
-
-    {
-        std::string multipart_footer;
-        multipart_footer += "\r\n--" + boundary + "--\r\n";
-        http->Write(multipart_footer.c_str(), multipart_footer.size());
+    if (!ok) {
+        return false;
     }
-    http->Write("", 0);
-
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
-        throw std::runtime_error("Failed to upload photo");
+    if (hashed) {
+        image_cache_.Remember(hash, explain_max_side_, image_id);
     }
 
-    std::string result = http->ReadAll();
-    http->Close();
-
     size_t remain_stack_size = uxTaskGetStackHighWaterMark(nullptr);
-    ESP_LOGI(TAG, "Explain image size=%dx%d, compressed size=%d, remain stack size=%d, question=%s\n%s",
-             current_fb_->width, current_fb_->height, (int)total_sent, (int)remain_stack_size, question.c_str(), result.c_str());
-    return result;
+    DLOGI(TAG, "Explain image size=%dx%d, compressed size=%d, remain stack size=%d, question=%s\n%s",
+          frame_.width, frame_.height, (int)total_sent, (int)remain_stack_size, question.c_str(), result.c_str());
+    return true;
 }
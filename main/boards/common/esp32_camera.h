@@ -3,21 +3,19 @@
 
 #include <lvgl.h>
 #include <thread>
+#include <atomic>
+#include <mutex>
 #include <memory>
 #include <vector>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/task.h>
 
 #include "camera.h"
 #include "esp_camera.h"
 #include "jpg/image_to_jpeg.h"
-
-struct JpegChunk
-{
-    uint8_t *data;
-    size_t len;
-};
+#include "explain_upload.h"
 
 class Esp32Camera : public Camera
 {
@@ -27,9 +25,34 @@ private:
     std::string explain_url_;
     std::string explain_token_;
     std::thread encoder_thread_;
-    camera_fb_t *current_fb_ = nullptr;
-    uint8_t *encode_buf_ = nullptr;  // Buffer for JPEG encoding (with optional byte swap)
-    size_t encode_buf_size_ = 0;
+    int explain_max_side_ = 0;
+    int explain_quality_ = 80;
+    ExplainImageCache image_cache_;
+
+    // Copy of a sensor frame, RGB565 gets the optional byte swap. The camera buffer goes back to the
+    // driver right away, the copy is shared by the JPEG encoder and the preview image.
+    struct Frame {
+        std::shared_ptr<uint8_t> data;
+        size_t capacity = 0;
+        size_t len = 0;
+        uint16_t width = 0;
+        uint16_t height = 0;
+        pixformat_t format = PIXFORMAT_RGB565;
+    };
+    Frame frame_;
+
+    // Streaming mode keeps the sensor running into a ring of two frames, Capture() takes the latest
+    std::mutex stream_mutex_;
+    Frame latest_frame_;
+    Frame spare_frame_;
+    std::atomic<int> stream_fps_ = 0;
+    std::atomic<bool> stream_upload_ = false;
+    // Guards stream_task_, SetStreaming() and the task leaving decide under it whether the task runs
+    std::mutex stream_task_mutex_;
+    TaskHandle_t stream_task_ = nullptr;
+
+    bool CopyFrame(camera_fb_t *fb, Frame &frame);
+    void StreamTask();
 
 public:
     Esp32Camera(const camera_config_t &config);
@@ -40,5 +63,7 @@ public:
     virtual bool SetHMirror(bool enabled) override;
     virtual bool SetVFlip(bool enabled) override;
     virtual bool SetSwapBytes(bool enabled) override;
-    virtual std::string Explain(const std::string &question) override;
+    virtual void SetExplainQuality(int max_side, int quality) override;
+    virtual bool SetStreaming(int fps, bool upload) override;
+    virtual bool Explain(const std::string &question, std::string &result) override;
 };
@@ -9,6 +9,7 @@
 #include <esp_heap_caps.h>
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
 
 #include "esp_imgfx_color_convert.h"
 #include "esp_video_device.h"
@@ -16,14 +17,17 @@
 #include "linux/videodev2.h"
 
 #include "board.h"
+#include "deferred_log.h"
 #include "display.h"
 #include "esp_video.h"
 #include "esp_jpeg_common.h"
 #include "jpg/image_to_jpeg.h"
+#include "dfs_policy.h"
+#include "task_factory.h"
 #include "jpg/jpeg_to_image.h"
 #include "lvgl_display.h"
 #include "mcp_server.h"
-#include "system_info.h"
+#include "pixel_swap.h"
 
 #ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_DEBUG_MODE
 #undef LOG_LOCAL_LEVEL
@@ -385,6 +389,28 @@ void EspVideo::SetExplainUrl(const std::string& url, const std::string& token) {
     explain_token_ = token;
 }
 
+// BT.601 limited range, as the esp_imgfx conversion used for the other formats
+static inline uint16_t YuvToRgb565(int y, int u, int v) {
+    int c = (y - 16) * 298 + 128;
+    int r = std::clamp((c + 409 * v) >> 8, 0, 255);
+    int g = std::clamp((c - 100 * u - 208 * v) >> 8, 0, 255);
+    int b = std::clamp((c + 516 * u) >> 8, 0, 255);
+    return ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+}
+
+// Every step-th pixel of every step-th row, converted in the same pass
+static void YuyvToRgb565(const uint8_t* src, int src_width, int step, uint16_t* dst, int width, int height) {
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = src + (size_t)y * step * src_width * 2;
+        for (int x = 0; x < width; x++) {
+            // Y0 U Y1 V, the chroma is shared by the pixel pair
+            const uint8_t* pair = row + ((x * step) & ~1) * 2;
+            int luma = pair[(x * step & 1) ? 2 : 0];
+            *dst++ = YuvToRgb565(luma, pair[1] - 128, pair[3] - 128);
+        }
+    }
+}
+
 bool EspVideo::Capture() {
     if (encoder_thread_.joinable()) {
         encoder_thread_.join();
@@ -405,12 +431,17 @@ bool EspVideo::Capture() {
         if (i == 2) {
             // 保存帧副本到PSRAM
             if (frame_.data) {
-                heap_caps_free(frame_.data);
+                // A preview still showing the previous frame keeps it alive until it goes away
+                if (frame_.data != frame_owner_.get()) {
+                    heap_caps_free(frame_.data);
+                }
                 frame_.data = nullptr;
                 frame_.format = 0;
             }
+            frame_owner_.reset();
             frame_.len = buf.bytesused;
-            frame_.data = (uint8_t*)heap_caps_malloc(frame_.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            // 按 cache line 对齐，硬件 JPEG 编码器可直接读取这份拷贝
+            frame_.data = (uint8_t*)heap_caps_aligned_alloc(64, frame_.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
             if (!frame_.data) {
                 ESP_LOGE(TAG, "alloc frame copy failed: need allocate %lu bytes", buf.bytesused);
                 if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
@@ -439,14 +470,8 @@ bool EspVideo::Capture() {
                 case V4L2_PIX_FMT_JPEG:
 #endif  // CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
 #ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                {
-                    auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                    auto dst16 = (uint16_t*)frame_.data;
-                    size_t count = (size_t)mmap_buffers_[buf.index].length / 2;
-                    for (size_t i = 0; i < count; i++) {
-                        dst16[i] = __builtin_bswap16(src16[i]);
-                    }
-                }
+                    SwapPixelBytes(mmap_buffers_[buf.index].start, frame_.data,
+                                   MIN(mmap_buffers_[buf.index].length, frame_.len) / 2);
 #else
                     memcpy(frame_.data, mmap_buffers_[buf.index].start,
                            MIN(mmap_buffers_[buf.index].length, frame_.len));
@@ -457,14 +482,8 @@ bool EspVideo::Capture() {
                     // 这个格式是 422 YUYV，不是 planer
                     frame_.format = V4L2_PIX_FMT_YUYV;
 #ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                    {
-                        auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                        auto dst16 = (uint16_t*)frame_.data;
-                        size_t count = (size_t)mmap_buffers_[buf.index].length / 2;
-                        for (size_t i = 0; i < count; i++) {
-                            dst16[i] = __builtin_bswap16(src16[i]);
-                        }
-                    }
+                    SwapPixelBytes(mmap_buffers_[buf.index].start, frame_.data,
+                                   MIN(mmap_buffers_[buf.index].length, frame_.len) / 2);
 #else
                     memcpy(frame_.data, mmap_buffers_[buf.index].start,
                            MIN(mmap_buffers_[buf.index].length, frame_.len));
@@ -474,12 +493,8 @@ bool EspVideo::Capture() {
                 case V4L2_PIX_FMT_RGB565X: {
                     // 大端序的 RGB565 需要转换为小端序
                     // 目前 esp_video 的大小端都会返回格式为 RGB565，不会返回格式为 RGB565X，此 case 用于未来版本兼容
-                    auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                    auto dst16 = (uint16_t*)frame_.data;
-                    size_t pixel_count = (size_t)frame_.width * (size_t)frame_.height;
-                    for (size_t i = 0; i < pixel_count; i++) {
-                        dst16[i] = __builtin_bswap16(src16[i]);
-                    }
+                    SwapPixelBytes(mmap_buffers_[buf.index].start, frame_.data,
+                                   MIN((size_t)frame_.width * (size_t)frame_.height, frame_.len / 2));
                     frame_.format = V4L2_PIX_FMT_RGB565;
                     break;
                 }
@@ -744,8 +759,22 @@ bool EspVideo::Capture() {
         uint8_t* data = nullptr;
 
         switch (frame_.format) {
+            case V4L2_PIX_FMT_YUYV: {
+                // Converted straight to about the panel size, the full frame is only needed by the encoder
+                int step = std::max(1, w / std::max(1, display->width()));
+                w = frame_.width / step & ~1;
+                h = frame_.height / step;
+                stride = w * 2;
+                lvgl_image_size = w * h * 2;
+                data = (uint8_t*)heap_caps_malloc(lvgl_image_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+                if (data == nullptr) {
+                    ESP_LOGE(TAG, "Failed to allocate memory for preview image");
+                    return false;
+                }
+                YuyvToRgb565(frame_.data, frame_.width, step, (uint16_t*)data, w, h);
+                break;
+            }
             // LVGL 显示 YUV 系的图像似乎都有问题，暂时转换为 RGB565 显示
-            case V4L2_PIX_FMT_YUYV:
             case V4L2_PIX_FMT_YUV420:
             case V4L2_PIX_FMT_RGB24: {
                 color_format = LV_COLOR_FORMAT_RGB565;
@@ -793,14 +822,11 @@ bool EspVideo::Capture() {
             }
 
             case V4L2_PIX_FMT_RGB565:
-                data = (uint8_t*)heap_caps_malloc(w * h * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-                if (data == nullptr) {
-                    ESP_LOGE(TAG, "Failed to allocate memory for preview image");
-                    return false;
-                }
-                memcpy(data, frame_.data, frame_.len);
-                lvgl_image_size = frame_.len;  // fallthrough 时兼顾 YUYV 与 RGB565
-                break;
+                // 预览直接显示帧本身，JPEG 编码同样只读取它，无需拷贝
+                frame_owner_ = std::shared_ptr<uint8_t>(frame_.data, heap_caps_free);
+                display->SetPreviewImage(
+                    std::make_unique<LvglSharedImage>(frame_owner_, frame_.len, w, h, stride, color_format));
+                return true;
 
 #ifdef CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
             case V4L2_PIX_FMT_JPEG: {
@@ -810,8 +836,9 @@ bool EspVideo::Capture() {
                 size_t out_height = 0;
                 size_t out_stride = 0;
 
-                esp_err_t ret =
-                    jpeg_to_image(frame_.data, frame_.len, &out_data, &out_len, &out_width, &out_height, &out_stride);
+                // Only the preview uses this copy, decode it no larger than the screen
+                esp_err_t ret = jpeg_to_image_fit(frame_.data, frame_.len, display->width(), display->height(),
+                                                  &out_data, &out_len, &out_width, &out_height, &out_stride);
                 if (ret != ESP_OK) {
                     ESP_LOGE(TAG, "Failed to decode JPEG image: %d (%s)", (int)ret, esp_err_to_name(ret));
                     if (out_data) {
@@ -874,6 +901,11 @@ bool EspVideo::SetVFlip(bool enabled) {
     return true;
 }
 
+void EspVideo::SetExplainQuality(int max_side, int quality) {
+    explain_max_side_ = max_side;
+    explain_quality_ = quality;
+}
+
 /**
  * @brief 将摄像头捕获的图像发送到远程服务器进行AI分析和解释
  *
@@ -888,154 +920,70 @@ bool EspVideo::SetVFlip(bool enabled) {
  * - 支持设备ID、客户端ID和认证令牌的HTTP头部配置
  *
  * @param question 要向AI提出的关于图像的问题，将作为表单字段发送
- * @return std::string 服务器返回的JSON格式响应字符串
- *         成功时包含AI分析结果，失败时包含错误信息
- *         格式示例：{"success": true, "result": "分析结果"}
- *                  {"success": false, "message": "错误信息"}
+ * @param result 成功时为服务器返回的JSON格式响应字符串，失败时为错误信息
+ * @return bool 服务器正常返回时为true
  *
  * @note 调用此函数前必须先调用SetExplainUrl()设置服务器URL
  * @note 函数会等待之前的编码线程完成后再开始新的处理
- * @warning 如果摄像头缓冲区为空或网络连接失败，将返回错误信息
+ * @warning 如果摄像头缓冲区为空或网络连接失败，将返回false
  */
-std::string EspVideo::Explain(const std::string& question) {
+bool EspVideo::Explain(const std::string& question, std::string& result) {
     if (explain_url_.empty()) {
-        throw std::runtime_error("Image explain URL or token is not set");
+        result = "Image explain URL or token is not set";
+        return false;
     }
 
-    // 创建局部的 JPEG 队列, 40 entries is about to store 512 * 40 = 20480 bytes of JPEG data
-    QueueHandle_t jpeg_queue = xQueueCreate(40, sizeof(JpegChunk));
-    if (jpeg_queue == nullptr) {
-        ESP_LOGE(TAG, "Failed to create JPEG queue");
-        throw std::runtime_error("Failed to create JPEG queue");
+    // 画面未变化时引用上一次上传的图像，不再重复上传
+    uint64_t hash = 0;
+    bool hashed = image_luma_hash(frame_.data, frame_.len, frame_.width, frame_.height, frame_.format, &hash);
+    if (hashed) {
+        auto image_ref = image_cache_.FindSimilar(hash, explain_max_side_);
+        if (!image_ref.empty()) {
+            if (PostExplainReference(explain_url_, explain_token_, question, image_ref, result)) {
+                DLOGI(TAG, "Explain unchanged scene by reference %s, question=%s\n%s",
+                      image_ref.c_str(), question.c_str(), result.c_str());
+                return true;
+            }
+            ESP_LOGW(TAG, "Image reference failed (%s), uploading the photo", result.c_str());
+            image_cache_.Forget();
+        }
     }
+    std::string image_id = hashed ? image_cache_.NewImageId(hash) : "";
+
+    // 编码输出经固定的分块缓冲池边编码边上传，内存占用与图像大小无关
+    JpegChunkStream stream;
 
     // We spawn a thread to encode the image to JPEG using optimized encoder (cost about 500ms and 8KB SRAM)
-    encoder_thread_ = std::thread([this, jpeg_queue]() {
+    TaskFactory::SetThreadStack(kTaskStackPsram, "jpeg_encoder");
+    encoder_thread_ = std::thread([this, &stream]() {
+        DfsBoost boost;
         uint16_t w = frame_.width ? frame_.width : 320;
         uint16_t h = frame_.height ? frame_.height : 240;
         v4l2_pix_fmt_t enc_fmt = frame_.format;
-        bool ok = image_to_jpeg_cb(
-            frame_.data, frame_.len, w, h, enc_fmt, 80,
-            [](void* arg, size_t index, const void* data, size_t len) -> size_t {
-                auto jpeg_queue = static_cast<QueueHandle_t>(arg);
-                JpegChunk chunk = {.data = nullptr, .len = len};
-                if (index == 0 && data != nullptr && len > 0) {
-                    chunk.data = (uint8_t*)heap_caps_aligned_alloc(16, len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-                    if (chunk.data == nullptr) {
-                        ESP_LOGE(TAG, "Failed to allocate %zu bytes for JPEG chunk", len);
-                        chunk.len = 0;
-                    } else {
-                        memcpy(chunk.data, data, len);
-                    }
-                } else {
-                    chunk.len = 0;  // Sentinel or error
-                }
-                xQueueSend(jpeg_queue, &chunk, portMAX_DELAY);
-                return len;
-            },
-            jpeg_queue);
-
+        uint16_t out_w = w, out_h = h;
+        bool ok = image_to_jpeg_fit_cb(frame_.data, frame_.len, w, h, enc_fmt, explain_quality_, explain_max_side_,
+                                       JpegChunkStream::EncoderCallback, &stream, &out_w, &out_h);
         if (!ok) {
-            JpegChunk chunk = {.data = nullptr, .len = 0};
-            xQueueSend(jpeg_queue, &chunk, portMAX_DELAY);
+            stream.Finish(false);
         }
+        ESP_LOGI(TAG, "Explain JPEG %ux%u, quality %d", out_w, out_h, explain_quality_);
     });
+    TaskFactory::SetThreadStack(kTaskStackInternal);
 
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(3);
-    // 构造multipart/form-data请求体
-    std::string boundary = "----ESP32_CAMERA_BOUNDARY";
-
-    // 配置HTTP客户端，使用分块传输编码
-    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
-    http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
-    if (!explain_token_.empty()) {
-        http->SetHeader("Authorization", "Bearer " + explain_token_);
-    }
-    http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
-    http->SetHeader("Transfer-Encoding", "chunked");
-    if (!http->Open("POST", explain_url_)) {
-        ESP_LOGE(TAG, "Failed to connect to explain URL");
-        // Clear the queue
-        encoder_thread_.join();
-        JpegChunk chunk;
-        while (xQueueReceive(jpeg_queue, &chunk, portMAX_DELAY) == pdPASS) {
-            if (chunk.data != nullptr) {
-                heap_caps_free(chunk.data);
-            } else {
-                break;
-            }
-        }
-        vQueueDelete(jpeg_queue);
-        throw std::runtime_error("Failed to connect to explain URL");
-    }
-
-    {
-        // 第一块：question字段
-        std::string question_field;
-        question_field += "--" + boundary + "\r\n";
-        question_field += "Content-Disposition: form-data; name=\"question\"\r\n";
-        question_field += "\r\n";
-        question_field += question + "\r\n";
-        http->Write(question_field.c_str(), question_field.size());
-    }
-    {
-        // 第二块：文件字段头部
-        std::string file_header;
-        file_header += "--" + boundary + "\r\n";
-        file_header += "Content-Disposition: form-data; name=\"file\"; filename=\"camera.jpg\"\r\n";
-        file_header += "Content-Type: image/jpeg\r\n";
-        file_header += "\r\n";
-        http->Write(file_header.c_str(), file_header.size());
-    }
-
-    // 第三块：JPEG数据
+    // The stream is drained on every path, so the encoder always gets to the end
     size_t total_sent = 0;
-    bool saw_terminator = false;
-    while (true) {
-        JpegChunk chunk;
-        if (xQueueReceive(jpeg_queue, &chunk, portMAX_DELAY) != pdPASS) {
-            ESP_LOGE(TAG, "Failed to receive JPEG chunk");
-            break;
-        }
-        if (chunk.data == nullptr) {
-            saw_terminator = true;
-            break;  // The last chunk
-        }
-        http->Write((const char*)chunk.data, chunk.len);
-        total_sent += chunk.len;
-        heap_caps_free(chunk.data);
-    }
-    // Wait for the encoder thread to finish
+    bool ok = PostExplainRequest(explain_url_, explain_token_, question, stream, total_sent, result, image_id);
     encoder_thread_.join();
-    // 清理队列
-    vQueueDelete(jpeg_queue);
-
-    if (!saw_terminator || total_sent == 0) {
-        ESP_LOGE(TAG, "JPEG encoder failed or produced empty output");
-        throw std::runtime_error("Failed to encode image to JPEG");
+    if (!ok) {
+        return false;
     }
-
-    {
-        // 第四块：multipart尾部
-        std::string multipart_footer;
-        multipart_footer += "\r\n--" + boundary + "--\r\n";
-        http->Write(multipart_footer.c_str(), multipart_footer.size());
+    if (hashed) {
+        image_cache_.Remember(hash, explain_max_side_, image_id);
     }
-    // 结束块
-    http->Write("", 0);
-
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
-        throw std::runtime_error("Failed to upload photo");
-    }
-
-    std::string result = http->ReadAll();
-    http->Close();
 
     // Get remain task stack size
     size_t remain_stack_size = uxTaskGetStackHighWaterMark(nullptr);
-    ESP_LOGI(TAG, "Explain image size=%d bytes, compressed size=%d, remain stack size=%d, question=%s\n%s",
-             (int)frame_.len, (int)total_sent, (int)remain_stack_size, question.c_str(), result.c_str());
-    return result;
+    DLOGI(TAG, "Explain image size=%d bytes, compressed size=%d, remain stack size=%d, question=%s\n%s",
+          (int)frame_.len, (int)total_sent, (int)remain_stack_size, question.c_str(), result.c_str());
+    return true;
 }
@@ -11,13 +11,9 @@
 
 #include "camera.h"
 #include "jpg/image_to_jpeg.h"
+#include "explain_upload.h"
 #include "esp_video_init.h"
 
-struct JpegChunk {
-    uint8_t* data;
-    size_t len;
-};
-
 class EspVideo : public Camera {
 private:
     struct FrameBuffer {
@@ -27,6 +23,8 @@ private:
         uint16_t height = 0;
         v4l2_pix_fmt_t format = 0;
     } frame_;
+    // Shares frame_.data with the preview, which then shows it without a copy
+    std::shared_ptr<uint8_t> frame_owner_;
     v4l2_pix_fmt_t sensor_format_ = 0;
 #ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
     uint16_t sensor_width_ = 0;
@@ -39,6 +37,9 @@ private:
     std::string explain_url_;
     std::string explain_token_;
     std::thread encoder_thread_;
+    int explain_max_side_ = 0;
+    int explain_quality_ = 80;
+    ExplainImageCache image_cache_;
 
 public:
     EspVideo(const esp_video_init_config_t& config);
@@ -49,5 +50,6 @@ public:
     // 翻转控制函数
     virtual bool SetHMirror(bool enabled) override;
     virtual bool SetVFlip(bool enabled) override;
-    virtual std::string Explain(const std::string& question);
+    virtual void SetExplainQuality(int max_side, int quality) override;
+    virtual bool Explain(const std::string& question, std::string& result);
 };
@@ -0,0 +1,257 @@
+#include "explain_upload.h"
+#include "board.h"
+#include "system_info.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#define TAG "ExplainUpload"
+
+#define EXPLAIN_BOUNDARY "----ESP32_CAMERA_BOUNDARY"
+
+// Frames whose hashes differ in at most this many of the 64 bits count as the same scene
+#define EXPLAIN_SIMILAR_MAX_BITS 4
+// How long the server is expected to keep an uploaded image
+#define EXPLAIN_IMAGE_REF_TTL_US (5 * 60 * 1000000LL)
+
+JpegChunkStream::JpegChunkStream(size_t chunk_size, int chunk_count) : chunk_size_(chunk_size) {
+    free_queue_ = xQueueCreate(chunk_count, sizeof(uint8_t*));
+    // One more slot for the end of stream marker
+    full_queue_ = xQueueCreate(chunk_count + 1, sizeof(JpegChunk));
+    pool_ = (uint8_t*)heap_caps_malloc(chunk_size * chunk_count, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (free_queue_ == nullptr || full_queue_ == nullptr || pool_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %d JPEG chunks of %u bytes", chunk_count, chunk_size);
+        return;
+    }
+    for (int i = 0; i < chunk_count; i++) {
+        uint8_t* buffer = pool_ + i * chunk_size;
+        xQueueSend(free_queue_, &buffer, 0);
+    }
+}
+
+JpegChunkStream::~JpegChunkStream() {
+    if (free_queue_ != nullptr) {
+        vQueueDelete(free_queue_);
+    }
+    if (full_queue_ != nullptr) {
+        vQueueDelete(full_queue_);
+    }
+    heap_caps_free(pool_);
+}
+
+bool JpegChunkStream::Write(const void* data, size_t len) {
+    if (pool_ == nullptr || free_queue_ == nullptr || full_queue_ == nullptr) {
+        ok_ = false;
+        return false;
+    }
+
+    // Small encoder outputs are gathered so that every HTTP chunk is a full buffer
+    auto src = (const uint8_t*)data;
+    while (len > 0) {
+        if (pending_.data == nullptr) {
+            xQueueReceive(free_queue_, &pending_.data, portMAX_DELAY);
+            pending_.len = 0;
+        }
+        size_t n = std::min(len, chunk_size_ - pending_.len);
+        memcpy(pending_.data + pending_.len, src, n);
+        pending_.len += n;
+        src += n;
+        len -= n;
+        if (pending_.len == chunk_size_) {
+            xQueueSend(full_queue_, &pending_, portMAX_DELAY);
+            pending_.data = nullptr;
+        }
+    }
+    return true;
+}
+
+void JpegChunkStream::Finish(bool ok) {
+    if (finished_.exchange(true) || full_queue_ == nullptr) {
+        return;
+    }
+    if (!ok) {
+        ok_ = false;
+    }
+    if (pending_.data != nullptr) {
+        if (pending_.len > 0) {
+            xQueueSend(full_queue_, &pending_, portMAX_DELAY);
+        } else {
+            xQueueSend(free_queue_, &pending_.data, portMAX_DELAY);
+        }
+        pending_.data = nullptr;
+    }
+    JpegChunk end = {nullptr, 0};
+    xQueueSend(full_queue_, &end, portMAX_DELAY);
+}
+
+size_t JpegChunkStream::EncoderCallback(void* arg, size_t index, const void* data, size_t len) {
+    auto stream = static_cast<JpegChunkStream*>(arg);
+    if (index == 0 && data != nullptr && len > 0) {
+        return stream->Write(data, len) ? len : 0;
+    }
+    // End of image
+    stream->Finish(true);
+    return len;
+}
+
+bool JpegChunkStream::Receive(JpegChunk& chunk) {
+    if (full_queue_ == nullptr) {
+        return false;
+    }
+    return xQueueReceive(full_queue_, &chunk, portMAX_DELAY) == pdPASS;
+}
+
+void JpegChunkStream::Release(const JpegChunk& chunk) {
+    if (chunk.data != nullptr) {
+        xQueueSend(free_queue_, &chunk.data, portMAX_DELAY);
+    }
+}
+
+void JpegChunkStream::Drain() {
+    JpegChunk chunk;
+    while (Receive(chunk) && chunk.data != nullptr) {
+        Release(chunk);
+    }
+}
+
+std::string ExplainImageCache::FindSimilar(uint64_t hash, int max_side) const {
+    if (image_id_.empty() || esp_timer_get_time() - upload_time_us_ > EXPLAIN_IMAGE_REF_TTL_US) {
+        return "";
+    }
+    // A smaller photo than the one asked for does not do
+    if (max_side_ != 0 && (max_side == 0 || max_side > max_side_)) {
+        return "";
+    }
+    if (__builtin_popcountll(hash ^ hash_) > EXPLAIN_SIMILAR_MAX_BITS) {
+        return "";
+    }
+    return image_id_;
+}
+
+std::string ExplainImageCache::NewImageId(uint64_t hash) {
+    char id[32];
+    snprintf(id, sizeof(id), "%016llx-%lu", (unsigned long long)hash, (unsigned long)++counter_);
+    return id;
+}
+
+void ExplainImageCache::Remember(uint64_t hash, int max_side, const std::string& image_id) {
+    hash_ = hash;
+    max_side_ = max_side;
+    image_id_ = image_id;
+    upload_time_us_ = esp_timer_get_time();
+}
+
+void ExplainImageCache::Forget() {
+    image_id_.clear();
+}
+
+static void AddFormField(std::string& body, const char* name, const std::string& value) {
+    body += "--" EXPLAIN_BOUNDARY "\r\n";
+    body += "Content-Disposition: form-data; name=\"";
+    body += name;
+    body += "\"\r\n\r\n";
+    body += value + "\r\n";
+}
+
+// Sends the headers and the form fields, then the file part header unless the image is a reference
+static std::unique_ptr<Http> OpenExplainRequest(const std::string& url, const std::string& token, const std::string& question,
+    const std::string& image_id, bool reference) {
+    auto network = Board::GetInstance().GetNetwork();
+    auto http = network->CreateHttp(3);
+    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+    http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+    if (!token.empty()) {
+        http->SetHeader("Authorization", "Bearer " + token);
+    }
+    http->SetHeader("Content-Type", "multipart/form-data; boundary=" EXPLAIN_BOUNDARY);
+    http->SetHeader("Transfer-Encoding", "chunked");
+    if (!http->Open("POST", url)) {
+        ESP_LOGE(TAG, "Failed to connect to explain URL");
+        return nullptr;
+    }
+
+    std::string fields;
+    AddFormField(fields, "question", question);
+    if (reference) {
+        AddFormField(fields, "image_ref", image_id);
+    } else {
+        if (!image_id.empty()) {
+            AddFormField(fields, "image_id", image_id);
+        }
+        fields += "--" EXPLAIN_BOUNDARY "\r\n";
+        fields += "Content-Disposition: form-data; name=\"file\"; filename=\"camera.jpg\"\r\n";
+        fields += "Content-Type: image/jpeg\r\n";
+        fields += "\r\n";
+    }
+    http->Write(fields.c_str(), fields.size());
+    return http;
+}
+
+static bool FinishExplainRequest(Http* http, std::string& result, bool reference = false) {
+    // Without a file part the last field already ends with its line break
+    static const char footer[] = "\r\n--" EXPLAIN_BOUNDARY "--\r\n";
+    const char* end = reference ? footer + 2 : footer;
+    http->Write(end, strlen(end));
+    http->Write("", 0);
+
+    if (http->GetStatusCode() != 200) {
+        ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
+        result = "Failed to upload photo";
+        return false;
+    }
+
+    result = http->ReadAll();
+    http->Close();
+    return true;
+}
+
+bool PostExplainRequest(const std::string& url, const std::string& token, const std::string& question,
+    JpegChunkStream& stream, size_t& jpeg_size, std::string& result, const std::string& image_id) {
+    auto http = OpenExplainRequest(url, token, question, image_id, false);
+    if (http == nullptr) {
+        stream.Drain();
+        result = "Failed to connect to explain URL";
+        return false;
+    }
+
+    // Each chunk goes out while the encoder fills the next ones
+    jpeg_size = 0;
+    JpegChunk chunk;
+    while (stream.Receive(chunk) && chunk.data != nullptr) {
+        http->Write((const char*)chunk.data, chunk.len);
+        jpeg_size += chunk.len;
+        stream.Release(chunk);
+    }
+
+    if (!stream.ok() || jpeg_size == 0) {
+        ESP_LOGE(TAG, "JPEG encoder failed or produced empty output");
+        result = "Failed to encode image to JPEG";
+        return false;
+    }
+    return FinishExplainRequest(http.get(), result);
+}
+
+bool PostExplainRequest(const std::string& url, const std::string& token, const std::string& question,
+    const uint8_t* jpeg, size_t jpeg_size, std::string& result, const std::string& image_id) {
+    auto http = OpenExplainRequest(url, token, question, image_id, false);
+    if (http == nullptr) {
+        result = "Failed to connect to explain URL";
+        return false;
+    }
+    http->Write((const char*)jpeg, jpeg_size);
+    return FinishExplainRequest(http.get(), result);
+}
+
+bool PostExplainReference(const std::string& url, const std::string& token, const std::string& question,
+    const std::string& image_id, std::string& result) {
+    auto http = OpenExplainRequest(url, token, question, image_id, true);
+    if (http == nullptr) {
+        result = "Failed to connect to explain URL";
+        return false;
+    }
+    return FinishExplainRequest(http.get(), result, true);
+}
@@ -0,0 +1,83 @@
+#ifndef EXPLAIN_UPLOAD_H
+#define EXPLAIN_UPLOAD_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct JpegChunk {
+    uint8_t* data;
+    size_t len;
+};
+
+/*
+ * Carries the encoder output to the HTTP upload through a fixed pool of chunk buffers.
+ * The encoder thread blocks while every chunk is in flight, so the memory used does not
+ * depend on the image size and the upload starts with the first chunk.
+ */
+class JpegChunkStream {
+public:
+    JpegChunkStream(size_t chunk_size = 8 * 1024, int chunk_count = 4);
+    ~JpegChunkStream();
+
+    // Producer side
+    bool Write(const void* data, size_t len);
+    void Finish(bool ok);
+    // Matches jpg_out_cb, pass the stream as arg
+    static size_t EncoderCallback(void* arg, size_t index, const void* data, size_t len);
+
+    // Consumer side, a chunk with data == nullptr ends the stream
+    bool Receive(JpegChunk& chunk);
+    void Release(const JpegChunk& chunk);
+    // Recycles everything up to the end of the stream, so that the producer can finish
+    void Drain();
+    bool ok() const { return ok_; }
+
+private:
+    uint8_t* pool_ = nullptr;
+    size_t chunk_size_;
+    QueueHandle_t free_queue_ = nullptr;
+    QueueHandle_t full_queue_ = nullptr;
+    JpegChunk pending_ = {nullptr, 0};
+    std::atomic<bool> finished_ = false;
+    std::atomic<bool> ok_ = true;
+};
+
+/*
+ * Remembers the last uploaded photo by its luma hash. A question about a scene that has not changed
+ * refers to that upload by its image_id, which the server keeps for a while, instead of sending it again.
+ */
+class ExplainImageCache {
+public:
+    // Id of the last upload if it looks the same, is recent enough and was sent with at least
+    // max_side (0 for the full size) on its longest side, empty otherwise
+    std::string FindSimilar(uint64_t hash, int max_side) const;
+    // Id to send with the upload of a frame with this hash, it is remembered once Remember() is called
+    std::string NewImageId(uint64_t hash);
+    void Remember(uint64_t hash, int max_side, const std::string& image_id);
+    void Forget();
+
+private:
+    uint64_t hash_ = 0;
+    int max_side_ = 0;
+    std::string image_id_;
+    int64_t upload_time_us_ = 0;
+    uint32_t counter_ = 0;
+};
+
+// Posts the question and the JPEG as multipart/form-data with chunked transfer encoding.
+// The result is the server response, or the error message if it returns false.
+// A non-empty image_id is sent along, so that later questions can refer to the image.
+bool PostExplainRequest(const std::string& url, const std::string& token, const std::string& question,
+    JpegChunkStream& stream, size_t& jpeg_size, std::string& result, const std::string& image_id = "");
+bool PostExplainRequest(const std::string& url, const std::string& token, const std::string& question,
+    const uint8_t* jpeg, size_t jpeg_size, std::string& result, const std::string& image_id = "");
+// Asks about an image uploaded earlier with image_id, fails if the server does not have it anymore
+bool PostExplainReference(const std::string& url, const std::string& token, const std::string& question,
+    const std::string& image_id, std::string& result);
+
+#endif // EXPLAIN_UPLOAD_H
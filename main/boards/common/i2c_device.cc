@@ -1,11 +1,17 @@
 #include "i2c_device.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <vector>
 
 #define TAG "I2cDevice"
 
+// Devices alive on any bus, for PrintStatistics()
+static std::mutex registry_mutex;
+static std::vector<I2cDevice*> registry;
 
-I2cDevice::I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr) {
+I2cDevice::I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : addr_(addr) {
     i2c_device_config_t i2c_device_cfg = {
         .dev_addr_length = I2C_ADDR_BIT_LEN_7,
         .device_address = addr,
@@ -17,19 +23,91 @@ I2cDevice::I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr) {
     };
     ESP_ERROR_CHECK(i2c_master_bus_add_device(i2c_bus, &i2c_device_cfg, &i2c_device_));
     assert(i2c_device_ != NULL);
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.push_back(this);
+}
+
+I2cDevice::~I2cDevice() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.erase(std::remove(registry.begin(), registry.end(), this), registry.end());
+}
+
+void I2cDevice::Account(int64_t start_us, size_t bytes) {
+    int64_t elapsed = esp_timer_get_time() - start_us;
+    statistics_.transactions++;
+    statistics_.bytes += bytes;
+    statistics_.bus_time_us += elapsed;
+    statistics_.max_transaction_us = std::max(statistics_.max_transaction_us, elapsed);
+}
+
+void I2cDevice::SetBurstWindow(uint8_t first_reg, uint8_t count, int64_t max_age_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    burst_first_reg_ = first_reg;
+    burst_count_ = std::min<uint8_t>(count, kMaxBurstWindow);
+    burst_max_age_us_ = max_age_us;
+    burst_valid_ = false;
 }
 
 void I2cDevice::WriteReg(uint8_t reg, uint8_t value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (InBurstWindow(reg)) {
+        burst_valid_ = false;
+    }
     uint8_t buffer[2] = {reg, value};
+    int64_t start = esp_timer_get_time();
     ESP_ERROR_CHECK(i2c_master_transmit(i2c_device_, buffer, 2, 100));
+    Account(start, 2);
 }
 
 uint8_t I2cDevice::ReadReg(uint8_t reg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (InBurstWindow(reg)) {
+        int64_t now = esp_timer_get_time();
+        if (!burst_valid_ || now - burst_time_us_ > burst_max_age_us_) {
+            ESP_ERROR_CHECK(i2c_master_transmit_receive(i2c_device_, &burst_first_reg_, 1, burst_data_, burst_count_, 100));
+            Account(now, 1 + burst_count_);
+            burst_time_us_ = now;
+            burst_valid_ = true;
+        } else {
+            statistics_.cached_reads++;
+        }
+        return burst_data_[reg - burst_first_reg_];
+    }
+
     uint8_t buffer[1];
+    int64_t start = esp_timer_get_time();
     ESP_ERROR_CHECK(i2c_master_transmit_receive(i2c_device_, &reg, 1, buffer, 1, 100));
+    Account(start, 2);
     return buffer[0];
 }
 
 void I2cDevice::ReadRegs(uint8_t reg, uint8_t* buffer, size_t length) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t start = esp_timer_get_time();
     ESP_ERROR_CHECK(i2c_master_transmit_receive(i2c_device_, &reg, 1, buffer, length, 100));
-}
\ No newline at end of file
+    Account(start, 1 + length);
+}
+
+I2cDeviceStatistics I2cDevice::GetStatistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return statistics_;
+}
+
+void I2cDevice::PrintStatistics() {
+    std::vector<std::pair<uint8_t, I2cDeviceStatistics>> devices;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (auto device : registry) {
+            devices.emplace_back(device->address(), device->GetStatistics());
+        }
+    }
+    std::sort(devices.begin(), devices.end(), [](const auto& a, const auto& b) {
+        return a.second.bus_time_us > b.second.bus_time_us;
+    });
+    for (const auto& [addr, stats] : devices) {
+        ESP_LOGD(TAG, "0x%02x: %lu transactions, %lu cached, %lu bytes, bus time %lld ms, max %lld us",
+            addr, (unsigned long)stats.transactions, (unsigned long)stats.cached_reads, (unsigned long)stats.bytes,
+            stats.bus_time_us / 1000, stats.max_transaction_us);
+    }
+}
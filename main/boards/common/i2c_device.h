@@ -3,9 +3,27 @@
 
 #include <driver/i2c_master.h>
 
+#include <cstdint>
+#include <mutex>
+
+struct I2cDeviceStatistics {
+    uint32_t transactions = 0;
+    // Reads answered from the burst snapshot without touching the bus
+    uint32_t cached_reads = 0;
+    uint32_t bytes = 0;
+    int64_t bus_time_us = 0;
+    int64_t max_transaction_us = 0;
+};
+
 class I2cDevice {
 public:
     I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr);
+    virtual ~I2cDevice();
+
+    uint8_t address() const { return addr_; }
+    I2cDeviceStatistics GetStatistics();
+    // Logs the bus time of every device, most expensive first
+    static void PrintStatistics();
 
 protected:
     i2c_master_dev_handle_t i2c_device_;
@@ -13,6 +31,27 @@ protected:
     void WriteReg(uint8_t reg, uint8_t value);
     uint8_t ReadReg(uint8_t reg);
     void ReadRegs(uint8_t reg, uint8_t* buffer, size_t length);
+
+    // Registers first_reg..first_reg+count-1 are fetched in one burst read and ReadReg() answers
+    // from that snapshot until it is max_age_us old, for status registers that are polled together
+    void SetBurstWindow(uint8_t first_reg, uint8_t count, int64_t max_age_us);
+
+private:
+    static constexpr int kMaxBurstWindow = 16;
+
+    uint8_t addr_;
+    std::mutex mutex_;
+    I2cDeviceStatistics statistics_;
+
+    uint8_t burst_first_reg_ = 0;
+    uint8_t burst_count_ = 0;
+    int64_t burst_max_age_us_ = 0;
+    int64_t burst_time_us_ = 0;
+    bool burst_valid_ = false;
+    uint8_t burst_data_[kMaxBurstWindow];
+
+    bool InBurstWindow(uint8_t reg) const { return reg >= burst_first_reg_ && reg < burst_first_reg_ + burst_count_; }
+    void Account(int64_t start_us, size_t bytes);
 };
 
 #endif // I2C_DEVICE_H
@@ -2,13 +2,23 @@
 
 static const char* TAG = "Knob";
 
+// Detents are summed over one UI frame, so a fast turn costs one volume write and one redraw per frame
+#define KNOB_BATCH_US (50 * 1000)
+#define KNOB_BATCH_SLACK_US (10 * 1000)
+
 Knob::Knob(gpio_num_t pin_a, gpio_num_t pin_b) {
     knob_config_t config = {
         .default_direction = 0,
         .gpio_encoder_a = static_cast<uint8_t>(pin_a),
         .gpio_encoder_b = static_cast<uint8_t>(pin_b),
+        // The encoder pins wake the knob timer by interrupt, it doesn't poll while the knob rests
+        .enable_power_save = true,
     };
 
+    batch_timer_ = TimerWheel::GetInstance().Create("knob_batch", [this]() {
+        DeliverSteps();
+    });
+
     esp_err_t err = ESP_OK;
     knob_handle_ = iot_knob_create(&config);
     if (knob_handle_ == NULL) {
@@ -36,12 +46,17 @@ Knob::~Knob() {
         iot_knob_delete(knob_handle_);
         knob_handle_ = NULL;
     }
+    TimerWheel::GetInstance().Delete(batch_timer_);
 }
 
 void Knob::OnRotate(std::function<void(bool)> callback) {
     on_rotate_ = callback;
 }
 
+void Knob::OnRotateSteps(std::function<void(int)> callback) {
+    on_rotate_steps_ = callback;
+}
+
 void Knob::knob_callback(void* arg, void* data) {
     Knob* knob = static_cast<Knob*>(data);
     knob_event_t event = iot_knob_get_event(arg);
@@ -49,4 +64,19 @@ void Knob::knob_callback(void* arg, void* data) {
     if (knob->on_rotate_) {
         knob->on_rotate_(event == KNOB_RIGHT);
     }
+    if (knob->on_rotate_steps_) {
+        knob->pending_steps_ += event == KNOB_RIGHT ? 1 : -1;
+        // The first detent of a frame starts the timer, the rest only add up
+        if (!knob->batch_pending_.exchange(true)) {
+            TimerWheel::GetInstance().StartOnce(knob->batch_timer_, KNOB_BATCH_US, KNOB_BATCH_SLACK_US);
+        }
+    }
+}
+
+void Knob::DeliverSteps() {
+    batch_pending_ = false;
+    int steps = pending_steps_.exchange(0);
+    if (steps != 0 && on_rotate_steps_) {
+        on_rotate_steps_(steps);
+    }
 }
\ No newline at end of file
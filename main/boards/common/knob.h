@@ -3,23 +3,34 @@
 
 #include <driver/gpio.h>
 #include <functional>
+#include <atomic>
 #include <esp_log.h>
 #include <iot_knob.h>
 
+#include "timer_wheel.h"
+
 class Knob {
 public:
     Knob(gpio_num_t pin_a, gpio_num_t pin_b);
     ~Knob();
 
+    // Called for every detent from the knob timer
     void OnRotate(std::function<void(bool)> callback);
+    // Called once per UI frame with the detents turned since the last call, clockwise is positive
+    void OnRotateSteps(std::function<void(int)> callback);
 
 private:
     static void knob_callback(void* arg, void* data);
+    void DeliverSteps();
 
     knob_handle_t knob_handle_;
     gpio_num_t pin_a_;
     gpio_num_t pin_b_;
     std::function<void(bool)> on_rotate_;
+    std::function<void(int)> on_rotate_steps_;
+    TimerWheel::Handle batch_timer_ = nullptr;
+    std::atomic<int> pending_steps_{0};
+    std::atomic<bool> batch_pending_{false};
 };
 
-#endif // KNOB_H_
\ No newline at end of file
+#endif // KNOB_H_
@@ -37,6 +37,8 @@ public:
             gpio_set_level(gpio_num_, 0);
             return true;
         });
+        mcp_server.SetDeviceControlTool("self.lamp.turn_on");
+        mcp_server.SetDeviceControlTool("self.lamp.turn_off");
     }
 };
 
@@ -0,0 +1,74 @@
+#include "lcd_init_sequence.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_check.h>
+#include <esp_lcd_panel_commands.h>
+#include <esp_log.h>
+#include <esp_rom_sys.h>
+#include <esp_timer.h>
+#include <sdkconfig.h>
+
+static const char *TAG = "LcdInitSequence";
+
+#if CONFIG_LCD_INIT_DATASHEET_DELAYS
+// The delay the MIPI DCS specification asks for after a standard command, -1 for the vendor's.
+// Only the commands tables end with, on paged controllers low codes are vendor registers too.
+static int required_delay_ms(int cmd)
+{
+    switch (cmd) {
+    case LCD_CMD_SWRESET:
+    case LCD_CMD_SLPIN:
+    case LCD_CMD_SLPOUT:
+        return 120;
+    case LCD_CMD_DISPOFF:
+    case LCD_CMD_DISPON:
+    case LCD_CMD_TEOFF:
+    case LCD_CMD_TEON:
+    case LCD_CMD_MADCTL:
+    case LCD_CMD_COLMOD:
+        return 0;
+    default:
+        return -1;
+    }
+}
+#endif
+
+static void wait_ms(unsigned int ms)
+{
+    if (ms == 0) {
+        return;
+    }
+    if (ms < portTICK_PERIOD_MS) {
+        esp_rom_delay_us(ms * 1000);
+        return;
+    }
+    vTaskDelay((ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+}
+
+esp_err_t lcd_init_sequence_run(esp_lcd_panel_io_handle_t io, const lcd_init_sequence_cmd_t *cmds, size_t count,
+                                const char *panel)
+{
+    int64_t start_us = esp_timer_get_time();
+    unsigned int waited_ms = 0;
+    unsigned int trimmed_ms = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        ESP_RETURN_ON_ERROR(esp_lcd_panel_io_tx_param(io, cmds[i].cmd, cmds[i].data, cmds[i].data_bytes), TAG,
+                            "%s: command %02Xh failed", panel, cmds[i].cmd);
+        unsigned int delay_ms = cmds[i].delay_ms;
+#if CONFIG_LCD_INIT_DATASHEET_DELAYS
+        int required_ms = required_delay_ms(cmds[i].cmd);
+        if (required_ms >= 0 && delay_ms > (unsigned int)required_ms) {
+            trimmed_ms += delay_ms - required_ms;
+            delay_ms = required_ms;
+        }
+#endif
+        wait_ms(delay_ms);
+        waited_ms += delay_ms;
+    }
+
+    ESP_LOGI(TAG, "%s: %u commands in %d ms, %u ms of it waiting, %u ms of the table delays skipped", panel,
+             (unsigned int)count, (int)((esp_timer_get_time() - start_us) / 1000), waited_ms, trimmed_ms);
+    return ESP_OK;
+}
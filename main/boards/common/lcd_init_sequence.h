@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <esp_err.h>
+#include <esp_lcd_panel_io.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief One command of a panel init table, the layout of the vendor *_lcd_init_cmd_t types
+ */
+typedef struct {
+    int cmd;
+    const void *data;
+    size_t data_bytes;
+    unsigned int delay_ms;  // Delay the vendor table asks for after this command
+} lcd_init_sequence_cmd_t;
+
+/**
+ * @brief Send a panel init table and log how long it took
+ *
+ * Commands without a delay follow each other without giving up the CPU. Delays shorter than a tick
+ * are spun, longer ones are rounded up to whole ticks, where pdMS_TO_TICKS() rounded a 5 ms delay
+ * at 100 Hz down to no delay at all. With CONFIG_LCD_INIT_DATASHEET_DELAYS the delay after a
+ * standard DCS command is capped at what the MIPI DCS specification asks for (reset and Sleep
+ * In / Out 120 ms, display on / off, tearing effect, address mode and pixel format none),
+ * vendor commands keep the delay of their table.
+ *
+ * @param io Panel IO the commands go to
+ * @param cmds Table with the layout of lcd_init_sequence_cmd_t
+ * @param count Number of commands
+ * @param panel Name of the panel for the log
+ */
+esp_err_t lcd_init_sequence_run(esp_lcd_panel_io_handle_t io, const lcd_init_sequence_cmd_t *cmds, size_t count,
+                                const char *panel);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,9 +2,14 @@
 
 #include "audio_codec.h"
 #include "display.h"
+#include "application.h"
+#include "metrics.h"
 
 #include <esp_log.h>
 #include <esp_timer.h>
+#if CONFIG_ML307_PPP_MODE
+#include <esp_network.h>
+#endif
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <font_awesome.h>
@@ -16,6 +21,8 @@ static const char *TAG = "Ml307Board";
 static constexpr int MODEM_DETECT_MAX_RETRIES = 30;
 // Maximum retry count for network registration
 static constexpr int NETWORK_REG_MAX_RETRIES = 6;
+// The modem stays awake this long after the last UART activity before it sleeps
+static constexpr int MODEM_SLEEP_DELAY_SECONDS = 5;
 
 Ml307Board::Ml307Board(gpio_num_t tx_pin, gpio_num_t rx_pin, gpio_num_t dtr_pin) : tx_pin_(tx_pin), rx_pin_(rx_pin), dtr_pin_(dtr_pin) {
 }
@@ -68,6 +75,36 @@ void Ml307Board::NetworkTask() {
     // Notify modem detection started
     OnNetworkEvent(NetworkEvent::ModemDetecting);
 
+#if CONFIG_ML307_PPP_MODE
+    ppp_modem_ = std::make_unique<Ml307PppModem>(tx_pin_, rx_pin_, CONFIG_ML307_PPP_BAUD_RATE);
+    ppp_modem_->OnNetworkStateChanged([this](bool network_ready) {
+        OnNetworkEvent(network_ready ? NetworkEvent::Connected : NetworkEvent::Disconnected);
+    });
+    OnNetworkEvent(NetworkEvent::Connecting);
+    for (int reg_retries = 0; reg_retries < NETWORK_REG_MAX_RETRIES; reg_retries++) {
+        auto result = ppp_modem_->Start();
+        if (result == Ml307PppStatus::Ready) {
+            ESP_LOGI(TAG, "ML307 Revision: %s", ppp_modem_->GetModuleRevision().c_str());
+            ESP_LOGI(TAG, "ML307 IMEI: %s", ppp_modem_->GetImei().c_str());
+            ESP_LOGI(TAG, "ML307 ICCID: %s", ppp_modem_->GetIccid().c_str());
+            return;
+        }
+        ppp_modem_->Stop();
+        if (result == Ml307PppStatus::ErrorNoModem || result == Ml307PppStatus::ErrorDataMode) {
+            OnNetworkEvent(NetworkEvent::ModemErrorInitFailed);
+        } else if (result == Ml307PppStatus::ErrorInsertPin) {
+            OnNetworkEvent(NetworkEvent::ModemErrorNoSim);
+        } else if (result == Ml307PppStatus::ErrorRegistrationDenied) {
+            OnNetworkEvent(NetworkEvent::ModemErrorRegDenied);
+        } else {
+            OnNetworkEvent(NetworkEvent::ModemErrorTimeout);
+        }
+        vTaskDelay(pdMS_TO_TICKS(10000));
+    }
+    ESP_LOGE(TAG, "Failed to start the PPP link after %d retries", NETWORK_REG_MAX_RETRIES);
+    return;
+#endif
+
     // Try to detect modem with retry limit
     int detect_retries = 0;
     while (detect_retries < MODEM_DETECT_MAX_RETRIES) {
@@ -141,14 +178,32 @@ void Ml307Board::StartNetwork() {
 }
 
 NetworkInterface* Ml307Board::GetNetwork() {
+#if CONFIG_ML307_PPP_MODE
+    static EspNetwork network;
+    return &network;
+#else
     return modem_.get();
+#endif
+}
+
+int Ml307Board::GetCsq() {
+    {
+        std::lock_guard<std::mutex> lock(power_mutex_);
+        if (modem_sleeping_) {
+            return last_csq_;
+        }
+    }
+    int csq = info_modem()->GetCsq();
+    std::lock_guard<std::mutex> lock(power_mutex_);
+    last_csq_ = csq;
+    return csq;
 }
 
 const char* Ml307Board::GetNetworkStateIcon() {
-    if (modem_ == nullptr || !modem_->network_ready()) {
+    if (info_modem() == nullptr || !info_modem()->network_ready()) {
         return FONT_AWESOME_SIGNAL_OFF;
     }
-    int csq = modem_->GetCsq();
+    int csq = GetCsq();
     if (csq == -1) {
         return FONT_AWESOME_SIGNAL_OFF;
     } else if (csq >= 0 && csq <= 9) {
@@ -165,22 +220,77 @@ const char* Ml307Board::GetNetworkStateIcon() {
     return FONT_AWESOME_SIGNAL_OFF;
 }
 
+int Ml307Board::GetSignalStrength() {
+    if (info_modem() == nullptr || !info_modem()->network_ready()) {
+        return -1;
+    }
+    // CSQ 0-31, 99 when unknown
+    int csq = GetCsq();
+    if (csq < 0 || csq > 31) {
+        return -1;
+    }
+    return csq * 100 / 31;
+}
+
 std::string Ml307Board::GetBoardJson() {
     // Set the board type for OTA
     std::string board_json = std::string("{\"type\":\"" BOARD_TYPE "\",");
     board_json += "\"name\":\"" BOARD_NAME "\",";
-    board_json += "\"revision\":\"" + modem_->GetModuleRevision() + "\",";
-    board_json += "\"carrier\":\"" + modem_->GetCarrierName() + "\",";
-    board_json += "\"csq\":\"" + std::to_string(modem_->GetCsq()) + "\",";
-    board_json += "\"imei\":\"" + modem_->GetImei() + "\",";
-    board_json += "\"iccid\":\"" + modem_->GetIccid() + "\",";
-    board_json += "\"cereg\":" + modem_->GetRegistrationState().ToString() + "}";
+    board_json += "\"revision\":\"" + info_modem()->GetModuleRevision() + "\",";
+    board_json += "\"carrier\":\"" + info_modem()->GetCarrierName() + "\",";
+    board_json += "\"csq\":\"" + std::to_string(GetCsq()) + "\",";
+    board_json += "\"imei\":\"" + info_modem()->GetImei() + "\",";
+    board_json += "\"iccid\":\"" + info_modem()->GetIccid() + "\",";
+    board_json += "\"cereg\":" + info_modem()->GetRegistrationState().ToString() + "}";
     return board_json;
 }
 
 void Ml307Board::SetPowerSaveLevel(PowerSaveLevel level) {
-    // TODO: Implement power save level for ML307
+#if CONFIG_ML307_SLEEP_BETWEEN_TURNS
+    std::lock_guard<std::mutex> lock(power_mutex_);
+    bool sleep = level == PowerSaveLevel::LOW_POWER;
+    // Without DTR the modem could not be woken from the device side
+    if (sleep == modem_sleeping_ || dtr_pin_ == GPIO_NUM_NC || modem_ == nullptr || !modem_->network_ready()) {
+        return;
+    }
+
+    auto at_uart = modem_->GetAtUart();
+    if (sleep) {
+#if CONFIG_ML307_IDLE_EDRX
+        if (!at_uart->SendCommand("AT+CEDRXS=2,4,\"" CONFIG_ML307_IDLE_EDRX_VALUE "\"")) {
+            ESP_LOGW(TAG, "eDRX request refused");
+        }
+#endif
+        if (!modem_->SetSleepMode(true, MODEM_SLEEP_DELAY_SECONDS)) {
+            ESP_LOGW(TAG, "Failed to enable modem sleep");
+            return;
+        }
+    } else {
+        // Clears DTR first, so the modem is awake for the commands that follow
+        if (!modem_->SetSleepMode(false)) {
+            ESP_LOGW(TAG, "Failed to disable modem sleep");
+        }
+#if CONFIG_ML307_IDLE_EDRX
+        at_uart->SendCommand("AT+CEDRXS=0,4");
+#endif
+    }
+    modem_sleeping_ = sleep;
+    ESP_LOGI(TAG, "Modem %s", sleep ? "sleeps between turns" : "active");
+#else
     (void)level;
+#endif
+}
+
+const char* Ml307Board::GetModemPowerState() {
+    std::lock_guard<std::mutex> lock(power_mutex_);
+    if (!modem_sleeping_) {
+        return "active";
+    }
+#if CONFIG_ML307_IDLE_EDRX
+    return "edrx";
+#else
+    return "sleep";
+#endif
 }
 
 std::string Ml307Board::GetDeviceStatusJson() {
@@ -203,52 +313,16 @@ std::string Ml307Board::GetDeviceStatusJson() {
      *     "network": {
      *         "type": "cellular",
      *         "carrier": "CHINA MOBILE",
-     *         "csq": 10
+     *         "csq": 10,
+     *         "modem_power": "active"
      *     }
      * }
      */
-    auto& board = Board::GetInstance();
-    auto root = cJSON_CreateObject();
-
-    // Audio speaker
-    auto audio_speaker = cJSON_CreateObject();
-    auto audio_codec = board.GetAudioCodec();
-    if (audio_codec) {
-        cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
-    }
-    cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
-
-    // Screen brightness
-    auto backlight = board.GetBacklight();
-    auto screen = cJSON_CreateObject();
-    if (backlight) {
-        cJSON_AddNumberToObject(screen, "brightness", backlight->brightness());
-    }
-    auto display = board.GetDisplay();
-    if (display && display->height() > 64) { // For LCD display only
-        auto theme = display->GetTheme();
-        if (theme != nullptr) {
-            cJSON_AddStringToObject(screen, "theme", theme->name().c_str());
-        }
-    }
-    cJSON_AddItemToObject(root, "screen", screen);
-
-    // Battery
-    int battery_level = 0;
-    bool charging = false;
-    bool discharging = false;
-    if (board.GetBatteryLevel(battery_level, charging, discharging)) {
-        cJSON* battery = cJSON_CreateObject();
-        cJSON_AddNumberToObject(battery, "level", battery_level);
-        cJSON_AddBoolToObject(battery, "charging", charging);
-        cJSON_AddItemToObject(root, "battery", battery);
-    }
-
     // Network
     auto network = cJSON_CreateObject();
     cJSON_AddStringToObject(network, "type", "cellular");
-    cJSON_AddStringToObject(network, "carrier", modem_->GetCarrierName().c_str());
-    int csq = modem_->GetCsq();
+    cJSON_AddStringToObject(network, "carrier", info_modem()->GetCarrierName().c_str());
+    int csq = GetCsq();
     if (csq == -1) {
         cJSON_AddStringToObject(network, "signal", "unknown");
     } else if (csq >= 0 && csq <= 14) {
@@ -260,11 +334,8 @@ std::string Ml307Board::GetDeviceStatusJson() {
     } else if (csq >= 25 && csq <= 31) {
         cJSON_AddStringToObject(network, "signal", "strong");
     }
-    cJSON_AddItemToObject(root, "network", network);
+    cJSON_AddStringToObject(network, "modem_power", GetModemPowerState());
+    cJSON_AddItemToObject(network, "quality", Application::GetInstance().GetNetworkQuality().CreateJson());
 
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string json(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
-    return json;
+    return CreateDeviceStatusJson(network);
 }
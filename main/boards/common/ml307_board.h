@@ -2,8 +2,12 @@
 #define ML307_BOARD_H
 
 #include <memory>
+#include <mutex>
 #include <at_modem.h>
 #include "board.h"
+#if CONFIG_ML307_PPP_MODE
+#include "ml307_ppp_modem.h"
+#endif
 
 
 class Ml307Board : public Board {
@@ -13,6 +17,14 @@ protected:
     gpio_num_t rx_pin_;
     gpio_num_t dtr_pin_;
     NetworkEventCallback network_event_callback_;
+    std::mutex power_mutex_;
+    bool modem_sleeping_ = false;
+    // Last CSQ read, answered while the modem sleeps so that polling does not wake it
+    int last_csq_ = -1;
+#if CONFIG_ML307_PPP_MODE
+    // Takes the place of modem_, which stays empty: sockets go through lwIP and the PPP netif
+    std::unique_ptr<Ml307PppModem> ppp_modem_;
+#endif
 
     virtual std::string GetBoardJson() override;
 
@@ -23,6 +35,14 @@ protected:
     static void NetworkTaskEntry(void* arg);
     void NetworkTask();
 
+    // The modem answering the signal and identity queries
+#if CONFIG_ML307_PPP_MODE
+    Ml307PppModem* info_modem() { return ppp_modem_.get(); }
+#else
+    AtModem* info_modem() { return modem_.get(); }
+#endif
+    int GetCsq();
+
 public:
     Ml307Board(gpio_num_t tx_pin, gpio_num_t rx_pin, gpio_num_t dtr_pin = GPIO_NUM_NC);
     virtual std::string GetBoardType() override;
@@ -30,9 +50,12 @@ public:
     virtual void SetNetworkEventCallback(NetworkEventCallback callback) override;
     virtual NetworkInterface* GetNetwork() override;
     virtual const char* GetNetworkStateIcon() override;
+    virtual int GetSignalStrength() override;
     virtual void SetPowerSaveLevel(PowerSaveLevel level) override;
     virtual AudioCodec* GetAudioCodec() override { return nullptr; }
     virtual std::string GetDeviceStatusJson() override;
+    // "active", "sleep" or "edrx"
+    const char* GetModemPowerState();
 };
 
 #endif // ML307_BOARD_H
@@ -0,0 +1,248 @@
+#include "ml307_ppp_modem.h"
+
+#include <cxx_include/esp_modem_api.hpp>
+#include <esp_modem_config.h>
+#include <driver/uart.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cstdlib>
+
+#define TAG "Ml307PppModem"
+
+#define ML307_PPP_UART_NUM UART_NUM_1
+// Room for a full TCP window while the receive task waits for lwIP, OTA and asset downloads run at line rate
+#define ML307_PPP_UART_RX_BUFFER_SIZE (16 * 1024)
+#define ML307_PPP_UART_TX_BUFFER_SIZE (4 * 1024)
+#define ML307_PPP_DTE_BUFFER_SIZE 2048
+// The modem boots at this rate until it was switched
+#define ML307_PPP_DEFAULT_BAUD_RATE 115200
+#define ML307_PPP_REGISTRATION_TIMEOUT_SECONDS 60
+
+using esp_modem::command_result;
+
+std::string Ml307PppRegState::ToString() const {
+    std::string json = "{";
+    json += "\"stat\":" + std::to_string(stat);
+    if (!tac.empty()) json += ",\"tac\":\"" + tac + "\"";
+    if (!ci.empty()) json += ",\"ci\":\"" + ci + "\"";
+    if (act >= 0) json += ",\"AcT\":" + std::to_string(act);
+    json += "}";
+    return json;
+}
+
+Ml307PppModem::Ml307PppModem(gpio_num_t tx_pin, gpio_num_t rx_pin, int baud_rate)
+    : tx_pin_(tx_pin), rx_pin_(rx_pin), baud_rate_(baud_rate) {
+    esp_event_loop_create_default();
+    esp_netif_init();
+}
+
+Ml307PppModem::~Ml307PppModem() {
+    Stop();
+}
+
+void Ml307PppModem::OnNetworkStateChanged(std::function<void(bool network_ready)> callback) {
+    on_network_state_changed_ = std::move(callback);
+}
+
+Ml307PppStatus Ml307PppModem::Start() {
+    esp_modem_dte_config_t dte_config = ESP_MODEM_DTE_DEFAULT_CONFIG();
+    dte_config.uart_config.port_num = ML307_PPP_UART_NUM;
+    dte_config.uart_config.baud_rate = ML307_PPP_DEFAULT_BAUD_RATE;
+    dte_config.uart_config.tx_io_num = tx_pin_;
+    dte_config.uart_config.rx_io_num = rx_pin_;
+    dte_config.uart_config.rts_io_num = UART_PIN_NO_CHANGE;
+    dte_config.uart_config.cts_io_num = UART_PIN_NO_CHANGE;
+    dte_config.uart_config.flow_control = ESP_MODEM_FLOW_CONTROL_NONE;
+    dte_config.uart_config.rx_buffer_size = ML307_PPP_UART_RX_BUFFER_SIZE;
+    dte_config.uart_config.tx_buffer_size = ML307_PPP_UART_TX_BUFFER_SIZE;
+    dte_config.dte_buffer_size = ML307_PPP_DTE_BUFFER_SIZE;
+    dte_ = esp_modem::create_uart_dte(&dte_config);
+    if (dte_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to open the UART");
+        return Ml307PppStatus::ErrorNoModem;
+    }
+
+    esp_netif_config_t netif_config = ESP_NETIF_DEFAULT_PPP();
+    netif_ = esp_netif_new(&netif_config);
+    esp_modem_dce_config_t dce_config = ESP_MODEM_DCE_DEFAULT_CONFIG(CONFIG_ML307_PPP_APN);
+    dce_ = esp_modem::create_generic_dce(&dce_config, dte_, netif_);
+    esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID, OnIpEvent, this, &ip_event_handler_);
+
+    if (!Connect()) {
+        return Ml307PppStatus::ErrorNoModem;
+    }
+
+    bool pin_ok = false;
+    if (dce_->read_pin(pin_ok) != command_result::OK || !pin_ok) {
+        return Ml307PppStatus::ErrorInsertPin;
+    }
+
+    // Also report the cell in +CEREG
+    Command("AT+CEREG=2");
+    auto state = WaitForRegistration();
+    if (state.stat == 3) {
+        return Ml307PppStatus::ErrorRegistrationDenied;
+    } else if (state.stat != 1 && state.stat != 5) {
+        return Ml307PppStatus::ErrorTimeout;
+    }
+    int act = 0;
+    dce_->get_operator_name(carrier_name_, act);
+
+    // Dials the PDP context on the first channel, AT commands keep working on the second
+    if (!dce_->set_mode(esp_modem::modem_mode::CMUX_MODE)) {
+        ESP_LOGE(TAG, "Failed to enter CMUX mode");
+        return Ml307PppStatus::ErrorDataMode;
+    }
+    ESP_LOGI(TAG, "CMUX mode at %d baud, waiting for PPP", baud_rate_);
+    return Ml307PppStatus::Ready;
+}
+
+void Ml307PppModem::Stop() {
+    if (ip_event_handler_ != nullptr) {
+        esp_event_handler_instance_unregister(IP_EVENT, ESP_EVENT_ANY_ID, ip_event_handler_);
+        ip_event_handler_ = nullptr;
+    }
+    if (dce_ != nullptr) {
+        dce_->set_mode(esp_modem::modem_mode::COMMAND_MODE);
+        dce_.reset();
+    }
+    dte_.reset();
+    if (netif_ != nullptr) {
+        esp_netif_destroy(netif_);
+        netif_ = nullptr;
+    }
+    network_ready_ = false;
+}
+
+// The modem keeps the rate it was switched to until it restarts, so try the configured rate first
+bool Ml307PppModem::Connect() {
+    for (int baud_rate : {baud_rate_, ML307_PPP_DEFAULT_BAUD_RATE}) {
+        uart_set_baudrate(ML307_PPP_UART_NUM, baud_rate);
+        for (int i = 0; i < 3; i++) {
+            if (dce_->sync() != command_result::OK) {
+                vTaskDelay(pdMS_TO_TICKS(500));
+                continue;
+            }
+            if (baud_rate == baud_rate_) {
+                ESP_LOGI(TAG, "Modem found at %d baud", baud_rate);
+                return true;
+            }
+            if (dce_->set_baud(baud_rate_) != command_result::OK) {
+                ESP_LOGW(TAG, "Modem refused %d baud, staying at %d", baud_rate_, baud_rate);
+                baud_rate_ = baud_rate;
+                return true;
+            }
+            uart_set_baudrate(ML307_PPP_UART_NUM, baud_rate_);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            ESP_LOGI(TAG, "Modem switched from %d to %d baud", baud_rate, baud_rate_);
+            return dce_->sync() == command_result::OK;
+        }
+    }
+    ESP_LOGE(TAG, "No modem answering on the UART");
+    return false;
+}
+
+Ml307PppRegState Ml307PppModem::WaitForRegistration() {
+    Ml307PppRegState state;
+    for (int i = 0; i < ML307_PPP_REGISTRATION_TIMEOUT_SECONDS; i++) {
+        state = GetRegistrationState();
+        // Registered at home or roaming, or denied
+        if (state.stat == 1 || state.stat == 5 || state.stat == 3) {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+    return state;
+}
+
+std::string Ml307PppModem::Command(const std::string& command, int timeout_ms) {
+    std::string response;
+    if (dce_ == nullptr || dce_->at(command, response, timeout_ms) != command_result::OK) {
+        return "";
+    }
+    // Strip the "+CMD: " prefix of the answer
+    auto colon = response.find(": ");
+    if (!response.empty() && response[0] == '+' && colon != std::string::npos) {
+        response = response.substr(colon + 2);
+    }
+    return response;
+}
+
+int Ml307PppModem::GetCsq() {
+    int rssi = 0, ber = 0;
+    if (dce_ == nullptr || dce_->get_signal_quality(rssi, ber) != command_result::OK) {
+        return -1;
+    }
+    return rssi;
+}
+
+std::string Ml307PppModem::GetModuleRevision() {
+    return Command("AT+CGMR");
+}
+
+std::string Ml307PppModem::GetImei() {
+    std::string imei;
+    if (dce_ != nullptr) {
+        dce_->get_imei(imei);
+    }
+    return imei;
+}
+
+std::string Ml307PppModem::GetIccid() {
+    return Command("AT+ICCID");
+}
+
+std::string Ml307PppModem::GetCarrierName() {
+    return carrier_name_;
+}
+
+// +CEREG: <n>,<stat>[,"<tac>","<ci>",<AcT>] after AT+CEREG=2, the location fields are missing otherwise
+Ml307PppRegState Ml307PppModem::GetRegistrationState() {
+    Ml307PppRegState state;
+    std::string response = Command("AT+CEREG?");
+    std::string fields[5];
+    size_t count = 0;
+    size_t start = 0;
+    while (count < 5 && start <= response.size()) {
+        size_t end = response.find(',', start);
+        if (end == std::string::npos) {
+            end = response.size();
+        }
+        fields[count] = response.substr(start, end - start);
+        if (fields[count].size() >= 2 && fields[count].front() == '"') {
+            fields[count] = fields[count].substr(1, fields[count].size() - 2);
+        }
+        count++;
+        start = end + 1;
+    }
+    if (count >= 2) {
+        state.stat = atoi(fields[1].c_str());
+    }
+    if (count >= 5) {
+        state.tac = fields[2];
+        state.ci = fields[3];
+        state.act = atoi(fields[4].c_str());
+    }
+    return state;
+}
+
+void Ml307PppModem::OnIpEvent(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+    auto* modem = static_cast<Ml307PppModem*>(arg);
+    bool ready;
+    if (event_id == IP_EVENT_PPP_GOT_IP) {
+        auto* event = static_cast<ip_event_got_ip_t*>(event_data);
+        ESP_LOGI(TAG, "PPP up, IP " IPSTR, IP2STR(&event->ip_info.ip));
+        ready = true;
+    } else if (event_id == IP_EVENT_PPP_LOST_IP) {
+        ESP_LOGW(TAG, "PPP lost its IP");
+        ready = false;
+    } else {
+        return;
+    }
+    modem->network_ready_ = ready;
+    if (modem->on_network_state_changed_) {
+        modem->on_network_state_changed_(ready);
+    }
+}
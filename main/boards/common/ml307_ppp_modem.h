@@ -0,0 +1,79 @@
+#ifndef ML307_PPP_MODEM_H
+#define ML307_PPP_MODEM_H
+
+#include <driver/gpio.h>
+#include <esp_event.h>
+#include <esp_netif.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace esp_modem {
+class DTE;
+class DCE;
+}
+
+enum class Ml307PppStatus {
+    Ready,
+    ErrorNoModem,
+    ErrorInsertPin,
+    ErrorRegistrationDenied,
+    ErrorTimeout,
+    ErrorDataMode,
+};
+
+struct Ml307PppRegState {
+    int stat = 0;
+    std::string tac;
+    std::string ci;
+    int act = -1;
+
+    std::string ToString() const;
+};
+
+/**
+ * Ml307PppModem - The ML307 as a native lwIP interface, CMUX with PPP on one channel and AT on another
+ *
+ * Start() finds the modem at its current baud rate, switches both sides to the configured rate, waits
+ * for the registration and enters CMUX mode. The PPP netif then carries every socket through lwIP, so
+ * the board serves the usual EspNetwork instead of the AT socket layer. The information queries are
+ * AT commands on the second CMUX channel and can run while data flows.
+ */
+class Ml307PppModem {
+public:
+    Ml307PppModem(gpio_num_t tx_pin, gpio_num_t rx_pin, int baud_rate);
+    ~Ml307PppModem();
+
+    Ml307PppStatus Start();
+    void Stop();
+    void OnNetworkStateChanged(std::function<void(bool network_ready)> callback);
+
+    inline bool network_ready() const { return network_ready_; }
+    int GetCsq();
+    std::string GetModuleRevision();
+    std::string GetImei();
+    std::string GetIccid();
+    std::string GetCarrierName();
+    Ml307PppRegState GetRegistrationState();
+
+private:
+    gpio_num_t tx_pin_;
+    gpio_num_t rx_pin_;
+    int baud_rate_;
+    esp_netif_t* netif_ = nullptr;
+    std::shared_ptr<esp_modem::DTE> dte_;
+    std::unique_ptr<esp_modem::DCE> dce_;
+    esp_event_handler_instance_t ip_event_handler_ = nullptr;
+    std::atomic<bool> network_ready_ = false;
+    std::function<void(bool)> on_network_state_changed_;
+    std::string carrier_name_;
+
+    bool Connect();
+    Ml307PppRegState WaitForRegistration();
+    std::string Command(const std::string& command, int timeout_ms = 1000);
+    static void OnIpEvent(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+};
+
+#endif // ML307_PPP_MODEM_H
@@ -0,0 +1,148 @@
+#include "netif_meter.h"
+#include "metrics.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/pbuf.h>
+
+#define TAG "NetifMeter"
+
+#define NETIF_METER_MAX 2
+
+// Looked up by the hooks for every frame, entries are only added
+static NetifMeter* meters[NETIF_METER_MAX] = {};
+
+// The functions the hooks replaced, per netif. Kept when a meter moves on to another netif,
+// the hooks left on the old one still have to pass its frames on.
+struct HookedNetif {
+    struct netif* netif;
+    netif_input_fn input;
+    netif_linkoutput_fn linkoutput;
+};
+static HookedNetif hooked[NETIF_METER_MAX * 2] = {};
+
+static const HookedNetif* FindHooked(struct netif* netif) {
+    for (auto& entry : hooked) {
+        if (entry.netif == netif) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+NetifMeter::NetifMeter(const std::string& name) : name_(name) {
+    auto& metrics = Metrics::GetInstance();
+    rx_bytes_ = metrics.AddCounter(name + ".rx_bytes");
+    rx_frames_ = metrics.AddCounter(name + ".rx_frames");
+    rx_dropped_ = metrics.AddCounter(name + ".rx_dropped");
+    tx_bytes_ = metrics.AddCounter(name + ".tx_bytes");
+    tx_frames_ = metrics.AddCounter(name + ".tx_frames");
+    tx_errors_ = metrics.AddCounter(name + ".tx_errors");
+}
+
+bool NetifMeter::Attach(esp_netif_t* esp_netif) {
+    auto netif = esp_netif ? static_cast<struct netif*>(esp_netif_get_netif_impl(esp_netif)) : nullptr;
+    if (netif == nullptr || netif->input == nullptr || netif->linkoutput == nullptr) {
+        return false;
+    }
+    if (netif == netif_ && netif->input == Input) {
+        return true;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < NETIF_METER_MAX; i++) {
+        if (meters[i] == this || (meters[i] == nullptr && slot < 0)) {
+            slot = i;
+        }
+    }
+    // A netif created again at the same address takes over its entry
+    int hooked_slot = -1;
+    for (int i = 0; i < NETIF_METER_MAX * 2; i++) {
+        if (hooked[i].netif == netif || (hooked[i].netif == nullptr && hooked_slot < 0)) {
+            hooked_slot = i;
+        }
+    }
+    if (slot < 0 || hooked_slot < 0) {
+        ESP_LOGW(TAG, "No room to meter %s", name_.c_str());
+        return false;
+    }
+
+    // The originals are in place before the hooks can be called
+    input_ = netif->input;
+    linkoutput_ = netif->linkoutput;
+    hooked[hooked_slot] = {netif, input_, linkoutput_};
+    netif_ = netif;
+    meters[slot] = this;
+    netif->input = Input;
+    netif->linkoutput = LinkOutput;
+    ESP_LOGI(TAG, "Metering %s on %c%c%d", name_.c_str(), netif->name[0], netif->name[1], netif->num);
+    return true;
+}
+
+NetifMeter* NetifMeter::Find(struct netif* netif) {
+    for (auto meter : meters) {
+        if (meter != nullptr && meter->netif_ == netif) {
+            return meter;
+        }
+    }
+    return nullptr;
+}
+
+err_t NetifMeter::Input(struct pbuf* p, struct netif* netif) {
+    auto meter = Find(netif);
+    if (meter == nullptr) {
+        // The meter moved on to another netif, the caller frees the frame on an error
+        auto entry = FindHooked(netif);
+        return entry != nullptr ? entry->input(p, netif) : ERR_IF;
+    }
+    // Once queued the TCP/IP task owns the frame and may already have freed it
+    uint16_t length = p->tot_len;
+    err_t err = meter->input_(p, netif);
+    meter->rx_frames_->Add();
+    meter->rx_bytes_->Add(length);
+    if (err != ERR_OK) {
+        meter->rx_dropped_->Add();
+    }
+    return err;
+}
+
+err_t NetifMeter::LinkOutput(struct netif* netif, struct pbuf* p) {
+    auto meter = Find(netif);
+    if (meter == nullptr) {
+        auto entry = FindHooked(netif);
+        return entry != nullptr ? entry->linkoutput(netif, p) : ERR_IF;
+    }
+    // The driver may free the chain, read the length first
+    uint16_t length = p->tot_len;
+    err_t err = meter->linkoutput_(netif, p);
+    meter->tx_frames_->Add();
+    meter->tx_bytes_->Add(length);
+    if (err != ERR_OK) {
+        meter->tx_errors_->Add();
+    }
+    return err;
+}
+
+NetifMeterStatistics NetifMeter::GetStatistics() const {
+    return {rx_bytes_->value(), rx_frames_->value(), rx_dropped_->value(),
+        tx_bytes_->value(), tx_frames_->value(), tx_errors_->value()};
+}
+
+cJSON* NetifMeter::CreateJson() {
+    auto statistics = GetStatistics();
+    int64_t now = esp_timer_get_time();
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "rx_bytes", statistics.rx_bytes);
+    cJSON_AddNumberToObject(json, "tx_bytes", statistics.tx_bytes);
+    cJSON_AddNumberToObject(json, "rx_dropped", statistics.rx_dropped);
+    cJSON_AddNumberToObject(json, "tx_errors", statistics.tx_errors);
+    if (last_json_us_ != 0 && now > last_json_us_) {
+        int64_t elapsed_ms = (now - last_json_us_) / 1000;
+        cJSON_AddNumberToObject(json, "rx_kbps", elapsed_ms ? (uint64_t)(statistics.rx_bytes - last_rx_bytes_) * 8 / elapsed_ms : 0);
+        cJSON_AddNumberToObject(json, "tx_kbps", elapsed_ms ? (uint64_t)(statistics.tx_bytes - last_tx_bytes_) * 8 / elapsed_ms : 0);
+    }
+    last_json_us_ = now;
+    last_rx_bytes_ = statistics.rx_bytes;
+    last_tx_bytes_ = statistics.tx_bytes;
+    return json;
+}
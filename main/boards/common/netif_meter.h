@@ -0,0 +1,68 @@
+#ifndef NETIF_METER_H
+#define NETIF_METER_H
+
+#include <esp_netif.h>
+#include <lwip/netif.h>
+#include <cJSON.h>
+
+#include <cstdint>
+#include <string>
+
+class MetricCounter;
+
+struct NetifMeterStatistics {
+    uint32_t rx_bytes;
+    uint32_t rx_frames;
+    uint32_t rx_dropped;
+    uint32_t tx_bytes;
+    uint32_t tx_frames;
+    uint32_t tx_errors;
+};
+
+/**
+ * NetifMeter - Counts the traffic of one lwIP interface by wrapping its input and linkoutput hooks
+ *
+ * Every received frame passes netif->input on its way to the TCP/IP task and every sent frame passes
+ * netif->linkoutput on its way to the driver, so the counters see the real link no matter which driver
+ * sits below. A frame the TCP/IP task refused, because its mailbox was full, counts as dropped. The
+ * counters are metrics and cost one relaxed atomic per frame, GetStatistics() just reads them.
+ */
+class NetifMeter {
+public:
+    // The metrics are named "<name>.rx_bytes" and so on
+    explicit NetifMeter(const std::string& name);
+
+    NetifMeter(const NetifMeter&) = delete;
+    NetifMeter& operator=(const NetifMeter&) = delete;
+
+    // Again after the driver created a new netif, the old one is simply forgotten.
+    // The hooks stay in place for the lifetime of the netif, so the meter is never destroyed.
+    bool Attach(esp_netif_t* esp_netif);
+
+    NetifMeterStatistics GetStatistics() const;
+    // Totals and the rates since the previous call
+    cJSON* CreateJson();
+
+private:
+    std::string name_;
+    struct netif* netif_ = nullptr;
+    netif_input_fn input_ = nullptr;
+    netif_linkoutput_fn linkoutput_ = nullptr;
+
+    MetricCounter* rx_bytes_;
+    MetricCounter* rx_frames_;
+    MetricCounter* rx_dropped_;
+    MetricCounter* tx_bytes_;
+    MetricCounter* tx_frames_;
+    MetricCounter* tx_errors_;
+
+    int64_t last_json_us_ = 0;
+    uint32_t last_rx_bytes_ = 0;
+    uint32_t last_tx_bytes_ = 0;
+
+    static NetifMeter* Find(struct netif* netif);
+    static err_t Input(struct pbuf* p, struct netif* netif);
+    static err_t LinkOutput(struct netif* netif, struct pbuf* p);
+};
+
+#endif // NETIF_METER_H
@@ -2,6 +2,7 @@
 #include "display.h"
 #include "application.h"
 #include "audio_codec.h"
+#include "metrics.h"
 #include <esp_log.h>
 #include <font_awesome.h>
 #include <cJSON.h>
@@ -83,6 +84,7 @@ void Nt26Board::StartNetwork() {
         switch (event) {
             case UartEthModem::UartEthModemEvent::Connected:
                 esp_timer_stop(network_ready_timer_);
+                link_meter_.Attach(esp_netif_get_default_netif());
                 OnNetworkEvent(NetworkEvent::Connected);
                 break;
             case UartEthModem::UartEthModemEvent::Disconnected:
@@ -207,42 +209,6 @@ Nt26CeregState Nt26Board::GetRegistrationState() {
 }
 
 std::string Nt26Board::GetDeviceStatusJson() {
-    auto& board = Board::GetInstance();
-    auto root = cJSON_CreateObject();
-
-    // Audio speaker
-    auto audio_speaker = cJSON_CreateObject();
-    auto audio_codec = board.GetAudioCodec();
-    if (audio_codec) {
-        cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
-    }
-    cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
-
-    // Screen
-    auto backlight = board.GetBacklight();
-    auto screen = cJSON_CreateObject();
-    if (backlight) {
-        cJSON_AddNumberToObject(screen, "brightness", backlight->brightness());
-    }
-    auto display = board.GetDisplay();
-    if (display && display->height() > 64) {
-        auto theme = display->GetTheme();
-        if (theme != nullptr) {
-            cJSON_AddStringToObject(screen, "theme", theme->name().c_str());
-        }
-    }
-    cJSON_AddItemToObject(root, "screen", screen);
-
-    // Battery
-    int battery_level = 0;
-    bool charging = false, discharging = false;
-    if (board.GetBatteryLevel(battery_level, charging, discharging)) {
-        auto battery = cJSON_CreateObject();
-        cJSON_AddNumberToObject(battery, "level", battery_level);
-        cJSON_AddBoolToObject(battery, "charging", charging);
-        cJSON_AddItemToObject(root, "battery", battery);
-    }
-
     // Network
     auto network = cJSON_CreateObject();
     cJSON_AddStringToObject(network, "type", "cellular");
@@ -259,11 +225,9 @@ std::string Nt26Board::GetDeviceStatusJson() {
             cJSON_AddStringToObject(network, "signal", "strong");
         }
     }
-    cJSON_AddItemToObject(root, "network", network);
+    // The UART link sleeps on its own through the MRDY/SRDY handshake, the level only holds the CPU lock
+    cJSON_AddStringToObject(network, "modem_power", current_power_level_ == PowerSaveLevel::LOW_POWER ? "sleep" : "active");
+    cJSON_AddItemToObject(network, "link", link_meter_.CreateJson());
 
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string json(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
-    return json;
+    return CreateDeviceStatusJson(network);
 }
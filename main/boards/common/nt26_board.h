@@ -7,6 +7,7 @@
 #include <esp_pm.h>
 #include <esp_timer.h>
 #include "board.h"
+#include "netif_meter.h"
 
 struct Nt26CeregState {
     int stat = 0;
@@ -38,6 +39,7 @@ protected:
     esp_pm_lock_handle_t pm_lock_cpu_max_ = nullptr;
     PowerSaveLevel current_power_level_ = PowerSaveLevel::LOW_POWER;
     esp_timer_handle_t network_ready_timer_ = nullptr;
+    NetifMeter link_meter_{"nt26"};
 
     virtual std::string GetBoardJson() override;
     
@@ -0,0 +1,40 @@
+#ifndef PIXEL_SWAP_H
+#define PIXEL_SWAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Byte order swap of 16-bit pixels (RGB565, YUYV) from a camera buffer into a copy, in the same
+ * pass as the copy. Two pixels per 32-bit word and four words per iteration, so PSRAM is read and
+ * written in bursts instead of a halfword at a time. Both buffers have to be 32-bit aligned, which
+ * the camera and heap buffers are. An odd last pixel is swapped on its own.
+ */
+static inline void SwapPixelBytes(const void* src, void* dst, size_t pixel_count) {
+    auto src32 = static_cast<const uint32_t*>(src);
+    auto dst32 = static_cast<uint32_t*>(dst);
+    size_t words = pixel_count / 2;
+    size_t i = 0;
+    for (; i + 4 <= words; i += 4) {
+        uint32_t a = src32[i];
+        uint32_t b = src32[i + 1];
+        uint32_t c = src32[i + 2];
+        uint32_t d = src32[i + 3];
+        dst32[i] = ((a & 0x00FF00FF) << 8) | ((a >> 8) & 0x00FF00FF);
+        dst32[i + 1] = ((b & 0x00FF00FF) << 8) | ((b >> 8) & 0x00FF00FF);
+        dst32[i + 2] = ((c & 0x00FF00FF) << 8) | ((c >> 8) & 0x00FF00FF);
+        dst32[i + 3] = ((d & 0x00FF00FF) << 8) | ((d >> 8) & 0x00FF00FF);
+    }
+    for (; i < words; i++) {
+        uint32_t v = src32[i];
+        dst32[i] = ((v & 0x00FF00FF) << 8) | ((v >> 8) & 0x00FF00FF);
+    }
+    if (pixel_count & 1) {
+        auto src16 = static_cast<const uint16_t*>(src);
+        auto dst16 = static_cast<uint16_t*>(dst);
+        dst16[pixel_count - 1] = __builtin_bswap16(src16[pixel_count - 1]);
+    }
+}
+
+#endif // PIXEL_SWAP_H
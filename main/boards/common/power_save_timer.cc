@@ -1,6 +1,7 @@
 #include "power_save_timer.h"
 #include "application.h"
 #include "settings.h"
+#include "dfs_policy.h"
 
 #include <esp_log.h>
 
@@ -9,22 +10,13 @@
 
 PowerSaveTimer::PowerSaveTimer(int cpu_max_freq, int seconds_to_sleep, int seconds_to_shutdown)
     : cpu_max_freq_(cpu_max_freq), seconds_to_sleep_(seconds_to_sleep), seconds_to_shutdown_(seconds_to_shutdown) {
-    esp_timer_create_args_t timer_args = {
-        .callback = [](void* arg) {
-            auto self = static_cast<PowerSaveTimer*>(arg);
-            self->PowerSaveCheck();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "power_save_timer",
-        .skip_unhandled_events = true,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &power_save_timer_));
+    power_save_timer_ = TimerWheel::GetInstance().Create("power_save_timer", [this]() {
+        PowerSaveCheck();
+    });
 }
 
 PowerSaveTimer::~PowerSaveTimer() {
-    esp_timer_stop(power_save_timer_);
-    esp_timer_delete(power_save_timer_);
+    TimerWheel::GetInstance().Delete(power_save_timer_);
 }
 
 void PowerSaveTimer::SetEnabled(bool enabled) {
@@ -37,10 +29,11 @@ void PowerSaveTimer::SetEnabled(bool enabled) {
 
         ticks_ = 0;
         enabled_ = enabled;
-        ESP_ERROR_CHECK(esp_timer_start_periodic(power_save_timer_, 1000000));
+        // Counting seconds towards sleep does not need to be punctual
+        TimerWheel::GetInstance().StartPeriodic(power_save_timer_, 1000000, 500000);
         ESP_LOGI(TAG, "Power save timer enabled");
     } else if (!enabled && enabled_) {
-        ESP_ERROR_CHECK(esp_timer_stop(power_save_timer_));
+        TimerWheel::GetInstance().Stop(power_save_timer_);
         enabled_ = enabled;
         WakeUp();
         ESP_LOGI(TAG, "Power save timer disabled");
@@ -65,6 +58,11 @@ void PowerSaveTimer::PowerSaveCheck() {
         ticks_ = 0;
         return;
     }
+    // The wake word went off behind the idle gate, the conversation needs the full clock
+    if (in_sleep_mode_ && is_idle_gated_ && !app.CanEnterSleepMode()) {
+        WakeUp();
+        return;
+    }
 
     ticks_++;
     if (seconds_to_sleep_ != -1 && ticks_ >= seconds_to_sleep_) {
@@ -76,16 +74,22 @@ void PowerSaveTimer::PowerSaveCheck() {
             }
 
             if (cpu_max_freq_ != -1) {
-                // Disable wake word detection
                 auto& audio_service = app.GetAudioService();
                 is_wake_word_running_ = audio_service.IsWakeWordRunning();
-                if (is_wake_word_running_) {
+#if CONFIG_USE_WAKE_WORD_IDLE_GATE
+                // Keep listening for the wake word, but only run it on loud input
+                is_idle_gated_ = is_wake_word_running_;
+#endif
+                if (is_idle_gated_) {
+                    audio_service.EnableIdleGate(true);
+                } else if (is_wake_word_running_) {
+                    // Disable wake word detection
                     audio_service.EnableWakeWordDetection(false);
                     vTaskDelay(pdMS_TO_TICKS(100));
                 }
                 // Disable audio input
                 auto codec = Board::GetInstance().GetAudioCodec();
-                if (codec) {
+                if (codec && !is_idle_gated_) {
                     codec->EnableInput(false);
                 }
 
@@ -110,17 +114,25 @@ void PowerSaveTimer::WakeUp() {
         in_sleep_mode_ = false;
 
         if (cpu_max_freq_ != -1) {
-            esp_pm_config_t pm_config = {
-                .max_freq_mhz = cpu_max_freq_,
-                .min_freq_mhz = cpu_max_freq_,
-                .light_sleep_enable = false,
-            };
-            esp_pm_configure(&pm_config);
+            if (DfsPolicy::GetInstance().IsStarted()) {
+                // Leave the frequency to the state driven policy
+                DfsPolicy::GetInstance().Configure(cpu_max_freq_, false);
+            } else {
+                esp_pm_config_t pm_config = {
+                    .max_freq_mhz = cpu_max_freq_,
+                    .min_freq_mhz = cpu_max_freq_,
+                    .light_sleep_enable = false,
+                };
+                esp_pm_configure(&pm_config);
+            }
 
             // Enable wake word detection
             auto& app = Application::GetInstance();
             auto& audio_service = app.GetAudioService();
-            if (is_wake_word_running_) {
+            if (is_idle_gated_) {
+                audio_service.EnableIdleGate(false);
+                is_idle_gated_ = false;
+            } else if (is_wake_word_running_) {
                 audio_service.EnableWakeWordDetection(true);
             }
         }
@@ -2,9 +2,10 @@
 
 #include <functional>
 
-#include <esp_timer.h>
 #include <esp_pm.h>
 
+#include "timer_wheel.h"
+
 class PowerSaveTimer {
 public:
     PowerSaveTimer(int cpu_max_freq, int seconds_to_sleep = 20, int seconds_to_shutdown = -1);
@@ -19,10 +20,11 @@ public:
 private:
     void PowerSaveCheck();
 
-    esp_timer_handle_t power_save_timer_ = nullptr;
+    TimerWheel::Handle power_save_timer_ = nullptr;
     bool enabled_ = false;
     bool in_sleep_mode_ = false;
     bool is_wake_word_running_ = false;
+    bool is_idle_gated_ = false;
     int ticks_ = 0;
     int cpu_max_freq_;
     int seconds_to_sleep_;
@@ -45,7 +45,7 @@ ReturnValue PressToTalkMcpTool::HandleSetPressToTalk(const PropertyList& propert
         return true;
     }
     
-    throw std::runtime_error("Invalid mode: " + mode);
+    return McpError{"Invalid mode: " + mode};
 }
 
 void PressToTalkMcpTool::SetPressToTalkEnabled(bool enabled) {
@@ -4,6 +4,7 @@
 #include "system_info.h"
 #include "settings.h"
 #include "assets/lang_config.h"
+#include "metrics.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -82,6 +83,8 @@ void RndisBoard::iot_event_handle(void *arg, esp_event_base_t event_base, int32_
         }
     } else if (event_base == IP_EVENT) {
         ESP_LOGI(TAG, "GOT_IP");
+        auto board = static_cast<RndisBoard*>(arg);
+        board->link_meter_.Attach(board->s_rndis_netif);
         xEventGroupSetBits(static_cast<RndisBoard*>(arg)->s_event_group, EVENT_GOT_IP_BIT);
     }
 }
@@ -193,55 +196,11 @@ void RndisBoard::SetPowerSaveLevel(PowerSaveLevel level) {
 }
 
 std::string RndisBoard::GetDeviceStatusJson() {
-    auto& board = Board::GetInstance();
-    auto root = cJSON_CreateObject();
-
-    // Audio speaker
-    auto audio_speaker = cJSON_CreateObject();
-    if (auto codec = board.GetAudioCodec()) {
-        cJSON_AddNumberToObject(audio_speaker, "volume", codec->output_volume());
-    }
-    cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
-
-    // Screen
-    auto screen = cJSON_CreateObject();
-    if (auto backlight = board.GetBacklight()) {
-        cJSON_AddNumberToObject(screen, "brightness", backlight->brightness());
-    }
-    if (auto display = board.GetDisplay(); display && display->height() > 64) {
-        if (auto theme = display->GetTheme()) {
-            cJSON_AddStringToObject(screen, "theme", theme->name().c_str());
-        }
-    }
-    cJSON_AddItemToObject(root, "screen", screen);
-
-    // Battery
-    int level = 0;
-    bool charging = false, discharging = false;
-    if (board.GetBatteryLevel(level, charging, discharging)) {
-        auto battery = cJSON_CreateObject();
-        cJSON_AddNumberToObject(battery, "level", level);
-        cJSON_AddBoolToObject(battery, "charging", charging);
-        cJSON_AddItemToObject(root, "battery", battery);
-    }
-
     // Network
     auto network = cJSON_CreateObject();
     cJSON_AddStringToObject(network, "type", "rndis");
-    cJSON_AddItemToObject(root, "network", network);
-
-    // Chip temperature
-    float temp = 0.0f;
-    if (board.GetTemperature(temp)) {
-        auto chip = cJSON_CreateObject();
-        cJSON_AddNumberToObject(chip, "temperature", temp);
-        cJSON_AddItemToObject(root, "chip", chip);
-    }
+    cJSON_AddItemToObject(network, "link", link_meter_.CreateJson());
 
-    auto str = cJSON_PrintUnformatted(root);
-    std::string result(str);
-    cJSON_free(str);
-    cJSON_Delete(root);
-    return result;
+    return CreateDeviceStatusJson(network);
 }
 #endif // CONFIG_IDF_TARGET_ESP32P4 || CONFIG_IDF_TARGET_ESP32S3
\ No newline at end of file
@@ -5,6 +5,7 @@
 
 #if CONFIG_IDF_TARGET_ESP32P4 || CONFIG_IDF_TARGET_ESP32S3
 #include "board.h"
+#include "netif_meter.h"
 #include "iot_eth.h"
 #include "iot_usbh_rndis.h"
 #include "iot_eth_netif_glue.h"
@@ -19,6 +20,7 @@ private:
     EventGroupHandle_t s_event_group = nullptr;
     iot_eth_driver_t *rndis_eth_driver = nullptr;
     esp_netif_t *s_rndis_netif = nullptr;
+    NetifMeter link_meter_{"rndis"};
 
     void install_rndis(uint16_t idVendor, uint16_t idProduct, const char *netif_name);
     static void iot_event_handle(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
@@ -13,22 +13,13 @@
 
 SleepTimer::SleepTimer(int seconds_to_light_sleep, int seconds_to_deep_sleep)
     : seconds_to_light_sleep_(seconds_to_light_sleep), seconds_to_deep_sleep_(seconds_to_deep_sleep) {
-    esp_timer_create_args_t timer_args = {
-        .callback = [](void* arg) {
-            auto self = static_cast<SleepTimer*>(arg);
-            self->CheckTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "sleep_timer",
-        .skip_unhandled_events = true,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sleep_timer_));
+    sleep_timer_ = TimerWheel::GetInstance().Create("sleep_timer", [this]() {
+        CheckTimer();
+    });
 }
 
 SleepTimer::~SleepTimer() {
-    esp_timer_stop(sleep_timer_);
-    esp_timer_delete(sleep_timer_);
+    TimerWheel::GetInstance().Delete(sleep_timer_);
 }
 
 void SleepTimer::SetEnabled(bool enabled) {
@@ -41,10 +32,10 @@ void SleepTimer::SetEnabled(bool enabled) {
 
         ticks_ = 0;
         enabled_ = enabled;
-        ESP_ERROR_CHECK(esp_timer_start_periodic(sleep_timer_, 1000000));
+        TimerWheel::GetInstance().StartPeriodic(sleep_timer_, 1000000, 500000);
         ESP_LOGI(TAG, "Sleep timer enabled");
     } else if (!enabled && enabled_) {
-        ESP_ERROR_CHECK(esp_timer_stop(sleep_timer_));
+        TimerWheel::GetInstance().Stop(sleep_timer_);
         enabled_ = enabled;
         WakeUp();
         ESP_LOGI(TAG, "Sleep timer disabled");
@@ -118,6 +109,7 @@ void SleepTimer::CheckTimer() {
             on_enter_deep_sleep_mode_();
         }
 
+        Settings::Flush();
         esp_deep_sleep_start();
     }
 }
@@ -2,9 +2,10 @@
 
 #include <functional>
 
-#include <esp_timer.h>
 #include <esp_pm.h>
 
+#include "timer_wheel.h"
+
 class SleepTimer {
 public:
     SleepTimer(int seconds_to_light_sleep = 20, int seconds_to_deep_sleep = -1);
@@ -19,7 +20,7 @@ public:
 private:
     void CheckTimer();
 
-    esp_timer_handle_t sleep_timer_ = nullptr;
+    TimerWheel::Handle sleep_timer_ = nullptr;
     bool enabled_ = false;
     int ticks_ = 0;
     int seconds_to_light_sleep_;
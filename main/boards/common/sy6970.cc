@@ -6,7 +6,12 @@
 
 #define TAG "Sy6970"
 
+// The charging state and battery voltage are asked for several times per battery poll
+#define STATUS_MAX_AGE_US (100 * 1000)
+
 Sy6970::Sy6970(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr) {
+    // REG0B status only, REG0C holds the faults and clears them on read
+    SetBurstWindow(0x0B, 1, STATUS_MAX_AGE_US);
 }
 
 int Sy6970::GetChangingStatus() {
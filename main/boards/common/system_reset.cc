@@ -1,4 +1,5 @@
 #include "system_reset.h"
+#include "settings.h"
 
 #include <esp_log.h>
 #include <nvs_flash.h>
@@ -46,6 +47,8 @@ void SystemReset::ResetNvsFlash() {
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to initialize NVS flash");
     }
+    // Nothing cached before the erase may be written back
+    Settings::Discard();
 }
 
 void SystemReset::ResetToFactory() {
@@ -10,13 +10,21 @@
 #include <freertos/task.h>
 #include <esp_network.h>
 #include <esp_log.h>
+#include <esp_wifi.h>
+#include <esp_system.h>
+#if CONFIG_WIFI_USE_TWT
+#include <esp_wifi_he.h>
+#endif
 #include <utility>
+#include <algorithm>
+#include <cstring>
 
 #include <font_awesome.h>
 #include <wifi_manager.h>
 #include <wifi_station.h>
 #include <ssid_manager.h>
 #include "afsk_demod.h"
+#include "metrics.h"
 #ifdef CONFIG_USE_ESP_BLUFI_WIFI_PROVISIONING
 #include "blufi.h"
 #endif
@@ -26,6 +34,14 @@ static const char *TAG = "WifiBoard";
 // Connection timeout in seconds
 static constexpr int CONNECT_TIMEOUT_SEC = 60;
 
+#if CONFIG_WIFI_USE_TWT
+// Flow of the single agreement, the wake interval is in units of 1024 us and the service period of 256 us
+static constexpr int TWT_FLOW_ID = 0;
+static constexpr int TWT_WAKE_INTERVAL_EXPONENT = 10;
+static constexpr int TWT_MIN_WAKE_DURATION = 64;
+static constexpr int TWT_SETUP_TIMEOUT_MS = 5000;
+#endif
+
 WifiBoard::WifiBoard() {
     // Create connection timeout timer
     esp_timer_create_args_t timer_args = {
@@ -39,6 +55,11 @@ WifiBoard::WifiBoard() {
 }
 
 WifiBoard::~WifiBoard() {
+#if CONFIG_WIFI_USE_TWT
+    if (twt_event_handler_) {
+        esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, twt_event_handler_);
+    }
+#endif
     if (connect_timer_) {
         esp_timer_stop(connect_timer_);
         esp_timer_delete(connect_timer_);
@@ -58,11 +79,24 @@ void WifiBoard::StartNetwork() {
     config.language = Lang::CODE;
     wifi_manager.Initialize(config);
 
+#if CONFIG_WIFI_USE_TWT
+    esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, OnTwtEvent, this, &twt_event_handler_);
+#endif
+
     // Set unified event callback - forward to NetworkEvent with SSID data
     wifi_manager.SetEventCallback([this, &wifi_manager](WifiEvent event) {
         std::string ssid = wifi_manager.GetSsid();
         switch (event) {
             case WifiEvent::Scanning:
+#if CONFIG_WIFI_FAST_RECONNECT
+                if (fast_reconnect_armed_) {
+                    fast_reconnect_armed_ = false;
+                    if (StartFastReconnect()) {
+                        OnNetworkEvent(NetworkEvent::Connecting, Settings("wifi_fast").GetString("ssid"));
+                        break;
+                    }
+                }
+#endif
                 OnNetworkEvent(NetworkEvent::Scanning);
                 break;
             case WifiEvent::Connecting:
@@ -72,6 +106,11 @@ void WifiBoard::StartNetwork() {
                 OnNetworkEvent(NetworkEvent::Connected, ssid);
                 break;
             case WifiEvent::Disconnected:
+#if CONFIG_WIFI_FAST_RECONNECT
+                if (fast_reconnect_active_) {
+                    CancelFastReconnect();
+                }
+#endif
                 OnNetworkEvent(NetworkEvent::Disconnected);
                 break;
             case WifiEvent::ConfigModeEnter:
@@ -91,11 +130,29 @@ void WifiBoard::TryWifiConnect() {
     auto& ssid_manager = SsidManager::GetInstance();
     bool have_ssid = !ssid_manager.GetSsidList().empty();
 
+#ifdef CONFIG_USE_ESP_BLUFI_WIFI_PROVISIONING
+    {
+        // Restarted to bring Bluetooth back for provisioning, see StartWifiConfigMode
+        Settings settings("wifi", true);
+        if (settings.GetBool("blufi_boot")) {
+            settings.EraseKey("blufi_boot");
+            StartWifiConfigMode();
+            return;
+        }
+    }
+#endif
+
     if (have_ssid) {
         // Start connection attempt with timeout
         ESP_LOGI(TAG, "Starting WiFi connection attempt");
         esp_timer_start_once(connect_timer_, CONNECT_TIMEOUT_SEC * 1000000ULL);
+#if CONFIG_WIFI_FAST_RECONNECT
+        fast_reconnect_armed_ = true;
+        connect_start_us_ = esp_timer_get_time();
+#endif
         WifiManager::GetInstance().StartStation();
+    } else if (standby_) {
+        ESP_LOGI(TAG, "No WiFi configured, standby WiFi stays off");
     } else {
         // No SSID configured, enter config mode
         // Wait for the board version to be shown
@@ -110,11 +167,22 @@ void WifiBoard::OnNetworkEvent(NetworkEvent event, const std::string& data) {
             // Stop timeout timer
             esp_timer_stop(connect_timer_);
 #ifdef CONFIG_USE_ESP_BLUFI_WIFI_PROVISIONING
-            // make sure blufi resources has been released
+            // Release the Blufi resources and hand the Bluetooth memory back to the heap
             Blufi::GetInstance().deinit();
 #endif
             in_config_mode_ = false;
+#if CONFIG_WIFI_FAST_RECONNECT
+            if (connect_start_us_ != 0) {
+                ESP_LOGI(TAG, "Connected to WiFi: %s in %d ms%s", data.c_str(),
+                    (int)((esp_timer_get_time() - connect_start_us_) / 1000), fast_reconnect_active_ ? " (fast reconnect)" : "");
+                connect_start_us_ = 0;
+            } else {
+                ESP_LOGI(TAG, "Reconnected to WiFi: %s", data.c_str());
+            }
+            SaveFastReconnectAp();
+#else
             ESP_LOGI(TAG, "Connected to WiFi: %s", data.c_str());
+#endif
             break;
         case NetworkEvent::Scanning:
             ESP_LOGI(TAG, "WiFi scanning");
@@ -151,12 +219,100 @@ void WifiBoard::SetNetworkEventCallback(NetworkEventCallback callback) {
 
 void WifiBoard::OnWifiConnectTimeout(void* arg) {
     auto* board = static_cast<WifiBoard*>(arg);
+    if (board->standby_) {
+        // The station keeps retrying in the background
+        ESP_LOGW(TAG, "Standby WiFi connection timeout, still trying");
+        return;
+    }
     ESP_LOGW(TAG, "WiFi connection timeout, entering config mode");
 
     WifiManager::GetInstance().StopStation();
     board->StartWifiConfigMode();
 }
 
+#if CONFIG_WIFI_FAST_RECONNECT
+// Associates with the BSSID and channel of the last connection instead of letting the station scan all
+// channels. The driver keeps the PMK derived for an unchanged SSID and password, so the 4-way handshake
+// also skips the PBKDF2 run. Any failure falls back to the scan of the station.
+bool WifiBoard::StartFastReconnect() {
+    Settings settings("wifi_fast");
+    std::string ssid = settings.GetString("ssid");
+    std::string bssid = settings.GetString("bssid");
+    int channel = settings.GetInt("channel");
+    if (ssid.empty() || bssid.size() != 12 || channel <= 0) {
+        return false;
+    }
+    // Only while its credentials are still saved, the password may have changed since
+    auto& ssid_list = SsidManager::GetInstance().GetSsidList();
+    auto item = std::find_if(ssid_list.begin(), ssid_list.end(), [&ssid](const SsidItem& item) {
+        return item.ssid == ssid;
+    });
+    if (item == ssid_list.end()) {
+        return false;
+    }
+
+    wifi_config_t config = {};
+    memcpy(config.sta.ssid, ssid.data(), std::min(ssid.size(), sizeof(config.sta.ssid)));
+    memcpy(config.sta.password, item->password.data(), std::min(item->password.size(), sizeof(config.sta.password)));
+    for (int i = 0; i < 6; i++) {
+        config.sta.bssid[i] = strtol(bssid.substr(i * 2, 2).c_str(), nullptr, 16);
+    }
+    config.sta.bssid_set = true;
+    config.sta.channel = channel;
+    config.sta.scan_method = WIFI_FAST_SCAN;
+    config.sta.pmf_cfg.capable = true;
+
+    esp_wifi_scan_stop();
+    esp_err_t err = esp_wifi_set_config(WIFI_IF_STA, &config);
+    if (err == ESP_OK) {
+        err = esp_wifi_connect();
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Fast reconnect to %s not possible: %s", ssid.c_str(), esp_err_to_name(err));
+        return false;
+    }
+    fast_reconnect_active_ = true;
+    ESP_LOGI(TAG, "Fast reconnect to %s, BSSID %s on channel %d", ssid.c_str(), bssid.c_str(), channel);
+    return true;
+}
+
+void WifiBoard::CancelFastReconnect() {
+    fast_reconnect_active_ = false;
+    ESP_LOGW(TAG, "Fast reconnect failed, falling back to a full scan");
+    // The station retries with the current config, it must not stay pinned to the old AP
+    wifi_config_t config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &config) == ESP_OK) {
+        config.sta.bssid_set = false;
+        config.sta.channel = 0;
+        config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        esp_wifi_set_config(WIFI_IF_STA, &config);
+    }
+    Settings settings("wifi_fast", true);
+    settings.EraseAll();
+}
+
+void WifiBoard::SaveFastReconnectAp() {
+    fast_reconnect_active_ = false;
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+        return;
+    }
+    std::string ssid(reinterpret_cast<const char*>(ap_info.ssid), strnlen(reinterpret_cast<const char*>(ap_info.ssid), sizeof(ap_info.ssid)));
+    char bssid[13];
+    snprintf(bssid, sizeof(bssid), "%02x%02x%02x%02x%02x%02x", ap_info.bssid[0], ap_info.bssid[1], ap_info.bssid[2],
+        ap_info.bssid[3], ap_info.bssid[4], ap_info.bssid[5]);
+
+    // Roaming or a channel change of the AP is the only time this writes the flash
+    Settings settings("wifi_fast", true);
+    if (settings.GetString("ssid") != ssid || settings.GetString("bssid") != bssid ||
+        settings.GetInt("channel") != ap_info.primary) {
+        settings.SetString("ssid", ssid);
+        settings.SetString("bssid", bssid);
+        settings.SetInt("channel", ap_info.primary);
+    }
+}
+#endif
+
 void WifiBoard::StartWifiConfigMode() {
     in_config_mode_ = true;
     // Transition to wifi configuring state
@@ -177,6 +333,12 @@ void WifiBoard::StartWifiConfigMode() {
     });
 #elif CONFIG_USE_ESP_BLUFI_WIFI_PROVISIONING
     auto &blufi = Blufi::GetInstance();
+    if (blufi.mem_released()) {
+        // The Bluetooth memory went back to the heap once connected, only a restart gets it back
+        ESP_LOGI(TAG, "Restarting to start Blufi provisioning");
+        Settings("wifi", true).SetBool("blufi_boot", true);
+        esp_restart();
+    }
     // initialize esp-blufi protocol
     blufi.init();
 #endif
@@ -266,10 +428,22 @@ const char* WifiBoard::GetNetworkStateIcon() {
     return FONT_AWESOME_WIFI_WEAK;
 }
 
+int WifiBoard::GetSignalStrength() {
+    auto& wifi = WifiManager::GetInstance();
+    if (wifi.IsConfigMode() || !wifi.IsConnected()) {
+        return -1;
+    }
+    // -90 dBm and below is unusable, -50 dBm and above is as good as it gets
+    return std::clamp((wifi.GetRssi() + 90) * 100 / 40, 0, 100);
+}
+
 std::string WifiBoard::GetBoardJson() {
     auto& wifi = WifiManager::GetInstance();
-    std::string json = R"({"type":")" + std::string(BOARD_TYPE) + R"(",)";
-    json += R"("name":")" + std::string(BOARD_NAME) + R"(",)";
+    // The MAC address does not change in a run
+    static const std::string mac_json = R"("mac":")" + SystemInfo::GetMacAddress() + R"("})";
+    std::string json;
+    json.reserve(160);
+    json += "{\"type\":\"" BOARD_TYPE "\",\"name\":\"" BOARD_NAME "\",";
 
     if (!wifi.IsConfigMode()) {
         json += R"("ssid":")" + wifi.GetSsid() + R"(",)";
@@ -278,10 +452,91 @@ std::string WifiBoard::GetBoardJson() {
         json += R"("ip":")" + wifi.GetIpAddress() + R"(",)";
     }
 
-    json += R"("mac":")" + SystemInfo::GetMacAddress() + R"("})";
+    json += mac_json;
     return json;
 }
 
+#if CONFIG_WIFI_USE_TWT
+// The wake interval only delays what the server sends, the station transmits whenever it has something.
+// Answers to the keepalive pings wait for the next service period, so it stays well below the ping interval.
+static int GetTwtWakeIntervalMs() {
+    int interval_ms = CONFIG_WIFI_TWT_WAKE_INTERVAL_MS;
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    interval_ms = std::min(interval_ms, CONFIG_WEBSOCKET_KEEP_WARM_PING_INTERVAL * 1000 / 4);
+#endif
+    return interval_ms;
+}
+
+bool WifiBoard::SetupTwt() {
+    // Only an 802.11ax association can negotiate TWT
+    wifi_phy_mode_t phy_mode;
+    if (esp_wifi_sta_get_negotiated_phymode(&phy_mode) != ESP_OK || phy_mode != WIFI_PHY_MODE_HE20) {
+        ESP_LOGI(TAG, "The AP does not support Wi-Fi 6, staying on modem sleep");
+        return false;
+    }
+
+    int interval_ms = GetTwtWakeIntervalMs();
+    wifi_itwt_setup_config_t config = {};
+    config.setup_cmd = TWT_REQUEST;
+    config.trigger = 1;
+    config.flow_type = 0;
+    config.flow_id = TWT_FLOW_ID;
+    config.wake_invl_expn = TWT_WAKE_INTERVAL_EXPONENT;
+    config.wake_duration_unit = 0;
+    config.min_wake_dura = TWT_MIN_WAKE_DURATION;
+    config.wake_invl_mant = std::min(interval_ms * 1000 / (1 << TWT_WAKE_INTERVAL_EXPONENT), 65535);
+    config.timeout_time_ms = TWT_SETUP_TIMEOUT_MS;
+    esp_err_t err = esp_wifi_sta_itwt_setup(&config);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "TWT setup failed: %s, staying on modem sleep", esp_err_to_name(err));
+        return false;
+    }
+    twt_requested_ = true;
+    ESP_LOGI(TAG, "Requesting TWT, wake interval %d ms, service period %d ms", interval_ms, TWT_MIN_WAKE_DURATION * 256 / 1000);
+    return true;
+}
+
+void WifiBoard::TeardownTwt() {
+    if (!twt_active_ && !twt_requested_) {
+        return;
+    }
+    twt_requested_ = false;
+    esp_wifi_sta_itwt_teardown(TWT_FLOW_ID);
+}
+
+void WifiBoard::OnTwtEvent(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+    auto* board = static_cast<WifiBoard*>(arg);
+    switch (event_id) {
+        case WIFI_EVENT_ITWT_SETUP: {
+            auto* setup = static_cast<wifi_event_sta_itwt_setup_t*>(event_data);
+            bool accepted = setup->status == ITWT_SETUP_SUCCESS && setup->config.setup_cmd == TWT_ACCEPT;
+            if (!board->twt_requested_ || !accepted) {
+                ESP_LOGW(TAG, "TWT not accepted by the AP (status %d), staying on modem sleep", setup->status);
+                board->twt_requested_ = false;
+                break;
+            }
+            board->twt_active_ = true;
+            board->twt_since_us_ = esp_timer_get_time();
+            ESP_LOGI(TAG, "TWT agreed, wake interval %d ms, service period %d us",
+                (int)(((uint64_t)setup->config.wake_invl_mant << setup->config.wake_invl_expn) / 1000),
+                setup->config.min_wake_dura << (setup->config.wake_duration_unit ? 10 : 8));
+            break;
+        }
+        case WIFI_EVENT_ITWT_TEARDOWN:
+        case WIFI_EVENT_STA_DISCONNECTED:
+            // The agreement ends with the association, the next idle period negotiates a new one
+            if (board->twt_active_) {
+                ESP_LOGI(TAG, "TWT ended after %lld s", (esp_timer_get_time() - board->twt_since_us_) / 1000000);
+            }
+            board->twt_active_ = false;
+            board->twt_requested_ = false;
+            break;
+        default:
+            break;
+    }
+}
+#endif
+
 void WifiBoard::SetPowerSaveLevel(PowerSaveLevel level) {
     WifiPowerSaveLevel wifi_level;
     switch (level) {
@@ -297,41 +552,20 @@ void WifiBoard::SetPowerSaveLevel(PowerSaveLevel level) {
             break;
     }
     WifiManager::GetInstance().SetPowerSaveLevel(wifi_level);
-}
-
-std::string WifiBoard::GetDeviceStatusJson() {
-    auto& board = Board::GetInstance();
-    auto root = cJSON_CreateObject();
 
-    // Audio speaker
-    auto audio_speaker = cJSON_CreateObject();
-    if (auto codec = board.GetAudioCodec()) {
-        cJSON_AddNumberToObject(audio_speaker, "volume", codec->output_volume());
-    }
-    cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
-
-    // Screen
-    auto screen = cJSON_CreateObject();
-    if (auto backlight = board.GetBacklight()) {
-        cJSON_AddNumberToObject(screen, "brightness", backlight->brightness());
-    }
-    if (auto display = board.GetDisplay(); display && display->height() > 64) {
-        if (auto theme = display->GetTheme()) {
-            cJSON_AddStringToObject(screen, "theme", theme->name().c_str());
+#if CONFIG_WIFI_USE_TWT
+    // TWT runs on top of modem sleep, without an agreement the station keeps waking for every DTIM
+    if (level == PowerSaveLevel::LOW_POWER && WifiManager::GetInstance().IsConnected()) {
+        if (!twt_active_ && !twt_requested_) {
+            SetupTwt();
         }
+    } else {
+        TeardownTwt();
     }
-    cJSON_AddItemToObject(root, "screen", screen);
-
-    // Battery
-    int level = 0;
-    bool charging = false, discharging = false;
-    if (board.GetBatteryLevel(level, charging, discharging)) {
-        auto battery = cJSON_CreateObject();
-        cJSON_AddNumberToObject(battery, "level", level);
-        cJSON_AddBoolToObject(battery, "charging", charging);
-        cJSON_AddItemToObject(root, "battery", battery);
-    }
+#endif
+}
 
+std::string WifiBoard::GetDeviceStatusJson() {
     // Network
     auto& wifi = WifiManager::GetInstance();
     auto network = cJSON_CreateObject();
@@ -340,19 +574,7 @@ std::string WifiBoard::GetDeviceStatusJson() {
     int rssi = wifi.GetRssi();
     const char* signal = rssi >= -60 ? "strong" : (rssi >= -70 ? "medium" : "weak");
     cJSON_AddStringToObject(network, "signal", signal);
-    cJSON_AddItemToObject(root, "network", network);
-
-    // Chip temperature
-    float temp = 0.0f;
-    if (board.GetTemperature(temp)) {
-        auto chip = cJSON_CreateObject();
-        cJSON_AddNumberToObject(chip, "temperature", temp);
-        cJSON_AddItemToObject(root, "chip", chip);
-    }
+    cJSON_AddItemToObject(network, "quality", Application::GetInstance().GetNetworkQuality().CreateJson());
 
-    auto str = cJSON_PrintUnformatted(root);
-    std::string result(str);
-    cJSON_free(str);
-    cJSON_Delete(root);
-    return result;
+    return CreateDeviceStatusJson(network);
 }
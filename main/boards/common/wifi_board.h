@@ -5,11 +5,15 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <esp_timer.h>
+#if CONFIG_WIFI_USE_TWT
+#include <esp_event.h>
+#endif
 
 class WifiBoard : public Board {
 protected:
     esp_timer_handle_t connect_timer_ = nullptr;
     bool in_config_mode_ = false;
+    bool standby_ = false;
     NetworkEventCallback network_event_callback_ = nullptr;
 
     virtual std::string GetBoardJson() override;
@@ -36,6 +40,29 @@ protected:
      */
     static void OnWifiConnectTimeout(void* arg);
 
+#if CONFIG_WIFI_FAST_RECONNECT
+    // The AP of the last connection is asked for directly when the station starts its first scan
+    bool fast_reconnect_armed_ = false;
+    bool fast_reconnect_active_ = false;
+    int64_t connect_start_us_ = 0;
+
+    bool StartFastReconnect();
+    void CancelFastReconnect();
+    void SaveFastReconnectAp();
+#endif
+
+#if CONFIG_WIFI_USE_TWT
+    // Individual TWT agreement of the idle station, written by the WiFi event task
+    volatile bool twt_active_ = false;
+    volatile bool twt_requested_ = false;
+    int64_t twt_since_us_ = 0;
+    esp_event_handler_instance_t twt_event_handler_ = nullptr;
+
+    bool SetupTwt();
+    void TeardownTwt();
+    static void OnTwtEvent(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+#endif
+
 public:
     WifiBoard();
     virtual ~WifiBoard();
@@ -51,6 +78,7 @@ public:
     virtual NetworkInterface* GetNetwork() override;
     virtual void SetNetworkEventCallback(NetworkEventCallback callback) override;
     virtual const char* GetNetworkStateIcon() override;
+    virtual int GetSignalStrength() override;
     virtual void SetPowerSaveLevel(PowerSaveLevel level) override;
     virtual AudioCodec* GetAudioCodec() override { return nullptr; }
     virtual std::string GetDeviceStatusJson() override;
@@ -64,6 +92,11 @@ public:
      * Check if in WiFi config mode
      */
     bool IsInWifiConfigMode() const;
+
+    /**
+     * Run as the backup interface of another board: keep trying the saved networks, never enter config mode
+     */
+    void SetStandby(bool standby) { standby_ = standby; }
 };
 
 #endif // WIFI_BOARD_H
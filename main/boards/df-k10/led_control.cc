@@ -80,6 +80,9 @@ LedStripControl::LedStripControl(CircularStrip* led_strip)
             led_strip_->SetAllColor(RGBToColor(red, green, blue));
             return true;
         });
+    mcp_server.SetDeviceControlTool("self.led_strip.set_brightness");
+    mcp_server.SetDeviceControlTool("self.led_strip.set_single_color");
+    mcp_server.SetDeviceControlTool("self.led_strip.set_all_color");
 
     mcp_server.AddTool("self.led_strip.blink", 
         "Blink the led strip. (闪烁)", 
@@ -16,6 +16,8 @@
 #include "settings.h"
 
 #define TAG "ElectronBotController"
+// 动作任务低于所有音频任务，舵机按固定周期采样，被抢占时不会打断说话
+#define ACTION_TASK_PRIORITY 1
 
 struct ElectronBotActionParams {
     int action_type;
@@ -112,7 +114,7 @@ private:
 
     void StartActionTaskIfNeeded() {
         if (action_task_handle_ == nullptr) {
-            xTaskCreate(ActionTask, "electron_bot_action", 1024 * 4, this, configMAX_PRIORITIES - 1,
+            xTaskCreate(ActionTask, "electron_bot_action", 1024 * 4, this, ACTION_TASK_PRIORITY,
                         &action_task_handle_);
         }
     }
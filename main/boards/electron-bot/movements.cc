@@ -155,16 +155,27 @@ void Otto::OscillateServos(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT],
         }
     }
 
-    double ref = millis();
-    double end_time = period * cycle + ref;
-
-    while (millis() < end_time) {
+    // 以固定周期采样，相位按实际经过的时间推进，任务被抢占时轨迹不会变形
+    unsigned long start_time = millis();
+    unsigned long end_time = start_time + (unsigned long)(period * cycle);
+    unsigned long last_time = start_time;
+    TickType_t last_wake = xTaskGetTickCount();
+    const TickType_t interval = std::max<TickType_t>(1, pdMS_TO_TICKS(OSCILLATOR_SAMPLING_PERIOD_MS));
+
+    for (unsigned long now = start_time; (long)(end_time - now) > 0; now = millis()) {
+        uint32_t elapsed = now - last_time;
+        last_time = now;
+        for (int i = 0; i < SERVO_COUNT; i++) {
+            if (servo_pins_[i] != -1) {
+                servo_[i].Refresh(elapsed);
+            }
+        }
         for (int i = 0; i < SERVO_COUNT; i++) {
             if (servo_pins_[i] != -1) {
-                servo_[i].Refresh();
+                servo_[i].Latch();
             }
         }
-        vTaskDelay(5);
+        xTaskDelayUntil(&last_wake, interval);
     }
     vTaskDelay(pdMS_TO_TICKS(10));
 }
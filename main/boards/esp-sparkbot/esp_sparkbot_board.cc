@@ -249,7 +249,7 @@ private:
                 SendUartMessage(command_str);
                 return true;
             }
-            throw std::runtime_error("Invalid light mode");
+            return McpError{"Invalid light mode"};
         });
 
         mcp_server.AddTool("self.camera.set_camera_flipped", "翻转摄像头图像方向", PropertyList(), [this](const PropertyList& properties) -> ReturnValue {
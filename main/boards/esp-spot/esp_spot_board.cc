@@ -15,6 +15,7 @@
 #include "button.h"
 #include "codecs/es8311_audio_codec.h"
 #include "config.h"
+#include "settings.h"
 #include "sleep_timer.h"
 #include "wifi_board.h"
 
@@ -340,6 +341,7 @@ private:
         const uint64_t wakeup_mask = (1ULL << KEY_BUTTON_GPIO) | (1ULL << IMU_INT_GPIO);
         ESP_ERROR_CHECK(esp_sleep_enable_ext1_wakeup(wakeup_mask, ESP_EXT1_WAKEUP_ANY_HIGH));
         ESP_LOGI(TAG, "Entering deep sleep, waiting for key or wrist gesture");
+        Settings::Flush();
         esp_deep_sleep_start();
     }
 #endif  // IMU_INT_GPIO
@@ -8,6 +8,7 @@
 #include "power_controller.h"
 #include <driver/rtc_io.h>
 #include <esp_sleep.h>
+#include "settings.h"
 
 #define JIUCHUAN_ADC_UNIT (ADC_UNIT_1)
 #define JIUCHUAN_ADC_BITWIDTH (ADC_BITWIDTH_12)
@@ -178,6 +179,7 @@ public:
                     vTaskDelay(200 / portTICK_PERIOD_MS);
                     ESP_LOGI(TAG, "Initiating deep sleep");
 
+                    Settings::Flush();
                     esp_deep_sleep_start();
                     break;
                 }   
@@ -15,6 +15,7 @@
 #include <esp_log.h>
 
 #include "esp_lcd_gc9503.h"
+#include "lcd_init_sequence.h"
 
 #define GC9503_CMD_MADCTL (0xB1)         // Memory data access control
 #define GC9503_CMD_MADCTL_DEFAULT (0x10) // Default value of Memory data access control
@@ -47,6 +48,8 @@ typedef struct
 
 static const char *TAG = "gc9503";
 
+_Static_assert(sizeof(gc9503_lcd_init_cmd_t) == sizeof(lcd_init_sequence_cmd_t), "init command layout differs");
+
 static esp_err_t panel_gc9503_send_init_cmds(gc9503_panel_t *gc9503);
 
 static esp_err_t panel_gc9503_init(esp_lcd_panel_t *panel);
@@ -346,11 +349,9 @@ static esp_err_t panel_gc9503_send_init_cmds(gc9503_panel_t *gc9503)
             ESP_LOGW(TAG, "The %02Xh command has been used and will be overwritten by external initialization sequence",
                      init_cmds[i].cmd);
         }
-
-        ESP_RETURN_ON_ERROR(esp_lcd_panel_io_tx_param(io, init_cmds[i].cmd, init_cmds[i].data, init_cmds[i].data_bytes),
-                            TAG, "send command failed");
-        vTaskDelay(pdMS_TO_TICKS(init_cmds[i].delay_ms));
     }
+    ESP_RETURN_ON_ERROR(lcd_init_sequence_run(io, (const lcd_init_sequence_cmd_t *)init_cmds, init_cmds_size, TAG),
+                        TAG, "send init commands failed");
     ESP_LOGD(TAG, "send init commands success");
 
     return ESP_OK;
@@ -14,6 +14,7 @@ Tcamerapluss3AudioCodec::Tcamerapluss3AudioCodec(int input_sample_rate, int outp
     gpio_num_t spkr_bclk, gpio_num_t spkr_lrclk, gpio_num_t spkr_data,
     bool input_reference) {
     duplex_ = true;                             // 是否双工
+    software_volume_ = true;                    // 音量由 AudioService 在输出前施加
     input_reference_ = input_reference;         // 是否使用参考输入，实现回声消除
     input_channels_ = input_reference_ ? 2 : 1; // 输入通道数
     input_sample_rate_ = input_sample_rate;
@@ -127,11 +128,6 @@ void Tcamerapluss3AudioCodec::CreateVoiceHardware(gpio_num_t mic_bclk, gpio_num_
     ESP_LOGI(TAG, "Voice hardware created");
 }
 
-void Tcamerapluss3AudioCodec::SetOutputVolume(int volume) {
-    volume_ = volume;
-    AudioCodec::SetOutputVolume(volume);
-}
-
 void Tcamerapluss3AudioCodec::EnableInput(bool enable) {
     AudioCodec::EnableInput(enable);
 }
@@ -157,13 +153,8 @@ int Tcamerapluss3AudioCodec::Read(int16_t *dest, int samples) {
 
 int Tcamerapluss3AudioCodec::Write(const int16_t *data, int samples){
     if (output_enabled_){
-        size_t bytes_read;
-        auto output_data = (int16_t *)malloc(samples * sizeof(int16_t));
-        for (size_t i = 0; i < samples; i++){
-            output_data[i] = (float)data[i] * (float)(volume_ / 100.0);
-        }
-        i2s_channel_write(tx_handle_, output_data, samples * sizeof(int16_t), &bytes_read, portMAX_DELAY);
-        free(output_data);
+        size_t bytes_written;
+        i2s_channel_write(tx_handle_, data, samples * sizeof(int16_t), &bytes_written, portMAX_DELAY);
     }
     return samples;
 }
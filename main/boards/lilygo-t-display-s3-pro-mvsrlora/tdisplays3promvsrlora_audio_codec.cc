@@ -14,6 +14,7 @@ Tdisplays3promvsrloraAudioCodec::Tdisplays3promvsrloraAudioCodec(int input_sampl
     gpio_num_t spkr_bclk, gpio_num_t spkr_lrclk, gpio_num_t spkr_data,
     bool input_reference) {
     duplex_ = true;                             // 是否双工
+    software_volume_ = true;                    // 音量由 AudioService 在输出前施加
     input_reference_ = input_reference;         // 是否使用参考输入，实现回声消除
     input_channels_ = input_reference_ ? 2 : 1; // 输入通道数
     input_sample_rate_ = input_sample_rate;
@@ -110,11 +111,6 @@ void Tdisplays3promvsrloraAudioCodec::CreateVoiceHardware(gpio_num_t mic_bclk, g
     ESP_LOGI(TAG, "Voice hardware created");
 }
 
-void Tdisplays3promvsrloraAudioCodec::SetOutputVolume(int volume) {
-    volume_ = volume;
-    AudioCodec::SetOutputVolume(volume);
-}
-
 void Tdisplays3promvsrloraAudioCodec::EnableInput(bool enable) {
     gpio_set_level(AUDIO_MIC_ENABLE, !enable);
     AudioCodec::EnableInput(enable);
@@ -138,13 +134,8 @@ int Tdisplays3promvsrloraAudioCodec::Read(int16_t *dest, int samples){
 
 int Tdisplays3promvsrloraAudioCodec::Write(const int16_t *data, int samples){
     if (output_enabled_){
-        size_t bytes_read;
-        auto output_data = (int16_t *)malloc(samples * sizeof(int16_t));
-        for (size_t i = 0; i < samples; i++){
-            output_data[i] = (float)data[i] * (float)(volume_ / 100.0);
-        }
-        i2s_channel_write(tx_handle_, output_data, samples * sizeof(int16_t), &bytes_read, portMAX_DELAY);
-        free(output_data);
+        size_t bytes_written;
+        i2s_channel_write(tx_handle_, data, samples * sizeof(int16_t), &bytes_written, portMAX_DELAY);
     }
     return samples;
 }
@@ -18,6 +18,7 @@
 #include "freertos/task.h"
 #include "driver/gpio.h"
 #include "esp_lcd_st7123.h"
+#include "lcd_init_sequence.h"
 
 #define ST7123_PAD_CONTROL  (0xB7)
 #define ST7123_DSI_2_LANE   (0x03)
@@ -44,6 +45,8 @@ typedef struct {
 
 static const char *TAG = "st7123";
 
+_Static_assert(sizeof(st7123_lcd_init_cmd_t) == sizeof(lcd_init_sequence_cmd_t), "init command layout differs");
+
 static esp_err_t panel_st7123_del(esp_lcd_panel_t *panel);
 static esp_err_t panel_st7123_init(esp_lcd_panel_t *panel);
 static esp_err_t panel_st7123_reset(esp_lcd_panel_t *panel);
@@ -241,40 +244,7 @@ static esp_err_t panel_st7123_init(esp_lcd_panel_t *panel)
         init_cmds_size = sizeof(vendor_specific_init_default) / sizeof(st7123_lcd_init_cmd_t);
     }
 
-    for (int i = 0; i < init_cmds_size; i++) {
-        // Check if the command has been used or conflicts with the internal
-        // if (is_command0_enable && init_cmds[i].data_bytes > 0) {
-        //     switch (init_cmds[i].cmd) {
-        //     case LCD_CMD_MADCTL:
-        //         is_cmd_overwritten = true;
-        //         st7123->madctl_val = ((uint8_t *)init_cmds[i].data)[0];
-        //         break;
-        //     case LCD_CMD_COLMOD:
-        //         is_cmd_overwritten = true;
-        //         st7123->colmod_val = ((uint8_t *)init_cmds[i].data)[0];
-        //         break;
-        //     default:
-        //         is_cmd_overwritten = false;
-        //         break;
-        //     }
-
-        //     if (is_cmd_overwritten) {
-        //         is_cmd_overwritten = false;
-        //         ESP_LOGW(TAG, "The %02Xh command has been used and will be overwritten by external initialization sequence",
-        //                  init_cmds[i].cmd);
-        //     }
-        // }
-
-        // Send command
-        ESP_RETURN_ON_ERROR(esp_lcd_panel_io_tx_param(io, init_cmds[i].cmd, init_cmds[i].data, init_cmds[i].data_bytes), TAG, "send command failed");
-        vTaskDelay(pdMS_TO_TICKS(init_cmds[i].delay_ms));
-
-        // if ((init_cmds[i].cmd == ST7123_CMD_CNDBKxSEL) && (((uint8_t *)init_cmds[i].data)[2] == ST7123_CMD_BKxSEL_BYTE2_PAGE0)) {
-        //     is_command0_enable = true;
-        // } else if ((init_cmds[i].cmd == ST7123_CMD_CNDBKxSEL) && (((uint8_t *)init_cmds[i].data)[2] != ST7123_CMD_BKxSEL_BYTE2_PAGE0)) {
-        //     is_command0_enable = false;
-        // }
-    }
+    ESP_RETURN_ON_ERROR(lcd_init_sequence_run(io, (const lcd_init_sequence_cmd_t *)init_cmds, init_cmds_size, TAG), TAG, "send init commands failed");
     ESP_LOGD(TAG, "send init commands success");
 
     ESP_RETURN_ON_ERROR(st7123->init(panel), TAG, "init MIPI DPI panel failed");
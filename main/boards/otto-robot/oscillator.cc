@@ -12,12 +12,32 @@
 #include <esp_timer.h>
 
 #include <algorithm>
+#include <array>
 #include <cmath>
 
 static const char* TAG = "Oscillator";
 
 extern unsigned long IRAM_ATTR millis();
 
+// Sine over one turn in Q15, with a guard entry for the interpolation
+#define SINE_TABLE_BITS 8
+#define SINE_TABLE_SIZE (1 << SINE_TABLE_BITS)
+
+static int SineQ15(uint32_t phase) {
+    static const auto table = [] {
+        std::array<int16_t, SINE_TABLE_SIZE + 1> t;
+        for (int i = 0; i <= SINE_TABLE_SIZE; i++) {
+            t[i] = (int16_t)std::lround(std::sin(2 * M_PI * i / SINE_TABLE_SIZE) * 32767);
+        }
+        return t;
+    }();
+    uint32_t index = phase >> (32 - SINE_TABLE_BITS);
+    int32_t frac = (phase >> (16 - SINE_TABLE_BITS)) & 0xFFFF;
+    int32_t a = table[index];
+    int32_t b = table[index + 1];
+    return a + (((b - a) * frac) >> 16);
+}
+
 static ledc_channel_t next_free_channel = LEDC_CHANNEL_0;
 
 Oscillator::Oscillator(int trim) {
@@ -25,10 +45,7 @@ Oscillator::Oscillator(int trim) {
     diff_limit_ = 0;
     is_attached_ = false;
 
-    sampling_period_ = 30;
     period_ = 2000;
-    number_samples_ = period_ / sampling_period_;
-    inc_ = 2 * M_PI / number_samples_;
 
     amplitude_ = 45;
     phase_ = 0;
@@ -38,7 +55,6 @@ Oscillator::Oscillator(int trim) {
     rev_ = false;
 
     pos_ = 90;
-    previous_millis_ = 0;
 }
 
 Oscillator::~Oscillator() {
@@ -51,15 +67,10 @@ uint32_t Oscillator::AngleToCompare(int angle) {
            SERVO_MIN_PULSEWIDTH_US;
 }
 
-bool Oscillator::NextSample() {
-    current_millis_ = millis();
-
-    if (current_millis_ - previous_millis_ > sampling_period_) {
-        previous_millis_ = current_millis_;
-        return true;
-    }
-
-    return false;
+uint32_t Oscillator::RadiansToPhase(double radians) {
+    double turns = radians / (2 * M_PI);
+    turns -= std::floor(turns);
+    return (uint32_t)(uint64_t)(turns * 4294967296.0);
 }
 
 void Oscillator::Attach(int pin, bool rev) {
@@ -109,30 +120,30 @@ void Oscillator::Detach() {
 }
 
 void Oscillator::SetT(unsigned int T) {
-    period_ = T;
-
-    number_samples_ = period_ / sampling_period_;
-    inc_ = 2 * M_PI / number_samples_;
+    period_ = T > 0 ? T : 1;
 }
 
-void Oscillator::SetPosition(int position) {
-    Write(position);
+void Oscillator::SetPosition(int position, bool latch) {
+    Write(position, latch);
 }
 
-void Oscillator::Refresh() {
-    if (NextSample()) {
-        if (!stop_) {
-            int pos = std::round(amplitude_ * std::sin(phase_ + phase0_) + offset_);
-            if (rev_)
-                pos = -pos;
-            Write(pos + 90);
-        }
-
-        phase_ = phase_ + inc_;
+void Oscillator::Refresh(uint32_t elapsed_ms) {
+    phase_ += (uint32_t)(((uint64_t)elapsed_ms << 32) / period_);
+    if (!stop_) {
+        int pos = (((int32_t)amplitude_ * SineQ15(phase_ + phase0_) + (1 << 14)) >> 15) + offset_;
+        if (rev_)
+            pos = -pos;
+        Write(pos + 90, false);
     }
 }
 
-void Oscillator::Write(int position) {
+void Oscillator::Latch() {
+    if (!is_attached_)
+        return;
+    ESP_ERROR_CHECK(ledc_update_duty(ledc_speed_mode_, ledc_channel_));
+}
+
+void Oscillator::Write(int position, bool latch) {
     if (!is_attached_)
         return;
 
@@ -157,5 +168,7 @@ void Oscillator::Write(int position) {
     uint32_t duty = (uint32_t)(((angle / 180.0) * 2.0 + 0.5) * 8191 / 20.0);
 
     ESP_ERROR_CHECK(ledc_set_duty(ledc_speed_mode_, ledc_channel_, duty));
-    ESP_ERROR_CHECK(ledc_update_duty(ledc_speed_mode_, ledc_channel_));
+    if (latch) {
+        ESP_ERROR_CHECK(ledc_update_duty(ledc_speed_mode_, ledc_channel_));
+    }
 }
@@ -26,6 +26,7 @@
 #define SERVO_MAX_DEGREE 90                   // 最大角度
 #define SERVO_TIMEBASE_RESOLUTION_HZ 1000000  // 1MHz, 1us per tick
 #define SERVO_TIMEBASE_PERIOD 20000           // 20000 ticks, 20ms
+#define OSCILLATOR_SAMPLING_PERIOD_MS 30      // 振荡器采样周期（毫秒）
 
 class Oscillator {
 public:
@@ -36,22 +37,25 @@ public:
 
     void SetA(unsigned int amplitude) { amplitude_ = amplitude; };
     void SetO(int offset) { offset_ = offset; };
-    void SetPh(double Ph) { phase0_ = Ph; };
+    void SetPh(double Ph) { phase0_ = RadiansToPhase(Ph); };
     void SetT(unsigned int period);
     void SetTrim(int trim) { trim_ = trim; };
     void SetLimiter(int diff_limit) { diff_limit_ = diff_limit; };
     void DisableLimiter() { diff_limit_ = 0; };
     int GetTrim() { return trim_; };
-    void SetPosition(int position);
+    void SetPosition(int position, bool latch = true);
     void Stop() { stop_ = true; };
     void Play() { stop_ = false; };
     void Reset() { phase_ = 0; };
-    void Refresh();
+    // Advances the phase by the time elapsed since the previous sample and sets the new duty.
+    // The duty is latched by Latch(), so that all servos change on the same PWM period.
+    void Refresh(uint32_t elapsed_ms);
+    void Latch();
     int GetPosition() { return pos_; }
 
 private:
-    bool NextSample();
-    void Write(int position);
+    void Write(int position, bool latch = true);
+    static uint32_t RadiansToPhase(double radians);
     uint32_t AngleToCompare(int angle);
 
 private:
@@ -61,19 +65,13 @@ private:
     unsigned int amplitude_;  //-- Amplitude (degrees)
     int offset_;              //-- Offset (degrees)
     unsigned int period_;     //-- Period (miliseconds)
-    double phase0_;           //-- Phase (radians)
+    uint32_t phase0_;         //-- Phase (1 << 32 per turn)
 
     //-- Internal variables
     int pos_;                       //-- Current servo pos
     int pin_;                       //-- Pin where the servo is connected
     int trim_;                      //-- Calibration offset
-    double phase_;                  //-- Current phase
-    double inc_;                    //-- Increment of phase
-    double number_samples_;         //-- Number of samples
-    unsigned int sampling_period_;  //-- sampling period (ms)
-
-    long previous_millis_;
-    long current_millis_;
+    uint32_t phase_;                //-- Current phase (1 << 32 per turn)
 
     //-- Oscillation mode. If true, the servo is stopped
     bool stop_;
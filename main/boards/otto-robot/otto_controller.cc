@@ -5,6 +5,7 @@
 #include <cJSON.h>
 #include <esp_log.h>
 
+#include <atomic>
 #include <cstdlib> 
 #include <cstring>
 
@@ -12,6 +13,7 @@
 #include "board.h"
 #include "config.h"
 #include "mcp_server.h"
+#include "otto_keyframes.h"
 #include "otto_movements.h"
 #include "power_manager.h"
 #include "sdkconfig.h"
@@ -19,6 +21,8 @@
 #include <wifi_manager.h>
 
 #define TAG "OttoController"
+// 动作任务低于所有音频任务，舵机按固定周期采样，被抢占时不会打断说话
+#define ACTION_TASK_PRIORITY 1
 
 class OttoController {
 private:
@@ -27,6 +31,8 @@ private:
     QueueHandle_t action_queue_;
     bool has_hands_ = false;
     bool is_action_in_progress_ = false;
+    KeyframeRing keyframe_ring_;
+    std::atomic<bool> keyframes_queued_{false};
 
     struct OttoActionParams {
         int action_type;
@@ -65,7 +71,8 @@ private:
         ACTION_SHOWCASE = 28,   // 展示动作
         ACTION_HOME = 17,
         ACTION_SERVO_SEQUENCE = 18,  // 舵机序列（自编程）
-        ACTION_WHIRLWIND_LEG = 19    // 旋风腿
+        ACTION_WHIRLWIND_LEG = 19,   // 旋风腿
+        ACTION_KEYFRAMES = 29        // 关键帧流（播放环形缓冲区中的关键帧）
     };
 
     static void ActionTask(void* arg) {
@@ -294,6 +301,10 @@ private:
                                  error_ptr ? error_ptr : "未知");
                         ESP_LOGE(TAG, "JSON内容: %s", params.servo_sequence_json);
                     }
+                } else if (params.action_type == ACTION_KEYFRAMES) {
+                    // 之后推入的关键帧会再排一次队，播放期间到达的帧直接接在当前动作后面
+                    controller->keyframes_queued_ = false;
+                    PlayKeyframes(controller->otto_, controller->keyframe_ring_);
                 } else {
                     // 执行预定义动作
                     switch (params.action_type) {
@@ -419,7 +430,7 @@ private:
 
     void StartActionTaskIfNeeded() {
         if (action_task_handle_ == nullptr) {
-            xTaskCreate(ActionTask, "otto_action", 1024 * 3, this, configMAX_PRIORITIES - 1,
+            xTaskCreate(ActionTask, "otto_action", 1024 * 3, this, ACTION_TASK_PRIORITY,
                         &action_task_handle_);
         }
     }
@@ -445,10 +456,11 @@ private:
         StartActionTaskIfNeeded();
     }
 
-    void QueueServoSequence(const char* servo_sequence_json) {
+    // 队列满时立即返回 false，不阻塞 MCP 调用方
+    bool QueueServoSequence(const char* servo_sequence_json) {
         if (servo_sequence_json == nullptr) {
             ESP_LOGE(TAG, "序列JSON为空");
-            return;
+            return false;
         }
         
         int input_len = strlen(servo_sequence_json);
@@ -457,12 +469,12 @@ private:
         
         if (input_len >= buffer_size) {
             ESP_LOGE(TAG, "JSON字符串太长！输入长度=%d，最大允许=%d", input_len, buffer_size - 1);
-            return;
+            return false;
         }
         
         if (input_len == 0) {
             ESP_LOGW(TAG, "序列JSON为空字符串");
-            return;
+            return false;
         }
         
         OttoActionParams params = {ACTION_SERVO_SEQUENCE, 0, 0, 0, 0, ""};
@@ -470,9 +482,33 @@ private:
         strncpy(params.servo_sequence_json, servo_sequence_json, sizeof(params.servo_sequence_json) - 1);
         params.servo_sequence_json[sizeof(params.servo_sequence_json) - 1] = '\0';
         
+        if (xQueueSend(action_queue_, &params, 0) != pdTRUE) {
+            ESP_LOGW(TAG, "动作队列已满，序列被拒绝");
+            return false;
+        }
         ESP_LOGD(TAG, "序列已加入队列: %s", params.servo_sequence_json);
-        
-        xQueueSend(action_queue_, &params, portMAX_DELAY);
+        StartActionTaskIfNeeded();
+        return true;
+    }
+
+    // 关键帧整批放入环形缓冲区，缓冲区放不下时整批拒绝，调用方稍后重发即可
+    bool QueueKeyframes(const std::vector<OttoKeyframe>& frames) {
+        if (!keyframe_ring_.Push(frames.data(), frames.size())) {
+            return false;
+        }
+        ScheduleKeyframes();
+        return true;
+    }
+
+    void ScheduleKeyframes() {
+        if (!keyframes_queued_.exchange(true)) {
+            OttoActionParams params = {ACTION_KEYFRAMES, 0, 0, 0, 0, ""};
+            if (xQueueSend(action_queue_, &params, 0) != pdTRUE) {
+                // 帧留在缓冲区里，下一批到达时再排队
+                keyframes_queued_ = false;
+                ESP_LOGW(TAG, "动作队列已满，关键帧稍后播放");
+            }
+        }
         StartActionTaskIfNeeded();
     }
 
@@ -695,10 +731,34 @@ public:
                 std::string sequence = properties["sequence"].value<std::string>();
                 // 检查是否是JSON对象（可能是字符串格式或已解析的对象）
                 // 如果sequence是JSON字符串，直接使用；如果是对象字符串，也需要使用
-                QueueServoSequence(sequence.c_str());
+                if (!QueueServoSequence(sequence.c_str())) {
+                    return "错误：序列无效或动作队列已满，请稍后重试";
+                }
                 return true;
             });
 
+        mcp_server.AddTool(
+            "self.otto.keyframes",
+            "流式发送舵机关键帧，机器人用样条曲线在关键帧之间平滑插值，适合长而流畅的自编动作。"
+            "frames: base64编码的二进制关键帧，每帧8字节：到达该帧的时长（毫秒，2字节小端，30-5000），"
+            "随后6个字节依次为ll/rl/lf/rf/lh/rh的目标角度(0-180)，255表示该舵机保持上一帧的位置。"
+            "缓冲区最多容纳64帧，长动作可以分多次调用，前一批播放期间发送的帧会无缝衔接；"
+            "返回free表示缓冲区剩余帧数，返回错误时请等待片刻后重发同一批。"
+            "舵机方向与self.otto.servo_sequences相同，左右腿脚不要同时大幅度运动。",
+            PropertyList({Property("frames", kPropertyTypeString)}),
+            [this](const PropertyList& properties) -> ReturnValue {
+                std::vector<OttoKeyframe> frames;
+                if (!DecodeKeyframes(properties["frames"].value<std::string>(), frames)) {
+                    return "错误：关键帧格式无效";
+                }
+                if (!QueueKeyframes(frames)) {
+                    return "错误：关键帧缓冲区已满，剩余" + std::to_string(keyframe_ring_.Free()) +
+                           "帧，请稍后重发";
+                }
+                return "{\"accepted\":" + std::to_string(frames.size()) +
+                       ",\"free\":" + std::to_string(keyframe_ring_.Free()) + "}";
+            });
+
 
         mcp_server.AddTool("self.otto.stop", "立即停止所有动作并复位", PropertyList(),
                            [this](const PropertyList& properties) -> ReturnValue {
@@ -709,6 +769,8 @@ public:
                                is_action_in_progress_ = false;
                                PowerManager::ResumeBatteryUpdate();  // 停止动作时恢复电量更新
                                xQueueReset(action_queue_);
+                               keyframe_ring_.Clear();
+                               keyframes_queued_ = false;
 
                                QueueAction(ACTION_HOME, 1, 1000, 1, 0);
                                return true;
@@ -830,6 +892,16 @@ public:
         ESP_LOGI(TAG, "MCP工具注册完成");
     }
 
+    // 实时控制只保留最新的目标，未播放的关键帧全部丢弃
+    void SetLiveTarget(const OttoKeyframe& target) {
+        keyframe_ring_.Replace(target);
+        ScheduleKeyframes();
+    }
+
+    void HoldPosition() {
+        keyframe_ring_.Clear();
+    }
+
     ~OttoController() {
         if (action_task_handle_ != nullptr) {
             vTaskDelete(action_task_handle_);
@@ -847,3 +919,15 @@ void InitializeOttoController(const HardwareConfig& hw_config) {
         ESP_LOGI(TAG, "Otto控制器已初始化并注册MCP工具");
     }
 }
+
+void SetOttoLiveTarget(const OttoKeyframe& target) {
+    if (g_otto_controller != nullptr) {
+        g_otto_controller->SetLiveTarget(target);
+    }
+}
+
+void HoldOttoPosition() {
+    if (g_otto_controller != nullptr) {
+        g_otto_controller->HoldPosition();
+    }
+}
@@ -0,0 +1,192 @@
+#include "otto_keyframes.h"
+
+#include <esp_log.h>
+#include <mbedtls/base64.h>
+
+#include <algorithm>
+
+#define TAG "OttoKeyframes"
+
+// 环形缓冲区读空后等待新帧的时间，分段发送的帧在此时间内到达即可连成一个动作
+#define KEYFRAME_STREAM_GAP_MS 300
+
+extern unsigned long IRAM_ATTR millis();
+
+bool KeyframeRing::Push(const OttoKeyframe* frames, size_t count) {
+    portENTER_CRITICAL(&lock_);
+    bool fits = count <= KEYFRAME_RING_SIZE - count_;
+    if (fits) {
+        for (size_t i = 0; i < count; i++) {
+            frames_[(head_ + count_ + i) % KEYFRAME_RING_SIZE] = frames[i];
+        }
+        count_ += count;
+    }
+    portEXIT_CRITICAL(&lock_);
+    return fits;
+}
+
+void KeyframeRing::Replace(const OttoKeyframe& frame) {
+    portENTER_CRITICAL(&lock_);
+    frames_[0] = frame;
+    head_ = 0;
+    count_ = 1;
+    generation_++;
+    portEXIT_CRITICAL(&lock_);
+}
+
+uint32_t KeyframeRing::Generation() {
+    portENTER_CRITICAL(&lock_);
+    uint32_t generation = generation_;
+    portEXIT_CRITICAL(&lock_);
+    return generation;
+}
+
+bool KeyframeRing::Pop(OttoKeyframe& frame) {
+    portENTER_CRITICAL(&lock_);
+    bool has_frame = count_ > 0;
+    if (has_frame) {
+        frame = frames_[head_];
+        head_ = (head_ + 1) % KEYFRAME_RING_SIZE;
+        count_--;
+    }
+    portEXIT_CRITICAL(&lock_);
+    return has_frame;
+}
+
+bool KeyframeRing::Peek(OttoKeyframe& frame) {
+    portENTER_CRITICAL(&lock_);
+    bool has_frame = count_ > 0;
+    if (has_frame) {
+        frame = frames_[head_];
+    }
+    portEXIT_CRITICAL(&lock_);
+    return has_frame;
+}
+
+size_t KeyframeRing::Free() {
+    portENTER_CRITICAL(&lock_);
+    size_t free = KEYFRAME_RING_SIZE - count_;
+    portEXIT_CRITICAL(&lock_);
+    return free;
+}
+
+void KeyframeRing::Clear() {
+    portENTER_CRITICAL(&lock_);
+    head_ = 0;
+    count_ = 0;
+    portEXIT_CRITICAL(&lock_);
+}
+
+bool DecodeKeyframes(const std::string& base64, std::vector<OttoKeyframe>& frames) {
+    size_t max_bytes = base64.size() / 4 * 3;
+    std::vector<uint8_t> data(max_bytes);
+    size_t length = 0;
+    if (mbedtls_base64_decode(data.data(), data.size(), &length, (const unsigned char*)base64.data(),
+                              base64.size()) != 0) {
+        return false;
+    }
+    if (length == 0 || length % sizeof(OttoKeyframe) != 0) {
+        return false;
+    }
+
+    frames.resize(length / sizeof(OttoKeyframe));
+    for (size_t i = 0; i < frames.size(); i++) {
+        const uint8_t* p = data.data() + i * sizeof(OttoKeyframe);
+        auto& frame = frames[i];
+        frame.duration_ms = p[0] | (p[1] << 8);
+        if (frame.duration_ms > KEYFRAME_MAX_DURATION_MS) {
+            return false;
+        }
+        for (int j = 0; j < SERVO_COUNT; j++) {
+            frame.position[j] = p[2 + j];
+            if (frame.position[j] > 180 && frame.position[j] != KEYFRAME_HOLD) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// 把关键帧中保持不变的舵机替换为上一帧的位置
+static void Resolve(const OttoKeyframe& frame, const int from[SERVO_COUNT], int to[SERVO_COUNT]) {
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        to[i] = frame.position[i] == KEYFRAME_HOLD ? from[i] : frame.position[i];
+    }
+}
+
+static int CatmullRom(int p0, int p1, int p2, int p3, float t) {
+    float t2 = t * t;
+    float t3 = t2 * t;
+    float v = 0.5f * (2 * p1 + (p2 - p0) * t + (2 * p0 - 5 * p1 + 4 * p2 - p3) * t2 +
+                      (3 * p1 - p0 - 3 * p2 + p3) * t3);
+    return std::clamp((int)(v + 0.5f), 0, 180);
+}
+
+static bool WaitForKeyframe(KeyframeRing& ring, OttoKeyframe& frame) {
+    unsigned long deadline = millis() + KEYFRAME_STREAM_GAP_MS;
+    while (!ring.Pop(frame)) {
+        if ((long)(millis() - deadline) >= 0) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(OSCILLATOR_SAMPLING_PERIOD_MS));
+    }
+    return true;
+}
+
+void PlayKeyframes(Otto& otto, KeyframeRing& ring) {
+    int previous[SERVO_COUNT];
+    int from[SERVO_COUNT];
+    for (int i = 0; i < SERVO_COUNT; i++) {
+        from[i] = previous[i] = otto.GetServoPosition(i);
+    }
+
+    const TickType_t interval = std::max<TickType_t>(1, pdMS_TO_TICKS(OSCILLATOR_SAMPLING_PERIOD_MS));
+    int played = 0;
+    OttoKeyframe frame;
+    while (WaitForKeyframe(ring, frame)) {
+        int to[SERVO_COUNT];
+        int next[SERVO_COUNT];
+        Resolve(frame, from, to);
+        // 下一帧若已到达，用它决定曲线在终点的切线，否则在终点平滑停下
+        OttoKeyframe next_frame;
+        if (ring.Peek(next_frame)) {
+            Resolve(next_frame, to, next);
+        } else {
+            std::copy(to, to + SERVO_COUNT, next);
+        }
+
+        unsigned long duration = std::max<unsigned long>(frame.duration_ms, KEYFRAME_MIN_DURATION_MS);
+        unsigned long start_time = millis();
+        TickType_t last_wake = xTaskGetTickCount();
+        uint32_t generation = ring.Generation();
+        int position[SERVO_COUNT];
+        bool replaced = false;
+        while (true) {
+            unsigned long elapsed = std::min(millis() - start_time, duration);
+            float t = (float)elapsed / duration;
+            for (int i = 0; i < SERVO_COUNT; i++) {
+                position[i] = CatmullRom(previous[i], from[i], to[i], next[i], t);
+            }
+            otto.SetServoPositions(position);
+            if (elapsed >= duration) {
+                break;
+            }
+            xTaskDelayUntil(&last_wake, interval);
+            if (ring.Generation() != generation) {
+                replaced = true;
+                break;
+            }
+        }
+
+        if (replaced) {
+            // 新目标从当前位置出发
+            std::copy(position, position + SERVO_COUNT, previous);
+            std::copy(position, position + SERVO_COUNT, from);
+        } else {
+            std::copy(from, from + SERVO_COUNT, previous);
+            std::copy(to, to + SERVO_COUNT, from);
+        }
+        played++;
+    }
+    ESP_LOGI(TAG, "Played %d keyframes", played);
+}
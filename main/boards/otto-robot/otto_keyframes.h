@@ -0,0 +1,63 @@
+#ifndef __OTTO_KEYFRAMES_H__
+#define __OTTO_KEYFRAMES_H__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <freertos/FreeRTOS.h>
+
+#include "otto_movements.h"
+
+// 关键帧环形缓冲区容量，单次发送的帧数不能超过它
+#define KEYFRAME_RING_SIZE 64
+// 位置为该值的舵机保持上一帧的位置
+#define KEYFRAME_HOLD 0xFF
+#define KEYFRAME_MIN_DURATION_MS 30
+#define KEYFRAME_MAX_DURATION_MS 5000
+
+// 二进制关键帧：到达该帧的时长（毫秒，小端）加六个舵机的目标角度，按 ll/rl/lf/rf/lh/rh 顺序
+struct __attribute__((packed)) OttoKeyframe {
+    uint16_t duration_ms;
+    uint8_t position[SERVO_COUNT];
+};
+static_assert(sizeof(OttoKeyframe) == 8, "OttoKeyframe must stay 8 bytes on the wire");
+
+/**
+ * KeyframeRing - Keyframes waiting to be played, filled by the MCP tool and drained by the action task
+ *
+ * Push() never blocks: a batch is either taken whole or refused, so the caller can retry the same
+ * batch once the robot has played part of the ring. A spinlock guards the ring rather than a mutex,
+ * since self.otto.stop deletes the action task wherever it is.
+ */
+class KeyframeRing {
+public:
+    bool Push(const OttoKeyframe* frames, size_t count);
+    // Drops everything waiting and leaves only this frame, for live control where only the latest
+    // target matters. The player notices through Generation() and heads for it right away.
+    void Replace(const OttoKeyframe& frame);
+    uint32_t Generation();
+    bool Pop(OttoKeyframe& frame);
+    bool Peek(OttoKeyframe& frame);
+    size_t Free();
+    void Clear();
+
+private:
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+    std::array<OttoKeyframe, KEYFRAME_RING_SIZE> frames_;
+    size_t head_ = 0;
+    size_t count_ = 0;
+    uint32_t generation_ = 0;
+};
+
+// Decodes base64 keyframes, returns false if the data is not a whole number of valid frames
+bool DecodeKeyframes(const std::string& base64, std::vector<OttoKeyframe>& frames);
+
+// Plays the ring with a Catmull-Rom spline through the keyframes, starting from the current servo
+// positions. Frames streamed in while playing are joined into the same motion, and a Replace()
+// cuts the current segment short; returns once the ring has stayed empty for a short gap.
+void PlayKeyframes(Otto& otto, KeyframeRing& ring);
+
+#endif  // __OTTO_KEYFRAMES_H__
@@ -49,6 +49,9 @@ public:
     //-- Predetermined Motion Functions
     void MoveServos(int time, int servo_target[]);
     void MoveSingle(int position, int servo_number);
+    //-- 同时设置所有舵机位置，-1 表示保持不变，所有通道在同一个 PWM 周期生效
+    void SetServoPositions(const int position[SERVO_COUNT]);
+    int GetServoPosition(int servo_number);
     void OscillateServos(int amplitude[SERVO_COUNT], int offset[SERVO_COUNT], int period,
                          double phase_diff[SERVO_COUNT], float cycle);
     void Execute2(int amplitude[SERVO_COUNT], int center_angle[SERVO_COUNT], int period,
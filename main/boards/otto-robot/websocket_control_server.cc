@@ -6,9 +6,13 @@
 #include <cstring>
 #include <cstdlib>
 #include <map>
+#include <algorithm>
 
 static const char* TAG = "WSControl";
 
+extern void SetOttoLiveTarget(const OttoKeyframe& target);
+extern void HoldOttoPosition();
+
 WebSocketControlServer* WebSocketControlServer::instance_ = nullptr;
 
 WebSocketControlServer::WebSocketControlServer() : server_handle_(nullptr) {
@@ -32,9 +36,7 @@ esp_err_t WebSocketControlServer::ws_handler(httpd_req_t *req) {
     }
     
     httpd_ws_frame_t ws_pkt;
-    uint8_t *buf = NULL;
     memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-    ws_pkt.type = HTTPD_WS_TYPE_TEXT;
     
     /* Set max_len = 0 to get the frame len */
     esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, 0);
@@ -42,48 +44,76 @@ esp_err_t WebSocketControlServer::ws_handler(httpd_req_t *req) {
         ESP_LOGE(TAG, "httpd_ws_recv_frame failed to get frame len with %d", ret);
         return ret;
     }
-    ESP_LOGI(TAG, "frame len is %d", ws_pkt.len);
+    ESP_LOGD(TAG, "frame type %d len %d", ws_pkt.type, ws_pkt.len);
+
+    if (ws_pkt.len > WS_CONTROL_MAX_TEXT_LEN) {
+        ESP_LOGE(TAG, "Message too long: %zu bytes", ws_pkt.len);
+        return ESP_FAIL;
+    }
     
+    auto& buf = instance_->rx_buffer_;
     if (ws_pkt.len) {
-        /* ws_pkt.len + 1 is for NULL termination as we are expecting a string */
-        buf = (uint8_t*)calloc(1, ws_pkt.len + 1);
-        if (buf == NULL) {
-            ESP_LOGE(TAG, "Failed to calloc memory for buf");
-            return ESP_ERR_NO_MEM;
+        /* One more byte for the NULL termination of text frames, the buffer only ever grows */
+        if (buf.size() < ws_pkt.len + 1) {
+            buf.resize(ws_pkt.len + 1);
         }
-        ws_pkt.payload = buf;
+        ws_pkt.payload = buf.data();
         /* Set max_len = ws_pkt.len to get the frame payload */
         ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
         if (ret != ESP_OK) {
             ESP_LOGE(TAG, "httpd_ws_recv_frame failed with %d", ret);
-            free(buf);
             return ret;
         }
-        ESP_LOGI(TAG, "Got packet with message: %s", ws_pkt.payload);
     }
     
-    ESP_LOGI(TAG, "Packet type: %d", ws_pkt.type);
-    
     if (ws_pkt.type == HTTPD_WS_TYPE_CLOSE) {
         ESP_LOGI(TAG, "WebSocket close frame received");
         instance_->RemoveClient(req);
-        free(buf);
         return ESP_OK;
     }
     
-    if (ws_pkt.type == HTTPD_WS_TYPE_TEXT) {
-        if (ws_pkt.len > 0 && buf != nullptr) {
+    if (ws_pkt.type == HTTPD_WS_TYPE_BINARY) {
+        instance_->HandleBinaryFrame(ws_pkt.payload, ws_pkt.len);
+    } else if (ws_pkt.type == HTTPD_WS_TYPE_TEXT) {
+        if (ws_pkt.len > 0) {
             buf[ws_pkt.len] = '\0';
-            instance_->HandleMessage(req, (const char*)buf, ws_pkt.len);
+            instance_->HandleMessage(req, (const char*)buf.data(), ws_pkt.len);
         }
     } else {
         ESP_LOGW(TAG, "Unsupported frame type: %d", ws_pkt.type);
     }
     
-    free(buf);
     return ESP_OK;
 }
 
+void WebSocketControlServer::HandleBinaryFrame(const uint8_t* data, size_t len) {
+    if (data == nullptr || len != sizeof(WsControlFrame)) {
+        ESP_LOGW(TAG, "Invalid control frame length: %zu", len);
+        return;
+    }
+
+    WsControlFrame frame;
+    memcpy(&frame, data, sizeof(frame));
+    switch (frame.command) {
+        case WS_CONTROL_TARGET:
+            for (int i = 0; i < SERVO_COUNT; i++) {
+                if (frame.target.position[i] > 180 && frame.target.position[i] != KEYFRAME_HOLD) {
+                    ESP_LOGW(TAG, "Invalid target for servo %d: %d", i, frame.target.position[i]);
+                    return;
+                }
+            }
+            frame.target.duration_ms = std::min<uint16_t>(frame.target.duration_ms, KEYFRAME_MAX_DURATION_MS);
+            SetOttoLiveTarget(frame.target);
+            break;
+        case WS_CONTROL_HOLD:
+            HoldOttoPosition();
+            break;
+        default:
+            ESP_LOGW(TAG, "Unknown control command: %d", frame.command);
+            break;
+    }
+}
+
 bool WebSocketControlServer::Start(int port) {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.server_port = port;
@@ -122,21 +152,7 @@ void WebSocketControlServer::HandleMessage(httpd_req_t *req, const char* data, s
         return;
     }
     
-    if (len > 4096) {
-        ESP_LOGE(TAG, "Message too long: %zu bytes", len);
-        return;
-    }
-    
-    char* temp_buf = (char*)malloc(len + 1);
-    if (temp_buf == nullptr) {
-        ESP_LOGE(TAG, "Failed to allocate memory");
-        return;
-    }
-    memcpy(temp_buf, data, len);
-    temp_buf[len] = '\0';
-    
-    cJSON* root = cJSON_Parse(temp_buf);
-    free(temp_buf);
+    cJSON* root = cJSON_ParseWithLength(data, len);
     
     if (root == nullptr) {
         ESP_LOGE(TAG, "Failed to parse JSON");
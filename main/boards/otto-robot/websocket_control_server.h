@@ -5,6 +5,22 @@
 #include <cJSON.h>
 #include <string>
 #include <map>
+#include <vector>
+
+#include "otto_keyframes.h"
+
+// 二进制控制帧的命令字
+#define WS_CONTROL_TARGET 0x01  // 实时目标：只保留最新一帧，旧目标直接丢弃
+#define WS_CONTROL_HOLD 0x02    // 丢弃未播放的目标，停在当前位置
+#define WS_CONTROL_MAX_TEXT_LEN 4096
+
+// 二进制模式下每条消息都是一个定长帧，摇杆类的高频控制不再经过 JSON 和 MCP
+struct __attribute__((packed)) WsControlFrame {
+    uint8_t command;
+    uint8_t reserved;
+    OttoKeyframe target;
+};
+static_assert(sizeof(WsControlFrame) == 10, "WsControlFrame must stay 10 bytes on the wire");
 
 class WebSocketControlServer {
 public:
@@ -20,10 +36,13 @@ public:
 private:
     httpd_handle_t server_handle_;
     std::map<int, httpd_req_t*> clients_;
+    // 所有连接都在 httpd 任务中读取，共用一个接收缓冲区
+    std::vector<uint8_t> rx_buffer_;
 
     static esp_err_t ws_handler(httpd_req_t *req);
     
     void HandleMessage(httpd_req_t *req, const char* data, size_t len);
+    void HandleBinaryFrame(const uint8_t* data, size_t len);
     void AddClient(httpd_req_t *req);
     void RemoveClient(httpd_req_t *req);
     static WebSocketControlServer* instance_;
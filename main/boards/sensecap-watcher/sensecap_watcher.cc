@@ -10,6 +10,7 @@
 #include "power_save_timer.h"
 #include "sscma_camera.h"
 #include "lvgl_theme.h"
+#include "settings.h"
 
 #include <esp_log.h>
 #include <esp_check.h>
@@ -210,10 +211,10 @@ private:
         assert(ret == ESP_OK);
     }
 
-    void OnKnobRotate(bool clockwise) {
+    void OnKnobRotate(int steps) {
         auto codec = GetAudioCodec();
         int current_volume = codec->output_volume();
-        int new_volume = current_volume + (clockwise ? -5 : 5); 
+        int new_volume = current_volume - steps * 5;
 
         // 确保音量在有效范围内
         if (new_volume > 100) {
@@ -238,9 +239,9 @@ private:
 
     void InitializeKnob() {
         knob_ = std::make_unique<Knob>(BSP_KNOB_A_PIN, BSP_KNOB_B_PIN);
-        knob_->OnRotate([this](bool clockwise) {
-            ESP_LOGD(TAG, "Knob rotation detected. Clockwise:%s", clockwise ? "true" : "false");
-            OnKnobRotate(clockwise);
+        knob_->OnRotateSteps([this](int steps) {
+            ESP_LOGD(TAG, "Knob rotation detected. Steps:%d", steps);
+            OnKnobRotate(steps);
         });
         ESP_LOGI(TAG, "Knob initialized with pins A:%d B:%d", BSP_KNOB_A_PIN, BSP_KNOB_B_PIN);
     }
@@ -297,6 +298,7 @@ private:
             // 长按10s 恢复出厂设置: 2+0.02*400 = 10
             if (self->long_press_cnt_ > 400) {
                 ESP_LOGI(TAG, "Factory reset");
+                Settings::Discard();
                 nvs_flash_erase();
                 esp_restart();
             }
@@ -489,6 +491,7 @@ private:
             .func = NULL,
             .argtable = NULL,
             .func_w_context = [](void *context,int argc, char** argv) -> int {
+                Settings::Discard();
                 nvs_flash_erase();
                 esp_restart();
                 return 0;
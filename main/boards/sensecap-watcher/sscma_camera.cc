@@ -1,9 +1,9 @@
 #include "sscma_camera.h"
+#include "explain_upload.h"
 #include "mcp_server.h"
 #include "lvgl_display.h"
 #include "lvgl_image.h"
 #include "board.h"
-#include "system_info.h"
 #include "config.h"
 #include "settings.h"
 
@@ -15,7 +15,8 @@
 
 #define TAG "SscmaCamera"
 
-#define IMG_JPEG_BUF_SIZE   48 * 1024
+// 图像最长等待时间，数据一到即返回，无需固定延时
+#define CAPTURE_TIMEOUT_MS  1500
 
 static bool __himax_keepalive_check(sscma_client_handle_t client)
 {
@@ -107,8 +108,12 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
                 // 定期更新检测配置参数，避免频繁NVS访问
                 int64_t cur_tm = esp_timer_get_time();
 
+                std::vector<SscmaDetection> detections;
                 // 尝试获取检测框数据（目标检测模型）
                 if (sscma_utils_fetch_boxes_from_reply(reply, &boxes, &box_count) == ESP_OK && box_count > 0) {
+                    for (int i = 0; i < box_count; i++) {
+                        detections.push_back({boxes[i].target, boxes[i].score, boxes[i].x, boxes[i].y, boxes[i].w, boxes[i].h});
+                    }
                     for (int i = 0; i < box_count; i++) {
                         ESP_LOGI(TAG, "[box %d]: x=%d, y=%d, w=%d, h=%d, score=%d, target=%d", i,  \
                                 boxes[i].x, boxes[i].y, boxes[i].w, boxes[i].h, boxes[i].score, boxes[i].target);
@@ -125,6 +130,7 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
                     for (int i = 0; i < class_count; i++) {
                         ESP_LOGI(TAG, "[class %d]: target=%d, score=%d", i,
                                 classes[i].target, classes[i].score);
+                        detections.push_back({classes[i].target, classes[i].score, 0, 0, 0, 0});
                         if (classes[i].target == self->detect_target && classes[i].score > self->detect_threshold) {
                            is_object_detected = true;
                            model_type = 1;
@@ -137,6 +143,7 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
                     for (int i = 0; i < point_count; i++) {
                         ESP_LOGI(TAG, "[point %d]: x=%d, y=%d, z=%d, score=%d, target=%d", i, 
                                 points[i].x, points[i].y, points[i].z, points[i].score, points[i].target);
+                        detections.push_back({points[i].target, points[i].score, points[i].x, points[i].y, 0, 0});
                         if (points[i].target == self->detect_target && points[i].score > self->detect_threshold) {
                            is_object_detected = true;
                            model_type = 2;
@@ -146,6 +153,13 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
                     free(points);
                 }
 
+                // 推理结果持续写入缓存，查询检测结果时无需等待新的推理
+                {
+                    std::lock_guard<std::mutex> lock(self->detections_mutex_);
+                    self->detections_ = std::move(detections);
+                    self->detections_time_us_ = cur_tm;
+                }
+
                 // 如果需要开始冷却期，现在开始计时
                 if (self->need_start_cooldown) { // 回调暂停，标志保持，等待回调恢复后开始计时
                     self->state_start_time = cur_tm;
@@ -291,14 +305,6 @@ SscmaCamera::SscmaCamera(esp_io_expander_handle_t io_exp_handle) {
             info->id ? info->id : "NULL", 
             info->name ? info->name : "NULL");
     }
-    // 初始化JPEG数据的内存
-    jpeg_data_.len = 0;
-    jpeg_data_.buf = (uint8_t*)heap_caps_malloc(IMG_JPEG_BUF_SIZE, MALLOC_CAP_SPIRAM);;
-    if ( jpeg_data_.buf == nullptr ) {
-        ESP_LOGE(TAG, "Failed to allocate memory for JPEG buffer");
-        return;
-    }
-
     //初始化JPEG解码
     jpeg_error_t err;
     jpeg_dec_config_t config = { .output_type = JPEG_PIXEL_FORMAT_RGB565_LE, .rotate = JPEG_ROTATE_0D };
@@ -487,56 +493,75 @@ void SscmaCamera::InitializeMcpTools() {
         }),
         [this](const PropertyList& properties) -> ReturnValue {
             Settings settings("model", true);
-            try {
-                const Property& threshold_prop = properties["threshold"];
-                int threshold = threshold_prop.value<int>();
-                if (threshold != -1) {
-                    settings.SetInt("threshold", threshold);
-                    this->detect_threshold = threshold;
-                    ESP_LOGI(TAG, "Set detection threshold to %d", threshold);
-                }
-            } catch (const std::runtime_error&) {
-                // threshold parameter not provided, skip
+            const Property& threshold_prop = properties["threshold"];
+            int threshold = threshold_prop.value<int>();
+            if (threshold != -1) {
+                settings.SetInt("threshold", threshold);
+                this->detect_threshold = threshold;
+                ESP_LOGI(TAG, "Set detection threshold to %d", threshold);
             }
             
-            try {
-                const Property& interval_prop = properties["interval"];
-                int interval = interval_prop.value<int>();
-                if (interval != -1) {
-                    settings.SetInt("interval", interval);
-                    this->detect_invoke_interval_sec = interval;
-                    ESP_LOGI(TAG, "Set detection interval to %d", interval);
-                }
-            } catch (const std::runtime_error&) {
-                // interval parameter not provided, skip
+            const Property& interval_prop = properties["interval"];
+            int interval = interval_prop.value<int>();
+            if (interval != -1) {
+                settings.SetInt("interval", interval);
+                this->detect_invoke_interval_sec = interval;
+                ESP_LOGI(TAG, "Set detection interval to %d", interval);
             }
             
-            try {
-                const Property& duration_prop = properties["duration"];
-                int duration = duration_prop.value<int>();
-                if (duration != -1) {
-                    settings.SetInt("duration", duration);
-                    this->detect_duration_sec = duration;
-                }
-            } catch (const std::runtime_error&) {
-                // duration parameter not provided, skip
+            const Property& duration_prop = properties["duration"];
+            int duration = duration_prop.value<int>();
+            if (duration != -1) {
+                settings.SetInt("duration", duration);
+                this->detect_duration_sec = duration;
             }
             
-            try {
-                const Property& target_prop = properties["target"];
-                int target = target_prop.value<int>();
-                if (target != -1) {
-                    settings.SetInt("target", target);
-                    this->detect_target = target;
-                    ESP_LOGI(TAG, "Set detection target to %d", target);
-                }
-            } catch (const std::runtime_error&) {
-                // target_type parameter not provided, skip
+            const Property& target_prop = properties["target"];
+            int target = target_prop.value<int>();
+            if (target != -1) {
+                settings.SetInt("target", target);
+                this->detect_target = target;
+                ESP_LOGI(TAG, "Set detection target to %d", target);
             }
 
             return "{\"status\": \"success\", \"message\": \"Detection configuration updated\"}";
         });
 
+    // 读取缓存的最新推理结果
+    mcp_server.AddTool("self.model.get_detections",
+        "获取视觉模型最近一次的推理结果，无需拍照。推理开启时可用于快速回答'有没有人'之类的问题。\n"
+        "返回结果包含：\n"
+        "  `age_ms`: 结果距今的毫秒数，-1 表示尚无结果；\n"
+        "  `detections`: 检测到的目标列表，包含名称 `target`、置信度 `score` 以及位置 `x` `y` `w` `h`。",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            std::lock_guard<std::mutex> lock(detections_mutex_);
+            auto root = cJSON_CreateObject();
+            int64_t age_ms = detections_time_us_ > 0 ? (esp_timer_get_time() - detections_time_us_) / 1000 : -1;
+            cJSON_AddNumberToObject(root, "age_ms", age_ms);
+            auto list = cJSON_AddArrayToObject(root, "detections");
+            for (auto& d : detections_) {
+                auto item = cJSON_CreateObject();
+                const char* name = (model != NULL && d.target >= 0 && d.target < model_class_cnt) ? model->classes[d.target] : NULL;
+                if (name != NULL) {
+                    cJSON_AddStringToObject(item, "target", name);
+                } else {
+                    cJSON_AddNumberToObject(item, "target", d.target);
+                }
+                cJSON_AddNumberToObject(item, "score", d.score);
+                cJSON_AddNumberToObject(item, "x", d.x);
+                cJSON_AddNumberToObject(item, "y", d.y);
+                cJSON_AddNumberToObject(item, "w", d.w);
+                cJSON_AddNumberToObject(item, "h", d.h);
+                cJSON_AddItemToArray(list, item);
+            }
+            auto json = cJSON_PrintUnformatted(root);
+            std::string result(json);
+            cJSON_free(json);
+            cJSON_Delete(root);
+            return result;
+        });
+
     // 推理开关获取
     mcp_server.AddTool("self.model.enable",
         "控制视觉推理(摄像头检测)功能的开启与关闭，或查询当前状态。\n"
@@ -548,15 +573,11 @@ void SscmaCamera::InitializeMcpTools() {
         }),
         [this](const PropertyList& properties) -> ReturnValue {
             Settings settings("model", true);
-            try {
-                const Property& enable_prop = properties["enable"];
-                int en = enable_prop.value<int>();
-                settings.SetInt("enable", en);
-                this->inference_en = en;
-                ESP_LOGI(TAG, "Set inference enable to %d", en);
-            } catch (const std::runtime_error&) {
-                // enable not provided -> treat as query
-            }
+            const Property& enable_prop = properties["enable"];
+            int en = enable_prop.value<int>();
+            settings.SetInt("enable", en);
+            this->inference_en = en;
+            ESP_LOGI(TAG, "Set inference enable to %d", en);
             // 返回当前配置
             int cur_en = settings.GetInt("enable", this->inference_en);
             return std::string("{\"enable\":") + std::to_string(cur_en) + "}";
@@ -588,24 +609,24 @@ bool SscmaCamera::Capture() {
         ESP_LOGE(TAG, "Failed to capture image from SSCMA client");
         return false;
     }
-    vTaskDelay(pdMS_TO_TICKS(500)); // 等待SSCMA客户端处理数据
-    if (xQueueReceive(sscma_data_queue_, &data, pdMS_TO_TICKS(1000)) != pdPASS) {
+    if (xQueueReceive(sscma_data_queue_, &data, pdMS_TO_TICKS(CAPTURE_TIMEOUT_MS)) != pdPASS) {
         ESP_LOGE(TAG, "Failed to receive JPEG data from SSCMA client");
         return false;
     }
 
-    if (jpeg_data_.buf == nullptr) {
+    // base64 原地解码：每读 4 个字符才写出 3 个字节，写指针始终落后于读指针
+    size_t jpeg_len = 0;
+    ret = mbedtls_base64_decode(data.img, data.len, &jpeg_len, data.img, data.len);
+    if (ret != 0 || jpeg_len == 0) {
+        ESP_LOGE(TAG, "Failed to decode base64 image data, ret: %d, output_len: %zu", ret, jpeg_len);
         heap_caps_free(data.img);
         return false;
     }
-
-    ret = mbedtls_base64_decode(jpeg_data_.buf, IMG_JPEG_BUF_SIZE, &jpeg_data_.len, data.img, data.len);
-    if (ret != 0 || jpeg_data_.len == 0) {
-        ESP_LOGE(TAG, "Failed to decode base64 image data, ret: %d, output_len: %zu", ret, jpeg_data_.len);
-        heap_caps_free(data.img);
-        return false;
+    if (jpeg_data_.buf) {
+        heap_caps_free(jpeg_data_.buf);
     }
-    heap_caps_free(data.img);
+    jpeg_data_.buf = data.img;
+    jpeg_data_.len = jpeg_len;
 
     //DECODE JPEG
     if (!jpeg_dec_ || !jpeg_io_ || !jpeg_out_ || !preview_image_.data) {
@@ -665,79 +686,27 @@ bool SscmaCamera::SetVFlip(bool enabled) {
  * 问题对图像进行AI分析并返回结果。
  * 
  * @param question 要向AI提出的关于图像的问题，将作为表单字段发送
- * @return std::string 服务器返回的JSON格式响应字符串
- *         成功时包含AI分析结果，失败时包含错误信息
- *         格式示例：{"success": true, "result": "分析结果"}
- *                  {"success": false, "message": "错误信息"}
+ * @param result 成功时为服务器返回的JSON格式响应字符串，失败时为错误信息
+ * @return bool 服务器正常返回时为true
  * 
  * @note 调用此函数前必须先调用SetExplainUrl()设置服务器URL
  * @note 函数会等待之前的编码线程完成后再开始新的处理
- * @warning 如果摄像头缓冲区为空或网络连接失败，将返回错误信息
+ * @warning 如果摄像头缓冲区为空或网络连接失败，将返回false
  */
-std::string SscmaCamera::Explain(const std::string& question) {
+bool SscmaCamera::Explain(const std::string& question, std::string& result) {
     if (explain_url_.empty()) {
-        return "{\"success\": false, \"message\": \"Image explain URL or token is not set\"}";
-    }
-
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(3);
-    // 构造multipart/form-data请求体
-    std::string boundary = "----ESP32_CAMERA_BOUNDARY";
-    
-    // 构造question字段
-    std::string question_field;
-    question_field += "--" + boundary + "\r\n";
-    question_field += "Content-Disposition: form-data; name=\"question\"\r\n";
-    question_field += "\r\n";
-    question_field += question + "\r\n";
-    
-    // 构造文件字段头部
-    std::string file_header;
-    file_header += "--" + boundary + "\r\n";
-    file_header += "Content-Disposition: form-data; name=\"file\"; filename=\"camera.jpg\"\r\n";
-    file_header += "Content-Type: image/jpeg\r\n";
-    file_header += "\r\n";
-    
-    // 构造尾部
-    std::string multipart_footer;
-    multipart_footer += "\r\n--" + boundary + "--\r\n";
-
-    // 配置HTTP客户端，使用分块传输编码
-    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
-    http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
-    if (!explain_token_.empty()) {
-        http->SetHeader("Authorization", "Bearer " + explain_token_);
+        result = "Image explain URL or token is not set";
+        return false;
     }
-    http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
-    http->SetHeader("Transfer-Encoding", "chunked");
-    if (!http->Open("POST", explain_url_)) {
-        ESP_LOGE(TAG, "Failed to connect to explain URL");
-        return "{\"success\": false, \"message\": \"Failed to connect to explain URL\"}";
+    if (jpeg_data_.buf == nullptr) {
+        result = "No camera frame captured";
+        return false;
     }
-    
-    // 第一块：question字段
-    http->Write(question_field.c_str(), question_field.size());
-    
-    // 第二块：文件字段头部
-    http->Write(file_header.c_str(), file_header.size());
-    
-    // 第三块：JPEG数据
-    http->Write((const char*)jpeg_data_.buf, jpeg_data_.len);
 
-    // 第四块：multipart尾部
-    http->Write(multipart_footer.c_str(), multipart_footer.size());
-    
-    // 结束块
-    http->Write("", 0);
-
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
-        return "{\"success\": false, \"message\": \"Failed to upload photo\"}";
+    if (!PostExplainRequest(explain_url_, explain_token_, question, jpeg_data_.buf, jpeg_data_.len, result)) {
+        return false;
     }
 
-    std::string result = http->ReadAll();
-    http->Close();
-
     ESP_LOGI(TAG, "Explain image size=%d, question=%s\n%s", jpeg_data_.len, question.c_str(), result.c_str());
-    return result;
+    return true;
 }
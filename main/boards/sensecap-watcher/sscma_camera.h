@@ -5,6 +5,8 @@
 #include <lvgl.h>
 #include <thread>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
@@ -20,8 +22,13 @@ struct SscmaData {
     size_t len;
 };
 struct JpegData {
-    uint8_t* buf;
-    size_t len;
+    uint8_t* buf = nullptr;     // 原地解码后的 base64 缓冲区
+    size_t len = 0;
+};
+struct SscmaDetection {
+    int target;
+    int score;
+    int x, y, w, h;
 };
 
 class SscmaCamera : public Camera {
@@ -58,6 +65,11 @@ private:
     
     sscma_client_model_t *model;
     int model_class_cnt = 0;
+
+    // 最近一次推理结果，由 SSCMA 回调持续更新
+    std::mutex detections_mutex_;
+    std::vector<SscmaDetection> detections_;
+    int64_t detections_time_us_ = 0;
 public:
     SscmaCamera(esp_io_expander_handle_t io_exp_handle);
     ~SscmaCamera();
@@ -68,7 +80,7 @@ public:
     // 翻转控制函数
     virtual bool SetHMirror(bool enabled) override;
     virtual bool SetVFlip(bool enabled) override;
-    virtual std::string Explain(const std::string& question);
+    virtual bool Explain(const std::string& question, std::string& result);
 
 };
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include "esp_lcd_jd9853.h"
+#include "lcd_init_sequence.h"
 /*
  * SPDX-FileCopyrightText: 2022-2023 Espressif Systems (Shanghai) CO LTD
  *
@@ -21,6 +22,8 @@
 
 static const char *TAG = "JD9853";
 
+_Static_assert(sizeof(jd9853_lcd_init_cmd_t) == sizeof(lcd_init_sequence_cmd_t), "init command layout differs");
+
 static esp_err_t panel_jd9853_del(esp_lcd_panel_t *panel);
 static esp_err_t panel_jd9853_reset(esp_lcd_panel_t *panel);
 static esp_err_t panel_jd9853_init(esp_lcd_panel_t *panel);
@@ -328,10 +331,8 @@ static esp_err_t panel_jd9853_init(esp_lcd_panel_t *panel)
         {
             ESP_LOGW(TAG, "The %02Xh command has been used and will be overwritten by external initialization sequence", init_cmds[i].cmd);
         }
-
-        ESP_RETURN_ON_ERROR(esp_lcd_panel_io_tx_param(io, init_cmds[i].cmd, init_cmds[i].data, init_cmds[i].data_bytes), TAG, "send command failed");
-        vTaskDelay(pdMS_TO_TICKS(init_cmds[i].delay_ms));
     }
+    ESP_RETURN_ON_ERROR(lcd_init_sequence_run(io, (const lcd_init_sequence_cmd_t *)init_cmds, init_cmds_size, TAG), TAG, "send init commands failed");
     ESP_LOGD(TAG, "send init commands success");
 
     return ESP_OK;
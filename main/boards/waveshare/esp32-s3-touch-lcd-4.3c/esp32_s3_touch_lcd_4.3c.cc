@@ -156,7 +156,9 @@ private:
             .x_max = BSP_LCD_H_RES - 1,
             .y_max = BSP_LCD_V_RES - 1,
             .rst_gpio_num = GPIO_NUM_NC,
-            .int_gpio_num = GPIO_NUM_NC,
+            // Past the address strap in InitializeCustomio(), INT tells when there are touches, so
+            // the LVGL input is read on demand rather than on every LVGL tick
+            .int_gpio_num = BSP_LCD_TOUCH_INT,
             .levels = {
                 .reset = 0,
                 .interrupt = 0,
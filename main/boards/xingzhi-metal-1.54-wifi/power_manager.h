@@ -11,6 +11,7 @@
 #include "config.h"
 #include "assets/lang_config.h"
 #include <esp_sleep.h>
+#include "settings.h"
 
 class PowerManager {
 private:
@@ -306,6 +307,7 @@ public:
                 ESP_LOGI("PowerManager","触发开关机控制");
             }
             ESP_LOGI("PowerManager","关机失败，进入深睡眠");
+            Settings::Flush();
             esp_deep_sleep_start();
         } else {
             ESP_LOGI("PowerManager","检测到插入usb，无法关机"); 
@@ -49,13 +49,18 @@ private:
             // Show the standby screen
             GetDisplay()->SetPowerSaveMode(true);
             // Enable sleep mode, and sleep in 1 second after DTR is set to high
-            modem_->SetSleepMode(true, 1);
-            // Set the DTR pin to high to make the modem enter sleep mode
-            modem_->GetAtUart()->SetDtrPin(true);
+            // In PPP mode the modem has no AT socket driver and stays awake
+            if (modem_ != nullptr) {
+                modem_->SetSleepMode(true, 1);
+                // Set the DTR pin to high to make the modem enter sleep mode
+                modem_->GetAtUart()->SetDtrPin(true);
+            }
         });
         sleep_timer_->OnExitLightSleepMode([this]() {
             // Set the DTR pin to low to make the modem wake up
-            modem_->GetAtUart()->SetDtrPin(false);
+            if (modem_ != nullptr) {
+                modem_->GetAtUart()->SetDtrPin(false);
+            }
             // Hide the standby screen
             GetDisplay()->SetPowerSaveMode(false);
         });
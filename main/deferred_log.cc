@@ -0,0 +1,304 @@
+#include "deferred_log.h"
+
+#if CONFIG_USE_DEFERRED_LOG
+#include "task_factory.h"
+
+#include <esp_attr.h>
+#include <esp_app_desc.h>
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#endif
+
+#define TAG "DeferredLog"
+
+#if CONFIG_USE_DEFERRED_LOG
+
+// Messages of one call site printed per second before the rest are dropped
+#define DEFERRED_LOG_BURST_WINDOW_MS 1000
+#define DEFERRED_LOG_LINE_BYTES 256
+
+// Bounded MPSC ring: a slot is free for ticket n while its sequence is n, and holds the record of
+// ticket n once its sequence is n + 1. The print task hands it back with n + size.
+struct DeferredLogSlot {
+    std::atomic<uint32_t> sequence;
+    DeferredLogRecord record;
+};
+
+static_assert((CONFIG_DEFERRED_LOG_ENTRIES & (CONFIG_DEFERRED_LOG_ENTRIES - 1)) == 0,
+    "CONFIG_DEFERRED_LOG_ENTRIES must be a power of two");
+
+static DeferredLogSlot slots_[CONFIG_DEFERRED_LOG_ENTRIES];
+static std::atomic<uint32_t> head_{0};
+static uint32_t tail_ = 0;
+static std::atomic<uint32_t> dropped_{0};
+static std::atomic<TaskHandle_t> task_{nullptr};
+
+static struct SlotInit {
+    SlotInit() {
+        for (uint32_t i = 0; i < CONFIG_DEFERRED_LOG_ENTRIES; i++) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+} slot_init_;
+
+#if CONFIG_DEFERRED_LOG_RTC_HISTORY
+#define DEFERRED_LOG_RTC_MAGIC 0x444C4F47
+
+// Plain copies of the last records printed, RTC memory keeps them over a crash and a reset
+struct DeferredLogHistory {
+    uint32_t magic;
+    uint8_t elf_sha256[8];
+    uint32_t count;
+    uint32_t head;
+    DeferredLogRecord records[CONFIG_DEFERRED_LOG_RTC_ENTRIES];
+};
+
+RTC_NOINIT_ATTR static DeferredLogHistory history_;
+#endif
+
+bool DeferredLog::Admit(DeferredLogSite& site, uint32_t& suppressed) {
+    uint32_t now = esp_log_timestamp();
+    uint32_t window = site.window_ms.load(std::memory_order_relaxed);
+    if (now - window >= DEFERRED_LOG_BURST_WINDOW_MS &&
+        site.window_ms.compare_exchange_strong(window, now, std::memory_order_relaxed)) {
+        site.count.store(0, std::memory_order_relaxed);
+    }
+    if (site.count.fetch_add(1, std::memory_order_relaxed) >= CONFIG_DEFERRED_LOG_BURST) {
+        site.suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+void DeferredLog::Push(const DeferredLogRecord& record) {
+    uint32_t ticket = head_.load(std::memory_order_relaxed);
+    DeferredLogSlot* slot;
+    while (true) {
+        slot = &slots_[ticket & (CONFIG_DEFERRED_LOG_ENTRIES - 1)];
+        int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire) - ticket);
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full, the print task has not caught up
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            ticket = head_.load(std::memory_order_relaxed);
+        }
+    }
+    // Only the bytes in use are copied
+    memcpy(&slot->record, &record, offsetof(DeferredLogRecord, strings) + record.string_bytes);
+    slot->sequence.store(ticket + 1, std::memory_order_release);
+
+    TaskHandle_t task = task_.load(std::memory_order_acquire);
+    if (task != nullptr) {
+        xTaskNotifyGive(task);
+    }
+}
+
+// Formats the record the way vsnprintf would have, one conversion at a time
+static void FormatRecord(const DeferredLogRecord& record, char* line, size_t size) {
+    size_t length = 0;
+    int arg = 0;
+    auto append = [&](int written) {
+        if (written > 0) {
+            length = std::min(length + written, size - 1);
+        }
+    };
+
+    for (const char* p = record.format; *p != '\0' && length < size - 1; p++) {
+        if (*p != '%') {
+            line[length++] = *p;
+            continue;
+        }
+        if (p[1] == '%') {
+            line[length++] = '%';
+            p++;
+            continue;
+        }
+        // Flags, width and precision are kept, the length modifier is replaced to match the stored type
+        char spec[24] = "%";
+        size_t spec_length = 1;
+        const char* q = p + 1;
+        while (*q != '\0' && strchr("-+ #0123456789.*", *q) != nullptr) {
+            if (*q == '*') {
+                int value = arg < record.arg_count ? (int)record.args[arg++] : 0;
+                spec_length += snprintf(spec + spec_length, sizeof(spec) - spec_length, "%d", value);
+            } else if (spec_length < sizeof(spec) - 4) {
+                spec[spec_length++] = *q;
+            }
+            q++;
+        }
+        while (*q != '\0' && strchr("hlLqjzt", *q) != nullptr) {
+            q++;
+        }
+        char conversion = *q;
+        if (conversion == '\0') {
+            break;
+        }
+        p = q;
+        if (arg >= record.arg_count) {
+            continue;
+        }
+        uint8_t type = record.types[arg];
+        uint64_t value = record.args[arg++];
+        char* out = line + length;
+        size_t room = size - length;
+
+        switch (conversion) {
+        case 'd':
+        case 'i':
+            strcpy(spec + spec_length, "lld");
+            append(snprintf(out, room, spec,
+                type == kDeferredLogInt ? (long long)(int32_t)value : (long long)value));
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            spec[spec_length] = 'l';
+            spec[spec_length + 1] = 'l';
+            spec[spec_length + 2] = conversion;
+            spec[spec_length + 3] = '\0';
+            append(snprintf(out, room, spec,
+                type == kDeferredLogInt ? (unsigned long long)(uint32_t)value : (unsigned long long)value));
+            break;
+        case 'c':
+            strcpy(spec + spec_length, "c");
+            append(snprintf(out, room, spec, (int)value));
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            spec[spec_length] = conversion;
+            spec[spec_length + 1] = '\0';
+            append(snprintf(out, room, spec, d));
+            break;
+        }
+        case 's':
+            strcpy(spec + spec_length, "s");
+            append(snprintf(out, room, spec, type == kDeferredLogString ? record.strings + value : "(null)"));
+            break;
+        case 'p':
+            strcpy(spec + spec_length, "p");
+            append(snprintf(out, room, spec, (void*)(uintptr_t)value));
+            break;
+        default:
+            break;
+        }
+    }
+    line[length] = '\0';
+}
+
+static void PrintRecord(const DeferredLogRecord& record, const char* prefix) {
+    static const char kLetters[] = {'N', 'E', 'W', 'I', 'D', 'V'};
+    char line[DEFERRED_LOG_LINE_BYTES];
+    FormatRecord(record, line, sizeof(line));
+    esp_log_level_t level = (esp_log_level_t)record.level;
+    char letter = record.level < sizeof(kLetters) ? kLetters[record.level] : '?';
+    if (record.suppressed > 0) {
+        esp_log_write(level, record.tag, "%s%c (%lu) %s: %s (%u similar dropped before)\n", prefix, letter,
+            (unsigned long)record.time_ms, record.tag, line, (unsigned)record.suppressed);
+    } else {
+        esp_log_write(level, record.tag, "%s%c (%lu) %s: %s\n", prefix, letter, (unsigned long)record.time_ms,
+            record.tag, line);
+    }
+}
+
+#if CONFIG_DEFERRED_LOG_RTC_HISTORY
+static void PrintHistory() {
+    const uint8_t* elf_sha256 = esp_app_get_description()->app_elf_sha256;
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool crashed = reason == ESP_RST_PANIC || reason == ESP_RST_INT_WDT || reason == ESP_RST_TASK_WDT ||
+        reason == ESP_RST_WDT || reason == ESP_RST_BROWNOUT;
+    // The records point into the flash of the image that wrote them
+    if (crashed && history_.magic == DEFERRED_LOG_RTC_MAGIC && memcmp(history_.elf_sha256, elf_sha256, 8) == 0 &&
+        history_.count <= CONFIG_DEFERRED_LOG_RTC_ENTRIES) {
+        ESP_LOGW(TAG, "Last %lu messages before the reset:", (unsigned long)history_.count);
+        for (uint32_t i = 0; i < history_.count; i++) {
+            uint32_t index = (history_.head + CONFIG_DEFERRED_LOG_RTC_ENTRIES - history_.count + i) %
+                CONFIG_DEFERRED_LOG_RTC_ENTRIES;
+            PrintRecord(history_.records[index], "[previous boot] ");
+        }
+    }
+    history_.magic = DEFERRED_LOG_RTC_MAGIC;
+    memcpy(history_.elf_sha256, elf_sha256, 8);
+    history_.count = 0;
+    history_.head = 0;
+}
+
+static void KeepHistory(const DeferredLogRecord& record) {
+    history_.records[history_.head] = record;
+    history_.head = (history_.head + 1) % CONFIG_DEFERRED_LOG_RTC_ENTRIES;
+    if (history_.count < CONFIG_DEFERRED_LOG_RTC_ENTRIES) {
+        history_.count++;
+    }
+}
+#endif
+
+static void PrintTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (true) {
+            auto& slot = slots_[tail_ & (CONFIG_DEFERRED_LOG_ENTRIES - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+                break;
+            }
+            DeferredLogRecord record = slot.record;
+            slot.sequence.store(tail_ + CONFIG_DEFERRED_LOG_ENTRIES, std::memory_order_release);
+            tail_++;
+#if CONFIG_DEFERRED_LOG_RTC_HISTORY
+            KeepHistory(record);
+#endif
+            PrintRecord(record, "");
+        }
+        uint32_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            ESP_LOGW(TAG, "Ring full, %lu messages dropped", (unsigned long)dropped);
+        }
+    }
+}
+
+void DeferredLog::Start() {
+    if (task_.load() != nullptr) {
+        return;
+    }
+#if CONFIG_DEFERRED_LOG_RTC_HISTORY
+    PrintHistory();
+#endif
+    TaskHandle_t task = TaskFactory::Create("deferred_log", kTaskStackInternal, PrintTask);
+    task_.store(task, std::memory_order_release);
+    // Messages logged before the task was there
+    if (task != nullptr) {
+        xTaskNotifyGive(task);
+    }
+}
+
+#else
+
+void DeferredLog::Start() {
+}
+
+bool DeferredLog::Admit(DeferredLogSite& site, uint32_t& suppressed) {
+    return false;
+}
+
+void DeferredLog::Push(const DeferredLogRecord& record) {
+}
+
+#endif
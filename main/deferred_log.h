@@ -0,0 +1,154 @@
+#ifndef DEFERRED_LOG_H
+#define DEFERRED_LOG_H
+
+#include <esp_log.h>
+#include <sdkconfig.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Arguments kept per entry, and the bytes for the %s strings among them, longer ones are cut
+#define DEFERRED_LOG_MAX_ARGS 6
+#define DEFERRED_LOG_STRING_BYTES 64
+
+enum DeferredLogArgType : uint8_t {
+    kDeferredLogInt,      // 32 bits or less, sign extended
+    kDeferredLogInt64,
+    kDeferredLogDouble,
+    kDeferredLogPointer,
+    kDeferredLogString,   // Offset into the strings of the record
+};
+
+// Everything about one message, written as is into the ring and the RTC history
+struct DeferredLogRecord {
+    const char* tag;
+    const char* format;
+    uint32_t time_ms;     // esp_log_timestamp() when it was logged
+    uint16_t suppressed;  // Messages of the same call site dropped by the burst limit before this one
+    uint8_t level;
+    uint8_t arg_count;
+    uint8_t types[DEFERRED_LOG_MAX_ARGS];
+    uint8_t string_bytes;
+    uint64_t args[DEFERRED_LOG_MAX_ARGS];
+    char strings[DEFERRED_LOG_STRING_BYTES];
+};
+
+// One per call site, counts its messages for the burst limit
+struct DeferredLogSite {
+    std::atomic<uint32_t> window_ms{0};
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> suppressed{0};
+};
+
+/**
+ * DeferredLog - ESP_LOG without the formatting on the calling task
+ *
+ * DLOGE / DLOGW / DLOGI keep the format pointer and the arguments in a lock-free ring, %s strings
+ * copied, and a low priority task formats and prints them later with their original timestamp.
+ * Hot paths such as the audio and network callbacks then never wait for the UART, so a burst of
+ * warnings cannot starve the audio tasks. A call site logging more than CONFIG_DEFERRED_LOG_BURST
+ * messages a second has the rest dropped, the next one printed tells how many. When the ring is
+ * full messages are dropped and counted as well.
+ *
+ * With CONFIG_DEFERRED_LOG_RTC_HISTORY the last records printed are also kept in RTC memory and
+ * printed again on the next boot after a crash, if the firmware is the same.
+ *
+ * Without CONFIG_USE_DEFERRED_LOG the macros are plain ESP_LOGx.
+ */
+class DeferredLog {
+public:
+    // Starts the print task, messages logged before are kept in the ring
+    static void Start();
+
+    template <typename... Args>
+    static void Write(DeferredLogSite& site, esp_log_level_t level, const char* tag, const char* format, Args... args) {
+        static_assert(sizeof...(Args) <= DEFERRED_LOG_MAX_ARGS, "Too many arguments for a deferred log");
+        uint32_t suppressed;
+        if (!Admit(site, suppressed)) {
+            return;
+        }
+        DeferredLogRecord record;
+        record.tag = tag;
+        record.format = format;
+        record.time_ms = esp_log_timestamp();
+        record.suppressed = suppressed > UINT16_MAX ? UINT16_MAX : suppressed;
+        record.level = level;
+        record.arg_count = 0;
+        record.string_bytes = 0;
+        (Pack(record, args), ...);
+        Push(record);
+    }
+
+private:
+    static bool Admit(DeferredLogSite& site, uint32_t& suppressed);
+    static void Push(const DeferredLogRecord& record);
+
+    static inline void PackString(DeferredLogRecord& record, const char* value) {
+        if (value == nullptr) {
+            record.types[record.arg_count] = kDeferredLogPointer;
+            record.args[record.arg_count++] = 0;
+            return;
+        }
+        size_t offset = record.string_bytes;
+        if (offset >= DEFERRED_LOG_STRING_BYTES) {
+            // No room left, the last terminator makes it an empty string
+            record.types[record.arg_count] = kDeferredLogString;
+            record.args[record.arg_count++] = DEFERRED_LOG_STRING_BYTES - 1;
+            return;
+        }
+        size_t length = strnlen(value, DEFERRED_LOG_STRING_BYTES - 1 - offset);
+        memcpy(record.strings + offset, value, length);
+        record.strings[offset + length] = '\0';
+        record.string_bytes = offset + length + 1;
+        record.types[record.arg_count] = kDeferredLogString;
+        record.args[record.arg_count++] = offset;
+    }
+
+    template <typename T>
+    static inline void Pack(DeferredLogRecord& record, T value) {
+        if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>) {
+            PackString(record, value);
+        } else if constexpr (std::is_pointer_v<T>) {
+            record.types[record.arg_count] = kDeferredLogPointer;
+            record.args[record.arg_count++] = (uintptr_t)value;
+        } else if constexpr (std::is_floating_point_v<T>) {
+            double d = value;
+            record.types[record.arg_count] = kDeferredLogDouble;
+            memcpy(&record.args[record.arg_count++], &d, sizeof(d));
+        } else if constexpr (sizeof(T) > 4) {
+            record.types[record.arg_count] = kDeferredLogInt64;
+            record.args[record.arg_count++] = (uint64_t)value;
+        } else {
+            record.types[record.arg_count] = kDeferredLogInt;
+            record.args[record.arg_count++] = (uint64_t)(int64_t)value;
+        }
+    }
+};
+
+// Never called, only there for the compiler to check the format against the arguments
+static inline void DeferredLogCheckFormat(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static inline void DeferredLogCheckFormat(const char* format, ...) {
+}
+
+#if CONFIG_USE_DEFERRED_LOG
+#define DLOG_LEVEL(level, tag, format, ...) do {                                         \
+        if (false) {                                                                    \
+            DeferredLogCheckFormat(format, ##__VA_ARGS__);                              \
+        }                                                                               \
+        if (LOG_LOCAL_LEVEL >= level) {                                                 \
+            static DeferredLogSite dlog_site_;                                          \
+            DeferredLog::Write(dlog_site_, level, tag, format, ##__VA_ARGS__);          \
+        }                                                                               \
+    } while (0)
+#define DLOGE(tag, format, ...) DLOG_LEVEL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...) DLOG_LEVEL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...) DLOG_LEVEL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#else
+#define DLOGE(tag, format, ...) ESP_LOGE(tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...) ESP_LOGW(tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+#endif
+
+#endif // DEFERRED_LOG_H
@@ -1,4 +1,5 @@
 #include "device_state_machine.h"
+#include "trace.h"
 
 #include <algorithm>
 #include <esp_log.h>
@@ -122,6 +123,7 @@ bool DeviceStateMachine::TransitionTo(DeviceState new_state) {
 
     // Perform transition
     current_state_.store(new_state);
+    TRACE_INSTANT(kTracePointDeviceState, new_state);
     ESP_LOGI(TAG, "State: %s -> %s",
              GetStateName(old_state), GetStateName(new_state));
 
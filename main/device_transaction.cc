@@ -0,0 +1,24 @@
+#include "device_transaction.h"
+#include "board.h"
+#include "settings.h"
+
+int DeviceTransaction::depth_ = 0;
+
+DeviceTransaction::DeviceTransaction() {
+    if (depth_++ > 0) {
+        return;
+    }
+    Settings::BeginBatch();
+    auto display = Board::GetInstance().GetDisplay();
+    if (display != nullptr) {
+        display_lock_.emplace(display);
+    }
+}
+
+DeviceTransaction::~DeviceTransaction() {
+    if (--depth_ > 0) {
+        return;
+    }
+    display_lock_.reset();
+    Settings::EndBatch();
+}
@@ -0,0 +1,32 @@
+#ifndef DEVICE_TRANSACTION_H
+#define DEVICE_TRANSACTION_H
+
+#include <optional>
+
+#include "display.h"
+
+/**
+ * DeviceTransaction - Applies a run of device state changes as one
+ *
+ * While the outermost transaction is open the display stays locked, so LVGL draws the result of
+ * all the changes in one refresh after it ends, and Settings holds back its write-back, so they
+ * go to flash in one commit. Inner transactions do nothing. A batch of MCP requests runs its
+ * device control tools (McpServer::SetDeviceControlTool) in one and sends their replies after it
+ * closes, a tool that changes many states itself can open its own.
+ *
+ * Main task only, and the changes must not wait for the LVGL task or the network.
+ */
+class DeviceTransaction {
+public:
+    DeviceTransaction();
+    ~DeviceTransaction();
+
+    DeviceTransaction(const DeviceTransaction&) = delete;
+    DeviceTransaction& operator=(const DeviceTransaction&) = delete;
+
+private:
+    static int depth_;
+    std::optional<DisplayLockGuard> display_lock_;
+};
+
+#endif // DEVICE_TRANSACTION_H
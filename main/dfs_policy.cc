@@ -0,0 +1,146 @@
+#include "dfs_policy.h"
+#include "device_state_machine.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <sdkconfig.h>
+#include <algorithm>
+
+#define TAG "DfsPolicy"
+
+#ifndef CONFIG_DFS_MIN_CPU_FREQ_MHZ
+#define CONFIG_DFS_MIN_CPU_FREQ_MHZ CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#endif
+
+static esp_err_t CreateLock(esp_pm_lock_type_t type, const char* name, esp_pm_lock_handle_t* handle) {
+    auto ret = esp_pm_lock_create(type, 0, name, handle);
+    if (ret != ESP_OK) {
+        *handle = nullptr;
+    }
+    return ret;
+}
+
+void DfsPolicy::Start(DeviceStateMachine& state_machine) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (started_) {
+            return;
+        }
+        auto ret = CreateLock(ESP_PM_CPU_FREQ_MAX, "dfs_state", &cpu_lock_);
+        if (ret == ESP_ERR_NOT_SUPPORTED) {
+            ESP_LOGI(TAG, "Power management not supported");
+            return;
+        }
+        ESP_ERROR_CHECK(ret);
+        ESP_ERROR_CHECK(CreateLock(ESP_PM_NO_LIGHT_SLEEP, "dfs_state_nosleep", &sleep_lock_));
+        ESP_ERROR_CHECK(CreateLock(ESP_PM_CPU_FREQ_MAX, "dfs_boost", &boost_lock_));
+        started_ = true;
+        // Boosts taken before the locks existed are held from now on
+        for (int i = 0; i < boost_count_; i++) {
+            esp_pm_lock_acquire(boost_lock_);
+        }
+        state_since_us_ = esp_timer_get_time();
+    }
+
+    Configure(CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, false);
+    state_machine.AddStateChangeListener([this](DeviceState old_state, DeviceState new_state) {
+        OnStateChanged(new_state);
+    });
+    OnStateChanged(state_machine.GetState());
+    ESP_LOGI(TAG, "Started, %d to %d MHz", CONFIG_DFS_MIN_CPU_FREQ_MHZ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+}
+
+void DfsPolicy::Configure(int max_freq_mhz, bool light_sleep) {
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = max_freq_mhz,
+        .min_freq_mhz = std::min(CONFIG_DFS_MIN_CPU_FREQ_MHZ, max_freq_mhz),
+        .light_sleep_enable = light_sleep,
+    };
+    esp_pm_configure(&pm_config);
+}
+
+bool DfsPolicy::NeedsFullSpeed(DeviceState state) {
+    switch (state) {
+        case kDeviceStateIdle:
+        case kDeviceStateFatalError:
+            return false;
+        default:
+            return true;
+    }
+}
+
+void DfsPolicy::OnStateChanged(DeviceState new_state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    residency_us_[state_] += now - state_since_us_;
+    state_ = new_state;
+    state_since_us_ = now;
+
+    bool full_speed = NeedsFullSpeed(new_state);
+    if (full_speed == cpu_lock_held_) {
+        return;
+    }
+    cpu_lock_held_ = full_speed;
+    if (full_speed) {
+        esp_pm_lock_acquire(cpu_lock_);
+        esp_pm_lock_acquire(sleep_lock_);
+    } else {
+        esp_pm_lock_release(sleep_lock_);
+        esp_pm_lock_release(cpu_lock_);
+    }
+}
+
+void DfsPolicy::AcquireBoost() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (boost_count_++ == 0) {
+        boost_since_us_ = esp_timer_get_time();
+    }
+    if (boost_lock_ != nullptr) {
+        esp_pm_lock_acquire(boost_lock_);
+    }
+}
+
+void DfsPolicy::ReleaseBoost() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (boost_count_ == 0) {
+        return;
+    }
+    if (--boost_count_ == 0) {
+        boost_us_ += esp_timer_get_time() - boost_since_us_;
+    }
+    if (boost_lock_ != nullptr) {
+        esp_pm_lock_release(boost_lock_);
+    }
+}
+
+void DfsPolicy::PrintResidency() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!started_) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    int64_t residency[kDeviceStateFatalError + 1];
+    int64_t total = 0;
+    for (int i = 0; i <= kDeviceStateFatalError; i++) {
+        residency[i] = residency_us_[i];
+        if (i == state_) {
+            residency[i] += now - state_since_us_;
+        }
+        total += residency[i];
+    }
+    if (total == 0) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "State residency over %lld s:", total / 1000000);
+    for (int i = 0; i <= kDeviceStateFatalError; i++) {
+        if (residency[i] == 0) {
+            continue;
+        }
+        auto state = static_cast<DeviceState>(i);
+        ESP_LOGI(TAG, "  %-14s %8lld ms %3d%% %s", DeviceStateMachine::GetStateName(state), residency[i] / 1000,
+            (int)(residency[i] * 100 / total), NeedsFullSpeed(state) ? "full" : "min");
+    }
+    int64_t boost = boost_us_ + (boost_count_ > 0 ? now - boost_since_us_ : 0);
+    ESP_LOGI(TAG, "  %-14s %8lld ms", "boost", boost / 1000);
+}
@@ -0,0 +1,73 @@
+#ifndef DFS_POLICY_H
+#define DFS_POLICY_H
+
+#include <esp_pm.h>
+
+#include <cstdint>
+#include <mutex>
+
+#include "device_state.h"
+
+class DeviceStateMachine;
+
+/**
+ * DfsPolicy - Dynamic frequency scaling driven by the device state
+ *
+ * Power management is configured with the DFS minimum frequency as its floor. A PM lock keeps
+ * the CPU at full speed in the states that move audio or data, and is released in the quiet ones,
+ * so the CPU runs slow while idle. Boosts hold their own lock for heavy work outside those states,
+ * such as camera encoding. The time spent in each state is kept for PrintResidency().
+ */
+class DfsPolicy {
+public:
+    static DfsPolicy& GetInstance() {
+        static DfsPolicy instance;
+        return instance;
+    }
+
+    DfsPolicy(const DfsPolicy&) = delete;
+    DfsPolicy& operator=(const DfsPolicy&) = delete;
+
+    // Configures power management and follows the state machine from then on
+    void Start(DeviceStateMachine& state_machine);
+    bool IsStarted() const { return started_; }
+    // Reconfigures power management with the policy floor, used when leaving power save mode
+    void Configure(int max_freq_mhz, bool light_sleep);
+
+    void AcquireBoost();
+    void ReleaseBoost();
+
+    void PrintResidency();
+
+private:
+    DfsPolicy() = default;
+
+    std::mutex mutex_;
+    bool started_ = false;
+    esp_pm_lock_handle_t cpu_lock_ = nullptr;
+    esp_pm_lock_handle_t sleep_lock_ = nullptr;
+    esp_pm_lock_handle_t boost_lock_ = nullptr;
+    bool cpu_lock_held_ = false;
+    int boost_count_ = 0;
+    int64_t boost_since_us_ = 0;
+    int64_t boost_us_ = 0;
+
+    DeviceState state_ = kDeviceStateUnknown;
+    int64_t state_since_us_ = 0;
+    int64_t residency_us_[kDeviceStateFatalError + 1] = {};
+
+    static bool NeedsFullSpeed(DeviceState state);
+    void OnStateChanged(DeviceState new_state);
+};
+
+// Holds the CPU at full speed for the lifetime of the object
+class DfsBoost {
+public:
+    DfsBoost() { DfsPolicy::GetInstance().AcquireBoost(); }
+    ~DfsBoost() { DfsPolicy::GetInstance().ReleaseBoost(); }
+
+    DfsBoost(const DfsBoost&) = delete;
+    DfsBoost& operator=(const DfsBoost&) = delete;
+};
+
+#endif // DFS_POLICY_H
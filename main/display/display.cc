@@ -10,6 +10,7 @@
 #include "application.h"
 #include "audio_codec.h"
 #include "settings.h"
+#include "deferred_log.h"
 #include "assets/lang_config.h"
 
 #define TAG "Display"
@@ -41,12 +42,27 @@ void Display::SetEmotion(const char* emotion) {
 }
 
 void Display::SetChatMessage(const char* role, const char* content) {
-    ESP_LOGW(TAG, "Role:%s", role);
-    ESP_LOGW(TAG, "     %s", content);
+    ResetAppendedMessage();
+    DLOGW(TAG, "Role:%s", role);
+    DLOGW(TAG, "     %s", content);
+}
+
+// Displays that cannot extend a message in place show the whole text again
+void Display::AppendChatMessage(const char* role, const char* delta) {
+    std::string text = append_role_ == role ? append_text_ + delta : std::string(delta);
+    // SetChatMessage resets the appended message, so it is stored again after the call
+    SetChatMessage(role, text.c_str());
+    append_role_ = role;
+    append_text_ = std::move(text);
 }
 
 void Display::ClearChatMessages() {
-    // Default empty implementation, override in subclasses if needed
+    ResetAppendedMessage();
+}
+
+void Display::ResetAppendedMessage() {
+    append_role_.clear();
+    append_text_.clear();
 }
 
 void Display::SetTheme(Theme* theme) {
@@ -35,11 +35,16 @@ public:
     virtual void ShowNotification(const std::string &notification, int duration_ms = 3000);
     virtual void SetEmotion(const char* emotion);
     virtual void SetChatMessage(const char* role, const char* content);
+    // Extends the last message when it has the same role, otherwise starts a new one with delta
+    virtual void AppendChatMessage(const char* role, const char* delta);
     virtual void ClearChatMessages();
     virtual void SetTheme(Theme* theme);
     virtual Theme* GetTheme() { return current_theme_; }
     virtual void UpdateStatusBar(bool update_all = false);
     virtual void SetPowerSaveMode(bool on);
+    // Stretch the frame delays of animated emojis and the screen refresh period by factor, 1 is normal
+    virtual void SetAnimationSlowdown(int factor) {}
+    virtual void SetRefreshSlowdown(int factor) {}
     virtual void SetupUI() { 
         setup_ui_called_ = true;
     }
@@ -54,6 +59,13 @@ protected:
     bool setup_ui_called_ = false;  // Track if SetupUI() has been called
 
     Theme* current_theme_ = nullptr;
+    // Text built up by the default AppendChatMessage
+    std::string append_role_;
+    std::string append_text_;
+
+    // The next default AppendChatMessage starts a new message. SetChatMessage and
+    // ClearChatMessages overrides that rely on the default append call it.
+    void ResetAppendedMessage();
 
     friend class DisplayLockGuard;
     virtual bool Lock(int timeout_ms = 0) = 0;
@@ -28,6 +28,7 @@
 #include "board.h"
 #include "gfx.h"
 #include "expression_emote.h"
+#include "task_factory.h"
 
 
 namespace emote {
@@ -58,26 +59,21 @@ static bool OnFlushIoReady(const esp_lcd_panel_io_handle_t panel_io,
     return true;
 }
 
-// Flush callback for emote
-static void OnFlushCallback(int x_start, int y_start, int x_end, int y_end, const void* data, emote_handle_t handle)
-{
-    esp_lcd_panel_handle_t panel = (esp_lcd_panel_handle_t)emote_get_user_data(handle);
-    if (panel != nullptr) {
-        esp_lcd_panel_draw_bitmap(panel, x_start, y_start, x_end, y_end, data);
-    }
-}
-
 // ============================================================================
 // Graphics Initialization Functions
 // ============================================================================
 
-static emote_handle_t InitializeEmote(const esp_lcd_panel_handle_t panel, const int width, const int height)
+static emote_handle_t InitializeEmote(const esp_lcd_panel_handle_t panel, const int width, const int height,
+    void (*flush_cb)(int, int, int, int, const void*, emote_handle_t), void* user_data)
 {
     if (!panel) {
         ESP_LOGE(TAG, "Invalid panel");
         return nullptr;
     }
 
+    TaskPlacement placement = {"emote", 6 * 1024, 1, 0};
+    TaskFactory::GetPlacement("emote", placement);
+
     emote_config_t emote_cfg = {
         .flags = {
             .swap = true,
@@ -93,13 +89,13 @@ static emote_handle_t InitializeEmote(const esp_lcd_panel_handle_t panel, const
             .buf_pixels = static_cast<size_t>(width * 16),
         },
         .task = {
-            .task_priority = 5,
-            .task_stack = 6 * 1024,
-            .task_affinity = 0,
+            .task_priority = static_cast<int>(placement.priority),
+            .task_stack = static_cast<int>(placement.stack_size),
+            .task_affinity = static_cast<int>(placement.core),
             .task_stack_in_ext = false,
         },
-        .flush_cb = OnFlushCallback,
-        .user_data = (void*)panel,
+        .flush_cb = flush_cb,
+        .user_data = user_data,
     };
 
     emote_handle_t emote_handle = emote_init(&emote_cfg);
@@ -117,8 +113,14 @@ static emote_handle_t InitializeEmote(const esp_lcd_panel_handle_t panel, const
 
 EmoteDisplay::EmoteDisplay(const esp_lcd_panel_handle_t panel, const esp_lcd_panel_io_handle_t panel_io,
                            const int width, const int height)
+    : panel_(panel)
 {
-    emote_handle_ = InitializeEmote(panel, width, height);
+    auto& metrics = Metrics::GetInstance();
+    frame_counter_ = metrics.AddCounter("display.frames");
+    flush_bytes_ = metrics.AddCounter("display.flush_bytes");
+    perf_since_us_ = esp_timer_get_time();
+
+    emote_handle_ = InitializeEmote(panel, width, height, OnFlushCallback, this);
 
     const esp_lcd_panel_io_callbacks_t cbs = {
         .on_color_trans_done = OnFlushIoReady,
@@ -137,7 +139,9 @@ EmoteDisplay::~EmoteDisplay()
 void EmoteDisplay::SetEmotion(const char* const emotion)
 {
     ESP_LOGI(TAG, "SetEmotion: %s", emotion);
-    if (emote_handle_ && emotion && strlen(emotion) > 0) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    if (emote_handle_ && emotion && strlen(emotion) > 0 && emotion_ != emotion) {
+        emotion_ = emotion;
         emote_set_anim_emoji(emote_handle_, emotion);
     }
 }
@@ -145,7 +149,10 @@ void EmoteDisplay::SetEmotion(const char* const emotion)
 void EmoteDisplay::SetChatMessage(const char* const role, const char* const content)
 {
     ESP_LOGI(TAG, "SetChatMessage: %s, %s", role, content);
-    if (emote_handle_ && content && strlen(content) > 0) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    chat_message_role_ = role;
+    chat_message_ = content != nullptr ? content : "";
+    if (emote_handle_ && content && strlen(content) > 0 && EventChanged(chat_message_role_ + ": " + content)) {
         if ((std::strcmp(role, "system") == 0) && std::strstr(content, "xiaozhi.me")) {
             size_t len = strlen(content);
             char* new_content = new char[len + 1];
@@ -159,10 +166,24 @@ void EmoteDisplay::SetChatMessage(const char* const role, const char* const cont
     }
 }
 
+void EmoteDisplay::AppendChatMessage(const char* const role, const char* const delta)
+{
+    std::string text;
+    {
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        if (chat_message_role_ == role && !chat_message_.empty()) {
+            text = chat_message_;
+        }
+    }
+    text += delta;
+    SetChatMessage(role, text.c_str());
+}
+
 void EmoteDisplay::SetStatus(const char* const status)
 {
     ESP_LOGI(TAG, "SetStatus: %s", status);
-    if (emote_handle_ && status && strlen(status) > 0) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    if (emote_handle_ && status && strlen(status) > 0 && EventChanged(status)) {
         if (std::strcmp(status, Lang::Strings::LISTENING) == 0) {
             emote_set_event_msg(emote_handle_, EMOTE_MGR_EVT_LISTEN, NULL);
         } else if (std::strcmp(status, Lang::Strings::STANDBY) == 0) {
@@ -179,6 +200,9 @@ void EmoteDisplay::ShowNotification(const char* notification, int duration_ms)
 {
     ESP_LOGI(TAG, "ShowNotification: %s", notification);
     if (emote_handle_ && notification && strlen(notification) > 0) {
+        // Shown every time, and whatever comes next replaces it
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        last_event_.clear();
         emote_set_event_msg(emote_handle_, EMOTE_MGR_EVT_SYS, notification);
     }
 }
@@ -241,10 +265,60 @@ bool EmoteDisplay::InsertAnimDialog(const char* emoji_name, uint32_t duration_ms
 
 void EmoteDisplay::RefreshAll()
 {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    emotion_.clear();
+    last_event_.clear();
     if (emote_handle_) {
         emote_notify_all_refresh(emote_handle_);
         return;
     }
 }
 
+// Status and chat messages share the engine's event slot, only a change from the last one is sent.
+// Called with state_mutex_ held.
+bool EmoteDisplay::EventChanged(const std::string& event)
+{
+    if (event == last_event_) {
+        return false;
+    }
+    last_event_ = event;
+    return true;
+}
+
+void EmoteDisplay::OnFlushCallback(int x_start, int y_start, int x_end, int y_end, const void* data,
+    emote_handle_t handle)
+{
+    auto self = static_cast<EmoteDisplay*>(emote_get_user_data(handle));
+    if (self != nullptr) {
+        self->OnFlush(x_start, y_start, x_end, y_end, data);
+    }
+}
+
+// The engine flushes only the areas it redrew, top down within a frame, so a frame starts where y goes back
+void EmoteDisplay::OnFlush(int x_start, int y_start, int x_end, int y_end, const void* data)
+{
+    esp_lcd_panel_draw_bitmap(panel_, x_start, y_start, x_end, y_end, data);
+
+    uint32_t bytes = (x_end - x_start) * (y_end - y_start) * sizeof(uint16_t);
+    if (y_start <= last_flush_y_) {
+        perf_frames_++;
+        frame_counter_->Add();
+    }
+    last_flush_y_ = y_start;
+    perf_flushes_++;
+    perf_bytes_ += bytes;
+    flush_bytes_->Add(bytes);
+
+    int64_t now = esp_timer_get_time();
+    if (now - perf_since_us_ >= EMOTE_PERF_LOG_INTERVAL_US) {
+        int64_t elapsed = now - perf_since_us_;
+        ESP_LOGD(TAG, "Display: %.1f fps, %" PRIu32 " flushes, %" PRIu32 " KB/s",
+            perf_frames_ * 1000000.0f / elapsed, perf_flushes_, (uint32_t)(perf_bytes_ * 1000000 / elapsed / 1024));
+        perf_since_us_ = now;
+        perf_frames_ = 0;
+        perf_flushes_ = 0;
+        perf_bytes_ = 0;
+    }
+}
+
 } // namespace emote
\ No newline at end of file
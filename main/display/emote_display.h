@@ -1,12 +1,17 @@
 #pragma once
 
 #include "display.h"
+#include "metrics.h"
 #include <memory>
+#include <mutex>
 #include <string>
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
 #include "expression_emote.h"
 
+// Interval of the frame rate and flush size log
+#define EMOTE_PERF_LOG_INTERVAL_US (10 * 1000 * 1000)
+
 namespace emote {
 
 class EmoteDisplay : public Display {
@@ -17,6 +22,7 @@ public:
     virtual void SetEmotion(const char* emotion) override;
     virtual void SetStatus(const char* status) override;
     virtual void SetChatMessage(const char* role, const char* content) override;
+    virtual void AppendChatMessage(const char* role, const char* delta) override;
     virtual void SetTheme(Theme* theme) override;
     virtual void ShowNotification(const char* notification, int duration_ms = 3000) override;
     virtual void UpdateStatusBar(bool update_all = false) override;
@@ -26,6 +32,7 @@ public:
     bool StopAnimDialog();
     bool InsertAnimDialog(const char* emoji_name, uint32_t duration_ms);
 
+    // Redraws everything, the next emotion and message are sent to the engine even when unchanged
     void RefreshAll();
 
     // Get emote handle for internal use
@@ -35,7 +42,30 @@ private:
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
 
+    static void OnFlushCallback(int x_start, int y_start, int x_end, int y_end, const void* data, emote_handle_t handle);
+    void OnFlush(int x_start, int y_start, int x_end, int y_end, const void* data);
+    bool EventChanged(const std::string& event);
+
     emote_handle_t emote_handle_ = nullptr;
+    esp_lcd_panel_handle_t panel_ = nullptr;
+    // Set from the main task and from the tasks that show messages, the emote engine has no display lock
+    std::mutex state_mutex_;
+    // The emote manager takes whole messages, appends are built up here
+    std::string chat_message_role_;
+    std::string chat_message_;
+    // What the engine was last given, the same emotion or event again would only restart its animation
+    // and redraw the whole screen
+    std::string emotion_;
+    std::string last_event_;
+
+    // Flush statistics, only touched from the emote task
+    int64_t perf_since_us_ = 0;
+    uint32_t perf_frames_ = 0;
+    uint32_t perf_flushes_ = 0;
+    uint64_t perf_bytes_ = 0;
+    int last_flush_y_ = -1;
+    MetricCounter* frame_counter_ = nullptr;
+    MetricCounter* flush_bytes_ = nullptr;
 
 };
 
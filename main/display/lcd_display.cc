@@ -15,6 +15,10 @@
 #include <src/misc/cache/lv_cache.h>
 
 #include "board.h"
+#include "trace.h"
+#include "deferred_log.h"
+#include "task_factory.h"
+#include "heap_monitor.h"
 
 #define TAG "LcdDisplay"
 
@@ -22,6 +26,19 @@ LV_FONT_DECLARE(BUILTIN_TEXT_FONT);
 LV_FONT_DECLARE(BUILTIN_ICON_FONT);
 LV_FONT_DECLARE(font_awesome_30_4);
 
+// esp_lvgl_port creates its task itself, with the taskLVGL entry of the task placement table
+static void ApplyTaskPlacement(lvgl_port_cfg_t& port_cfg) {
+    TaskPlacement placement;
+    if (!TaskFactory::GetPlacement("taskLVGL", placement)) {
+        return;
+    }
+    port_cfg.task_priority = placement.priority;
+    port_cfg.task_affinity = placement.core == tskNO_AFFINITY ? -1 : placement.core;
+    if (placement.stack_size != 0) {
+        port_cfg.task_stack = placement.stack_size;
+    }
+}
+
 void LcdDisplay::InitializeLcdThemes() {
     auto text_font = std::make_shared<LvglBuiltInFont>(&BUILTIN_TEXT_FONT);
     auto icon_font = std::make_shared<LvglBuiltInFont>(&BUILTIN_ICON_FONT);
@@ -87,10 +104,73 @@ LcdDisplay::LcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_
         .skip_unhandled_events = false,
     };
     esp_timer_create(&preview_timer_args, &preview_timer_);
+
+    // The GIF decodes its frames again instead of replaying them
+    heap_releaser_id_ = HeapMonitor::GetInstance().AddReleaser("gif_frames", [this](HeapPressure pressure) {
+        if (!Lock(1000)) {
+            return (size_t)0;
+        }
+        size_t bytes = gif_controller_ ? gif_controller_->DropFrameCache() : 0;
+        Unlock();
+        return bytes;
+    });
+}
+
+void LcdDisplay::InitializePerfStats() {
+    perf_since_us_ = esp_timer_get_time();
+    auto& metrics = Metrics::GetInstance();
+    frame_counter_ = metrics.AddCounter("display.frames");
+    render_us_ = metrics.AddHistogram("display.render_us");
+    flush_wait_us_ = metrics.AddHistogram("display.flush_wait_us");
+    lv_display_add_event_cb(display_, OnDisplayEvent, LV_EVENT_REFR_START, this);
+    lv_display_add_event_cb(display_, OnDisplayEvent, LV_EVENT_REFR_READY, this);
+    lv_display_add_event_cb(display_, OnDisplayEvent, LV_EVENT_FLUSH_WAIT_START, this);
+    lv_display_add_event_cb(display_, OnDisplayEvent, LV_EVENT_FLUSH_WAIT_FINISH, this);
+}
+
+// Render time is a whole refresh, flush wait is the part of it spent waiting for the panel transfer
+void LcdDisplay::OnDisplayEvent(lv_event_t* e) {
+    auto self = static_cast<LcdDisplay*>(lv_event_get_user_data(e));
+    int64_t now = esp_timer_get_time();
+    switch (lv_event_get_code(e)) {
+    case LV_EVENT_REFR_START:
+        self->refresh_start_us_ = now;
+        TRACE_BEGIN(kTracePointDisplayRender);
+        break;
+    case LV_EVENT_REFR_READY:
+        TRACE_END(kTracePointDisplayRender);
+        self->perf_frames_++;
+        self->perf_render_us_ += now - self->refresh_start_us_;
+        self->frame_counter_->Add();
+        self->render_us_->Record(now - self->refresh_start_us_);
+        if (now - self->perf_since_us_ >= LCD_PERF_LOG_INTERVAL_US) {
+            int64_t elapsed = now - self->perf_since_us_;
+            ESP_LOGD(TAG, "Display: %.1f fps, render %lld us/frame, flush wait %lld us/frame",
+                self->perf_frames_ * 1000000.0f / elapsed, self->perf_render_us_ / self->perf_frames_,
+                self->perf_flush_wait_us_ / self->perf_frames_);
+            self->perf_since_us_ = now;
+            self->perf_frames_ = 0;
+            self->perf_render_us_ = 0;
+            self->perf_flush_wait_us_ = 0;
+        }
+        break;
+    case LV_EVENT_FLUSH_WAIT_START:
+        self->flush_wait_start_us_ = now;
+        TRACE_BEGIN(kTracePointDisplayFlushWait);
+        break;
+    case LV_EVENT_FLUSH_WAIT_FINISH:
+        TRACE_END(kTracePointDisplayFlushWait);
+        self->perf_flush_wait_us_ += now - self->flush_wait_start_us_;
+        self->flush_wait_us_->Record(now - self->flush_wait_start_us_);
+        break;
+    default:
+        break;
+    }
 }
 
 SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
-                           int width, int height, int offset_x, int offset_y, bool mirror_x, bool mirror_y, bool swap_xy)
+                           int width, int height, int offset_x, int offset_y, bool mirror_x, bool mirror_y, bool swap_xy,
+                           const LcdBufferConfig& buffer_config)
     : LcdDisplay(panel_io, panel, width, height) {
 
     // draw white
@@ -127,20 +207,25 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
-#if CONFIG_SOC_CPU_CORES_NUM > 1
-    port_cfg.task_affinity = 1;
-#endif
+    ApplyTaskPlacement(port_cfg);
     lvgl_port_init(&port_cfg);
 
-    ESP_LOGI(TAG, "Adding LCD display");
+    bool spiram = buffer_config.spiram;
+#if !CONFIG_SPIRAM
+    if (spiram) {
+        ESP_LOGW(TAG, "No PSRAM, draw buffers stay in internal memory");
+        spiram = false;
+    }
+#endif
+    ESP_LOGI(TAG, "Adding LCD display, %d lines %s buffer in %s", buffer_config.lines,
+        buffer_config.double_buffer ? "double" : "single", spiram ? "PSRAM" : "DMA memory");
     const lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
         .panel_handle = panel_,
         .control_handle = nullptr,
-        .buffer_size = static_cast<uint32_t>(width_ * 20),
-        .double_buffer = false,
-        .trans_size = 0,
+        .buffer_size = static_cast<uint32_t>(width_ * buffer_config.lines),
+        .double_buffer = buffer_config.double_buffer,
+        .trans_size = spiram ? buffer_config.trans_size : 0,
         .hres = static_cast<uint32_t>(width_),
         .vres = static_cast<uint32_t>(height_),
         .monochrome = false,
@@ -151,8 +236,8 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         },
         .color_format = LV_COLOR_FORMAT_RGB565,
         .flags = {
-            .buff_dma = 1,
-            .buff_spiram = 0,
+            .buff_dma = !spiram,
+            .buff_spiram = spiram,
             .sw_rotate = 0,
             .swap_bytes = 1,
             .full_refresh = 0,
@@ -165,6 +250,7 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         ESP_LOGE(TAG, "Failed to add display");
         return;
     }
+    InitializePerfStats();
 
     if (offset_x != 0 || offset_y != 0) {
         lv_display_set_offset(display_, offset_x, offset_y);
@@ -189,7 +275,7 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
+    ApplyTaskPlacement(port_cfg);
     port_cfg.timer_period_ms = 50;
     lvgl_port_init(&port_cfg);
 
@@ -234,7 +320,8 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
 MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                             int width, int height,  int offset_x, int offset_y,
-                            bool mirror_x, bool mirror_y, bool swap_xy)
+                            bool mirror_x, bool mirror_y, bool swap_xy,
+                            const LcdBufferConfig& buffer_config)
     : LcdDisplay(panel_io, panel, width, height) {
 
     ESP_LOGI(TAG, "Initialize LVGL library");
@@ -242,15 +329,22 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
+    ApplyTaskPlacement(port_cfg);
     lvgl_port_init(&port_cfg);
 
-    ESP_LOGI(TAG, "Adding LCD display");
+    bool spiram = buffer_config.spiram;
+#if !CONFIG_SPIRAM
+    spiram = false;
+#endif
+    ESP_LOGI(TAG, "Adding LCD display, %d lines %s buffer in %s", buffer_config.lines,
+        buffer_config.double_buffer ? "double" : "single", spiram ? "PSRAM" : "DMA memory");
     const lvgl_port_display_cfg_t disp_cfg = {
         .io_handle = panel_io,
         .panel_handle = panel,
         .control_handle = nullptr,
-        .buffer_size = static_cast<uint32_t>(width_ * 50),
-        .double_buffer = false,
+        .buffer_size = static_cast<uint32_t>(width_ * buffer_config.lines),
+        .double_buffer = buffer_config.double_buffer,
+        .trans_size = spiram ? buffer_config.trans_size : 0,
         .hres = static_cast<uint32_t>(width_),
         .vres = static_cast<uint32_t>(height_),
         .monochrome = false,
@@ -261,8 +355,8 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
             .mirror_y = mirror_y,
         },
         .flags = {
-            .buff_dma = true,
-            .buff_spiram =false,
+            .buff_dma = !spiram,
+            .buff_spiram = spiram,
             .sw_rotate = true,
         },
     };
@@ -277,6 +371,7 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
         ESP_LOGE(TAG, "Failed to add display");
         return;
     }
+    InitializePerfStats();
 
     if (offset_x != 0 || offset_y != 0) {
         lv_display_set_offset(display_, offset_x, offset_y);
@@ -284,6 +379,7 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
 }
 
 LcdDisplay::~LcdDisplay() {
+    HeapMonitor::GetInstance().RemoveReleaser(heap_releaser_id_);
     SetPreviewImage(nullptr);
     
     // Clean up GIF controller
@@ -291,6 +387,7 @@ LcdDisplay::~LcdDisplay() {
         gif_controller_->Stop();
         gif_controller_.reset();
     }
+    animation_controller_.reset();
     
     if (preview_timer_ != nullptr) {
         esp_timer_stop(preview_timer_);
@@ -343,7 +440,11 @@ LcdDisplay::~LcdDisplay() {
 }
 
 bool LcdDisplay::Lock(int timeout_ms) {
-    return lvgl_port_lock(timeout_ms);
+    if (!lvgl_port_lock(timeout_ms)) {
+        return false;
+    }
+    ExitIdle();
+    return true;
 }
 
 void LcdDisplay::Unlock() {
@@ -360,6 +461,7 @@ void LcdDisplay::SetupUI() {
     
     Display::SetupUI();  // Mark SetupUI as called
     DisplayLockGuard lock(this);
+    InitializeUpdateQueue();
 
     auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
     auto text_font = lvgl_theme->text_font()->font();
@@ -501,9 +603,16 @@ void LcdDisplay::SetupUI() {
 #else
 #define  MAX_MESSAGES 20
 #endif
+// Marks the containers of text messages, the ones that can be recycled
+static char message_container_tag;
+void* const LcdDisplay::kMessageContainer = &message_container_tag;
+
 void LcdDisplay::SetChatMessage(const char* role, const char* content) {
     if (!setup_ui_called_) {
-        ESP_LOGW(TAG, "SetChatMessage('%s', '%s') called before SetupUI() - message will be lost!", role, content);
+        DLOGW(TAG, "SetChatMessage('%s', '%s') called before SetupUI() - message will be lost!", role, content);
+    }
+    if (DeferChatMessage(PendingChatMessage::kSet, role, content)) {
+        return;
     }
     DisplayLockGuard lock(this);
     if (content_ == nullptr) {
@@ -512,44 +621,22 @@ void LcdDisplay::SetChatMessage(const char* role, const char* content) {
         }
         return;
     }
-    
-    // Check if message count exceeds limit
+    // Every call starts a new message, appends only continue it once a bubble shows it
+    chat_message_role_.clear();
+
+    // Collapse system messages: a system message right after another one takes its place
     uint32_t child_count = lv_obj_get_child_cnt(content_);
-    if (child_count >= MAX_MESSAGES) {
-        // Delete the oldest message (first child object)
-        lv_obj_t* first_child = lv_obj_get_child(content_, 0);
-        if (first_child != nullptr) {
-            lv_obj_del(first_child);
-            // Refresh child count after deletion
-            child_count = lv_obj_get_child_cnt(content_);
-        }
-        // Scroll to the last message immediately (get last_child after deletion)
-        if (child_count > 0) {
-            lv_obj_t* last_child = lv_obj_get_child(content_, child_count - 1);
-            if (last_child != nullptr && lv_obj_is_valid(last_child)) {
-                lv_obj_scroll_to_view_recursive(last_child, LV_ANIM_OFF);
-            }
-        }
-    }
-    
-    // Collapse system messages (if it's a system message, check if the last message is also a system message)
+    lv_obj_t* container = nullptr;
     if (strcmp(role, "system") == 0) {
-        // Refresh child count to get accurate count after potential deletion above
-        child_count = lv_obj_get_child_cnt(content_);
-        if (child_count > 0) {
-            // Get the last message container
-            lv_obj_t* last_container = lv_obj_get_child(content_, child_count - 1);
-            if (last_container != nullptr && lv_obj_is_valid(last_container) && lv_obj_get_child_cnt(last_container) > 0) {
-                // Get the bubble inside the container
-                lv_obj_t* last_bubble = lv_obj_get_child(last_container, 0);
-                if (last_bubble != nullptr && lv_obj_is_valid(last_bubble)) {
-                    // Check if bubble type is system message
-                    void* bubble_type_ptr = lv_obj_get_user_data(last_bubble);
-                    if (bubble_type_ptr != nullptr && strcmp((const char*)bubble_type_ptr, "system") == 0) {
-                        // If the last message is also a system message, delete it
-                        lv_obj_del(last_container);
-                    }
+        lv_obj_t* last = child_count > 0 ? lv_obj_get_child(content_, child_count - 1) : nullptr;
+        if (last != nullptr && lv_obj_get_user_data(last) == kMessageContainer) {
+            auto last_role = (const char*)lv_obj_get_user_data(lv_obj_get_child(last, 0));
+            if (last_role != nullptr && strcmp(last_role, "system") == 0) {
+                if (strlen(content) == 0) {
+                    lv_obj_del(last);
+                    return;
                 }
+                container = last;
             }
         }
     } else {
@@ -562,28 +649,24 @@ void LcdDisplay::SetChatMessage(const char* role, const char* content) {
         return;
     }
 
+    if (container == nullptr) {
+        container = AcquireMessageContainer();
+    }
+    lv_obj_t* msg_bubble = lv_obj_get_child(container, 0);
+    lv_obj_t* msg_text = lv_obj_get_child(msg_bubble, 0);
     auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
 
-    // Create a message bubble
-    lv_obj_t* msg_bubble = lv_obj_create(content_);
-    lv_obj_set_style_radius(msg_bubble, 8, 0);
-    lv_obj_set_scrollbar_mode(msg_bubble, LV_SCROLLBAR_MODE_OFF);
-    lv_obj_set_style_border_width(msg_bubble, 0, 0);
-    lv_obj_set_style_pad_all(msg_bubble, lvgl_theme->spacing(4), 0);
-
-    // Create the message text
-    lv_obj_t* msg_text = lv_label_create(msg_bubble);
     lv_label_set_text(msg_text, content);
-    
+
     // Calculate bubble width constraints
     lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;  // 85% of screen width
-    lv_coord_t min_width = 20;  
-    
+    lv_coord_t min_width = 20;
+
     // Let LVGL calculate the natural text width first
     lv_obj_set_width(msg_text, LV_SIZE_CONTENT);
     lv_obj_update_layout(msg_text);
     lv_coord_t text_width = lv_obj_get_width(msg_text);
-    
+
     // Ensure text width is not less than minimum width
     if (text_width < min_width) {
         text_width = min_width;
@@ -591,110 +674,112 @@ void LcdDisplay::SetChatMessage(const char* role, const char* content) {
 
     // Constrain to max width
     lv_coord_t bubble_width = (text_width < max_width) ? text_width : max_width;
-    
-    // Set message text width
     lv_obj_set_width(msg_text, bubble_width);
-    lv_label_set_long_mode(msg_text, LV_LABEL_LONG_WRAP);
 
-    // Set bubble width
-    lv_obj_set_width(msg_bubble, bubble_width);
-    lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-
-    // Set alignment and style based on message role
+    // Only the role styling differs between messages, the rest was set when the widgets were created
     if (strcmp(role, "user") == 0) {
         // User messages are right-aligned with green background
         lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->user_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
         lv_obj_set_style_text_color(msg_text, lvgl_theme->text_color(), 0);
-        
-        // Set custom attribute to mark bubble type
         lv_obj_set_user_data(msg_bubble, (void*)"user");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    } else if (strcmp(role, "assistant") == 0) {
-        // Assistant messages are left-aligned with white background
-        lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->assistant_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, lvgl_theme->text_color(), 0);
-        
-        // Set custom attribute to mark bubble type
-        lv_obj_set_user_data(msg_bubble, (void*)"assistant");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
+        lv_obj_align(msg_bubble, LV_ALIGN_RIGHT_MID, -25, 0);
     } else if (strcmp(role, "system") == 0) {
         // System messages are center-aligned with light gray background
         lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->system_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
         lv_obj_set_style_text_color(msg_text, lvgl_theme->system_text_color(), 0);
-        
-        // Set custom attribute to mark bubble type
         lv_obj_set_user_data(msg_bubble, (void*)"system");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    }
-    
-    // Create a full-width container for user messages to ensure right alignment
-    if (strcmp(role, "user") == 0) {
-        // Create a full-width container
-        lv_obj_t* container = lv_obj_create(content_);
-        lv_obj_set_width(container, LV_HOR_RES);
-        lv_obj_set_height(container, LV_SIZE_CONTENT);
-        
-        // Make container transparent and borderless
-        lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
-        lv_obj_set_style_border_width(container, 0, 0);
-        lv_obj_set_style_pad_all(container, 0, 0);
-        
-        // Move the message bubble into this container
-        lv_obj_set_parent(msg_bubble, container);
-        
-        // Right align the bubble in the container
-        lv_obj_align(msg_bubble, LV_ALIGN_RIGHT_MID, -25, 0);
-        
-        // Auto-scroll to this container
-        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
-    } else if (strcmp(role, "system") == 0) {
-        // Create full-width container for system messages to ensure center alignment
-        lv_obj_t* container = lv_obj_create(content_);
-        lv_obj_set_width(container, LV_HOR_RES);
-        lv_obj_set_height(container, LV_SIZE_CONTENT);
-        
-        lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
-        lv_obj_set_style_border_width(container, 0, 0);
-        lv_obj_set_style_pad_all(container, 0, 0);
-        
-        lv_obj_set_parent(msg_bubble, container);
         lv_obj_align(msg_bubble, LV_ALIGN_CENTER, 0, 0);
-        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
     } else {
-        // For assistant messages
-        // Left align assistant messages
+        // Assistant messages are left-aligned with white background
+        lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->assistant_bubble_color(), 0);
+        lv_obj_set_style_text_color(msg_text, lvgl_theme->text_color(), 0);
+        lv_obj_set_user_data(msg_bubble, (void*)"assistant");
         lv_obj_align(msg_bubble, LV_ALIGN_LEFT_MID, 0, 0);
-
-        // Auto-scroll to the message bubble
-        lv_obj_scroll_to_view_recursive(msg_bubble, LV_ANIM_ON);
     }
-    
+
+    // The message is always the tail of the list
+    lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
+
     // Store reference to the latest message label
     chat_message_label_ = msg_text;
+    chat_message_role_ = role;
+}
+
+void LcdDisplay::AppendChatMessage(const char* role, const char* delta) {
+    if (DeferChatMessage(PendingChatMessage::kAppend, role, delta)) {
+        return;
+    }
+    DisplayLockGuard lock(this);
+    if (content_ == nullptr) {
+        return;
+    }
+
+    // Only the tail message is extended, anything else starts a new one
+    uint32_t child_count = lv_obj_get_child_cnt(content_);
+    lv_obj_t* container = child_count > 0 ? lv_obj_get_child(content_, child_count - 1) : nullptr;
+    lv_obj_t* msg_bubble = container != nullptr && lv_obj_get_user_data(container) == kMessageContainer
+        ? lv_obj_get_child(container, 0) : nullptr;
+    auto last_role = msg_bubble != nullptr ? (const char*)lv_obj_get_user_data(msg_bubble) : nullptr;
+    if (last_role == nullptr || chat_message_role_ != role) {
+        SetChatMessage(role, delta);
+        return;
+    }
+    lv_obj_t* msg_text = lv_obj_get_child(msg_bubble, 0);
+    lv_label_ins_text(msg_text, LV_LABEL_POS_LAST, delta);
+
+    // The bubble grows up to the max width, past that the label only wraps into more lines
+    lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;
+    lv_coord_t old_height = lv_obj_get_height(container);
+    if (lv_obj_get_width(msg_text) < max_width) {
+        lv_obj_set_width(msg_text, LV_SIZE_CONTENT);
+        lv_obj_update_layout(msg_text);
+        lv_coord_t text_width = lv_obj_get_width(msg_text);
+        lv_obj_set_width(msg_text, text_width < max_width ? text_width : max_width);
+    }
+    lv_obj_update_layout(container);
+    if (lv_obj_get_height(container) != old_height) {
+        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
+    }
+}
+
+// Returns an empty message at the end of the list, the oldest one is moved there once the list is full
+lv_obj_t* LcdDisplay::AcquireMessageContainer() {
+    uint32_t child_count = lv_obj_get_child_cnt(content_);
+    if (child_count >= MAX_MESSAGES) {
+        lv_obj_t* first_child = lv_obj_get_child(content_, 0);
+        if (lv_obj_get_user_data(first_child) == kMessageContainer) {
+            lv_obj_move_to_index(first_child, -1);
+            return first_child;
+        }
+        // Image previews are not recycled
+        lv_obj_del(first_child);
+    }
+
+    auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
+
+    // A full-width transparent container holds the bubble, so it can be aligned per role
+    lv_obj_t* container = lv_obj_create(content_);
+    lv_obj_set_width(container, LV_HOR_RES);
+    lv_obj_set_height(container, LV_SIZE_CONTENT);
+    lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
+    lv_obj_set_style_border_width(container, 0, 0);
+    lv_obj_set_style_pad_all(container, 0, 0);
+    lv_obj_set_scrollbar_mode(container, LV_SCROLLBAR_MODE_OFF);
+    lv_obj_set_user_data(container, kMessageContainer);
+
+    lv_obj_t* msg_bubble = lv_obj_create(container);
+    lv_obj_set_style_radius(msg_bubble, 8, 0);
+    lv_obj_set_scrollbar_mode(msg_bubble, LV_SCROLLBAR_MODE_OFF);
+    lv_obj_set_style_border_width(msg_bubble, 0, 0);
+    lv_obj_set_style_pad_all(msg_bubble, lvgl_theme->spacing(4), 0);
+    lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
+    lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
+    lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
+    lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
+
+    lv_obj_t* msg_text = lv_label_create(msg_bubble);
+    lv_label_set_long_mode(msg_text, LV_LABEL_LONG_WRAP);
+    return container;
 }
 
 void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
@@ -745,6 +830,14 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
     
     // Ensure zoom doesn't exceed 256 (100%)
     if (zoom > 256) zoom = 256;
+
+    // Scale once with the PPA instead of transforming on every redraw
+    auto scaled = LvglScaleImage(img_dsc, zoom);
+    if (scaled != nullptr) {
+        image = std::move(scaled);
+        img_dsc = image->image_dsc();
+        zoom = 256;
+    }
     
     // Set image properties
     lv_image_set_src(preview_image, img_dsc);
@@ -782,6 +875,9 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
 }
 
 void LcdDisplay::ClearChatMessages() {
+    if (DeferChatMessage(PendingChatMessage::kClear, nullptr, nullptr)) {
+        return;
+    }
     DisplayLockGuard lock(this);
     if (content_ == nullptr) {
         return;
@@ -792,6 +888,7 @@ void LcdDisplay::ClearChatMessages() {
     
     // Reset chat_message_label_ as it has been deleted
     chat_message_label_ = nullptr;
+    chat_message_role_.clear();
     
     // Show the centered AI logo (emoji_label_) again
     if (emoji_label_ != nullptr) {
@@ -810,6 +907,7 @@ void LcdDisplay::SetupUI() {
     
     Display::SetupUI();  // Mark SetupUI as called
     DisplayLockGuard lock(this);
+    InitializeUpdateQueue();
     LvglTheme* lvgl_theme = static_cast<LvglTheme*>(current_theme_);
     auto text_font = lvgl_theme->text_font()->font();
     auto icon_font = lvgl_theme->icon_font()->font();
@@ -980,24 +1078,39 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
         lv_obj_remove_flag(emoji_box_, LV_OBJ_FLAG_HIDDEN);
         lv_obj_add_flag(preview_image_, LV_OBJ_FLAG_HIDDEN);
         preview_image_cached_.reset();
-        if (gif_controller_) {
+        if (gif_controller_ && gif_controller_->IsLoaded()) {
             gif_controller_->Start();
         }
+        if (animation_controller_ && animation_controller_->IsLoaded()) {
+            animation_controller_->Start();
+        }
         return;
     }
 
     preview_image_cached_ = std::move(image);
     auto img_dsc = preview_image_cached_->image_dsc();
-    lv_image_set_src(preview_image_, img_dsc);
     if (img_dsc->header.w > 0 && img_dsc->header.h > 0) {
         // zoom factor 0.5
-        lv_image_set_scale(preview_image_, 128 * width_ / img_dsc->header.w);
+        int zoom = 128 * width_ / img_dsc->header.w;
+        auto scaled = LvglScaleImage(img_dsc, zoom);
+        if (scaled != nullptr) {
+            preview_image_cached_ = std::move(scaled);
+            img_dsc = preview_image_cached_->image_dsc();
+            zoom = LV_SCALE_NONE;
+        }
+        lv_image_set_src(preview_image_, img_dsc);
+        lv_image_set_scale(preview_image_, zoom);
+    } else {
+        lv_image_set_src(preview_image_, img_dsc);
     }
 
     // Hide emoji_box_
     if (gif_controller_) {
         gif_controller_->Stop();
     }
+    if (animation_controller_) {
+        animation_controller_->Stop();
+    }
     lv_obj_add_flag(emoji_box_, LV_OBJ_FLAG_HIDDEN);
     lv_obj_remove_flag(preview_image_, LV_OBJ_FLAG_HIDDEN);
     esp_timer_stop(preview_timer_);
@@ -1006,7 +1119,10 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
 
 void LcdDisplay::SetChatMessage(const char* role, const char* content) {
     if (!setup_ui_called_) {
-        ESP_LOGW(TAG, "SetChatMessage('%s', '%s') called before SetupUI() - message will be lost!", role, content);
+        DLOGW(TAG, "SetChatMessage('%s', '%s') called before SetupUI() - message will be lost!", role, content);
+    }
+    if (DeferChatMessage(PendingChatMessage::kSet, role, content)) {
+        return;
     }
     DisplayLockGuard lock(this);
     if (chat_message_label_ == nullptr) {
@@ -1016,14 +1132,31 @@ void LcdDisplay::SetChatMessage(const char* role, const char* content) {
         return;
     }
     lv_label_set_text(chat_message_label_, content);
+    chat_message_role_ = role;
+}
+
+void LcdDisplay::AppendChatMessage(const char* role, const char* delta) {
+    if (DeferChatMessage(PendingChatMessage::kAppend, role, delta)) {
+        return;
+    }
+    DisplayLockGuard lock(this);
+    if (chat_message_label_ == nullptr || chat_message_role_ != role) {
+        SetChatMessage(role, delta);
+        return;
+    }
+    lv_label_ins_text(chat_message_label_, LV_LABEL_POS_LAST, delta);
 }
 
 void LcdDisplay::ClearChatMessages() {
+    if (DeferChatMessage(PendingChatMessage::kClear, nullptr, nullptr)) {
+        return;
+    }
     DisplayLockGuard lock(this);
     // In non-wechat mode, just clear the chat message label
     if (chat_message_label_ != nullptr) {
         lv_label_set_text(chat_message_label_, "");
     }
+    chat_message_role_.clear();
 }
 #endif
 
@@ -1031,13 +1164,9 @@ void LcdDisplay::SetEmotion(const char* emotion) {
     if (!setup_ui_called_) {
         ESP_LOGW(TAG, "SetEmotion('%s') called before SetupUI() - emotion will not be displayed!", emotion);
     }
-    // Stop any running GIF animation
-    if (gif_controller_) {
-        DisplayLockGuard lock(this);
-        gif_controller_->Stop();
-        gif_controller_.reset();
+    if (DeferEmotion(emotion)) {
+        return;
     }
-    
     if (emoji_image_ == nullptr) {
         if (setup_ui_called_) {
             ESP_LOGW(TAG, "SetEmotion('%s') failed: emoji_image_ is nullptr (SetupUI() was called but emoji image not created)", emotion);
@@ -1047,6 +1176,15 @@ void LcdDisplay::SetEmotion(const char* emotion) {
 
     auto emoji_collection = static_cast<LvglTheme*>(current_theme_)->emoji_collection();
     auto image = emoji_collection != nullptr ? emoji_collection->GetEmojiImage(emotion) : nullptr;
+    // Stop any running GIF animation, the player keeps its buffers for the next GIF
+    if (gif_controller_ && (image == nullptr || !image->IsGif())) {
+        DisplayLockGuard lock(this);
+        gif_controller_->Unload();
+    }
+    if (animation_controller_ && (image == nullptr || !image->IsAnimation())) {
+        DisplayLockGuard lock(this);
+        animation_controller_->Unload();
+    }
     if (image == nullptr) {
         const char* utf8 = font_awesome_get_utf8(emotion);
         if (utf8 != nullptr && emoji_label_ != nullptr) {
@@ -1060,25 +1198,54 @@ void LcdDisplay::SetEmotion(const char* emotion) {
 
     DisplayLockGuard lock(this);
     if (image->IsGif()) {
-        // Create new GIF controller
-        gif_controller_ = std::make_unique<LvglGif>(image->image_dsc());
-        
-        if (gif_controller_->IsLoaded()) {
+        if (gif_controller_ && gif_controller_->IsPlaying() && gif_controller_->source() == image->image_dsc()->data) {
+            // Same GIF already running, do not restart it
+        } else if (gif_controller_ == nullptr) {
+            gif_controller_ = std::make_unique<LvglGif>(image->image_dsc());
+            gif_controller_->SetSlowdown(gif_slowdown_);
             // Set up frame update callback
             gif_controller_->SetFrameCallback([this]() {
                 lv_image_set_src(emoji_image_, gif_controller_->image_dsc());
             });
-            
+        } else {
+            gif_controller_->Load(image->image_dsc());
+        }
+
+        if (gif_controller_->IsLoaded()) {
             // Set initial frame and start animation
-            lv_image_set_src(emoji_image_, gif_controller_->image_dsc());
-            gif_controller_->Start();
+            if (!gif_controller_->IsPlaying()) {
+                lv_image_set_src(emoji_image_, gif_controller_->image_dsc());
+                gif_controller_->Start();
+            }
             
             // Show GIF, hide others
             lv_obj_add_flag(emoji_label_, LV_OBJ_FLAG_HIDDEN);
             lv_obj_remove_flag(emoji_image_, LV_OBJ_FLAG_HIDDEN);
         } else {
             ESP_LOGE(TAG, "Failed to load GIF for emotion: %s", emotion);
-            gif_controller_.reset();
+        }
+    } else if (image->IsAnimation()) {
+        // Same loading as a GIF, the frames are copied instead of decoded
+        if (animation_controller_ && animation_controller_->IsPlaying() && animation_controller_->source() == image->image_dsc()->data) {
+            // Same animation already running, do not restart it
+        } else {
+            if (animation_controller_ == nullptr) {
+                animation_controller_ = std::make_unique<LvglAnimation>();
+                animation_controller_->SetFrameCallback([this]() {
+                    lv_image_set_src(emoji_image_, animation_controller_->image_dsc());
+                });
+            }
+            if (animation_controller_->Load(image->image_dsc())) {
+                lv_image_set_src(emoji_image_, animation_controller_->image_dsc());
+                animation_controller_->Start();
+            }
+        }
+
+        if (animation_controller_->IsLoaded()) {
+            lv_obj_add_flag(emoji_label_, LV_OBJ_FLAG_HIDDEN);
+            lv_obj_remove_flag(emoji_image_, LV_OBJ_FLAG_HIDDEN);
+        } else {
+            ESP_LOGE(TAG, "Failed to load animation for emotion: %s", emotion);
         }
     } else {
         lv_image_set_src(emoji_image_, image->image_dsc());
@@ -1092,8 +1259,10 @@ void LcdDisplay::SetEmotion(const char* emotion) {
     if (strcmp(emotion, "neutral") == 0 && child_count > 0) {
         // Stop GIF animation if running
         if (gif_controller_) {
-            gif_controller_->Stop();
-            gif_controller_.reset();
+            gif_controller_->Unload();
+        }
+        if (animation_controller_) {
+            animation_controller_->Unload();
         }
         
         lv_obj_add_flag(emoji_image_, LV_OBJ_FLAG_HIDDEN);
@@ -1244,6 +1413,14 @@ void LcdDisplay::SetTheme(Theme* theme) {
     Display::SetTheme(lvgl_theme);
 }
 
+void LcdDisplay::SetAnimationSlowdown(int factor) {
+    DisplayLockGuard lock(this);
+    gif_slowdown_ = std::max(factor, 1);
+    if (gif_controller_) {
+        gif_controller_->SetSlowdown(gif_slowdown_);
+    }
+}
+
 void LcdDisplay::SetHideSubtitle(bool hide) {
     DisplayLockGuard lock(this);
     hide_subtitle_ = hide;
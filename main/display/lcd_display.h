@@ -3,6 +3,8 @@
 
 #include "lvgl_display.h"
 #include "gif/lvgl_gif.h"
+#include "lvgl_animation.h"
+#include "metrics.h"
 
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
@@ -10,8 +12,19 @@
 
 #include <atomic>
 #include <memory>
+#include <string>
 
 #define PREVIEW_IMAGE_DURATION_MS 5000
+// Interval of the frame rate and flush time log, at debug level
+#define LCD_PERF_LOG_INTERVAL_US (10 * 1000 * 1000)
+
+// Draw buffer profile of a board, the defaults are what fits every board's internal RAM
+struct LcdBufferConfig {
+    int lines = 20;                 // Height of a draw buffer stripe
+    bool double_buffer = false;     // Render the next stripe while the previous one is still flushed
+    bool spiram = false;            // Draw buffers in PSRAM instead of internal DMA memory
+    uint32_t trans_size = 0;        // Pixels per transfer through an internal DMA buffer, needed with spiram
+};
 
 
 class LcdDisplay : public LvglDisplay {
@@ -30,13 +43,33 @@ protected:
     lv_obj_t* emoji_label_ = nullptr;
     lv_obj_t* emoji_image_ = nullptr;
     std::unique_ptr<LvglGif> gif_controller_ = nullptr;
+    int gif_slowdown_ = 1;
+    std::unique_ptr<LvglAnimation> animation_controller_ = nullptr;
     lv_obj_t* emoji_box_ = nullptr;
     lv_obj_t* chat_message_label_ = nullptr;
     esp_timer_handle_t preview_timer_ = nullptr;
     std::unique_ptr<LvglImage> preview_image_cached_ = nullptr;
     bool hide_subtitle_ = false;  // Control whether to hide chat messages/subtitles
+    std::string chat_message_role_;  // Role of chat_message_label_
+
+    // Frame statistics, only touched from the LVGL task
+    int64_t refresh_start_us_ = 0;
+    int64_t flush_wait_start_us_ = 0;
+    int64_t perf_since_us_ = 0;
+    uint32_t perf_frames_ = 0;
+    int64_t perf_render_us_ = 0;
+    int64_t perf_flush_wait_us_ = 0;
+    MetricCounter* frame_counter_ = nullptr;
+    MetricHistogram* render_us_ = nullptr;
+    MetricHistogram* flush_wait_us_ = nullptr;
+    int heap_releaser_id_ = 0;
 
     void InitializeLcdThemes();
+    void InitializePerfStats();
+    // Chat message widgets, recycled once MAX_MESSAGES are shown
+    static void* const kMessageContainer;
+    lv_obj_t* AcquireMessageContainer();
+    static void OnDisplayEvent(lv_event_t* e);
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
 
@@ -48,11 +81,13 @@ public:
     ~LcdDisplay();
     virtual void SetEmotion(const char* emotion) override;
     virtual void SetChatMessage(const char* role, const char* content) override;
+    virtual void AppendChatMessage(const char* role, const char* delta) override;
     virtual void ClearChatMessages() override;
     virtual void SetPreviewImage(std::unique_ptr<LvglImage> image) override;
     virtual void SetupUI() override;
     // Add theme switching function
     virtual void SetTheme(Theme* theme) override;
+    virtual void SetAnimationSlowdown(int factor) override;
     
     // Set whether to hide chat messages/subtitles
     void SetHideSubtitle(bool hide);
@@ -63,7 +98,8 @@ class SpiLcdDisplay : public LcdDisplay {
 public:
     SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                   int width, int height, int offset_x, int offset_y,
-                  bool mirror_x, bool mirror_y, bool swap_xy);
+                  bool mirror_x, bool mirror_y, bool swap_xy,
+                  const LcdBufferConfig& buffer_config = LcdBufferConfig());
 };
 
 // RGB LCD display
@@ -79,7 +115,8 @@ class MipiLcdDisplay : public LcdDisplay {
 public:
     MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                    int width, int height, int offset_x, int offset_y,
-                   bool mirror_x, bool mirror_y, bool swap_xy);
+                   bool mirror_x, bool mirror_y, bool swap_xy,
+                   const LcdBufferConfig& buffer_config = LcdBufferConfig{.lines = 50});
 };
 
 #endif // LCD_DISPLAY_H
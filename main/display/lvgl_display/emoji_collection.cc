@@ -27,6 +27,37 @@ EmojiCollection::~EmojiCollection() {
     emoji_collection_.clear();
 }
 
+LazyEmojiCollection::LazyEmojiCollection(std::function<LvglImage*(const std::string& file)> loader)
+    : loader_(loader) {
+}
+
+void LazyEmojiCollection::AddEmojiFile(const std::string& name, const std::string& file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_[name] = file;
+}
+
+const LvglImage* LazyEmojiCollection::GetEmojiImage(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = emoji_collection_.find(name);
+    if (it != emoji_collection_.end()) {
+        return it->second;
+    }
+
+    auto file = files_.find(name);
+    if (file == files_.end()) {
+        ESP_LOGW(TAG, "Emoji not found: %s", name);
+        return nullptr;
+    }
+    // A file that fails to load is not tried again
+    auto image = loader_(file->second);
+    files_.erase(file);
+    if (image == nullptr) {
+        return nullptr;
+    }
+    emoji_collection_[name] = image;
+    return image;
+}
+
 // These are declared in xiaozhi-fonts/src/font_emoji_32.c
 extern const lv_image_dsc_t emoji_1f636_32; // neutral
 extern const lv_image_dsc_t emoji_1f642_32; // happy
@@ -8,6 +8,8 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <functional>
+#include <mutex>
 
 
 // Define interface for emoji collection
@@ -17,10 +19,23 @@ public:
     virtual const LvglImage* GetEmojiImage(const char* name);
     virtual ~EmojiCollection();
 
-private:
+protected:
     std::map<std::string, LvglImage*> emoji_collection_;
 };
 
+// Keeps only the file of each emoji, the image is made by the loader on first use
+class LazyEmojiCollection : public EmojiCollection {
+public:
+    explicit LazyEmojiCollection(std::function<LvglImage*(const std::string& file)> loader);
+    void AddEmojiFile(const std::string& name, const std::string& file);
+    virtual const LvglImage* GetEmojiImage(const char* name) override;
+
+private:
+    std::function<LvglImage*(const std::string& file)> loader_;
+    std::map<std::string, std::string> files_;
+    std::mutex mutex_;
+};
+
 class Twemoji32 : public EmojiCollection {
 public:
     Twemoji32();
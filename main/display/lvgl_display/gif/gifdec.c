@@ -22,13 +22,16 @@ typedef struct Table {
     Entry * entries;
 } Table;
 
+/* Palette expanded to canvas words, allocated in front of the canvas */
+#define GIF_COLORS_SIZE             (0x100 * sizeof(uint32_t))
+
 #if LV_GIF_CACHE_DECODE_DATA
 #define LZW_MAXBITS                 12
 #define LZW_TABLE_SIZE              (1 << LZW_MAXBITS)
 #define LZW_CACHE_SIZE              (LZW_TABLE_SIZE * 4)
 #endif
 
-static gd_GIF  * gif_open(gd_GIF * gif);
+static gd_GIF  * gif_open(gd_GIF * gif, gd_GIF * reuse);
 static bool f_gif_open(gd_GIF * gif, const void * path, bool is_file);
 static inline void f_gif_read(gd_GIF * gif, void * buf, size_t len);
 static inline int f_gif_seek(gd_GIF * gif, size_t pos, int k);
@@ -56,7 +59,7 @@ gd_open_gif_file(const char * fname)
     bool res = f_gif_open(&gif_base, fname, true);
     if(!res) return NULL;
 
-    return gif_open(&gif_base);
+    return gif_open(&gif_base, NULL);
 }
 
 gd_GIF *
@@ -68,16 +71,31 @@ gd_open_gif_data(const void * data)
     bool res = f_gif_open(&gif_base, data, false);
     if(!res) return NULL;
 
-    return gif_open(&gif_base);
+    return gif_open(&gif_base, NULL);
 }
 
-static gd_GIF * gif_open(gd_GIF * gif_base)
+gd_GIF *
+gd_reopen_gif_data(gd_GIF * gif, const void * data)
+{
+    if(!gif) return gd_open_gif_data(data);
+
+    gd_GIF gif_base;
+    memset(&gif_base, 0, sizeof(gif_base));
+
+    f_gif_close(gif);
+    f_gif_open(&gif_base, data, false);
+    return gif_open(&gif_base, gif);
+}
+
+/* Reuses the buffers of |reuse| when they are large enough, |reuse| is freed otherwise */
+static gd_GIF * gif_open(gd_GIF * gif_base, gd_GIF * reuse)
 {
     uint8_t sigver[3];
     uint16_t width, height, depth;
     uint8_t fdsz, bgidx, aspect;
     uint8_t * bgcolor;
     int gct_sz;
+    size_t alloc_size;
     gd_GIF * gif = NULL;
 
     /* Header */
@@ -117,20 +135,30 @@ static gd_GIF * gif_open(gd_GIF * gif_base)
         goto fail;
     }
 #if LV_GIF_CACHE_DECODE_DATA
-    if(0 == (INT_MAX - sizeof(gd_GIF) - LZW_CACHE_SIZE) / width / height / 5){
+    if(0 == (INT_MAX - sizeof(gd_GIF) - GIF_COLORS_SIZE - LZW_CACHE_SIZE) / width / height / 5){
         ESP_LOGW(TAG, "Image dimensions are too large");
         goto fail;
     } 
-    gif = lv_malloc(sizeof(gd_GIF) + 5 * width * height + LZW_CACHE_SIZE);
+    alloc_size = sizeof(gd_GIF) + GIF_COLORS_SIZE + 5 * width * height + LZW_CACHE_SIZE;
 #else
-    if(0 == (INT_MAX - sizeof(gd_GIF)) / width / height / 5){
+    if(0 == (INT_MAX - sizeof(gd_GIF) - GIF_COLORS_SIZE) / width / height / 5){
         ESP_LOGW(TAG, "Image dimensions are too large");
         goto fail;
     } 
-    gif = lv_malloc(sizeof(gd_GIF) + 5 * width * height);
+    alloc_size = sizeof(gd_GIF) + GIF_COLORS_SIZE + 5 * width * height;
 #endif
+    if(reuse && reuse->alloc_size >= alloc_size) {
+        gif = reuse;
+        alloc_size = reuse->alloc_size;
+    }
+    else {
+        lv_free(reuse);
+        gif = lv_malloc(alloc_size);
+    }
+    reuse = NULL;
     if(!gif) goto fail;
     memcpy(gif, gif_base, sizeof(gd_GIF));
+    gif->alloc_size = alloc_size;
     gif->width  = width;
     gif->height = height;
     gif->depth  = depth;
@@ -139,7 +167,9 @@ static gd_GIF * gif_open(gd_GIF * gif_base)
     f_gif_read(gif, gif->gct.colors, 3 * gif->gct.size);
     gif->palette = &gif->gct;
     gif->bgindex = bgidx;
-    gif->canvas = (uint8_t *) &gif[1];
+    gif->colors = (uint32_t *) &gif[1];
+    memset(gif->colors, 0, GIF_COLORS_SIZE);
+    gif->canvas = (uint8_t *) &gif->colors[0x100];
     gif->frame = &gif->canvas[4 * width * height];
     if(gif->bgindex) {
         memset(gif->frame, gif->bgindex, gif->width * gif->height);
@@ -152,11 +182,10 @@ static gd_GIF * gif_open(gd_GIF * gif_base)
 #ifdef GIFDEC_FILL_BG
     GIFDEC_FILL_BG(gif->canvas, gif->width * gif->height, 1, gif->width * gif->height, bgcolor, 0x00);
 #else
+    // 初始化为透明，让第一帧根据自己的透明度设置来渲染
+    uint32_t bg = ((uint32_t)bgcolor[0] << 16) | ((uint32_t)bgcolor[1] << 8) | bgcolor[2];
     for(int i = 0; i < gif->width * gif->height; i++) {
-        gif->canvas[i * 4 + 0] = *(bgcolor + 2);
-        gif->canvas[i * 4 + 1] = *(bgcolor + 1);
-        gif->canvas[i * 4 + 2] = *(bgcolor + 0);
-        gif->canvas[i * 4 + 3] = 0x00;  // 初始化为透明，让第一帧根据自己的透明度设置来渲染
+        ((uint32_t *)gif->canvas)[i] = bg;
     }
 #endif
     gif->anim_start = f_gif_seek(gif, 0, LV_FS_SEEK_CUR);
@@ -164,6 +193,7 @@ static gd_GIF * gif_open(gd_GIF * gif_base)
     goto ok;
 fail:
     f_gif_close(gif_base);
+    lv_free(reuse);
 ok:
     return gif;
 }
@@ -666,21 +696,32 @@ render_frame_rect(gd_GIF * gif, uint8_t * buffer)
                         &gif->frame[i], gif->palette->colors,
                         gif->gce.transparency ? gif->gce.tindex : 0x100);
 #else
-    int j, k;
-    uint8_t index, * color;
-
-    for(j = 0; j < gif->fh; j++) {
-        for(k = 0; k < gif->fw; k++) {
-            index = gif->frame[(gif->fy + j) * gif->width + gif->fx + k];
-            color = &gif->palette->colors[index * 3];
-            if(!gif->gce.transparency || index != gif->gce.tindex) {
-                buffer[(i + k) * 4 + 0] = *(color + 2);
-                buffer[(i + k) * 4 + 1] = *(color + 1);
-                buffer[(i + k) * 4 + 2] = *(color + 0);
-                buffer[(i + k) * 4 + 3] = 0xFF;
+    /* One 32-bit store per pixel, the palette is expanded to canvas words first */
+    uint32_t * colors = gif->colors;
+    const uint8_t * rgb = gif->palette->colors;
+    for(int c = 0; c < gif->palette->size; c++, rgb += 3) {
+        colors[c] = 0xFF000000 | ((uint32_t)rgb[0] << 16) | ((uint32_t)rgb[1] << 8) | rgb[2];
+    }
+    int tindex = gif->gce.transparency ? gif->gce.tindex : 0x100;
+
+    uint32_t * dst = (uint32_t *)buffer + i;
+    const uint8_t * src = &gif->frame[i];
+    for(int j = 0; j < gif->fh; j++) {
+        if(tindex > 0xFF) {
+            for(int k = 0; k < gif->fw; k++) {
+                dst[k] = colors[src[k]];
+            }
+        }
+        else {
+            for(int k = 0; k < gif->fw; k++) {
+                uint8_t index = src[k];
+                if(index != tindex) {
+                    dst[k] = colors[index];
+                }
             }
         }
-        i += gif->width;
+        dst += gif->width;
+        src += gif->width;
     }
 #endif
 }
@@ -701,15 +742,13 @@ dispose(gd_GIF * gif)
 #ifdef GIFDEC_FILL_BG
             GIFDEC_FILL_BG(&(gif->canvas[i * 4]), gif->fw, gif->fh, gif->width, bgcolor, opa);
 #else
-            int j, k;
-            for(j = 0; j < gif->fh; j++) {
-                for(k = 0; k < gif->fw; k++) {
-                    gif->canvas[(i + k) * 4 + 0] = *(bgcolor + 2);
-                    gif->canvas[(i + k) * 4 + 1] = *(bgcolor + 1);
-                    gif->canvas[(i + k) * 4 + 2] = *(bgcolor + 0);
-                    gif->canvas[(i + k) * 4 + 3] = opa;
+            uint32_t color = ((uint32_t)opa << 24) | ((uint32_t)bgcolor[0] << 16) | ((uint32_t)bgcolor[1] << 8) | bgcolor[2];
+            uint32_t * dst = (uint32_t *)gif->canvas + i;
+            for(int j = 0; j < gif->fh; j++) {
+                for(int k = 0; k < gif->fw; k++) {
+                    dst[k] = color;
                 }
-                i += gif->width;
+                dst += gif->width;
             }
 #endif
             break;
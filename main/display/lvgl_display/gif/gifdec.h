@@ -46,6 +46,8 @@ typedef struct _gd_GIF {
     uint16_t fx, fy, fw, fh;
     uint8_t bgindex;
     uint8_t * canvas, * frame;
+    uint32_t * colors; /* Palette expanded to ARGB8888 canvas words */
+    size_t alloc_size;
 #if LV_GIF_CACHE_DECODE_DATA
     uint8_t *lzw_cache;
 #endif
@@ -55,6 +57,9 @@ gd_GIF * gd_open_gif_file(const char * fname);
 
 gd_GIF * gd_open_gif_data(const void * data);
 
+/* Opens |data| in the buffers of |gif| when they are large enough, |gif| must not be used afterwards */
+gd_GIF * gd_reopen_gif_data(gd_GIF * gif, const void * data);
+
 void gd_render_frame(gd_GIF * gif, uint8_t * buffer);
 
 int gd_get_frame(gd_GIF * gif);
@@ -1,5 +1,6 @@
 #include "lvgl_gif.h"
 #include <esp_log.h>
+#include <esp_heap_caps.h>
 #include <cstring>
 
 #define TAG "LvglGif"
@@ -7,16 +8,24 @@
 LvglGif::LvglGif(const lv_img_dsc_t* img_dsc)
     : gif_(nullptr), timer_(nullptr), last_call_(0), playing_(false), loaded_(false),
       loop_delay_ms_(0), loop_waiting_(false), loop_wait_start_(0) {
+    memset(&img_dsc_, 0, sizeof(img_dsc_));
+    Load(img_dsc);
+}
+
+bool LvglGif::Load(const lv_img_dsc_t* img_dsc) {
+    Unload();
     if (!img_dsc || !img_dsc->data) {
         ESP_LOGE(TAG, "Invalid image descriptor");
-        return;
+        return false;
     }
 
-    gif_ = gd_open_gif_data(img_dsc->data);
+    // The decoder buffers are kept when the new GIF fits, so switching emojis does not allocate
+    gif_ = gd_reopen_gif_data(gif_, img_dsc->data);
     if (!gif_) {
         ESP_LOGE(TAG, "Failed to open GIF from image descriptor");
-        return;
+        return false;
     }
+    source_ = img_dsc->data;
 
     // Setup LVGL image descriptor
     memset(&img_dsc_, 0, sizeof(img_dsc_));
@@ -34,8 +43,25 @@ LvglGif::LvglGif(const lv_img_dsc_t* img_dsc)
         gd_render_frame(gif_, gif_->canvas);
     }
 
+    cache_enabled_ = img_dsc_.data_size <= CONFIG_GIF_FRAME_CACHE_SIZE_KB * 1024;
     loaded_ = true;
     ESP_LOGD(TAG, "GIF loaded from image descriptor: %dx%d", gif_->width, gif_->height);
+    return true;
+}
+
+void LvglGif::Unload() {
+    if (timer_) {
+        lv_timer_pause(timer_);
+    }
+    ReleaseFrameCache();
+    playing_ = false;
+    loaded_ = false;
+    loop_waiting_ = false;
+    source_ = nullptr;
+}
+
+const void* LvglGif::source() const {
+    return source_;
 }
 
 // Destructor
@@ -109,7 +135,18 @@ void LvglGif::Stop() {
     // Reset loop waiting state
     loop_waiting_ = false;
 
-    if (gif_) {
+    if (cache_ready_) {
+        // The decoder is not used anymore, rewind the cache instead
+        memcpy(gif_->canvas, frame_cache_[0].pixels, img_dsc_.data_size);
+        cache_delay_ms_ = frame_cache_[0].delay_ms;
+        cache_next_ = 1 % frame_cache_.size();
+        ESP_LOGD(TAG, "GIF animation stopped and rewound");
+        return;
+    }
+    // A partial first loop is of no use once rewound, capture it again
+    ReleaseFrameCache();
+
+    if (loaded_ && gif_) {
         gd_rewind(gif_);
         // Render first frame without advancing
         if (gif_->canvas) {
@@ -140,6 +177,11 @@ void LvglGif::SetLoopCount(int32_t count) {
         return;
     }
     gif_->loop_count = count;
+    // The cache replays forever, go back to the decoder to honor the count
+    if (count != 0) {
+        ReleaseFrameCache();
+        cache_enabled_ = false;
+    }
 }
 
 uint32_t LvglGif::GetLoopDelay() const {
@@ -165,6 +207,10 @@ uint16_t LvglGif::height() const {
     return gif_->height;
 }
 
+void LvglGif::SetSlowdown(uint32_t factor) {
+    slowdown_ = factor > 0 ? factor : 1;
+}
+
 void LvglGif::SetFrameCallback(std::function<void()> callback) {
     frame_callback_ = callback;
 }
@@ -175,6 +221,7 @@ void LvglGif::NextFrame() {
     }
 
     // Check if we're in loop wait state (only for infinite loop GIFs with delay)
+    bool loop_wait_done = false;
     if (loop_waiting_) {
         uint32_t wait_elapsed = lv_tick_elaps(loop_wait_start_);
         if (wait_elapsed < loop_delay_ms_) {
@@ -183,12 +230,18 @@ void LvglGif::NextFrame() {
         }
         // Loop delay completed, continue playing
         loop_waiting_ = false;
+        loop_wait_done = true;
         ESP_LOGD(TAG, "Loop delay completed, continuing GIF");
     }
 
+    if (cache_ready_) {
+        NextCachedFrame(loop_wait_done);
+        return;
+    }
+
     // Check if enough time has passed for the next frame
     uint32_t elapsed = lv_tick_elaps(last_call_);
-    if (elapsed < gif_->gce.delay * 10) {
+    if (elapsed < gif_->gce.delay * 10 * slowdown_) {
         return;
     }
 
@@ -211,7 +264,22 @@ void LvglGif::NextFrame() {
 
     // Detect loop by checking if file position jumped back (rewound to start)
     // This works for looping GIFs regardless of when loop_count is set
-    if (loop_delay_ms_ > 0 && gif_->f_rw_p < pos_before) {
+    bool wrapped = gif_->f_rw_p < pos_before;
+    if (wrapped && cache_enabled_ && !frame_cache_.empty()) {
+        // The whole first loop is cached, playback is a copy from now on
+        cache_ready_ = true;
+        cache_next_ = 0;
+        ESP_LOGD(TAG, "GIF cached %u frames, %u KB", frame_cache_.size(),
+            frame_cache_.size() * img_dsc_.data_size / 1024);
+        if (loop_delay_ms_ > 0) {
+            loop_waiting_ = true;
+            loop_wait_start_ = lv_tick_get();
+            return;
+        }
+        NextCachedFrame(true);
+        return;
+    }
+    if (loop_delay_ms_ > 0 && wrapped) {
         // File position decreased, meaning GIF looped back to beginning
         // Start waiting before rendering this frame
         loop_waiting_ = true;
@@ -223,6 +291,9 @@ void LvglGif::NextFrame() {
     // Render current frame
     if (gif_->canvas) {
         gd_render_frame(gif_, gif_->canvas);
+        if (cache_enabled_) {
+            CacheFrame();
+        }
         
         // Call frame callback if set
         if (frame_callback_) {
@@ -231,6 +302,66 @@ void LvglGif::NextFrame() {
     }
 }
 
+void LvglGif::CacheFrame() {
+    // Only endless loops come back to the first frame, anything else would be copied for nothing
+    size_t frame_size = img_dsc_.data_size;
+    if (gif_->loop_count != 0 || (frame_cache_.size() + 1) * frame_size > CONFIG_GIF_FRAME_CACHE_SIZE_KB * 1024) {
+        ReleaseFrameCache();
+        cache_enabled_ = false;
+        return;
+    }
+
+    auto pixels = (uint8_t*)heap_caps_malloc(frame_size, MALLOC_CAP_SPIRAM);
+    if (pixels == nullptr) {
+        ESP_LOGW(TAG, "Failed to allocate GIF frame cache, keep decoding");
+        ReleaseFrameCache();
+        cache_enabled_ = false;
+        return;
+    }
+    memcpy(pixels, gif_->canvas, frame_size);
+    frame_cache_.push_back({pixels, gif_->gce.delay * 10u});
+}
+
+void LvglGif::NextCachedFrame(bool loop_wait_done) {
+    if (!loop_wait_done) {
+        if (lv_tick_elaps(last_call_) < cache_delay_ms_ * slowdown_) {
+            return;
+        }
+        if (cache_next_ == 0 && loop_delay_ms_ > 0) {
+            loop_waiting_ = true;
+            loop_wait_start_ = lv_tick_get();
+            return;
+        }
+    }
+
+    last_call_ = lv_tick_get();
+    const auto& frame = frame_cache_[cache_next_];
+    memcpy(gif_->canvas, frame.pixels, img_dsc_.data_size);
+    cache_delay_ms_ = frame.delay_ms;
+    cache_next_ = (cache_next_ + 1) % frame_cache_.size();
+
+    if (frame_callback_) {
+        frame_callback_();
+    }
+}
+
+size_t LvglGif::DropFrameCache() {
+    size_t bytes = frame_cache_.size() * img_dsc_.data_size;
+    ReleaseFrameCache();
+    cache_enabled_ = false;
+    return bytes;
+}
+
+void LvglGif::ReleaseFrameCache() {
+    for (auto& frame : frame_cache_) {
+        heap_caps_free(frame.pixels);
+    }
+    frame_cache_.clear();
+    cache_ready_ = false;
+    cache_next_ = 0;
+    cache_delay_ms_ = 0;
+}
+
 void LvglGif::Cleanup() {
     // Stop and delete timer
     if (timer_) {
@@ -238,6 +369,8 @@ void LvglGif::Cleanup() {
         timer_ = nullptr;
     }
 
+    ReleaseFrameCache();
+
     // Close GIF decoder
     if (gif_) {
         gd_close_gif(gif_);
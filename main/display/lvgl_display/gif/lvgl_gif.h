@@ -5,6 +5,7 @@
 #include <lvgl.h>
 #include <memory>
 #include <functional>
+#include <vector>
 
 /**
  * C++ implementation of LVGL GIF widget
@@ -15,6 +16,22 @@ public:
     explicit LvglGif(const lv_img_dsc_t* img_dsc);
     virtual ~LvglGif();
 
+    /**
+     * Switch to another GIF, reusing the decoder buffers when they are large enough.
+     * Playback is stopped, call Start() again.
+     */
+    bool Load(const lv_img_dsc_t* img_dsc);
+
+    /**
+     * Stop and drop the current GIF, the decoder buffers are kept for the next Load()
+     */
+    void Unload();
+
+    /**
+     * GIF data currently loaded, nullptr if none
+     */
+    const void* source() const;
+
     // LvglImage interface implementation
     virtual const lv_img_dsc_t* image_dsc() const;
 
@@ -75,14 +92,26 @@ public:
     uint16_t width() const;
     uint16_t height() const;
 
+    /**
+     * Stretch every frame delay by factor, 1 plays at the speed of the file
+     */
+    void SetSlowdown(uint32_t factor);
+
     /**
      * Set frame update callback
      */
     void SetFrameCallback(std::function<void()> callback);
 
+    /**
+     * Free the cached frames and decode from here on, until the next Load().
+     * Returns the bytes freed.
+     */
+    size_t DropFrameCache();
+
 private:
     // GIF decoder instance
     gd_GIF* gif_;
+    const void* source_ = nullptr;
     
     // LVGL image descriptor
     lv_img_dsc_t img_dsc_;
@@ -104,11 +133,38 @@ private:
     
     // Frame update callback
     std::function<void()> frame_callback_;
+
+    // Rendered frames of the first loop in PSRAM, replayed once the GIF wraps around
+    struct CachedFrame {
+        uint8_t* pixels;
+        uint32_t delay_ms;
+    };
+    std::vector<CachedFrame> frame_cache_;
+    bool cache_enabled_ = false;
+    bool cache_ready_ = false;
+    size_t cache_next_ = 0;
+    uint32_t cache_delay_ms_ = 0;
+    uint32_t slowdown_ = 1;
     
     /**
      * Update to next frame
      */
     void NextFrame();
+
+    /**
+     * Copy the rendered canvas into the frame cache, gives up when it runs over budget
+     */
+    void CacheFrame();
+
+    /**
+     * Show the next cached frame, bypassing the decoder
+     */
+    void NextCachedFrame(bool loop_wait_done);
+
+    /**
+     * Free the cached frames and go back to decoding
+     */
+    void ReleaseFrameCache();
     
     /**
      * Cleanup resources
@@ -3,6 +3,7 @@
 #include <esp_log.h>
 #include <stddef.h>
 #include <string.h>
+#include <mutex>
 #include <utility>
 
 #include "esp_jpeg_common.h"
@@ -11,6 +12,8 @@
 
 #if CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
 #include "driver/jpeg_encode.h"
+#include "esp_cache.h"
+#include "esp_memory_utils.h"
 #endif
 #include "image_to_jpeg.h"
 
@@ -194,8 +197,10 @@ static uint8_t* convert_input_to_encoder_buf(const uint8_t* src, uint16_t width,
 
 #if CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
 static jpeg_encoder_handle_t s_hw_jpeg_handle = NULL;
+static std::mutex s_hw_jpeg_init_mutex;
 
 static bool hw_jpeg_ensure_inited(void) {
+    std::lock_guard<std::mutex> lock(s_hw_jpeg_init_mutex);
     if (s_hw_jpeg_handle) {
         return true;
     }
@@ -212,6 +217,59 @@ static bool hw_jpeg_ensure_inited(void) {
     return true;
 }
 
+// 输出缓冲区在回调模式下复用，避免每次编码都重新申请 DMA 内存
+// 从取得缓冲区到回调返回都持有 s_hw_jpeg_outbuf_mutex，并发的编码依次使用它
+static uint8_t* s_hw_jpeg_outbuf = NULL;
+static size_t s_hw_jpeg_outbuf_size = 0;
+static std::mutex s_hw_jpeg_outbuf_mutex;
+
+static uint8_t* hw_jpeg_get_outbuf(size_t size, size_t* out_size) {
+    if (s_hw_jpeg_outbuf && s_hw_jpeg_outbuf_size >= size) {
+        *out_size = s_hw_jpeg_outbuf_size;
+        return s_hw_jpeg_outbuf;
+    }
+    free(s_hw_jpeg_outbuf);
+    s_hw_jpeg_outbuf_size = 0;
+    jpeg_encode_memory_alloc_cfg_t mem_cfg = { .buffer_direction = JPEG_ENC_ALLOC_OUTPUT_BUFFER };
+    s_hw_jpeg_outbuf = (uint8_t*)jpeg_alloc_encoder_mem(size, &mem_cfg, &s_hw_jpeg_outbuf_size);
+    *out_size = s_hw_jpeg_outbuf_size;
+    return s_hw_jpeg_outbuf;
+}
+
+// 硬件可直接读取的格式，缓冲区按 cache line 对齐时无需拷贝
+static bool hw_jpeg_input_in_place(const uint8_t* src, size_t src_len, uint16_t width, uint16_t height,
+                                   v4l2_pix_fmt_t format, jpeg_enc_input_format_t* out_fmt, int* out_size) {
+    size_t bpp;
+    switch (format) {
+        case V4L2_PIX_FMT_GREY:
+            *out_fmt = JPEG_ENCODE_IN_FORMAT_GRAY;
+            bpp = 1;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            *out_fmt = JPEG_ENCODE_IN_FORMAT_RGB888;
+            bpp = 3;
+            break;
+        case V4L2_PIX_FMT_RGB565:
+            *out_fmt = JPEG_ENCODE_IN_FORMAT_RGB565;
+            bpp = 2;
+            break;
+        default:
+            return false;
+    }
+    size_t sz = (size_t)width * height * bpp;
+    if (src_len < sz) {
+        return false;
+    }
+    size_t align = 0;
+    uint32_t caps = esp_ptr_external_ram(src) ? MALLOC_CAP_SPIRAM : MALLOC_CAP_INTERNAL;
+    if (esp_cache_get_alignment(caps | MALLOC_CAP_DMA, &align) != ESP_OK ||
+        (align > 0 && ((uintptr_t)src % align) != 0)) {
+        return false;
+    }
+    *out_size = (int)sz;
+    return true;
+}
+
 static uint8_t* convert_input_to_hw_encoder_buf(const uint8_t* src, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
                                                 jpeg_enc_input_format_t* out_fmt, int* out_size) {
     if (format == V4L2_PIX_FMT_GREY) {
@@ -285,14 +343,22 @@ static bool encode_with_hw_jpeg(const uint8_t* src, size_t src_len, uint16_t wid
 
     jpeg_enc_input_format_t enc_src_type = JPEG_ENCODE_IN_FORMAT_RGB888;
     int enc_in_size = 0;
-    uint8_t* enc_in = convert_input_to_hw_encoder_buf(src, width, height, format, &enc_src_type, &enc_in_size);
+    uint8_t* enc_in = NULL;
+    // EspVideo 的帧缓冲区已按 cache line 对齐，硬件可直接从中读取
+    bool in_place = hw_jpeg_input_in_place(src, src_len, width, height, format, &enc_src_type, &enc_in_size);
+    if (in_place) {
+        enc_in = const_cast<uint8_t*>(src);
+    } else {
+        enc_in = convert_input_to_hw_encoder_buf(src, width, height, format, &enc_src_type, &enc_in_size);
+    }
     if (!enc_in) {
         ESP_LOGW(TAG, "hw jpeg: unsupported format, fallback to sw");
         return false;
     }
 
     if (!hw_jpeg_ensure_inited()) {
-        free(enc_in);
+        if (!in_place)
+            free(enc_in);
         return false;
     }
 
@@ -306,21 +372,32 @@ static bool encode_with_hw_jpeg(const uint8_t* src, size_t src_len, uint16_t wid
     size_t out_cap = (size_t)width * (size_t)height * 3 / 2 + 64 * 1024;
     if (out_cap < 128 * 1024)
         out_cap = 128 * 1024;
-    jpeg_encode_memory_alloc_cfg_t jpeg_enc_output_mem_cfg = { .buffer_direction = JPEG_ENC_ALLOC_OUTPUT_BUFFER };
     size_t out_cap_aligned = 0;
-    uint8_t* outbuf = (uint8_t*)jpeg_alloc_encoder_mem(out_cap, &jpeg_enc_output_mem_cfg, &out_cap_aligned);
+    uint8_t* outbuf = NULL;
+    std::unique_lock<std::mutex> outbuf_lock(s_hw_jpeg_outbuf_mutex, std::defer_lock);
+    if (cb) {
+        // 回调返回前数据已被取走，缓冲区可留给下一次编码
+        outbuf_lock.lock();
+        outbuf = hw_jpeg_get_outbuf(out_cap, &out_cap_aligned);
+    } else {
+        jpeg_encode_memory_alloc_cfg_t jpeg_enc_output_mem_cfg = { .buffer_direction = JPEG_ENC_ALLOC_OUTPUT_BUFFER };
+        outbuf = (uint8_t*)jpeg_alloc_encoder_mem(out_cap, &jpeg_enc_output_mem_cfg, &out_cap_aligned);
+    }
     if (!outbuf) {
-        free(enc_in);
+        if (!in_place)
+            free(enc_in);
         ESP_LOGE(TAG, "alloc out buffer failed");
         return false;
     }
 
     uint32_t out_len = 0;
     esp_err_t er = jpeg_encoder_process(s_hw_jpeg_handle, &enc_cfg, enc_in, (uint32_t)enc_in_size, outbuf, (uint32_t)out_cap_aligned, &out_len);
-    free(enc_in);
+    if (!in_place)
+        free(enc_in);
 
     if (er != ESP_OK) {
-        free(outbuf);
+        if (!cb)
+            free(outbuf);
         ESP_LOGE(TAG, "jpeg_encoder_process failed: %d", (int)er);
         return false;
     }
@@ -328,7 +405,6 @@ static bool encode_with_hw_jpeg(const uint8_t* src, size_t src_len, uint16_t wid
     if (cb) {
         cb(cb_arg, 0, outbuf, (size_t)out_len);
         cb(cb_arg, 1, NULL, 0);
-        free(outbuf);
         if (jpg_out)
             *jpg_out = NULL;
         if (jpg_out_len)
@@ -465,3 +541,296 @@ bool image_to_jpeg_cb(uint8_t* src, size_t src_len, uint16_t width, uint16_t hei
 #endif
     return encode_with_esp_new_jpeg(src, src_len, width, height, format, quality, NULL, NULL, cb, arg);
 }
+
+bool image_to_jpeg_strips_cb(uint16_t width, uint16_t height, v4l2_pix_fmt_t format, uint8_t quality,
+                             jpg_strip_fill_cb fill, void* fill_arg, jpg_out_cb cb, void* arg) {
+    if (format != V4L2_PIX_FMT_RGB565 && format != V4L2_PIX_FMT_RGB565X) {
+        ESP_LOGE(TAG, "unsupported strip format: 0x%08lx", format);
+        return false;
+    }
+    if (quality < 1)
+        quality = 1;
+    if (quality > 100)
+        quality = 100;
+
+    jpeg_enc_config_t cfg = DEFAULT_JPEG_ENC_CONFIG();
+    cfg.width = width;
+    cfg.height = height;
+    cfg.src_type = JPEG_PIXEL_FORMAT_YCbYCr;
+    cfg.subsampling = JPEG_SUBSAMPLE_420;
+    cfg.quality = quality;
+    cfg.rotate = JPEG_ROTATE_0D;
+    cfg.task_enable = false;
+
+    jpeg_enc_handle_t h = NULL;
+    jpeg_error_t ret = jpeg_enc_open(&cfg, &h);
+    if (ret != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "jpeg_enc_open failed: %d", (int)ret);
+        return false;
+    }
+
+    // 编码器每次消耗一个 MCU 行的 YUYV 数据，条带高度与之一致
+    int block_size = jpeg_enc_get_block_size(h);
+    int lines = block_size / ((int)width * 2);
+    size_t row_size = (size_t)width * 2;
+    // 单个 MCU 行的输出不会超过其未压缩大小
+    int out_cap = block_size + 4 * 1024;
+    uint8_t* strip = (uint8_t*)jpeg_calloc_align(block_size, 16);
+    uint8_t* block = (uint8_t*)jpeg_calloc_align(block_size, 16);
+    uint8_t* outbuf = (uint8_t*)malloc_psram(out_cap);
+    esp_imgfx_color_convert_handle_t convert_handle = nullptr;
+    esp_imgfx_color_convert_cfg_t convert_cfg = {
+        .in_res = {.width = static_cast<int16_t>(width),
+                    .height = static_cast<int16_t>(lines)},
+        .in_pixel_fmt = format == V4L2_PIX_FMT_RGB565 ? ESP_IMGFX_PIXEL_FMT_RGB565_LE : ESP_IMGFX_PIXEL_FMT_RGB565_BE,
+        .out_pixel_fmt = ESP_IMGFX_PIXEL_FMT_YUYV,
+        .color_space_std = ESP_IMGFX_COLOR_SPACE_STD_BT601,
+    };
+    bool ok = lines > 0 && strip && block && outbuf &&
+              esp_imgfx_color_convert_open(&convert_cfg, &convert_handle) == ESP_IMGFX_ERR_OK && convert_handle;
+    if (!ok) {
+        ESP_LOGE(TAG, "alloc strip buffers failed, block size: %d", block_size);
+    }
+
+    for (int y = 0; ok && y < height; y += lines) {
+        int n = height - y < lines ? height - y : lines;
+        if (!fill(fill_arg, (uint16_t)y, (uint16_t)n, strip)) {
+            ok = false;
+            break;
+        }
+        // 最后一条不足一个 MCU 行时重复末行补齐
+        for (int i = n; i < lines; i++) {
+            memcpy(strip + i * row_size, strip + (n - 1) * row_size, row_size);
+        }
+        esp_imgfx_data_t convert_input_data = {
+            .data = strip,
+            .data_len = static_cast<uint32_t>(block_size),
+        };
+        esp_imgfx_data_t convert_output_data = {
+            .data = block,
+            .data_len = static_cast<uint32_t>(block_size),
+        };
+        if (esp_imgfx_color_convert_process(convert_handle, &convert_input_data, &convert_output_data) != ESP_IMGFX_ERR_OK) {
+            ESP_LOGE(TAG, "esp_imgfx_color_convert_process failed");
+            ok = false;
+            break;
+        }
+        int out_len = 0;
+        ret = jpeg_enc_process_with_block(h, block, block_size, outbuf, out_cap, &out_len);
+        if (ret < JPEG_ERR_OK) {
+            ESP_LOGE(TAG, "jpeg_enc_process_with_block failed: %d", (int)ret);
+            ok = false;
+            break;
+        }
+        if (out_len > 0) {
+            cb(arg, 0, outbuf, (size_t)out_len);
+        }
+    }
+    if (ok) {
+        cb(arg, 1, NULL, 0);  // 结束信号
+    }
+
+    if (convert_handle)
+        esp_imgfx_color_convert_close(convert_handle);
+    jpeg_enc_close(h);
+    jpeg_free_align(strip);
+    jpeg_free_align(block);
+    free(outbuf);
+    return ok;
+}
+
+// 最近邻抽样缩小 factor 倍，宽高向下取到 8 的倍数，便于编码器按块处理
+static uint8_t* downscale_image(const uint8_t* src, uint16_t width, uint16_t height, v4l2_pix_fmt_t format, int factor,
+                                uint16_t* out_w, uint16_t* out_h, size_t* out_len) {
+    int dw = (width / factor) & ~7;
+    int dh = (height / factor) & ~7;
+    if (dw <= 0 || dh <= 0)
+        return NULL;
+
+    size_t bpp;
+    switch (format) {
+        case V4L2_PIX_FMT_GREY:
+            bpp = 1;
+            break;
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_RGB565X:
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+            bpp = 2;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            bpp = 3;
+            break;
+        case V4L2_PIX_FMT_YUV420:
+            bpp = 0;  // 平面格式，单独处理
+            break;
+        default:
+            return NULL;
+    }
+
+    size_t sz = bpp ? (size_t)dw * dh * bpp : (size_t)dw * dh * 3 / 2;
+    // 与 EspVideo 的帧一样按 cache line 对齐，硬件编码器可直接读取
+    uint8_t* buf = (uint8_t*)heap_caps_aligned_alloc(64, sz, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!buf)
+        return NULL;
+
+    if (format == V4L2_PIX_FMT_YUV420) {
+        const uint8_t* y_plane = src;
+        const uint8_t* u_plane = y_plane + (size_t)width * height;
+        const uint8_t* v_plane = u_plane + (size_t)(width / 2) * (height / 2);
+        uint8_t* dy = buf;
+        uint8_t* du = dy + (size_t)dw * dh;
+        uint8_t* dv = du + (size_t)(dw / 2) * (dh / 2);
+        for (int y = 0; y < dh; y++) {
+            const uint8_t* row = y_plane + (size_t)y * factor * width;
+            for (int x = 0; x < dw; x++) {
+                *dy++ = row[x * factor];
+            }
+        }
+        for (int y = 0; y < dh / 2; y++) {
+            size_t row = (size_t)y * factor * (width / 2);
+            for (int x = 0; x < dw / 2; x++) {
+                *du++ = u_plane[row + x * factor];
+                *dv++ = v_plane[row + x * factor];
+            }
+        }
+    } else if (format == V4L2_PIX_FMT_YUYV || format == V4L2_PIX_FMT_UYVY) {
+        // 以 4 字节的像素对为单位，亮度逐点取样，色度取自第一个像素所在的像素对
+        bool yuyv = format == V4L2_PIX_FMT_YUYV;
+        uint8_t* d = buf;
+        for (int y = 0; y < dh; y++) {
+            const uint8_t* row = src + (size_t)y * factor * width * 2;
+            for (int x = 0; x < dw; x += 2) {
+                const uint8_t* p0 = row + (size_t)(x * factor / 2) * 4;
+                const uint8_t* p1 = row + (size_t)((x + 1) * factor / 2) * 4;
+                int y0 = (x * factor) & 1;
+                int y1 = ((x + 1) * factor) & 1;
+                if (yuyv) {
+                    d[0] = p0[y0 * 2];
+                    d[1] = p0[1];
+                    d[2] = p1[y1 * 2];
+                    d[3] = p0[3];
+                } else {
+                    d[0] = p0[0];
+                    d[1] = p0[1 + y0 * 2];
+                    d[2] = p0[2];
+                    d[3] = p1[1 + y1 * 2];
+                }
+                d += 4;
+            }
+        }
+    } else {
+        uint8_t* d = buf;
+        for (int y = 0; y < dh; y++) {
+            const uint8_t* row = src + (size_t)y * factor * width * bpp;
+            for (int x = 0; x < dw; x++) {
+                memcpy(d, row + (size_t)x * factor * bpp, bpp);
+                d += bpp;
+            }
+        }
+    }
+
+    *out_w = (uint16_t)dw;
+    *out_h = (uint16_t)dh;
+    *out_len = sz;
+    return buf;
+}
+
+bool image_to_jpeg_fit_cb(uint8_t* src, size_t src_len, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
+                          uint8_t quality, uint16_t max_side, jpg_out_cb cb, void* arg, uint16_t* out_width,
+                          uint16_t* out_height) {
+    uint16_t longest = width > height ? width : height;
+    int factor = max_side > 0 ? (longest + max_side - 1) / max_side : 1;
+    uint8_t* scaled = NULL;
+    if (factor > 1 && format != V4L2_PIX_FMT_JPEG) {
+        uint16_t w = 0, h = 0;
+        size_t len = 0;
+        scaled = downscale_image(src, width, height, format, factor, &w, &h, &len);
+        if (scaled) {
+            src = scaled;
+            src_len = len;
+            width = w;
+            height = h;
+        }
+    }
+    if (out_width)
+        *out_width = width;
+    if (out_height)
+        *out_height = height;
+
+    bool ok = image_to_jpeg_cb(src, src_len, width, height, format, quality, cb, arg);
+    heap_caps_free(scaled);
+    return ok;
+}
+
+static __always_inline uint8_t luma_at(const uint8_t* src, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
+                                       int x, int y) {
+    size_t i = (size_t)y * width + x;
+    switch (format) {
+        case V4L2_PIX_FMT_RGB565: {
+            uint16_t p = ((const uint16_t*)src)[i];
+            return (uint8_t)((expand_5_to_8(p >> 11) * 77 + expand_6_to_8((p >> 5) & 0x3F) * 150 +
+                              expand_5_to_8(p & 0x1F) * 29) >> 8);
+        }
+        case V4L2_PIX_FMT_RGB24: {
+            const uint8_t* p = src + i * 3;
+            return (uint8_t)((p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8);
+        }
+        case V4L2_PIX_FMT_YUYV:
+            return src[i * 2];
+        case V4L2_PIX_FMT_UYVY:
+            return src[i * 2 + 1];
+        default:  // GREY 与 YUV420 的 Y 平面
+            return src[i];
+    }
+}
+
+bool image_luma_hash(const uint8_t* src, size_t src_len, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
+                     uint64_t* hash) {
+    size_t need;
+    switch (format) {
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_YUV420:
+            need = (size_t)width * height;
+            break;
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+            need = (size_t)width * height * 2;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            need = (size_t)width * height * 3;
+            break;
+        default:
+            return false;
+    }
+    if (src == NULL || src_len < need || width < 32 || height < 32)
+        return false;
+
+    // 8x8 分块，每块取 4x4 个采样点
+    uint32_t blocks[64];
+    uint32_t total = 0;
+    for (int by = 0; by < 8; by++) {
+        for (int bx = 0; bx < 8; bx++) {
+            uint32_t sum = 0;
+            for (int sy = 0; sy < 4; sy++) {
+                int y = (by * 4 + sy) * height / 32 + height / 64;
+                for (int sx = 0; sx < 4; sx++) {
+                    int x = (bx * 4 + sx) * width / 32 + width / 64;
+                    sum += luma_at(src, width, height, format, x, y);
+                }
+            }
+            blocks[by * 8 + bx] = sum;
+            total += sum;
+        }
+    }
+
+    uint32_t mean = total / 64;
+    uint64_t h = 0;
+    for (int i = 0; i < 64; i++) {
+        if (blocks[i] > mean)
+            h |= 1ULL << i;
+    }
+    *hash = h;
+    return true;
+}
@@ -79,6 +79,44 @@ extern "C"
     bool image_to_jpeg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height,
                           v4l2_pix_fmt_t format, uint8_t quality, jpg_out_cb cb, void *arg);
 
+    // 条带填充回调：把从第 y 行开始的 lines 行像素紧密排列写入 buf，返回 false 中止编码
+    typedef bool (*jpg_strip_fill_cb)(void *arg, uint16_t y, uint16_t lines, uint8_t *buf);
+
+    /**
+     * @brief 按条带逐段编码 JPEG，不需要整幅图像常驻内存
+     *
+     * 每次向 fill 要一个 MCU 行高度的像素，转换后交给编码器，输出随即通过 cb 交出，
+     * 峰值内存只与图像宽度有关。目前支持 RGB565 与 RGB565X。
+     *
+     * @param fill      条带填充回调
+     * @param fill_arg  传递给 fill 的用户参数
+     */
+    bool image_to_jpeg_strips_cb(uint16_t width, uint16_t height, v4l2_pix_fmt_t format, uint8_t quality,
+                                 jpg_strip_fill_cb fill, void *fill_arg, jpg_out_cb cb, void *arg);
+
+    /**
+     * @brief 与 image_to_jpeg_cb 相同，但先按整数倍抽样缩小，使最长边不超过 max_side
+     *
+     * 用于按网络状况降低上传的数据量。max_side 为 0 或图像本身已足够小时不缩放，
+     * JPEG 输入和不支持抽样的格式也按原尺寸编码。
+     *
+     * @param max_side  输出图像最长边的上限（像素）
+     * @param out_width  实际编码的宽度，可为 NULL
+     * @param out_height 实际编码的高度，可为 NULL
+     */
+    bool image_to_jpeg_fit_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height,
+                              v4l2_pix_fmt_t format, uint8_t quality, uint16_t max_side,
+                              jpg_out_cb cb, void *arg, uint16_t *out_width, uint16_t *out_height);
+
+    /**
+     * @brief 计算图像亮度的 64 位感知哈希（8x8 分块均值与整体均值比较）
+     *
+     * 每块只稀疏采样 16 个点，开销远小于一次编码，用于判断画面是否变化。
+     * 两次哈希的汉明距离越小画面越接近，JPEG 输入与不支持的格式返回 false。
+     */
+    bool image_luma_hash(const uint8_t *src, size_t src_len, uint16_t width, uint16_t height,
+                         v4l2_pix_fmt_t format, uint64_t *hash);
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,6 +2,7 @@
 #include <esp_err.h>
 #include <esp_heap_caps.h>
 #include <sys/param.h>
+#include <string.h>
 
 #include "esp_jpeg_common.h"
 #include "esp_jpeg_dec.h"
@@ -20,8 +21,8 @@
 
 #define TAG "jpeg_to_image"
 
-static esp_err_t decode_with_new_jpeg(const uint8_t* src, size_t src_len, uint8_t** out, size_t* out_len, size_t* width,
-                                      size_t* height, size_t* stride) {
+static esp_err_t decode_with_new_jpeg(const uint8_t* src, size_t src_len, size_t max_width, size_t max_height,
+                                      uint8_t** out, size_t* out_len, size_t* width, size_t* height, size_t* stride) {
     ESP_LOGD(TAG, "Decoding JPEG with software decoder");
     esp_err_t ret = ESP_OK;
     jpeg_error_t jpeg_ret = JPEG_ERR_OK;
@@ -53,6 +54,41 @@ static esp_err_t decode_with_new_jpeg(const uint8_t* src, size_t src_len, uint8_
 
     ESP_LOGD(TAG, "JPEG header info: width=%d, height=%d", out_info.width, out_info.height);
 
+    // The decoder scales by 1/2, 1/4 or 1/8 as long as the output stays a multiple of 8 pixels
+    int shift = 0;
+    if (max_width > 0 && max_height > 0) {
+        while (shift < 3 &&
+               ((size_t)(out_info.width >> shift) > max_width || (size_t)(out_info.height >> shift) > max_height) &&
+               out_info.width % (16 << shift) == 0 && out_info.height % (16 << shift) == 0) {
+            shift++;
+        }
+    }
+    if (shift > 0) {
+        // The scale is part of the open config, reopen the decoder with it
+        jpeg_dec_close(jpeg_dec);
+        jpeg_dec = NULL;
+        config.scale.width = out_info.width >> shift;
+        config.scale.height = out_info.height >> shift;
+        jpeg_ret = jpeg_dec_open(&config, &jpeg_dec);
+        if (jpeg_ret != JPEG_ERR_OK) {
+            ESP_LOGE(TAG, "Failed to open JPEG decoder");
+            ret = ESP_FAIL;
+            goto jpeg_dec_failed;
+        }
+        memset(&jpeg_io, 0, sizeof(jpeg_io));
+        jpeg_io.inbuf = (uint8_t*)src;
+        jpeg_io.inbuf_len = (int)src_len;
+        jpeg_ret = jpeg_dec_parse_header(jpeg_dec, &jpeg_io, &out_info);
+        if (jpeg_ret != JPEG_ERR_OK) {
+            ESP_LOGE(TAG, "Failed to parse JPEG header");
+            ret = ESP_ERR_INVALID_ARG;
+            goto jpeg_dec_failed;
+        }
+        ESP_LOGD(TAG, "Decoding at 1/%d: width=%d, height=%d", 1 << shift, config.scale.width, config.scale.height);
+        out_info.width = config.scale.width;
+        out_info.height = config.scale.height;
+    }
+
     out_buf = jpeg_calloc_align(out_info.width * out_info.height * 2, 16);
     if (out_buf == NULL) {
         ESP_LOGE(TAG, "Failed to allocate memory for JPEG output buffer");
@@ -244,6 +280,11 @@ jpeg_hw_dec_failed:
 
 esp_err_t jpeg_to_image(const uint8_t* src, size_t src_len, uint8_t** out, size_t* out_len, size_t* width,
                         size_t* height, size_t* stride) {
+    return jpeg_to_image_fit(src, src_len, 0, 0, out, out_len, width, height, stride);
+}
+
+esp_err_t jpeg_to_image_fit(const uint8_t* src, size_t src_len, size_t max_width, size_t max_height, uint8_t** out,
+                            size_t* out_len, size_t* width, size_t* height, size_t* stride) {
 #ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_DEBUG_MODE
     esp_log_level_set(TAG, ESP_LOG_DEBUG);
 #endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_DEBUG_MODE
@@ -260,5 +301,5 @@ esp_err_t jpeg_to_image(const uint8_t* src, size_t src_len, uint8_t** out, size_
     ESP_LOGW(TAG, "Failed to decode with hardware JPEG, fallback to software decoder");
     // Fallback to esp_new_jpeg
 #endif
-    return decode_with_new_jpeg(src, src_len, out, out_len, width, height, stride);
+    return decode_with_new_jpeg(src, src_len, max_width, max_height, out, out_len, width, height, stride);
 }
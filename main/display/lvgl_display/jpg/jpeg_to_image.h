@@ -55,6 +55,20 @@ extern "C" {
 esp_err_t jpeg_to_image(const uint8_t* src, size_t src_len, uint8_t** out, size_t* out_len, size_t* width,
                         size_t* height, size_t* stride);
 
+/**
+ * @brief Same as jpeg_to_image(), but lets the software decoder scale the image by 1/2, 1/4 or 1/8 while decoding
+ *        so that it fits in max_width x max_height, without a full resolution buffer in between
+ *
+ * @param[in] max_width Width of the box the image is shown in, 0 to decode at full resolution
+ * @param[in] max_height Height of the box the image is shown in, 0 to decode at full resolution
+ *
+ * @note The scale is only applied while the output stays a multiple of 8 pixels, so the result can still be larger
+ *       than the box. The hardware decoder does not scale, on targets that use it the image is decoded at full
+ *       resolution and is left to the display to scale.
+ */
+esp_err_t jpeg_to_image_fit(const uint8_t* src, size_t src_len, size_t max_width, size_t max_height, uint8_t** out,
+                            size_t* out_len, size_t* width, size_t* height, size_t* stride);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,193 @@
+#include "lvgl_animation.h"
+#include "heap_placement.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "LvglAnimation"
+
+#define ANIMATION_MAGIC "XZAN"
+#define ANIMATION_VERSION 1
+
+static size_t BytesPerPixel(uint8_t color_format) {
+    return color_format == LV_COLOR_FORMAT_RGB565A8 ? 3 : 2;
+}
+
+LvglAnimation::LvglAnimation() {
+    memset(&img_dsc_, 0, sizeof(img_dsc_));
+}
+
+LvglAnimation::~LvglAnimation() {
+    if (timer_) {
+        lv_timer_delete(timer_);
+    }
+    HeapPlacement::Free(kHeapSubsystemDisplay, canvas_);
+}
+
+bool LvglAnimation::IsAnimation(const void* data, size_t size) {
+    return size >= sizeof(Header) && memcmp(data, ANIMATION_MAGIC, 4) == 0;
+}
+
+LvglAnimation::Frame LvglAnimation::GetFrame(uint16_t index) const {
+    Frame frame;
+    memcpy(&frame, source_ + sizeof(Header) + index * sizeof(Frame), sizeof(frame));
+    return frame;
+}
+
+// Every rectangle inside the image and its pixels inside the asset, frame 0 covering all of it
+bool LvglAnimation::CheckFrames(size_t size) const {
+    if (header_.frames == 0 || sizeof(Header) + header_.frames * sizeof(Frame) > size) {
+        return false;
+    }
+    size_t bytes_per_pixel = BytesPerPixel(header_.color_format);
+    for (uint16_t i = 0; i < header_.frames; i++) {
+        Frame frame = GetFrame(i);
+        if (i == 0 && (frame.x != 0 || frame.y != 0 || frame.w != header_.width || frame.h != header_.height)) {
+            return false;
+        }
+        if (frame.x + frame.w > header_.width || frame.y + frame.h > header_.height) {
+            return false;
+        }
+        if (frame.offset > size || (size_t)frame.w * frame.h * bytes_per_pixel > size - frame.offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LvglAnimation::Load(const lv_img_dsc_t* img_dsc) {
+    Unload();
+    if (!img_dsc || !img_dsc->data || !IsAnimation(img_dsc->data, img_dsc->data_size)) {
+        ESP_LOGE(TAG, "Invalid image descriptor");
+        return false;
+    }
+
+    source_ = img_dsc->data;
+    memcpy(&header_, source_, sizeof(header_));
+    if (header_.version != ANIMATION_VERSION
+        || (header_.color_format != LV_COLOR_FORMAT_RGB565 && header_.color_format != LV_COLOR_FORMAT_RGB565A8)) {
+        ESP_LOGE(TAG, "Unsupported animation version %u, color format 0x%02x", header_.version, header_.color_format);
+        return false;
+    }
+    if (!CheckFrames(img_dsc->data_size)) {
+        ESP_LOGE(TAG, "Animation frames out of bounds");
+        return false;
+    }
+
+    // The canvas is kept when the new animation fits, so switching emojis does not allocate
+    size_t canvas_size = (size_t)header_.width * header_.height * BytesPerPixel(header_.color_format);
+    if (canvas_size > canvas_capacity_) {
+        HeapPlacement::Free(kHeapSubsystemDisplay, canvas_);
+        canvas_capacity_ = 0;
+        canvas_ = (uint8_t*)HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemDisplay, canvas_size);
+        if (canvas_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate the %ux%u canvas", header_.width, header_.height);
+            return false;
+        }
+        canvas_capacity_ = canvas_size;
+    }
+
+    memset(&img_dsc_, 0, sizeof(img_dsc_));
+    img_dsc_.header.magic = LV_IMAGE_HEADER_MAGIC;
+    img_dsc_.header.flags = LV_IMAGE_FLAGS_MODIFIABLE;
+    img_dsc_.header.cf = header_.color_format;
+    img_dsc_.header.w = header_.width;
+    img_dsc_.header.h = header_.height;
+    img_dsc_.header.stride = header_.width * 2;
+    img_dsc_.data = canvas_;
+    img_dsc_.data_size = canvas_size;
+
+    loaded_ = true;
+    Stop();
+    ESP_LOGD(TAG, "Animation loaded: %ux%u, %u frames", header_.width, header_.height, header_.frames);
+    return true;
+}
+
+void LvglAnimation::Unload() {
+    if (timer_) {
+        lv_timer_pause(timer_);
+    }
+    playing_ = false;
+    loaded_ = false;
+    source_ = nullptr;
+}
+
+void LvglAnimation::Start() {
+    if (!loaded_) {
+        ESP_LOGW(TAG, "Animation not loaded, cannot start");
+        return;
+    }
+    if (!timer_) {
+        timer_ = lv_timer_create([](lv_timer_t* timer) {
+            static_cast<LvglAnimation*>(lv_timer_get_user_data(timer))->NextFrame();
+        }, 10, this);
+        if (!timer_) {
+            return;
+        }
+    }
+    playing_ = true;
+    last_call_ = lv_tick_get();
+    lv_timer_resume(timer_);
+    lv_timer_reset(timer_);
+}
+
+void LvglAnimation::Stop() {
+    if (timer_) {
+        lv_timer_pause(timer_);
+    }
+    playing_ = false;
+    if (loaded_) {
+        CopyFrame(0);
+        delay_ms_ = GetFrame(0).delay_ms;
+        next_frame_ = 1;
+        loops_done_ = 0;
+    }
+}
+
+void LvglAnimation::SetFrameCallback(std::function<void()> callback) {
+    frame_callback_ = callback;
+}
+
+void LvglAnimation::NextFrame() {
+    if (!loaded_ || !playing_ || lv_tick_elaps(last_call_) < delay_ms_) {
+        return;
+    }
+    last_call_ = lv_tick_get();
+
+    if (next_frame_ == header_.frames) {
+        loops_done_++;
+        if (header_.loop != 0 && loops_done_ >= header_.loop) {
+            // Finished, the last frame stays on screen
+            playing_ = false;
+            lv_timer_pause(timer_);
+            return;
+        }
+        next_frame_ = 0;
+    }
+
+    CopyFrame(next_frame_);
+    delay_ms_ = GetFrame(next_frame_).delay_ms;
+    next_frame_++;
+
+    if (frame_callback_) {
+        frame_callback_();
+    }
+}
+
+// Only the rectangle that changed is copied, rows of the color plane and then of the alpha plane
+void LvglAnimation::CopyFrame(uint16_t index) {
+    Frame frame = GetFrame(index);
+    const uint8_t* pixels = source_ + frame.offset;
+    size_t row_size = frame.w * 2;
+    for (uint16_t row = 0; row < frame.h; row++) {
+        memcpy(canvas_ + ((frame.y + row) * header_.width + frame.x) * 2, pixels, row_size);
+        pixels += row_size;
+    }
+    if (header_.color_format == LV_COLOR_FORMAT_RGB565A8) {
+        uint8_t* alpha = canvas_ + header_.width * header_.height * 2;
+        for (uint16_t row = 0; row < frame.h; row++) {
+            memcpy(alpha + (frame.y + row) * header_.width + frame.x, pixels, frame.w);
+            pixels += frame.w;
+        }
+    }
+}
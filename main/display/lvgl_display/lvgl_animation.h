@@ -0,0 +1,109 @@
+#pragma once
+
+#include <lvgl.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/*
+ * Plays the emoji animations that scripts/spiffs_assets/emoji_anim.py converts from GIF, so frames are
+ * copied instead of LZW decoded and blended. All values are little endian:
+ *
+ *   |"XZAN"|version 1u|color format 1u|frames 2u|width 2u|height 2u|loop 2u|reserved 2u|
+ *   |frame table: offset 4u|delay_ms 2u|x 2u|y 2u|w 2u|h 2u|reserved 2u| x frames|frame data|
+ *
+ * The color format is LV_COLOR_FORMAT_RGB565 or LV_COLOR_FORMAT_RGB565A8. The data of a frame is the
+ * rectangle that changed since the previous one, h rows of w RGB565 pixels followed by h rows of w
+ * alpha bytes for RGB565A8. Frame 0 covers the whole image, a frame with w == 0 only waits. A loop of
+ * 0 repeats forever, otherwise the animation plays that many times and stays on its last frame.
+ */
+class LvglAnimation {
+public:
+    LvglAnimation();
+    ~LvglAnimation();
+
+    LvglAnimation(const LvglAnimation&) = delete;
+    LvglAnimation& operator=(const LvglAnimation&) = delete;
+
+    static bool IsAnimation(const void* data, size_t size);
+
+    /**
+     * Switch to another animation, reusing the canvas when it is large enough.
+     * Playback is stopped, call Start() again.
+     */
+    bool Load(const lv_img_dsc_t* img_dsc);
+
+    /**
+     * Stop and drop the current animation, the canvas is kept for the next Load()
+     */
+    void Unload();
+
+    /**
+     * Animation data currently loaded, nullptr if none
+     */
+    const void* source() const { return loaded_ ? source_ : nullptr; }
+
+    const lv_img_dsc_t* image_dsc() const { return loaded_ ? &img_dsc_ : nullptr; }
+
+    /**
+     * Start the animation from its first frame
+     */
+    void Start();
+
+    /**
+     * Stop the animation and rewind to the first frame
+     */
+    void Stop();
+
+    bool IsPlaying() const { return playing_; }
+    bool IsLoaded() const { return loaded_; }
+
+    /**
+     * Called after each frame was copied into the canvas
+     */
+    void SetFrameCallback(std::function<void()> callback);
+
+private:
+    struct Header {
+        char magic[4];
+        uint8_t version;
+        uint8_t color_format;
+        uint16_t frames;
+        uint16_t width;
+        uint16_t height;
+        uint16_t loop;
+        uint16_t reserved;
+    };
+    struct Frame {
+        uint32_t offset;
+        uint16_t delay_ms;
+        uint16_t x;
+        uint16_t y;
+        uint16_t w;
+        uint16_t h;
+        uint16_t reserved;
+    };
+
+    // The asset may sit at any address in flash, the header and frames are copied out before use
+    const uint8_t* source_ = nullptr;
+    Header header_ = {};
+
+    uint8_t* canvas_ = nullptr;
+    size_t canvas_capacity_ = 0;
+    lv_img_dsc_t img_dsc_;
+
+    lv_timer_t* timer_ = nullptr;
+    uint32_t last_call_ = 0;
+    uint32_t delay_ms_ = 0;
+    uint16_t next_frame_ = 0;
+    uint16_t loops_done_ = 0;
+    bool playing_ = false;
+    bool loaded_ = false;
+
+    std::function<void()> frame_callback_;
+
+    Frame GetFrame(uint16_t index) const;
+    bool CheckFrames(size_t size) const;
+    void NextFrame();
+    void CopyFrame(uint16_t index);
+};
@@ -1,6 +1,7 @@
 #include <esp_log.h>
 #include <esp_err.h>
 #include <string>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <font_awesome.h>
@@ -10,9 +11,12 @@
 #include "application.h"
 #include "audio_codec.h"
 #include "settings.h"
+#include "deferred_log.h"
 #include "assets/lang_config.h"
 #include "jpg/image_to_jpeg.h"
 
+#include <lvgl_private.h>
+
 #define TAG "Display"
 
 LvglDisplay::LvglDisplay() {
@@ -41,6 +45,12 @@ LvglDisplay::LvglDisplay() {
 }
 
 LvglDisplay::~LvglDisplay() {
+    if (update_timer_ != nullptr) {
+        lv_timer_delete(update_timer_);
+    }
+    if (idle_timer_ != nullptr) {
+        lv_timer_delete(idle_timer_);
+    }
     if (notification_timer_ != nullptr) {
         esp_timer_stop(notification_timer_);
         esp_timer_delete(notification_timer_);
@@ -69,10 +79,130 @@ LvglDisplay::~LvglDisplay() {
     }
 }
 
+void LvglDisplay::InitializeUpdateQueue() {
+    update_timer_ = lv_timer_create([](lv_timer_t* timer) {
+        static_cast<LvglDisplay*>(lv_timer_get_user_data(timer))->ApplyPendingUpdates();
+    }, LV_DEF_REFR_PERIOD, this);
+    idle_timer_ = lv_timer_create([](lv_timer_t* timer) {
+        static_cast<LvglDisplay*>(lv_timer_get_user_data(timer))->OnIdleTimer();
+    }, DISPLAY_IDLE_DELAY_MS, this);
+    lv_timer_pause(idle_timer_);
+
+    auto& metrics = Metrics::GetInstance();
+    update_us_ = metrics.AddHistogram("display.update_us");
+    update_deferred_ = metrics.AddCounter("display.update_deferred");
+}
+
+bool LvglDisplay::DeferStatus(const char* status) {
+    if (!ShouldDefer()) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(pending_mutex_);
+    status_pending_ = true;
+    pending_status_ = status;
+    lock.unlock();
+    WakeFromIdle();
+    return true;
+}
+
+bool LvglDisplay::DeferEmotion(const char* emotion) {
+    if (!ShouldDefer()) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(pending_mutex_);
+    emotion_pending_ = true;
+    pending_emotion_ = emotion;
+    lock.unlock();
+    WakeFromIdle();
+    return true;
+}
+
+bool LvglDisplay::DeferChatMessage(PendingChatMessage::Kind kind, const char* role, const char* content) {
+    if (!ShouldDefer()) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(pending_mutex_);
+    if (kind == PendingChatMessage::kClear) {
+        // Nothing queued before a clear would stay on screen
+        pending_messages_.clear();
+    } else if (pending_messages_.size() >= DISPLAY_MAX_PENDING_MESSAGES) {
+        DLOGW(TAG, "Too many pending chat messages, dropping the oldest");
+        pending_messages_.pop_front();
+    }
+    pending_messages_.push_back(PendingChatMessage{kind, role != nullptr ? role : "", content != nullptr ? content : ""});
+    lock.unlock();
+    WakeFromIdle();
+    return true;
+}
+
+// Runs on the LVGL task with the display locked
+void LvglDisplay::ApplyPendingUpdates() {
+    lvgl_task_ = xTaskGetCurrentTaskHandle();
+
+    bool status_pending, emotion_pending, status_bar_pending;
+    std::string status, emotion;
+    StatusBarState status_bar;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        status_pending = status_pending_;
+        emotion_pending = emotion_pending_;
+        status_bar_pending = status_bar_pending_;
+        if (!status_pending && !emotion_pending && !status_bar_pending && pending_messages_.empty()) {
+            return;
+        }
+        status.swap(pending_status_);
+        emotion.swap(pending_emotion_);
+        status_bar = pending_status_bar_;
+        status_pending_ = emotion_pending_ = status_bar_pending_ = false;
+    }
+
+    int64_t start = esp_timer_get_time();
+    if (status_pending) {
+        SetStatus(status.c_str());
+    }
+    if (emotion_pending) {
+        SetEmotion(emotion.c_str());
+    }
+    if (status_bar_pending) {
+        ApplyStatusBar(status_bar);
+    }
+    // One message at a time, at least one per frame, until the budget is spent
+    for (int applied = 0; ; applied++) {
+        PendingChatMessage message;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            if (pending_messages_.empty()) {
+                break;
+            }
+            if (applied > 0 && esp_timer_get_time() - start >= DISPLAY_UPDATE_BUDGET_US) {
+                update_deferred_->Add();
+                break;
+            }
+            message = std::move(pending_messages_.front());
+            pending_messages_.pop_front();
+        }
+        switch (message.kind) {
+        case PendingChatMessage::kSet:
+            SetChatMessage(message.role.c_str(), message.content.c_str());
+            break;
+        case PendingChatMessage::kAppend:
+            AppendChatMessage(message.role.c_str(), message.content.c_str());
+            break;
+        case PendingChatMessage::kClear:
+            ClearChatMessages();
+            break;
+        }
+    }
+    update_us_->Record(esp_timer_get_time() - start);
+}
+
 void LvglDisplay::SetStatus(const char* status) {
     if (!setup_ui_called_) {
         ESP_LOGW(TAG, "SetStatus('%s') called before SetupUI() - message will be lost!", status);
     }
+    if (DeferStatus(status)) {
+        return;
+    }
     DisplayLockGuard lock(this);
     if (status_label_ == nullptr) {
         if (setup_ui_called_) {
@@ -80,9 +210,16 @@ void LvglDisplay::SetStatus(const char* status) {
         }
         return;
     }
-    lv_label_set_text(status_label_, status);
-    lv_obj_remove_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
-    lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
+    // The clock sets the same text most of the time, leave the labels alone then
+    if (strcmp(lv_label_get_text(status_label_), status) != 0) {
+        lv_label_set_text(status_label_, status);
+    }
+    if (lv_obj_has_flag(status_label_, LV_OBJ_FLAG_HIDDEN)) {
+        lv_obj_remove_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
+    }
+    if (!lv_obj_has_flag(notification_label_, LV_OBJ_FLAG_HIDDEN)) {
+        lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
+    }
 
     last_status_update_time_ = std::chrono::system_clock::now();
 }
@@ -110,27 +247,28 @@ void LvglDisplay::ShowNotification(const char* notification, int duration_ms) {
     ESP_ERROR_CHECK(esp_timer_start_once(notification_timer_, duration_ms * 1000));
 }
 
+// Reads the state on the calling task, only the label updates go to the LVGL task
 void LvglDisplay::UpdateStatusBar(bool update_all) {
     auto& app = Application::GetInstance();
     auto& board = Board::GetInstance();
     auto codec = board.GetAudioCodec();
 
-    // Update mute icon
-    {
-        DisplayLockGuard lock(this);
-        if (mute_label_ == nullptr) {
-            return;
-        }
-
-        // Update icon if mute state changes
-        if (codec->output_volume() == 0 && !muted_) {
-            muted_ = true;
-            lv_label_set_text(mute_label_, FONT_AWESOME_VOLUME_XMARK);
-        } else if (codec->output_volume() > 0 && muted_) {
-            muted_ = false;
-            lv_label_set_text(mute_label_, "");
-        }
+    if (mute_label_ == nullptr) {
+        return;
+    }
+    // Nothing to show while the screen is off, everything is read again once it is back
+    auto backlight = board.GetBacklight();
+    if (IsScreenHidden()) {
+        status_bar_skipped_ = true;
+        RequestIdle();
+        return;
     }
+    if (status_bar_skipped_) {
+        status_bar_skipped_ = false;
+        update_all = true;
+    }
+    StatusBarState state;
+    state.muted = codec->output_volume() == 0;
 
     // Update time
     if (app.GetDeviceState() == kDeviceStateIdle) {
@@ -153,10 +291,9 @@ void LvglDisplay::UpdateStatusBar(bool update_all) {
     // Update battery icon
     int battery_level;
     bool charging, discharging;
-    const char* icon = nullptr;
     if (board.GetBatteryLevel(battery_level, charging, discharging)) {
         if (charging) {
-            icon = FONT_AWESOME_BATTERY_BOLT;
+            state.battery_icon = FONT_AWESOME_BATTERY_BOLT;
         } else {
             const char* levels[] = {
                 FONT_AWESOME_BATTERY_EMPTY, // 0-19%
@@ -166,27 +303,14 @@ void LvglDisplay::UpdateStatusBar(bool update_all) {
                 FONT_AWESOME_BATTERY_FULL, // 80-99%
                 FONT_AWESOME_BATTERY_FULL, // 100%
             };
-            icon = levels[battery_level / 20];
+            state.battery_icon = levels[battery_level / 20];
         }
-        DisplayLockGuard lock(this);
-        if (battery_label_ != nullptr && battery_icon_ != icon) {
-            battery_icon_ = icon;
-            lv_label_set_text(battery_label_, battery_icon_);
-        }
-
-        if (low_battery_popup_ != nullptr) {
-            if (strcmp(icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging) {
-                if (lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // Show if low battery popup is hidden
-                    lv_obj_remove_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
-                    app.PlaySound(Lang::Sounds::OGG_LOW_BATTERY);
-                }
-            } else {
-                // Hide the low battery popup when the battery is not empty
-                if (!lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // Hide if low battery popup is shown
-                    lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
-                }
-            }
+        state.low_battery = strcmp(state.battery_icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging;
+        // Warn once each time the battery runs low
+        if (state.low_battery && !low_battery_warned_ && low_battery_popup_ != nullptr) {
+            app.PlaySound(Lang::Sounds::OGG_LOW_BATTERY);
         }
+        low_battery_warned_ = state.low_battery;
     }
 
     // Update network icon every 10 seconds
@@ -202,54 +326,267 @@ void LvglDisplay::UpdateStatusBar(bool update_all) {
             kDeviceStateActivating,
         };
         if (std::find(allowed_states.begin(), allowed_states.end(), device_state) != allowed_states.end()) {
-            icon = board.GetNetworkStateIcon();
-            if (network_label_ != nullptr && icon != nullptr && network_icon_ != icon) {
-                DisplayLockGuard lock(this);
-                network_icon_ = icon;
-                lv_label_set_text(network_label_, network_icon_);
+            state.network_icon = board.GetNetworkStateIcon();
+        }
+    }
+    esp_pm_lock_release(pm_lock_);
+
+    if (status_bar_sent_ && !update_all && state.muted == sent_status_bar_.muted
+        && (state.battery_icon == nullptr || (state.battery_icon == sent_status_bar_.battery_icon
+            && state.low_battery == sent_status_bar_.low_battery))
+        && (state.network_icon == nullptr || state.network_icon == sent_status_bar_.network_icon)) {
+        return;
+    }
+    sent_status_bar_.muted = state.muted;
+    if (state.battery_icon != nullptr) {
+        sent_status_bar_.battery_icon = state.battery_icon;
+        sent_status_bar_.low_battery = state.low_battery;
+    }
+    if (state.network_icon != nullptr) {
+        sent_status_bar_.network_icon = state.network_icon;
+    }
+    status_bar_sent_ = true;
+
+    if (ShouldDefer()) {
+        std::unique_lock<std::mutex> lock(pending_mutex_);
+        // Icons not read this time keep what an earlier pending update had
+        if (status_bar_pending_) {
+            if (state.battery_icon == nullptr) {
+                state.battery_icon = pending_status_bar_.battery_icon;
+                state.low_battery = pending_status_bar_.low_battery;
+            }
+            if (state.network_icon == nullptr) {
+                state.network_icon = pending_status_bar_.network_icon;
             }
         }
+        pending_status_bar_ = state;
+        status_bar_pending_ = true;
+        lock.unlock();
+        WakeFromIdle();
+        return;
     }
+    ApplyStatusBar(state);
+}
 
-    esp_pm_lock_release(pm_lock_);
+void LvglDisplay::ApplyStatusBar(const StatusBarState& state) {
+    DisplayLockGuard lock(this);
+    if (mute_label_ == nullptr) {
+        return;
+    }
+
+    // Update icon if mute state changes
+    if (state.muted != muted_) {
+        muted_ = state.muted;
+        lv_label_set_text(mute_label_, muted_ ? FONT_AWESOME_VOLUME_XMARK : "");
+    }
+
+    if (state.battery_icon != nullptr) {
+        if (battery_label_ != nullptr && battery_icon_ != state.battery_icon) {
+            battery_icon_ = state.battery_icon;
+            lv_label_set_text(battery_label_, battery_icon_);
+        }
+        if (low_battery_popup_ != nullptr) {
+            if (state.low_battery && lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) {
+                lv_obj_remove_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
+            } else if (!state.low_battery && !lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) {
+                // Hide the low battery popup when the battery is not empty
+                lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
+            }
+        }
+    }
+
+    if (state.network_icon != nullptr && network_label_ != nullptr && network_icon_ != state.network_icon) {
+        network_icon_ = state.network_icon;
+        lv_label_set_text(network_label_, network_icon_);
+    }
 }
 
 void LvglDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
 }
 
 void LvglDisplay::SetPowerSaveMode(bool on) {
+    power_save_ = on;
     if (on) {
         SetChatMessage("system", "");
         SetEmotion("sleepy");
+        RequestIdle();
     } else {
         SetChatMessage("system", "");
         SetEmotion("neutral");
     }
 }
 
-bool LvglDisplay::SnapshotToJpeg(std::string& jpeg_data, int quality) {
-#if CONFIG_LV_USE_SNAPSHOT
+void LvglDisplay::SetRefreshSlowdown(int factor) {
+    if (display_ == nullptr) {
+        return;
+    }
+    DisplayLockGuard lock(this);
+    if (auto timer = lv_display_get_refr_timer(display_)) {
+        lv_timer_set_period(timer, LV_DEF_REFR_PERIOD * std::max(factor, 1));
+    }
+}
+
+bool LvglDisplay::IsScreenHidden() const {
+    auto backlight = Board::GetInstance().GetBacklight();
+    return power_save_ || (backlight != nullptr && backlight->brightness() == 0);
+}
+
+// The idle timer fires DISPLAY_IDLE_DELAY_MS later on the LVGL task, once the last updates are drawn
+void LvglDisplay::RequestIdle() {
+    if (idle_timer_ == nullptr || idle_ || idle_requested_.exchange(true)) {
+        return;
+    }
     DisplayLockGuard lock(this);
+    lv_timer_set_period(idle_timer_, DISPLAY_IDLE_DELAY_MS);
+    lv_timer_reset(idle_timer_);
+    lv_timer_resume(idle_timer_);
+}
+
+// Runs on the LVGL task with the display locked
+void LvglDisplay::OnIdleTimer() {
+    if (idle_) {
+        // Input reads go on while paused, a touch since then counts as activity
+        if (lv_display_get_inactive_time(display_) < lv_tick_elaps(idle_since_)) {
+            ExitIdle();
+        }
+        return;
+    }
+    lv_timer_pause(idle_timer_);
+    idle_requested_ = false;
+    if (!IsScreenHidden()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        if (status_pending_ || emotion_pending_ || status_bar_pending_ || !pending_messages_.empty()) {
+            return;
+        }
+    }
+    EnterIdle();
+}
+
+static bool IsInputTimer(lv_timer_t* timer) {
+    for (lv_indev_t* indev = lv_indev_get_next(nullptr); indev != nullptr; indev = lv_indev_get_next(indev)) {
+        if (lv_indev_get_read_timer(indev) == timer) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LvglDisplay::EnterIdle() {
+    bool has_input = lv_indev_get_next(nullptr) != nullptr;
+    for (lv_timer_t* timer = lv_timer_get_next(nullptr); timer != nullptr; timer = lv_timer_get_next(timer)) {
+        // Timers paused by their owners stay as they are when the display wakes up
+        if (timer == idle_timer_ || lv_timer_get_paused(timer) || IsInputTimer(timer)) {
+            continue;
+        }
+        lv_timer_pause(timer);
+        idle_paused_timers_.push_back(timer);
+    }
+    idle_since_ = lv_tick_get();
+    idle_ = true;
+    if (has_input) {
+        lv_timer_set_period(idle_timer_, DISPLAY_IDLE_INPUT_CHECK_MS);
+        lv_timer_resume(idle_timer_);
+    }
+    ESP_LOGI(TAG, "Display idle, %u timers paused", (unsigned)idle_paused_timers_.size());
+}
+
+// Only the display lock holder touches the timers, and every change to them first takes the lock
+void LvglDisplay::ExitIdle() {
+    if (!idle_) {
+        return;
+    }
+    for (auto timer : idle_paused_timers_) {
+        lv_timer_resume(timer);
+    }
+    idle_paused_timers_.clear();
+    lv_timer_pause(idle_timer_);
+    idle_ = false;
+    ESP_LOGI(TAG, "Display active");
+}
+
+void LvglDisplay::WakeFromIdle() {
+    if (idle_) {
+        // Taking the lock is enough, Lock() resumes the timers
+        DisplayLockGuard lock(this);
+    }
+}
 
-    lv_obj_t* screen = lv_screen_active();
-    lv_draw_buf_t* draw_buffer = lv_snapshot_take(screen, LV_COLOR_FORMAT_RGB565);
-    if (draw_buffer == nullptr) {
-        ESP_LOGE(TAG, "Failed to take snapshot, draw_buffer is nullptr");
+#if CONFIG_LV_USE_SNAPSHOT
+struct SnapshotContext {
+    Display* display;
+    lv_obj_t* screen;
+};
+
+// Renders rows [y, y + lines) of the screen into buf, the same way lv_snapshot_take does for the whole object.
+// The display is locked for one strip at a time, so the LVGL task keeps drawing frames in between, and
+// a change to the screen meanwhile only shows in the rows after it.
+static bool RenderScreenStrip(void* arg, uint16_t y, uint16_t lines, uint8_t* buf) {
+    auto context = static_cast<SnapshotContext*>(arg);
+    DisplayLockGuard lock(context->display);
+    lv_obj_t* screen = context->screen;
+    if (lv_screen_active() != screen) {
+        ESP_LOGW(TAG, "Screen changed during the snapshot");
         return false;
     }
+    lv_area_t coords;
+    lv_obj_get_coords(screen, &coords);
+    int32_t width = lv_area_get_width(&coords);
+
+    lv_draw_buf_t draw_buf;
+    if (lv_draw_buf_init(&draw_buf, width, lines, LV_COLOR_FORMAT_RGB565, width * 2, buf, width * 2 * lines) != LV_RESULT_OK) {
+        return false;
+    }
+
+    lv_area_t strip_area = {coords.x1, coords.y1 + y, coords.x2, coords.y1 + y + lines - 1};
+    lv_layer_t layer;
+    lv_memzero(&layer, sizeof(layer));
+    layer.draw_buf = &draw_buf;
+    layer.buf_area = strip_area;
+    layer.color_format = LV_COLOR_FORMAT_RGB565;
+    layer._clip_area = strip_area;
+    layer.phy_clip_area = strip_area;
+#if LV_DRAW_TRANSFORM_USE_MATRIX
+    lv_matrix_identity(&layer.matrix);
+#endif
+
+    lv_display_t* disp_old = lv_refr_get_disp_refreshing();
+    lv_display_t* disp = lv_obj_get_display(screen);
+    lv_layer_t* layer_old = disp->layer_head;
+    disp->layer_head = &layer;
+    lv_refr_set_disp_refreshing(disp);
+    lv_obj_redraw(&layer, screen);
+    while (layer.draw_task_head) {
+        lv_draw_dispatch_wait_for_request();
+        lv_draw_dispatch();
+    }
+    disp->layer_head = layer_old;
+    lv_refr_set_disp_refreshing(disp_old);
+    return true;
+}
+#endif
 
-    // swap bytes
-    uint16_t* data = (uint16_t*)draw_buffer->data;
-    size_t pixel_count = draw_buffer->data_size / 2;
-    for (size_t i = 0; i < pixel_count; i++) {
-        data[i] = __builtin_bswap16(data[i]);
+bool LvglDisplay::SnapshotToJpeg(std::string& jpeg_data, int quality) {
+#if CONFIG_LV_USE_SNAPSHOT
+    SnapshotContext context = {this, nullptr};
+    int32_t width, height;
+    {
+        DisplayLockGuard lock(this);
+        context.screen = lv_screen_active();
+        lv_obj_update_layout(context.screen);
+        width = lv_obj_get_width(context.screen);
+        height = lv_obj_get_height(context.screen);
     }
 
-    // Clear output string and use callback version to avoid pre-allocating large memory blocks
+    // A UI screenshot compresses well, reserve for the common case and let the string grow otherwise
     jpeg_data.clear();
+    jpeg_data.reserve(width * height / 8);
 
-    // Use callback-based JPEG encoder to further save memory
-    bool ret = image_to_jpeg_cb((uint8_t*)draw_buffer->data, draw_buffer->data_size, draw_buffer->header.w, draw_buffer->header.h, V4L2_PIX_FMT_RGB565, quality,
+    // The screen is rendered one MCU row at a time, so memory does not grow with its height.
+    // LVGL renders little endian RGB565, the encoder reads it as RGB565X, same as swapping every pixel first.
+    bool ret = image_to_jpeg_strips_cb(width, height, V4L2_PIX_FMT_RGB565X, quality, RenderScreenStrip, &context,
         [](void *arg, size_t index, const void *data, size_t len) -> size_t {
         std::string* output = static_cast<std::string*>(arg);
         if (data && len > 0) {
@@ -258,10 +595,8 @@ bool LvglDisplay::SnapshotToJpeg(std::string& jpeg_data, int quality) {
         return len;
     }, &jpeg_data);
     if (!ret) {
-        ESP_LOGE(TAG, "Failed to convert image to JPEG");
+        ESP_LOGE(TAG, "Failed to convert snapshot to JPEG");
     }
-
-    lv_draw_buf_destroy(draw_buffer);
     return ret;
 #else
     ESP_LOGE(TAG, "LV_USE_SNAPSHOT is not enabled");
@@ -3,14 +3,31 @@
 
 #include "display.h"
 #include "lvgl_image.h"
+#include "metrics.h"
 
 #include <lvgl.h>
 #include <esp_timer.h>
 #include <esp_log.h>
 #include <esp_pm.h>
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
 #include <string>
 #include <chrono>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// Chat messages waiting for the LVGL task, the oldest are dropped past this
+#define DISPLAY_MAX_PENDING_MESSAGES 32
+// LVGL task time per frame for queued chat messages, the rest waits for the next frame
+#define DISPLAY_UPDATE_BUDGET_US 8000
+// How long the screen stays hidden before the LVGL timers are paused, the last frame is drawn by then
+#define DISPLAY_IDLE_DELAY_MS 1000
+// How often a paused display looks for touch input
+#define DISPLAY_IDLE_INPUT_CHECK_MS 100
 
 class LvglDisplay : public Display {
 public:
@@ -23,6 +40,7 @@ public:
     virtual void SetPreviewImage(std::unique_ptr<LvglImage> image);
     virtual void UpdateStatusBar(bool update_all = false);
     virtual void SetPowerSaveMode(bool on);
+    virtual void SetRefreshSlowdown(int factor) override;
     virtual bool SnapshotToJpeg(std::string& jpeg_data, int quality = 80);
 
 protected:
@@ -43,6 +61,70 @@ protected:
 
     std::chrono::system_clock::time_point last_status_update_time_;
     esp_timer_handle_t notification_timer_ = nullptr;
+    bool low_battery_warned_ = false;
+    // Set while the screen is not visible, UpdateStatusBar does nothing then
+    std::atomic<bool> power_save_ = false;
+    bool status_bar_skipped_ = false;
+
+    // What UpdateStatusBar found, a null icon leaves that icon as it is
+    struct StatusBarState {
+        bool muted = false;
+        const char* battery_icon = nullptr;
+        bool low_battery = false;
+        const char* network_icon = nullptr;
+    };
+
+    struct PendingChatMessage {
+        enum Kind { kSet, kAppend, kClear } kind;
+        std::string role;
+        std::string content;
+    };
+
+    // Updates from other tasks wait here and the LVGL task applies them once per frame, so callers do not
+    // block on the display lock. Status, emotion and status bar keep only their latest value, chat
+    // messages keep their order. A burst of chat messages is spread over several frames, so creating
+    // the bubbles does not hold the LVGL task past DISPLAY_UPDATE_BUDGET_US.
+    std::mutex pending_mutex_;
+    lv_timer_t* update_timer_ = nullptr;
+    TaskHandle_t lvgl_task_ = nullptr;
+    bool status_pending_ = false;
+    std::string pending_status_;
+    bool emotion_pending_ = false;
+    std::string pending_emotion_;
+    bool status_bar_pending_ = false;
+    StatusBarState pending_status_bar_;
+    // Last state UpdateStatusBar handed on, identical updates stop there
+    StatusBarState sent_status_bar_;
+    bool status_bar_sent_ = false;
+    std::deque<PendingChatMessage> pending_messages_;
+    MetricHistogram* update_us_ = nullptr;
+    MetricCounter* update_deferred_ = nullptr;  // Frames that left chat messages for the next one
+
+    // While the screen is hidden (power save or backlight off) every LVGL timer but the input reads is
+    // paused, so GIFs, animations and the refresh stop and the LVGL task sleeps. Taking the display lock,
+    // queueing an update or touching the screen brings them back.
+    lv_timer_t* idle_timer_ = nullptr;
+    std::atomic<bool> idle_ = false;
+    std::atomic<bool> idle_requested_ = false;
+    uint32_t idle_since_ = 0;
+    std::vector<lv_timer_t*> idle_paused_timers_;
+
+    // Called by SetupUI with the display locked
+    void InitializeUpdateQueue();
+    bool ShouldDefer() const { return update_timer_ != nullptr && xTaskGetCurrentTaskHandle() != lvgl_task_; }
+    // Each returns true when the update was queued, the caller then returns right away
+    bool DeferStatus(const char* status);
+    bool DeferEmotion(const char* emotion);
+    bool DeferChatMessage(PendingChatMessage::Kind kind, const char* role, const char* content);
+    void ApplyPendingUpdates();
+    void ApplyStatusBar(const StatusBarState& state);
+    bool IsScreenHidden() const;
+    void RequestIdle();
+    void OnIdleTimer();
+    void EnterIdle();
+    // Lock() implementations call it once they hold the lock
+    void ExitIdle();
+    void WakeFromIdle();
 
     friend class DisplayLockGuard;
     virtual bool Lock(int timeout_ms = 0) = 0;
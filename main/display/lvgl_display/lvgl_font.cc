@@ -1,13 +1,21 @@
 #include "lvgl_font.h"
+#include "lvgl_glyph_cache.h"
 #include <cbin_font.h>
+#include <sdkconfig.h>
 
 
 LvglCBinFont::LvglCBinFont(void* data) {
     font_ = cbin_font_create(static_cast<uint8_t*>(data));
+#if CONFIG_GLYPH_CACHE_SIZE_KB > 0
+    LvglGlyphCache::GetInstance().Attach(font_);
+#endif
 }
 
 LvglCBinFont::~LvglCBinFont() {
     if (font_ != nullptr) {
+#if CONFIG_GLYPH_CACHE_SIZE_KB > 0
+        LvglGlyphCache::GetInstance().Detach(font_);
+#endif
         cbin_font_delete(font_);
     }
 }
\ No newline at end of file
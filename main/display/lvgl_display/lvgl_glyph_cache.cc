@@ -0,0 +1,170 @@
+#include "lvgl_glyph_cache.h"
+#include "heap_placement.h"
+#include "heap_monitor.h"
+
+#include <esp_log.h>
+#include <sdkconfig.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "GlyphCache"
+
+#define GLYPH_CACHE_CAPACITY (CONFIG_GLYPH_CACHE_SIZE_KB * 1024)
+
+void LvglGlyphCache::Attach(lv_font_t* font) {
+    if (font == nullptr || font->get_glyph_bitmap == nullptr || GLYPH_CACHE_CAPACITY == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& attached : fonts_) {
+        if (attached.font == font) {
+            return;
+        }
+    }
+    fonts_.push_back({font, font->get_glyph_bitmap});
+    font->get_glyph_bitmap = GetGlyphBitmap;
+    if (!releaser_added_) {
+        releaser_added_ = true;
+        HeapMonitor::GetInstance().AddReleaser("glyph_cache", [this](HeapPressure pressure) {
+            return Clear();
+        });
+    }
+    ESP_LOGI(TAG, "Caching glyphs of font %p, line height %d, up to %d KB", font, (int)font->line_height,
+        CONFIG_GLYPH_CACHE_SIZE_KB);
+}
+
+void LvglGlyphCache::Detach(lv_font_t* font) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(fonts_.begin(), fonts_.end(), [font](const AttachedFont& attached) {
+        return attached.font == font;
+    });
+    if (it == fonts_.end()) {
+        return;
+    }
+    font->get_glyph_bitmap = it->get_glyph_bitmap;
+    fonts_.erase(it);
+
+    // Its glyphs are keyed by the font address, which can be reused by the next font
+    uint64_t font_key = (uint64_t)(uintptr_t)font << 32;
+    for (auto entry = lru_.begin(); entry != lru_.end();) {
+        if ((entry->key & 0xFFFFFFFF00000000ULL) == font_key) {
+            index_.erase(entry->key);
+            bytes_ -= entry->size;
+            HeapPlacement::Free(kHeapSubsystemDisplay, entry->data);
+            entry = lru_.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+}
+
+size_t LvglGlyphCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t bytes = bytes_;
+    for (auto& entry : lru_) {
+        HeapPlacement::Free(kHeapSubsystemDisplay, entry.data);
+    }
+    lru_.clear();
+    index_.clear();
+    bytes_ = 0;
+    return bytes;
+}
+
+// Replaces get_glyph_bitmap of the attached fonts, the original writes the glyph as A8 into draw_buf
+const void* LvglGlyphCache::GetGlyphBitmap(lv_font_glyph_dsc_t* g_dsc, lv_draw_buf_t* draw_buf) {
+    auto& cache = GetInstance();
+    const void* (*get_glyph_bitmap)(lv_font_glyph_dsc_t*, lv_draw_buf_t*) = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex_);
+        for (auto& attached : cache.fonts_) {
+            if (attached.font == g_dsc->resolved_font) {
+                get_glyph_bitmap = attached.get_glyph_bitmap;
+                break;
+            }
+        }
+    }
+    if (get_glyph_bitmap == nullptr) {
+        return nullptr;
+    }
+    if (draw_buf == nullptr || draw_buf->data == nullptr || g_dsc->format > LV_FONT_GLYPH_FORMAT_A8) {
+        return get_glyph_bitmap(g_dsc, draw_buf);
+    }
+
+    uint64_t key = (uint64_t)(uintptr_t)g_dsc->resolved_font << 32 | g_dsc->gid.index;
+    size_t size = std::min<size_t>((size_t)lv_draw_buf_width_to_stride(g_dsc->box_w, LV_COLOR_FORMAT_A8) * g_dsc->box_h,
+        draw_buf->data_size);
+    if (cache.Lookup(key, draw_buf, size)) {
+        return draw_buf;
+    }
+    auto result = get_glyph_bitmap(g_dsc, draw_buf);
+    if (result == draw_buf) {
+        cache.Insert(key, draw_buf->data, size);
+    }
+    return result;
+}
+
+bool LvglGlyphCache::Lookup(uint64_t key, lv_draw_buf_t* draw_buf, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end() || it->second->size != size) {
+        misses_++;
+        return false;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    memcpy(draw_buf->data, it->second->data, size);
+    hits_++;
+    return true;
+}
+
+void LvglGlyphCache::Insert(uint64_t key, const uint8_t* data, size_t size) {
+    // A few huge glyphs would push out all the small ones
+    if (size == 0 || size > GLYPH_CACHE_CAPACITY / 16) {
+        return;
+    }
+    auto copy = (uint8_t*)HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemDisplay, size);
+    if (copy == nullptr) {
+        return;
+    }
+    memcpy(copy, data, size);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        bytes_ -= it->second->size;
+        HeapPlacement::Free(kHeapSubsystemDisplay, it->second->data);
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+    while (bytes_ + size > GLYPH_CACHE_CAPACITY && !lru_.empty()) {
+        Evict();
+    }
+    lru_.push_front({key, copy, size});
+    index_[key] = lru_.begin();
+    bytes_ += size;
+}
+
+void LvglGlyphCache::Evict() {
+    auto& entry = lru_.back();
+    index_.erase(entry.key);
+    bytes_ -= entry.size;
+    HeapPlacement::Free(kHeapSubsystemDisplay, entry.data);
+    lru_.pop_back();
+    evictions_++;
+}
+
+GlyphCacheStatistics LvglGlyphCache::GetStatistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {hits_, misses_, evictions_, lru_.size(), bytes_, (size_t)GLYPH_CACHE_CAPACITY};
+}
+
+void LvglGlyphCache::PrintStatistics() {
+    auto statistics = GetStatistics();
+    uint32_t lookups = statistics.hits + statistics.misses;
+    if (lookups == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "Glyph cache hits: %lu/%lu (%lu%%), evictions: %lu, %u glyphs in %u/%u bytes",
+        statistics.hits, lookups, (uint32_t)((uint64_t)statistics.hits * 100 / lookups), statistics.evictions,
+        (unsigned)statistics.entries, (unsigned)statistics.bytes, (unsigned)statistics.capacity);
+}
@@ -0,0 +1,75 @@
+#ifndef LVGL_GLYPH_CACHE_H
+#define LVGL_GLYPH_CACHE_H
+
+#include <lvgl.h>
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct GlyphCacheStatistics {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    size_t entries;
+    size_t bytes;
+    size_t capacity;
+};
+
+/**
+ * LvglGlyphCache - LRU cache of rendered glyph bitmaps in front of the cbin font lookup
+ *
+ * Attach() swaps the get_glyph_bitmap callback of a font, a lookup that is cached copies the A8
+ * bitmap into the draw buffer of LVGL instead of reading and expanding it from flash again.
+ * Long CJK messages redraw the same glyphs on every scroll step. One budget of
+ * CONFIG_GLYPH_CACHE_SIZE_KB is shared by all attached fonts, in PSRAM when there is some.
+ */
+class LvglGlyphCache {
+public:
+    static LvglGlyphCache& GetInstance() {
+        static LvglGlyphCache instance;
+        return instance;
+    }
+
+    void Attach(lv_font_t* font);
+    void Detach(lv_font_t* font);
+    // Drops every cached glyph, returns the bytes freed
+    size_t Clear();
+    GlyphCacheStatistics GetStatistics();
+    void PrintStatistics();
+
+private:
+    struct Entry {
+        uint64_t key;
+        uint8_t* data;
+        size_t size;
+    };
+    struct AttachedFont {
+        const lv_font_t* font;
+        const void* (*get_glyph_bitmap)(lv_font_glyph_dsc_t*, lv_draw_buf_t*);
+    };
+
+    LvglGlyphCache() = default;
+    LvglGlyphCache(const LvglGlyphCache&) = delete;
+    LvglGlyphCache& operator=(const LvglGlyphCache&) = delete;
+
+    static const void* GetGlyphBitmap(lv_font_glyph_dsc_t* g_dsc, lv_draw_buf_t* draw_buf);
+    bool Lookup(uint64_t key, lv_draw_buf_t* draw_buf, size_t size);
+    void Insert(uint64_t key, const uint8_t* data, size_t size);
+    void Evict();
+
+    std::mutex mutex_;
+    std::vector<AttachedFont> fonts_;
+    // Most recently used first
+    std::list<Entry> lru_;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+    size_t bytes_ = 0;
+    bool releaser_added_ = false;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+    uint32_t evictions_ = 0;
+};
+
+#endif // LVGL_GLYPH_CACHE_H
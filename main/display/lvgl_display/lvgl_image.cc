@@ -1,10 +1,15 @@
 #include "lvgl_image.h"
+#include "lvgl_animation.h"
 #include <cbin_font.h>
 
 #include <esp_log.h>
-#include <stdexcept>
 #include <cstring>
+#include <new>
 #include <esp_heap_caps.h>
+#include <sdkconfig.h>
+#if CONFIG_SOC_PPA_SUPPORTED
+#include <driver/ppa.h>
+#endif
 
 #define TAG "LvglImage"
 
@@ -24,6 +29,30 @@ bool LvglRawImage::IsGif() const {
     return ptr[0] == 'G' && ptr[1] == 'I' && ptr[2] == 'F';
 }
 
+bool LvglRawImage::IsAnimation() const {
+    return LvglAnimation::IsAnimation(image_dsc_.data, image_dsc_.data_size);
+}
+
+LvglBinImage::LvglBinImage(void* data, size_t size) {
+    bzero(&image_dsc_, sizeof(image_dsc_));
+    memcpy(&image_dsc_.header, data, sizeof(image_dsc_.header));
+    image_dsc_.data = static_cast<uint8_t*>(data) + sizeof(image_dsc_.header);
+    image_dsc_.data_size = size - sizeof(image_dsc_.header);
+}
+
+bool LvglBinImage::IsBinImage(const void* data, size_t size) {
+    lv_image_header_t header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    // Compressed ones would be inflated into RAM by the bin decoder
+    if (header.magic != LV_IMAGE_HEADER_MAGIC || (header.flags & LV_IMAGE_FLAGS_COMPRESSED)) {
+        return false;
+    }
+    return header.stride != 0 && (size_t)header.stride * header.h <= size - sizeof(header);
+}
+
 LvglCBinImage::LvglCBinImage(void* data) {
     image_dsc_ = cbin_img_dsc_create(static_cast<uint8_t*>(data));
 }
@@ -41,7 +70,8 @@ LvglAllocatedImage::LvglAllocatedImage(void* data, size_t size) {
 
     if (lv_image_decoder_get_info(&image_dsc_, &image_dsc_.header) != LV_RESULT_OK) {
         ESP_LOGE(TAG, "Failed to get image info, data: %p size: %u", data, size);
-        throw std::runtime_error("Failed to get image info");
+        image_dsc_.header.w = 0;
+        image_dsc_.header.h = 0;
     }
 }
 
@@ -61,4 +91,141 @@ LvglAllocatedImage::~LvglAllocatedImage() {
         heap_caps_free((void*)image_dsc_.data);
         image_dsc_.data = nullptr;
     }
-}
\ No newline at end of file
+}
+
+LvglSharedImage::LvglSharedImage(std::shared_ptr<uint8_t> data, size_t size, int width, int height, int stride, int color_format)
+    : data_(std::move(data)) {
+    bzero(&image_dsc_, sizeof(image_dsc_));
+    image_dsc_.data_size = size;
+    image_dsc_.data = data_.get();
+    image_dsc_.header.magic = LV_IMAGE_HEADER_MAGIC;
+    image_dsc_.header.cf = color_format;
+    image_dsc_.header.w = width;
+    image_dsc_.header.h = height;
+    image_dsc_.header.stride = stride;
+}
+
+std::unique_ptr<LvglImage> LvglScaleImage(const lv_img_dsc_t* image_dsc, int lv_scale) {
+#if CONFIG_SOC_PPA_SUPPORTED
+    ppa_srm_color_mode_t color_mode;
+    int bytes_per_pixel;
+    switch (image_dsc->header.cf) {
+        case LV_COLOR_FORMAT_RGB565:
+            color_mode = PPA_SRM_COLOR_MODE_RGB565;
+            bytes_per_pixel = 2;
+            break;
+        case LV_COLOR_FORMAT_RGB888:
+            color_mode = PPA_SRM_COLOR_MODE_RGB888;
+            bytes_per_pixel = 3;
+            break;
+        case LV_COLOR_FORMAT_ARGB8888:
+            color_mode = PPA_SRM_COLOR_MODE_ARGB8888;
+            bytes_per_pixel = 4;
+            break;
+        default:
+            return nullptr;
+    }
+
+    // Encoded images (JPEG, PNG) report a color format too, only raw pixels can go through the PPA
+    int width = image_dsc->header.w;
+    int height = image_dsc->header.h;
+    int stride = image_dsc->header.stride != 0 ? image_dsc->header.stride : width * bytes_per_pixel;
+    if (width == 0 || height == 0 || stride % bytes_per_pixel != 0 || image_dsc->data_size < (size_t)stride * height) {
+        return nullptr;
+    }
+
+    // The PPA scales in 1/16 steps, LVGL uses 256 for 1.0
+    int steps = lv_scale * 16 / LV_SCALE_NONE;
+    if (steps == 16 || steps <= 0 || steps >= 16 * 16) {
+        return nullptr;
+    }
+    float scale = steps / 16.0f;
+    int out_width = width * scale;
+    int out_height = height * scale;
+    if (out_width == 0 || out_height == 0) {
+        return nullptr;
+    }
+
+    // The output is written by DMA, both ends of the buffer have to be cache line aligned
+    size_t size = (out_width * out_height * bytes_per_pixel + 127) & ~127;
+    auto data = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT | MALLOC_CAP_CACHE_ALIGNED);
+    if (data == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the scaled image", size);
+        return nullptr;
+    }
+
+    ppa_client_handle_t ppa_client = nullptr;
+    ppa_client_config_t client_cfg = {
+        .oper_type = PPA_OPERATION_SRM,
+        .max_pending_trans_num = 1,
+    };
+    if (ppa_register_client(&client_cfg, &ppa_client) != ESP_OK) {
+        ESP_LOGE(TAG, "ppa_register_client failed");
+        heap_caps_free(data);
+        return nullptr;
+    }
+
+    ppa_srm_oper_config_t srm_cfg = {};
+    srm_cfg.in.buffer = image_dsc->data;
+    srm_cfg.in.pic_w = stride / bytes_per_pixel;
+    srm_cfg.in.pic_h = height;
+    srm_cfg.in.block_w = width;
+    srm_cfg.in.block_h = height;
+    srm_cfg.in.srm_cm = color_mode;
+    srm_cfg.out.buffer = data;
+    srm_cfg.out.buffer_size = size;
+    srm_cfg.out.pic_w = out_width;
+    srm_cfg.out.pic_h = out_height;
+    srm_cfg.out.srm_cm = color_mode;
+    srm_cfg.rotation_angle = PPA_SRM_ROTATION_ANGLE_0;
+    srm_cfg.scale_x = scale;
+    srm_cfg.scale_y = scale;
+    srm_cfg.mode = PPA_TRANS_MODE_BLOCKING;
+    esp_err_t err = ppa_do_scale_rotate_mirror(ppa_client, &srm_cfg);
+    ppa_unregister_client(ppa_client);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ppa_do_scale_rotate_mirror failed: %d", err);
+        heap_caps_free(data);
+        return nullptr;
+    }
+    return std::make_unique<LvglAllocatedImage>(data, size, out_width, out_height,
+        out_width * bytes_per_pixel, image_dsc->header.cf);
+#else
+    // Only shrinking: every output pixel is read from the source once, instead of LVGL
+    // transforming the full frame on each redraw
+    if (image_dsc->header.cf != LV_COLOR_FORMAT_RGB565 || lv_scale <= 0 || lv_scale >= LV_SCALE_NONE) {
+        return nullptr;
+    }
+    int width = image_dsc->header.w;
+    int height = image_dsc->header.h;
+    int stride = image_dsc->header.stride != 0 ? image_dsc->header.stride : width * 2;
+    if (width == 0 || height == 0 || image_dsc->data_size < (size_t)stride * height) {
+        return nullptr;
+    }
+    int out_width = width * lv_scale / LV_SCALE_NONE;
+    int out_height = height * lv_scale / LV_SCALE_NONE;
+    if (out_width == 0 || out_height == 0) {
+        return nullptr;
+    }
+
+    size_t size = out_width * out_height * 2;
+    auto data = (uint16_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    std::unique_ptr<uint16_t[]> columns(new (std::nothrow) uint16_t[out_width]);
+    if (data == nullptr || columns == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the scaled image", size);
+        heap_caps_free(data);
+        return nullptr;
+    }
+    for (int x = 0; x < out_width; x++) {
+        columns[x] = x * width / out_width;
+    }
+    auto out = data;
+    for (int y = 0; y < out_height; y++) {
+        auto row = (const uint16_t*)(image_dsc->data + (size_t)(y * height / out_height) * stride);
+        for (int x = 0; x < out_width; x++) {
+            *out++ = row[columns[x]];
+        }
+    }
+    return std::make_unique<LvglAllocatedImage>(data, size, out_width, out_height, out_width * 2, LV_COLOR_FORMAT_RGB565);
+#endif
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <lvgl.h>
+#include <memory>
 
 
 // Wrap around lv_img_dsc_t
@@ -8,6 +9,8 @@ class LvglImage {
 public:
     virtual const lv_img_dsc_t* image_dsc() const = 0;
     virtual bool IsGif() const { return false; }
+    // An emoji animation pre-converted for LvglAnimation
+    virtual bool IsAnimation() const { return false; }
     virtual ~LvglImage() = default;
 };
 
@@ -17,6 +20,18 @@ public:
     LvglRawImage(void* data, size_t size);
     virtual const lv_img_dsc_t* image_dsc() const override { return &image_dsc_; }
     virtual bool IsGif() const;
+    virtual bool IsAnimation() const;
+
+private:
+    lv_img_dsc_t image_dsc_;
+};
+
+// An LVGL .bin image, its header followed by uncompressed pixels, drawn where it is without a decoder
+class LvglBinImage : public LvglImage {
+public:
+    LvglBinImage(void* data, size_t size);
+    virtual const lv_img_dsc_t* image_dsc() const override { return &image_dsc_; }
+    static bool IsBinImage(const void* data, size_t size);
 
 private:
     lv_img_dsc_t image_dsc_;
@@ -43,11 +58,29 @@ private:
 
 class LvglAllocatedImage : public LvglImage {
 public:
+    // Takes the header from the encoded data, check valid() as the data may not be an image LVGL can decode
     LvglAllocatedImage(void* data, size_t size);
     LvglAllocatedImage(void* data, size_t size, int width, int height, int stride, int color_format);
     virtual ~LvglAllocatedImage();
     virtual const lv_img_dsc_t* image_dsc() const override { return &image_dsc_; }
+    inline bool valid() const { return image_dsc_.header.w > 0 && image_dsc_.header.h > 0; }
+
+private:
+    lv_img_dsc_t image_dsc_;
+};
+
+// Raw pixels owned together with someone else, e.g. a camera frame that is also being JPEG encoded
+class LvglSharedImage : public LvglImage {
+public:
+    LvglSharedImage(std::shared_ptr<uint8_t> data, size_t size, int width, int height, int stride, int color_format);
+    virtual const lv_img_dsc_t* image_dsc() const override { return &image_dsc_; }
 
 private:
+    std::shared_ptr<uint8_t> data_;
     lv_img_dsc_t image_dsc_;
-};
\ No newline at end of file
+};
+
+// Scale a raw RGB565 / RGB888 / ARGB8888 image with the PPA, so LVGL does not transform it on every redraw.
+// Without a PPA an RGB565 image is shrunk once in software, picking the nearest pixels.
+// Returns nullptr when the image can not be scaled this way, keep using lv_image_set_scale then.
+std::unique_ptr<LvglImage> LvglScaleImage(const lv_img_dsc_t* image_dsc, int lv_scale);
@@ -2,13 +2,18 @@
 #include "assets/lang_config.h"
 #include "lvgl_theme.h"
 #include "lvgl_font.h"
+#include "task_factory.h"
 
 #include <string>
 #include <algorithm>
+#include <vector>
+#include <cstring>
 
 #include <esp_log.h>
 #include <esp_err.h>
 #include <esp_lvgl_port.h>
+#include <esp_lcd_panel_interface.h>
+#include <esp_timer.h>
 #include <font_awesome.h>
 
 #define TAG "OledDisplay"
@@ -17,6 +22,128 @@ LV_FONT_DECLARE(BUILTIN_TEXT_FONT);
 LV_FONT_DECLARE(BUILTIN_ICON_FONT);
 LV_FONT_DECLARE(font_awesome_30_1);
 
+// esp_lvgl_port creates its task itself, with the taskLVGL entry of the task placement table
+static void ApplyTaskPlacement(lvgl_port_cfg_t& port_cfg) {
+    TaskPlacement placement;
+    if (!TaskFactory::GetPlacement("taskLVGL", placement)) {
+        return;
+    }
+    port_cfg.task_priority = placement.priority;
+    port_cfg.task_affinity = placement.core == tskNO_AFFINITY ? -1 : placement.core;
+    if (placement.stack_size != 0) {
+        port_cfg.task_stack = placement.stack_size;
+    }
+}
+
+/*
+ * The SSD1306 class panels take 1bpp data in 8 pixel high pages, one byte per column, which is what
+ * esp_lvgl_port hands to draw_bitmap after LVGL rendered in I1. Since it widens every invalidated area to
+ * whole page rows, a status bar change would resend full 128 byte pages. This wrapper keeps a copy of what
+ * the panel shows and only sends the changed column range of each page. The panel io is I2C, so every
+ * transfer is done when draw_bitmap returns.
+ */
+struct OledDisplay::DiffPanel {
+    esp_lcd_panel_t base;
+    esp_lcd_panel_handle_t panel;
+    lv_display_t* display = nullptr;
+    int width;
+    int height;
+    std::vector<uint8_t> shadow;
+    std::vector<bool> page_valid;
+
+    int64_t stats_since_us = 0;
+    uint32_t stats_flushes = 0;
+    uint32_t stats_requested = 0;
+    uint32_t stats_sent = 0;
+
+    DiffPanel(esp_lcd_panel_handle_t panel, int width, int height)
+        : panel(panel), width(width), height(height), shadow(width * height / 8), page_valid(height / 8, false) {
+        memset(&base, 0, sizeof(base));
+        base.reset = [](esp_lcd_panel_t* p) { return esp_lcd_panel_reset(From(p)->panel); };
+        base.init = [](esp_lcd_panel_t* p) { return esp_lcd_panel_init(From(p)->panel); };
+        base.del = [](esp_lcd_panel_t* p) { return ESP_OK; };
+        base.draw_bitmap = DrawBitmap;
+        base.mirror = [](esp_lcd_panel_t* p, bool x, bool y) { return esp_lcd_panel_mirror(From(p)->panel, x, y); };
+        base.swap_xy = [](esp_lcd_panel_t* p, bool swap) { return esp_lcd_panel_swap_xy(From(p)->panel, swap); };
+        base.set_gap = [](esp_lcd_panel_t* p, int x, int y) { return esp_lcd_panel_set_gap(From(p)->panel, x, y); };
+        base.invert_color = [](esp_lcd_panel_t* p, bool invert) {
+            return esp_lcd_panel_invert_color(From(p)->panel, invert);
+        };
+        base.disp_on_off = [](esp_lcd_panel_t* p, bool on) {
+            // In case the board resets the panel while it is off, send everything again afterwards
+            std::fill(From(p)->page_valid.begin(), From(p)->page_valid.end(), false);
+            return esp_lcd_panel_disp_on_off(From(p)->panel, on);
+        };
+        base.disp_sleep = [](esp_lcd_panel_t* p, bool sleep) {
+            std::fill(From(p)->page_valid.begin(), From(p)->page_valid.end(), false);
+            return esp_lcd_panel_disp_sleep(From(p)->panel, sleep);
+        };
+        stats_since_us = esp_timer_get_time();
+    }
+
+    static DiffPanel* From(esp_lcd_panel_t* p) {
+        return reinterpret_cast<DiffPanel*>(p);
+    }
+
+    static esp_err_t DrawBitmap(esp_lcd_panel_t* p, int x_start, int y_start, int x_end, int y_end, const void* data) {
+        auto self = From(p);
+        int columns = x_end - x_start;
+        // Only whole pages inside the panel can be compared, pass anything else through
+        if (y_start % 8 != 0 || y_end % 8 != 0 || x_start < 0 || x_end > self->width || y_start < 0 ||
+            y_end > self->height || columns <= 0) {
+            for (int page = std::max(y_start, 0) / 8; page < std::min(y_end, self->height) / 8; page++) {
+                self->page_valid[page] = false;
+            }
+            return esp_lcd_panel_draw_bitmap(self->panel, x_start, y_start, x_end, y_end, data);
+        }
+
+        esp_err_t err = ESP_OK;
+        bool sent = false;
+        auto src = static_cast<const uint8_t*>(data);
+        for (int page = y_start / 8; page < y_end / 8 && err == ESP_OK; page++, src += columns) {
+            uint8_t* shadow = &self->shadow[page * self->width + x_start];
+            int first = 0;
+            int last = columns - 1;
+            if (self->page_valid[page]) {
+                while (first < columns && src[first] == shadow[first]) {
+                    first++;
+                }
+                if (first == columns) {
+                    continue;
+                }
+                while (src[last] == shadow[last]) {
+                    last--;
+                }
+            } else if (columns == self->width) {
+                self->page_valid[page] = true;
+            }
+            memcpy(shadow + first, src + first, last - first + 1);
+            err = esp_lcd_panel_draw_bitmap(self->panel, x_start + first, page * 8, x_start + last + 1, page * 8 + 8,
+                src + first);
+            self->stats_sent += last - first + 1;
+            sent = true;
+        }
+        self->stats_flushes++;
+        self->stats_requested += columns * (y_end - y_start) / 8;
+
+        int64_t now = esp_timer_get_time();
+        if (now - self->stats_since_us >= OLED_PERF_LOG_INTERVAL_US && self->stats_flushes > 0) {
+            ESP_LOGI(TAG, "Display: %lu flushes, %lu bytes/flush sent of %lu", self->stats_flushes,
+                self->stats_sent / self->stats_flushes, self->stats_requested / self->stats_flushes);
+            self->stats_since_us = now;
+            self->stats_flushes = 0;
+            self->stats_requested = 0;
+            self->stats_sent = 0;
+        }
+
+        // Nothing changed, so no transfer will report the flush as done
+        if (!sent && self->display != nullptr) {
+            lv_display_flush_ready(self->display);
+        }
+        return err;
+    }
+};
+
 OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
     int width, int height, bool mirror_x, bool mirror_y)
     : panel_io_(panel_io), panel_(panel) {
@@ -38,17 +165,15 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
 
     ESP_LOGI(TAG, "Initialize LVGL");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
     port_cfg.task_stack = 6144;
-#if CONFIG_SOC_CPU_CORES_NUM > 1
-    port_cfg.task_affinity = 1;
-#endif
+    ApplyTaskPlacement(port_cfg);
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding OLED display");
+    diff_panel_ = std::make_unique<DiffPanel>(panel_, width_, height_);
     const lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
-        .panel_handle = panel_,
+        .panel_handle = &diff_panel_->base,
         .control_handle = nullptr,
         .buffer_size = static_cast<uint32_t>(width_ * height_),
         .double_buffer = false,
@@ -75,6 +200,7 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
         ESP_LOGE(TAG, "Failed to add display");
         return;
     }
+    diff_panel_->display = display_;
 
     // Note: SetupUI() should be called by Application::Initialize(), not in constructor
     // to ensure lvgl objects are created after the display is fully initialized.
@@ -136,7 +262,11 @@ OledDisplay::~OledDisplay() {
 }
 
 bool OledDisplay::Lock(int timeout_ms) {
-    return lvgl_port_lock(timeout_ms);
+    if (!lvgl_port_lock(timeout_ms)) {
+        return false;
+    }
+    ExitIdle();
+    return true;
 }
 
 void OledDisplay::Unlock() {
@@ -144,6 +274,9 @@ void OledDisplay::Unlock() {
 }
 
 void OledDisplay::SetChatMessage(const char* role, const char* content) {
+    if (DeferChatMessage(PendingChatMessage::kSet, role, content)) {
+        return;
+    }
     DisplayLockGuard lock(this);
     if (chat_message_label_ == nullptr) {
         return;
@@ -163,10 +296,31 @@ void OledDisplay::SetChatMessage(const char* role, const char* content) {
             lv_obj_remove_flag(content_right_, LV_OBJ_FLAG_HIDDEN);
         }
     }
+    chat_message_role_ = role;
+}
+
+void OledDisplay::AppendChatMessage(const char* role, const char* delta) {
+    if (DeferChatMessage(PendingChatMessage::kAppend, role, delta)) {
+        return;
+    }
+    DisplayLockGuard lock(this);
+    if (chat_message_label_ == nullptr) {
+        return;
+    }
+    bool hidden = content_right_ != nullptr && lv_obj_has_flag(content_right_, LV_OBJ_FLAG_HIDDEN);
+    if (hidden || chat_message_role_ != role) {
+        SetChatMessage(role, delta);
+        return;
+    }
+
+    std::string delta_str = delta;
+    std::replace(delta_str.begin(), delta_str.end(), '\n', ' ');
+    lv_label_ins_text(chat_message_label_, LV_LABEL_POS_LAST, delta_str.c_str());
 }
 
 void OledDisplay::SetupUI_128x64() {
     DisplayLockGuard lock(this);
+    InitializeUpdateQueue();
 
     auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
     auto text_font = lvgl_theme->text_font()->font();
@@ -299,6 +453,7 @@ void OledDisplay::SetupUI_128x64() {
 
 void OledDisplay::SetupUI_128x32() {
     DisplayLockGuard lock(this);
+    InitializeUpdateQueue();
 
     auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
     auto text_font = lvgl_theme->text_font()->font();
@@ -385,6 +540,9 @@ void OledDisplay::SetupUI_128x32() {
 }
 
 void OledDisplay::SetEmotion(const char* emotion) {
+    if (DeferEmotion(emotion)) {
+        return;
+    }
     const char* utf8 = font_awesome_get_utf8(emotion);
     DisplayLockGuard lock(this);
     if (emotion_label_ == nullptr) {
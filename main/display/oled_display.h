@@ -6,11 +6,17 @@
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
 
+#include <memory>
+
+#define OLED_PERF_LOG_INTERVAL_US (10 * 1000 * 1000)
 
 class OledDisplay : public LvglDisplay {
 private:
     esp_lcd_panel_io_handle_t panel_io_ = nullptr;
     esp_lcd_panel_handle_t panel_ = nullptr;
+    // Handed to esp_lvgl_port in place of panel_, forwards only the columns that changed
+    struct DiffPanel;
+    std::unique_ptr<DiffPanel> diff_panel_;
 
     lv_obj_t* top_bar_ = nullptr;
     lv_obj_t* status_bar_ = nullptr;
@@ -21,6 +27,7 @@ private:
     lv_obj_t* side_bar_ = nullptr;
     lv_obj_t *emotion_label_ = nullptr;
     lv_obj_t* chat_message_label_ = nullptr;
+    std::string chat_message_role_;
 
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
@@ -34,6 +41,7 @@ public:
 
     virtual void SetupUI() override;
     virtual void SetChatMessage(const char* role, const char* content) override;
+    virtual void AppendChatMessage(const char* role, const char* delta) override;
     virtual void SetEmotion(const char* emotion) override;
     virtual void SetTheme(Theme* theme) override;
 };
@@ -0,0 +1,146 @@
+#include "download_checkpoint.h"
+#include "settings.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include <algorithm>
+#include <cstdio>
+
+#define TAG "DownloadCheckpoint"
+
+DownloadCheckpoint::DownloadCheckpoint(const char* ns, const std::string& url, const esp_partition_t* partition)
+    : ns_(ns), url_(url), partition_(partition) {
+    mbedtls_sha256_init(&sha256_);
+    mbedtls_sha256_starts(&sha256_, 0);
+}
+
+DownloadCheckpoint::~DownloadCheckpoint() {
+    mbedtls_sha256_free(&sha256_);
+}
+
+void DownloadCheckpoint::Restart() {
+    mbedtls_sha256_free(&sha256_);
+    mbedtls_sha256_init(&sha256_);
+    mbedtls_sha256_starts(&sha256_, 0);
+    offset_ = 0;
+    last_saved_ = 0;
+}
+
+// Hex SHA-256 of everything added so far, the running hash goes on
+std::string DownloadCheckpoint::FinishHash() const {
+    mbedtls_sha256_context copy;
+    mbedtls_sha256_init(&copy);
+    mbedtls_sha256_clone(&copy, &sha256_);
+    unsigned char digest[32];
+    mbedtls_sha256_finish(&copy, digest);
+    mbedtls_sha256_free(&copy);
+
+    char hex[sizeof(digest) * 2 + 1];
+    for (size_t i = 0; i < sizeof(digest); i++) {
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    return std::string(hex, sizeof(digest) * 2);
+}
+
+// Hashes the partition prefix of the saved checkpoint, returns its size if it still matches
+size_t DownloadCheckpoint::LoadVerified() {
+    Settings settings(ns_);
+    size_t offset = settings.GetInt("offset");
+    if (offset == 0 || offset > partition_->size || settings.GetString("url") != url_) {
+        return 0;
+    }
+
+    constexpr size_t CHUNK_SIZE = 4096;
+    char* buffer = (char*)heap_caps_malloc(CHUNK_SIZE, MALLOC_CAP_INTERNAL);
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate buffer");
+        return 0;
+    }
+    bool read_ok = true;
+    for (size_t pos = 0; pos < offset && read_ok; pos += CHUNK_SIZE) {
+        size_t size = std::min(CHUNK_SIZE, offset - pos);
+        read_ok = esp_partition_read(partition_, pos, buffer, size) == ESP_OK;
+        mbedtls_sha256_update(&sha256_, (const unsigned char*)buffer, size);
+    }
+    heap_caps_free(buffer);
+
+    if (!read_ok || FinishHash() != settings.GetString("sha256")) {
+        ESP_LOGW(TAG, "Partial download in %s does not match its checkpoint, starting over", partition_->label);
+        Restart();
+        return 0;
+    }
+    offset_ = offset;
+    last_saved_ = offset;
+    return offset;
+}
+
+bool DownloadCheckpoint::Open(Http* http, size_t& total_size) {
+    size_t resume = LoadVerified();
+    size_t saved_size = 0;
+    if (resume > 0) {
+        Settings settings(ns_);
+        saved_size = settings.GetInt("size");
+        http->SetHeader("Range", "bytes=" + std::to_string(resume) + "-");
+        // The server answers with the whole file instead if it changed since
+        auto etag = settings.GetString("etag");
+        if (!etag.empty()) {
+            http->SetHeader("If-Range", etag);
+        }
+    }
+
+    if (!http->Open("GET", url_)) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection");
+        return false;
+    }
+
+    int status = http->GetStatusCode();
+    if (status == 206 && resume > 0) {
+        // Content-Range: bytes <first>-<last>/<size>
+        auto range = http->GetResponseHeader("Content-Range");
+        unsigned int first = 0, last = 0, size = 0;
+        if (sscanf(range.c_str(), "bytes %u-%u/%u", &first, &last, &size) == 3 && first == resume && size == saved_size) {
+            ESP_LOGI(TAG, "Resuming download at %u of %u bytes", resume, size);
+            total_size = size;
+            return true;
+        }
+        ESP_LOGE(TAG, "Unexpected Content-Range: %s", range.c_str());
+        Clear();
+        return false;
+    }
+    if (status != 200) {
+        ESP_LOGE(TAG, "Failed to download, status code: %d", status);
+        return false;
+    }
+
+    // A new download, or the server did not resume the old one
+    Restart();
+    total_size = http->GetBodyLength();
+    Settings settings(ns_, true);
+    settings.SetString("url", url_);
+    settings.SetInt("size", total_size);
+    settings.SetString("etag", http->GetResponseHeader("ETag"));
+    settings.SetInt("offset", 0);
+    return true;
+}
+
+void DownloadCheckpoint::Update(const void* data, size_t size) {
+    mbedtls_sha256_update(&sha256_, (const unsigned char*)data, size);
+    offset_ += size;
+    if (offset_ - last_saved_ >= DOWNLOAD_CHECKPOINT_INTERVAL) {
+        Save();
+    }
+}
+
+void DownloadCheckpoint::Save() {
+    Settings settings(ns_, true);
+    settings.SetInt("offset", offset_);
+    settings.SetString("sha256", FinishHash());
+    last_saved_ = offset_;
+}
+
+void DownloadCheckpoint::Clear() {
+    Settings settings(ns_, true);
+    settings.EraseAll();
+    Restart();
+}
@@ -0,0 +1,52 @@
+#ifndef DOWNLOAD_CHECKPOINT_H
+#define DOWNLOAD_CHECKPOINT_H
+
+#include <http.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+#include <string>
+
+// Bytes written between two checkpoints saved to NVS
+#define DOWNLOAD_CHECKPOINT_INTERVAL (64 * 1024)
+
+/*
+ * Progress of a download into a flash partition, saved to NVS regularly so that an interrupted
+ * download continues with an HTTP Range request instead of starting over, also after a reboot.
+ *
+ * A checkpoint holds the url, the ETag and size of the file, and the number of bytes already in the
+ * partition with their SHA-256. Open() re-reads that prefix from flash and only resumes while it
+ * still hashes the same, otherwise the download starts at byte 0.
+ */
+class DownloadCheckpoint {
+public:
+    // ns is the NVS namespace, one per partition
+    DownloadCheckpoint(const char* ns, const std::string& url, const esp_partition_t* partition);
+    ~DownloadCheckpoint();
+
+    // Sends the GET, with a Range from the checkpoint if there is one. On success offset() tells where
+    // the response body starts and total_size is the size of the whole file.
+    bool Open(Http* http, size_t& total_size);
+    // Adds data just written to the partition at offset(), a checkpoint is saved every DOWNLOAD_CHECKPOINT_INTERVAL bytes
+    void Update(const void* data, size_t size);
+    // Saves the current offset right away, for a download that is interrupted
+    void Save();
+    // The download completed, or the partition content is of no use anymore
+    void Clear();
+
+    size_t offset() const { return offset_; }
+
+private:
+    std::string ns_;
+    std::string url_;
+    const esp_partition_t* partition_;
+    mbedtls_sha256_context sha256_;
+    size_t offset_ = 0;
+    size_t last_saved_ = 0;
+
+    size_t LoadVerified();
+    void Restart();
+    std::string FinishHash() const;
+};
+
+#endif // DOWNLOAD_CHECKPOINT_H
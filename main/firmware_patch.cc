@@ -0,0 +1,261 @@
+#include "firmware_patch.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "FirmwarePatch"
+
+#define PATCH_COMMAND_COPY 0x01
+#define PATCH_COMMAND_ADD 0x02
+#define PATCH_COMMAND_INSERT 0x03
+
+// Output goes to the OTA handle in flash sector sized writes
+#define PATCH_OUTPUT_SIZE 4096
+// Source bytes are read in slices of this size onto the stack
+#define PATCH_SOURCE_SLICE 256
+
+static uint32_t ReadUint32(const uint8_t* data) {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static uint16_t ReadUint16(const uint8_t* data) {
+    return ((uint16_t)data[0] << 8) | data[1];
+}
+
+FirmwarePatch::FirmwarePatch(const esp_partition_t* source, esp_ota_handle_t target)
+    : source_(source), target_(target) {
+    mbedtls_sha256_init(&sha256_);
+    mbedtls_sha256_starts(&sha256_, 0);
+    output_.reserve(PATCH_OUTPUT_SIZE);
+}
+
+FirmwarePatch::~FirmwarePatch() {
+    mbedtls_sha256_free(&sha256_);
+}
+
+size_t FirmwarePatch::NeededFieldSize() const {
+    switch (state_) {
+    case kStateHeader:
+        return 76;
+    case kStateCommand:
+        if (field_size_ == 0) {
+            return 1;
+        }
+        return field_[0] == PATCH_COMMAND_INSERT ? 5 : 9;
+    case kStateAddBlock:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+bool FirmwarePatch::Feed(const uint8_t* data, size_t size) {
+    while (size > 0 && !failed_) {
+        if (state_ == kStateInsert) {
+            size_t n = std::min<size_t>(size, remaining_);
+            failed_ = !Emit(data, n);
+            remaining_ -= n;
+            if (remaining_ == 0) {
+                state_ = kStateCommand;
+            }
+            data += n;
+            size -= n;
+            continue;
+        }
+
+        if (state_ == kStateAddDelta) {
+            uint8_t slice[PATCH_SOURCE_SLICE];
+            size_t n = std::min<size_t>({size, block_delta_, sizeof(slice)});
+            if (esp_partition_read(source_, source_offset_, slice, n) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to read source at 0x%lx", source_offset_);
+                failed_ = true;
+                break;
+            }
+            for (size_t i = 0; i < n; i++) {
+                slice[i] += data[i];
+            }
+            failed_ = !Emit(slice, n);
+            source_offset_ += n;
+            block_delta_ -= n;
+            if (block_delta_ == 0) {
+                state_ = remaining_ > 0 ? kStateAddBlock : kStateCommand;
+            }
+            data += n;
+            size -= n;
+            continue;
+        }
+
+        if (state_ == kStateCommand && field_size_ == 0 && produced_ == target_size_) {
+            ESP_LOGE(TAG, "Unexpected data after the end of the image");
+            failed_ = true;
+            break;
+        }
+
+        size_t n = std::min(NeededFieldSize() - field_size_, size);
+        memcpy(field_ + field_size_, data, n);
+        field_size_ += n;
+        data += n;
+        size -= n;
+        if (field_size_ == NeededFieldSize()) {
+            failed_ = !ParseField();
+            field_size_ = 0;
+        }
+    }
+    return !failed_;
+}
+
+bool FirmwarePatch::ParseField() {
+    if (state_ == kStateHeader) {
+        if (memcmp(field_, FIRMWARE_PATCH_MAGIC, 4) != 0) {
+            ESP_LOGE(TAG, "Not a firmware patch");
+            return false;
+        }
+        source_size_ = ReadUint32(field_ + 4);
+        target_size_ = ReadUint32(field_ + 40);
+        memcpy(target_sha256_, field_ + 44, sizeof(target_sha256_));
+        ESP_LOGI(TAG, "Patch from %lu to %lu bytes", source_size_, target_size_);
+        if (source_size_ > source_->size || !CheckSource(field_ + 8)) {
+            ESP_LOGE(TAG, "Patch does not apply to the running firmware");
+            return false;
+        }
+        state_ = kStateCommand;
+        return true;
+    }
+
+    if (state_ == kStateAddBlock) {
+        uint16_t skip = ReadUint16(field_);
+        uint16_t count = ReadUint16(field_ + 2);
+        if (skip + count > remaining_) {
+            ESP_LOGE(TAG, "Add block overruns its command");
+            return false;
+        }
+        remaining_ -= skip + count;
+        if (!CopySource(skip)) {
+            return false;
+        }
+        block_delta_ = count;
+        if (count > 0) {
+            state_ = kStateAddDelta;
+        } else if (remaining_ == 0) {
+            state_ = kStateCommand;
+        }
+        return true;
+    }
+
+    // kStateCommand
+    uint8_t command = field_[0];
+    if (command != PATCH_COMMAND_COPY && command != PATCH_COMMAND_ADD && command != PATCH_COMMAND_INSERT) {
+        ESP_LOGE(TAG, "Unknown patch command: %u", command);
+        return false;
+    }
+    uint32_t length = ReadUint32(field_ + (command == PATCH_COMMAND_INSERT ? 1 : 5));
+    if (length > target_size_ - produced_) {
+        ESP_LOGE(TAG, "Patch command overruns the image");
+        return false;
+    }
+    if (command == PATCH_COMMAND_INSERT) {
+        remaining_ = length;
+        if (length > 0) {
+            state_ = kStateInsert;
+        }
+        return true;
+    }
+
+    source_offset_ = ReadUint32(field_ + 1);
+    if (source_offset_ > source_size_ || length > source_size_ - source_offset_) {
+        ESP_LOGE(TAG, "Patch command reads outside the source");
+        return false;
+    }
+    if (command == PATCH_COMMAND_COPY) {
+        return CopySource(length);
+    }
+    remaining_ = length;
+    if (length > 0) {
+        state_ = kStateAddBlock;
+    }
+    return true;
+}
+
+bool FirmwarePatch::CheckSource(const uint8_t* expected_sha256) {
+    constexpr size_t CHUNK_SIZE = 4096;
+    uint8_t* buffer = (uint8_t*)heap_caps_malloc(CHUNK_SIZE, MALLOC_CAP_INTERNAL);
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate buffer");
+        return false;
+    }
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts(&sha256, 0);
+    bool read_ok = true;
+    for (size_t offset = 0; offset < source_size_ && read_ok; offset += CHUNK_SIZE) {
+        size_t size = std::min<size_t>(CHUNK_SIZE, source_size_ - offset);
+        read_ok = esp_partition_read(source_, offset, buffer, size) == ESP_OK;
+        mbedtls_sha256_update(&sha256, buffer, size);
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha256, digest);
+    mbedtls_sha256_free(&sha256);
+    heap_caps_free(buffer);
+    return read_ok && memcmp(digest, expected_sha256, sizeof(digest)) == 0;
+}
+
+// Emits size source bytes from source_offset_ unchanged
+bool FirmwarePatch::CopySource(size_t size) {
+    uint8_t slice[PATCH_SOURCE_SLICE];
+    while (size > 0) {
+        size_t n = std::min(size, sizeof(slice));
+        if (esp_partition_read(source_, source_offset_, slice, n) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read source at 0x%lx", source_offset_);
+            return false;
+        }
+        if (!Emit(slice, n)) {
+            return false;
+        }
+        source_offset_ += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool FirmwarePatch::Emit(const uint8_t* data, size_t size) {
+    output_.append((const char*)data, size);
+    produced_ += size;
+    if (output_.size() >= PATCH_OUTPUT_SIZE) {
+        return FlushOutput();
+    }
+    return true;
+}
+
+bool FirmwarePatch::FlushOutput() {
+    if (output_.empty()) {
+        return true;
+    }
+    mbedtls_sha256_update(&sha256_, (const unsigned char*)output_.data(), output_.size());
+    auto err = esp_ota_write(target_, output_.data(), output_.size());
+    output_.clear();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+bool FirmwarePatch::Finish() {
+    if (failed_ || !FlushOutput()) {
+        return false;
+    }
+    if (state_ != kStateCommand || field_size_ != 0 || produced_ != target_size_ || target_size_ == 0) {
+        ESP_LOGE(TAG, "Patch ended early, %u of %lu bytes", produced_, target_size_);
+        return false;
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha256_, digest);
+    if (memcmp(digest, target_sha256_, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "Patched image does not match its hash");
+        return false;
+    }
+    return true;
+}
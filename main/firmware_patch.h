@@ -0,0 +1,79 @@
+#ifndef FIRMWARE_PATCH_H
+#define FIRMWARE_PATCH_H
+
+#include <esp_partition.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+
+#include <cstdint>
+#include <string>
+
+#define FIRMWARE_PATCH_MAGIC "XZP1"
+
+/*
+ * Streams a delta patch against the running app partition into an OTA handle, bsdiff style: the
+ * new image is made of source ranges, copied as they are or with small byte deltas added, and
+ * literal bytes. All integers are big endian.
+ *
+ * |magic "XZP1"|source_size 4u|source_sha256 32u|target_size 4u|target_sha256 32u|
+ * then commands up to target_size bytes of output:
+ * |0x01 copy|offset 4u|length 4u|
+ * |0x02 add|offset 4u|length 4u| followed by blocks of |skip 2u|count 2u|count delta bytes|, skip
+ *     source bytes are copied, count source bytes get a delta added, until length is covered
+ * |0x03 insert|length 4u|length bytes|
+ *
+ * The source hash is checked once the header is in, the target hash by Finish().
+ */
+class FirmwarePatch {
+public:
+    FirmwarePatch(const esp_partition_t* source, esp_ota_handle_t target);
+    ~FirmwarePatch();
+
+    // Any chunking of the patch stream works, false once the patch is found broken or does not apply
+    bool Feed(const uint8_t* data, size_t size);
+    // True if the whole image was produced and hashes as announced
+    bool Finish();
+
+    size_t target_size() const { return target_size_; }
+    size_t produced() const { return produced_; }
+
+private:
+    enum State {
+        kStateHeader,
+        kStateCommand,
+        kStateAddBlock,
+        kStateAddDelta,
+        kStateInsert,
+    };
+
+    const esp_partition_t* source_;
+    esp_ota_handle_t target_;
+    mbedtls_sha256_context sha256_;
+    State state_ = kStateHeader;
+    bool failed_ = false;
+
+    // Fixed size fields are collected here across Feed() calls
+    uint8_t field_[76];
+    size_t field_size_ = 0;
+
+    uint32_t source_size_ = 0;
+    uint32_t target_size_ = 0;
+    uint8_t target_sha256_[32];
+    size_t produced_ = 0;
+
+    // Current command
+    uint32_t source_offset_ = 0;
+    uint32_t remaining_ = 0;
+    uint32_t block_delta_ = 0;
+
+    std::string output_;
+
+    size_t NeededFieldSize() const;
+    bool ParseField();
+    bool CheckSource(const uint8_t* expected_sha256);
+    bool CopySource(size_t size);
+    bool Emit(const uint8_t* data, size_t size);
+    bool FlushOutput();
+};
+
+#endif // FIRMWARE_PATCH_H
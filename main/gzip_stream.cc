@@ -0,0 +1,239 @@
+#include "gzip_stream.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_crc.h>
+#include <rom/miniz.h>
+
+#include <algorithm>
+#include <cstring>
+
+#define TAG "GzipStream"
+
+#define GZIP_INPUT_SIZE 4096
+
+#define GZIP_FLAG_FHCRC 0x02
+#define GZIP_FLAG_FEXTRA 0x04
+#define GZIP_FLAG_FNAME 0x08
+#define GZIP_FLAG_FCOMMENT 0x10
+
+static void* AllocateBuffer(size_t size) {
+    void* buffer = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (buffer == nullptr) {
+        buffer = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    return buffer;
+}
+
+GzipStream::GzipStream(Http* http) : http_(http) {
+    input_ = (uint8_t*)heap_caps_malloc(GZIP_INPUT_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (input_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the input buffer");
+        state_ = kStateError;
+    }
+}
+
+GzipStream::~GzipStream() {
+    heap_caps_free(input_);
+    heap_caps_free(inflator_);
+    heap_caps_free(window_);
+}
+
+// Makes the next size bytes available at input_ + input_offset_, false if the body ends before
+bool GzipStream::Fill(size_t size) {
+    if (input_size_ - input_offset_ >= size) {
+        return true;
+    }
+    memmove(input_, input_ + input_offset_, input_size_ - input_offset_);
+    input_size_ -= input_offset_;
+    input_offset_ = 0;
+    while (input_size_ < size && !body_ended_) {
+        int ret = http_->Read((char*)input_ + input_size_, GZIP_INPUT_SIZE - input_size_);
+        if (ret < 0) {
+            state_ = kStateError;
+            return false;
+        }
+        if (ret == 0) {
+            body_ended_ = true;
+            break;
+        }
+        input_size_ += ret;
+        body_read_ += ret;
+    }
+    return input_size_ >= size;
+}
+
+// RFC 1952 member header, only the deflate method exists
+bool GzipStream::SkipHeader() {
+    if (!Fill(10) || input_[input_offset_ + 2] != 8) {
+        return false;
+    }
+    uint8_t flags = input_[input_offset_ + 3];
+    input_offset_ += 10;
+
+    if (flags & GZIP_FLAG_FEXTRA) {
+        if (!Fill(2)) {
+            return false;
+        }
+        size_t length = input_[input_offset_] | input_[input_offset_ + 1] << 8;
+        input_offset_ += 2;
+        while (length > 0) {
+            if (!Fill(1)) {
+                return false;
+            }
+            size_t skip = std::min(length, input_size_ - input_offset_);
+            input_offset_ += skip;
+            length -= skip;
+        }
+    }
+    // The file name and the comment are zero terminated
+    for (uint8_t flag : {GZIP_FLAG_FNAME, GZIP_FLAG_FCOMMENT}) {
+        if (flags & flag) {
+            do {
+                if (!Fill(1)) {
+                    return false;
+                }
+            } while (input_[input_offset_++] != 0);
+        }
+    }
+    if (flags & GZIP_FLAG_FHCRC) {
+        if (!Fill(2)) {
+            return false;
+        }
+        input_offset_ += 2;
+    }
+    return true;
+}
+
+bool GzipStream::Start() {
+    if (!SkipHeader()) {
+        ESP_LOGE(TAG, "Invalid gzip header");
+        return false;
+    }
+    inflator_ = (tinfl_decompressor*)AllocateBuffer(sizeof(tinfl_decompressor));
+    window_ = (uint8_t*)AllocateBuffer(TINFL_LZ_DICT_SIZE);
+    if (inflator_ == nullptr || window_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the inflate window");
+        return false;
+    }
+    tinfl_init(inflator_);
+    state_ = kStateInflate;
+    ESP_LOGI(TAG, "Inflating a gzip body");
+    return true;
+}
+
+int GzipStream::Read(char* buffer, size_t size) {
+    switch (state_) {
+        case kStateDetect:
+            if (!Fill(2) && state_ == kStateError) {
+                return -1;
+            }
+            if (input_size_ >= 2 && input_[0] == 0x1f && input_[1] == 0x8b) {
+                if (!Start()) {
+                    state_ = kStateError;
+                    return -1;
+                }
+                return Inflate(buffer, size);
+            }
+            state_ = kStateRaw;
+            [[fallthrough]];
+        case kStateRaw: {
+            if (input_offset_ < input_size_) {
+                size_t n = std::min(size, input_size_ - input_offset_);
+                memcpy(buffer, input_ + input_offset_, n);
+                input_offset_ += n;
+                return n;
+            }
+            if (body_ended_) {
+                return 0;
+            }
+            int ret = http_->Read(buffer, size);
+            if (ret > 0) {
+                body_read_ += ret;
+            }
+            return ret;
+        }
+        case kStateInflate:
+        case kStateTrailer:
+            return Inflate(buffer, size);
+        case kStateDone:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+int GzipStream::Inflate(char* buffer, size_t size) {
+    while (pending_size_ == 0) {
+        if (state_ == kStateTrailer) {
+            if (!CheckTrailer()) {
+                state_ = kStateError;
+                return -1;
+            }
+            state_ = kStateDone;
+            return 0;
+        }
+        if (input_offset_ == input_size_ && !Fill(1) && state_ == kStateError) {
+            return -1;
+        }
+
+        // The window is circular, each call inflates at most up to its end
+        size_t in_size = input_size_ - input_offset_;
+        size_t out_size = TINFL_LZ_DICT_SIZE - window_offset_;
+        tinfl_status status = tinfl_decompress(inflator_, input_ + input_offset_, &in_size, window_, window_ + window_offset_,
+            &out_size, body_ended_ ? 0 : TINFL_FLAG_HAS_MORE_INPUT);
+        input_offset_ += in_size;
+        pending_offset_ = window_offset_;
+        pending_size_ = out_size;
+        window_offset_ = (window_offset_ + out_size) & (TINFL_LZ_DICT_SIZE - 1);
+        if (status == TINFL_STATUS_DONE) {
+            state_ = kStateTrailer;
+        } else if (status < 0) {
+            // Also a body that ends in the middle of the stream
+            ESP_LOGE(TAG, "Inflate failed: %d", (int)status);
+            state_ = kStateError;
+            return -1;
+        }
+    }
+
+    size_t n = std::min(size, pending_size_);
+    memcpy(buffer, window_ + pending_offset_, n);
+    crc_ = esp_rom_crc32_le(crc_, window_ + pending_offset_, n);
+    pending_offset_ += n;
+    pending_size_ -= n;
+    output_size_ += n;
+    return n;
+}
+
+// CRC-32 and the size modulo 2^32 of the inflated data, little endian
+bool GzipStream::CheckTrailer() {
+    if (!Fill(8)) {
+        ESP_LOGE(TAG, "The gzip trailer is missing");
+        return false;
+    }
+    const uint8_t* trailer = input_ + input_offset_;
+    uint32_t crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+    uint32_t size = trailer[4] | trailer[5] << 8 | trailer[6] << 16 | (uint32_t)trailer[7] << 24;
+    input_offset_ += 8;
+    if (crc != crc_ || size != output_size_) {
+        ESP_LOGE(TAG, "gzip trailer mismatch, crc %08lx/%08lx, size %lu/%lu", crc, crc_, size, output_size_);
+        return false;
+    }
+    return true;
+}
+
+bool GzipStream::ReadAll(Http* http, std::string& body) {
+    GzipStream stream(http);
+    body.clear();
+    char buffer[512];
+    while (true) {
+        int ret = stream.Read(buffer, sizeof(buffer));
+        if (ret < 0) {
+            return false;
+        }
+        if (ret == 0) {
+            return true;
+        }
+        body.append(buffer, ret);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef GZIP_STREAM_H
+#define GZIP_STREAM_H
+
+#include <http.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct tinfl_decompressor_tag;
+
+/*
+ * Reads an HTTP body and inflates it on the fly when it is gzip, recognised by the magic of its first
+ * bytes whatever the Content-Encoding says. Any other body is passed through unchanged, so a caller can
+ * read every download through it.
+ *
+ * Inflating uses the miniz of the ROM with a 32 KB window, which goes to PSRAM when there is some. The
+ * gzip trailer is checked at the end: a CRC or size mismatch fails the last Read().
+ */
+class GzipStream {
+public:
+    explicit GzipStream(Http* http);
+    ~GzipStream();
+
+    GzipStream(const GzipStream&) = delete;
+    GzipStream& operator=(const GzipStream&) = delete;
+
+    // Like Http::Read(), 0 at the end of the (inflated) body and negative on an error
+    int Read(char* buffer, size_t size);
+    // The whole body inflated, for small responses such as JSON, false on a read or gzip error
+    static bool ReadAll(Http* http, std::string& body);
+
+    bool compressed() const { return state_ != kStateRaw && state_ != kStateDetect; }
+    // Bytes of the HTTP body consumed so far, for the progress against the content length
+    size_t body_read() const { return body_read_; }
+
+private:
+    enum State {
+        kStateDetect,
+        kStateRaw,
+        kStateInflate,
+        kStateTrailer,
+        kStateDone,
+        kStateError,
+    };
+
+    Http* http_;
+    State state_ = kStateDetect;
+    size_t body_read_ = 0;
+    bool body_ended_ = false;
+
+    uint8_t* input_ = nullptr;
+    size_t input_offset_ = 0;
+    size_t input_size_ = 0;
+
+    tinfl_decompressor_tag* inflator_ = nullptr;
+    uint8_t* window_ = nullptr;
+    size_t window_offset_ = 0;
+    // Inflated bytes in the window not returned yet
+    size_t pending_offset_ = 0;
+    size_t pending_size_ = 0;
+    uint32_t crc_ = 0;
+    uint32_t output_size_ = 0;
+
+    bool Fill(size_t size);
+    bool SkipHeader();
+    bool Start();
+    int Inflate(char* buffer, size_t size);
+    bool CheckTrailer();
+};
+
+#endif // GZIP_STREAM_H
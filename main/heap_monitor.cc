@@ -0,0 +1,334 @@
+#include "heap_monitor.h"
+
+#include <esp_log.h>
+#include <cJSON.h>
+
+#if CONFIG_USE_HEAP_MONITOR
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#if CONFIG_HEAP_MONITOR_TRACE
+#include <esp_heap_trace.h>
+#endif
+
+#include <algorithm>
+
+#if CONFIG_USE_LOW_MEMORY_PROFILE
+#include "application.h"
+#endif
+#endif
+
+#define TAG "HeapMonitor"
+
+#if CONFIG_USE_HEAP_MONITOR
+
+#define HEAP_MONITOR_INTERVAL_US (10 * 1000 * 1000)
+#define HEAP_MONITOR_RELEASE_INTERVAL_US (60 * 1000 * 1000)
+// A fragmented region with a largest block above this many times its minimum is not short
+#define HEAP_MONITOR_FRAGMENTED_BLOCKS 4
+#define HEAP_MONITOR_HISTOGRAM_BUCKETS 7
+#define HEAP_MONITOR_TOP_SITES 8
+
+// Written by the failed allocation hook, which may run on any task
+static std::atomic<uint32_t> failed_allocations_{0};
+static std::atomic<size_t> failed_size_{0};
+static std::atomic<uint32_t> failed_caps_{0};
+static std::atomic<const char*> failed_function_{nullptr};
+static bool has_psram_ = false;
+
+static void OnAllocationFailed(size_t size, uint32_t caps, const char* function_name) {
+    // Without PSRAM, PSRAM first allocations like those of HeapPlacement always fail and fall back
+    if ((caps & MALLOC_CAP_SPIRAM) && !has_psram_) {
+        return;
+    }
+    failed_size_.store(size, std::memory_order_relaxed);
+    failed_caps_.store(caps, std::memory_order_relaxed);
+    failed_function_.store(function_name, std::memory_order_relaxed);
+    failed_allocations_.fetch_add(1, std::memory_order_release);
+}
+
+struct Histogram {
+    uint32_t used[HEAP_MONITOR_HISTOGRAM_BUCKETS] = {};
+    uint32_t free[HEAP_MONITOR_HISTOGRAM_BUCKETS] = {};
+};
+
+static int BucketOf(size_t size) {
+    if (size < 64) {
+        return 0;
+    }
+    int log2 = 31 - __builtin_clz((uint32_t)size);
+    return std::min((log2 - 6) / 2 + 1, HEAP_MONITOR_HISTOGRAM_BUCKETS - 1);
+}
+
+// Runs with the heap locked, must not allocate or log
+static bool CountBlock(walker_heap_into_t heap_info, walker_block_info_t block_info, void* user_data) {
+    auto histogram = static_cast<Histogram*>(user_data);
+    int bucket = BucketOf(block_info.size);
+    if (block_info.used) {
+        histogram->used[bucket]++;
+    } else {
+        histogram->free[bucket]++;
+    }
+    return true;
+}
+
+#if CONFIG_HEAP_MONITOR_TRACE
+static heap_trace_record_t trace_records_[CONFIG_HEAP_MONITOR_TRACE_RECORDS];
+
+struct AllocationSite {
+    void* caller;
+    uint32_t count;
+    size_t bytes;
+};
+
+// Live allocations grouped by their caller, the largest holders first
+static size_t CollectTopSites(AllocationSite* sites, size_t max_sites) {
+    static AllocationSite all[64];
+    size_t site_count = 0;
+    size_t records = heap_trace_get_count();
+    for (size_t i = 0; i < records; i++) {
+        heap_trace_record_t record;
+        if (heap_trace_get(i, &record) != ESP_OK || record.address == nullptr) {
+            continue;
+        }
+        void* caller = record.alloced_by[0];
+        auto it = std::find_if(all, all + site_count, [caller](const AllocationSite& site) {
+            return site.caller == caller;
+        });
+        if (it == all + site_count) {
+            if (site_count == sizeof(all) / sizeof(all[0])) {
+                continue;
+            }
+            *it = {caller, 0, 0};
+            site_count++;
+        }
+        it->count++;
+        it->bytes += record.size;
+    }
+    size_t top = std::min(site_count, max_sites);
+    std::partial_sort(all, all + top, all + site_count, [](const AllocationSite& a, const AllocationSite& b) {
+        return a.bytes > b.bytes;
+    });
+    std::copy(all, all + top, sites);
+    return top;
+}
+#endif
+
+void HeapMonitor::Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!regions_.empty()) {
+        return;
+    }
+    regions_.push_back({"internal", MALLOC_CAP_INTERNAL, CONFIG_HEAP_MONITOR_INTERNAL_MIN_BLOCK_KB * 1024, true});
+    regions_.push_back({"dma", MALLOC_CAP_DMA, CONFIG_HEAP_MONITOR_INTERNAL_MIN_BLOCK_KB * 1024, false});
+#if CONFIG_SPIRAM
+    has_psram_ = heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0;
+    if (has_psram_) {
+        regions_.push_back({"spiram", MALLOC_CAP_SPIRAM, CONFIG_HEAP_MONITOR_PSRAM_MIN_BLOCK_KB * 1024, true});
+    }
+#endif
+    heap_caps_register_failed_alloc_callback(OnAllocationFailed);
+#if CONFIG_HEAP_MONITOR_TRACE
+    ESP_ERROR_CHECK(heap_trace_init_standalone(trace_records_, CONFIG_HEAP_MONITOR_TRACE_RECORDS));
+    ESP_ERROR_CHECK(heap_trace_start(HEAP_TRACE_LEAKS));
+#endif
+}
+
+HeapPressure HeapMonitor::Measure() {
+    HeapPressure pressure = kHeapPressureNone;
+    for (auto& region : regions_) {
+        region.free = heap_caps_get_free_size(region.caps);
+        region.min_free = heap_caps_get_minimum_free_size(region.caps);
+        region.largest = heap_caps_get_largest_free_block(region.caps);
+        region.min_largest = std::min(region.min_largest, region.largest);
+        region.fragmentation = region.free > 0 ? 100 - region.largest * 100 / region.free : 0;
+
+        if (region.largest < region.min_block) {
+            region.pressure = kHeapPressureCritical;
+        } else if (region.fragmentation >= CONFIG_HEAP_MONITOR_FRAGMENTATION_PERCENT &&
+                   region.largest < region.min_block * HEAP_MONITOR_FRAGMENTED_BLOCKS) {
+            region.pressure = kHeapPressureFragmented;
+        } else {
+            region.pressure = kHeapPressureNone;
+        }
+        pressure = std::max(pressure, region.pressure);
+    }
+    return pressure;
+}
+
+void HeapMonitor::Check() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (regions_.empty()) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    uint32_t failures = failed_allocations_.load(std::memory_order_acquire);
+    bool failed = failures != checked_failures_;
+    if (!failed && now - last_measure_us_ < HEAP_MONITOR_INTERVAL_US) {
+        return;
+    }
+    last_measure_us_ = now;
+
+    if (failed) {
+        const char* function = failed_function_.load(std::memory_order_relaxed);
+        ESP_LOGW(TAG, "%lu allocations failed, the last of %u bytes with caps 0x%lx in %s",
+            (unsigned long)(failures - checked_failures_), failed_size_.load(std::memory_order_relaxed),
+            (unsigned long)failed_caps_.load(std::memory_order_relaxed), function ? function : "?");
+        checked_failures_ = failures;
+    }
+
+    HeapPressure previous = pressure_;
+    HeapPressure pressure = Measure();
+    pressure_ = pressure;
+#if CONFIG_USE_LOW_MEMORY_PROFILE
+    // The worst case so far, and what the device was doing when it got there
+    size_t headroom = regions_[0].min_free;
+    if (headroom < CONFIG_LOW_MEMORY_HEADROOM_KB * 1024 && headroom + 1024 <= headroom_logged_) {
+        headroom_logged_ = headroom;
+        ESP_LOGW(TAG, "internal headroom down to %u bytes while %s, largest block %u", headroom,
+            DeviceStateMachine::GetStateName(Application::GetInstance().GetDeviceState()), regions_[0].largest);
+    }
+#endif
+    if (pressure > previous) {
+        alarms_++;
+        for (auto& region : regions_) {
+            if (region.pressure != kHeapPressureNone) {
+                ESP_LOGW(TAG, "%s %s: free %u, largest block %u (minimum %u), %u%% fragmented", region.name,
+                    region.pressure == kHeapPressureCritical ? "critical" : "fragmented", region.free,
+                    region.largest, region.min_block, region.fragmentation);
+            }
+        }
+    } else if (pressure == kHeapPressureNone && previous != kHeapPressureNone) {
+        ESP_LOGI(TAG, "Heap pressure is gone");
+    }
+
+    // A failed allocation means a region had no block that large, even if it was retried elsewhere
+    if (failed) {
+        pressure = kHeapPressureCritical;
+    }
+    if (pressure == kHeapPressureNone || (!failed && now - last_release_us_ < HEAP_MONITOR_RELEASE_INTERVAL_US)) {
+        return;
+    }
+    last_release_us_ = now;
+    // Releasers may take other locks and remove themselves
+    std::vector<ReleaserEntry> releasers = releasers_;
+    lock.unlock();
+
+    for (auto& entry : releasers) {
+        size_t released = entry.releaser(pressure);
+        if (released == 0) {
+            continue;
+        }
+        lock.lock();
+        released_bytes_ += released;
+        HeapPressure remaining = Measure();
+        pressure_ = remaining;
+        lock.unlock();
+        ESP_LOGI(TAG, "%s released %u bytes", entry.name, released);
+        if (remaining == kHeapPressureNone) {
+            break;
+        }
+    }
+}
+
+int HeapMonitor::AddReleaser(const char* name, Releaser releaser) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int id = next_releaser_id_++;
+    releasers_.push_back({id, name, std::move(releaser)});
+    return id;
+}
+
+void HeapMonitor::RemoveReleaser(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    releasers_.erase(std::remove_if(releasers_.begin(), releasers_.end(), [id](const ReleaserEntry& entry) {
+        return entry.id == id;
+    }), releasers_.end());
+}
+
+void HeapMonitor::PrintReport() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Measure();
+    for (auto& region : regions_) {
+        ESP_LOGI(TAG, "%-8s free: %u minimal: %u largest: %u (lowest %u), %u%% fragmented", region.name,
+            region.free, region.min_free, region.largest, region.min_largest, region.fragmentation);
+    }
+    ESP_LOGI(TAG, "failed allocations: %lu, alarms: %lu, released: %u bytes",
+        (unsigned long)failed_allocations_.load(), (unsigned long)alarms_, released_bytes_);
+#if CONFIG_HEAP_MONITOR_TRACE
+    AllocationSite sites[HEAP_MONITOR_TOP_SITES];
+    size_t count = CollectTopSites(sites, HEAP_MONITOR_TOP_SITES);
+    for (size_t i = 0; i < count; i++) {
+        ESP_LOGI(TAG, "site %p: %lu allocations, %u bytes", sites[i].caller, (unsigned long)sites[i].count,
+            sites[i].bytes);
+    }
+#endif
+}
+
+cJSON* HeapMonitor::CreateJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Measure();
+    cJSON* json = cJSON_CreateObject();
+    for (auto& region : regions_) {
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "free", region.free);
+        cJSON_AddNumberToObject(item, "min_free", region.min_free);
+        cJSON_AddNumberToObject(item, "largest", region.largest);
+        cJSON_AddNumberToObject(item, "min_largest", region.min_largest);
+        cJSON_AddNumberToObject(item, "fragmentation", region.fragmentation);
+        if (region.walk) {
+            Histogram histogram;
+            heap_caps_walk(region.caps, CountBlock, &histogram);
+            cJSON* used = cJSON_CreateArray();
+            cJSON* free = cJSON_CreateArray();
+            for (int i = 0; i < HEAP_MONITOR_HISTOGRAM_BUCKETS; i++) {
+                cJSON_AddItemToArray(used, cJSON_CreateNumber(histogram.used[i]));
+                cJSON_AddItemToArray(free, cJSON_CreateNumber(histogram.free[i]));
+            }
+            cJSON_AddItemToObject(item, "used_blocks", used);
+            cJSON_AddItemToObject(item, "free_blocks", free);
+        }
+        cJSON_AddItemToObject(json, region.name, item);
+    }
+    cJSON_AddNumberToObject(json, "failed_allocations", failed_allocations_.load());
+    cJSON_AddNumberToObject(json, "alarms", alarms_);
+    cJSON_AddNumberToObject(json, "released", released_bytes_);
+#if CONFIG_HEAP_MONITOR_TRACE
+    AllocationSite sites[HEAP_MONITOR_TOP_SITES];
+    size_t count = CollectTopSites(sites, HEAP_MONITOR_TOP_SITES);
+    cJSON* top = cJSON_CreateArray();
+    for (size_t i = 0; i < count; i++) {
+        char caller[16];
+        snprintf(caller, sizeof(caller), "%p", sites[i].caller);
+        cJSON* site = cJSON_CreateArray();
+        cJSON_AddItemToArray(site, cJSON_CreateString(caller));
+        cJSON_AddItemToArray(site, cJSON_CreateNumber(sites[i].count));
+        cJSON_AddItemToArray(site, cJSON_CreateNumber(sites[i].bytes));
+        cJSON_AddItemToArray(top, site);
+    }
+    cJSON_AddItemToObject(json, "top_sites", top);
+#endif
+    return json;
+}
+
+#else
+
+void HeapMonitor::Start() {
+}
+
+void HeapMonitor::Check() {
+}
+
+int HeapMonitor::AddReleaser(const char* name, Releaser releaser) {
+    return 0;
+}
+
+void HeapMonitor::RemoveReleaser(int id) {
+}
+
+void HeapMonitor::PrintReport() {
+}
+
+cJSON* HeapMonitor::CreateJson() {
+    return cJSON_CreateObject();
+}
+
+#endif
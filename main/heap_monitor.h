@@ -0,0 +1,111 @@
+#ifndef HEAP_MONITOR_H
+#define HEAP_MONITOR_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <sdkconfig.h>
+
+struct cJSON;
+
+enum HeapPressure {
+    kHeapPressureNone,
+    kHeapPressureFragmented,    // A region is split into small blocks, nothing has failed yet
+    kHeapPressureCritical,      // The largest block of a region is below its minimum, or an allocation failed
+};
+
+/**
+ * HeapMonitor - Why an allocation fails while the free heap looks fine
+ *
+ * Check() runs on the main task every second. Every 10 seconds, or at once after an allocation
+ * failed, it measures free size, low watermark and largest free block of the internal, DMA and
+ * PSRAM regions. Fragmentation is the share of the free memory outside the largest block.
+ *
+ * When a region gets fragmented or its largest block drops below the minimum configured for it,
+ * a warning is logged and the releasers run in the order they were added, each dropping optional
+ * memory it can rebuild later (decoded sound cache, glyph cache, GIF frame cache) and returning
+ * the bytes it freed. They stop once the pressure is gone, and run at most once a minute unless
+ * an allocation failed. Releasers run on the main task and may take the display lock.
+ * With CONFIG_USE_LOW_MEMORY_PROFILE every new low of the internal free heap under
+ * CONFIG_LOW_MEMORY_HEADROOM_KB is logged with the device state it happened in.
+ *
+ * PrintReport() logs the same counters and is cheap enough to call every minute. CreateJson(),
+ * built for the metrics report, adds histograms of the used and free block sizes of each region, which
+ * walks the heap under its lock. With CONFIG_HEAP_MONITOR_TRACE both list the call sites holding
+ * the most memory, as addresses for addr2line.
+ *
+ * Without CONFIG_USE_HEAP_MONITOR releasers are accepted and never called.
+ */
+class HeapMonitor {
+public:
+    // Returns the bytes released
+    using Releaser = std::function<size_t(HeapPressure pressure)>;
+
+    static HeapMonitor& GetInstance() {
+        static HeapMonitor instance;
+        return instance;
+    }
+
+    HeapMonitor(const HeapMonitor&) = delete;
+    HeapMonitor& operator=(const HeapMonitor&) = delete;
+
+    // Counts failed allocations from here on, and starts the heap trace if enabled
+    void Start();
+    // Main task only
+    void Check();
+
+    // Returns an id for RemoveReleaser(), name has to stay valid
+    int AddReleaser(const char* name, Releaser releaser);
+    void RemoveReleaser(int id);
+
+    HeapPressure pressure() const { return pressure_; }
+    void PrintReport();
+    cJSON* CreateJson();
+
+private:
+    HeapMonitor() = default;
+
+#if CONFIG_USE_HEAP_MONITOR
+    struct Region {
+        const char* name;
+        uint32_t caps;
+        size_t min_block;           // Largest block below this is critical
+        bool walk;                  // DMA memory is part of the internal region, it is walked there
+        size_t free = 0;
+        size_t min_free = 0;
+        size_t largest = 0;
+        size_t min_largest = SIZE_MAX;
+        uint8_t fragmentation = 0;  // Percent of the free memory outside the largest block
+        HeapPressure pressure = kHeapPressureNone;
+    };
+    struct ReleaserEntry {
+        int id;
+        const char* name;
+        Releaser releaser;
+    };
+
+    std::mutex mutex_;
+    std::vector<Region> regions_;
+    std::vector<ReleaserEntry> releasers_;
+    int next_releaser_id_ = 1;
+    std::atomic<HeapPressure> pressure_{kHeapPressureNone};
+    int64_t last_measure_us_ = 0;
+    int64_t last_release_us_ = 0;
+    uint32_t checked_failures_ = 0;
+    uint32_t alarms_ = 0;
+    size_t released_bytes_ = 0;
+#if CONFIG_USE_LOW_MEMORY_PROFILE
+    size_t headroom_logged_ = SIZE_MAX;
+#endif
+
+    HeapPressure Measure();
+#else
+    std::atomic<HeapPressure> pressure_{kHeapPressureNone};
+#endif
+};
+
+#endif // HEAP_MONITOR_H
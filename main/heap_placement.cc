@@ -0,0 +1,113 @@
+#include "heap_placement.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_memory_utils.h>
+#include <cJSON.h>
+#include <atomic>
+
+#define TAG "HeapPlacement"
+
+namespace {
+
+const char* const kSubsystemNames[kHeapSubsystemCount] = {"audio", "display", "json", "protocol", "system"};
+
+struct SubsystemUsage {
+    std::atomic<size_t> psram{0};
+    std::atomic<size_t> internal{0};
+    std::atomic<size_t> peak{0};
+};
+
+SubsystemUsage usage[kHeapSubsystemCount];
+
+void Count(HeapSubsystem subsystem, void* ptr, bool allocated) {
+    // What the heap really handed out, the same on both ends however the caller rounded
+    size_t size = heap_caps_get_allocated_size(ptr);
+    auto& entry = usage[subsystem];
+    auto& region = esp_ptr_external_ram(ptr) ? entry.psram : entry.internal;
+    if (!allocated) {
+        region -= size;
+        return;
+    }
+    region += size;
+    size_t total = entry.psram + entry.internal;
+    size_t peak = entry.peak;
+    while (total > peak && !entry.peak.compare_exchange_weak(peak, total)) {
+    }
+}
+
+}  // namespace
+
+void* HeapPlacement::Allocate(HeapPlace place, HeapSubsystem subsystem, size_t size) {
+    void* ptr = nullptr;
+    switch (place) {
+        case kHeapPlacePsram:
+            ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if (ptr == nullptr) {
+                ptr = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+            }
+            break;
+        case kHeapPlaceInternal:
+            ptr = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+            break;
+        case kHeapPlaceDma:
+            ptr = heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+            break;
+    }
+    if (ptr != nullptr) {
+        Count(subsystem, ptr, true);
+    }
+    return ptr;
+}
+
+void HeapPlacement::Free(HeapSubsystem subsystem, void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    Count(subsystem, ptr, false);
+    heap_caps_free(ptr);
+}
+
+void HeapPlacement::InstallJsonHooks() {
+    cJSON_Hooks hooks = {
+        .malloc_fn = [](size_t size) -> void* {
+            return Allocate(kHeapPlacePsram, kHeapSubsystemJson, size);
+        },
+        .free_fn = [](void* ptr) {
+            Free(kHeapSubsystemJson, ptr);
+        },
+    };
+    cJSON_InitHooks(&hooks);
+}
+
+size_t HeapPlacement::InUse(HeapSubsystem subsystem) {
+    return usage[subsystem].psram + usage[subsystem].internal;
+}
+
+const char* HeapPlacement::GetSubsystemName(HeapSubsystem subsystem) {
+    return kSubsystemNames[subsystem];
+}
+
+void HeapPlacement::PrintReport() {
+    for (int i = 0; i < kHeapSubsystemCount; i++) {
+        auto& entry = usage[i];
+        ESP_LOGI(TAG, "%-8s psram: %u internal: %u peak: %u", kSubsystemNames[i],
+            entry.psram.load(), entry.internal.load(), entry.peak.load());
+    }
+    ESP_LOGI(TAG, "internal free: %u largest: %u, dma free: %u, psram free: %u",
+        heap_caps_get_free_size(MALLOC_CAP_INTERNAL), heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL),
+        heap_caps_get_free_size(MALLOC_CAP_DMA), heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+}
+
+cJSON* HeapPlacement::CreateJson() {
+    cJSON* json = cJSON_CreateObject();
+    for (int i = 0; i < kHeapSubsystemCount; i++) {
+        auto& entry = usage[i];
+        cJSON* item = cJSON_CreateArray();
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(entry.psram));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(entry.internal));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(entry.peak));
+        cJSON_AddItemToObject(json, kSubsystemNames[i], item);
+    }
+    return json;
+}
@@ -0,0 +1,101 @@
+#ifndef HEAP_PLACEMENT_H
+#define HEAP_PLACEMENT_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+struct cJSON;
+
+/*
+ * Where large buffers go, instead of wherever malloc() happens to put them.
+ *
+ * - kHeapPlacePsram: buffers only the CPU touches (PCM, Opus packets, JSON, pixels, download
+ *   pages). PSRAM where the board has it, internal RAM without PSRAM or once it is full.
+ * - kHeapPlaceDma: buffers handed to a DMA engine, always internal and DMA capable.
+ * - kHeapPlaceInternal: buffers used while the flash cache is off, or on paths PSRAM is too slow for.
+ *
+ * Internal RAM is then left to Wi-Fi / BT, task stacks and DMA. Every allocation is counted for
+ * its subsystem and the region it landed in, PrintReport() logs the totals and their peaks.
+ * Memory from Allocate() has to go back through Free() with the same subsystem.
+ */
+enum HeapPlace {
+    kHeapPlacePsram,
+    kHeapPlaceInternal,
+    kHeapPlaceDma,
+};
+
+enum HeapSubsystem {
+    kHeapSubsystemAudio,
+    kHeapSubsystemDisplay,
+    kHeapSubsystemJson,
+    kHeapSubsystemProtocol,
+    kHeapSubsystemSystem,
+    kHeapSubsystemCount,
+};
+
+class HeapPlacement {
+public:
+    static void* Allocate(HeapPlace place, HeapSubsystem subsystem, size_t size);
+    static void Free(HeapSubsystem subsystem, void* ptr);
+
+    // cJSON nodes and printed strings go to PSRAM as kHeapSubsystemJson, before the first cJSON call
+    static void InstallJsonHooks();
+
+    // Bytes the subsystem has in use now, in PSRAM and internal RAM together
+    static size_t InUse(HeapSubsystem subsystem);
+    static const char* GetSubsystemName(HeapSubsystem subsystem);
+
+    // Bytes in use per subsystem, in PSRAM and in internal RAM, and the peak of both together
+    static void PrintReport();
+    static cJSON* CreateJson();
+};
+
+// Allocator for the standard containers, fails like std::allocator: std::bad_alloc, or abort() without exceptions
+template <typename T, HeapPlace Place, HeapSubsystem Subsystem>
+class PlacedAllocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = PlacedAllocator<U, Place, Subsystem>;
+    };
+
+    PlacedAllocator() noexcept = default;
+    template <typename U>
+    PlacedAllocator(const PlacedAllocator<U, Place, Subsystem>&) noexcept {}
+
+    T* allocate(size_t n) {
+        void* ptr = HeapPlacement::Allocate(Place, Subsystem, n * sizeof(T));
+        if (ptr == nullptr) {
+#if __cpp_exceptions
+            throw std::bad_alloc();
+#else
+            abort();
+#endif
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) noexcept {
+        HeapPlacement::Free(Subsystem, ptr);
+    }
+
+    template <typename U>
+    bool operator==(const PlacedAllocator<U, Place, Subsystem>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const PlacedAllocator<U, Place, Subsystem>&) const noexcept { return false; }
+};
+
+template <typename T, HeapSubsystem Subsystem>
+using PsramVector = std::vector<T, PlacedAllocator<T, kHeapPlacePsram, Subsystem>>;
+
+template <typename T, HeapSubsystem Subsystem>
+using DmaVector = std::vector<T, PlacedAllocator<T, kHeapPlaceDma, Subsystem>>;
+
+template <typename T, HeapSubsystem Subsystem>
+using InternalVector = std::vector<T, PlacedAllocator<T, kHeapPlaceInternal, Subsystem>>;
+
+#endif // HEAP_PLACEMENT_H
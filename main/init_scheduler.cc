@@ -0,0 +1,76 @@
+#include "init_scheduler.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <cstring>
+
+#define TAG "InitScheduler"
+
+void InitScheduler::Add(const char* name, std::function<void()> function, std::initializer_list<const char*> deps,
+    uint32_t stack_size) {
+    if (steps_.size() >= INIT_SCHEDULER_MAX_STEPS) {
+        ESP_LOGE(TAG, "Too many steps, %s runs right away", name);
+        function();
+        return;
+    }
+
+    EventBits_t dep_bits = 0;
+    for (auto dep : deps) {
+        bool found = false;
+        for (auto& step : steps_) {
+            if (strcmp(step.name, dep) == 0) {
+                dep_bits |= ((EventBits_t)1 << step.index);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            ESP_LOGE(TAG, "Step %s depends on %s, which is not added before it", name, dep);
+        }
+    }
+    steps_.push_back({this, steps_.size(), name, std::move(function), dep_bits, stack_size});
+}
+
+void InitScheduler::Run() {
+    int64_t start_us = esp_timer_get_time();
+    event_group_ = xEventGroupCreate();
+    caller_task_ = xTaskGetCurrentTaskHandle();
+    UBaseType_t priority = uxTaskPriorityGet(NULL);
+
+    for (auto& step : steps_) {
+        auto ret = xTaskCreate([](void* arg) {
+            Step* step = static_cast<Step*>(arg);
+            step->scheduler->RunStep(*step);
+            vTaskDelete(NULL);
+        }, step.name, step.stack_size, &step, priority, nullptr);
+        if (ret != pdPASS) {
+            // Its dependencies were added before it and are running already
+            ESP_LOGW(TAG, "Failed to create the task of %s, running it inline", step.name);
+            RunStep(step);
+        }
+    }
+    // Counted by notification rather than by the bits, so no step is still inside the event group when it is deleted
+    size_t done = 0;
+    while (done < steps_.size()) {
+        done += ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    vEventGroupDelete(event_group_);
+    event_group_ = nullptr;
+
+    int64_t now = esp_timer_get_time();
+    ESP_LOGI(TAG, "%u steps took %lld ms, done %lld ms after boot", (unsigned)steps_.size(), (now - start_us) / 1000, now / 1000);
+    steps_.clear();
+}
+
+void InitScheduler::RunStep(Step& step) {
+    if (step.deps != 0) {
+        xEventGroupWaitBits(event_group_, step.deps, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    int64_t start_us = esp_timer_get_time();
+    step.function();
+    int64_t end_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "Step %s took %lld ms, done %lld ms after boot", step.name, (end_us - start_us) / 1000, end_us / 1000);
+    xEventGroupSetBits(event_group_, ((EventBits_t)1 << step.index));
+    xTaskNotifyGive(caller_task_);
+}
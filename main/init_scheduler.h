@@ -0,0 +1,51 @@
+#ifndef INIT_SCHEDULER_H
+#define INIT_SCHEDULER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+// One event group bit per step
+#define INIT_SCHEDULER_MAX_STEPS 24
+
+/**
+ * InitScheduler - Runs the startup steps that do not depend on each other at the same time
+ *
+ * Every step gets its own task at the priority of the caller and starts once the steps it
+ * depends on have finished, so dependencies can only name steps added before it. Run() returns
+ * when all of them are done. Each step is logged with its duration and the time since boot it
+ * finished at, for tracking startup regressions.
+ */
+class InitScheduler {
+public:
+    InitScheduler() = default;
+    InitScheduler(const InitScheduler&) = delete;
+    InitScheduler& operator=(const InitScheduler&) = delete;
+
+    void Add(const char* name, std::function<void()> function, std::initializer_list<const char*> deps = {},
+        uint32_t stack_size = 4096 * 2);
+    void Run();
+
+private:
+    struct Step {
+        InitScheduler* scheduler;
+        size_t index;
+        const char* name;
+        std::function<void()> function;
+        EventBits_t deps;
+        uint32_t stack_size;
+    };
+
+    std::vector<Step> steps_;
+    EventGroupHandle_t event_group_ = nullptr;
+    TaskHandle_t caller_task_ = nullptr;
+
+    void RunStep(Step& step);
+};
+
+#endif // INIT_SCHEDULER_H
@@ -0,0 +1,12 @@
+#include "lang_sound.h"
+#include "assets.h"
+#include "assets/lang_config.h"
+
+LangSound::operator std::string_view() const {
+    void* ptr = nullptr;
+    size_t size = 0;
+    if (!Assets::GetInstance().GetAssetData(name_, ptr, size)) {
+        return Lang::Sounds::OGG_POPUP;
+    }
+    return std::string_view(static_cast<const char*>(ptr), size);
+}
@@ -0,0 +1,26 @@
+#ifndef LANG_SOUND_H
+#define LANG_SOUND_H
+
+#include <string_view>
+
+/*
+ * A sound of the language that is kept in the assets partition instead of the app image
+ * (CONFIG_LANG_SOUNDS_IN_ASSETS). It is looked up by its file name whenever it is played,
+ * so it follows the assets applied at the time and costs no copy, the OGG data is read
+ * straight from the mapped partition.
+ *
+ * Where the partition does not have it, e.g. assets from a server that were built without
+ * sounds, the embedded popup sound is played instead.
+ */
+class LangSound {
+public:
+    constexpr LangSound(const char* name) : name_(name) {}
+
+    operator std::string_view() const;
+    inline const char* name() const { return name_; }
+
+private:
+    const char* name_;
+};
+
+#endif // LANG_SOUND_H
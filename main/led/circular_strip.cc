@@ -7,11 +7,21 @@
 
 #define BLINK_INFINITE -1
 
+// Rings this long are refreshed through DMA where the RMT supports it, shorter ones fit in RMT memory
+#define STRIP_DMA_MIN_LEDS 16
+#define STRIP_DMA_MEM_SYMBOLS 1024
+
+static bool SameColor(const StripColor& a, const StripColor& b) {
+    return a.red == b.red && a.green == b.green && a.blue == b.blue;
+}
+
 CircularStrip::CircularStrip(gpio_num_t gpio, uint16_t max_leds) : max_leds_(max_leds) {
     // If the gpio is not connected, you should use NoLed class
     assert(gpio != GPIO_NUM_NC);
 
     colors_.resize(max_leds_);
+    frames_[0].resize(max_leds_);
+    frames_[1].resize(max_leds_);
 
     led_strip_config_t strip_config = {};
     strip_config.strip_gpio_num = gpio;
@@ -22,7 +32,21 @@ CircularStrip::CircularStrip(gpio_num_t gpio, uint16_t max_leds) : max_leds_(max
     led_strip_rmt_config_t rmt_config = {};
     rmt_config.resolution_hz = 10 * 1000 * 1000; // 10MHz
 
-    ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_));
+#if SOC_RMT_SUPPORT_DMA
+    // A long ring would otherwise be fed by RMT interrupts all along the transfer
+    if (max_leds_ >= STRIP_DMA_MIN_LEDS) {
+        led_strip_rmt_config_t dma_config = rmt_config;
+        dma_config.mem_block_symbols = STRIP_DMA_MEM_SYMBOLS;
+        dma_config.flags.with_dma = true;
+        if (led_strip_new_rmt_device(&strip_config, &dma_config, &led_strip_) != ESP_OK) {
+            ESP_LOGW(TAG, "No DMA channel for the LED strip, using RMT memory");
+            led_strip_ = nullptr;
+        }
+    }
+#endif
+    if (led_strip_ == nullptr) {
+        ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_));
+    }
     led_strip_clear(led_strip_);
 
     esp_timer_create_args_t strip_timer_args = {
@@ -54,17 +78,17 @@ void CircularStrip::SetAllColor(StripColor color) {
     esp_timer_stop(strip_timer_);
     for (int i = 0; i < max_leds_; i++) {
         colors_[i] = color;
-        led_strip_set_pixel(led_strip_, i, color.red, color.green, color.blue);
     }
-    led_strip_refresh(led_strip_);
+    BackFrame() = colors_;
+    Present();
 }
 
 void CircularStrip::SetSingleColor(uint8_t index, StripColor color) {
     std::lock_guard<std::mutex> lock(mutex_);
     esp_timer_stop(strip_timer_);
     colors_[index] = color;
-    led_strip_set_pixel(led_strip_, index, color.red, color.green, color.blue);
-    led_strip_refresh(led_strip_);
+    BackFrame() = colors_;
+    Present();
 }
 
 void CircularStrip::SetMultiColors(const std::vector<StripColor>& colors) {
@@ -73,26 +97,25 @@ void CircularStrip::SetMultiColors(const std::vector<StripColor>& colors) {
     int count = std::min(max_leds_, static_cast<int>(colors.size()));
     for (int i = 0; i < count; i++) {
         colors_[i] = colors[i];
-        led_strip_set_pixel(led_strip_, i, colors[i].red, colors[i].green, colors[i].blue);
     }
-    led_strip_refresh(led_strip_);
+    BackFrame() = colors_;
+    Present();
 }
 
 void CircularStrip::Blink(StripColor color, int interval_ms) {
     for (int i = 0; i < max_leds_; i++) {
         colors_[i] = color;
     }
+    blink_on_ = true;
     StartStripTask(interval_ms, [this]() {
-        static bool on = true;
-        if (on) {
-            for (int i = 0; i < max_leds_; i++) {
-                led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
-            }
-            led_strip_refresh(led_strip_);
+        auto& frame = BackFrame();
+        if (blink_on_) {
+            frame = colors_;
         } else {
-            led_strip_clear(led_strip_);
+            std::fill(frame.begin(), frame.end(), StripColor());
         }
-        on = !on;
+        Present();
+        blink_on_ = !blink_on_;
     });
 }
 
@@ -106,21 +129,21 @@ void CircularStrip::FadeOut(int interval_ms) {
             if (colors_[i].red != 0 || colors_[i].green != 0 || colors_[i].blue != 0) {
                 all_off = false;
             }
-            led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
         }
+        BackFrame() = colors_;
+        Present();
         if (all_off) {
-            led_strip_clear(led_strip_);
             esp_timer_stop(strip_timer_);
-        } else {
-            led_strip_refresh(led_strip_);
         }
     });
 }
 
 void CircularStrip::Breathe(StripColor low, StripColor high, int interval_ms) {
+    breathe_increase_ = true;
+    breathe_color_ = low;
     StartStripTask(interval_ms, [this, low, high]() {
-        static bool increase = true;
-        static StripColor color = low;
+        auto& color = breathe_color_;
+        auto& increase = breathe_increase_;
         if (increase) {
             if (color.red < high.red) {
                 color.red++;
@@ -148,10 +171,9 @@ void CircularStrip::Breathe(StripColor low, StripColor high, int interval_ms) {
                 increase = true;
             }
         }
-        for (int i = 0; i < max_leds_; i++) {
-            led_strip_set_pixel(led_strip_, i, color.red, color.green, color.blue);
-        }
-        led_strip_refresh(led_strip_);
+        auto& frame = BackFrame();
+        std::fill(frame.begin(), frame.end(), color);
+        Present();
     });
 }
 
@@ -159,23 +181,55 @@ void CircularStrip::Scroll(StripColor low, StripColor high, int length, int inte
     for (int i = 0; i < max_leds_; i++) {
         colors_[i] = low;
     }
+    scroll_offset_ = 0;
     StartStripTask(interval_ms, [this, low, high, length]() {
-        static int offset = 0;
         for (int i = 0; i < max_leds_; i++) {
             colors_[i] = low;
         }
         for (int j = 0; j < length; j++) {
-            int i = (offset + j) % max_leds_;
+            int i = (scroll_offset_ + j) % max_leds_;
             colors_[i] = high;
         }
+        BackFrame() = colors_;
+        Present();
+        scroll_offset_ = (scroll_offset_ + 1) % max_leds_;
+    });
+}
+
+void CircularStrip::VuMeter(StripColor low, StripColor high, int interval_ms) {
+    vu_lit_ = 0;
+    StartStripTask(interval_ms, [this, low, high]() {
+        auto envelope = Application::GetInstance().GetAudioService().GetEnvelope();
+        float ratio = AudioLoudness(envelope.output_rms);
+        // Rises at once and falls one LED per frame, so the ring doesn't flicker between syllables
+        int lit = static_cast<int>(ratio * max_leds_ + 0.5f);
+        vu_lit_ = std::max(lit, vu_lit_ - 1);
+
         for (int i = 0; i < max_leds_; i++) {
-            led_strip_set_pixel(led_strip_, i, colors_[i].red, colors_[i].green, colors_[i].blue);
+            colors_[i] = i < vu_lit_ ? high : low;
         }
-        led_strip_refresh(led_strip_);
-        offset = (offset + 1) % max_leds_;
+        BackFrame() = colors_;
+        Present();
     });
 }
 
+void CircularStrip::Present() {
+    auto& back = BackFrame();
+    auto& front = frames_[front_frame_];
+    bool changed = false;
+    for (int i = 0; i < max_leds_; i++) {
+        if (!SameColor(back[i], front[i])) {
+            led_strip_set_pixel(led_strip_, i, back[i].red, back[i].green, back[i].blue);
+            changed = true;
+        }
+    }
+    // Static frames cost nothing, a changed frame goes out in one transfer
+    if (changed) {
+        led_strip_refresh(led_strip_);
+    }
+    front_frame_ ^= 1;
+}
+
 void CircularStrip::StartStripTask(int interval_ms, std::function<void()> cb) {
     if (led_strip_ == nullptr) {
         return;
@@ -224,8 +278,9 @@ void CircularStrip::OnStateChanged() {
             break;
         }
         case kDeviceStateSpeaking: {
-            StripColor color = { low_brightness_, default_brightness_, low_brightness_ };
-            SetAllColor(color);
+            StripColor low = { 0, low_brightness_, 0 };
+            StripColor high = { low_brightness_, default_brightness_, low_brightness_ };
+            VuMeter(low, high, 50);
             break;
         }
         case kDeviceStateUpgrading: {
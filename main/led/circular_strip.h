@@ -29,6 +29,8 @@ public:
     void Blink(StripColor color, int interval_ms);
     void Breathe(StripColor low, StripColor high, int interval_ms);
     void Scroll(StripColor low, StripColor high, int length, int interval_ms);
+    // Lights a share of the ring that follows the loudness of the playback
+    void VuMeter(StripColor low, StripColor high, int interval_ms);
 
 private:
     std::mutex mutex_;
@@ -36,14 +38,26 @@ private:
     led_strip_handle_t led_strip_ = nullptr;
     int max_leds_ = 0;
     std::vector<StripColor> colors_;
+    // Effects render the next frame into the back buffer, Present() sends what changed in one refresh
+    std::vector<StripColor> frames_[2];
+    int front_frame_ = 0;
     int blink_counter_ = 0;
     int blink_interval_ms_ = 0;
     esp_timer_handle_t strip_timer_ = nullptr;
     std::function<void()> strip_callback_ = nullptr;
 
+    // Effect state, reset when an effect starts
+    bool blink_on_ = true;
+    bool breathe_increase_ = true;
+    StripColor breathe_color_;
+    int scroll_offset_ = 0;
+    int vu_lit_ = 0;
+
     uint8_t default_brightness_ = DEFAULT_BRIGHTNESS;
     uint8_t low_brightness_ = LOW_BRIGHTNESS;
 
+    std::vector<StripColor>& BackFrame() { return frames_[front_frame_ ^ 1]; }
+    void Present();
     void StartStripTask(int interval_ms, std::function<void()> cb);
     void Rainbow(StripColor low, StripColor high, int interval_ms);
     void FadeOut(int interval_ms);
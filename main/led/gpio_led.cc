@@ -15,6 +15,8 @@
 #define ACTIVATING_BRIGHTNESS 35
 
 #define BLINK_INFINITE -1
+// The LED never drops below this share of its brightness while following the speech
+#define LEVEL_MIN_PERCENT 30
 
 // GPIO_LED
 #define LEDC_LS_TIMER          LEDC_TIMER_1
@@ -112,6 +114,7 @@ void GpioLed::TurnOn() {
 
     std::lock_guard<std::mutex> lock(mutex_);
     esp_timer_stop(blink_timer_);
+    follow_level_ = false;
     ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
     ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
     ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
@@ -124,6 +127,7 @@ void GpioLed::TurnOff() {
 
     std::lock_guard<std::mutex> lock(mutex_);
     esp_timer_stop(blink_timer_);
+    follow_level_ = false;
     ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
     ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, 0);
     ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
@@ -148,6 +152,7 @@ void GpioLed::StartBlinkTask(int times, int interval_ms) {
 
     std::lock_guard<std::mutex> lock(mutex_);
     esp_timer_stop(blink_timer_);
+    follow_level_ = false;
     ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
 
     blink_counter_ = times * 2;
@@ -155,8 +160,27 @@ void GpioLed::StartBlinkTask(int times, int interval_ms) {
     esp_timer_start_periodic(blink_timer_, interval_ms * 1000);
 }
 
+void GpioLed::StartLevelTask(int interval_ms) {
+    if (!ledc_initialized_) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    esp_timer_stop(blink_timer_);
+    ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
+    follow_level_ = true;
+    esp_timer_start_periodic(blink_timer_, interval_ms * 1000);
+}
+
 void GpioLed::OnBlinkTimer() {
     std::lock_guard<std::mutex> lock(mutex_);
+    if (follow_level_) {
+        auto envelope = Application::GetInstance().GetAudioService().GetEnvelope();
+        float percent = LEVEL_MIN_PERCENT + (100 - LEVEL_MIN_PERCENT) * AudioLoudness(envelope.output_rms);
+        ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, static_cast<uint32_t>(duty_ * percent / 100));
+        ledc_update_duty(ledc_channel_.speed_mode, ledc_channel_.channel);
+        return;
+    }
     blink_counter_--;
     if (blink_counter_ & 1) {
         ledc_set_duty(ledc_channel_.speed_mode, ledc_channel_.channel, duty_);
@@ -177,6 +201,7 @@ void GpioLed::StartFadeTask() {
 
     std::lock_guard<std::mutex> lock(mutex_);
     esp_timer_stop(blink_timer_);
+    follow_level_ = false;
     ledc_fade_stop(ledc_channel_.speed_mode, ledc_channel_.channel);
     fade_up_ = true;
     ledc_set_fade_with_time(ledc_channel_.speed_mode,
@@ -237,7 +262,7 @@ void GpioLed::OnStateChanged() {
             break;
         case kDeviceStateSpeaking:
             SetBrightness(SPEAKING_BRIGHTNESS);
-            TurnOn();
+            StartLevelTask(50);
             break;
         case kDeviceStateUpgrading:
             SetBrightness(UPGRADING_BRIGHTNESS);
@@ -9,11 +9,15 @@
 
 #include "application.h"
 #include "system_info.h"
+#include "heap_placement.h"
 
 #define TAG "main"
 
 extern "C" void app_main(void)
 {
+    // Before anything creates a cJSON object, the hooks free it with the matching accounting
+    HeapPlacement::InstallJsonHooks();
+
     // Initialize NVS flash for WiFi configuration
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
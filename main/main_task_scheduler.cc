@@ -0,0 +1,110 @@
+#include "main_task_scheduler.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "MainTaskScheduler"
+
+MainTaskScheduler::MainTaskScheduler() {
+    arena_ = new Slot[kArenaSlots];
+    for (int i = 0; i < kArenaSlots; i++) {
+        arena_[i].in_arena = true;
+        arena_[i].next = free_slots_;
+        free_slots_ = &arena_[i];
+    }
+}
+
+MainTaskScheduler::~MainTaskScheduler() {
+    for (int priority = 0; priority < kTaskPriorityCount; priority++) {
+        while (auto slot = Dequeue(priority)) {
+            slot->destroy(slot->storage);
+            FreeSlot(slot);
+        }
+    }
+    delete[] arena_;
+}
+
+// Called with mutex_ held
+MainTaskScheduler::Slot* MainTaskScheduler::AllocateSlot() {
+    if (free_slots_ == nullptr) {
+        ESP_LOGW(TAG, "Arena is full, allocating a task slot on the heap");
+        auto slot = new Slot;
+        slot->in_arena = false;
+        return slot;
+    }
+    auto slot = free_slots_;
+    free_slots_ = slot->next;
+    return slot;
+}
+
+// Called with mutex_ held
+void MainTaskScheduler::FreeSlot(Slot* slot) {
+    if (!slot->in_arena) {
+        delete slot;
+        return;
+    }
+    slot->next = free_slots_;
+    free_slots_ = slot;
+}
+
+// Called with mutex_ held
+void MainTaskScheduler::Enqueue(TaskPriority priority, Slot* slot) {
+    slot->sequence = next_sequence_++;
+    slot->next = nullptr;
+    auto& queue = queues_[priority];
+    if (queue.tail != nullptr) {
+        queue.tail->next = slot;
+    } else {
+        queue.head = slot;
+    }
+    queue.tail = slot;
+}
+
+// Called with mutex_ held
+MainTaskScheduler::Slot* MainTaskScheduler::Dequeue(int priority) {
+    auto& queue = queues_[priority];
+    auto slot = queue.head;
+    if (slot != nullptr) {
+        queue.head = slot->next;
+        if (queue.head == nullptr) {
+            queue.tail = nullptr;
+        }
+    }
+    return slot;
+}
+
+bool MainTaskScheduler::RunPending(int64_t budget_us) {
+    int64_t start_time = esp_timer_get_time();
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Callbacks scheduled while running wait for the next round, as they did with the old queue
+    uint32_t end_sequence = next_sequence_;
+    while (true) {
+        bool over_budget = esp_timer_get_time() - start_time >= budget_us;
+        Slot* slot = nullptr;
+        for (int priority = 0; priority < kTaskPriorityCount && slot == nullptr; priority++) {
+            if (priority != kTaskPriorityAudio && over_budget) {
+                break;
+            }
+            auto head = queues_[priority].head;
+            // Sequence numbers wrap, compare their distance
+            if (head != nullptr && (int32_t)(head->sequence - end_sequence) < 0) {
+                slot = Dequeue(priority);
+            }
+        }
+        if (slot == nullptr) {
+            break;
+        }
+        lock.unlock();
+        slot->invoke(slot->storage);
+        slot->destroy(slot->storage);
+        lock.lock();
+        FreeSlot(slot);
+    }
+
+    for (auto& queue : queues_) {
+        if (queue.head != nullptr) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,83 @@
+#ifndef MAIN_TASK_SCHEDULER_H
+#define MAIN_TASK_SCHEDULER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+enum TaskPriority {
+    kTaskPriorityAudio,         // Audio and state transitions, never held back by the time budget
+    kTaskPriorityUi,
+    kTaskPriorityBackground,
+    kTaskPriorityCount,
+};
+
+/**
+ * MainTaskScheduler - Queue of callbacks run by the main task
+ *
+ * Callbacks are kept in slots of a fixed arena, so scheduling one with small captures does not
+ * touch the heap. Bigger callbacks, or callbacks beyond the arena size, fall back to the heap.
+ * Higher priority callbacks run first, and audio callbacks are never held back by the time budget.
+ */
+class MainTaskScheduler {
+public:
+    static constexpr size_t kInlineSize = 64;
+    static constexpr int kArenaSlots = 16;
+
+    MainTaskScheduler();
+    ~MainTaskScheduler();
+
+    MainTaskScheduler(const MainTaskScheduler&) = delete;
+    MainTaskScheduler& operator=(const MainTaskScheduler&) = delete;
+
+    template<typename F>
+    void Push(TaskPriority priority, F&& callback) {
+        using Fn = std::decay_t<F>;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Slot* slot = AllocateSlot();
+        if constexpr (sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t)) {
+            new (slot->storage) Fn(std::forward<F>(callback));
+            slot->invoke = [](void* p) { (*static_cast<Fn*>(p))(); };
+            slot->destroy = [](void* p) { static_cast<Fn*>(p)->~Fn(); };
+        } else {
+            new (slot->storage) Fn*(new Fn(std::forward<F>(callback)));
+            slot->invoke = [](void* p) { (**static_cast<Fn**>(p))(); };
+            slot->destroy = [](void* p) { delete *static_cast<Fn**>(p); };
+        }
+        Enqueue(priority, slot);
+    }
+
+    // Runs the callbacks queued before the call, highest priority first. Once budget_us is used up
+    // only audio callbacks still run. Returns true if callbacks are left for the next round.
+    bool RunPending(int64_t budget_us);
+
+private:
+    struct Slot {
+        alignas(std::max_align_t) unsigned char storage[kInlineSize];
+        void (*invoke)(void*);
+        void (*destroy)(void*);
+        Slot* next;
+        uint32_t sequence;
+        bool in_arena;
+    };
+    struct Queue {
+        Slot* head = nullptr;
+        Slot* tail = nullptr;
+    };
+
+    std::mutex mutex_;
+    Slot* arena_;
+    Slot* free_slots_ = nullptr;
+    Queue queues_[kTaskPriorityCount];
+    uint32_t next_sequence_ = 0;
+
+    Slot* AllocateSlot();
+    void FreeSlot(Slot* slot);
+    void Enqueue(TaskPriority priority, Slot* slot);
+    Slot* Dequeue(int priority);
+};
+
+#endif // MAIN_TASK_SCHEDULER_H
@@ -17,10 +17,36 @@
 #include "settings.h"
 #include "lvgl_theme.h"
 #include "lvgl_display.h"
+#include "jpg/jpeg_to_image.h"
+#include "trace.h"
+#include "usage_accounting.h"
+#include "benchmark.h"
+#include "device_transaction.h"
 
 #define TAG "MCP"
 
+// progressToken of the tool call running on this task, nullptr outside of a call or without one
+static thread_local const std::string* current_progress_token = nullptr;
+
+// How often background calls are checked against their deadline
+#define MCP_CALL_TIMEOUT_CHECK_US (200 * 1000)
+
 McpServer::McpServer() {/*McpServer类构造函数*/
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<McpServer*>(arg)->CheckCallTimeouts();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "mcp_call_timeout",
+        .skip_unhandled_events = true,
+    };
+    esp_timer_create(&timer_args, &timeout_timer_);
+
+    auto& metrics = Metrics::GetInstance();
+    tool_call_counter_ = metrics.AddCounter("mcp.tool_calls");
+    tool_error_counter_ = metrics.AddCounter("mcp.tool_errors");
+    tool_call_ms_ = metrics.AddHistogram("mcp.tool_call_ms");
 }
 
 McpServer::~McpServer() {/*McpServer类析构函数*/
@@ -28,8 +54,17 @@ McpServer::~McpServer() {/*McpServer类析构函数*/
         delete tool;
     }
     tools_.clear();
+    if (timeout_timer_ != nullptr) {
+        esp_timer_stop(timeout_timer_);
+        esp_timer_delete(timeout_timer_);
+    }
 }
 
+struct SetVolumeArgs {/*参数定义：volume，0~100*/
+    int volume;
+    static inline const auto kFields = std::make_tuple(McpArg("volume", &SetVolumeArgs::volume, 0, 100));
+};
+
 void McpServer::AddCommonTools() {/*添加常用工具：常用工具+原始工具*/
     // **重要** 为了提升响应速度，我们把常用的工具放在前面，利用 prompt cache 的特性。
 
@@ -54,18 +89,16 @@ void McpServer::AddCommonTools() {/*添加常用工具：常用工具+原始工
             return board.GetDeviceStatusJson();/*返回设备的状态json数据*/
         });
 
-    AddTool("self.audio_speaker.set_volume", /*工具名称：设置音频扬声器音量工具*/
+    AddTool<SetVolumeArgs>("self.audio_speaker.set_volume", /*工具名称：设置音频扬声器音量工具*/
         /*LLM使用说明：设置音频扬声器的音量。
                        如果当前音量未知，必须先调用 `self.get_device_status` 工具，然后才能调用此工具。*/
         "Set the volume of the audio speaker. If the current volume is unknown, you must call `self.get_device_status` tool first and then call this tool.",
-        PropertyList({/*参数定义：volume，0~100*/ 
-            Property("volume", kPropertyTypeInteger, 0, 100)
-        }), 
-        [&board](const PropertyList& properties) -> ReturnValue {/*lambda实际执行逻辑*/
+        [&board](const SetVolumeArgs& args) -> ReturnValue {/*lambda实际执行逻辑*/
             auto codec = board.GetAudioCodec();
-            codec->SetOutputVolume(properties["volume"].value<int>());
+            codec->SetOutputVolume(args.volume);
             return true;
         });
+    SetDeviceControlTool("self.audio_speaker.set_volume");
     
     auto backlight = board.GetBacklight();/*获取背光亮度 */
     if (backlight) {/*有开启背光*/
@@ -80,8 +113,98 @@ void McpServer::AddCommonTools() {/*添加常用工具：常用工具+原始工
                 backlight->SetBrightness(brightness, true);
                 return true;
             });
+        SetDeviceControlTool("self.screen.set_brightness");
     }
 
+#if CONFIG_USE_MUSIC_PLAYER
+    AddTool("self.music.play",
+        "Play music or a podcast streamed from a URL in the background, replacing what is playing. "
+        "Only Ogg Opus files (.ogg / .opus) are supported. Speech is mixed over the music, which is turned down meanwhile.",
+        PropertyList({
+            Property("url", kPropertyTypeString)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetAudioService().PlayMusic(properties["url"].value<std::string>());
+        });
+
+    AddTool("self.music.pause",
+        "Pause the music, or resume it where it was paused.",
+        PropertyList({
+            Property("pause", kPropertyTypeBoolean, true)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            Application::GetInstance().GetAudioService().PauseMusic(properties["pause"].value<bool>());
+            return true;
+        });
+
+    AddTool("self.music.seek",
+        "Jump to a position of the music in seconds. The position is estimated from the bitrate, so it may be a few "
+        "seconds off. Only works once the music has played for a moment.",
+        PropertyList({
+            Property("position", kPropertyTypeInteger, 0, 86400)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetAudioService().SeekMusic(properties["position"].value<int>() * 1000LL);
+        });
+
+    AddTool("self.music.stop",
+        "Stop the music.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            Application::GetInstance().GetAudioService().StopMusic();
+            return true;
+        });
+
+    AddTool("self.music.get_status",
+        "The music state (`idle`, `playing` or `paused`), its URL and the position in seconds.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto status = Application::GetInstance().GetAudioService().GetMusicStatus();
+            static const char* const kStates[] = {"idle", "playing", "paused"};
+            cJSON* json = cJSON_CreateObject();
+            cJSON_AddStringToObject(json, "state", kStates[status.state]);
+            cJSON_AddStringToObject(json, "url", status.url.c_str());
+            cJSON_AddNumberToObject(json, "position", status.position_ms / 1000);
+            cJSON_AddBoolToObject(json, "buffering", status.buffering);
+            cJSON_AddNumberToObject(json, "buffered_bytes", status.buffered_bytes);
+            cJSON_AddNumberToObject(json, "underruns", status.underruns);
+            return json;
+        });
+#endif
+
+#if CONFIG_USE_VOICE_MEMO
+    AddTool("self.voice_memo.start",
+        "Record a voice memo on the device, when the user wants to leave a message or note to be processed later. "
+        "The conversation ends and everything the user says is stored on the device until they press the button "
+        "or say the wake word. The memos are uploaded later when the network is good.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            if (!app.GetVoiceMemoStatus().available) {
+                return McpError{"Voice memos are not available on this device"};
+            }
+            // After the result has been sent, the memo closes the conversation
+            app.Schedule([&app]() {
+                app.StartVoiceMemo();
+            });
+            return true;
+        });
+
+    AddTool("self.voice_memo.get_status",
+        "How many voice memos are stored on the device, how many are not uploaded yet and the flash they use.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto status = Application::GetInstance().GetVoiceMemoStatus();
+            cJSON* json = cJSON_CreateObject();
+            cJSON_AddNumberToObject(json, "memos", status.memos);
+            cJSON_AddNumberToObject(json, "pending", status.pending);
+            cJSON_AddBoolToObject(json, "uploading", status.uploading);
+            cJSON_AddNumberToObject(json, "used_bytes", status.used_bytes);
+            cJSON_AddNumberToObject(json, "capacity_bytes", status.capacity_bytes);
+            return json;
+        });
+#endif
+
 #ifdef HAVE_LVGL/*启用LVGL */
     auto display = board.GetDisplay();/*从 Board 单例获取显示设备接口*/
     if (display && display->GetTheme() != nullptr) {
@@ -101,6 +224,7 @@ void McpServer::AddCommonTools() {/*添加常用工具：常用工具+原始工
                 }
                 return false;
             });
+        SetDeviceControlTool("self.screen.set_theme");
     }
 
     auto camera = board.GetCamera();/*从 Board 单例获取摄像头设备接口*/
@@ -113,25 +237,65 @@ void McpServer::AddCommonTools() {/*添加常用工具：常用工具+原始工
             "Always remember you have a camera. If the user asks you to see something, use this tool to take a photo and then explain it.\n"
             "Args:\n"
             "  `question`: The question that you want to ask about the photo.\n"
+            "  `detail`: `auto` (default, follows the network quality), `low`, `normal` or `high`. Use `high` to read small text.\n"
             "Return:\n"
             "  A JSON object that provides the photo information.",
-            PropertyList({/*参数定义：question，json字符串*/
-                Property("question", kPropertyTypeString)
+            PropertyList({/*参数定义：question，json字符串；detail，上传图像的清晰度*/
+                Property("question", kPropertyTypeString),
+                Property("detail", kPropertyTypeString, "auto")
             }),
-            [camera](const PropertyList& properties) -> ReturnValue {
+            [this, camera](const PropertyList& properties) -> ReturnValue {
                 // Lower the priority to do the camera capture
                 TaskPriorityReset priority_reset(1);
 
+                // Upload ladder: the slower the link, the smaller the photo the vision model gets
+                auto detail = properties["detail"].value<std::string>();
+                if (detail == "auto") {
+                    int score = Application::GetInstance().GetNetworkQuality().GetScore();
+                    detail = score >= NETWORK_QUALITY_GOOD_SCORE ? "high" : score >= NETWORK_QUALITY_POOR_SCORE ? "normal" : "low";
+                }
+                if (detail == "low") {
+                    camera->SetExplainQuality(320, 60);
+                } else if (detail == "normal") {
+                    camera->SetExplainQuality(640, 70);
+                } else {
+                    camera->SetExplainQuality(0, 80);
+                }
+                ESP_LOGI(TAG, "Taking photo with %s detail", detail.c_str());
+
+                ReportProgress(0, 2, "Taking a photo");
                 if (!camera->Capture()) {
-                    throw std::runtime_error("Failed to capture photo");
+                    return McpError{"Failed to capture photo"};
                 }
+                ReportProgress(1, 2, "Looking at the photo");
                 auto question = properties["question"].value<std::string>();
-                return camera->Explain(question);
+                std::string result;
+                if (!camera->Explain(question, result)) {
+                    return McpError{result};
+                }
+                return result;
+            });
+        // Capture and upload take seconds, keep them off the main loop
+        SetBackgroundTool("self.camera.take_photo", 8192, tskNO_AFFINITY, 60000);
+
+        AddTool("self.camera.set_streaming",
+            "Keep the camera running so that the next photo is taken without delay. Use it when the user is going to ask "
+            "several questions about what the camera sees, and stop it afterwards.\n"
+            "Args:\n"
+            "  `fps`: Frames per second, 0 stops the streaming.\n"
+            "  `upload`: Also send the frames to the server.",
+            PropertyList({
+                Property("fps", kPropertyTypeInteger, 1, 0, 5),
+                Property("upload", kPropertyTypeBoolean, false)
+            }),
+            [camera](const PropertyList& properties) -> ReturnValue {
+                return camera->SetStreaming(properties["fps"].value<int>(), properties["upload"].value<bool>());
             });
     }
 #endif
     /*将原始工具列表恢复并追加到当前工具列表的末尾。*/
     tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
+    tools_list_cache_.clear();
 }
 
 void McpServer::AddUserOnlyTools() {/*添加用户工具*/
@@ -145,6 +309,132 @@ void McpServer::AddUserOnlyTools() {/*添加用户工具*/
             return board.GetSystemInfoJson();
         });
 
+#if CONFIG_USE_AUDIO_LATENCY_STATS
+    AddUserOnlyTool("self.audio.get_latency_stats",
+        "Get the per-stage latency histograms of the audio pipeline. Set `reset` to clear them after reading.",
+        PropertyList({
+            Property("reset", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& stats = Application::GetInstance().GetAudioService().GetLatencyStats();
+            auto json = stats.ToJson();
+            if (properties["reset"].value<bool>()) {
+                stats.Reset();
+            }
+            return json;
+        });
+
+#endif
+    if (Application::GetInstance().GetAudioService().HasAecReference()) {
+        AddUserOnlyTool("self.audio.calibrate_echo",
+            "Play a short chirp and measure how far the speaker echo lags the playback reference, so the echo "
+            "cancellation lines them up. Run it once in a quiet room, the result is kept. Returns the delay applied in ms.",
+            PropertyList(),
+            [](const PropertyList& properties) -> ReturnValue {
+                int delay_ms = 0;
+                if (!Application::GetInstance().GetAudioService().CalibrateAecDelay(delay_ms)) {
+                    return McpError{"Echo calibration failed"};
+                }
+                return delay_ms;
+            });
+        // Waits for the chirp to play and the correlation, off the main loop
+        SetBackgroundTool("self.audio.calibrate_echo", 4096, tskNO_AFFINITY, 5000);
+    }
+
+    AddUserOnlyTool("self.wake_word.get_models",
+        "Get the wake word models running side by side, with their words, detection threshold (0 for the model default), "
+        "number of detections since boot and seconds since the last one (-1 if none).",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto models = Application::GetInstance().GetAudioService().GetWakeWordModels();
+            int64_t now = esp_timer_get_time();
+            cJSON* json = cJSON_CreateArray();
+            for (size_t i = 0; i < models.size(); i++) {
+                cJSON* model = cJSON_CreateObject();
+                cJSON_AddNumberToObject(model, "index", i);
+                cJSON_AddStringToObject(model, "name", models[i].name.c_str());
+                cJSON_AddStringToObject(model, "words", models[i].words.c_str());
+                cJSON_AddNumberToObject(model, "threshold", models[i].threshold);
+                cJSON_AddNumberToObject(model, "detections", models[i].detections);
+                cJSON_AddNumberToObject(model, "last_detection_s",
+                    models[i].detections > 0 ? (now - models[i].last_detection_us) / 1000000 : -1);
+                cJSON_AddItemToArray(json, model);
+            }
+            return json;
+        });
+
+    AddUserOnlyTool("self.wake_word.set_threshold",
+        "Set the detection threshold of one wake word model in percent. Higher values give fewer false wake ups "
+        "and need a clearer wake word. The value is kept across reboots.",
+        PropertyList({
+            Property("model", kPropertyTypeInteger, 0, 0, 7),
+            Property("threshold", kPropertyTypeInteger, 40, 99)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            int model = properties["model"].value<int>();
+            float threshold = properties["threshold"].value<int>() / 100.0f;
+            return Application::GetInstance().GetAudioService().SetWakeWordThreshold(model, threshold);
+        });
+
+    AddUserOnlyTool("self.get_metrics",
+        "Get the runtime metrics: counters, gauges and histograms of the audio pipeline, protocol, display and MCP server "
+        "(histograms are [count, total, max, [log2 buckets]]), per-task CPU since the previous call with the free stack, "
+        "and free / minimum free / largest block of each heap.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Metrics::GetInstance().CreateJson();
+        });
+
+#if CONFIG_USE_USAGE_ACCOUNTING
+    AddUserOnlyTool("self.get_usage",
+        "Get the share of CPU each subsystem (front_end, codec, network, display, mcp, system, idle) takes in each "
+        "device state, in percent of all cores, with the seconds spent in the state and the peak heap of each "
+        "subsystem in KB. Accumulated over boots of this firmware, with the summary of the previous version.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return UsageAccounting::GetInstance().CreateJson();
+        });
+#endif
+
+#if CONFIG_USE_TRACE
+    AddUserOnlyTool("self.trace.dump",
+        "Send the trace ring buffer to the trace server, or print it on the console when none is configured. "
+        "Convert it with scripts/trace_viewer.py.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Trace::Dump();
+        });
+#endif
+
+#if CONFIG_USE_BENCHMARK
+    AddUserOnlyTool("self.benchmark.run",
+        "Run the on-target benchmarks of the audio, codec, crypto and display kernels and return the cycles and "
+        "microseconds per iteration with the heap each case holds. Takes about half a minute.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Benchmark::Run();
+        });
+    // Core 0 exists on every chip, and the cycle counter must not change cores mid case
+    SetBackgroundTool("self.benchmark.run", 2048 * 12, 0, 120000);
+
+    AddUserOnlyTool("self.benchmark.download",
+        "Download the URL through the board network for at most the given seconds, discard the body and return the "
+        "bytes, the time and the throughput in kbit/s. Measures the link, lwIP and TLS together.",
+        PropertyList({
+            Property("url", kPropertyTypeString),
+            Property("seconds", kPropertyTypeInteger, 10, 1, 60)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto url = properties["url"].value<std::string>();
+            auto result = Benchmark::RunDownload(url, properties["seconds"].value<int>());
+            if (result == nullptr) {
+                return McpError{"Failed to open URL: " + url};
+            }
+            return result;
+        });
+    SetBackgroundTool("self.benchmark.download", 8192, tskNO_AFFINITY, 70000);
+#endif
+
     AddUserOnlyTool("self.reboot", /*工具名称：重启系统工具*/
         "Reboot the system",/*LLM使用说明：重启系统工具*/
         PropertyList(),/*参数定义：空*/
@@ -213,7 +503,7 @@ void McpServer::AddUserOnlyTools() {/*添加用户工具*/
 
                 std::string jpeg_data;
                 if (!display->SnapshotToJpeg(jpeg_data, quality)) {
-                    throw std::runtime_error("Failed to snapshot screen");
+                    return McpError{"Failed to snapshot screen"};
                 }
 
                 ESP_LOGI(TAG, "Upload snapshot %u bytes to %s", jpeg_data.size(), url.c_str());
@@ -224,7 +514,7 @@ void McpServer::AddUserOnlyTools() {/*添加用户工具*/
                 auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
                 http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
                 if (!http->Open("POST", url)) {
-                    throw std::runtime_error("Failed to open URL: " + url);
+                    return McpError{"Failed to open URL: " + url};
                 }
                 {
                     // 文件字段头部
@@ -248,13 +538,14 @@ void McpServer::AddUserOnlyTools() {/*添加用户工具*/
                 http->Write("", 0);
 
                 if (http->GetStatusCode() != 200) {
-                    throw std::runtime_error("Unexpected status code: " + std::to_string(http->GetStatusCode()));
+                    return McpError{"Unexpected status code: " + std::to_string(http->GetStatusCode())};
                 }
                 std::string result = http->ReadAll();
                 http->Close();
                 ESP_LOGI(TAG, "Snapshot screen result: %s", result.c_str());
                 return true;
             });
+        SetBackgroundTool("self.screen.snapshot", 8192, tskNO_AFFINITY, 60000);
         
         AddUserOnlyTool("self.screen.preview_image", "Preview an image on the screen",
             PropertyList({
@@ -265,24 +556,24 @@ void McpServer::AddUserOnlyTools() {/*添加用户工具*/
                 auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
 
                 if (!http->Open("GET", url)) {
-                    throw std::runtime_error("Failed to open URL: " + url);
+                    return McpError{"Failed to open URL: " + url};
                 }
                 int status_code = http->GetStatusCode();
                 if (status_code != 200) {
-                    throw std::runtime_error("Unexpected status code: " + std::to_string(status_code));
+                    return McpError{"Unexpected status code: " + std::to_string(status_code)};
                 }
 
                 size_t content_length = http->GetBodyLength();
                 char* data = (char*)heap_caps_malloc(content_length, MALLOC_CAP_8BIT);
                 if (data == nullptr) {
-                    throw std::runtime_error("Failed to allocate memory for image: " + url);
+                    return McpError{"Failed to allocate memory for image: " + url};
                 }
                 size_t total_read = 0;
                 while (total_read < content_length) {
                     int ret = http->Read(data + total_read, content_length - total_read);
                     if (ret < 0) {
                         heap_caps_free(data);
-                        throw std::runtime_error("Failed to download image: " + url);
+                        return McpError{"Failed to download image: " + url};
                     }
                     if (ret == 0) {
                         break;
@@ -291,7 +582,27 @@ void McpServer::AddUserOnlyTools() {/*添加用户工具*/
                 }
                 http->Close();
 
+#ifndef CONFIG_IDF_TARGET_ESP32
+                // Decode photos straight to screen size, LVGL would keep a full resolution copy
+                if (total_read > 2 && (uint8_t)data[0] == 0xFF && (uint8_t)data[1] == 0xD8) {
+                    uint8_t* pixels = nullptr;
+                    size_t size, width, height, stride;
+                    esp_err_t err = jpeg_to_image_fit((const uint8_t*)data, total_read, display->width(), display->height(),
+                        &pixels, &size, &width, &height, &stride);
+                    heap_caps_free(data);
+                    if (err != ESP_OK) {
+                        return McpError{"Failed to decode image: " + url};
+                    }
+                    display->SetPreviewImage(std::make_unique<LvglAllocatedImage>(pixels, size, width, height, stride,
+                        LV_COLOR_FORMAT_RGB565));
+                    return true;
+                }
+#endif
+
                 auto image = std::make_unique<LvglAllocatedImage>(data, content_length);
+                if (!image->valid()) {
+                    return McpError{"Unsupported image: " + url};
+                }
                 display->SetPreviewImage(std::move(image));
                 return true;
             });
@@ -326,6 +637,7 @@ void McpServer::AddTool(McpTool* tool) {
 
     ESP_LOGI(TAG, "Add tool: %s%s", tool->name().c_str(), tool->user_only() ? " [user]" : "");
     tools_.push_back(tool);
+    tools_list_cache_.clear();
 }
 
 void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
@@ -338,6 +650,24 @@ void McpServer::AddUserOnlyTool(const std::string& name, const std::string& desc
     AddTool(tool);
 }
 
+void McpServer::SetBackgroundTool(const std::string& name, uint32_t stack_size, int core_id, int timeout_ms, int max_concurrency) {
+    auto it = std::find_if(tools_.begin(), tools_.end(), [&name](const McpTool* t) { return t->name() == name; });
+    if (it == tools_.end()) {
+        ESP_LOGW(TAG, "Tool %s not found", name.c_str());
+        return;
+    }
+    (*it)->set_background(stack_size, core_id, timeout_ms, max_concurrency);
+}
+
+void McpServer::SetDeviceControlTool(const std::string& name) {
+    auto it = std::find_if(tools_.begin(), tools_.end(), [&name](const McpTool* t) { return t->name() == name; });
+    if (it == tools_.end()) {
+        ESP_LOGW(TAG, "Tool %s not found", name.c_str());
+        return;
+    }
+    (*it)->set_device_control(true);
+}
+
 void McpServer::ParseMessage(const std::string& message) {
     cJSON* json = cJSON_Parse(message.c_str());
     if (json == nullptr) {
@@ -368,6 +698,40 @@ void McpServer::ParseCapabilities(const cJSON* capabilities) {
 }
 
 void McpServer::ParseMessage(const cJSON* json) {
+    if (cJSON_IsArray(json)) {
+        ParseBatch(json);
+    } else {
+        ParseRequest(json);
+    }
+}
+
+void McpServer::ParseBatch(const cJSON* json) {
+    if (cJSON_GetArraySize(json) == 0) {
+        ESP_LOGE(TAG, "Empty batch");
+        return;
+    }
+    // Every request of the batch is dispatched as if it came alone, background tools run side by side
+    // on their own tasks, the others one after the other on the main task. Device control calls next
+    // to each other run together in one transaction.
+    auto batch = std::make_shared<Batch>();
+    parsing_batch_ = batch;
+    const cJSON* item;
+    cJSON_ArrayForEach(item, json) {
+        ParseRequest(item);
+    }
+    ScheduleTransaction();
+    parsing_batch_.reset();
+
+    std::unique_lock<std::mutex> lock(batch_mutex_);
+    batch->sealed = true;
+    if (batch->expected == 0 || (int)batch->replies.size() < batch->expected) {
+        return;
+    }
+    lock.unlock();
+    SendBatch(batch);
+}
+
+void McpServer::ParseRequest(const cJSON* json) {
     // Check JSONRPC version
     auto version = cJSON_GetObjectItem(json, "jsonrpc");
     if (version == nullptr || !cJSON_IsString(version) || strcmp(version->valuestring, "2.0") != 0) {
@@ -400,6 +764,15 @@ void McpServer::ParseMessage(const cJSON* json) {
         return;
     }
     auto id_int = id->valueint;
+    if (parsing_batch_) {
+        // Only requests that get a reply count, notifications and invalid ones have none in a batch either
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        if (batch_calls_.emplace(id_int, parsing_batch_).second) {
+            parsing_batch_->expected++;
+        } else {
+            ESP_LOGW(TAG, "Duplicate id %d in batch, replied on its own", id_int);
+        }
+    }
     
     if (method_str == "initialize") {
         if (cJSON_IsObject(params)) {
@@ -445,7 +818,15 @@ void McpServer::ParseMessage(const cJSON* json) {
             ReplyError(id_int, "Invalid arguments");
             return;
         }
-        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments);
+        std::string progress_token;
+        auto meta = cJSON_GetObjectItem(params, "_meta");
+        auto token = cJSON_IsObject(meta) ? cJSON_GetObjectItem(meta, "progressToken") : nullptr;
+        if (cJSON_IsString(token) || cJSON_IsNumber(token)) {
+            char* printed = cJSON_PrintUnformatted(token);
+            progress_token = printed;
+            cJSON_free(printed);
+        }
+        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments, std::move(progress_token));
     } else {
         ESP_LOGE(TAG, "Method not implemented: %s", method_str.c_str());
         ReplyError(id_int, "Method not implemented: " + method_str);
@@ -457,7 +838,7 @@ void McpServer::ReplyResult(int id, const std::string& result) {
     payload += std::to_string(id) + ",\"result\":";
     payload += result;
     payload += "}";
-    Application::GetInstance().SendMcpMessage(payload);
+    SendReply(id, std::move(payload));
 }
 
 void McpServer::ReplyError(int id, const std::string& message) {
@@ -466,10 +847,99 @@ void McpServer::ReplyError(int id, const std::string& message) {
     payload += ",\"error\":{\"message\":\"";
     payload += message;
     payload += "\"}}";
-    Application::GetInstance().SendMcpMessage(payload);
+    SendReply(id, std::move(payload));
+}
+
+void McpServer::SendReply(int id, std::string payload) {
+    bool in_batch;
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        in_batch = batch_calls_.find(id) != batch_calls_.end();
+    }
+    if (!in_batch) {
+        Application::GetInstance().SendMcpMessage(payload);
+        return;
+    }
+    SendReply(id, [payload = std::move(payload)](const TextPartsSink& sink) {
+        return sink(payload.data(), payload.size());
+    });
+}
+
+void McpServer::SendReply(int id, ReplyWriter writer) {
+    std::shared_ptr<Batch> batch;
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        auto it = batch_calls_.find(id);
+        if (it != batch_calls_.end()) {
+            batch = std::move(it->second);
+            batch_calls_.erase(it);
+        }
+    }
+    if (!batch) {
+        Application::GetInstance().SendMcpMessage(std::move(writer));
+        return;
+    }
+    AddBatchReply(batch, std::move(writer));
+}
+
+void McpServer::AddBatchReply(const std::shared_ptr<Batch>& batch, ReplyWriter writer) {
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        batch->replies.push_back(std::move(writer));
+        if (!batch->sealed || (int)batch->replies.size() < batch->expected) {
+            return;
+        }
+    }
+    SendBatch(batch);
+}
+
+void McpServer::SendBatch(const std::shared_ptr<Batch>& batch) {
+    ESP_LOGI(TAG, "Batch of %d replies done", batch->expected);
+    Application::GetInstance().SendMcpMessage([batch](const TextPartsSink& sink) {
+        if (!sink("[", 1)) {
+            return false;
+        }
+        for (size_t i = 0; i < batch->replies.size(); i++) {
+            if ((i > 0 && !sink(",", 1)) || !batch->replies[i](sink)) {
+                return false;
+            }
+        }
+        return sink("]", 1);
+    });
+}
+
+void McpServer::ReplyToolResult(int id, ReturnValue return_value) {
+    if (auto error = std::get_if<McpError>(&return_value)) {
+        ESP_LOGE(TAG, "tools/call: %s", error->message.c_str());
+        tool_error_counter_->Add();
+        ReplyError(id, error->message);
+        return;
+    }
+    if (!std::holds_alternative<ImageContent*>(return_value)) {
+        ReplyResult(id, McpTool::TextResult(return_value));
+        return;
+    }
+
+    // The base64 data goes out in pieces between the JSON envelope parts, so neither the encoded
+    // image nor the whole message is ever built in memory
+    std::shared_ptr<ImageContent> image(std::get<ImageContent*>(return_value));
+    std::string head = "{\"jsonrpc\":\"2.0\",\"id\":" + std::to_string(id) +
+        ",\"result\":{\"content\":[{\"type\":\"image\",\"mimeType\":\"" + image->mime_type() + "\",\"data\":\"";
+    SendReply(id, [image, head = std::move(head)](const TextPartsSink& sink) {
+        static const char tail[] = "\"}],\"isError\":false}}";
+        return sink(head.data(), head.size()) && image->WriteBase64(sink) && sink(tail, sizeof(tail) - 1);
+    });
 }
 
 void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_only_tools) {
+    // The tool set is final once the client asks, so every page is only built once
+    std::string cache_key = (list_user_only_tools ? "1:" : "0:") + cursor;
+    auto cached = tools_list_cache_.find(cache_key);
+    if (cached != tools_list_cache_.end()) {
+        ReplyResult(id, cached->second);
+        return;
+    }
+
     const int max_payload_size = 8000;
     std::string json = "{\"tools\":[";
     
@@ -494,14 +964,15 @@ void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_o
         }
         
         // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
-        if (json.length() + tool_json.length() + 30 > max_payload_size) {
+        const std::string& tool_json = (*it)->to_json();
+        if (json.length() + tool_json.length() + 1 + 30 > max_payload_size) {
             // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
             next_cursor = (*it)->name();
             break;
         }
         
         json += tool_json;
+        json += ',';
         ++it;
     }
     
@@ -523,58 +994,232 @@ void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_o
     }
     
     ReplyResult(id, json);
+    tools_list_cache_[cache_key] = std::move(json);
 }
 
-void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments) {
+void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, std::string progress_token) {
     auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
                                  [&tool_name](const McpTool* tool) { 
                                      return tool->name() == tool_name; 
                                  });
     
+    tool_call_counter_->Add();
     if (tool_iter == tools_.end()) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
+        tool_error_counter_->Add();
         ReplyError(id, "Unknown tool: " + tool_name);
         return;
     }
 
-    PropertyList arguments = (*tool_iter)->properties();
-    try {
-        for (auto& argument : arguments) {
-            bool found = false;
-            if (cJSON_IsObject(tool_arguments)) {
-                auto value = cJSON_GetObjectItem(tool_arguments, argument.name().c_str());
-                if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
-                    argument.set_value<bool>(value->valueint == 1);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
-                    argument.set_value<int>(value->valueint);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
-                    argument.set_value<std::string>(value->valuestring);
-                    found = true;
-                }
-            }
+    std::string error;
+    auto call = (*tool_iter)->Bind(tool_arguments, error);
+    if (!call) {
+        ESP_LOGE(TAG, "tools/call: %s", error.c_str());
+        tool_error_counter_->Add();
+        ReplyError(id, error);
+        return;
+    }
+
+    if ((*tool_iter)->background()) {
+        StartBackgroundCall(id, *tool_iter, std::move(call), std::move(progress_token));
+        return;
+    }
+
+    // Use main thread to call the tool
+    auto run = [this, call = std::move(call), progress_token = std::move(progress_token)]() {
+        int64_t start_us = esp_timer_get_time();
+        current_progress_token = progress_token.empty() ? nullptr : &progress_token;
+        std::optional<UsageScope> usage(std::in_place, kUsageMcp);
+        auto result = call();
+        usage.reset();
+        current_progress_token = nullptr;
+        tool_call_ms_->Record((esp_timer_get_time() - start_us) / 1000);
+        return result;
+    };
+    if (parsing_batch_ && (*tool_iter)->device_control()) {
+        parsing_batch_->transaction.emplace_back(id, std::move(run));
+        return;
+    }
+    // Changes parsed before this call go first
+    ScheduleTransaction();
+    Application::GetInstance().Schedule([this, id, run = std::move(run)]() {
+        ReplyToolResult(id, run());
+    }, kTaskPriorityBackground);
+}
 
-            if (!argument.has_default_value() && !found) {
-                ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", argument.name().c_str());
-                ReplyError(id, "Missing valid argument: " + argument.name());
-                return;
+void McpServer::ScheduleTransaction() {
+    if (!parsing_batch_ || parsing_batch_->transaction.empty()) {
+        return;
+    }
+    auto calls = std::move(parsing_batch_->transaction);
+    parsing_batch_->transaction.clear();
+    Application::GetInstance().Schedule([this, calls = std::move(calls)]() {
+        ESP_LOGI(TAG, "Applying %u device changes in one transaction", (unsigned)calls.size());
+        std::vector<ReturnValue> results;
+        results.reserve(calls.size());
+        {
+            DeviceTransaction transaction;
+            for (auto& [id, call] : calls) {
+                results.push_back(call());
             }
         }
-    } catch (const std::exception& e) {
-        ESP_LOGE(TAG, "tools/call: %s", e.what());
-        ReplyError(id, e.what());
+        // Sending may wait for the network, the display is unlocked by now
+        for (size_t i = 0; i < calls.size(); i++) {
+            ReplyToolResult(calls[i].first, std::move(results[i]));
+        }
+    }, kTaskPriorityBackground);
+}
+
+bool McpServer::CallLocalTool(const std::string& tool_name, const std::string& arguments) {
+    auto tool_iter = std::find_if(tools_.begin(), tools_.end(),
+                                 [&tool_name](const McpTool* tool) {
+                                     return tool->name() == tool_name;
+                                 });
+    if (tool_iter == tools_.end()) {
+        ESP_LOGE(TAG, "Local call: Unknown tool: %s", tool_name.c_str());
+        return false;
+    }
+    // There is nobody to wait for the reply of a slow tool
+    if ((*tool_iter)->background()) {
+        ESP_LOGE(TAG, "Local call: %s only runs in the background", tool_name.c_str());
+        return false;
+    }
+
+    cJSON* json = cJSON_Parse(arguments.c_str());
+    std::string error;
+    auto call = (*tool_iter)->Bind(json, error);
+    cJSON_Delete(json);
+    if (!call) {
+        ESP_LOGE(TAG, "Local call: %s", error.c_str());
+        return false;
+    }
+
+    auto result = call();
+    if (auto error = std::get_if<McpError>(&result)) {
+        ESP_LOGE(TAG, "Local call: %s", error->message.c_str());
+        return false;
+    }
+    if (auto image = std::get_if<ImageContent*>(&result)) {
+        delete *image;
+    } else if (auto json = std::get_if<cJSON*>(&result)) {
+        cJSON_Delete(*json);
+    }
+    ESP_LOGI(TAG, "Local call: %s done", tool_name.c_str());
+    return true;
+}
+
+void McpServer::ReportProgress(double progress, double total, const std::string& message) {
+    if (current_progress_token == nullptr) {
         return;
     }
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(root, "method", "notifications/progress");
+    cJSON* params = cJSON_AddObjectToObject(root, "params");
+    cJSON_AddItemToObject(params, "progressToken", cJSON_Parse(current_progress_token->c_str()));
+    cJSON_AddNumberToObject(params, "progress", progress);
+    if (total > 0) {
+        cJSON_AddNumberToObject(params, "total", total);
+    }
+    if (!message.empty()) {
+        cJSON_AddStringToObject(params, "message", message.c_str());
+    }
+    char* payload = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    // Not a reply, it goes out straight away even in a batch
+    Application::GetInstance().SendMcpMessage(std::string(payload));
+    cJSON_free(payload);
+}
 
-    // Use main thread to call the tool
-    auto& app = Application::GetInstance();
-    app.Schedule([this, id, tool_iter, arguments = std::move(arguments)]() {
-        try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
-        } catch (const std::exception& e) {
-            ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
+void McpServer::StartBackgroundCall(int id, McpTool* tool, std::function<ReturnValue()> call, std::string progress_token) {
+    // Refuse instead of queueing, a queued call would only time out behind the slow one
+    if (tool->running().fetch_add(1) >= tool->max_concurrency()) {
+        tool->running()--;
+        ESP_LOGW(TAG, "tools/call: %s is busy", tool->name().c_str());
+        ReplyError(id, "Tool is busy: " + tool->name());
+        return;
+    }
+    if (background_calls_.fetch_add(1) >= CONFIG_MCP_MAX_BACKGROUND_CALLS) {
+        background_calls_--;
+        tool->running()--;
+        ESP_LOGW(TAG, "tools/call: Too many background calls, refusing %s", tool->name().c_str());
+        ReplyError(id, "Too many tool calls in progress");
+        return;
+    }
+
+    uint32_t call_id;
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex_);
+        call_id = next_call_id_++;
+        int64_t deadline_us = tool->timeout_ms() > 0 ? esp_timer_get_time() + tool->timeout_ms() * 1000LL : 0;
+        pending_calls_[call_id] = {id, tool->name(), deadline_us};
+        if (deadline_us > 0 && !esp_timer_is_active(timeout_timer_)) {
+            esp_timer_start_periodic(timeout_timer_, MCP_CALL_TIMEOUT_CHECK_US);
         }
-    });
+    }
+
+    struct CallContext {
+        McpServer* server;
+        McpTool* tool;
+        std::function<ReturnValue()> call;
+        int id;
+        uint32_t call_id;
+        std::string progress_token;
+    };
+    auto context = new CallContext{this, tool, std::move(call), id, call_id, std::move(progress_token)};
+    auto ret = xTaskCreatePinnedToCore([](void* arg) {
+        auto context = static_cast<CallContext*>(arg);
+        auto server = context->server;
+        current_progress_token = context->progress_token.empty() ? nullptr : &context->progress_token;
+        auto result = context->call();
+        current_progress_token = nullptr;
+        if (server->FinishBackgroundCall(context->call_id)) {
+            server->ReplyToolResult(context->id, std::move(result));
+        } else {
+            ESP_LOGW(TAG, "tools/call: %s returned after its timeout, result dropped", context->tool->name().c_str());
+            if (std::holds_alternative<ImageContent*>(result)) {
+                delete std::get<ImageContent*>(result);
+            } else if (std::holds_alternative<cJSON*>(result)) {
+                cJSON_Delete(std::get<cJSON*>(result));
+            }
+        }
+        context->tool->running()--;
+        server->background_calls_--;
+        delete context;
+        vTaskDelete(NULL);
+    }, "mcp_tool", tool->stack_size(), context, 2, nullptr, tool->core_id());
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "tools/call: Failed to create task for %s", tool->name().c_str());
+        FinishBackgroundCall(call_id);
+        tool->running()--;
+        background_calls_--;
+        delete context;
+        ReplyError(id, "Failed to start tool " + tool->name());
+    }
+}
+
+// Returns false if the call already timed out and its error was sent
+bool McpServer::FinishBackgroundCall(uint32_t call_id) {
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    return pending_calls_.erase(call_id) > 0;
+}
+
+void McpServer::CheckCallTimeouts() {
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    int64_t now = esp_timer_get_time();
+    bool waiting = false;
+    for (auto it = pending_calls_.begin(); it != pending_calls_.end();) {
+        auto& call = it->second;
+        if (call.deadline_us > 0 && now >= call.deadline_us) {
+            ESP_LOGE(TAG, "tools/call: %s timed out", call.tool_name.c_str());
+            ReplyError(call.id, "Tool call timed out: " + call.tool_name);
+            it = pending_calls_.erase(it);
+            continue;
+        }
+        waiting |= call.deadline_us > 0;
+        ++it;
+    }
+    if (!waiting) {
+        esp_timer_stop(timeout_timer_);
+    }
 }
@@ -3,41 +3,62 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <functional>
 #include <variant>
 #include <optional>
-#include <stdexcept>
+#include <tuple>
+#include <type_traits>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cassert>
 #include <mbedtls/base64.h>
 
 #include <cJSON.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+#include "metrics.h"
 
 class ImageContent {
 private:
-    std::string encoded_data_;
+    std::string data_;
     std::string mime_type_;
 
-    static std::string Base64Encode(const std::string& data) {
-        size_t dlen = 0, olen = 0;
-        mbedtls_base64_encode((unsigned char*)nullptr, 0, &dlen, (const unsigned char*)data.data(), data.size());
-        std::string result(dlen, 0);
-        mbedtls_base64_encode((unsigned char*)result.data(), result.size(), &olen, (const unsigned char*)data.data(), data.size());
-        return result;
-    }
-
 public:
-    ImageContent(const std::string& mime_type, const std::string& data) {
-        mime_type_ = mime_type;
-        // base64 encode data
-        encoded_data_ = Base64Encode(data);
+    ImageContent(const std::string& mime_type, std::string data)
+        : data_(std::move(data)), mime_type_(mime_type) {}
+
+    inline const std::string& mime_type() const { return mime_type_; }
+
+    // Encodes the image as base64 a few hundred bytes at a time, so the encoded copy is never held as a whole
+    bool WriteBase64(const std::function<bool(const char* data, size_t len)>& sink) const {
+        const size_t chunk = 768;  // A multiple of 3, the encoded chunks join without padding
+        unsigned char out[chunk / 3 * 4 + 1];
+        for (size_t i = 0; i < data_.size(); i += chunk) {
+            size_t olen = 0;
+            mbedtls_base64_encode(out, sizeof(out), &olen, (const unsigned char*)data_.data() + i, std::min(chunk, data_.size() - i));
+            if (!sink((const char*)out, olen)) {
+                return false;
+            }
+        }
+        return true;
     }
 
     std::string to_json() const {
+        std::string encoded;
+        encoded.reserve((data_.size() + 2) / 3 * 4);
+        WriteBase64([&encoded](const char* data, size_t len) {
+            encoded.append(data, len);
+            return true;
+        });
         cJSON *json = cJSON_CreateObject();
         cJSON_AddStringToObject(json, "type", "image");
         cJSON_AddStringToObject(json, "mimeType", mime_type_.c_str());
-        cJSON_AddStringToObject(json, "data", encoded_data_.c_str());
+        cJSON_AddStringToObject(json, "data", encoded.c_str());
         char* json_str = cJSON_PrintUnformatted(json);
         std::string result(json_str);
         cJSON_free(json_str);
@@ -46,8 +67,13 @@ public:
     }
 };
 
+// A tool fails by returning this instead of throwing, the message is sent back as a JSON-RPC error
+struct McpError {
+    std::string message;
+};
+
 // 添加类型别名
-using ReturnValue = std::variant<bool, int, std::string, cJSON*, ImageContent*>;
+using ReturnValue = std::variant<bool, int, std::string, cJSON*, ImageContent*, McpError>;
 
 enum PropertyType {
     kPropertyTypeBoolean,
@@ -76,21 +102,16 @@ public:
         value_ = default_value;
     }
 
+    // A range on a non-integer property or a default outside the range is a bug in the tool, not in a call
     Property(const std::string& name, PropertyType type, int min_value, int max_value)
         : name_(name), type_(type), has_default_value_(false), min_value_(min_value), max_value_(max_value) {
-        if (type != kPropertyTypeInteger) {
-            throw std::invalid_argument("Range limits only apply to integer properties");
-        }
+        assert(type == kPropertyTypeInteger && "Range limits only apply to integer properties");
     }
 
     Property(const std::string& name, PropertyType type, int default_value, int min_value, int max_value)
         : name_(name), type_(type), has_default_value_(true), min_value_(min_value), max_value_(max_value) {
-        if (type != kPropertyTypeInteger) {
-            throw std::invalid_argument("Range limits only apply to integer properties");
-        }
-        if (default_value < min_value || default_value > max_value) {
-            throw std::invalid_argument("Default value must be within the specified range");
-        }
+        assert(type == kPropertyTypeInteger && "Range limits only apply to integer properties");
+        assert(default_value >= min_value && default_value <= max_value && "Default value must be within the specified range");
         value_ = default_value;
     }
 
@@ -106,18 +127,22 @@ public:
         return std::get<T>(value_);
     }
 
+    // Returns false with the error set if the value is out of range, the property is then unchanged
     template<typename T>
-    inline void set_value(const T& value) {
+    inline bool set_value(const T& value, std::string& error) {
         // 添加对设置的整数值进行范围检查
         if constexpr (std::is_same_v<T, int>) {
             if (min_value_.has_value() && value < min_value_.value()) {
-                throw std::invalid_argument("Value is below minimum allowed: " + std::to_string(min_value_.value()));
+                error = "Value is below minimum allowed: " + std::to_string(min_value_.value());
+                return false;
             }
             if (max_value_.has_value() && value > max_value_.value()) {
-                throw std::invalid_argument("Value exceeds maximum allowed: " + std::to_string(max_value_.value()));
+                error = "Value exceeds maximum allowed: " + std::to_string(max_value_.value());
+                return false;
             }
         }
         value_ = value;
+        return true;
     }
 
     std::string to_json() const {
@@ -166,13 +191,21 @@ public:
         properties_.push_back(property);
     }
 
-    const Property& operator[](const std::string& name) const {
+    // nullptr if the tool has no such property
+    const Property* Find(const std::string& name) const {
         for (const auto& property : properties_) {
             if (property.name() == name) {
-                return property;
+                return &property;
             }
         }
-        throw std::runtime_error("Property not found: " + name);
+        return nullptr;
+    }
+
+    // The properties of a call are the ones the tool declared, asking for another one is a bug in the tool
+    const Property& operator[](const std::string& name) const {
+        auto property = Find(name);
+        assert(property != nullptr && "Property not found");
+        return *property;
     }
 
     auto begin() { return properties_.begin(); }
@@ -205,13 +238,125 @@ public:
     }
 };
 
+/*
+ * Typed tool arguments. An argument struct lists its fields in kFields, for example
+ *
+ *   struct SetVolumeArgs {
+ *       int volume;
+ *       static inline const auto kFields = std::make_tuple(McpArg("volume", &SetVolumeArgs::volume, 0, 100));
+ *   };
+ *   AddTool<SetVolumeArgs>("self.audio_speaker.set_volume", "...", [](const SetVolumeArgs& args) -> ReturnValue { ... });
+ *
+ * The schema is derived from the fields once, and the call arguments are bound straight into the struct
+ * without going through Property copies, name lookups or exceptions.
+ */
+template<typename S, typename T>
+struct McpField {
+    static_assert(std::is_same_v<T, bool> || std::is_same_v<T, int> || std::is_same_v<T, std::string>,
+        "MCP arguments are bool, int or std::string");
+    using Default = std::conditional_t<std::is_same_v<T, std::string>, const char*, T>;
+
+    const char* name;
+    T S::* member;
+    bool required = true;
+    Default default_value{};
+    bool has_range = false;
+    int min_value = 0;
+    int max_value = 0;
+
+    Property ToProperty() const {
+        constexpr PropertyType type = std::is_same_v<T, bool> ? kPropertyTypeBoolean :
+            std::is_same_v<T, int> ? kPropertyTypeInteger : kPropertyTypeString;
+        if constexpr (std::is_same_v<T, int>) {
+            if (has_range) {
+                return required ? Property(name, type, min_value, max_value) :
+                    Property(name, type, default_value, min_value, max_value);
+            }
+        }
+        if (required) {
+            return Property(name, type);
+        }
+        return Property(name, type, T(default_value));
+    }
+
+    bool Bind(const cJSON* arguments, S& args, std::string& error) const {
+        const cJSON* value = cJSON_IsObject(arguments) ? cJSON_GetObjectItem(arguments, name) : nullptr;
+        if constexpr (std::is_same_v<T, bool>) {
+            if (cJSON_IsBool(value)) {
+                args.*member = cJSON_IsTrue(value);
+                return true;
+            }
+        } else if constexpr (std::is_same_v<T, int>) {
+            if (cJSON_IsNumber(value)) {
+                if (has_range && value->valueint < min_value) {
+                    error = "Value is below minimum allowed: " + std::to_string(min_value);
+                    return false;
+                }
+                if (has_range && value->valueint > max_value) {
+                    error = "Value exceeds maximum allowed: " + std::to_string(max_value);
+                    return false;
+                }
+                args.*member = value->valueint;
+                return true;
+            }
+        } else {
+            if (cJSON_IsString(value)) {
+                args.*member = value->valuestring;
+                return true;
+            }
+        }
+        if (required) {
+            error = std::string("Missing valid argument: ") + name;
+            return false;
+        }
+        args.*member = default_value;
+        return true;
+    }
+};
+
+// Required argument
+template<typename S, typename T>
+McpField<S, T> McpArg(const char* name, T S::* member) {
+    return {name, member};
+}
+
+// Optional argument with a default value
+template<typename S, typename T, typename D>
+McpField<S, T> McpArg(const char* name, T S::* member, D default_value) {
+    return {name, member, false, default_value};
+}
+
+// Required integer argument within [min_value, max_value]
+template<typename S>
+McpField<S, int> McpArg(const char* name, int S::* member, int min_value, int max_value) {
+    return {name, member, true, 0, true, min_value, max_value};
+}
+
+// Optional integer argument within [min_value, max_value]
+template<typename S>
+McpField<S, int> McpArg(const char* name, int S::* member, int default_value, int min_value, int max_value) {
+    return {name, member, false, default_value, true, min_value, max_value};
+}
+
+// Binds the call arguments and returns the call to run, or nullptr with the error set
+using McpToolBinder = std::function<std::function<ReturnValue()>(const cJSON* arguments, std::string& error)>;
+
 class McpTool {
 private:
     std::string name_;
     std::string description_;
     PropertyList properties_;
     std::function<ReturnValue(const PropertyList&)> callback_;
+    McpToolBinder binder_;
     bool user_only_ = false;
+    mutable std::string json_;  // Serialized once, a tool does not change after it is added
+    // Background execution, a stack size of 0 keeps the tool on the main loop
+    uint32_t stack_size_ = 0;
+    int core_id_ = tskNO_AFFINITY;
+    int timeout_ms_ = 0;
+    int max_concurrency_ = 1;
+    std::atomic<int> running_ = 0;
+    bool device_control_ = false;
 
 public:
     McpTool(const std::string& name, 
@@ -223,13 +368,40 @@ public:
         properties_(properties), 
         callback_(callback) {}
 
-    void set_user_only(bool user_only) { user_only_ = user_only; }
+    // Typed tool, properties only describe the schema
+    McpTool(const std::string& name,
+            const std::string& description,
+            const PropertyList& properties,
+            McpToolBinder binder)
+        : name_(name),
+        description_(description),
+        properties_(properties),
+        binder_(binder) {}
+
+    void set_user_only(bool user_only) { user_only_ = user_only; json_.clear(); }
     inline const std::string& name() const { return name_; }
     inline const std::string& description() const { return description_; }
     inline const PropertyList& properties() const { return properties_; }
     inline bool user_only() const { return user_only_; }
-
-    std::string to_json() const {
+    void set_background(uint32_t stack_size, int core_id, int timeout_ms, int max_concurrency) {
+        stack_size_ = stack_size;
+        core_id_ = core_id;
+        timeout_ms_ = timeout_ms;
+        max_concurrency_ = max_concurrency;
+    }
+    inline bool background() const { return stack_size_ > 0; }
+    inline uint32_t stack_size() const { return stack_size_; }
+    inline int core_id() const { return core_id_; }
+    inline int timeout_ms() const { return timeout_ms_; }
+    inline int max_concurrency() const { return max_concurrency_; }
+    inline std::atomic<int>& running() { return running_; }
+    void set_device_control(bool device_control) { device_control_ = device_control; }
+    inline bool device_control() const { return device_control_; }
+
+    const std::string& to_json() const {
+        if (!json_.empty()) {
+            return json_;
+        }
         std::vector<std::string> required = properties_.GetRequired();
         
         cJSON *json = cJSON_CreateObject();
@@ -262,44 +434,69 @@ public:
         }
         
         char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
+        json_ = json_str;
         cJSON_free(json_str);
         cJSON_Delete(json);
         
-        return result;
+        return json_;
     }
 
-    std::string Call(const PropertyList& properties) {
-        ReturnValue return_value = callback_(properties);
-        // 返回结果
+    std::function<ReturnValue()> Bind(const cJSON* arguments, std::string& error) {
+        if (binder_) {
+            return binder_(arguments, error);
+        }
+
+        PropertyList bound = properties_;
+        for (auto& argument : bound) {
+            bool found = false;
+            if (cJSON_IsObject(arguments)) {
+                auto value = cJSON_GetObjectItem(arguments, argument.name().c_str());
+                bool ok = true;
+                if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
+                    ok = argument.set_value<bool>(value->valueint == 1, error);
+                    found = true;
+                } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
+                    ok = argument.set_value<int>(value->valueint, error);
+                    found = true;
+                } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
+                    ok = argument.set_value<std::string>(value->valuestring, error);
+                    found = true;
+                }
+                if (!ok) {
+                    return nullptr;
+                }
+            }
+
+            if (!argument.has_default_value() && !found) {
+                error = "Missing valid argument: " + argument.name();
+                return nullptr;
+            }
+        }
+        // Tools are never removed, so the call can refer to this one
+        return [this, bound = std::move(bound)]() { return callback_(bound); };
+    }
+
+    // The tools/call result of a return value other than ImageContent
+    static std::string TextResult(ReturnValue& return_value) {
         cJSON* result = cJSON_CreateObject();
         cJSON* content = cJSON_CreateArray();
 
-        if (std::holds_alternative<ImageContent*>(return_value)) {
-            auto image_content = std::get<ImageContent*>(return_value);
-            cJSON* image = cJSON_CreateObject();
-            cJSON_AddStringToObject(image, "type", "image");
-            cJSON_AddStringToObject(image, "image", image_content->to_json().c_str());
-            cJSON_AddItemToArray(content, image);
-            delete image_content;
-        } else {
-            cJSON* text = cJSON_CreateObject();
-            cJSON_AddStringToObject(text, "type", "text");
-            if (std::holds_alternative<std::string>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
-            } else if (std::holds_alternative<bool>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
-            } else if (std::holds_alternative<int>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
-            } else if (std::holds_alternative<cJSON*>(return_value)) {
-                cJSON* json = std::get<cJSON*>(return_value);
-                char* json_str = cJSON_PrintUnformatted(json);
-                cJSON_AddStringToObject(text, "text", json_str);
-                cJSON_free(json_str);
-                cJSON_Delete(json);
-            }
-            cJSON_AddItemToArray(content, text);
+        cJSON* text = cJSON_CreateObject();
+        cJSON_AddStringToObject(text, "type", "text");
+        if (std::holds_alternative<std::string>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
+        } else if (std::holds_alternative<bool>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
+        } else if (std::holds_alternative<int>(return_value)) {
+            cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
+        } else if (std::holds_alternative<cJSON*>(return_value)) {
+            cJSON* json = std::get<cJSON*>(return_value);
+            char* json_str = cJSON_PrintUnformatted(json);
+            cJSON_AddStringToObject(text, "text", json_str);
+            cJSON_free(json_str);
+            cJSON_Delete(json);
         }
+        cJSON_AddItemToArray(content, text);
         cJSON_AddItemToObject(result, "content", content);
         cJSON_AddBoolToObject(result, "isError", false);
 
@@ -323,21 +520,96 @@ public:
     void AddTool(McpTool* tool);
     void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
     void AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    template<typename Args>
+    void AddTool(const std::string& name, const std::string& description, std::function<ReturnValue(const Args&)> callback) {
+        PropertyList properties;
+        std::apply([&properties](const auto&... field) { (properties.AddProperty(field.ToProperty()), ...); }, Args::kFields);
+        AddTool(new McpTool(name, description, properties,
+            [callback](const cJSON* arguments, std::string& error) -> std::function<ReturnValue()> {
+                Args args{};
+                bool ok = std::apply([&](const auto&... field) { return (field.Bind(arguments, args, error) && ...); }, Args::kFields);
+                if (!ok) {
+                    return nullptr;
+                }
+                return [callback, args = std::move(args)]() { return callback(args); };
+            }));
+    }
+    // Runs the tool on a task of its own, so that a slow call does not hold up the main loop.
+    // Its reply is sent when it returns, or an error after timeout_ms (0 waits forever).
+    void SetBackgroundTool(const std::string& name, uint32_t stack_size, int core_id = tskNO_AFFINITY,
+        int timeout_ms = 0, int max_concurrency = 1);
+    // The tool only changes device state. The calls of such tools that follow each other in a batch
+    // run in one DeviceTransaction, with one display lock, one Settings commit and one redraw.
+    void SetDeviceControlTool(const std::string& name);
+    // A JSON-RPC request, or a batch array of them answered with one array once every call in it returned
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
+    // Runs a tool on the calling task for a request that did not come from the server, such as an
+    // offline voice command. The result is dropped, returns false if the call failed.
+    bool CallLocalTool(const std::string& tool_name, const std::string& arguments);
+    // Called from inside a tool callback: sends notifications/progress for the running call, so that
+    // the server can start talking before the result. Nothing happens if the client gave no progressToken.
+    // A total of 0 is left out.
+    void ReportProgress(double progress, double total = 0, const std::string& message = "");
 
 private:
     McpServer();
     ~McpServer();
 
     void ParseCapabilities(const cJSON* capabilities);
+    void ParseRequest(const cJSON* json);
+    void ParseBatch(const cJSON* json);
+
+    // Writes one reply through the sink, the same as TextPartsWriter
+    using ReplyWriter = std::function<bool(const std::function<bool(const char* data, size_t len)>& sink)>;
+    // Replies of a batch wait in it until the last one, then go out as one message
+    struct Batch {
+        int expected = 0;
+        bool sealed = false;
+        std::vector<ReplyWriter> replies;
+        // Device control calls parsed since the last other main task call, not scheduled yet
+        std::vector<std::pair<int, std::function<ReturnValue()>>> transaction;
+    };
+    void SendReply(int id, std::string payload);
+    void SendReply(int id, ReplyWriter writer);
+    void AddBatchReply(const std::shared_ptr<Batch>& batch, ReplyWriter writer);
+    void SendBatch(const std::shared_ptr<Batch>& batch);
 
     void ReplyResult(int id, const std::string& result);
     void ReplyError(int id, const std::string& message);
+    // Takes ownership of an ImageContent result, which is streamed instead of being serialized
+    void ReplyToolResult(int id, ReturnValue return_value);
 
     void GetToolsList(int id, const std::string& cursor, bool list_user_only_tools);
-    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments);
-
+    // progress_token is the JSON of params._meta.progressToken, empty without one
+    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, std::string progress_token);
+    void ScheduleTransaction();
+    void StartBackgroundCall(int id, McpTool* tool, std::function<ReturnValue()> call, std::string progress_token);
+    bool FinishBackgroundCall(uint32_t call_id);
+    void CheckCallTimeouts();
+
+    // Background calls that have not replied yet, the timeout timer only runs while one has a deadline
+    struct PendingCall {
+        int id;
+        std::string tool_name;
+        int64_t deadline_us;
+    };
+    std::mutex calls_mutex_;
+    std::map<uint32_t, PendingCall> pending_calls_;
+    uint32_t next_call_id_ = 0;
+    std::atomic<int> background_calls_ = 0;
+    esp_timer_handle_t timeout_timer_ = nullptr;
+    MetricCounter* tool_call_counter_;
+    MetricCounter* tool_error_counter_;
+    MetricHistogram* tool_call_ms_;
+
+    // Requests of the batches that wait for replies, by id
+    std::mutex batch_mutex_;
+    std::map<int, std::shared_ptr<Batch>> batch_calls_;
+    std::shared_ptr<Batch> parsing_batch_;
+
+    // Serialized tools/list pages keyed by user-only flag and cursor, cleared when a tool is added
+    std::map<std::string, std::string> tools_list_cache_;
     std::vector<McpTool*> tools_;/*McpServer 内部维护一个可动态增长的工具列表，每个元素是指向 McpTool 对象的指针，用于存储和管理所有已注册的工具。 */
 };
 
@@ -0,0 +1,187 @@
+#include "metrics.h"
+#include "heap_placement.h"
+#include "heap_monitor.h"
+#include "task_factory.h"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+
+#define TAG "Metrics"
+
+void MetricHistogram::Record(uint32_t value) {
+    int bucket = 0;
+    while (bucket < METRIC_HISTOGRAM_BUCKETS - 1 && value >= (1u << bucket)) {
+        bucket++;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(value, std::memory_order_relaxed);
+    uint32_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+cJSON* MetricHistogram::CreateJson() const {
+    cJSON* json = cJSON_CreateArray();
+    cJSON_AddItemToArray(json, cJSON_CreateNumber(count_.load(std::memory_order_relaxed)));
+    cJSON_AddItemToArray(json, cJSON_CreateNumber(total_.load(std::memory_order_relaxed)));
+    cJSON_AddItemToArray(json, cJSON_CreateNumber(max_.load(std::memory_order_relaxed)));
+    // Trailing empty buckets are left out
+    int used = METRIC_HISTOGRAM_BUCKETS;
+    while (used > 0 && buckets_[used - 1].load(std::memory_order_relaxed) == 0) {
+        used--;
+    }
+    cJSON* buckets = cJSON_CreateArray();
+    for (int i = 0; i < used; i++) {
+        cJSON_AddItemToArray(buckets, cJSON_CreateNumber(buckets_[i].load(std::memory_order_relaxed)));
+    }
+    cJSON_AddItemToArray(json, buckets);
+    return json;
+}
+
+MetricCounter* Metrics::AddCounter(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& counter : counters_) {
+        if (counter->name == name) {
+            return &counter->metric;
+        }
+    }
+    counters_.push_back(std::make_unique<Counter>());
+    counters_.back()->name = name;
+    return &counters_.back()->metric;
+}
+
+MetricHistogram* Metrics::AddHistogram(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& histogram : histograms_) {
+        if (histogram->name == name) {
+            return &histogram->metric;
+        }
+    }
+    histograms_.push_back(std::make_unique<Histogram>());
+    histograms_.back()->name = name;
+    return &histograms_.back()->metric;
+}
+
+void Metrics::AddGauge(const std::string& name, std::function<int64_t()> read) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& gauge : gauges_) {
+        if (gauge.name == name) {
+            ESP_LOGW(TAG, "Gauge %s registered twice, keeping the first one", name.c_str());
+            return;
+        }
+    }
+    gauges_.push_back({name, std::move(read)});
+}
+
+cJSON* Metrics::CreateJson(bool with_system) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* root = cJSON_CreateObject();
+
+    cJSON* counters = cJSON_CreateObject();
+    for (auto& counter : counters_) {
+        cJSON_AddNumberToObject(counters, counter->name.c_str(), counter->metric.value());
+    }
+    cJSON_AddItemToObject(root, "c", counters);
+
+    cJSON* gauges = cJSON_CreateObject();
+    for (auto& gauge : gauges_) {
+        cJSON_AddNumberToObject(gauges, gauge.name.c_str(), gauge.read());
+    }
+    cJSON_AddItemToObject(root, "g", gauges);
+
+    cJSON* histograms = cJSON_CreateObject();
+    for (auto& histogram : histograms_) {
+        cJSON_AddItemToObject(histograms, histogram->name.c_str(), histogram->metric.CreateJson());
+    }
+    cJSON_AddItemToObject(root, "h", histograms);
+
+    if (with_system) {
+        if (auto tasks = CreateTasksJson()) {
+            cJSON_AddItemToObject(root, "tasks", tasks);
+        }
+        cJSON_AddItemToObject(root, "heap", CreateHeapJson());
+    }
+    return root;
+}
+
+std::string Metrics::ToJson(bool with_system) {
+    cJSON* json = CreateJson(with_system);
+    char* str = cJSON_PrintUnformatted(json);
+    std::string result(str);
+    cJSON_free(str);
+    cJSON_Delete(json);
+    return result;
+}
+
+// CPU usage is measured against the run time counters of the previous export, tasks created since
+// then are measured from their start
+cJSON* Metrics::CreateTasksJson() {
+    UBaseType_t size = uxTaskGetNumberOfTasks() + 5;
+    std::vector<TaskStatus_t> tasks(size);
+    configRUN_TIME_COUNTER_TYPE total_run_time = 0;
+    size = uxTaskGetSystemState(tasks.data(), size, &total_run_time);
+    if (size == 0) {
+        return nullptr;
+    }
+    tasks.resize(size);
+
+    uint32_t elapsed = (uint32_t)total_run_time - last_total_run_time_;
+    cJSON* json = cJSON_CreateArray();
+    std::vector<TaskRunTime> run_times;
+    run_times.reserve(size);
+    for (auto& task : tasks) {
+        uint32_t run_time = (uint32_t)task.ulRunTimeCounter;
+        uint32_t previous = 0;
+        for (auto& last : last_task_run_times_) {
+            if (last.handle == task.xHandle) {
+                previous = last.run_time;
+                break;
+            }
+        }
+        run_times.push_back({task.xHandle, run_time});
+
+        int cpu = 0;
+        if (elapsed > 0) {
+            cpu = (int)((uint64_t)(run_time - previous) * 100 / ((uint64_t)elapsed * CONFIG_FREERTOS_NUMBER_OF_CORES));
+        }
+        cJSON* item = cJSON_CreateArray();
+        cJSON_AddItemToArray(item, cJSON_CreateString(task.pcTaskName));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(cpu));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(task.usStackHighWaterMark));
+        cJSON_AddItemToArray(json, item);
+    }
+    last_task_run_times_ = std::move(run_times);
+    last_total_run_time_ = (uint32_t)total_run_time;
+    return json;
+}
+
+// Fragmentation shows as a largest block far below the free size
+cJSON* Metrics::CreateHeapJson() {
+    struct {
+        const char* name;
+        uint32_t caps;
+    } const regions[] = {
+        {"internal", MALLOC_CAP_INTERNAL},
+        {"dma", MALLOC_CAP_DMA},
+        {"spiram", MALLOC_CAP_SPIRAM},
+    };
+
+    cJSON* json = cJSON_CreateObject();
+    for (auto& region : regions) {
+        if (heap_caps_get_total_size(region.caps) == 0) {
+            continue;
+        }
+        cJSON* item = cJSON_CreateArray();
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(heap_caps_get_free_size(region.caps)));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(heap_caps_get_minimum_free_size(region.caps)));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(heap_caps_get_largest_free_block(region.caps)));
+        cJSON_AddItemToObject(json, region.name, item);
+    }
+    cJSON_AddItemToObject(json, "subsystems", HeapPlacement::CreateJson());
+    cJSON_AddItemToObject(json, "task_stacks", TaskFactory::CreateJson());
+#if CONFIG_USE_HEAP_MONITOR
+    cJSON_AddItemToObject(json, "monitor", HeapMonitor::GetInstance().CreateJson());
+#endif
+    return json;
+}
@@ -0,0 +1,103 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define METRIC_HISTOGRAM_BUCKETS 20
+
+class MetricCounter {
+public:
+    inline void Add(uint32_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint32_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> value_{0};
+};
+
+// Bucket 0 holds 0, bucket i holds [2^(i-1), 2^i), the last one is open-ended. The unit is
+// whatever the owner records, and is part of the metric name.
+class MetricHistogram {
+public:
+    void Record(uint32_t value);
+    cJSON* CreateJson() const;
+
+private:
+    std::atomic<uint32_t> buckets_[METRIC_HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint32_t> count_{0};
+    std::atomic<uint32_t> max_{0};
+    std::atomic<uint64_t> total_{0};
+};
+
+/**
+ * Metrics - Registry of named counters, gauges and histograms for field diagnostics
+ *
+ * Modules register their metrics once and keep the returned pointer, which stays valid for the
+ * lifetime of the firmware, so updates are a relaxed atomic with no lookup. Registering a name
+ * twice returns the existing metric, so several instances of a class can share it. Gauges are
+ * read through their callback on export, and their owner must never be destroyed.
+ *
+ * The export is compact JSON:
+ * {"c":{name:value},"g":{name:value},"h":{name:[count,total,max,[buckets]]},
+ *  "tasks":[[name,cpu%,stack_free],...],"heap":{caps:[free,min_free,largest_block]}}
+ * where cpu% is measured since the previous export.
+ */
+class Metrics {
+public:
+    static Metrics& GetInstance() {
+        static Metrics instance;
+        return instance;
+    }
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    MetricCounter* AddCounter(const std::string& name);
+    MetricHistogram* AddHistogram(const std::string& name);
+    void AddGauge(const std::string& name, std::function<int64_t()> read);
+
+    // Includes the task and heap sections when with_system is set
+    cJSON* CreateJson(bool with_system = true);
+    std::string ToJson(bool with_system = true);
+
+private:
+    Metrics() = default;
+
+    struct Counter {
+        std::string name;
+        MetricCounter metric;
+    };
+    struct Histogram {
+        std::string name;
+        MetricHistogram metric;
+    };
+    struct Gauge {
+        std::string name;
+        std::function<int64_t()> read;
+    };
+    struct TaskRunTime {
+        TaskHandle_t handle;
+        uint32_t run_time;
+    };
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Counter>> counters_;
+    std::vector<std::unique_ptr<Histogram>> histograms_;
+    std::vector<Gauge> gauges_;
+    std::vector<TaskRunTime> last_task_run_times_;
+    uint32_t last_total_run_time_ = 0;
+
+    cJSON* CreateTasksJson();
+    cJSON* CreateHeapJson();
+};
+
+#endif // METRICS_H
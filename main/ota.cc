@@ -1,10 +1,18 @@
 #include "ota.h"
 #include "system_info.h"
 #include "settings.h"
+#include "download_checkpoint.h"
+#include "firmware_patch.h"
+#include "heap_placement.h"
+#if CONFIG_OTA_GZIP_IMAGES || CONFIG_OTA_COMPACT_VERSION_CHECK
+#include "gzip_stream.h"
+#endif
 #include "assets/lang_config.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <cJSON.h>
 #include <esp_log.h>
 #include <esp_partition.h>
@@ -12,7 +20,7 @@
 #include <esp_app_format.h>
 #include <esp_efuse.h>
 #include <esp_efuse_table.h>
-#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
 #ifdef SOC_HMAC_SUPPORTED
 #include <esp_hmac.h>
 #endif
@@ -21,6 +29,8 @@
 #include <vector>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <memory>
 
 #define TAG "Ota"
 
@@ -71,6 +81,54 @@ std::unique_ptr<Http> Ota::SetupHttp() {
     return http;
 }
 
+#if CONFIG_OTA_COMPACT_VERSION_CHECK
+// Board info that stays the same from boot to boot, the ETag is a hash of it
+static const char* const kFixedSystemInfoKeys[] = {"flash_size", "chip_model_name", "chip_info", "partition_table", "display"};
+static const char* const kFixedApplicationKeys[] = {"compile_time", "idf_version", "elf_sha256"};
+
+// The ETag of the fixed part of the system info, and the system info without it in compact.
+// Empty if the system info does not parse.
+static std::string GetSystemInfoEtag(const std::string& system_info, std::string& compact) {
+    cJSON* root = cJSON_Parse(system_info.c_str());
+    if (root == nullptr) {
+        return "";
+    }
+    cJSON* fixed = cJSON_CreateObject();
+    for (auto key : kFixedSystemInfoKeys) {
+        cJSON* item = cJSON_DetachItemFromObject(root, key);
+        if (item != nullptr) {
+            cJSON_AddItemToObject(fixed, key, item);
+        }
+    }
+    cJSON* application = cJSON_GetObjectItem(root, "application");
+    if (cJSON_IsObject(application)) {
+        cJSON* fixed_application = cJSON_AddObjectToObject(fixed, "application");
+        for (auto key : kFixedApplicationKeys) {
+            cJSON* item = cJSON_DetachItemFromObject(application, key);
+            if (item != nullptr) {
+                cJSON_AddItemToObject(fixed_application, key, item);
+            }
+        }
+    }
+
+    char* printed = cJSON_PrintUnformatted(fixed);
+    uint8_t digest[32];
+    mbedtls_sha256(reinterpret_cast<const unsigned char*>(printed), strlen(printed), digest, 0);
+    cJSON_free(printed);
+    printed = cJSON_PrintUnformatted(root);
+    compact = printed;
+    cJSON_free(printed);
+    cJSON_Delete(fixed);
+    cJSON_Delete(root);
+
+    char etag[17];
+    for (int i = 0; i < 8; i++) {
+        snprintf(etag + i * 2, sizeof(etag) - i * 2, "%02x", digest[i]);
+    }
+    return etag;
+}
+#endif
+
 /* 
  * Specification: https://ccnphfhqs21z.feishu.cn/wiki/FjW6wZmisimNBBkov6OcmfvknVd
  */
@@ -91,6 +149,22 @@ esp_err_t Ota::CheckVersion() {
     auto http = SetupHttp();
 
     std::string data = board.GetSystemInfoJson();
+#if CONFIG_OTA_COMPACT_VERSION_CHECK
+    // The fixed board info is left out once the server has answered with its ETag, until it changes
+    std::string compact;
+    std::string etag = GetSystemInfoEtag(data, compact);
+    std::string acknowledged_etag;
+    if (!etag.empty()) {
+        Settings settings("ota", false);
+        acknowledged_etag = settings.GetString("sysinfo_etag");
+        http->SetHeader("System-Info-ETag", etag);
+        if (acknowledged_etag == etag) {
+            ESP_LOGI(TAG, "System info unchanged, sending %u of %u bytes", compact.size(), data.size());
+            data = std::move(compact);
+        }
+    }
+    http->SetHeader("Accept-Encoding", "gzip");
+#endif
     std::string method = data.length() > 0 ? "POST" : "GET";
     http->SetContent(std::move(data));
 
@@ -101,15 +175,37 @@ esp_err_t Ota::CheckVersion() {
     }
 
     auto status_code = http->GetStatusCode();
+#if CONFIG_OTA_COMPACT_VERSION_CHECK
+    if (status_code == 412 && !etag.empty() && acknowledged_etag == etag) {
+        // The server no longer has the board info of this ETag, check again with all of it
+        ESP_LOGW(TAG, "Server asked for the full system info");
+        http->Close();
+        Settings settings("ota", true);
+        settings.EraseKey("sysinfo_etag");
+        return CheckVersion();
+    }
+#endif
     if (status_code != 200) {
         ESP_LOGE(TAG, "Failed to check version, status code: %d", status_code);
         return status_code;
     }
 
+#if CONFIG_OTA_COMPACT_VERSION_CHECK
+    if (!etag.empty() && etag != acknowledged_etag && http->GetResponseHeader("System-Info-ETag") == etag) {
+        Settings settings("ota", true);
+        settings.SetString("sysinfo_etag", etag);
+    }
+    if (!GzipStream::ReadAll(http.get(), data)) {
+        ESP_LOGE(TAG, "Failed to read the version check response");
+        http->Close();
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+#else
     data = http->ReadAll();
+#endif
     http->Close();
 
-    // Response: { "firmware": { "version": "1.0.0", "url": "http://" } }
+    // Response: { "firmware": { "version": "1.0.0", "url": "http://", "patch_url": "http://", "sha256": "hex" } }
     // Parse the JSON response and check if the version is newer
     // If it is, set has_new_version_ to true and store the new version and URL
     
@@ -221,6 +317,18 @@ esp_err_t Ota::CheckVersion() {
         if (cJSON_IsString(url)) {
             firmware_url_ = url->valuestring;
         }
+        // Optional patch from the current version to this one, see FirmwarePatch
+        firmware_patch_url_.clear();
+        cJSON *patch_url = cJSON_GetObjectItem(firmware, "patch_url");
+        if (cJSON_IsString(patch_url)) {
+            firmware_patch_url_ = patch_url->valuestring;
+        }
+        // Optional digest of the full image, checked against the hash taken during the download
+        firmware_sha256_.clear();
+        cJSON *sha256 = cJSON_GetObjectItem(firmware, "sha256");
+        if (cJSON_IsString(sha256)) {
+            firmware_sha256_ = sha256->valuestring;
+        }
 
         if (cJSON_IsString(version) && cJSON_IsString(url)) {
             // Check if the version is newer, for example, 0.1.0 is newer than 0.0.1
@@ -264,9 +372,85 @@ void Ota::MarkCurrentVersionValid() {
     }
 }
 
-bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback) {
+namespace {
+
+// One page handed from the HTTP reader to the flash writer, a null data ends the stream
+struct OtaPage {
+    char* data;
+    size_t size;
+};
+
+struct OtaWriter {
+    esp_ota_handle_t handle = 0;
+    QueueHandle_t full_pages = nullptr;
+    QueueHandle_t free_pages = nullptr;
+    SemaphoreHandle_t done = nullptr;
+    std::atomic<esp_err_t> error = ESP_OK;
+    std::atomic<size_t> written = 0;
+    DownloadCheckpoint* checkpoint = nullptr;
+    // Every byte written goes through it, using the SHA peripheral where the chip has one
+    mbedtls_sha256_context* sha256 = nullptr;
+};
+
+// False unless hex is exactly 64 hex digits
+bool ParseSha256(const std::string& hex, uint8_t digest[32]) {
+    if (hex.size() != 64) {
+        return false;
+    }
+    for (size_t i = 0; i < 32; i++) {
+        char byte[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+        char* end;
+        digest[i] = strtoul(byte, &end, 16);
+        if (end != byte + 2) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Erasing and writing a page takes about as long as downloading one, so the flash work runs on its own task
+void OtaWriterTask(void* arg) {
+    auto writer = (OtaWriter*)arg;
+    OtaPage page;
+    while (xQueueReceive(writer->full_pages, &page, portMAX_DELAY) == pdTRUE && page.data != nullptr) {
+        // After an error the pages are only handed back, until the reader notices and ends the stream
+        if (writer->error == ESP_OK) {
+            auto err = esp_ota_write(writer->handle, page.data, page.size);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+                writer->error = err;
+            } else {
+                if (writer->checkpoint != nullptr) {
+                    writer->checkpoint->Update(page.data, page.size);
+                }
+                if (writer->sha256 != nullptr) {
+                    mbedtls_sha256_update(writer->sha256, (const unsigned char*)page.data, page.size);
+                }
+                writer->written += page.size;
+            }
+        }
+        xQueueSend(writer->free_pages, &page, portMAX_DELAY);
+    }
+    xSemaphoreGive(writer->done);
+    vTaskDelete(NULL);
+}
+
+} // namespace
+
+bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed, size_t write_speed)> callback,
+    const std::string& patch_url, const std::string& sha256) {
+    if (!patch_url.empty()) {
+        if (UpgradeFromPatch(patch_url, callback)) {
+            return true;
+        }
+        ESP_LOGW(TAG, "Firmware patch failed, downloading the full image");
+    }
+    return UpgradeFromImage(firmware_url, callback, sha256);
+}
+
+bool Ota::UpgradeFromImage(const std::string& firmware_url, std::function<void(int progress, size_t speed, size_t write_speed)> callback,
+    const std::string& sha256) {
     ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
-    esp_ota_handle_t update_handle = 0;
     auto update_partition = esp_ota_get_next_update_partition(NULL);
     if (update_partition == NULL) {
         ESP_LOGE(TAG, "Failed to get update partition");
@@ -274,98 +458,305 @@ bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progre
     }
 
     ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
 
+    // What an interrupted upgrade left in the partition is kept, only the rest is downloaded
+    DownloadCheckpoint checkpoint("ota_resume", firmware_url, update_partition);
     auto network = Board::GetInstance().GetNetwork();
     auto http = network->CreateHttp(0);
-    if (!http->Open("GET", firmware_url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
+    size_t content_length = 0;
+    if (!checkpoint.Open(http.get(), content_length)) {
         return false;
     }
-
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
-        return false;
-    }
-
-    size_t content_length = http->GetBodyLength();
     if (content_length == 0) {
         ESP_LOGE(TAG, "Failed to get content length");
         return false;
     }
 
+    // The reader fills one page while the writer task flashes the others
     constexpr size_t PAGE_SIZE = 4096;
-    char* buffer = (char*)heap_caps_malloc(PAGE_SIZE, MALLOC_CAP_INTERNAL);
-    if (buffer == nullptr) {
+    constexpr size_t PAGE_COUNT = 3;
+    char* pages = (char*)HeapPlacement::Allocate(kHeapPlaceInternal, kHeapSubsystemSystem, PAGE_SIZE * PAGE_COUNT);
+    if (pages == nullptr) {
         ESP_LOGE(TAG, "Failed to allocate buffer");
         return false;
     }
 
-    size_t buffer_offset = 0;  // Current data size in buffer
-    size_t total_read = 0, recent_read = 0;
+    uint8_t expected_sha256[32];
+    bool check_sha256 = ParseSha256(sha256, expected_sha256);
+    if (!sha256.empty() && !check_sha256) {
+        ESP_LOGW(TAG, "Ignoring malformed image SHA-256: %s", sha256.c_str());
+    }
+    mbedtls_sha256_context sha256_context;
+    mbedtls_sha256_init(&sha256_context);
+    mbedtls_sha256_starts(&sha256_context, 0);
+
+    OtaWriter writer;
+    writer.checkpoint = &checkpoint;
+    if (check_sha256) {
+        writer.sha256 = &sha256_context;
+    }
+    writer.full_pages = xQueueCreate(PAGE_COUNT + 1, sizeof(OtaPage));
+    writer.free_pages = xQueueCreate(PAGE_COUNT, sizeof(OtaPage));
+    writer.done = xSemaphoreCreateBinary();
+    for (size_t i = 0; i < PAGE_COUNT; i++) {
+        OtaPage page = {pages + i * PAGE_SIZE, 0};
+        xQueueSend(writer.free_pages, &page, 0);
+    }
+    xTaskCreate(OtaWriterTask, "ota_writer", 4096, &writer, uxTaskPriorityGet(NULL), NULL);
+
+#if CONFIG_OTA_GZIP_IMAGES
+    // A gzip image is inflated as it arrives, a resumed download is always raw since only those are resumed
+    std::unique_ptr<GzipStream> gzip;
+    if (checkpoint.offset() == 0) {
+        gzip = std::make_unique<GzipStream>(http.get());
+    }
+#endif
+
+    bool ota_begun = false;
+    bool success = false;
+    OtaPage page;
+    xQueueReceive(writer.free_pages, &page, portMAX_DELAY);
+    size_t buffer_offset = 0;  // Current data size in page
+    size_t total_read = checkpoint.offset(), recent_read = 0, last_written = 0;
+    if (checkpoint.offset() > 0) {
+        // The OTA handle can only write from the start, so the verified prefix is written again from flash.
+        // Each page is read before its sector gets erased.
+        if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &writer.handle)) {
+            ESP_LOGE(TAG, "Failed to begin OTA");
+            writer.error = ESP_FAIL;
+        } else {
+            ota_begun = true;
+        }
+        for (size_t offset = 0; offset < checkpoint.offset() && writer.error == ESP_OK; offset += PAGE_SIZE) {
+            size_t size = std::min(PAGE_SIZE, checkpoint.offset() - offset);
+            auto err = esp_partition_read(update_partition, offset, page.data, size);
+            if (err == ESP_OK) {
+                err = esp_ota_write(writer.handle, page.data, size);
+            }
+            if (err == ESP_OK && writer.sha256 != nullptr) {
+                mbedtls_sha256_update(writer.sha256, (const unsigned char*)page.data, size);
+            }
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to rewrite the downloaded part: %s", esp_err_to_name(err));
+                writer.error = err;
+            }
+        }
+    }
     auto last_calc_time = esp_timer_get_time();
-    while (true) {
-        int ret = http->Read(buffer + buffer_offset, PAGE_SIZE - buffer_offset);
+    while (writer.error == ESP_OK) {
+        char* buffer = page.data + buffer_offset;
+        size_t size = PAGE_SIZE - buffer_offset;
+#if CONFIG_OTA_GZIP_IMAGES
+        int ret = gzip ? gzip->Read(buffer, size) : http->Read(buffer, size);
+#else
+        int ret = http->Read(buffer, size);
+#endif
         if (ret < 0) {
             ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            heap_caps_free(buffer);
-            return false;
+            break;
         }
 
+        // Speed and progress count the downloaded bytes, fewer than the inflated ones for a gzip image
+        size_t received = ret;
+#if CONFIG_OTA_GZIP_IMAGES
+        if (gzip) {
+            received = gzip->body_read() - total_read;
+            // The partition holds the inflated image, the checkpoint could not map it back to a Range
+            if (gzip->compressed() && writer.checkpoint != nullptr) {
+                ESP_LOGI(TAG, "Gzip image, the download cannot be resumed");
+                writer.checkpoint = nullptr;
+            }
+        }
+#endif
+
         // Calculate speed and progress every second
-        recent_read += ret;
-        total_read += ret;
+        recent_read += received;
+        total_read += received;
         buffer_offset += ret;
         if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
             size_t progress = total_read * 100 / content_length;
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
+            size_t written = writer.written;
+            size_t recent_written = written - last_written;
+            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s, Write: %uB/s", progress, total_read, content_length,
+                recent_read, recent_written);
             if (callback) {
-                callback(progress, recent_read);
+                callback(progress, recent_read, recent_written);
             }
             last_calc_time = esp_timer_get_time();
             recent_read = 0;
+            last_written = written;
         }
 
-        if (!image_header_checked) {
-            image_header.append(buffer, buffer_offset);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
-
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    ESP_LOGE(TAG, "Failed to begin OTA");
-                    heap_caps_free(buffer);
-                    return false;
-                }
-
-                image_header_checked = true;
-                std::string().swap(image_header);
+        bool is_last_chunk = (ret == 0);
+        if (!ota_begun && buffer_offset >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
+            // Also catches an error page or a compressed image the device cannot inflate
+            if ((uint8_t)page.data[0] != ESP_IMAGE_HEADER_MAGIC) {
+                ESP_LOGE(TAG, "Not a firmware image, magic 0x%02x", (uint8_t)page.data[0]);
+                break;
+            }
+            esp_app_desc_t new_app_info;
+            memcpy(&new_app_info, page.data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
+            ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
+
+            // Sequential writes erase each sector right before it is written, not the whole partition up front
+            if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &writer.handle)) {
+                esp_ota_abort(writer.handle);
+                ESP_LOGE(TAG, "Failed to begin OTA");
+                break;
             }
+            ota_begun = true;
         }
 
-        // Write to flash when buffer is full (4KB) or it's the last chunk
-        bool is_last_chunk = (ret == 0);
+        // Hand the page to the writer when it is full (4KB) or it's the last chunk
         if (buffer_offset == PAGE_SIZE || (is_last_chunk && buffer_offset > 0)) {
-            auto err = esp_ota_write(update_handle, buffer, buffer_offset);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-                esp_ota_abort(update_handle);
-                heap_caps_free(buffer);
-                return false;
+            if (!ota_begun) {
+                ESP_LOGE(TAG, "Firmware image is too small");
+                break;
             }
-
+            page.size = buffer_offset;
+            xQueueSend(writer.full_pages, &page, portMAX_DELAY);
+            xQueueReceive(writer.free_pages, &page, portMAX_DELAY);
             buffer_offset = 0;
         }
 
         if (is_last_chunk) {
+            success = true;
+            break;
+        }
+    }
+
+    if (success && total_read != content_length) {
+        // The connection closed early, what arrived is kept for the next attempt
+        ESP_LOGE(TAG, "Downloaded size (%u) does not match expected size (%u)", total_read, content_length);
+        success = false;
+    }
+
+    // End the stream and wait until the writer has flashed or dropped every page
+    OtaPage end_of_stream = {nullptr, 0};
+    xQueueSend(writer.full_pages, &end_of_stream, portMAX_DELAY);
+    xSemaphoreTake(writer.done, portMAX_DELAY);
+    vSemaphoreDelete(writer.done);
+    vQueueDelete(writer.full_pages);
+    vQueueDelete(writer.free_pages);
+    HeapPlacement::Free(kHeapSubsystemSystem, pages);
+    http->Close();
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha256_context, digest);
+    mbedtls_sha256_free(&sha256_context);
+    if (success && writer.error == ESP_OK && check_sha256) {
+        if (memcmp(digest, expected_sha256, sizeof(digest)) != 0) {
+            // What is in the partition cannot be trusted, the next attempt starts over
+            ESP_LOGE(TAG, "Image SHA-256 does not match the version check, the download is corrupted");
+            esp_ota_abort(writer.handle);
+            checkpoint.Clear();
+            return false;
+        }
+        ESP_LOGI(TAG, "Image SHA-256 matches the version check");
+    }
+
+    if (!success || writer.error != ESP_OK) {
+        if (ota_begun) {
+            esp_ota_abort(writer.handle);
+        }
+        // A dropped connection resumes next time, a flash error or a gzip image starts over
+        if (writer.error != ESP_OK || writer.checkpoint == nullptr) {
+            checkpoint.Clear();
+        } else {
+            checkpoint.Save();
+        }
+        return false;
+    }
+
+    checkpoint.Clear();
+    return CompleteUpgrade(writer.handle, update_partition);
+}
+
+// Applies a FirmwarePatch against the running firmware, the patch is small enough to not need resuming
+bool Ota::UpgradeFromPatch(const std::string& patch_url, std::function<void(int progress, size_t speed, size_t write_speed)> callback) {
+    ESP_LOGI(TAG, "Upgrading firmware with patch %s", patch_url.c_str());
+    auto update_partition = esp_ota_get_next_update_partition(NULL);
+    if (update_partition == NULL) {
+        ESP_LOGE(TAG, "Failed to get update partition");
+        return false;
+    }
+
+    auto network = Board::GetInstance().GetNetwork();
+    auto http = network->CreateHttp(0);
+    if (!http->Open("GET", patch_url)) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection");
+        return false;
+    }
+    if (http->GetStatusCode() != 200) {
+        ESP_LOGE(TAG, "Failed to get firmware patch, status code: %d", http->GetStatusCode());
+        return false;
+    }
+    size_t content_length = http->GetBodyLength();
+    if (content_length == 0) {
+        ESP_LOGE(TAG, "Failed to get content length");
+        return false;
+    }
+
+    esp_ota_handle_t update_handle = 0;
+    if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
+        ESP_LOGE(TAG, "Failed to begin OTA");
+        return false;
+    }
+
+    constexpr size_t BUFFER_SIZE = 4096;
+    char* buffer = (char*)HeapPlacement::Allocate(kHeapPlaceInternal, kHeapSubsystemSystem, BUFFER_SIZE);
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate buffer");
+        esp_ota_abort(update_handle);
+        return false;
+    }
+
+    FirmwarePatch patch(esp_ota_get_running_partition(), update_handle);
+    bool success = false;
+    size_t total_read = 0, recent_read = 0, last_produced = 0;
+    auto last_calc_time = esp_timer_get_time();
+    while (true) {
+        int ret = http->Read(buffer, BUFFER_SIZE);
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
+            break;
+        }
+
+        recent_read += ret;
+        total_read += ret;
+        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
+            size_t progress = total_read * 100 / content_length;
+            size_t recent_produced = patch.produced() - last_produced;
+            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s, Write: %uB/s", progress, total_read, content_length,
+                recent_read, recent_produced);
+            if (callback) {
+                callback(progress, recent_read, recent_produced);
+            }
+            last_calc_time = esp_timer_get_time();
+            recent_read = 0;
+            last_produced = patch.produced();
+        }
+
+        if (ret == 0) {
+            // Checks the hash of the new image before anything marks it bootable
+            success = patch.Finish();
+            break;
+        }
+        if (!patch.Feed((const uint8_t*)buffer, ret)) {
             break;
         }
     }
     http->Close();
-    heap_caps_free(buffer);
+    HeapPlacement::Free(kHeapSubsystemSystem, buffer);
+
+    if (!success) {
+        esp_ota_abort(update_handle);
+        return false;
+    }
+    return CompleteUpgrade(update_handle, update_partition);
+}
 
+bool Ota::CompleteUpgrade(esp_ota_handle_t update_handle, const esp_partition_t* update_partition) {
     esp_err_t err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
@@ -386,8 +777,8 @@ bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progre
     return true;
 }
 
-bool Ota::StartUpgrade(std::function<void(int progress, size_t speed)> callback) {
-    return Upgrade(firmware_url_, callback);
+bool Ota::StartUpgrade(std::function<void(int progress, size_t speed, size_t write_speed)> callback) {
+    return Upgrade(firmware_url_, callback, firmware_patch_url_, firmware_sha256_);
 }
 
 
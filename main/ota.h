@@ -5,6 +5,7 @@
 #include <string>
 
 #include <esp_err.h>
+#include <esp_ota_ops.h>
 #include "board.h"
 
 class Ota {
@@ -20,13 +21,20 @@ public:
     bool HasWebsocketConfig() { return has_websocket_config_; }
     bool HasActivationCode() { return has_activation_code_; }
     bool HasServerTime() { return has_server_time_; }
-    bool StartUpgrade(std::function<void(int progress, size_t speed)> callback);
-    static bool Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback);
+    // speed is the download rate and write_speed the flash rate over the last second, in bytes per second
+    bool StartUpgrade(std::function<void(int progress, size_t speed, size_t write_speed)> callback);
+    // Tries the patch first if there is one, the full image is the fallback. A full image is hashed while
+    // it downloads and must match sha256 when one is given.
+    static bool Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed, size_t write_speed)> callback,
+        const std::string& patch_url = "", const std::string& sha256 = "");
     void MarkCurrentVersionValid();
 
     const std::string& GetFirmwareVersion() const { return firmware_version_; }
     const std::string& GetCurrentVersion() const { return current_version_; }
     const std::string& GetFirmwareUrl() const { return firmware_url_; }
+    const std::string& GetFirmwarePatchUrl() const { return firmware_patch_url_; }
+    // Hex SHA-256 of the image as installed, empty when the server sent none
+    const std::string& GetFirmwareSha256() const { return firmware_sha256_; }
     const std::string& GetActivationMessage() const { return activation_message_; }
     const std::string& GetActivationCode() const { return activation_code_; }
     std::string GetCheckVersionUrl();
@@ -44,15 +52,21 @@ private:
     std::string current_version_;
     std::string firmware_version_;
     std::string firmware_url_;
+    std::string firmware_patch_url_;
+    std::string firmware_sha256_;
     std::string activation_challenge_;
     std::string serial_number_;
     int activation_timeout_ms_ = 30000;
 
-    std::function<void(int progress, size_t speed)> upgrade_callback_;
+    std::function<void(int progress, size_t speed, size_t write_speed)> upgrade_callback_;
     std::vector<int> ParseVersion(const std::string& version);
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
     std::string GetActivationPayload();
     std::unique_ptr<Http> SetupHttp();
+    static bool UpgradeFromImage(const std::string& firmware_url, std::function<void(int progress, size_t speed, size_t write_speed)> callback,
+        const std::string& sha256);
+    static bool UpgradeFromPatch(const std::string& patch_url, std::function<void(int progress, size_t speed, size_t write_speed)> callback);
+    static bool CompleteUpgrade(esp_ota_handle_t update_handle, const esp_partition_t* update_partition);
 };
 
 #endif // _OTA_H
@@ -0,0 +1,93 @@
+#include "control_frame.h"
+#include "protocol.h"
+
+#include <arpa/inet.h>
+
+static void SetPayloadSize(std::string& frame) {
+    auto bp3 = (BinaryProtocol3*)frame.data();
+    bp3->payload_size = htons(frame.size() - sizeof(BinaryProtocol3));
+}
+
+void BuildControlFrame(std::string& frame, ControlEvent event) {
+    frame.assign(sizeof(BinaryProtocol3), '\0');
+    frame[0] = CONTROL_FRAME_TYPE;
+    frame.push_back(event);
+    SetPayloadSize(frame);
+}
+
+void AppendControlField(std::string& frame, ControlTag tag, std::string_view value) {
+    if (value.size() > 255) {
+        value = value.substr(0, 255);
+    }
+    frame.push_back(tag);
+    frame.push_back(value.size());
+    frame.append(value.data(), value.size());
+    SetPayloadSize(frame);
+}
+
+void AppendControlField(std::string& frame, ControlTag tag, uint8_t value) {
+    frame.push_back(tag);
+    frame.push_back(1);
+    frame.push_back(value);
+    SetPayloadSize(frame);
+}
+
+bool ParseControlFrame(std::string_view frame, ServerMessage& message) {
+    if (frame.size() < sizeof(BinaryProtocol3) + 1 || (uint8_t)frame[0] != CONTROL_FRAME_TYPE) {
+        return false;
+    }
+    auto bp3 = (const BinaryProtocol3*)frame.data();
+    size_t payload_size = ntohs(bp3->payload_size);
+    if (payload_size < 1 || payload_size > frame.size() - sizeof(BinaryProtocol3)) {
+        return false;
+    }
+    auto payload = frame.substr(sizeof(BinaryProtocol3), payload_size);
+
+    message = ServerMessage();
+    switch ((uint8_t)payload[0]) {
+    case kControlEventTtsStart:
+        message.type = "tts";
+        message.state = "start";
+        break;
+    case kControlEventTtsStop:
+        message.type = "tts";
+        message.state = "stop";
+        break;
+    case kControlEventTtsSentenceStart:
+        message.type = "tts";
+        message.state = "sentence_start";
+        break;
+    case kControlEventStt:
+        message.type = "stt";
+        break;
+    case kControlEventLlm:
+        message.type = "llm";
+        break;
+    default:
+        return false;
+    }
+
+    // Unknown tags are skipped, so fields can be added without a new version
+    size_t pos = 1;
+    while (pos < payload.size()) {
+        if (pos + 2 > payload.size()) {
+            return false;
+        }
+        uint8_t tag = payload[pos];
+        size_t length = (uint8_t)payload[pos + 1];
+        pos += 2;
+        if (length > payload.size() - pos) {
+            return false;
+        }
+        auto value = payload.substr(pos, length);
+        pos += length;
+        if (tag == kControlTagText) {
+            message.text = value;
+        } else if (tag == kControlTagEmotion) {
+            message.emotion = value;
+        } else if (tag == kControlTagHash) {
+            message.hash = value;
+        }
+    }
+    return true;
+}
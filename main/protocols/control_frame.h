@@ -0,0 +1,54 @@
+#ifndef CONTROL_FRAME_H
+#define CONTROL_FRAME_H
+
+#include "server_message.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+ * Binary control frames of protocol version 4, used instead of JSON for the per-turn events once
+ * the server accepted "binary_control" in its hello. MCP and the rare messages stay JSON.
+ *
+ * A control frame is a BinaryProtocol3 frame with type CONTROL_FRAME_TYPE, its payload is:
+ * |event 1u|fields of (tag 1u, length 1u, value length)|
+ *
+ * There is no session id, a frame belongs to the session of the connection it arrives on.
+ */
+enum ControlEvent : uint8_t {
+    // Client to server
+    kControlEventListenStart = 0x01,        // mode
+    kControlEventListenStop = 0x02,
+    kControlEventListenDetect = 0x03,       // text
+    kControlEventAbort = 0x04,              // reason, only sent for kAbortReasonWakeWordDetected
+    kControlEventTtsCached = 0x05,          // hash
+    // Server to client
+    kControlEventTtsStart = 0x10,           // hash, only for a cacheable response
+    kControlEventTtsStop = 0x11,
+    kControlEventTtsSentenceStart = 0x12,   // text
+    kControlEventStt = 0x13,                // text
+    kControlEventLlm = 0x14,                // emotion, text
+};
+
+enum ControlTag : uint8_t {
+    kControlTagMode = 0x01,     // One byte, a ListeningMode value
+    kControlTagReason = 0x02,   // One byte, an AbortReason value
+    kControlTagText = 0x03,     // UTF-8, at most 255 bytes
+    kControlTagEmotion = 0x04,  // UTF-8, at most 255 bytes
+    kControlTagHash = 0x05,     // ASCII, at most 64 bytes
+};
+
+// Starts frame over with the header and the event, fields are appended with AppendControlField()
+void BuildControlFrame(std::string& frame, ControlEvent event);
+// Longer values are cut at 255 bytes
+void AppendControlField(std::string& frame, ControlTag tag, std::string_view value);
+void AppendControlField(std::string& frame, ControlTag tag, uint8_t value);
+
+/*
+ * Reads a server control frame, header included, into the fields Application handles. The views
+ * point into frame. Returns false for malformed frames and events the device does not handle.
+ */
+bool ParseControlFrame(std::string_view frame, ServerMessage& message);
+
+#endif // CONTROL_FRAME_H
@@ -0,0 +1,54 @@
+#include "dns_prefetch.h"
+#include "task_factory.h"
+
+#include <algorithm>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <lwip/netdb.h>
+#include <lwip/inet.h>
+
+#define TAG "DnsPrefetch"
+
+void DnsPrefetch::Start(const std::vector<std::string>& urls) {
+    std::vector<std::string> hosts;
+    for (auto& url : urls) {
+        auto host = GetHost(url);
+        if (!host.empty() && std::find(hosts.begin(), hosts.end(), host) == hosts.end()) {
+            hosts.push_back(host);
+        }
+    }
+    if (hosts.empty()) {
+        return;
+    }
+    TaskFactory::Create("dns_prefetch", 3072, 2, kTaskStackInternal, [hosts = std::move(hosts)]() {
+        for (auto& host : hosts) {
+            int64_t start_us = esp_timer_get_time();
+            struct addrinfo hints = {};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            struct addrinfo* result = nullptr;
+            int err = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+            if (err != 0 || result == nullptr) {
+                ESP_LOGW(TAG, "Failed to resolve %s: %d", host.c_str(), err);
+                continue;
+            }
+            freeaddrinfo(result);
+            ESP_LOGI(TAG, "Resolved %s in %d ms", host.c_str(), (int)((esp_timer_get_time() - start_us) / 1000));
+        }
+    });
+}
+
+std::string DnsPrefetch::GetHost(const std::string& url) {
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    if (start >= url.size() || url[start] == '[') {
+        return "";
+    }
+    size_t end = url.find_first_of(":/?#", start);
+    std::string host = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    struct in_addr addr;
+    if (host.empty() || inet_aton(host.c_str(), &addr)) {
+        return "";
+    }
+    return host;
+}
@@ -0,0 +1,23 @@
+#ifndef DNS_PREFETCH_H
+#define DNS_PREFETCH_H
+
+#include <string>
+#include <vector>
+
+/*
+ * Resolves the server host names on a short lived task, so the lookup overlaps the version
+ * check and lwIP's DNS table already holds the address when the connection opens.
+ *
+ * Only the lookup is early, the connections still use the host name, so SNI and the
+ * certificate check are unchanged. The table follows the record TTL and lives in RAM.
+ * Only for boards whose sockets go through lwIP, an ML307 in AT mode resolves names itself.
+ */
+class DnsPrefetch {
+public:
+    // Accepts urls and MQTT "host:port" endpoints, empty entries are skipped
+    static void Start(const std::vector<std::string>& urls);
+    // The host of a url or endpoint, empty for IP literals
+    static std::string GetHost(const std::string& url);
+};
+
+#endif // DNS_PREFETCH_H
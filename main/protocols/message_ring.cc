@@ -0,0 +1,140 @@
+#include "message_ring.h"
+#include "heap_placement.h"
+
+#include <cstring>
+
+// |header 4u|data, padded to 4|, the header is the length, or kOutOfLine with |length 4u|pointer|
+size_t MessageRing::RecordSize(uint32_t header) {
+    size_t data_size = (header & kOutOfLine) ? sizeof(uint32_t) + sizeof(void*) : header;
+    return (sizeof(uint32_t) + data_size + 3) & ~(size_t)3;
+}
+
+MessageRing::~MessageRing() {
+    Clear();
+    HeapPlacement::Free(kHeapSubsystemProtocol, buffer_);
+}
+
+bool MessageRing::Initialize(size_t capacity) {
+    capacity = (capacity + 3) & ~(size_t)3;
+    buffer_ = static_cast<uint8_t*>(HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemProtocol, capacity));
+    if (buffer_ == nullptr) {
+        return false;
+    }
+    capacity_ = capacity;
+    head_ = tail_ = used_ = 0;
+    return true;
+}
+
+bool MessageRing::Reserve(size_t size, size_t& position) {
+    if (used_ == 0) {
+        head_ = tail_ = 0;
+    }
+    if (used_ == 0 || head_ > tail_) {
+        // Free from head_ to the end, and from the start to tail_
+        if (capacity_ - head_ >= size) {
+            position = head_;
+        } else if (tail_ >= size) {
+            uint32_t marker = kWrapMarker;
+            memcpy(buffer_ + head_, &marker, sizeof(marker));
+            used_ += capacity_ - head_;
+            position = 0;
+        } else {
+            return false;
+        }
+    } else if (tail_ - head_ >= size) {
+        position = head_;
+    } else {
+        return false;
+    }
+    head_ = position + size;
+    if (head_ == capacity_) {
+        head_ = 0;
+    }
+    used_ += size;
+    return true;
+}
+
+bool MessageRing::Push(const char* data, size_t length) {
+    if (buffer_ == nullptr) {
+        return false;
+    }
+    size_t position;
+    // Up to half the buffer inline, so one message can arrive while another is parsed
+    if (RecordSize(length) <= capacity_ / 2 && length < kOutOfLine) {
+        if (!Reserve(RecordSize(length), position)) {
+            return false;
+        }
+        uint32_t header = length;
+        memcpy(buffer_ + position, &header, sizeof(header));
+        memcpy(buffer_ + position + sizeof(header), data, length);
+        return true;
+    }
+
+    void* copy = HeapPlacement::Allocate(kHeapPlacePsram, kHeapSubsystemProtocol, length);
+    if (copy == nullptr) {
+        return false;
+    }
+    if (!Reserve(RecordSize(kOutOfLine), position)) {
+        HeapPlacement::Free(kHeapSubsystemProtocol, copy);
+        return false;
+    }
+    memcpy(copy, data, length);
+    uint32_t header = kOutOfLine;
+    uint32_t length32 = length;
+    memcpy(buffer_ + position, &header, sizeof(header));
+    memcpy(buffer_ + position + sizeof(header), &length32, sizeof(length32));
+    memcpy(buffer_ + position + sizeof(header) + sizeof(length32), &copy, sizeof(copy));
+    out_of_line_++;
+    return true;
+}
+
+bool MessageRing::Front(std::string_view& message) {
+    if (used_ == 0) {
+        return false;
+    }
+    uint32_t header;
+    memcpy(&header, buffer_ + tail_, sizeof(header));
+    if (header == kWrapMarker) {
+        used_ -= capacity_ - tail_;
+        tail_ = 0;
+        memcpy(&header, buffer_, sizeof(header));
+    }
+    const uint8_t* data = buffer_ + tail_ + sizeof(header);
+    if (header & kOutOfLine) {
+        uint32_t length;
+        const char* copy;
+        memcpy(&length, data, sizeof(length));
+        memcpy(&copy, data + sizeof(length), sizeof(copy));
+        message = std::string_view(copy, length);
+    } else {
+        message = std::string_view(reinterpret_cast<const char*>(data), header);
+    }
+    return true;
+}
+
+void MessageRing::Pop() {
+    std::string_view message;
+    if (!Front(message)) {
+        return;
+    }
+    uint32_t header;
+    memcpy(&header, buffer_ + tail_, sizeof(header));
+    if (header & kOutOfLine) {
+        HeapPlacement::Free(kHeapSubsystemProtocol, const_cast<char*>(message.data()));
+    }
+    size_t size = RecordSize(header);
+    tail_ += size;
+    if (tail_ == capacity_) {
+        tail_ = 0;
+    }
+    used_ -= size;
+    if (used_ == 0) {
+        head_ = tail_ = 0;
+    }
+}
+
+void MessageRing::Clear() {
+    while (!empty()) {
+        Pop();
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef MESSAGE_RING_H
+#define MESSAGE_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+ * Queue of whole messages in one buffer allocated up front, PSRAM where the board has it.
+ *
+ * Push() copies a message in behind the others, Front() hands out the oldest one in place and
+ * Pop() drops it once it has been handled, so the consumer parses straight out of the buffer.
+ * Every message stays contiguous, one that does not fit before the end of the buffer starts
+ * over at the beginning. A message too large for the buffer is copied into an allocation of
+ * its own and only a reference to it is queued, so the order holds either way.
+ *
+ * Not thread safe, the owner serializes the calls. A message handed out by Front() stays valid
+ * while other messages are pushed, until Pop().
+ */
+class MessageRing {
+public:
+    MessageRing() = default;
+    ~MessageRing();
+
+    MessageRing(const MessageRing&) = delete;
+    MessageRing& operator=(const MessageRing&) = delete;
+
+    bool Initialize(size_t capacity);
+    // False if the buffer has no room for the message or the reference to it right now
+    bool Push(const char* data, size_t length);
+    // False if empty
+    bool Front(std::string_view& message);
+    void Pop();
+    void Clear();
+
+    bool empty() const { return used_ == 0; }
+    size_t capacity() const { return capacity_; }
+    // Messages that were too large for the buffer
+    uint32_t out_of_line() const { return out_of_line_; }
+
+private:
+    static constexpr uint32_t kWrapMarker = 0xFFFFFFFF;
+    static constexpr uint32_t kOutOfLine = 0x80000000;
+
+    uint8_t* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    size_t head_ = 0;   // Where the next record goes
+    size_t tail_ = 0;   // The oldest record
+    size_t used_ = 0;   // Bytes from tail_ to head_, with the space skipped at the end
+    uint32_t out_of_line_ = 0;
+
+    static size_t RecordSize(uint32_t header);
+    bool Reserve(size_t size, size_t& position);
+};
+
+#endif // MESSAGE_RING_H
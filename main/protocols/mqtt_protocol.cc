@@ -2,10 +2,11 @@
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "control_frame.h"
+#include "trace.h"
 
 #include <esp_log.h>
 #include <cstring>
-#include <arpa/inet.h>
 #include "assets/lang_config.h"
 
 #define TAG "MQTT"
@@ -44,7 +45,7 @@ MqttProtocol::~MqttProtocol() {
         esp_timer_delete(reconnect_timer_);
     }
 
-    udp_.reset();
+    udp_channel_.Close();
     mqtt_.reset();
     
     if (event_group_handle_ != nullptr) {
@@ -95,9 +96,27 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
             on_connected_();
         }
         esp_timer_stop(reconnect_timer_);
+        // Publishing from the client callback could block its own task
+        auto alive = alive_;
+        Application::GetInstance().Schedule([this, alive]() {
+            if (*alive) {
+                FlushPublishQueue();
+            }
+        });
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
+        // JSON never starts with a control character
+        if (!payload.empty() && payload[0] == CONTROL_FRAME_TYPE) {
+            DispatchControlFrame(payload);
+            last_incoming_time_ = std::chrono::steady_clock::now();
+            return;
+        }
+        if (DispatchServerMessage(payload)) {
+            last_incoming_time_ = std::chrono::steady_clock::now();
+            return;
+        }
+
         cJSON* root = cJSON_Parse(payload.c_str());
         if (root == nullptr) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
@@ -148,6 +167,80 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     }
 
     ESP_LOGI(TAG, "Connected to endpoint");
+    FlushPublishQueue();
+    return true;
+}
+
+// Keys of the messages that only matter in their latest state, empty for the ones that all have to arrive
+static std::string CoalesceKey(const std::string& payload) {
+    if (!payload.empty() && payload[0] == CONTROL_FRAME_TYPE) {
+        uint8_t event = payload.size() > sizeof(BinaryProtocol3) ? payload[sizeof(BinaryProtocol3)] : 0;
+        if (event >= kControlEventListenStart && event <= kControlEventListenDetect) {
+            return "listen";
+        } else if (event == kControlEventAbort) {
+            return "abort";
+        }
+        return std::string();
+    }
+    ServerMessage message;
+    if (ParseServerMessage(payload, message) && (message.type == "listen" || message.type == "abort")) {
+        return std::string(message.type);
+    }
+    return std::string();
+}
+
+// Publishes right away, or queues the message while the client is disconnected
+bool MqttProtocol::Publish(const std::string& payload) {
+    auto key = CoalesceKey(payload);
+    // Superseded states go at most once, the broker acknowledges the rest
+    int qos = key.empty() ? 1 : 0;
+
+    std::lock_guard<std::mutex> lock(publish_mutex_);
+    if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
+        if (!key.empty()) {
+            for (auto it = publish_queue_.begin(); it != publish_queue_.end(); ++it) {
+                if (it->key == key) {
+                    publish_queue_.erase(it);
+                    break;
+                }
+            }
+        }
+        if (publish_queue_.size() >= MQTT_PUBLISH_QUEUE_MAX_MESSAGES) {
+            ESP_LOGW(TAG, "Publish queue is full, dropping the oldest message");
+            publish_queue_.pop_front();
+        }
+        publish_queue_.push_back({std::move(key), payload, qos, std::chrono::steady_clock::now()});
+        return true;
+    }
+
+    // Queued messages go first, so nothing overtakes them
+    if (!PublishQueuedMessages()) {
+        return false;
+    }
+    return mqtt_->Publish(publish_topic_, payload, qos);
+}
+
+void MqttProtocol::FlushPublishQueue() {
+    std::lock_guard<std::mutex> lock(publish_mutex_);
+    if (publish_queue_.empty() || mqtt_ == nullptr || !mqtt_->IsConnected()) {
+        return;
+    }
+    ESP_LOGI(TAG, "Publishing %u queued messages", publish_queue_.size());
+    PublishQueuedMessages();
+}
+
+// Called with publish_mutex_ held, stops at the first failure and keeps the rest queued
+bool MqttProtocol::PublishQueuedMessages() {
+    while (!publish_queue_.empty()) {
+        auto& message = publish_queue_.front();
+        if (std::chrono::steady_clock::now() - message.time > std::chrono::milliseconds(MQTT_PUBLISH_QUEUE_MAX_AGE_MS)) {
+            ESP_LOGW(TAG, "Dropping a queued message older than %d ms", MQTT_PUBLISH_QUEUE_MAX_AGE_MS);
+        } else if (!mqtt_->Publish(publish_topic_, message.payload, message.qos)) {
+            ESP_LOGW(TAG, "Failed to publish queued message, %u left", publish_queue_.size());
+            return false;
+        }
+        publish_queue_.pop_front();
+    }
     return true;
 }
 
@@ -155,7 +248,7 @@ bool MqttProtocol::SendText(const std::string& text) {
     if (publish_topic_.empty()) {
         return false;
     }
-    if (!mqtt_->Publish(publish_topic_, text)) {
+    if (!Publish(text)) {
         ESP_LOGE(TAG, "Failed to publish message: %s", text.c_str());
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
@@ -163,36 +256,38 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
-bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
-    std::lock_guard<std::mutex> lock(channel_mutex_);
-    if (udp_ == nullptr) {
+bool MqttProtocol::SendControlFrame(const std::string& frame) {
+    if (publish_topic_.empty()) {
         return false;
     }
-
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
-
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
-
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
-        ESP_LOGE(TAG, "Failed to encrypt audio data");
+    if (!Publish(frame)) {
+        ESP_LOGE(TAG, "Failed to publish control frame, event: %u", (uint8_t)frame[sizeof(BinaryProtocol3)]);
+        SetError(Lang::Strings::SERVER_ERROR);
         return false;
     }
+    return true;
+}
 
-    return udp_->Send(encrypted) > 0;
+bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    bool sent = udp_channel_.SendAudio(packet->opus_data(), packet->opus_size(), packet->timestamp);
+    Application::GetInstance().GetAudioService().ReleasePacket(std::move(packet));
+    return sent;
+}
+
+bool MqttProtocol::SendAudioBatchFrame(const std::string& body, uint32_t timestamp, int count) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    return udp_channel_.SendAudioBatch(body, timestamp, count);
 }
 
 void MqttProtocol::CloseAudioChannel(bool send_goodbye) {
     {
         std::lock_guard<std::mutex> lock(channel_mutex_);
-        udp_.reset();
+        udp_channel_.Close();
+#if CONFIG_MQTT_RESUME_UDP_SESSION
+        resume_pending_ = false;
+        resume_idle_since_ = std::chrono::steady_clock::now();
+#endif
     }
 
     ESP_LOGI(TAG, "Closing audio channel, send_goodbye: %d", send_goodbye);
@@ -212,7 +307,18 @@ void MqttProtocol::CloseAudioChannel(bool send_goodbye) {
     }
 }
 
+void MqttProtocol::ResetConnection() {
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        udp_channel_.Close();
+    }
+    // Reconnect right away instead of waiting for the broker keepalive to notice
+    esp_timer_stop(reconnect_timer_);
+    StartMqttClient(false);
+}
+
 bool MqttProtocol::OpenAudioChannel() {
+    TRACE_SCOPE(kTracePointAudioChannelOpen);
     if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
         ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
         if (!StartMqttClient(true)) {
@@ -222,74 +328,71 @@ bool MqttProtocol::OpenAudioChannel() {
 
     error_occurred_ = false;
     session_id_ = "";
+    bool resume = false;
+#if CONFIG_MQTT_RESUME_UDP_SESSION
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        resume = !udp_params_.empty() &&
+            std::chrono::steady_clock::now() - resume_idle_since_ < std::chrono::seconds(MQTT_RESUME_MAX_IDLE_SECONDS);
+        if (resume) {
+            session_id_ = resume_session_id_;
+        }
+    }
+#endif
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
     auto message = GetHelloMessage();
+    hello_sent_time_ = std::chrono::steady_clock::now();
+    TRACE_BEGIN(kTracePointHello);
     if (!SendText(message)) {
         return false;
     }
 
-    // 等待服务器响应
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
-    if (!(bits & MQTT_PROTOCOL_SERVER_HELLO_EVENT)) {
-        ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
-        return false;
+    if (resume) {
+#if CONFIG_MQTT_RESUME_UDP_SESSION
+        // The server hello still has to arrive, ParseServerHello() switches over if the session was not resumed
+        ESP_LOGI(TAG, "Resuming session %s with the cached udp parameters", session_id_.c_str());
+        resume_deadline_ = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        resume_pending_ = true;
+#endif
+    } else {
+        // 等待服务器响应
+        EventBits_t bits = xEventGroupWaitBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+        if (!(bits & MQTT_PROTOCOL_SERVER_HELLO_EVENT)) {
+            ESP_LOGE(TAG, "Failed to receive server hello");
+            SetError(Lang::Strings::SERVER_TIMEOUT);
+            return false;
+        }
     }
 
-    std::lock_guard<std::mutex> lock(channel_mutex_);
-    auto network = Board::GetInstance().GetNetwork();
-    udp_ = network->CreateUdp(2);
-    udp_->OnMessage([this](const std::string& data) {
-        /*
-         * UDP Encrypted OPUS Packet Format:
-         * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
-         * |payload payload_len|
-         */
-        if (data.size() < sizeof(aes_nonce_)) {
-            ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
-            return;
-        }
-        if (data[0] != 0x01) {
-            ESP_LOGE(TAG, "Invalid audio packet type: %x", data[0]);
-            return;
-        }
-        uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
-        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        // A fast server hello may have opened it already
+        if (!udp_channel_.IsOpened() && !OpenUdpChannel()) {
+            return false;
         }
+    }
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
 
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
+bool MqttProtocol::OpenUdpChannel() {
+    bool opened = udp_channel_.Open([this](std::unique_ptr<AudioStreamPacket> packet) {
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
-        packet->timestamp = timestamp;
-        packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
-            return;
-        }
         if (on_incoming_audio_ != nullptr) {
             on_incoming_audio_(std::move(packet));
+        } else {
+            Application::GetInstance().GetAudioService().ReleasePacket(std::move(packet));
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
-
-    udp_->Connect(udp_server_, udp_port_);
-
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
+    if (!opened) {
+        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        return false;
     }
     return true;
 }
@@ -300,17 +403,29 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddStringToObject(root, "type", "hello");
     cJSON_AddNumberToObject(root, "version", 3);
     cJSON_AddStringToObject(root, "transport", "udp");
+    // Only set when resuming the previous session
+    if (!session_id_.empty()) {
+        cJSON_AddStringToObject(root, "session_id", session_id_.c_str());
+    }
     cJSON* features = cJSON_CreateObject();
 #if CONFIG_USE_SERVER_AEC
     cJSON_AddBoolToObject(features, "aec", true);
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+    AddAudioBatchFeature(features);
+    AddBinaryControlFeature(features);
+    AddTtsCacheFeature(features);
     cJSON_AddItemToObject(root, "features", features);
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    auto encoder_config = Application::GetInstance().GetAudioService().GetEncoderConfig();
+    cJSON_AddNumberToObject(audio_params, "frame_duration", encoder_config.frame_duration_ms);
+    if (encoder_config.bitrate != ESP_OPUS_BITRATE_AUTO) {
+        cJSON_AddNumberToObject(audio_params, "bitrate", encoder_config.bitrate);
+    }
+    AddDownlinkAudioParams(audio_params);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -326,12 +441,17 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         return;
     }
 
+    RecordHelloRoundTrip();
+
     auto session_id = cJSON_GetObjectItem(root, "session_id");
     if (cJSON_IsString(session_id)) {
         session_id_ = session_id->valuestring;
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
+    ParseAudioBatchFeature(root);
+    ParseBinaryControlFeature(root);
+
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (cJSON_IsObject(audio_params)) {
@@ -343,6 +463,7 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
+        ParseUplinkAudioParams(audio_params);
     }
 
     auto udp = cJSON_GetObjectItem(root, "udp");
@@ -350,40 +471,53 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         ESP_LOGE(TAG, "UDP is not specified");
         return;
     }
-    udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
-    udp_port_ = cJSON_GetObjectItem(udp, "port")->valueint;
-    auto key = cJSON_GetObjectItem(udp, "key")->valuestring;
-    auto nonce = cJSON_GetObjectItem(udp, "nonce")->valuestring;
-
-    // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
-    // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
-    local_sequence_ = 0;
-    remote_sequence_ = 0;
+#if CONFIG_MQTT_RESUME_UDP_SESSION
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        resume_pending_ = false;
+        auto params_str = cJSON_PrintUnformatted(udp);
+        std::string params(params_str);
+        cJSON_free(params_str);
+        // A resumed session keeps its sequences, the counter blocks must not repeat under the same key
+        if (!udp_channel_.IsOpened() || params != udp_params_) {
+            if (!udp_channel_.Configure(udp)) {
+                udp_params_.clear();
+                return;
+            }
+            if (udp_channel_.IsOpened()) {
+                ESP_LOGW(TAG, "Session was not resumed, reopening udp with the new parameters");
+                udp_channel_.Close();
+                if (!OpenUdpChannel()) {
+                    udp_params_.clear();
+                    return;
+                }
+            }
+        }
+        udp_params_ = params;
+        resume_session_id_ = session_id_;
+    }
+#else
+    if (!udp_channel_.Configure(udp)) {
+        return;
+    }
+#endif
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
-static const char hex_chars[] = "0123456789ABCDEF";
-// 辅助函数，将单个十六进制字符转换为对应的数值
-static inline uint8_t CharToHex(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    return 0;  // 对于无效输入，返回0
-}
-
-std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
-    std::string decoded;
-    decoded.reserve(hex_string.size() / 2);
-    for (size_t i = 0; i < hex_string.size(); i += 2) {
-        char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
-        decoded.push_back(byte);
+void MqttProtocol::KeepAlive() {
+#if CONFIG_MQTT_RESUME_UDP_SESSION
+    if (resume_pending_ && std::chrono::steady_clock::now() > resume_deadline_) {
+        ESP_LOGE(TAG, "No server hello for the resumed session");
+        {
+            std::lock_guard<std::mutex> lock(channel_mutex_);
+            resume_pending_ = false;
+            udp_params_.clear();
+        }
+        SetError(Lang::Strings::SERVER_TIMEOUT);
     }
-    return decoded;
+#endif
 }
 
 bool MqttProtocol::IsAudioChannelOpened() const {
-    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+    return udp_channel_.IsOpened() && !error_occurred_ && !IsTimeout();
 }
@@ -3,10 +3,9 @@
 
 
 #include "protocol.h"
+#include "udp_audio_channel.h"
 #include <mqtt.h>
-#include <udp.h>
 #include <cJSON.h>
-#include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <esp_timer.h>
@@ -17,10 +16,18 @@
 #include <mutex>
 #include <memory>
 #include <atomic>
+#include <deque>
+#include <chrono>
 
 #define MQTT_PING_INTERVAL_SECONDS 90
 #define MQTT_RECONNECT_INTERVAL_MS 60000
 
+// Messages published while the client is disconnected wait for the reconnection, the stale ones are dropped
+#define MQTT_PUBLISH_QUEUE_MAX_MESSAGES 16
+#define MQTT_PUBLISH_QUEUE_MAX_AGE_MS 10000
+// How long the udp parameters of the last server hello are reused for a new channel
+#define MQTT_RESUME_MAX_IDLE_SECONDS 300
+
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
 class MqttProtocol : public Protocol {
@@ -33,8 +40,17 @@ public:
     bool OpenAudioChannel() override;
     void CloseAudioChannel(bool send_goodbye = true) override;
     bool IsAudioChannelOpened() const override;
+    void KeepAlive() override;
+    void ResetConnection() override;
 
 private:
+    struct QueuedPublish {
+        std::string key;        // Messages with the same non-empty key replace each other
+        std::string payload;
+        int qos;
+        std::chrono::steady_clock::time_point time;
+    };
+
     // Alive flag for safe scheduled callbacks - set to false in destructor
     std::shared_ptr<std::atomic<bool>> alive_ = std::make_shared<std::atomic<bool>>(true);
     
@@ -44,20 +60,33 @@ private:
 
     std::mutex channel_mutex_;
     std::unique_ptr<Mqtt> mqtt_;
-    std::unique_ptr<Udp> udp_;
-    mbedtls_aes_context aes_ctx_;
-    std::string aes_nonce_;
-    std::string udp_server_;
-    int udp_port_;
-    uint32_t local_sequence_;
-    uint32_t remote_sequence_;
+    UdpAudioChannel udp_channel_;
     esp_timer_handle_t reconnect_timer_;
 
+    std::mutex publish_mutex_;
+    std::deque<QueuedPublish> publish_queue_;
+
+#if CONFIG_MQTT_RESUME_UDP_SESSION
+    // The udp block of the last server hello, kept with udp_channel_ configured after the channel closes
+    std::string udp_params_;
+    std::string resume_session_id_;
+    std::chrono::steady_clock::time_point resume_idle_since_;
+    // Set while a channel opened with the cached parameters waits for the server hello
+    std::atomic<bool> resume_pending_ = false;
+    std::chrono::steady_clock::time_point resume_deadline_;
+#endif
+
     bool StartMqttClient(bool report_error=false);
     void ParseServerHello(const cJSON* root);
-    std::string DecodeHexString(const std::string& hex_string);
+    // Called with channel_mutex_ held
+    bool OpenUdpChannel();
+    bool Publish(const std::string& payload);
+    void FlushPublishQueue();
+    bool PublishQueuedMessages();
 
     bool SendText(const std::string& text) override;
+    bool SendControlFrame(const std::string& frame) override;
+    bool SendAudioBatchFrame(const std::string& body, uint32_t timestamp, int count) override;
     std::string GetHelloMessage();
 };
 
@@ -0,0 +1,67 @@
+#include "network_quality.h"
+
+#include <algorithm>
+
+void NetworkQuality::RecordRtt(int rtt_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (statistics_.rtt_ms < 0) {
+        statistics_.rtt_ms = rtt_ms;
+    } else {
+        statistics_.rtt_ms = (statistics_.rtt_ms * 7 + rtt_ms) / 8;
+    }
+}
+
+void NetworkQuality::RecordDownlinkPacket(uint32_t missing) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    received_++;
+    // A restarted stream shows up as one huge gap, do not count it
+    if (missing < 1000) {
+        missing_ += missing;
+    }
+}
+
+void NetworkQuality::Update(int jitter_ms, int signal) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t total = received_ + missing_;
+    statistics_.loss_percent = total > 0 ? missing_ * 100 / total : 0;
+    // Halving once a second keeps about the last few seconds of traffic
+    received_ /= 2;
+    missing_ /= 2;
+    statistics_.jitter_ms = jitter_ms;
+    statistics_.signal = signal;
+
+    // Heuristic: each metric takes off at most its share, past the point where it starts to be heard
+    int score = 100;
+    if (statistics_.rtt_ms > 150) {
+        score -= std::min(40, (statistics_.rtt_ms - 150) / 10);
+    }
+    score -= std::min(50, statistics_.loss_percent * 4);
+    if (statistics_.jitter_ms > 40) {
+        score -= std::min(30, (statistics_.jitter_ms - 40) / 4);
+    }
+    if (statistics_.signal >= 0 && statistics_.signal < 40) {
+        score -= (40 - statistics_.signal) / 2;
+    }
+    statistics_.score = std::clamp(score, 0, 100);
+}
+
+int NetworkQuality::GetScore() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return statistics_.score;
+}
+
+NetworkQualityStatistics NetworkQuality::GetStatistics() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return statistics_;
+}
+
+cJSON* NetworkQuality::CreateJson() const {
+    auto statistics = GetStatistics();
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "score", statistics.score);
+    cJSON_AddNumberToObject(json, "rtt_ms", statistics.rtt_ms);
+    cJSON_AddNumberToObject(json, "loss_percent", statistics.loss_percent);
+    cJSON_AddNumberToObject(json, "jitter_ms", statistics.jitter_ms);
+    cJSON_AddNumberToObject(json, "signal", statistics.signal);
+    return json;
+}
@@ -0,0 +1,47 @@
+#ifndef NETWORK_QUALITY_H
+#define NETWORK_QUALITY_H
+
+#include <cJSON.h>
+#include <cstdint>
+#include <mutex>
+
+// Scores below this cap the uplink bitrate like a backed up send queue
+#define NETWORK_QUALITY_POOR_SCORE 40
+// Scores from this up count as a good link, e.g. for full resolution photo uploads
+#define NETWORK_QUALITY_GOOD_SCORE 70
+
+struct NetworkQualityStatistics {
+    int rtt_ms = -1;        // Smoothed hello round trip, -1 until measured
+    int loss_percent = 0;   // Downlink datagrams missing, recent seconds weigh most
+    int jitter_ms = 0;      // Downlink arrival jitter, from the jitter buffer
+    int signal = -1;        // Signal strength 0-100 from the board, -1 if unknown
+    int score = 100;        // 0 (unusable) to 100 (good)
+};
+
+/*
+ * Link quality as seen by the device, combined into one score for the adaptive audio features.
+ *
+ * The transports record round trips and downlink sequence gaps from their own tasks, the main
+ * task adds jitter and signal strength once a second with Update(), which recomputes the score.
+ */
+class NetworkQuality {
+public:
+    void RecordRtt(int rtt_ms);
+    // One downlink packet, missing is the number of sequence numbers skipped right before it
+    void RecordDownlinkPacket(uint32_t missing);
+    void Update(int jitter_ms, int signal);
+
+    int GetScore() const;
+    NetworkQualityStatistics GetStatistics() const;
+    // {"score", "rtt_ms", "loss_percent", "jitter_ms", "signal"}, the caller owns the object
+    cJSON* CreateJson() const;
+
+private:
+    mutable std::mutex mutex_;
+    NetworkQualityStatistics statistics_;
+    // Decaying downlink counters behind loss_percent
+    uint32_t received_ = 0;
+    uint32_t missing_ = 0;
+};
+
+#endif // NETWORK_QUALITY_H
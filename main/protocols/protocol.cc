@@ -1,13 +1,69 @@
 #include "protocol.h"
+#include "application.h"
+#include "control_frame.h"
+#include "trace.h"
 
 #include <esp_log.h>
+#include <arpa/inet.h>
 
 #define TAG "Protocol"
 
+Protocol::Protocol() {
+    auto& metrics = Metrics::GetInstance();
+    error_counter_ = metrics.AddCounter("protocol.errors");
+    fast_message_counter_ = metrics.AddCounter("protocol.fast_messages");
+    control_frame_counter_ = metrics.AddCounter("protocol.control_frames");
+    hello_rtt_ms_ = metrics.AddHistogram("protocol.hello_rtt_ms");
+}
+
 void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
     on_incoming_json_ = callback;
 }
 
+void Protocol::OnIncomingMessage(std::function<void(const ServerMessage& message)> callback) {
+    on_incoming_message_ = callback;
+}
+
+void Protocol::RecordHelloRoundTrip() {
+    if (hello_sent_time_ == std::chrono::steady_clock::time_point()) {
+        return;
+    }
+    auto rtt = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - hello_sent_time_);
+    hello_sent_time_ = std::chrono::steady_clock::time_point();
+    TRACE_END(kTracePointHello);
+    hello_rtt_ms_->Record(rtt.count());
+    Application::GetInstance().GetNetworkQuality().RecordRtt(rtt.count());
+}
+
+bool Protocol::DispatchServerMessage(std::string_view json) {
+    if (on_incoming_message_ == nullptr) {
+        return false;
+    }
+    ServerMessage message;
+    if (!ParseServerMessage(json, message)) {
+        return false;
+    }
+    if (message.type != "tts" && message.type != "stt" && message.type != "llm") {
+        return false;
+    }
+    fast_message_counter_->Add();
+    on_incoming_message_(message);
+    return true;
+}
+
+bool Protocol::DispatchControlFrame(std::string_view frame) {
+    ServerMessage message;
+    if (!ParseControlFrame(frame, message)) {
+        ESP_LOGW(TAG, "Unsupported control frame, size: %u", frame.size());
+        return false;
+    }
+    control_frame_counter_->Add();
+    if (on_incoming_message_ != nullptr) {
+        on_incoming_message_(message);
+    }
+    return true;
+}
+
 void Protocol::OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback) {
     on_incoming_audio_ = callback;
 }
@@ -34,12 +90,148 @@ void Protocol::OnDisconnected(std::function<void()> callback) {
 
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
+    error_counter_->Add();
     if (on_network_error_ != nullptr) {
         on_network_error_(message);
     }
 }
 
+// "audio_params": {"uplink": {"frame_duration": 20, "bitrate": 24000, "complexity": 3}}
+void Protocol::ParseUplinkAudioParams(const cJSON* audio_params) {
+    server_uplink_params_ = UplinkAudioParams();
+    auto uplink = cJSON_GetObjectItem(audio_params, "uplink");
+    if (!cJSON_IsObject(uplink)) {
+        return;
+    }
+    auto frame_duration = cJSON_GetObjectItem(uplink, "frame_duration");
+    if (cJSON_IsNumber(frame_duration)) {
+        server_uplink_params_.frame_duration = frame_duration->valueint;
+    }
+    auto bitrate = cJSON_GetObjectItem(uplink, "bitrate");
+    if (cJSON_IsNumber(bitrate)) {
+        server_uplink_params_.bitrate = bitrate->valueint;
+    }
+    auto complexity = cJSON_GetObjectItem(uplink, "complexity");
+    if (cJSON_IsNumber(complexity)) {
+        server_uplink_params_.complexity = complexity->valueint;
+    }
+}
+
+// "audio_params": {"downlink": {"sample_rate": 16000, "frame_duration": 60}}, the rate the device plays
+// without resampling. The server answers with the audio_params sample_rate / frame_duration it sends.
+void Protocol::AddDownlinkAudioParams(cJSON* audio_params) {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    cJSON* downlink = cJSON_CreateObject();
+    cJSON_AddNumberToObject(downlink, "sample_rate", audio_service.GetPreferredDownlinkSampleRate());
+    cJSON_AddNumberToObject(downlink, "frame_duration", OPUS_FRAME_DURATION_MS);
+    cJSON_AddItemToObject(audio_params, "downlink", downlink);
+}
+
+void Protocol::AddAudioBatchFeature(cJSON* features) {
+#if CONFIG_USE_AUDIO_BATCH_SEND
+    cJSON_AddBoolToObject(features, "audio_batch", true);
+#endif
+}
+
+// The server opts in by echoing "features": {"audio_batch": true} in its hello
+void Protocol::ParseAudioBatchFeature(const cJSON* root) {
+    audio_batch_enabled_ = false;
+#if CONFIG_USE_AUDIO_BATCH_SEND
+    auto features = cJSON_GetObjectItem(root, "features");
+    if (cJSON_IsObject(features)) {
+        audio_batch_enabled_ = cJSON_IsTrue(cJSON_GetObjectItem(features, "audio_batch"));
+    }
+#endif
+}
+
+void Protocol::AddBinaryControlFeature(cJSON* features) {
+    cJSON_AddBoolToObject(features, "binary_control", true);
+}
+
+// Same opt-in as audio batching, "features": {"binary_control": true}
+void Protocol::ParseBinaryControlFeature(const cJSON* root) {
+    binary_control_enabled_ = false;
+    auto features = cJSON_GetObjectItem(root, "features");
+    if (cJSON_IsObject(features)) {
+        binary_control_enabled_ = cJSON_IsTrue(cJSON_GetObjectItem(features, "binary_control"));
+    }
+}
+
+void Protocol::AddVideoStreamFeature(cJSON* features) {
+#if CONFIG_XIAOZHI_ENABLE_CAMERA_STREAM
+    cJSON_AddBoolToObject(features, "video_stream", true);
+#endif
+}
+
+// "features": {"video_stream": true}, the camera frames of the streaming mode are dropped otherwise
+void Protocol::ParseVideoStreamFeature(const cJSON* root) {
+    video_stream_enabled_ = false;
+#if CONFIG_XIAOZHI_ENABLE_CAMERA_STREAM
+    auto features = cJSON_GetObjectItem(root, "features");
+    if (cJSON_IsObject(features)) {
+        video_stream_enabled_ = cJSON_IsTrue(cJSON_GetObjectItem(features, "video_stream"));
+    }
+#endif
+}
+
+// The server only tags responses with a hash once the device offered "features": {"tts_cache": true}
+void Protocol::AddTtsCacheFeature(cJSON* features) {
+    if (tts_cache_enabled_) {
+        cJSON_AddBoolToObject(features, "tts_cache", true);
+    }
+}
+
+bool Protocol::SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    bool sent = true;
+    size_t i = 0;
+    while (i < packets.size() && sent) {
+        // Collect as many packets as fit into one frame
+        size_t bytes = 0;
+        size_t end = i;
+        while (end < packets.size() && end - i < AUDIO_BATCH_MAX_PACKETS &&
+               (end == i || bytes + 2 + packets[end]->opus_size() <= AUDIO_BATCH_MAX_BYTES)) {
+            bytes += 2 + packets[end]->opus_size();
+            end++;
+        }
+
+        if (!audio_batch_enabled_ || end - i == 1) {
+            sent = SendAudio(std::move(packets[i]));
+            i++;
+            continue;
+        }
+
+        batch_buffer_.clear();
+        for (size_t j = i; j < end; j++) {
+            uint16_t length = htons(packets[j]->opus_size());
+            batch_buffer_.append((const char*)&length, sizeof(length));
+            batch_buffer_.append((const char*)packets[j]->opus_data(), packets[j]->opus_size());
+        }
+        sent = SendAudioBatchFrame(batch_buffer_, packets[i]->timestamp, end - i);
+        for (size_t j = i; j < end; j++) {
+            audio_service.ReleasePacket(std::move(packets[j]));
+        }
+        i = end;
+    }
+
+    // Whatever was not sent is dropped, same as a failed SendAudio()
+    for (; i < packets.size(); i++) {
+        audio_service.ReleasePacket(std::move(packets[i]));
+    }
+    packets.clear();
+    return sent;
+}
+
 void Protocol::SendAbortSpeaking(AbortReason reason) {
+    if (binary_control_enabled_) {
+        std::string frame;
+        BuildControlFrame(frame, kControlEventAbort);
+        if (reason == kAbortReasonWakeWordDetected) {
+            AppendControlField(frame, kControlTagReason, (uint8_t)reason);
+        }
+        SendControlFrame(frame);
+        return;
+    }
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
     if (reason == kAbortReasonWakeWordDetected) {
         message += ",\"reason\":\"wake_word_detected\"";
@@ -49,12 +241,26 @@ void Protocol::SendAbortSpeaking(AbortReason reason) {
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
+    if (binary_control_enabled_) {
+        std::string frame;
+        BuildControlFrame(frame, kControlEventListenDetect);
+        AppendControlField(frame, kControlTagText, wake_word);
+        SendControlFrame(frame);
+        return;
+    }
     std::string json = "{\"session_id\":\"" + session_id_ + 
                       "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
     SendText(json);
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
+    if (binary_control_enabled_) {
+        std::string frame;
+        BuildControlFrame(frame, kControlEventListenStart);
+        AppendControlField(frame, kControlTagMode, (uint8_t)mode);
+        SendControlFrame(frame);
+        return;
+    }
     std::string message = "{\"session_id\":\"" + session_id_ + "\"";
     message += ",\"type\":\"listen\",\"state\":\"start\"";
     if (mode == kListeningModeRealtime) {
@@ -69,15 +275,52 @@ void Protocol::SendStartListening(ListeningMode mode) {
 }
 
 void Protocol::SendStopListening() {
+    if (binary_control_enabled_) {
+        std::string frame;
+        BuildControlFrame(frame, kControlEventListenStop);
+        SendControlFrame(frame);
+        return;
+    }
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
     SendText(message);
 }
 
+// The hash has been checked by TtsCache, it needs no escaping
+void Protocol::SendTtsCached(const std::string& hash) {
+    if (binary_control_enabled_) {
+        std::string frame;
+        BuildControlFrame(frame, kControlEventTtsCached);
+        AppendControlField(frame, kControlTagHash, hash);
+        SendControlFrame(frame);
+        return;
+    }
+    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"tts\",\"state\":\"cached\",\"hash\":\"" + hash + "\"}";
+    SendText(message);
+}
+
 void Protocol::SendMcpMessage(const std::string& payload) {
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
     SendText(message);
 }
 
+void Protocol::SendMcpMessage(const TextPartsWriter& payload_writer) {
+    std::string head = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":";
+    SendTextParts([&head, &payload_writer](const TextPartsSink& sink) {
+        return sink(head.data(), head.size()) && payload_writer(sink) && sink("}", 1);
+    });
+}
+
+bool Protocol::SendTextParts(const TextPartsWriter& writer) {
+    std::string text;
+    if (!writer([&text](const char* data, size_t len) {
+        text.append(data, len);
+        return true;
+    })) {
+        return false;
+    }
+    return SendText(text);
+}
+
 bool Protocol::IsTimeout() const {
     const int kTimeoutSeconds = 120;
     auto now = std::chrono::steady_clock::now();
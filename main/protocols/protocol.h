@@ -6,12 +6,47 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <string_view>
+
+#include "server_message.h"
+#include "metrics.h"
+#include "heap_placement.h"
+
+// Bytes the encoder reserves in front of the Opus data, enough for the largest transport header
+#define AUDIO_PACKET_HEADROOM 16
+
+// Batched uplink frames: |count packets of (length 2u, big endian)|opus length|
+#define AUDIO_BATCH_MAX_PACKETS 8
+#define AUDIO_BATCH_MAX_BYTES 1200
+// Binary frame / datagram type of a batch, single packets keep type 0 (websocket) / 1 (udp)
+#define AUDIO_BATCH_FRAME_TYPE 2
+// BinaryProtocol3 frame type of the protocol version 4 control frames, see control_frame.h
+#define CONTROL_FRAME_TYPE 3
+// Binary frame type of a camera JPEG frame, BinaryProtocol3 can only carry frames below 64 KB
+#define VIDEO_FRAME_TYPE 4
 
 struct AudioStreamPacket {
     int sample_rate = 0;
-    int frame_duration = 0;
+    int frame_duration = 0;     // Of the stream, the decoder sizes each packet from its TOC byte
     uint32_t timestamp = 0;
-    std::vector<uint8_t> payload;
+    uint32_t sequence = 0;  // Transport sequence number, 0 if the transport has none
+    int lost_frames = 0;    // Frames missing right before this one, set by transports with sequence numbers
+    size_t headroom = 0;    // Leading bytes of payload that are not Opus data
+    int64_t queued_time_us = 0;  // Local time it entered its current queue, for the latency stats
+    uint32_t cue = 0;       // AudioService playback cue that waits for this packet to play
+    // Pooled, so PSRAM keeps the capacity of every packet in flight out of internal RAM
+    PsramVector<uint8_t, kHeapSubsystemAudio> payload;
+
+    uint8_t* opus_data() { return payload.data() + headroom; }
+    const uint8_t* opus_data() const { return payload.data() + headroom; }
+    size_t opus_size() const { return payload.size() - headroom; }
+};
+
+// Uplink encoder settings requested by the server hello, zero / negative means not requested
+struct UplinkAudioParams {
+    int frame_duration = 0;
+    int bitrate = 0;
+    int complexity = -1;
 };
 
 struct BinaryProtocol2 {
@@ -30,6 +65,9 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+static_assert(sizeof(BinaryProtocol2) <= AUDIO_PACKET_HEADROOM, "Headroom too small for BinaryProtocol2");
+static_assert(sizeof(BinaryProtocol3) <= AUDIO_PACKET_HEADROOM, "Headroom too small for BinaryProtocol3");
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -41,8 +79,13 @@ enum ListeningMode {
     kListeningModeRealtime // 需要 AEC 支持
 };
 
+// Writes a text message part by part through the sink, stopping when the sink returns false
+using TextPartsSink = std::function<bool(const char* data, size_t len)>;
+using TextPartsWriter = std::function<bool(const TextPartsSink& sink)>;
+
 class Protocol {
 public:
+    Protocol();
     virtual ~Protocol() = default;
 
     inline int server_sample_rate() const {
@@ -51,12 +94,26 @@ public:
     inline int server_frame_duration() const {
         return server_frame_duration_;
     }
+    inline const UplinkAudioParams& server_uplink_params() const {
+        return server_uplink_params_;
+    }
+    inline bool audio_batch_enabled() const {
+        return audio_batch_enabled_;
+    }
+    inline bool binary_control_enabled() const {
+        return binary_control_enabled_;
+    }
+    inline bool video_stream_enabled() const {
+        return video_stream_enabled_;
+    }
     inline const std::string& session_id() const {
         return session_id_;
     }
 
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
     void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    // tts / stt / llm messages read without cJSON, the ones it cannot handle still go to OnIncomingJson
+    void OnIncomingMessage(std::function<void(const ServerMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
@@ -67,15 +124,30 @@ public:
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel(bool send_goodbye = true) = 0;
     virtual bool IsAudioChannelOpened() const = 0;
+    // Called by the main task once a second
+    virtual void KeepAlive() {}
+    // Drops the connections made over the previous network interface after the board switched to another one
+    virtual void ResetConnection() {}
     virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // Packs the packets into as few frames as AUDIO_BATCH_MAX_BYTES allows, if the server accepted batching
+    bool SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets);
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
     virtual void SendMcpMessage(const std::string& message);
+    // The response tagged with hash plays from the TTS cache, the server may stop sending its audio
+    void SendTtsCached(const std::string& hash);
+    // Offers "tts_cache" in the next hello, set before Start()
+    void EnableTtsCache(bool enable) { tts_cache_enabled_ = enable; }
+    // Same as above, the payload is produced in parts so that it never has to be held as a whole
+    void SendMcpMessage(const TextPartsWriter& payload_writer);
+    // Only called once the server accepted the video stream
+    virtual bool SendVideoFrame(const uint8_t* jpeg, size_t size, uint32_t timestamp) { return false; }
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<void(const ServerMessage& message)> on_incoming_message_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
@@ -85,13 +157,46 @@ protected:
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    UplinkAudioParams server_uplink_params_;
+    bool audio_batch_enabled_ = false;
+    bool binary_control_enabled_ = false;
+    bool video_stream_enabled_ = false;
+    bool tts_cache_enabled_ = false;
+    std::string batch_buffer_;
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    // Set when the client hello goes out, the server hello turns it into a round trip sample
+    std::chrono::time_point<std::chrono::steady_clock> hello_sent_time_;
+    // Shared by all transports
+    MetricCounter* error_counter_;
+    MetricCounter* fast_message_counter_;
+    MetricCounter* control_frame_counter_;
+    MetricHistogram* hello_rtt_ms_;
 
     virtual bool SendText(const std::string& text) = 0;
+    // Gathers the parts into one SendText by default, transports that can fragment a message override it
+    virtual bool SendTextParts(const TextPartsWriter& writer);
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    void ParseUplinkAudioParams(const cJSON* audio_params);
+    void AddDownlinkAudioParams(cJSON* audio_params);
+    void RecordHelloRoundTrip();
+    // Hands a frequent message to on_incoming_message_, false if it needs the full cJSON parser
+    bool DispatchServerMessage(std::string_view json);
+    void AddAudioBatchFeature(cJSON* features);
+    void ParseAudioBatchFeature(const cJSON* root);
+    void AddBinaryControlFeature(cJSON* features);
+    void ParseBinaryControlFeature(const cJSON* root);
+    void AddVideoStreamFeature(cJSON* features);
+    void ParseVideoStreamFeature(const cJSON* root);
+    void AddTtsCacheFeature(cJSON* features);
+    // Hands a received control frame to on_incoming_message_, false if it is malformed or unknown
+    bool DispatchControlFrame(std::string_view frame);
+    // Only called once the server accepted binary control, so transports that never offer it keep this
+    virtual bool SendControlFrame(const std::string& frame) { return false; }
+    // Sends one batch body of count packets, the first packet has the given timestamp
+    virtual bool SendAudioBatchFrame(const std::string& body, uint32_t timestamp, int count) = 0;
 };
 
 #endif // PROTOCOL_H
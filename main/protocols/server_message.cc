@@ -0,0 +1,244 @@
+#include "server_message.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace {
+
+bool ReadHex4(std::string_view raw, size_t pos, uint32_t& value) {
+    if (pos + 4 > raw.size()) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = pos; i < pos + 4; i++) {
+        char c = raw[i];
+        int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+void AppendUtf8(uint32_t code, std::string& out) {
+    if (code < 0x80) {
+        out.push_back((char)code);
+    } else if (code < 0x800) {
+        out.push_back((char)(0xC0 | (code >> 6)));
+        out.push_back((char)(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+        out.push_back((char)(0xE0 | (code >> 12)));
+        out.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (code & 0x3F)));
+    } else {
+        out.push_back((char)(0xF0 | (code >> 18)));
+        out.push_back((char)(0x80 | ((code >> 12) & 0x3F)));
+        out.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (code & 0x3F)));
+    }
+}
+
+class JsonScanner {
+public:
+    explicit JsonScanner(std::string_view json) : json_(json) {}
+
+    bool Consume(char c) {
+        SkipSpace();
+        if (pos_ < json_.size() && json_[pos_] == c) {
+            pos_++;
+            return true;
+        }
+        return false;
+    }
+
+    bool AtEnd() {
+        SkipSpace();
+        return pos_ == json_.size();
+    }
+
+    // value is the raw text between the quotes, escaped tells whether it still contains escape sequences
+    bool ReadString(std::string_view& value, bool& escaped) {
+        escaped = false;
+        if (!Consume('"')) {
+            return false;
+        }
+        size_t start = pos_;
+        while (pos_ < json_.size()) {
+            char c = json_[pos_];
+            if (c == '"') {
+                value = json_.substr(start, pos_ - start);
+                pos_++;
+                return true;
+            }
+            if (c == '\\') {
+                escaped = true;
+                pos_++;
+            }
+            pos_++;
+        }
+        return false;
+    }
+
+    // Skips one value of any type, nested objects and arrays included
+    bool SkipValue() {
+        SkipSpace();
+        if (pos_ >= json_.size()) {
+            return false;
+        }
+        std::string_view value;
+        bool escaped;
+        char c = json_[pos_];
+        if (c == '"') {
+            return ReadString(value, escaped);
+        }
+        if (c == '{' || c == '[') {
+            int depth = 0;
+            while (pos_ < json_.size()) {
+                c = json_[pos_];
+                if (c == '"') {
+                    if (!ReadString(value, escaped)) {
+                        return false;
+                    }
+                    continue;
+                }
+                if (c == '{' || c == '[') {
+                    depth++;
+                } else if ((c == '}' || c == ']') && --depth == 0) {
+                    pos_++;
+                    return true;
+                }
+                pos_++;
+            }
+            return false;
+        }
+        // Number, true, false or null
+        size_t start = pos_;
+        while (pos_ < json_.size() && json_[pos_] != ',' && json_[pos_] != '}' && json_[pos_] != ']' && !IsSpace(json_[pos_])) {
+            pos_++;
+        }
+        return pos_ > start;
+    }
+
+private:
+    std::string_view json_;
+    size_t pos_ = 0;
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    void SkipSpace() {
+        while (pos_ < json_.size() && IsSpace(json_[pos_])) {
+            pos_++;
+        }
+    }
+};
+
+// Appends the decoded raw string to out, which has room for it: no escape decodes to more bytes than it takes
+bool Unescape(std::string_view raw, std::string& out) {
+    for (size_t i = 0; i < raw.size(); i++) {
+        char c = raw[i];
+        if (c != '\\') {
+            out.push_back(c);
+            continue;
+        }
+        if (++i >= raw.size()) {
+            return false;
+        }
+        switch (raw[i]) {
+            case '"': out.push_back('"'); break;
+            case '\\': out.push_back('\\'); break;
+            case '/': out.push_back('/'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                uint32_t code;
+                if (!ReadHex4(raw, i + 1, code)) {
+                    return false;
+                }
+                i += 4;
+                // A surrogate pair, for the characters outside the basic plane such as emoji
+                if (code >= 0xD800 && code <= 0xDBFF) {
+                    uint32_t low;
+                    if (i + 2 >= raw.size() || raw[i + 1] != '\\' || raw[i + 2] != 'u' ||
+                        !ReadHex4(raw, i + 3, low) || low < 0xDC00 || low > 0xDFFF) {
+                        return false;
+                    }
+                    i += 6;
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                } else if (code >= 0xDC00 && code <= 0xDFFF) {
+                    return false;
+                }
+                AppendUtf8(code, out);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+bool ParseServerMessage(std::string_view json, ServerMessage& message) {
+    message = ServerMessage();
+    JsonScanner scanner(json);
+    if (!scanner.Consume('{')) {
+        return false;
+    }
+    if (scanner.Consume('}')) {
+        return scanner.AtEnd();
+    }
+
+    do {
+        std::string_view key;
+        bool escaped;
+        if (!scanner.ReadString(key, escaped) || escaped || !scanner.Consume(':')) {
+            return false;
+        }
+
+        std::string_view* field = nullptr;
+        if (key == "type") {
+            field = &message.type;
+        } else if (key == "state") {
+            field = &message.state;
+        } else if (key == "text") {
+            field = &message.text;
+        } else if (key == "emotion") {
+            field = &message.emotion;
+        } else if (key == "hash") {
+            field = &message.hash;
+        }
+
+        if (field == nullptr) {
+            if (!scanner.SkipValue()) {
+                return false;
+            }
+        } else if (!scanner.ReadString(*field, escaped)) {
+            return false;
+        } else if (escaped) {
+            // The whole message is an upper bound for all decoded fields, so earlier views stay valid
+            if (message.unescaped.empty()) {
+                message.unescaped.reserve(json.size());
+            }
+            size_t start = message.unescaped.size();
+            if (!Unescape(*field, message.unescaped)) {
+                return false;
+            }
+            *field = std::string_view(message.unescaped).substr(start);
+        }
+    } while (scanner.Consume(','));
+
+    return scanner.Consume('}') && scanner.AtEnd();
+}
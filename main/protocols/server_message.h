@@ -0,0 +1,32 @@
+#ifndef SERVER_MESSAGE_H
+#define SERVER_MESSAGE_H
+
+#include <string>
+#include <string_view>
+
+// The fields Application reads from the frequent tts / stt / llm messages, missing ones have a null data()
+struct ServerMessage {
+    std::string_view type;
+    std::string_view state;
+    std::string_view text;
+    std::string_view emotion;
+    // Set on a tts start the server allows the device to cache, see TtsCache
+    std::string_view hash;
+    // Decoded copies of the fields that held escape sequences, the views above point into it.
+    // Reserved once for the whole message so it never reallocates, a message using it is not to be copied.
+    std::string unescaped;
+};
+
+/*
+ * Extracts the top-level type, state, text, emotion and hash strings of a JSON object without building
+ * a cJSON tree. Plain strings are views into json, the ones with escape sequences (quotes, newlines,
+ * \uXXXX escapes of servers that send ASCII only) are decoded into message.unescaped, which is the only
+ * allocation and only made for them.
+ *
+ * Returns false for anything the caller should hand to cJSON instead: malformed input, an invalid
+ * escape, or one of the wanted fields holding something else than a string. Other fields may hold
+ * any JSON value.
+ */
+bool ParseServerMessage(std::string_view json, ServerMessage& message);
+
+#endif // SERVER_MESSAGE_H
@@ -0,0 +1,169 @@
+#include "udp_audio_channel.h"
+#include "board.h"
+#include "application.h"
+#include "deferred_log.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <arpa/inet.h>
+
+#define TAG "UdpAudio"
+
+// 辅助函数，将单个十六进制字符转换为对应的数值
+static inline uint8_t CharToHex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 0;  // 对于无效输入，返回0
+}
+
+static std::string DecodeHexString(const std::string& hex_string) {
+    std::string decoded;
+    decoded.reserve(hex_string.size() / 2);
+    for (size_t i = 0; i + 1 < hex_string.size(); i += 2) {
+        char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
+        decoded.push_back(byte);
+    }
+    return decoded;
+}
+
+UdpAudioChannel::UdpAudioChannel() {
+    mbedtls_aes_init(&aes_ctx_);
+}
+
+UdpAudioChannel::~UdpAudioChannel() {
+    // Stop receiving before the key goes away
+    udp_.reset();
+    mbedtls_aes_free(&aes_ctx_);
+}
+
+bool UdpAudioChannel::Configure(const cJSON* udp) {
+    auto server = cJSON_GetObjectItem(udp, "server");
+    auto port = cJSON_GetObjectItem(udp, "port");
+    auto key = cJSON_GetObjectItem(udp, "key");
+    auto nonce = cJSON_GetObjectItem(udp, "nonce");
+    if (!cJSON_IsString(server) || !cJSON_IsNumber(port) || !cJSON_IsString(key) || !cJSON_IsString(nonce)) {
+        ESP_LOGE(TAG, "Invalid udp block in server hello");
+        return false;
+    }
+
+    // The nonce is the packet header template, it must be a full AES block
+    auto decoded_nonce = DecodeHexString(nonce->valuestring);
+    auto decoded_key = DecodeHexString(key->valuestring);
+    if (decoded_nonce.size() != 16 || decoded_key.size() != 16) {
+        ESP_LOGE(TAG, "Invalid udp key / nonce size: %u / %u", decoded_key.size(), decoded_nonce.size());
+        return false;
+    }
+
+    server_ = server->valuestring;
+    port_ = port->valueint;
+    aes_nonce_ = decoded_nonce;
+    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)decoded_key.data(), 128);
+    local_sequence_ = 0;
+    remote_sequence_ = 0;
+    return true;
+}
+
+bool UdpAudioChannel::Open(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_audio) {
+    auto network = Board::GetInstance().GetNetwork();
+    udp_ = network->CreateUdp(2);
+    if (udp_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create udp");
+        return false;
+    }
+
+    udp_->OnMessage([this, on_audio](const std::string& data) {
+        if (data.size() < aes_nonce_.size()) {
+            DLOGE(TAG, "Invalid audio packet size: %u", data.size());
+            return;
+        }
+        if (data[0] != 0x01) {
+            DLOGE(TAG, "Invalid audio packet type: %x", data[0]);
+            return;
+        }
+        uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
+        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
+        // Late and missing packets are handled by the jitter buffer, which reorders by sequence
+        if (sequence != remote_sequence_ + 1) {
+            ESP_LOGD(TAG, "Received audio packet with sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+        }
+
+        size_t decrypted_size = data.size() - aes_nonce_.size();
+        size_t nc_off = 0;
+        uint8_t stream_block[16] = {0};
+        // Decrypt straight into the pooled packet, the counter block is advanced on a stack copy
+        uint8_t nonce[16];
+        memcpy(nonce, data.data(), sizeof(nonce));
+        auto encrypted = (const uint8_t*)data.data() + aes_nonce_.size();
+        auto& audio_service = Application::GetInstance().GetAudioService();
+        auto packet = audio_service.AcquirePacket();
+        packet->timestamp = timestamp;
+        packet->sequence = sequence;
+        packet->payload.resize(decrypted_size);
+        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
+        if (ret != 0) {
+            DLOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+            audio_service.ReleasePacket(std::move(packet));
+            return;
+        }
+        uint32_t missing = (int32_t)(sequence - remote_sequence_) > 1 ? sequence - remote_sequence_ - 1 : 0;
+        Application::GetInstance().GetNetworkQuality().RecordDownlinkPacket(missing);
+        if ((int32_t)(sequence - remote_sequence_) > 0) {
+            remote_sequence_ = sequence;
+        }
+        on_audio(std::move(packet));
+    });
+
+    if (!udp_->Connect(server_, port_)) {
+        ESP_LOGE(TAG, "Failed to connect to udp server %s:%d, code=%d", server_.c_str(), port_, udp_->GetLastError());
+        udp_.reset();
+        return false;
+    }
+    return true;
+}
+
+void UdpAudioChannel::Close() {
+    udp_.reset();
+}
+
+bool UdpAudioChannel::SendAudio(const uint8_t* data, size_t size, uint32_t timestamp) {
+    if (udp_ == nullptr) {
+        return false;
+    }
+    return SendEncrypted(aes_nonce_[0], data, size, timestamp, ++local_sequence_);
+}
+
+bool UdpAudioChannel::SendAudioBatch(const std::string& body, uint32_t timestamp, int count) {
+    if (udp_ == nullptr) {
+        return false;
+    }
+
+    // Same layout as a single packet, the sequence is the one of the first packet in the batch
+    uint32_t sequence = local_sequence_ + 1;
+    local_sequence_ += count;
+    return SendEncrypted(AUDIO_BATCH_FRAME_TYPE, (const uint8_t*)body.data(), body.size(), timestamp, sequence);
+}
+
+// Builds |nonce|encrypted payload| straight into send_buffer_
+bool UdpAudioChannel::SendEncrypted(uint8_t type, const uint8_t* data, size_t size, uint32_t timestamp, uint32_t sequence) {
+    // The buffer keeps its capacity across packets, so this does not allocate once warmed up
+    send_buffer_.resize(aes_nonce_.size() + size);
+    auto nonce = (uint8_t*)send_buffer_.data();
+    memcpy(nonce, aes_nonce_.data(), aes_nonce_.size());
+    nonce[0] = type;
+    *(uint16_t*)&nonce[2] = htons(size);
+    *(uint32_t*)&nonce[8] = htonl(timestamp);
+    *(uint32_t*)&nonce[12] = htonl(sequence);
+
+    // CTR mode advances the counter block, so work on a copy and keep the header intact
+    uint8_t nonce_counter[16];
+    memcpy(nonce_counter, nonce, sizeof(nonce_counter));
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, size, &nc_off, nonce_counter, stream_block,
+        data, nonce + aes_nonce_.size()) != 0) {
+        DLOGE(TAG, "Failed to encrypt audio data");
+        return false;
+    }
+    return udp_->Send(send_buffer_) > 0;
+}
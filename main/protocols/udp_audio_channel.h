@@ -0,0 +1,54 @@
+#ifndef UDP_AUDIO_CHANNEL_H
+#define UDP_AUDIO_CHANNEL_H
+
+#include "protocol.h"
+
+#include <udp.h>
+#include <cJSON.h>
+#include <mbedtls/aes.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+/*
+ * Encrypted Opus datagrams, used by the MQTT protocol and optionally by the websocket protocol.
+ *
+ * UDP Encrypted OPUS Packet Format:
+ * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
+ * |payload payload_len|
+ *
+ * The header doubles as the AES-CTR nonce, the payload is encrypted with the key from the server hello.
+ * The owner serializes Configure, Open, Close and the sends. Received audio is handed over on the
+ * UDP receive task.
+ */
+class UdpAudioChannel {
+public:
+    UdpAudioChannel();
+    ~UdpAudioChannel();
+
+    // Takes server, port, key and nonce from the udp block of a server hello and restarts the sequences
+    bool Configure(const cJSON* udp);
+    bool Open(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_audio);
+    void Close();
+    bool IsOpened() const { return udp_ != nullptr; }
+    const std::string& server() const { return server_; }
+
+    bool SendAudio(const uint8_t* data, size_t size, uint32_t timestamp);
+    // Sends one batch body of count packets, the first packet has the given timestamp
+    bool SendAudioBatch(const std::string& body, uint32_t timestamp, int count);
+
+private:
+    std::unique_ptr<Udp> udp_;
+    mbedtls_aes_context aes_ctx_;
+    std::string aes_nonce_;
+    std::string send_buffer_;
+    std::string server_;
+    int port_ = 0;
+    uint32_t local_sequence_ = 0;
+    uint32_t remote_sequence_ = 0;
+
+    bool SendEncrypted(uint8_t type, const uint8_t* data, size_t size, uint32_t timestamp, uint32_t sequence);
+};
+
+#endif // UDP_AUDIO_CHANNEL_H
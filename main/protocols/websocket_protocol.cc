@@ -3,7 +3,10 @@
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
+#include "trace.h"
+#include "task_factory.h"
 
+#include <algorithm>
 #include <cstring>
 #include <cJSON.h>
 #include <esp_log.h>
@@ -12,49 +15,272 @@
 
 #define TAG "WS"
 
+// Fragment size of long text messages, such as MCP results that carry an image
+#define WEBSOCKET_TEXT_FRAGMENT_SIZE ((size_t)4096)
+// How long the network task waits for the control task to make room for a message
+#define WEBSOCKET_RECEIVE_WAIT_MS 1000
+
 WebsocketProtocol::WebsocketProtocol() {
     event_group_handle_ = xEventGroupCreate();
+    if (!control_messages_.Initialize(CONFIG_WEBSOCKET_RECEIVE_BUFFER_KB * 1024)) {
+        ESP_LOGE(TAG, "Failed to allocate the receive buffer");
+    }
+
+    TaskFactory::Create("ws_control", kTaskStackInternal, [this]() {
+        ControlTask();
+    });
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    // Stop receiving first, the receive callback feeds the control task
+    ResetWebsocket(nullptr);
+    {
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        control_task_stopping_ = true;
+        control_cv_.notify_one();
+        control_space_cv_.notify_all();
+    }
+    xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_CONTROL_TASK_EXITED_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
     vEventGroupDelete(event_group_handle_);
 }
 
+void WebsocketProtocol::ControlTask() {
+    std::string_view message;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(control_mutex_);
+            control_cv_.wait(lock, [this]() {
+                return control_task_stopping_ || !control_messages_.empty();
+            });
+            if (control_task_stopping_) {
+                break;
+            }
+            // Stays in the ring until it has been handled
+            control_messages_.Front(message);
+        }
+        // JSON never starts with a control character, so control frames share the queue and keep their order
+        if (!message.empty() && message[0] == CONTROL_FRAME_TYPE) {
+            if (channel_opened_) {
+                DispatchControlFrame(message);
+            }
+        } else {
+            ParseTextMessage(message);
+        }
+        {
+            std::lock_guard<std::mutex> lock(control_mutex_);
+            control_messages_.Pop();
+        }
+        control_space_cv_.notify_one();
+    }
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_CONTROL_TASK_EXITED_EVENT);
+}
+
+// Called on the network task, waits a while for room when the control task is behind
+void WebsocketProtocol::QueueControlMessage(const char* data, size_t len) {
+    if (len > CONFIG_WEBSOCKET_MAX_MESSAGE_KB * 1024) {
+        ESP_LOGE(TAG, "Dropping a %u byte message, larger than %d KB", len, CONFIG_WEBSOCKET_MAX_MESSAGE_KB);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(control_mutex_);
+    bool queued = control_space_cv_.wait_for(lock, std::chrono::milliseconds(WEBSOCKET_RECEIVE_WAIT_MS), [&]() {
+        return control_task_stopping_ || control_messages_.Push(data, len);
+    });
+    if (!queued || control_task_stopping_) {
+        ESP_LOGE(TAG, "Dropping a %u byte message, the receive buffer is full", len);
+        return;
+    }
+    control_cv_.notify_one();
+}
+
+void WebsocketProtocol::ParseTextMessage(std::string_view message) {
+    // Closed channels fall through to cJSON, which drops what the keep-warm mode does not want
+    if (channel_opened_ && DispatchServerMessage(message)) {
+        return;
+    }
+
+    auto root = cJSON_ParseWithLength(message.data(), message.size());
+    auto type = cJSON_GetObjectItem(root, "type");
+    if (cJSON_IsString(type)) {
+        if (strcmp(type->valuestring, "hello") == 0) {
+            ParseServerHello(root);
+#if CONFIG_WEBSOCKET_KEEP_WARM
+        } else if (!channel_opened_ && strcmp(type->valuestring, "mcp") != 0) {
+            // Leftovers of a closed turn, MCP calls are still served
+            ESP_LOGW(TAG, "Dropping %s message while the channel is closed", type->valuestring);
+#endif
+        } else if (on_incoming_json_ != nullptr) {
+            on_incoming_json_(root);
+        }
+    } else {
+        ESP_LOGE(TAG, "Missing message type, data: %.*s", (int)message.size(), message.data());
+    }
+    cJSON_Delete(root);
+}
+
 bool WebsocketProtocol::Start() {
     // Only connect to server when audio channel is needed
     return true;
 }
 
 bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    std::lock_guard<std::mutex> channel_lock(channel_mutex_);
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        Application::GetInstance().GetAudioService().ReleasePacket(std::move(packet));
         return false;
     }
 
+#if CONFIG_WEBSOCKET_PIPELINED_HELLO
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    if (hello_pending_) {
+        // Hold back at most one send queue, the oldest audio goes first
+        if (pending_packets_ >= MAX_SEND_PACKETS_IN_QUEUE) {
+            for (auto it = pending_frames_.begin(); it != pending_frames_.end(); ++it) {
+                if (it->packet != nullptr) {
+                    Application::GetInstance().GetAudioService().ReleasePacket(std::move(it->packet));
+                    pending_frames_.erase(it);
+                    pending_packets_--;
+                    break;
+                }
+            }
+        }
+        pending_frames_.push_back({std::move(packet), std::string()});
+        pending_packets_++;
+        return true;
+    }
+#endif
+    return WriteAudio(std::move(packet));
+}
+
+bool WebsocketProtocol::WriteAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    bool sent;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    if (udp_uplink_) {
+        if (udp_channel_.SendAudio(packet->opus_data(), packet->opus_size(), packet->timestamp)) {
+            audio_service.ReleasePacket(std::move(packet));
+            return true;
+        }
+        ESP_LOGW(TAG, "Failed to send audio over UDP, falling back to the websocket");
+        udp_uplink_ = false;
+    }
+#endif
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        auto bp2 = (BinaryProtocol2*)PrependHeader(*packet, sizeof(BinaryProtocol2));
         bp2->version = htons(version_);
         bp2->type = 0;
         bp2->reserved = 0;
         bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
-    } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
+        bp2->payload_size = htonl(packet->opus_size());
+        sent = websocket_->Send(bp2, sizeof(BinaryProtocol2) + packet->opus_size(), true);
+    } else if (version_ >= 3) {
+        auto bp3 = (BinaryProtocol3*)PrependHeader(*packet, sizeof(BinaryProtocol3));
         bp3->type = 0;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
+        bp3->payload_size = htons(packet->opus_size());
+        sent = websocket_->Send(bp3, sizeof(BinaryProtocol3) + packet->opus_size(), true);
+    } else {
+        sent = websocket_->Send(packet->opus_data(), packet->opus_size(), true);
+    }
+    audio_service.ReleasePacket(std::move(packet));
+    return sent;
+}
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+bool WebsocketProtocol::SendAudioBatchFrame(const std::string& body, uint32_t timestamp, int count) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    if (udp_uplink_) {
+        if (udp_channel_.SendAudioBatch(body, timestamp, count)) {
+            return true;
+        }
+        ESP_LOGW(TAG, "Failed to send audio over UDP, falling back to the websocket");
+        udp_uplink_ = false;
+    }
+#endif
+
+    if (version_ == 2) {
+        send_buffer_.resize(sizeof(BinaryProtocol2) + body.size());
+        auto bp2 = (BinaryProtocol2*)send_buffer_.data();
+        bp2->version = htons(version_);
+        bp2->type = htons(AUDIO_BATCH_FRAME_TYPE);
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(timestamp);
+        bp2->payload_size = htonl(body.size());
+        memcpy(bp2->payload, body.data(), body.size());
+    } else if (version_ >= 3) {
+        send_buffer_.resize(sizeof(BinaryProtocol3) + body.size());
+        auto bp3 = (BinaryProtocol3*)send_buffer_.data();
+        bp3->type = AUDIO_BATCH_FRAME_TYPE;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(body.size());
+        memcpy(bp3->payload, body.data(), body.size());
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        // Version 1 frames have no header to mark a batch
+        ESP_LOGE(TAG, "Audio batch is not supported by protocol version %d", version_);
+        return false;
     }
+    return websocket_->Send(send_buffer_.data(), send_buffer_.size(), true);
+}
+
+bool WebsocketProtocol::SendVideoFrame(const uint8_t* jpeg, size_t size, uint32_t timestamp) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+
+    if (version_ == 2) {
+        send_buffer_.resize(sizeof(BinaryProtocol2) + size);
+        auto bp2 = (BinaryProtocol2*)send_buffer_.data();
+        bp2->version = htons(version_);
+        bp2->type = htons(VIDEO_FRAME_TYPE);
+        bp2->reserved = 0;
+        bp2->timestamp = htonl(timestamp);
+        bp2->payload_size = htonl(size);
+        memcpy(bp2->payload, jpeg, size);
+    } else if (size <= UINT16_MAX) {
+        send_buffer_.resize(sizeof(BinaryProtocol3) + size);
+        auto bp3 = (BinaryProtocol3*)send_buffer_.data();
+        bp3->type = VIDEO_FRAME_TYPE;
+        bp3->reserved = 0;
+        bp3->payload_size = htons(size);
+        memcpy(bp3->payload, jpeg, size);
+    } else {
+        ESP_LOGW(TAG, "Video frame of %u bytes is too large for protocol version %d", size, version_);
+        return false;
+    }
+    return websocket_->Send(send_buffer_.data(), send_buffer_.size(), true);
+}
+
+// Returns where to write a header of header_size bytes right in front of the Opus data.
+// Encoded packets carry headroom for it, anything else is copied once into send_buffer_.
+uint8_t* WebsocketProtocol::PrependHeader(AudioStreamPacket& packet, size_t header_size) {
+    if (packet.headroom >= header_size) {
+        return packet.opus_data() - header_size;
+    }
+    send_buffer_.resize(header_size + packet.opus_size());
+    memcpy(&send_buffer_[header_size], packet.opus_data(), packet.opus_size());
+    return (uint8_t*)send_buffer_.data();
+}
+
+bool WebsocketProtocol::SendControlFrame(const std::string& frame) {
+    bool sent;
+    {
+        // Binary frames share the socket with the audio sender task
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        if (websocket_ == nullptr || !websocket_->IsConnected()) {
+            return false;
+        }
+        sent = websocket_->Send(frame.data(), frame.size(), true);
+    }
+    if (!sent) {
+        ESP_LOGE(TAG, "Failed to send control frame, event: %u", (uint8_t)frame[sizeof(BinaryProtocol3)]);
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
 }
 
 bool WebsocketProtocol::SendText(const std::string& text) {
@@ -62,6 +288,61 @@ bool WebsocketProtocol::SendText(const std::string& text) {
         return false;
     }
 
+#if CONFIG_WEBSOCKET_PIPELINED_HELLO
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    if (hello_pending_) {
+        pending_frames_.push_back({nullptr, text});
+        return true;
+    }
+#endif
+    return WriteText(text);
+}
+
+// Sends the message as a fragmented text frame, so that only one fragment is held at a time
+bool WebsocketProtocol::SendTextParts(const TextPartsWriter& writer) {
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+
+#if CONFIG_WEBSOCKET_PIPELINED_HELLO
+    bool hello_pending;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        hello_pending = hello_pending_;
+    }
+    if (hello_pending) {
+        // Queued frames are whole messages
+        return Protocol::SendTextParts(writer);
+    }
+#endif
+
+    std::string fragment;
+    fragment.reserve(WEBSOCKET_TEXT_FRAGMENT_SIZE);
+    bool ok = writer([this, &fragment](const char* data, size_t len) {
+        while (len > 0) {
+            size_t n = std::min(len, WEBSOCKET_TEXT_FRAGMENT_SIZE - fragment.size());
+            fragment.append(data, n);
+            data += n;
+            len -= n;
+            if (fragment.size() == WEBSOCKET_TEXT_FRAGMENT_SIZE) {
+                if (!websocket_->Send(fragment.data(), fragment.size(), false, false)) {
+                    return false;
+                }
+                fragment.clear();
+            }
+        }
+        return true;
+    });
+    // The final fragment also ends a message that failed halfway, the server drops it as invalid JSON
+    if (!websocket_->Send(fragment.data(), fragment.size(), false, true) || !ok) {
+        ESP_LOGE(TAG, "Failed to send fragmented text");
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+
+bool WebsocketProtocol::WriteText(const std::string& text) {
     if (!websocket_->Send(text)) {
         ESP_LOGE(TAG, "Failed to send text: %s", text.c_str());
         SetError(Lang::Strings::SERVER_ERROR);
@@ -71,16 +352,121 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+// Called with pending_mutex_ held, once the server hello has arrived
+void WebsocketProtocol::FlushPendingFrames() {
+    if (!pending_frames_.empty()) {
+        ESP_LOGI(TAG, "Flushing %u frames sent before the server hello", pending_frames_.size());
+    }
+    for (auto& frame : pending_frames_) {
+        if (frame.packet != nullptr) {
+            WriteAudio(std::move(frame.packet));
+        } else {
+            WriteText(frame.text);
+        }
+    }
+    pending_frames_.clear();
+    pending_packets_ = 0;
+    hello_pending_ = false;
+}
+
+void WebsocketProtocol::ClearPendingFrames() {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    for (auto& frame : pending_frames_) {
+        if (frame.packet != nullptr) {
+            audio_service.ReleasePacket(std::move(frame.packet));
+        }
+    }
+    pending_frames_.clear();
+    pending_packets_ = 0;
+    hello_pending_ = false;
+}
+
+// The audio sender task may be using the old socket, it is swapped under channel_mutex_ and destroyed outside
+void WebsocketProtocol::ResetWebsocket(std::unique_ptr<WebSocket> websocket) {
+    std::unique_ptr<WebSocket> old;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        old = std::move(websocket_);
+        websocket_ = std::move(websocket);
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+        // The datagrams belong to the session of the old connection
+        udp_channel_.Close();
+        udp_uplink_ = false;
+#endif
+    }
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return websocket_ != nullptr && websocket_->IsConnected() && channel_opened_ && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel(bool send_goodbye) {
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    if (channel_opened_ && !error_occurred_ && websocket_ != nullptr && websocket_->IsConnected()) {
+        // Keep the connection for the next turn, the abort makes the server drop what is left of this one
+        if (send_goodbye) {
+            SendAbortSpeaking(kAbortReasonNone);
+        }
+        channel_opened_ = false;
+        channel_closed_time_ = std::chrono::steady_clock::now();
+        last_ping_time_ = channel_closed_time_;
+        if (on_audio_channel_closed_ != nullptr) {
+            on_audio_channel_closed_();
+        }
+        return;
+    }
+#endif
     (void)send_goodbye;  // Websocket doesn't need to send goodbye message
-    websocket_.reset();
+    // The disconnect callback still sees the channel open and reports it closed
+    ResetWebsocket(nullptr);
+    channel_opened_ = false;
+    ClearPendingFrames();
+}
+
+void WebsocketProtocol::KeepAlive() {
+#if CONFIG_WEBSOCKET_PIPELINED_HELLO
+    {
+        std::unique_lock<std::mutex> lock(pending_mutex_);
+        if (hello_pending_ && std::chrono::steady_clock::now() > hello_deadline_) {
+            lock.unlock();
+            ESP_LOGE(TAG, "Failed to receive server hello");
+            ClearPendingFrames();
+            SetError(Lang::Strings::SERVER_TIMEOUT);
+            return;
+        }
+    }
+#endif
+
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    if (websocket_ == nullptr || channel_opened_) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (!websocket_->IsConnected()) {
+        ESP_LOGI(TAG, "Idle websocket connection lost");
+        ResetWebsocket(nullptr);
+    } else if (now - channel_closed_time_ >= std::chrono::seconds(CONFIG_WEBSOCKET_KEEP_WARM_IDLE_TIMEOUT)) {
+        ESP_LOGI(TAG, "Closing idle websocket connection");
+        ResetWebsocket(nullptr);
+    } else if (now - last_ping_time_ >= std::chrono::seconds(CONFIG_WEBSOCKET_KEEP_WARM_PING_INTERVAL)) {
+        websocket_->Ping();
+        last_ping_time_ = now;
+    }
+#endif
+}
+
+void WebsocketProtocol::ResetConnection() {
+    // A warm connection goes as well, the next OpenAudioChannel connects over the current interface
+    ResetWebsocket(nullptr);
+    channel_opened_ = false;
+    connection_key_.clear();
+    ClearPendingFrames();
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
+    TRACE_SCOPE(kTracePointAudioChannelOpen);
     Settings settings("websocket", false);
     std::string url = settings.GetString("url");
     std::string token = settings.GetString("token");
@@ -90,9 +476,37 @@ bool WebsocketProtocol::OpenAudioChannel() {
     }
 
     error_occurred_ = false;
+    auto hello = GetHelloMessage();
+
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    if (websocket_ != nullptr && websocket_->IsConnected() && connection_key_ == url + token + hello) {
+        ESP_LOGI(TAG, "Reusing websocket connection, session: %s", session_id_.c_str());
+        last_incoming_time_ = std::chrono::steady_clock::now();
+    } else if (!Connect(url, token, hello)) {
+        return false;
+    }
+#else
+    if (!Connect(url, token, hello)) {
+        return false;
+    }
+#endif
+
+    channel_opened_ = true;
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
 
+    return true;
+}
+
+// Opens a new connection and exchanges the hello messages
+bool WebsocketProtocol::Connect(const std::string& url, const std::string& token, const std::string& hello) {
+    connection_key_.clear();
+    ClearPendingFrames();
+    // Stays JSON until the new server hello, which may arrive after the first messages with a pipelined hello
+    binary_control_enabled_ = false;
     auto network = Board::GetInstance().GetNetwork();
-    websocket_ = network->CreateWebSocket(1);
+    ResetWebsocket(network->CreateWebSocket(1));
     if (websocket_ == nullptr) {
         ESP_LOGE(TAG, "Failed to create websocket");
         return false;
@@ -101,72 +515,74 @@ bool WebsocketProtocol::OpenAudioChannel() {
     if (!token.empty()) {
         // If token not has a space, add "Bearer " prefix
         if (token.find(" ") == std::string::npos) {
-            token = "Bearer " + token;
+            websocket_->SetHeader("Authorization", ("Bearer " + token).c_str());
+        } else {
+            websocket_->SetHeader("Authorization", token.c_str());
         }
-        websocket_->SetHeader("Authorization", token.c_str());
     }
     websocket_->SetHeader("Protocol-Version", std::to_string(version_).c_str());
     websocket_->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
-        if (binary) {
+        if (binary && version_ == 4 && len > 0 && (uint8_t)data[0] == CONTROL_FRAME_TYPE) {
+            // Handled on the control task in order with the JSON messages
+            QueueControlMessage(data, len);
+        } else if (binary) {
+#if CONFIG_WEBSOCKET_KEEP_WARM
+            // Leftovers of a closed turn
+            if (!channel_opened_) {
+                return;
+            }
+#endif
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+            // The server only answers over UDP once our datagrams reach it, so these do not either
+            if (udp_uplink_.exchange(false)) {
+                ESP_LOGW(TAG, "Server sends audio over the websocket, moving the uplink there as well");
+            }
+#endif
             if (on_incoming_audio_ != nullptr) {
+                auto packet = Application::GetInstance().GetAudioService().AcquirePacket();
+                packet->sample_rate = server_sample_rate_;
+                packet->frame_duration = server_frame_duration_;
+                // Read the header fields in place, only the Opus data is copied into the pooled packet
                 if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
-                } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
+                    auto bp2 = (const BinaryProtocol2*)data;
+                    if (len < sizeof(BinaryProtocol2) || ntohl(bp2->payload_size) > len - sizeof(BinaryProtocol2)) {
+                        ESP_LOGE(TAG, "Invalid binary frame, len: %u", len);
+                        Application::GetInstance().GetAudioService().ReleasePacket(std::move(packet));
+                        return;
+                    }
+                    packet->timestamp = ntohl(bp2->timestamp);
+                    packet->payload.assign(bp2->payload, bp2->payload + ntohl(bp2->payload_size));
+                } else if (version_ >= 3) {
+                    auto bp3 = (const BinaryProtocol3*)data;
+                    if (len < sizeof(BinaryProtocol3) || ntohs(bp3->payload_size) > len - sizeof(BinaryProtocol3)) {
+                        ESP_LOGE(TAG, "Invalid binary frame, len: %u", len);
+                        Application::GetInstance().GetAudioService().ReleasePacket(std::move(packet));
+                        return;
+                    }
+                    packet->payload.assign(bp3->payload, bp3->payload + ntohs(bp3->payload_size));
                 } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
+                    packet->payload.assign((uint8_t*)data, (uint8_t*)data + len);
                 }
+                on_incoming_audio_(std::move(packet));
             }
         } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
-                }
-            } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
-            }
-            cJSON_Delete(root);
+            // Parsed and handled on the control task, audio frames behind it are not held up
+            QueueControlMessage(data, len);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     websocket_->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
+#if CONFIG_WEBSOCKET_KEEP_WARM
+        // An idle connection has no channel to report closed
+        if (!channel_opened_) {
+            return;
+        }
+#endif
         if (on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
@@ -180,11 +596,23 @@ bool WebsocketProtocol::OpenAudioChannel() {
     }
 
     // Send hello message to describe the client
-    auto message = GetHelloMessage();
-    if (!SendText(message)) {
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+    hello_sent_time_ = std::chrono::steady_clock::now();
+    TRACE_BEGIN(kTracePointHello);
+    if (!SendText(hello)) {
         return false;
     }
 
+#if CONFIG_WEBSOCKET_PIPELINED_HELLO
+    // Open the channel with the audio params we offered, everything sent until the server hello is held back
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        if (!(xEventGroupGetBits(event_group_handle_) & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
+            hello_pending_ = true;
+            hello_deadline_ = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        }
+    }
+#else
     // Wait for server hello
     EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
     if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
@@ -192,11 +620,9 @@ bool WebsocketProtocol::OpenAudioChannel() {
         SetError(Lang::Strings::SERVER_TIMEOUT);
         return false;
     }
+#endif
 
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
-    }
-
+    connection_key_ = url + token + hello;
     return true;
 }
 
@@ -210,13 +636,31 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON_AddBoolToObject(features, "aec", true);
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    cJSON_AddBoolToObject(features, "udp", true);
+#endif
+    if (version_ != 1) {
+        AddAudioBatchFeature(features);
+    }
+    if (version_ == 4) {
+        AddBinaryControlFeature(features);
+    }
+    if (version_ != 1) {
+        AddVideoStreamFeature(features);
+    }
+    AddTtsCacheFeature(features);
     cJSON_AddItemToObject(root, "features", features);
     cJSON_AddStringToObject(root, "transport", "websocket");
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    auto encoder_config = Application::GetInstance().GetAudioService().GetEncoderConfig();
+    cJSON_AddNumberToObject(audio_params, "frame_duration", encoder_config.frame_duration_ms);
+    if (encoder_config.bitrate != ESP_OPUS_BITRATE_AUTO) {
+        cJSON_AddNumberToObject(audio_params, "bitrate", encoder_config.bitrate);
+    }
+    AddDownlinkAudioParams(audio_params);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -232,12 +676,26 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         return;
     }
 
+    RecordHelloRoundTrip();
+
     auto session_id = cJSON_GetObjectItem(root, "session_id");
     if (cJSON_IsString(session_id)) {
         session_id_ = session_id->valuestring;
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
+    ParseAudioBatchFeature(root);
+    if (version_ == 1) {
+        audio_batch_enabled_ = false;
+    }
+    ParseVideoStreamFeature(root);
+    if (version_ == 1) {
+        video_stream_enabled_ = false;
+    }
+    ParseBinaryControlFeature(root);
+    bool binary_control = binary_control_enabled_ && version_ == 4;
+    binary_control_enabled_ = false;
+
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (cJSON_IsObject(audio_params)) {
         auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
@@ -248,7 +706,59 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
+        ParseUplinkAudioParams(audio_params);
     }
 
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    OpenUdpChannel(cJSON_GetObjectItem(root, "udp"));
+#endif
+
+#if CONFIG_WEBSOCKET_PIPELINED_HELLO
+    {
+        // The held back audio goes out on the transport just chosen, without racing the sender task
+        std::lock_guard<std::mutex> channel_lock(channel_mutex_);
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+        FlushPendingFrames();
+        // Only after the held back JSON, so the control events keep their order
+        binary_control_enabled_ = binary_control;
+    }
+    // The channel was opened with the offered params, report it again with the confirmed ones
+    if (channel_opened_ && on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+#else
+    binary_control_enabled_ = binary_control;
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+#endif
+}
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+// Audio moves to the udp block of the server hello if there is one, JSON and MCP stay on the websocket
+void WebsocketProtocol::OpenUdpChannel(const cJSON* udp) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    udp_channel_.Close();
+    udp_uplink_ = false;
+    if (!cJSON_IsObject(udp)) {
+        return;
+    }
+
+    bool opened = udp_channel_.Configure(udp) && udp_channel_.Open([this](std::unique_ptr<AudioStreamPacket> packet) {
+        // Leftovers of a closed turn are dropped like the binary frames
+        if (!channel_opened_ || on_incoming_audio_ == nullptr) {
+            Application::GetInstance().GetAudioService().ReleasePacket(std::move(packet));
+            return;
+        }
+        packet->sample_rate = server_sample_rate_;
+        packet->frame_duration = server_frame_duration_;
+        on_incoming_audio_(std::move(packet));
+        last_incoming_time_ = std::chrono::steady_clock::now();
+    });
+    if (!opened) {
+        ESP_LOGW(TAG, "UDP audio is not available, keeping audio on the websocket");
+        return;
+    }
+    udp_uplink_ = true;
+    ESP_LOGI(TAG, "Audio over UDP server %s", udp_channel_.server().c_str());
 }
+#endif
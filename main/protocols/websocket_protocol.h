@@ -3,12 +3,21 @@
 
 
 #include "protocol.h"
+#include "udp_audio_channel.h"
+#include "message_ring.h"
 
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string_view>
+
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+#define WEBSOCKET_PROTOCOL_CONTROL_TASK_EXITED_EVENT (1 << 1)
 
 class WebsocketProtocol : public Protocol {
 public:
@@ -20,14 +29,68 @@ public:
     bool OpenAudioChannel() override;
     void CloseAudioChannel(bool send_goodbye = true) override;
     bool IsAudioChannelOpened() const override;
+    void KeepAlive() override;
+    void ResetConnection() override;
+    bool SendVideoFrame(const uint8_t* jpeg, size_t size, uint32_t timestamp) override;
 
 private:
     EventGroupHandle_t event_group_handle_;
+    // Guards websocket_ against the audio sender task, only the main task replaces it
+    std::mutex channel_mutex_;
     std::unique_ptr<WebSocket> websocket_;
     int version_ = 1;
+    bool channel_opened_ = false;
+    // Url and hello message of the current connection, a warm connection is only reused if both still match
+    std::string connection_key_;
+    std::chrono::steady_clock::time_point channel_closed_time_;
+    std::chrono::steady_clock::time_point last_ping_time_;
+    // Only used for packets without headroom
+    std::string send_buffer_;
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Audio datagrams offered by the server hello, opened and closed with the websocket under channel_mutex_.
+    // The uplink goes back to binary frames for the rest of the connection once the UDP path looks blocked.
+    UdpAudioChannel udp_channel_;
+    std::atomic<bool> udp_uplink_ = false;
+#endif
+
+    // Text messages and control frames waiting for the control task, copied out of the receive
+    // buffer into a ring allocated once and parsed there. control_space_cv_ wakes the network
+    // task waiting for room.
+    std::mutex control_mutex_;
+    std::condition_variable control_cv_;
+    std::condition_variable control_space_cv_;
+    MessageRing control_messages_;
+    bool control_task_stopping_ = false;
+
+    // Frames sent while the server hello is outstanding, flushed in order once it arrives.
+    // A null packet stands for a text message.
+    struct PendingFrame {
+        std::unique_ptr<AudioStreamPacket> packet;
+        std::string text;
+    };
+    std::mutex pending_mutex_;
+    bool hello_pending_ = false;
+    std::chrono::steady_clock::time_point hello_deadline_;
+    std::deque<PendingFrame> pending_frames_;
+    size_t pending_packets_ = 0;
 
+    void ControlTask();
+    void QueueControlMessage(const char* data, size_t len);
+    void ParseTextMessage(std::string_view message);
+    bool Connect(const std::string& url, const std::string& token, const std::string& hello);
+    void ResetWebsocket(std::unique_ptr<WebSocket> websocket);
+    bool WriteAudio(std::unique_ptr<AudioStreamPacket> packet);
+    bool WriteText(const std::string& text);
+    void FlushPendingFrames();
+    void ClearPendingFrames();
     void ParseServerHello(const cJSON* root);
+    void OpenUdpChannel(const cJSON* udp);
+    uint8_t* PrependHeader(AudioStreamPacket& packet, size_t header_size);
     bool SendText(const std::string& text) override;
+    bool SendTextParts(const TextPartsWriter& writer) override;
+    bool SendControlFrame(const std::string& frame) override;
+    bool SendAudioBatchFrame(const std::string& body, uint32_t timestamp, int count) override;
     std::string GetHelloMessage();
 };
 
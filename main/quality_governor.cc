@@ -0,0 +1,140 @@
+#include "quality_governor.h"
+
+#if CONFIG_USE_QUALITY_GOVERNOR
+#include "application.h"
+#include "board.h"
+#include "display.h"
+
+#include <esp_log.h>
+
+#include <algorithm>
+
+#define TAG "QualityGovernor"
+
+#define QUALITY_GOVERNOR_SAMPLE_S 5
+// 30 seconds of heat or load before a step down, two minutes of calm before a step up
+#define QUALITY_GOVERNOR_STEP_DOWN_SAMPLES 6
+#define QUALITY_GOVERNOR_STEP_UP_SAMPLES 24
+// A step up needs the chip this much below the limit, and twice the idle share
+#define QUALITY_GOVERNOR_HYSTERESIS_CELSIUS 5
+
+static const char* const kLevelNames[kQualityLevelCount] = {
+    "full", "gif slow", "opus light", "afe light", "refresh slow",
+};
+
+void QualityGovernor::Start() {
+    started_ = true;
+#if SOC_TEMP_SENSOR_SUPPORTED
+    float celsius;
+    if (!Board::GetInstance().GetTemperature(celsius)) {
+        temperature_sensor_config_t config = TEMPERATURE_SENSOR_CONFIG_DEFAULT(20, 100);
+        if (temperature_sensor_install(&config, &temperature_sensor_) != ESP_OK ||
+            temperature_sensor_enable(temperature_sensor_) != ESP_OK) {
+            ESP_LOGW(TAG, "Internal temperature sensor not available, load only");
+            temperature_sensor_ = nullptr;
+        }
+    }
+#endif
+    SampleIdlePercent();
+    ESP_LOGI(TAG, "Started, hot at %d C, busy below %d%% idle", CONFIG_QUALITY_GOVERNOR_HOT_CELSIUS,
+        CONFIG_QUALITY_GOVERNOR_MIN_IDLE_PERCENT);
+}
+
+bool QualityGovernor::ReadTemperature(float& celsius) {
+    if (Board::GetInstance().GetTemperature(celsius)) {
+        return true;
+    }
+#if SOC_TEMP_SENSOR_SUPPORTED
+    if (temperature_sensor_ != nullptr) {
+        return temperature_sensor_get_celsius(temperature_sensor_, &celsius) == ESP_OK;
+    }
+#endif
+    return false;
+}
+
+int QualityGovernor::SampleIdlePercent() {
+    configRUN_TIME_COUNTER_TYPE counter = portGET_RUN_TIME_COUNTER_VALUE();
+    uint32_t elapsed = (uint32_t)(counter - last_counter_);
+    last_counter_ = counter;
+    int min_percent = 100;
+    for (int core = 0; core < CONFIG_FREERTOS_NUMBER_OF_CORES; core++) {
+        configRUN_TIME_COUNTER_TYPE idle = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+        uint32_t idle_elapsed = (uint32_t)(idle - last_idle_[core]);
+        last_idle_[core] = idle;
+        if (elapsed > 0) {
+            min_percent = std::min(min_percent, (int)((uint64_t)idle_elapsed * 100 / elapsed));
+        }
+    }
+    return min_percent;
+}
+
+void QualityGovernor::Check() {
+    if (!started_) {
+        Start();
+    }
+    if (++ticks_ % QUALITY_GOVERNOR_SAMPLE_S != 0) {
+        return;
+    }
+
+    float celsius = 0;
+    bool has_temperature = ReadTemperature(celsius);
+    int idle_percent = SampleIdlePercent();
+    // The CPU is clocked down while idle, only a conversation tells real load
+    auto state = Application::GetInstance().GetDeviceState();
+    bool conversation = state == kDeviceStateListening || state == kDeviceStateSpeaking;
+
+    bool hot = has_temperature && celsius >= CONFIG_QUALITY_GOVERNOR_HOT_CELSIUS;
+    bool busy = conversation && idle_percent < CONFIG_QUALITY_GOVERNOR_MIN_IDLE_PERCENT;
+    bool cool = (!has_temperature || celsius < CONFIG_QUALITY_GOVERNOR_HOT_CELSIUS - QUALITY_GOVERNOR_HYSTERESIS_CELSIUS) &&
+        (!conversation || idle_percent >= CONFIG_QUALITY_GOVERNOR_MIN_IDLE_PERCENT * 2);
+
+    hot_samples_ = (hot || busy) ? hot_samples_ + 1 : 0;
+    cool_samples_ = cool ? cool_samples_ + 1 : 0;
+
+    QualityLevel level = level_;
+    if (hot_samples_ >= QUALITY_GOVERNOR_STEP_DOWN_SAMPLES && level_ + 1 < kQualityLevelCount) {
+        level = (QualityLevel)(level_ + 1);
+    } else if (cool_samples_ >= QUALITY_GOVERNOR_STEP_UP_SAMPLES && level_ > kQualityFull) {
+        level = (QualityLevel)(level_ - 1);
+    } else {
+        return;
+    }
+    hot_samples_ = 0;
+    cool_samples_ = 0;
+
+    ESP_LOGW(TAG, "%s to %s: %.1f C, %d%% idle%s", level > level_ ? "Stepping down" : "Stepping up",
+        kLevelNames[level], has_temperature ? celsius : 0.0f, idle_percent, conversation ? "" : " (not in conversation)");
+    Apply(level);
+}
+
+// Only the reduction of the level that is entered or left changes
+void QualityGovernor::Apply(QualityLevel level) {
+    QualityLevel changed = std::max(level, level_);
+    level_ = level;
+    bool reduce = level == changed;
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    auto display = Board::GetInstance().GetDisplay();
+    switch (changed) {
+        case kQualityGifSlow:
+            display->SetAnimationSlowdown(reduce ? 2 : 1);
+            break;
+        case kQualityOpusLight:
+            audio_service.SetEncoderComplexityCap(reduce ? 0 : 10);
+            break;
+        case kQualityAfeLight:
+            audio_service.EnableNoiseSuppression(!reduce);
+            break;
+        case kQualityRefreshSlow:
+            display->SetRefreshSlowdown(reduce ? 2 : 1);
+            break;
+        default:
+            break;
+    }
+}
+
+#else
+
+void QualityGovernor::Check() {
+}
+
+#endif
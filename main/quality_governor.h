@@ -0,0 +1,78 @@
+#ifndef QUALITY_GOVERNOR_H
+#define QUALITY_GOVERNOR_H
+
+#include <cstdint>
+
+#include <sdkconfig.h>
+
+#if CONFIG_USE_QUALITY_GOVERNOR
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <soc/soc_caps.h>
+#if SOC_TEMP_SENSOR_SUPPORTED
+#include <driver/temperature_sensor.h>
+#endif
+#endif
+
+// Each level keeps the reductions of the levels before it
+enum QualityLevel {
+    kQualityFull,
+    kQualityGifSlow,        // GIF emojis at half their frame rate
+    kQualityOpusLight,      // Uplink encoder at complexity 0
+    kQualityAfeLight,       // No noise suppression in voice processing
+    kQualityRefreshSlow,    // Screen refresh period doubled
+    kQualityLevelCount,
+};
+
+/**
+ * QualityGovernor - Trades quality for heat and CPU time when the device runs hot or busy
+ *
+ * Check() runs on the main task every second and samples every QUALITY_GOVERNOR_SAMPLE_S
+ * seconds: the chip temperature, from the board or the internal sensor, and the share of time
+ * the idle task of each core got. A sample is hot at CONFIG_QUALITY_GOVERNOR_HOT_CELSIUS, or busy
+ * while listening or speaking when a core was idle less than CONFIG_QUALITY_GOVERNOR_MIN_IDLE_PERCENT.
+ * After QUALITY_GOVERNOR_STEP_DOWN_SAMPLES such samples in a row the governor steps down one
+ * level, and after QUALITY_GOVERNOR_STEP_UP_SAMPLES cool and quiet ones it steps back up. Every
+ * transition is logged with the readings that caused it.
+ *
+ * Without CONFIG_USE_QUALITY_GOVERNOR Check() does nothing and the level stays full.
+ */
+class QualityGovernor {
+public:
+    static QualityGovernor& GetInstance() {
+        static QualityGovernor instance;
+        return instance;
+    }
+
+    QualityGovernor(const QualityGovernor&) = delete;
+    QualityGovernor& operator=(const QualityGovernor&) = delete;
+
+    // Main task only
+    void Check();
+    QualityLevel level() const { return level_; }
+
+private:
+    QualityGovernor() = default;
+
+    QualityLevel level_ = kQualityFull;
+
+#if CONFIG_USE_QUALITY_GOVERNOR
+    bool started_ = false;
+    int ticks_ = 0;
+    int hot_samples_ = 0;
+    int cool_samples_ = 0;
+    configRUN_TIME_COUNTER_TYPE last_counter_ = 0;
+    configRUN_TIME_COUNTER_TYPE last_idle_[CONFIG_FREERTOS_NUMBER_OF_CORES] = {};
+#if SOC_TEMP_SENSOR_SUPPORTED
+    temperature_sensor_handle_t temperature_sensor_ = nullptr;
+#endif
+
+    void Start();
+    bool ReadTemperature(float& celsius);
+    // Lowest idle share of all cores since the previous call, in percent
+    int SampleIdlePercent();
+    void Apply(QualityLevel level);
+#endif
+};
+
+#endif // QUALITY_GOVERNOR_H
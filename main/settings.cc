@@ -1,88 +1,237 @@
 #include "settings.h"
 
 #include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 
+#include <map>
+#include <mutex>
+
 #define TAG "Settings"
 
-Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
-    nvs_open(ns.c_str(), read_write_ ? NVS_READWRITE : NVS_READONLY, &nvs_handle_);
+// Writes within this window go to flash together
+#define SETTINGS_WRITE_BACK_DELAY_US (2 * 1000 * 1000)
+
+namespace {
+
+enum EntryType {
+    kEntryString,
+    kEntryInt,
+    kEntryBool,
+    kEntryAbsent,   // Not in NVS, or erased
+};
+
+struct Entry {
+    EntryType type = kEntryAbsent;
+    std::string string_value;
+    int32_t int_value = 0;
+    bool dirty = false;
+};
+
+std::mutex cache_mutex;
+std::map<std::string, std::map<std::string, Entry>> cache;
+esp_timer_handle_t flush_timer = nullptr;
+// Open BeginBatch() calls, and whether a write is waiting for the last one to end
+int batch_depth = 0;
+bool flush_held = false;
+
+// Called with cache_mutex held, nullptr if the key could not be read
+Entry* Load(const std::string& ns, const std::string& key, EntryType type) {
+    auto& entries = cache[ns];
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        return &it->second;
+    }
+
+    Entry entry;
+    nvs_handle_t handle = 0;
+    esp_err_t ret = nvs_open(ns.c_str(), NVS_READONLY, &handle);
+    if (ret == ESP_OK) {
+        if (type == kEntryString) {
+            size_t length = 0;
+            ret = nvs_get_str(handle, key.c_str(), nullptr, &length);
+            if (ret == ESP_OK) {
+                entry.string_value.resize(length);
+                ret = nvs_get_str(handle, key.c_str(), entry.string_value.data(), &length);
+                while (!entry.string_value.empty() && entry.string_value.back() == '\0') {
+                    entry.string_value.pop_back();
+                }
+            }
+        } else if (type == kEntryInt) {
+            ret = nvs_get_i32(handle, key.c_str(), &entry.int_value);
+        } else {
+            uint8_t value = 0;
+            ret = nvs_get_u8(handle, key.c_str(), &value);
+            entry.int_value = value;
+        }
+        nvs_close(handle);
+    }
+
+    if (ret == ESP_OK) {
+        entry.type = type;
+    } else if (ret != ESP_ERR_NVS_NOT_FOUND) {
+        // A key of another type, leave it to NVS
+        return nullptr;
+    }
+    return &(entries[key] = std::move(entry));
 }
 
-Settings::~Settings() {
-    if (nvs_handle_ != 0) {
-        if (read_write_ && dirty_) {
-            ESP_ERROR_CHECK(nvs_commit(nvs_handle_));
+void FlushLocked() {
+    if (flush_timer != nullptr) {
+        esp_timer_stop(flush_timer);
+    }
+    flush_held = false;
+    for (auto& [ns, entries] : cache) {
+        nvs_handle_t handle = 0;
+        bool opened = false;
+        for (auto& [key, entry] : entries) {
+            if (!entry.dirty) {
+                continue;
+            }
+            if (!opened) {
+                esp_err_t ret = nvs_open(ns.c_str(), NVS_READWRITE, &handle);
+                if (ret != ESP_OK) {
+                    ESP_LOGE(TAG, "Failed to open namespace %s: %s", ns.c_str(), esp_err_to_name(ret));
+                    break;
+                }
+                opened = true;
+            }
+            esp_err_t ret;
+            switch (entry.type) {
+                case kEntryString:
+                    ret = nvs_set_str(handle, key.c_str(), entry.string_value.c_str());
+                    break;
+                case kEntryInt:
+                    ret = nvs_set_i32(handle, key.c_str(), entry.int_value);
+                    break;
+                case kEntryBool:
+                    ret = nvs_set_u8(handle, key.c_str(), entry.int_value ? 1 : 0);
+                    break;
+                default:
+                    ret = nvs_erase_key(handle, key.c_str());
+                    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+                        ret = ESP_OK;
+                    }
+                    break;
+            }
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to write %s.%s: %s", ns.c_str(), key.c_str(), esp_err_to_name(ret));
+            }
+            entry.dirty = false;
+        }
+        if (opened) {
+            esp_err_t ret = nvs_commit(handle);
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to commit namespace %s: %s", ns.c_str(), esp_err_to_name(ret));
+            }
+            nvs_close(handle);
         }
-        nvs_close(nvs_handle_);
     }
 }
 
-std::string Settings::GetString(const std::string& key, const std::string& default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
+// Called with cache_mutex held
+void ScheduleFlush() {
+    if (flush_timer == nullptr) {
+        esp_timer_create_args_t timer_args = {
+            .callback = [](void* arg) {
+                Settings::Flush();
+            },
+            .arg = nullptr,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "settings_flush",
+            .skip_unhandled_events = true,
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &flush_timer));
+        esp_register_shutdown_handler([]() {
+            Settings::Flush();
+        });
     }
+    if (batch_depth > 0) {
+        flush_held = true;
+        return;
+    }
+    if (!esp_timer_is_active(flush_timer)) {
+        esp_timer_start_once(flush_timer, SETTINGS_WRITE_BACK_DELAY_US);
+    }
+}
 
-    size_t length = 0;
-    if (nvs_get_str(nvs_handle_, key.c_str(), nullptr, &length) != ESP_OK) {
-        return default_value;
+// Called with cache_mutex held, a value that is already stored is not written again
+void Store(const std::string& ns, const std::string& key, EntryType type, const std::string* string_value, int32_t int_value) {
+    auto [it, inserted] = cache[ns].try_emplace(key);
+    auto& entry = it->second;
+    if (!inserted && entry.type == type &&
+        (type == kEntryString ? entry.string_value == *string_value : entry.int_value == int_value)) {
+        return;
+    }
+    entry.type = type;
+    if (string_value != nullptr) {
+        entry.string_value = *string_value;
+    } else {
+        entry.string_value.clear();
     }
+    entry.int_value = int_value;
+    entry.dirty = true;
+    ScheduleFlush();
+}
+
+} // namespace
 
-    std::string value;
-    value.resize(length);
-    ESP_ERROR_CHECK(nvs_get_str(nvs_handle_, key.c_str(), value.data(), &length));
-    while (!value.empty() && value.back() == '\0') {
-        value.pop_back();
+Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
+}
+
+Settings::~Settings() {
+}
+
+std::string Settings::GetString(const std::string& key, const std::string& default_value) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto entry = Load(ns_, key, kEntryString);
+    if (entry == nullptr || entry->type != kEntryString) {
+        return default_value;
     }
-    return value;
+    return entry->string_value;
 }
 
 void Settings::SetString(const std::string& key, const std::string& value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_str(nvs_handle_, key.c_str(), value.c_str()));
-        dirty_ = true;
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        Store(ns_, key, kEntryString, &value, 0);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
-    if (nvs_handle_ == 0) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto entry = Load(ns_, key, kEntryInt);
+    if (entry == nullptr || entry->type != kEntryInt) {
         return default_value;
     }
-
-    int32_t value;
-    if (nvs_get_i32(nvs_handle_, key.c_str(), &value) != ESP_OK) {
-        return default_value;
-    }
-    return value;
+    return entry->int_value;
 }
 
 void Settings::SetInt(const std::string& key, int32_t value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_i32(nvs_handle_, key.c_str(), value));
-        dirty_ = true;
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        Store(ns_, key, kEntryInt, nullptr, value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 bool Settings::GetBool(const std::string& key, bool default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
-    }
-
-    uint8_t value;
-    if (nvs_get_u8(nvs_handle_, key.c_str(), &value) != ESP_OK) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto entry = Load(ns_, key, kEntryBool);
+    if (entry == nullptr || entry->type != kEntryBool) {
         return default_value;
     }
-    return value != 0;
+    return entry->int_value != 0;
 }
 
 void Settings::SetBool(const std::string& key, bool value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_u8(nvs_handle_, key.c_str(), value ? 1 : 0));
-        dirty_ = true;
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        Store(ns_, key, kEntryBool, nullptr, value ? 1 : 0);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -90,10 +239,8 @@ void Settings::SetBool(const std::string& key, bool value) {
 
 void Settings::EraseKey(const std::string& key) {
     if (read_write_) {
-        auto ret = nvs_erase_key(nvs_handle_, key.c_str());
-        if (ret != ESP_ERR_NVS_NOT_FOUND) {
-            ESP_ERROR_CHECK(ret);
-        }
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        Store(ns_, key, kEntryAbsent, nullptr, 0);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -101,8 +248,47 @@ void Settings::EraseKey(const std::string& key) {
 
 void Settings::EraseAll() {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_erase_all(nvs_handle_));
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        // Pending writes of the namespace are dropped together with it
+        cache.erase(ns_);
+        nvs_handle_t handle = 0;
+        if (nvs_open(ns_.c_str(), NVS_READWRITE, &handle) == ESP_OK) {
+            ESP_ERROR_CHECK(nvs_erase_all(handle));
+            ESP_ERROR_CHECK(nvs_commit(handle));
+            nvs_close(handle);
+        }
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
+
+void Settings::Flush() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    FlushLocked();
+}
+
+void Settings::Discard() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (flush_timer != nullptr) {
+        esp_timer_stop(flush_timer);
+    }
+    flush_held = false;
+    cache.clear();
+}
+
+void Settings::BeginBatch() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    // Earlier writes that were about to go out wait for the batch too
+    if (batch_depth++ == 0 && flush_timer != nullptr && esp_timer_is_active(flush_timer)) {
+        esp_timer_stop(flush_timer);
+        flush_held = true;
+    }
+}
+
+void Settings::EndBatch() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (--batch_depth == 0 && flush_held) {
+        flush_held = false;
+        ScheduleFlush();
+    }
+}
@@ -4,6 +4,13 @@
 #include <string>
 #include <nvs_flash.h>
 
+/*
+ * Settings are served from a process-wide cache that is filled from NVS on first read.
+ * Writes only touch the cache and are committed in one batch a moment later, so that
+ * a run of volume or brightness steps costs a single flash write. Pending writes are
+ * also committed by Flush(), and on esp_restart() through a shutdown handler. Between
+ * BeginBatch() and EndBatch() the write-back waits, so a batch of changes is one commit.
+ */
 class Settings {
 public:
     Settings(const std::string& ns, bool read_write = false);
@@ -18,11 +25,17 @@ public:
     void EraseKey(const std::string& key);
     void EraseAll();
 
+    // Commits the pending writes now, call before deep sleep
+    static void Flush();
+    // Drops the cache and the pending writes, after the NVS partition was erased
+    static void Discard();
+    // Hold back the write-back until the matching EndBatch(), batches nest
+    static void BeginBatch();
+    static void EndBatch();
+
 private:
     std::string ns_;
-    nvs_handle_t nvs_handle_ = 0;
     bool read_write_ = false;
-    bool dirty_ = false;
 };
 
 #endif
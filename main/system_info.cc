@@ -1,4 +1,5 @@
 #include "system_info.h"
+#include "dfs_policy.h"
 
 #include <freertos/task.h>
 #include <esp_log.h>
@@ -153,4 +154,5 @@ void SystemInfo::PrintHeapStats() {
 
 void SystemInfo::PrintPmLocks() {
     esp_pm_dump_locks(stdout);
+    DfsPolicy::GetInstance().PrintResidency();
 }
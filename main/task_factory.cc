@@ -0,0 +1,275 @@
+#include "task_factory.h"
+#include "metrics.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_pthread.h>
+#include <esp_timer.h>
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#define TAG "TaskFactory"
+
+// Pinning to the second core means no affinity on single-core chips
+#if CONFIG_SOC_CPU_CORES_NUM > 1
+#define TASK_CORE(core) (core)
+#else
+#define TASK_CORE(core) tskNO_AFFINITY
+#endif
+
+// Stack of a task created by name that has no placement
+#define TASK_DEFAULT_STACK_SIZE 4096
+
+namespace {
+
+struct TaskEntry {
+    TaskHandle_t handle;
+    const char* name;
+    uint32_t stack_size;
+    UBaseType_t priority;
+    BaseType_t core;
+    bool psram;
+    std::function<void()> body;
+};
+
+std::mutex tasks_mutex;
+std::list<TaskEntry> tasks;
+
+// Audio tasks are above LVGL and the emote engine, so a busy display drops frames rather than audio.
+// Only the AFE input is pinned, to core 0 with Wi-Fi, keeping it off the LVGL core.
+std::mutex placements_mutex;
+std::vector<TaskPlacement> placements = {
+#if CONFIG_USE_AUDIO_PROCESSOR
+    {"audio_input", 2048 * 3, 8, TASK_CORE(0)},
+    {"audio_output", 2048 * 2, 4, tskNO_AFFINITY},
+#else
+    {"audio_input", 2048 * 2, 8, tskNO_AFFINITY},
+    {"audio_output", 2048, 4, tskNO_AFFINITY},
+#endif
+#if CONFIG_USE_SPLIT_OPUS_CODEC_TASKS
+    {"opus_decoder", CONFIG_OPUS_DECODER_TASK_STACK_SIZE, CONFIG_OPUS_DECODER_TASK_PRIORITY,
+        TASK_CORE(CONFIG_OPUS_DECODER_TASK_CORE)},
+    {"opus_encoder", CONFIG_OPUS_ENCODER_TASK_STACK_SIZE, CONFIG_OPUS_ENCODER_TASK_PRIORITY,
+        TASK_CORE(CONFIG_OPUS_ENCODER_TASK_CORE)},
+#else
+    {"opus_codec", CONFIG_OPUS_CODEC_TASK_STACK_SIZE, 2, tskNO_AFFINITY},
+#endif
+    {"audio_sender", 4096 * 2, CONFIG_AUDIO_SENDER_TASK_PRIORITY, tskNO_AFFINITY},
+    {"ws_control", 4096 * 2, 5, tskNO_AFFINITY},
+    {"activation", 4096 * 2, 2, tskNO_AFFINITY},
+    {"deferred_log", 3072, 1, tskNO_AFFINITY},
+    // Created by esp_lvgl_port and the emote engine, a size of 0 keeps what the display asks for
+    {"taskLVGL", 0, 1, TASK_CORE(1)},
+    {"emote", 6 * 1024, 1, TASK_CORE(0)},
+    // The camera's JPEG encoder std::thread, on the pthread default stack
+    {"jpeg_encoder", 0, 5, tskNO_AFFINITY},
+};
+
+// Removes the task from the list, the body goes with it
+void Unregister(TaskHandle_t handle) {
+    std::lock_guard<std::mutex> lock(tasks_mutex);
+    tasks.remove_if([handle](const TaskEntry& entry) { return entry.handle == handle; });
+}
+
+void TaskMain(void* arg) {
+    auto entry = static_cast<TaskEntry*>(arg);
+    {
+        // Set here rather than by the creator, which may only get to it after a short body has returned
+        std::lock_guard<std::mutex> lock(tasks_mutex);
+        entry->handle = xTaskGetCurrentTaskHandle();
+    }
+    entry->body();
+    Unregister(xTaskGetCurrentTaskHandle());
+    vTaskDeleteWithCaps(NULL);
+}
+
+#if CONFIG_USE_TASK_LATENCY_PROBE
+// One probe task per core at the audio output priority, all woken by the same timer tick. How long
+// each takes to run is what an audio task woken then would have waited on that core.
+struct LatencyProbe {
+    TaskHandle_t task = nullptr;
+    std::atomic<uint32_t> max_us{0};
+    MetricHistogram* latency_us = nullptr;
+};
+
+LatencyProbe probes[CONFIG_SOC_CPU_CORES_NUM];
+std::atomic<int64_t> probe_wake_us{0};
+esp_timer_handle_t probe_timer = nullptr;
+
+// Worst latency of each core since the previous report
+void PrintLatencyReport() {
+    for (int core = 0; core < CONFIG_SOC_CPU_CORES_NUM; core++) {
+        ESP_LOGI(TAG, "core %d scheduling latency max: %lu us", core, probes[core].max_us.exchange(0));
+    }
+}
+#endif
+
+}  // namespace
+
+TaskHandle_t TaskFactory::Create(const char* name, uint32_t stack_size, UBaseType_t priority, TaskStack stack,
+    std::function<void()> body, BaseType_t core) {
+    TaskEntry* entry;
+    {
+        std::lock_guard<std::mutex> lock(tasks_mutex);
+        tasks.push_back({nullptr, name, stack_size, priority, core, stack == kTaskStackPsram, std::move(body)});
+        entry = &tasks.back();
+    }
+
+    TaskHandle_t handle = nullptr;
+    if (entry->psram && xTaskCreatePinnedToCoreWithCaps(TaskMain, name, stack_size, entry, priority, &handle, core,
+            MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) != pdPASS) {
+        handle = nullptr;
+        entry->psram = false;
+    }
+    if (handle == nullptr && xTaskCreatePinnedToCoreWithCaps(TaskMain, name, stack_size, entry, priority, &handle, core,
+            MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create task %s with %lu bytes of stack", name, stack_size);
+        std::lock_guard<std::mutex> lock(tasks_mutex);
+        tasks.remove_if([entry](const TaskEntry& e) { return &e == entry; });
+        return nullptr;
+    }
+    return handle;
+}
+
+TaskHandle_t TaskFactory::Create(const char* name, TaskStack stack, std::function<void()> body) {
+    TaskPlacement placement = {name, TASK_DEFAULT_STACK_SIZE, 1, tskNO_AFFINITY};
+    if (!GetPlacement(name, placement)) {
+        ESP_LOGW(TAG, "No placement for task %s, using %lu bytes of stack at priority 1", name, placement.stack_size);
+    }
+    if (placement.stack_size == 0) {
+        placement.stack_size = TASK_DEFAULT_STACK_SIZE;
+    }
+    return Create(name, placement.stack_size, placement.priority, stack, std::move(body), placement.core);
+}
+
+void TaskFactory::SetPlacement(const TaskPlacement& placement) {
+    TaskPlacement entry = placement;
+#if CONFIG_SOC_CPU_CORES_NUM == 1
+    entry.core = tskNO_AFFINITY;
+#endif
+    std::lock_guard<std::mutex> lock(placements_mutex);
+    for (auto& existing : placements) {
+        if (strcmp(existing.name, entry.name) == 0) {
+            existing = entry;
+            return;
+        }
+    }
+    placements.push_back(entry);
+}
+
+bool TaskFactory::GetPlacement(const char* name, TaskPlacement& placement) {
+    std::lock_guard<std::mutex> lock(placements_mutex);
+    for (auto& entry : placements) {
+        if (strcmp(entry.name, name) == 0) {
+            placement = entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskFactory::Delete(TaskHandle_t task) {
+    if (task == nullptr) {
+        return;
+    }
+    // Deleted before it goes off the list, so its body is not destroyed while it runs
+    vTaskDeleteWithCaps(task);
+    Unregister(task);
+}
+
+void TaskFactory::SetThreadStack(TaskStack stack, const char* placement) {
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    TaskPlacement entry;
+    if (placement != nullptr && GetPlacement(placement, entry)) {
+        cfg.thread_name = entry.name;
+        cfg.prio = entry.priority;
+        cfg.pin_to_core = entry.core;
+        if (entry.stack_size != 0) {
+            cfg.stack_size = entry.stack_size;
+        }
+    }
+    if (stack == kTaskStackPsram && heap_caps_get_free_size(MALLOC_CAP_SPIRAM) >= cfg.stack_size) {
+        cfg.stack_alloc_caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+    }
+    esp_pthread_set_cfg(&cfg);
+}
+
+void TaskFactory::PrintReport() {
+    std::lock_guard<std::mutex> lock(tasks_mutex);
+    for (auto& entry : tasks) {
+        if (entry.handle == nullptr) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-20s core: %c prio: %2u %s stack: %lu min free: %u", entry.name,
+            entry.core == tskNO_AFFINITY ? '*' : (char)('0' + entry.core), (unsigned)entry.priority,
+            entry.psram ? "psram" : "internal", entry.stack_size, (unsigned)uxTaskGetStackHighWaterMark(entry.handle));
+    }
+#if CONFIG_USE_TASK_LATENCY_PROBE
+    PrintLatencyReport();
+#endif
+}
+
+#if CONFIG_USE_TASK_LATENCY_PROBE
+void TaskFactory::StartLatencyProbe() {
+    if (probe_timer != nullptr) {
+        return;
+    }
+    static const char* const kProbeNames[] = {"latency_probe0", "latency_probe1"};
+    TaskPlacement output = {"audio_output", 0, 4, tskNO_AFFINITY};
+    GetPlacement("audio_output", output);
+    for (int core = 0; core < CONFIG_SOC_CPU_CORES_NUM; core++) {
+        auto& probe = probes[core];
+        probe.latency_us = Metrics::GetInstance().AddHistogram("sched.latency_us.core" + std::to_string(core));
+        probe.task = Create(kProbeNames[core], 2048, output.priority, kTaskStackInternal, [&probe]() {
+            while (true) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                uint32_t latency = esp_timer_get_time() - probe_wake_us;
+                probe.latency_us->Record(latency);
+                uint32_t max = probe.max_us;
+                while (latency > max && !probe.max_us.compare_exchange_weak(max, latency)) {
+                }
+            }
+        }, core);
+    }
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            probe_wake_us = esp_timer_get_time();
+            for (auto& probe : probes) {
+                if (probe.task != nullptr) {
+                    xTaskNotifyGive(probe.task);
+                }
+            }
+        },
+        .arg = nullptr,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "latency_probe",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &probe_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(probe_timer, CONFIG_TASK_LATENCY_PROBE_PERIOD_MS * 1000));
+}
+#endif
+
+cJSON* TaskFactory::CreateJson() {
+    cJSON* json = cJSON_CreateObject();
+    std::lock_guard<std::mutex> lock(tasks_mutex);
+    for (auto& entry : tasks) {
+        if (entry.handle == nullptr) {
+            continue;
+        }
+        cJSON* item = cJSON_CreateArray();
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(entry.stack_size));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(uxTaskGetStackHighWaterMark(entry.handle)));
+        cJSON_AddItemToArray(item, cJSON_CreateBool(entry.psram));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(entry.core == tskNO_AFFINITY ? -1 : entry.core));
+        cJSON_AddItemToArray(item, cJSON_CreateNumber(entry.priority));
+        cJSON_AddItemToObject(json, entry.name, item);
+    }
+    return json;
+}
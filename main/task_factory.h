@@ -0,0 +1,75 @@
+#ifndef TASK_FACTORY_H
+#define TASK_FACTORY_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cstdint>
+#include <functional>
+
+struct cJSON;
+
+/*
+ * Where a task keeps its stack.
+ *
+ * - kTaskStackPsram: tasks that never run with the flash cache disabled, i.e. never write or
+ *   erase flash themselves (no Settings / NVS commits, no OTA or partition writes). Audio codec,
+ *   AFE and camera encoder tasks. Internal RAM is used where the board has no PSRAM.
+ * - kTaskStackInternal: everything else, and tasks with tight timing.
+ */
+enum TaskStack {
+    kTaskStackInternal,
+    kTaskStackPsram,
+};
+
+/*
+ * Core, priority and stack size of a long-lived task. The defaults of every chip are in the table
+ * in task_factory.cc, a board changes them with SetPlacement() in its constructor, before the
+ * tasks start. On dual-core chips Wi-Fi runs on core 0 and LVGL on core 1, so which task shares
+ * a core with them is read off that table and nowhere else.
+ */
+struct TaskPlacement {
+    const char* name;
+    uint32_t stack_size;    // 0 keeps the size chosen by whoever creates the task
+    UBaseType_t priority;
+    BaseType_t core;        // tskNO_AFFINITY to let the scheduler pick
+};
+
+/*
+ * Creates tasks with their stack placed as asked, and keeps a list of the tasks it created
+ * so their stack high-water marks can be logged and the sizes tuned.
+ *
+ * The body may simply return, the task then deletes itself and its stack. A task created
+ * here has to be deleted by others with Delete(), never with vTaskDelete().
+ */
+class TaskFactory {
+public:
+    // nullptr if the task could not be created
+    static TaskHandle_t Create(const char* name, uint32_t stack_size, UBaseType_t priority, TaskStack stack,
+        std::function<void()> body, BaseType_t core = tskNO_AFFINITY);
+    // Core, priority and stack size come from the placement table
+    static TaskHandle_t Create(const char* name, TaskStack stack, std::function<void()> body);
+    static void Delete(TaskHandle_t task);
+
+    // Replaces the placement of a task, or adds one
+    static void SetPlacement(const TaskPlacement& placement);
+    // False when the table has no such task, placement is left as it was then
+    static bool GetPlacement(const char* name, TaskPlacement& placement);
+
+    // Stack placement of the std::threads the calling task creates from now on, at the default size,
+    // or with the core, priority and stack size of the named placement
+    static void SetThreadStack(TaskStack stack, const char* placement = nullptr);
+
+    // Stack size, placement, core, priority and the least free stack so far of every task alive,
+    // and the scheduling latency of each core with CONFIG_USE_TASK_LATENCY_PROBE
+    static void PrintReport();
+    static cJSON* CreateJson();
+
+#if CONFIG_USE_TASK_LATENCY_PROBE
+    // Wakes a probe task on every core each CONFIG_TASK_LATENCY_PROBE_PERIOD_MS and records how long it
+    // waited to run, as the sched.latency_us.core<n> histograms
+    static void StartLatencyProbe();
+#endif
+};
+
+#endif // TASK_FACTORY_H
@@ -0,0 +1,141 @@
+#include "timer_wheel.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "TimerWheel"
+
+TimerWheel::TimerWheel() {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<TimerWheel*>(arg)->Dispatch();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "timer_wheel",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &wakeup_timer_));
+}
+
+TimerWheel::~TimerWheel() {
+    esp_timer_stop(wakeup_timer_);
+    esp_timer_delete(wakeup_timer_);
+    for (auto timer : timers_) {
+        delete timer;
+    }
+}
+
+TimerWheel::Handle TimerWheel::Create(const char* name, std::function<void()> callback) {
+    auto timer = new Timer;
+    timer->name = name;
+    timer->callback = std::move(callback);
+    std::lock_guard<std::mutex> lock(mutex_);
+    timers_.push_back(timer);
+    return timer;
+}
+
+void TimerWheel::StartPeriodic(Handle timer, uint64_t period_us, uint64_t slack_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    timer->period_us = period_us;
+    timer->slack_us = slack_us;
+    // The first tick comes on the next multiple of the period
+    timer->due_us = (now / period_us + 1) * period_us;
+    timer->active = true;
+    Reschedule();
+}
+
+void TimerWheel::StartOnce(Handle timer, uint64_t delay_us, uint64_t slack_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    timer->period_us = 0;
+    timer->slack_us = slack_us;
+    timer->due_us = esp_timer_get_time() + delay_us;
+    timer->active = true;
+    Reschedule();
+}
+
+void TimerWheel::Stop(Handle timer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    timer->active = false;
+    Reschedule();
+}
+
+void TimerWheel::Delete(Handle timer) {
+    if (timer == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    timer->active = false;
+    timer->deleted = true;
+    // Freed by Dispatch() if its callback may be about to run
+    if (!dispatching_) {
+        timers_.erase(std::remove(timers_.begin(), timers_.end(), timer), timers_.end());
+        delete timer;
+    }
+    Reschedule();
+}
+
+// Called with mutex_ held, arms the wakeup for the timer that can wait the least
+void TimerWheel::Reschedule() {
+    if (dispatching_) {
+        return;
+    }
+    int64_t wakeup = INT64_MAX;
+    for (auto timer : timers_) {
+        if (timer->active) {
+            wakeup = std::min(wakeup, timer->due_us + (int64_t)timer->slack_us);
+        }
+    }
+    esp_timer_stop(wakeup_timer_);
+    if (wakeup != INT64_MAX) {
+        int64_t delay = wakeup - esp_timer_get_time();
+        esp_timer_start_once(wakeup_timer_, delay > 0 ? delay : 0);
+    }
+}
+
+void TimerWheel::Dispatch() {
+    std::vector<Timer*> expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        dispatching_ = true;
+        int64_t now = esp_timer_get_time();
+        // Everything already due goes in this wakeup, even if its slack would let it wait
+        for (auto timer : timers_) {
+            if (!timer->active || timer->due_us > now) {
+                continue;
+            }
+            expired.push_back(timer);
+            if (timer->period_us > 0) {
+                // Missed ticks are skipped, as with skip_unhandled_events
+                while (timer->due_us <= now) {
+                    timer->due_us += timer->period_us;
+                }
+            } else {
+                timer->active = false;
+            }
+        }
+    }
+
+    for (auto timer : expired) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (timer->deleted) {
+                continue;
+            }
+        }
+        timer->callback();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    dispatching_ = false;
+    for (auto it = timers_.begin(); it != timers_.end();) {
+        if ((*it)->deleted) {
+            delete *it;
+            it = timers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    Reschedule();
+}
@@ -0,0 +1,62 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <esp_timer.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/**
+ * TimerWheel - One esp_timer shared by the periodic and delayed work of several components
+ *
+ * Every timer has a slack: its callback may run up to that much after its deadline, so that
+ * timers due close together are handled in a single wakeup. Periodic timers are aligned to
+ * multiples of their period, so timers with the same period always tick together.
+ * Callbacks run on the esp_timer task, like ESP_TIMER_TASK callbacks.
+ */
+class TimerWheel {
+public:
+    struct Timer;
+    using Handle = Timer*;
+
+    static TimerWheel& GetInstance() {
+        static TimerWheel instance;
+        return instance;
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Creates a stopped timer
+    Handle Create(const char* name, std::function<void()> callback);
+    void StartPeriodic(Handle timer, uint64_t period_us, uint64_t slack_us = 0);
+    void StartOnce(Handle timer, uint64_t delay_us, uint64_t slack_us = 0);
+    void Stop(Handle timer);
+    void Delete(Handle timer);
+
+    struct Timer {
+        const char* name;
+        std::function<void()> callback;
+        int64_t due_us = 0;
+        uint64_t period_us = 0;     // 0 for a one-shot timer
+        uint64_t slack_us = 0;
+        bool active = false;
+        bool deleted = false;
+    };
+
+private:
+    TimerWheel();
+    ~TimerWheel();
+
+    std::mutex mutex_;
+    std::vector<Timer*> timers_;
+    esp_timer_handle_t wakeup_timer_ = nullptr;
+    bool dispatching_ = false;
+
+    void Dispatch();
+    void Reschedule();
+};
+
+#endif // TIMER_WHEEL_H
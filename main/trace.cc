@@ -0,0 +1,268 @@
+#include "trace.h"
+
+#if CONFIG_USE_TRACE
+#include "device_state_machine.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mbedtls/base64.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#endif
+
+#define TAG "Trace"
+
+#if CONFIG_USE_TRACE
+
+static_assert(sizeof(TraceEvent) == 16, "TraceEvent is 16 bytes in the dump format");
+
+// Dump records, all little endian and starting with TRACE_MAGIC and a record type:
+//   'H' version:u8 cores:u8 reserved:u8 ring_size:u32 now_us:u32
+//       point_count:u8 names... state_count:u8 names... task_count:u16 (number:u16 name)...
+//       with NUL terminated names
+//   'E' core:u8 count:u16 TraceEvent[count]
+//   'F' end of dump
+#define TRACE_MAGIC "XZTR"
+#define TRACE_DUMP_VERSION 1
+#define TRACE_EVENTS_PER_RECORD 64
+
+struct TraceRing {
+    TraceEvent* events = nullptr;
+    std::atomic<uint32_t> head{0};
+};
+
+static const char* const TRACE_POINT_NAMES[] = {
+    "state",
+    "wake_word",
+    "audio_channel_open",
+    "hello",
+    "tts",
+    "encode",
+    "decode",
+    "display_render",
+    "display_flush_wait",
+};
+static_assert(sizeof(TRACE_POINT_NAMES) / sizeof(TRACE_POINT_NAMES[0]) == kTracePointCount,
+    "Every trace point needs a name");
+
+static TraceRing rings_[CONFIG_FREERTOS_NUMBER_OF_CORES];
+static uint32_t ring_size_ = 0;
+static std::atomic<bool> recording_{false};
+// Trace ids handed to tasks with vTaskSetTaskNumber() on their first event, 0 is no id yet
+static std::atomic<uint16_t> next_task_id_{1};
+static std::mutex dump_mutex_;
+
+void Trace::Start() {
+    if (ring_size_ != 0) {
+        return;
+    }
+    uint32_t size = 1;
+    while (size * 2 <= CONFIG_TRACE_RING_EVENTS) {
+        size *= 2;
+    }
+    for (auto& ring : rings_) {
+        ring.events = (TraceEvent*)heap_caps_calloc(size, sizeof(TraceEvent), MALLOC_CAP_SPIRAM);
+        if (ring.events == nullptr) {
+            ring.events = (TraceEvent*)heap_caps_calloc(size, sizeof(TraceEvent), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        }
+        if (ring.events == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate %u trace events", (unsigned)size);
+            return;
+        }
+    }
+    ring_size_ = size;
+    recording_.store(true, std::memory_order_release);
+    ESP_LOGI(TAG, "Recording %u events per core", (unsigned)size);
+}
+
+void Trace::Record(TracePoint point, TraceType type, int32_t value) {
+    if (!recording_.load(std::memory_order_acquire)) {
+        return;
+    }
+    int core = esp_cpu_get_core_id();
+    auto& ring = rings_[core];
+    uint32_t index = ring.head.fetch_add(1, std::memory_order_relaxed) & (ring_size_ - 1);
+    auto& event = ring.events[index];
+    event.time_us = (uint32_t)esp_timer_get_time();
+    event.point = point;
+    event.type = type;
+    event.core = core;
+    event.value = value;
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    UBaseType_t id = uxTaskGetTaskNumber(task);
+    if (id == 0) {
+        id = next_task_id_.fetch_add(1, std::memory_order_relaxed);
+        vTaskSetTaskNumber(task, id);
+    }
+    event.task = (uint16_t)id;
+    event.reserved = 0;
+}
+
+class TraceSink {
+public:
+    TraceSink() {
+        std::string server_addr = CONFIG_TRACE_UDP_SERVER;
+        if (server_addr.empty()) {
+            return;
+        }
+        size_t colon_pos = server_addr.find(':');
+        if (colon_pos == std::string::npos) {
+            ESP_LOGW(TAG, "Invalid server address: %s, should be IP:PORT", CONFIG_TRACE_UDP_SERVER);
+            return;
+        }
+        memset(&server_, 0, sizeof(server_));
+        server_.sin_family = AF_INET;
+        server_.sin_port = htons(std::stoi(server_addr.substr(colon_pos + 1)));
+        inet_pton(AF_INET, server_addr.substr(0, colon_pos).c_str(), &server_.sin_addr);
+        sockfd_ = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd_ < 0) {
+            ESP_LOGW(TAG, "Failed to create UDP socket: %d", errno);
+        }
+    }
+
+    ~TraceSink() {
+        if (sockfd_ >= 0) {
+            close(sockfd_);
+        }
+    }
+
+    bool ok() const { return sockfd_ >= 0 || std::string(CONFIG_TRACE_UDP_SERVER).empty(); }
+
+    bool Send(const std::string& record) {
+        if (sockfd_ >= 0) {
+            if (sendto(sockfd_, record.data(), record.size(), 0, (struct sockaddr*)&server_, sizeof(server_)) < 0) {
+                ESP_LOGW(TAG, "Failed to send trace to %s: %d", CONFIG_TRACE_UDP_SERVER, errno);
+                return false;
+            }
+            // Gives the receiver time to keep up, UDP drops records otherwise
+            vTaskDelay(pdMS_TO_TICKS(2));
+            return true;
+        }
+        // Console lines for scripts/trace_viewer.py --log
+        size_t length = 0;
+        mbedtls_base64_encode(nullptr, 0, &length, (const unsigned char*)record.data(), record.size());
+        std::vector<unsigned char> line(length);
+        if (mbedtls_base64_encode(line.data(), line.size(), &length, (const unsigned char*)record.data(), record.size()) != 0) {
+            return false;
+        }
+        printf("XZTRACE:%.*s\n", (int)length, (const char*)line.data());
+        return true;
+    }
+
+private:
+    int sockfd_ = -1;
+    struct sockaddr_in server_;
+};
+
+template <typename T>
+static void Append(std::string& record, T value) {
+    record.append((const char*)&value, sizeof(value));
+}
+
+static std::string BuildHeader() {
+    std::string record = TRACE_MAGIC "H";
+    Append<uint8_t>(record, TRACE_DUMP_VERSION);
+    Append<uint8_t>(record, CONFIG_FREERTOS_NUMBER_OF_CORES);
+    Append<uint8_t>(record, 0);
+    Append<uint32_t>(record, ring_size_);
+    Append<uint32_t>(record, (uint32_t)esp_timer_get_time());
+
+    Append<uint8_t>(record, kTracePointCount);
+    for (auto name : TRACE_POINT_NAMES) {
+        record.append(name, strlen(name) + 1);
+    }
+    Append<uint8_t>(record, kDeviceStateFatalError + 1);
+    for (int state = 0; state <= kDeviceStateFatalError; state++) {
+        const char* name = DeviceStateMachine::GetStateName((DeviceState)state);
+        record.append(name, strlen(name) + 1);
+    }
+
+    UBaseType_t size = uxTaskGetNumberOfTasks() + 5;
+    std::vector<TaskStatus_t> tasks(size);
+    size = uxTaskGetSystemState(tasks.data(), size, nullptr);
+    // Only the tasks that recorded an event have an id, xTaskNumber is the TCB number instead
+    std::string names;
+    uint16_t named = 0;
+    for (UBaseType_t i = 0; i < size; i++) {
+        UBaseType_t id = uxTaskGetTaskNumber(tasks[i].xHandle);
+        if (id == 0) {
+            continue;
+        }
+        Append<uint16_t>(names, id);
+        names.append(tasks[i].pcTaskName, strlen(tasks[i].pcTaskName) + 1);
+        named++;
+    }
+    Append<uint16_t>(record, named);
+    record += names;
+    return record;
+}
+
+bool Trace::Dump() {
+    std::lock_guard<std::mutex> lock(dump_mutex_);
+    if (ring_size_ == 0) {
+        return false;
+    }
+    TraceSink sink;
+    if (!sink.ok()) {
+        return false;
+    }
+
+    recording_.store(false, std::memory_order_release);
+    // Lets a Record() that already passed the check finish its store
+    vTaskDelay(1);
+
+    bool ok = sink.Send(BuildHeader());
+    size_t total = 0;
+    for (int core = 0; core < CONFIG_FREERTOS_NUMBER_OF_CORES && ok; core++) {
+        auto& ring = rings_[core];
+        uint32_t head = ring.head.load(std::memory_order_relaxed);
+        uint32_t count = head < ring_size_ ? head : ring_size_;
+        uint32_t index = head - count;
+        while (count > 0 && ok) {
+            uint16_t n = count < TRACE_EVENTS_PER_RECORD ? count : TRACE_EVENTS_PER_RECORD;
+            std::string record = TRACE_MAGIC "E";
+            Append<uint8_t>(record, core);
+            Append<uint16_t>(record, n);
+            for (uint16_t i = 0; i < n; i++) {
+                Append(record, ring.events[(index + i) & (ring_size_ - 1)]);
+            }
+            ok = sink.Send(record);
+            index += n;
+            count -= n;
+            total += n;
+        }
+    }
+    if (ok) {
+        ok = sink.Send(TRACE_MAGIC "F");
+    }
+
+    recording_.store(true, std::memory_order_release);
+    ESP_LOGI(TAG, "Dumped %u events", (unsigned)total);
+    return ok;
+}
+
+#else
+
+void Trace::Start() {
+}
+
+void Trace::Record(TracePoint point, TraceType type, int32_t value) {
+}
+
+bool Trace::Dump() {
+    return false;
+}
+
+#endif
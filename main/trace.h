@@ -0,0 +1,87 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+
+#include <sdkconfig.h>
+
+// Trace points, their names travel in the dump header so the host script needs no copy of this list
+enum TracePoint : uint16_t {
+    kTracePointDeviceState,       // Instant, value is the new DeviceState
+    kTracePointWakeWord,          // Instant
+    kTracePointAudioChannelOpen,  // Begin / end around OpenAudioChannel()
+    kTracePointHello,             // Begin when the hello goes out, end when the server hello arrives
+    kTracePointTts,               // Instant per tts message, value is 0 start / 1 sentence / 2 stop
+    kTracePointEncode,            // Begin / end around one Opus encode
+    kTracePointDecode,            // Begin / end around one Opus decode
+    kTracePointDisplayRender,     // Begin / end around one LVGL refresh
+    kTracePointDisplayFlushWait,  // Begin / end while LVGL waits for the panel transfer
+    kTracePointCount,
+};
+
+enum TraceType : uint8_t {
+    kTraceBegin = 'B',
+    kTraceEnd = 'E',
+    kTraceInstant = 'I',
+    kTraceCounter = 'C',
+};
+
+// 16 bytes, written as is into the ring and into the dump
+struct TraceEvent {
+    uint32_t time_us;  // Low 32 bits of esp_timer_get_time()
+    uint16_t point;
+    uint8_t type;
+    uint8_t core;
+    int32_t value;
+    uint16_t task;     // FreeRTOS task number, the dump header maps it to the task name
+    uint16_t reserved;
+};
+
+/**
+ * Trace - Fixed binary trace events in one lock-free ring per core
+ *
+ * Recording is a relaxed fetch_add on the ring head of the current core and a 16 byte store, so
+ * it can stay in hot paths such as the codec tasks. The ring keeps the latest events and is
+ * dumped on request over UDP to CONFIG_TRACE_UDP_SERVER, or as base64 lines on the console when
+ * no server is set. scripts/trace_viewer.py turns the dump into Chrome / Perfetto trace JSON.
+ *
+ * Everything compiles away without CONFIG_USE_TRACE, use the TRACE_* macros at the call sites.
+ */
+class Trace {
+public:
+    // Allocates the rings, events recorded before are dropped
+    static void Start();
+    static void Record(TracePoint point, TraceType type, int32_t value = 0);
+    // Recording pauses while the rings are sent
+    static bool Dump();
+};
+
+#if CONFIG_USE_TRACE
+class TraceScope {
+public:
+    explicit TraceScope(TracePoint point) : point_(point) { Trace::Record(point_, kTraceBegin); }
+    ~TraceScope() { Trace::Record(point_, kTraceEnd); }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    TracePoint point_;
+};
+
+#define TRACE_BEGIN(point) Trace::Record(point, kTraceBegin)
+#define TRACE_END(point) Trace::Record(point, kTraceEnd)
+#define TRACE_INSTANT(point, value) Trace::Record(point, kTraceInstant, value)
+#define TRACE_COUNTER(point, value) Trace::Record(point, kTraceCounter, value)
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(point) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(point)
+#else
+#define TRACE_BEGIN(point) do {} while (0)
+#define TRACE_END(point) do {} while (0)
+#define TRACE_INSTANT(point, value) do {} while (0)
+#define TRACE_COUNTER(point, value) do {} while (0)
+#define TRACE_SCOPE(point) do {} while (0)
+#endif
+
+#endif // TRACE_H
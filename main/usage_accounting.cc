@@ -0,0 +1,348 @@
+#include "usage_accounting.h"
+
+#if CONFIG_USE_USAGE_ACCOUNTING
+#include "device_state_machine.h"
+#include "settings.h"
+#include "timer_wheel.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_app_desc.h>
+#include <cJSON.h>
+
+#include <algorithm>
+#include <cstring>
+#endif
+
+#define TAG "UsageAccounting"
+
+#if CONFIG_USE_USAGE_ACCOUNTING
+
+#define USAGE_SAMPLE_INTERVAL_MS 10000
+#define USAGE_SAMPLE_SLACK_MS 2000
+// Summaries go to Settings every this many samples, about every 30 minutes
+#define USAGE_SAMPLES_PER_SAVE 180
+
+static const char* const kUsageNames[kUsageCount] = {
+    "front_end", "codec", "network", "display", "mcp", "system", "idle",
+};
+
+// First match wins, by prefix of the task name
+static const struct {
+    const char* prefix;
+    UsageSubsystem subsystem;
+} kTaskSubsystems[] = {
+    {"audio_input", kUsageFrontEnd},
+    {"audio_front_end", kUsageFrontEnd},
+    {"audio_communication", kUsageFrontEnd},
+    {"audio_detection", kUsageFrontEnd},
+    {"encode_wake_word", kUsageFrontEnd},
+    {"afe", kUsageFrontEnd},
+    {"AFE", kUsageFrontEnd},
+    {"audio_output", kUsageCodec},
+    {"opus_", kUsageCodec},
+    {"audio_sender", kUsageNetwork},
+    {"ws_control", kUsageNetwork},
+    {"tiT", kUsageNetwork},
+    {"wifi", kUsageNetwork},
+    {"mqtt", kUsageNetwork},
+    {"sys_evt", kUsageNetwork},
+    {"taskLVGL", kUsageDisplay},
+    {"emote", kUsageDisplay},
+    {"jpeg_encoder", kUsageDisplay},
+    // Background tool calls, what one runs after the last sample before it exits is not counted
+    {"mcp_tool", kUsageMcp},
+    {"IDLE", kUsageIdle},
+};
+
+UsageSubsystem UsageAccounting::GetTaskSubsystem(const char* task_name) {
+    for (auto& entry : kTaskSubsystems) {
+        if (strncmp(task_name, entry.prefix, strlen(entry.prefix)) == 0) {
+            return entry.subsystem;
+        }
+    }
+    return kUsageSystem;
+}
+
+void UsageAccounting::Start(DeviceStateMachine& state_machine) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (started_) {
+            return;
+        }
+        started_ = true;
+        state_ = state_machine.GetState();
+        state_since_us_ = esp_timer_get_time();
+        Load();
+    }
+    // Run time counted from here on
+    Sample();
+
+    state_machine.AddStateChangeListener([this](DeviceState old_state, DeviceState new_state) {
+        ChangeState(new_state);
+    });
+    auto timer = TimerWheel::GetInstance().Create("usage_sample", [this]() {
+        Sample();
+        if (++samples_since_save_ >= USAGE_SAMPLES_PER_SAVE) {
+            samples_since_save_ = 0;
+            Save();
+        }
+    });
+    TimerWheel::GetInstance().StartPeriodic(timer, USAGE_SAMPLE_INTERVAL_MS * 1000, USAGE_SAMPLE_SLACK_MS * 1000);
+    ESP_LOGI(TAG, "Accounting firmware %s", version_.c_str());
+}
+
+void UsageAccounting::Charge(UsageSubsystem from, UsageSubsystem to, uint32_t run_time) {
+    if (from != to) {
+        charges_[from][to].fetch_add(run_time, std::memory_order_relaxed);
+    }
+}
+
+void UsageAccounting::Sample() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SampleLocked();
+}
+
+// What happened up to the change belongs to the state the device was in until then
+void UsageAccounting::ChangeState(DeviceState next_state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SampleLocked();
+    state_ = next_state;
+}
+
+// Called with mutex_ held, so the snapshots are applied in the order they were taken
+void UsageAccounting::SampleLocked() {
+    if (!started_) {
+        return;
+    }
+    UBaseType_t size = uxTaskGetNumberOfTasks() + 5;
+    std::vector<TaskStatus_t> tasks(size);
+    configRUN_TIME_COUNTER_TYPE total_run_time = 0;
+    size = uxTaskGetSystemState(tasks.data(), size, &total_run_time);
+    int64_t now = esp_timer_get_time();
+
+    auto& usage = states_[state_];
+    usage.wall_us += now - state_since_us_;
+    bool first = last_total_run_time_ == 0;
+    uint32_t elapsed = (uint32_t)total_run_time - last_total_run_time_;
+    if (!first) {
+        usage.elapsed += (uint64_t)elapsed * CONFIG_FREERTOS_NUMBER_OF_CORES;
+    }
+
+    std::vector<TaskRunTime> run_times;
+    run_times.reserve(size);
+    for (UBaseType_t i = 0; i < size; i++) {
+        auto& task = tasks[i];
+        uint32_t run_time = (uint32_t)task.ulRunTimeCounter;
+        // Tasks created since the previous sample are counted from their start
+        uint32_t previous = 0;
+        for (auto& last : last_run_times_) {
+            if (last.handle == task.xHandle) {
+                previous = last.run_time;
+                break;
+            }
+        }
+        run_times.push_back({task.xHandle, run_time});
+        // A task cannot run longer than the time since the last sample. More means a new task was
+        // created in the TCB of a deleted one and its counter started over.
+        uint32_t gained = run_time - previous;
+        if (gained > elapsed) {
+            gained = run_time;
+        }
+        if (!first) {
+            usage.cpu[GetTaskSubsystem(task.pcTaskName)] += gained;
+        }
+    }
+    for (int from = 0; from < kUsageCount; from++) {
+        for (int to = 0; to < kUsageCount; to++) {
+            uint32_t charged = charges_[from][to].exchange(0, std::memory_order_relaxed);
+            charged = std::min<uint64_t>(charged, usage.cpu[from]);
+            usage.cpu[from] -= charged;
+            usage.cpu[to] += charged;
+        }
+    }
+    for (int i = 0; i < kHeapSubsystemCount; i++) {
+        uint32_t in_use = HeapPlacement::InUse((HeapSubsystem)i);
+        usage.heap_peak[i] = std::max(usage.heap_peak[i], in_use);
+    }
+
+    last_run_times_ = std::move(run_times);
+    last_total_run_time_ = (uint32_t)total_run_time;
+    state_since_us_ = now;
+}
+
+// Called with mutex_ held
+UsageAccounting::Summary UsageAccounting::Merge(int state) {
+    Summary summary = stored_[state];
+    auto& usage = states_[state];
+    double seconds = usage.wall_us / 1000000.0;
+    double total = summary.seconds + seconds;
+    for (int i = 0; i < kUsageCount; i++) {
+        double percent = usage.elapsed > 0 ? usage.cpu[i] * 100.0 / usage.elapsed : 0;
+        summary.cpu[i] = total > 0 ? (summary.cpu[i] * summary.seconds + percent * seconds) / total : 0;
+    }
+    for (int i = 0; i < kHeapSubsystemCount; i++) {
+        summary.heap_kb[i] = std::max(summary.heap_kb[i], (usage.heap_peak[i] + 1023) / 1024);
+    }
+    summary.seconds = total;
+    return summary;
+}
+
+cJSON* UsageAccounting::SummaryToJson(const Summary* summaries) {
+    cJSON* json = cJSON_CreateObject();
+    for (int state = 0; state <= kDeviceStateFatalError; state++) {
+        auto& summary = summaries[state];
+        if (summary.seconds < 1) {
+            continue;
+        }
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "s", (int64_t)summary.seconds);
+        cJSON* cpu = cJSON_CreateObject();
+        for (int i = 0; i < kUsageCount; i++) {
+            // One decimal is plenty and keeps the stored JSON short
+            cJSON_AddNumberToObject(cpu, kUsageNames[i], (int)(summary.cpu[i] * 10 + 0.5) / 10.0);
+        }
+        cJSON_AddItemToObject(item, "cpu", cpu);
+        cJSON* heap = cJSON_CreateObject();
+        for (int i = 0; i < kHeapSubsystemCount; i++) {
+            cJSON_AddNumberToObject(heap, HeapPlacement::GetSubsystemName((HeapSubsystem)i), summary.heap_kb[i]);
+        }
+        cJSON_AddItemToObject(item, "heap_kb", heap);
+        cJSON_AddItemToObject(json, DeviceStateMachine::GetStateName((DeviceState)state), item);
+    }
+    return json;
+}
+
+void UsageAccounting::SummaryFromJson(cJSON* json, Summary* summaries) {
+    for (int state = 0; state <= kDeviceStateFatalError; state++) {
+        cJSON* item = cJSON_GetObjectItem(json, DeviceStateMachine::GetStateName((DeviceState)state));
+        if (!cJSON_IsObject(item)) {
+            continue;
+        }
+        auto& summary = summaries[state];
+        summary.seconds = cJSON_GetNumberValue(cJSON_GetObjectItem(item, "s"));
+        cJSON* cpu = cJSON_GetObjectItem(item, "cpu");
+        for (int i = 0; i < kUsageCount; i++) {
+            cJSON* value = cJSON_GetObjectItem(cpu, kUsageNames[i]);
+            summary.cpu[i] = cJSON_IsNumber(value) ? value->valuedouble : 0;
+        }
+        cJSON* heap = cJSON_GetObjectItem(item, "heap_kb");
+        for (int i = 0; i < kHeapSubsystemCount; i++) {
+            cJSON* value = cJSON_GetObjectItem(heap, HeapPlacement::GetSubsystemName((HeapSubsystem)i));
+            summary.heap_kb[i] = cJSON_IsNumber(value) ? value->valueint : 0;
+        }
+    }
+}
+
+// Called with mutex_ held. A new firmware moves the stored summary aside as the previous version
+void UsageAccounting::Load() {
+    version_ = esp_app_get_description()->version;
+    Settings settings("usage", true);
+    std::string stored_version = settings.GetString("version");
+    if (stored_version == version_) {
+        cJSON* json = cJSON_Parse(settings.GetString("summary").c_str());
+        SummaryFromJson(json, stored_);
+        cJSON_Delete(json);
+        return;
+    }
+    if (!stored_version.empty()) {
+        settings.SetString("prev_version", stored_version);
+        settings.SetString("prev_summary", settings.GetString("summary"));
+    }
+    settings.SetString("version", version_);
+    settings.SetString("summary", "{}");
+}
+
+void UsageAccounting::Save() {
+    Summary summaries[kDeviceStateFatalError + 1];
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int state = 0; state <= kDeviceStateFatalError; state++) {
+            summaries[state] = Merge(state);
+        }
+    }
+    cJSON* json = SummaryToJson(summaries);
+    char* str = cJSON_PrintUnformatted(json);
+    Settings settings("usage", true);
+    settings.SetString("summary", str);
+    cJSON_free(str);
+    cJSON_Delete(json);
+}
+
+cJSON* UsageAccounting::CreateJson() {
+    Sample();
+    Summary summaries[kDeviceStateFatalError + 1];
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int state = 0; state <= kDeviceStateFatalError; state++) {
+            summaries[state] = Merge(state);
+        }
+    }
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "version", version_.c_str());
+    cJSON_AddItemToObject(json, "states", SummaryToJson(summaries));
+
+    Settings settings("usage", false);
+    std::string previous_version = settings.GetString("prev_version");
+    if (!previous_version.empty()) {
+        cJSON* previous = cJSON_CreateObject();
+        cJSON_AddStringToObject(previous, "version", previous_version.c_str());
+        cJSON* states = cJSON_Parse(settings.GetString("prev_summary").c_str());
+        cJSON_AddItemToObject(previous, "states", states != nullptr ? states : cJSON_CreateObject());
+        cJSON_AddItemToObject(json, "previous", previous);
+    }
+    return json;
+}
+
+void UsageAccounting::PrintReport() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SampleLocked();
+    for (int state = 0; state <= kDeviceStateFatalError; state++) {
+        Summary summary = Merge(state);
+        if (summary.seconds < 1) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-16s %6ds cpu%%: front_end %.1f codec %.1f network %.1f display %.1f mcp %.1f system %.1f",
+            DeviceStateMachine::GetStateName((DeviceState)state), (int)summary.seconds, summary.cpu[kUsageFrontEnd],
+            summary.cpu[kUsageCodec], summary.cpu[kUsageNetwork], summary.cpu[kUsageDisplay], summary.cpu[kUsageMcp],
+            summary.cpu[kUsageSystem]);
+    }
+}
+
+UsageScope::UsageScope(UsageSubsystem subsystem)
+    : subsystem_(subsystem),
+      task_subsystem_(UsageAccounting::GetTaskSubsystem(pcTaskGetName(nullptr))),
+      start_((uint32_t)ulTaskGetRunTimeCounter(nullptr)) {
+}
+
+UsageScope::~UsageScope() {
+    uint32_t run_time = (uint32_t)ulTaskGetRunTimeCounter(nullptr) - start_;
+    UsageAccounting::GetInstance().Charge(task_subsystem_, subsystem_, run_time);
+}
+
+#else
+
+void UsageAccounting::Start(DeviceStateMachine& state_machine) {
+}
+
+void UsageAccounting::Charge(UsageSubsystem from, UsageSubsystem to, uint32_t run_time) {
+}
+
+UsageSubsystem UsageAccounting::GetTaskSubsystem(const char* task_name) {
+    return kUsageSystem;
+}
+
+cJSON* UsageAccounting::CreateJson() {
+    return nullptr;
+}
+
+void UsageAccounting::PrintReport() {
+}
+
+UsageScope::UsageScope(UsageSubsystem subsystem) {
+}
+
+UsageScope::~UsageScope() {
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef USAGE_ACCOUNTING_H
+#define USAGE_ACCOUNTING_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sdkconfig.h>
+
+#include "device_state.h"
+#include "heap_placement.h"
+
+struct cJSON;
+class DeviceStateMachine;
+
+// Where CPU time goes, tasks are assigned by name in usage_accounting.cc
+enum UsageSubsystem {
+    kUsageFrontEnd,  // Microphone input, AFE, wake word
+    kUsageCodec,     // Opus encode / decode and the speaker output
+    kUsageNetwork,   // Wi-Fi, lwIP, the protocol and the uplink
+    kUsageDisplay,   // LVGL, emote and the camera encoder
+    kUsageMcp,       // Tool calls, charged with UsageScope on whatever task runs them
+    kUsageSystem,    // The main task and everything else
+    kUsageIdle,
+    kUsageCount,
+};
+
+/**
+ * UsageAccounting - CPU time and heap per subsystem, split by device state
+ *
+ * Every 10 seconds and on every state change, the run time each task gained since the previous
+ * sample is added to its subsystem under the state the device was in, together with the wall
+ * time in that state. The heap in use of every HeapPlacement subsystem is sampled at the same
+ * points and the highest sample is kept per state, a sampled peak that misses short spikes. So "how much CPU does speaking cost on this board" is the speaking row.
+ *
+ * The summary accumulates over boots of the same firmware in Settings, and the summary of the
+ * previous firmware version is kept next to it, so a regression shows as a difference between
+ * the two. CreateJson() returns both, as
+ * {"version":..,"states":{state:{"s":seconds,"cpu":{subsystem:percent},"heap_kb":{subsystem:sampled_peak}}},
+ *  "previous":{"version":..,"states":..}} with percent of all cores.
+ */
+class UsageAccounting {
+public:
+    static UsageAccounting& GetInstance() {
+        static UsageAccounting instance;
+        return instance;
+    }
+
+    UsageAccounting(const UsageAccounting&) = delete;
+    UsageAccounting& operator=(const UsageAccounting&) = delete;
+
+    // Follows the state machine and starts sampling
+    void Start(DeviceStateMachine& state_machine);
+    // Moves run time of a task from the subsystem of the task to another, see UsageScope
+    void Charge(UsageSubsystem from, UsageSubsystem to, uint32_t run_time);
+    static UsageSubsystem GetTaskSubsystem(const char* task_name);
+
+    cJSON* CreateJson();
+    void PrintReport();
+
+private:
+    UsageAccounting() = default;
+
+    struct StateUsage {
+        int64_t wall_us = 0;
+        uint64_t elapsed = 0;           // Run time counter ticks of all cores together
+        uint64_t cpu[kUsageCount] = {};
+        uint32_t heap_peak[kHeapSubsystemCount] = {};  // Highest sample, not the true peak
+    };
+    // What earlier boots of this firmware had, as stored
+    struct Summary {
+        double seconds = 0;
+        double cpu[kUsageCount] = {};   // Percent of all cores
+        uint32_t heap_kb[kHeapSubsystemCount] = {};
+    };
+    struct TaskRunTime {
+        TaskHandle_t handle;
+        uint32_t run_time;
+    };
+
+    std::mutex mutex_;
+    bool started_ = false;
+    DeviceState state_ = kDeviceStateUnknown;
+    int64_t state_since_us_ = 0;
+    uint32_t last_total_run_time_ = 0;
+    std::vector<TaskRunTime> last_run_times_;
+    std::atomic<uint32_t> charges_[kUsageCount][kUsageCount] = {};
+    StateUsage states_[kDeviceStateFatalError + 1];
+    Summary stored_[kDeviceStateFatalError + 1];
+    std::string version_;
+    int samples_since_save_ = 0;
+
+    void Sample();
+    void ChangeState(DeviceState next_state);
+    void SampleLocked();
+    void Load();
+    void Save();
+    Summary Merge(int state);
+    static cJSON* SummaryToJson(const Summary* summaries);
+    static void SummaryFromJson(cJSON* json, Summary* summaries);
+};
+
+// Charges the run time the calling task spends in the scope to a subsystem instead of its own
+class UsageScope {
+public:
+    explicit UsageScope(UsageSubsystem subsystem);
+    ~UsageScope();
+
+    UsageScope(const UsageScope&) = delete;
+    UsageScope& operator=(const UsageScope&) = delete;
+
+private:
+#if CONFIG_USE_USAGE_ACCOUNTING
+    UsageSubsystem subsystem_;
+    UsageSubsystem task_subsystem_;
+    uint32_t start_;
+#endif
+};
+
+#endif // USAGE_ACCOUNTING_H
@@ -0,0 +1,192 @@
+#include "wake_word_arbiter.h"
+
+#if CONFIG_USE_WAKE_WORD_ARBITRATION
+#include "metrics.h"
+
+#include <esp_log.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#define TAG "WakeWordArbiter"
+
+#define CLAIM_MAGIC 0x41575A58    // "XZWA"
+// Claims sent per window, one may get lost in the air
+#define CLAIM_BROADCASTS 3
+
+static const uint8_t kBroadcastMac[ESP_NOW_ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+// FNV-1a, devices only listen to claims of their own group
+static uint32_t HashGroup(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const char* p = name; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    return hash;
+}
+
+void WakeWordArbiter::Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (started_) {
+        return;
+    }
+    esp_err_t err = esp_now_init();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "ESP-NOW is not available: %s", esp_err_to_name(err));
+        return;
+    }
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, kBroadcastMac, ESP_NOW_ETH_ALEN);
+    peer.channel = 0;   // The channel the station is on
+    peer.ifidx = WIFI_IF_STA;
+    peer.encrypt = false;
+    err = esp_now_add_peer(&peer);
+    if (err != ESP_OK && err != ESP_ERR_ESPNOW_EXIST) {
+        ESP_LOGE(TAG, "Failed to add the broadcast peer: %s", esp_err_to_name(err));
+        esp_now_deinit();
+        return;
+    }
+    esp_now_register_recv_cb([](const esp_now_recv_info_t* info, const uint8_t* data, int length) {
+        OnReceive(info->src_addr, data, length);
+    });
+    esp_wifi_get_mac(WIFI_IF_STA, mac_);
+    group_ = HashGroup(CONFIG_WAKE_WORD_ARBITRATION_GROUP);
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<WakeWordArbiter*>(arg)->OnTimer();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wake_word_arbiter",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer_));
+
+    auto& metrics = Metrics::GetInstance();
+    won_ = metrics.AddCounter("wake_word.arbitration_won");
+    lost_ = metrics.AddCounter("wake_word.arbitration_lost");
+    started_ = true;
+    ESP_LOGI(TAG, "Started, group %s, window %d ms", CONFIG_WAKE_WORD_ARBITRATION_GROUP, CONFIG_WAKE_WORD_ARBITRATION_WINDOW_MS);
+}
+
+bool WakeWordArbiter::Arbitrate(int level, std::function<void(bool won)> done) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!started_ || active_) {
+        return false;
+    }
+    active_ = true;
+    level_ = (int16_t)std::clamp(level, (int)SHRT_MIN, (int)SHRT_MAX);
+    claimed_us_ = esp_timer_get_time();
+    broadcasts_ = 0;
+    done_ = std::move(done);
+    Broadcast(kClaimDetected);
+    esp_timer_start_periodic(timer_, CONFIG_WAKE_WORD_ARBITRATION_WINDOW_MS * 1000 / CLAIM_BROADCASTS);
+    return true;
+}
+
+void WakeWordArbiter::Broadcast(ClaimType type) {
+    Claim claim = {
+        .magic = CLAIM_MAGIC,
+        .group = group_,
+        .type = type,
+        .level = level_,
+    };
+    esp_err_t err = esp_now_send(kBroadcastMac, reinterpret_cast<const uint8_t*>(&claim), sizeof(claim));
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to send the claim: %s", esp_err_to_name(err));
+    }
+    broadcasts_++;
+}
+
+// Louder wins, the higher MAC address on a tie, the same on both sides
+bool WakeWordArbiter::Beats(const Peer& peer) const {
+    if (level_ != peer.level) {
+        return level_ > peer.level;
+    }
+    return memcmp(mac_, peer.mac, sizeof(mac_)) > 0;
+}
+
+void WakeWordArbiter::OnTimer() {
+    std::function<void(bool won)> done;
+    bool won = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!active_) {
+            return;
+        }
+        if (broadcasts_ < CLAIM_BROADCASTS) {
+            Broadcast(kClaimDetected);
+            return;
+        }
+        esp_timer_stop(timer_);
+
+        int rivals = 0;
+        int64_t window_us = CONFIG_WAKE_WORD_ARBITRATION_WINDOW_MS * 1000LL;
+        for (auto& peer : peers_) {
+            if (peer.heard_us == 0 || std::llabs(peer.heard_us - claimed_us_) > window_us) {
+                continue;
+            }
+            rivals++;
+            // A device that has already won settles it, also for one that detected the word late
+            if (peer.won || !Beats(peer)) {
+                won = false;
+            }
+        }
+        if (won) {
+            Broadcast(kClaimWon);
+        }
+        (won ? won_ : lost_)->Add();
+        ESP_LOGI(TAG, "%s against %d other devices, level %.1f dB", won ? "Won" : "Lost", rivals, level_ / 10.0f);
+        active_ = false;
+        done.swap(done_);
+    }
+    done(won);
+}
+
+// Wi-Fi task, keeps the latest claim per device
+void WakeWordArbiter::OnReceive(const uint8_t* mac, const uint8_t* data, int length) {
+    if (length != sizeof(Claim)) {
+        return;
+    }
+    Claim claim;
+    memcpy(&claim, data, sizeof(claim));
+    auto& self = GetInstance();
+    if (claim.magic != CLAIM_MAGIC || claim.group != self.group_) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(self.mutex_);
+    Peer* slot = nullptr;
+    for (auto& peer : self.peers_) {
+        if (peer.heard_us != 0 && memcmp(peer.mac, mac, sizeof(peer.mac)) == 0) {
+            slot = &peer;
+            break;
+        }
+    }
+    if (slot == nullptr) {
+        // A free slot, or the one heard from longest ago
+        slot = std::min_element(std::begin(self.peers_), std::end(self.peers_), [](const Peer& a, const Peer& b) {
+            return a.heard_us < b.heard_us;
+        });
+        memcpy(slot->mac, mac, sizeof(slot->mac));
+    }
+    slot->level = claim.level;
+    slot->won = claim.type == kClaimWon;
+    slot->heard_us = esp_timer_get_time();
+}
+
+#else
+
+void WakeWordArbiter::Start() {
+}
+
+bool WakeWordArbiter::Arbitrate(int level, std::function<void(bool won)> done) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef WAKE_WORD_ARBITER_H
+#define WAKE_WORD_ARBITER_H
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+#include <esp_timer.h>
+#include <sdkconfig.h>
+
+class MetricCounter;
+
+/**
+ * WakeWordArbiter - One answer when several devices hear the same wake word
+ *
+ * A device that detects the wake word broadcasts a claim over ESP-NOW with the level the word
+ * reached at its microphone, repeated a few times during CONFIG_WAKE_WORD_ARBITRATION_WINDOW_MS.
+ * Claims of the same group heard within the window before or after its own are compared, the
+ * loudest one wins and the MAC address breaks a tie, so every device that hears the others comes
+ * to the same result. The winner announces itself, which also settles a device that detects the
+ * word late. Only the winner opens the audio channel, the others go back to waiting for the wake
+ * word without touching the network.
+ *
+ * ESP-NOW runs on the channel of the access point, devices on different channels or with their
+ * radio asleep do not hear each other and each one answers as before.
+ *
+ * Without CONFIG_USE_WAKE_WORD_ARBITRATION Arbitrate() returns false and the device goes ahead.
+ */
+class WakeWordArbiter {
+public:
+    static WakeWordArbiter& GetInstance() {
+        static WakeWordArbiter instance;
+        return instance;
+    }
+
+    WakeWordArbiter(const WakeWordArbiter&) = delete;
+    WakeWordArbiter& operator=(const WakeWordArbiter&) = delete;
+
+    // Once Wi-Fi is started, later calls do nothing
+    void Start();
+    // level is in 0.1 dBFS. Calls done from the timer task once the window has passed, returns
+    // false without calling it when the arbiter is not running or busy with another claim.
+    bool Arbitrate(int level, std::function<void(bool won)> done);
+
+private:
+    WakeWordArbiter() = default;
+
+#if CONFIG_USE_WAKE_WORD_ARBITRATION
+    enum ClaimType : uint8_t {
+        kClaimDetected = 1,
+        kClaimWon = 2,
+    };
+    struct __attribute__((packed)) Claim {
+        uint32_t magic;
+        uint32_t group;
+        uint8_t type;
+        int16_t level;
+    };
+    // Last claim of one other device
+    struct Peer {
+        uint8_t mac[6];
+        int16_t level;
+        bool won;
+        int64_t heard_us;
+    };
+    static constexpr int kMaxPeers = 8;
+
+    std::mutex mutex_;
+    bool started_ = false;
+    uint8_t mac_[6] = {};
+    uint32_t group_ = 0;
+    Peer peers_[kMaxPeers] = {};
+    esp_timer_handle_t timer_ = nullptr;
+    // While arbitrating
+    bool active_ = false;
+    int16_t level_ = 0;
+    int64_t claimed_us_ = 0;
+    int broadcasts_ = 0;
+    std::function<void(bool won)> done_;
+    MetricCounter* won_ = nullptr;
+    MetricCounter* lost_ = nullptr;
+
+    static void OnReceive(const uint8_t* mac, const uint8_t* data, int length);
+    void OnTimer();
+    // With mutex_ held
+    void Broadcast(ClaimType type);
+    bool Beats(const Peer& peer) const;
+#endif
+};
+
+#endif // WAKE_WORD_ARBITER_H
@@ -1,54 +1,132 @@
 import socket
+import struct
 import wave
 import argparse
 
 
 '''
   Create a UDP socket and bind it to the server's IP:8000.
-  Listen for incoming messages and print them to the console.
-  Save the audio to a WAV file.
+  Receive the audio debug streams of CONFIG_USE_AUDIO_DEBUGGER and save each stream to its own WAV file:
+  {prefix}_mic.wav, {prefix}_reference.wav, {prefix}_processed.wav, {prefix}_playback.wav
+
+  Packets carry a 16-byte header (magic 0xAD, stream, codec, channels, sample rate, samples,
+  sequence, position), then raw PCM or IMA ADPCM. Lost packets are filled with silence by
+  position, so the files stay sample aligned with each other.
 '''
-def main(samplerate, channels):
-    # Create a UDP socket
-    server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-    server_socket.bind(('0.0.0.0', 8000))
 
-    # Create WAV file with parameters
-    filename = f"{samplerate}_{channels}.wav"
-    wav_file = wave.open(filename, "wb")
-    wav_file.setnchannels(channels)     # channels parameter
-    wav_file.setsampwidth(2)            # 2 bytes per sample (16-bit)
-    wav_file.setframerate(samplerate)   # samplerate parameter
+HEADER = struct.Struct("<BBBBHHII")
+MAGIC = 0xAD
+STREAM_NAMES = {0: "mic", 1: "reference", 2: "processed", 3: "playback"}
+
+ADPCM_STEPS = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+]
+ADPCM_INDEX_STEPS = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+
+def decode_adpcm(payload, channels, samples):
+    predictors = []
+    indexes = []
+    for c in range(channels):
+        predictor, index = struct.unpack_from("<hB", payload, c * 4)
+        predictors.append(predictor)
+        indexes.append(index)
+    codes = payload[channels * 4:]
+    out = []
+    for i in range(samples * channels):
+        c = i % channels
+        code = (codes[i // 2] >> 4) if i & 1 else (codes[i // 2] & 0x0F)
+        step = ADPCM_STEPS[indexes[c]]
+        delta = step >> 3
+        if code & 4:
+            delta += step
+        if code & 2:
+            delta += step >> 1
+        if code & 1:
+            delta += step >> 2
+        predictor = predictors[c] + (-delta if code & 8 else delta)
+        predictors[c] = max(-32768, min(32767, predictor))
+        indexes[c] = max(0, min(88, indexes[c] + ADPCM_INDEX_STEPS[code]))
+        out.append(predictors[c])
+    return struct.pack(f"<{len(out)}h", *out)
+
+
+class StreamWriter:
+    def __init__(self, prefix, stream, channels, sample_rate):
+        self.filename = f"{prefix}_{STREAM_NAMES.get(stream, stream)}.wav"
+        self.channels = channels
+        self.wav_file = wave.open(self.filename, "wb")
+        self.wav_file.setnchannels(channels)
+        self.wav_file.setsampwidth(2)
+        self.wav_file.setframerate(sample_rate)
+        self.position = None
+        self.sequence = None
+        self.packets = 0
+        self.lost = 0
+        print(f"Saving stream {STREAM_NAMES.get(stream, stream)} ({channels} ch, {sample_rate} Hz) to {self.filename}")
+
+    def write(self, sequence, position, pcm, samples):
+        if self.sequence is not None and sequence != self.sequence + 1:
+            self.lost += max(0, sequence - self.sequence - 1)
+        self.sequence = sequence
+        self.packets += 1
+        if self.position is None:
+            self.position = position
+        if position < self.position:
+            # Late or duplicate, its place has been filled already
+            return
+        if position > self.position:
+            self.wav_file.writeframes(b"\0" * ((position - self.position) * self.channels * 2))
+        self.wav_file.writeframes(pcm)
+        self.position = position + samples
 
-    print(f"Start saving audio from 0.0.0.0:8000 to {filename}...")
+    def close(self):
+        self.wav_file.close()
+        print(f"{self.filename}: {self.packets} packets, {self.lost} lost")
 
+
+def main(prefix, port):
+    # Create a UDP socket
+    server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server_socket.bind(('0.0.0.0', port))
+    print(f"Start saving audio from 0.0.0.0:{port} to {prefix}_*.wav...")
+
+    writers = {}
     try:
         while True:
-            # Receive a message from the client
-            message, address = server_socket.recvfrom(8000)
-            
-            # Write PCM data to WAV file
-            wav_file.writeframes(message)
-
-            # Print length of the message
-            print(f"Received {len(message)} bytes from {address}")
-    
+            message, address = server_socket.recvfrom(2048)
+            if len(message) < HEADER.size or message[0] != MAGIC:
+                print(f"Ignored {len(message)} bytes from {address}, not an audio debug packet")
+                continue
+            _, stream, codec, channels, sample_rate, samples, sequence, position = HEADER.unpack_from(message)
+            payload = message[HEADER.size:]
+            pcm = decode_adpcm(payload, channels, samples) if codec == 1 else payload
+
+            writer = writers.get(stream)
+            if writer is None:
+                writer = writers[stream] = StreamWriter(prefix, stream, channels, sample_rate)
+            writer.write(sequence, position, pcm, samples)
+
     except KeyboardInterrupt:
         print("\nStopping recording...")
-    
+
     finally:
         # Close files and socket
-        wav_file.close()
+        for writer in writers.values():
+            writer.close()
         server_socket.close()
-        print(f"WAV file '{filename}' saved successfully")
 
 
 if __name__ == "__main__":
-    parser = argparse.ArgumentParser(description='UDP音频数据接收器，保存为WAV文件')
-    parser.add_argument('--samplerate', '-s', type=int, default=16000, 
-                        help='采样率 (默认: 16000)')
-    parser.add_argument('--channels', '-c', type=int, default=2, 
-                        help='声道数 (默认: 2)')
-    
+    parser = argparse.ArgumentParser(description='UDP音频调试数据接收器，每个音频流保存为一个WAV文件')
+    parser.add_argument('--prefix', '-o', default='audio_debug',
+                        help='WAV文件名前缀 (默认: audio_debug)')
+    parser.add_argument('--port', '-p', type=int, default=8000,
+                        help='UDP端口 (默认: 8000)')
+
     args = parser.parse_args()
-    main(args.samplerate, args.channels)
+    main(args.prefix, args.port)
@@ -293,7 +293,31 @@ def process_extra_files(extra_files_dir, assets_dir):
     return extra_files_list
 
 
-def generate_index_json(assets_dir, srmodels, text_font, emoji_collection, extra_files=None, multinet_model_info=None):
+def process_locale_sounds(locales_dir, language, assets_dir):
+    """Copy the sounds of the language, with en-US for the missing ones, as <name>.ogg"""
+    if not locales_dir or not language:
+        return []
+
+    sounds = {}
+    for lang in ("en-US", language):
+        lang_dir = os.path.join(locales_dir, lang)
+        if not os.path.isdir(lang_dir):
+            print(f"Warning: Locale directory not found: {lang_dir}")
+            continue
+        for file in os.listdir(lang_dir):
+            if file.endswith(".ogg"):
+                sounds[file] = os.path.join(lang_dir, file)
+
+    for file, src_file in sounds.items():
+        copy_file(src_file, os.path.join(assets_dir, file))
+
+    if sounds:
+        print(f"Processed {len(sounds)} {language} sounds")
+    return sorted(sounds)
+
+
+def generate_index_json(assets_dir, srmodels, text_font, emoji_collection, extra_files=None, multinet_model_info=None,
+                        sounds=None, language=None):
     """Generate index.json file"""
     index_data = {
         "version": 1
@@ -313,6 +337,9 @@ def generate_index_json(assets_dir, srmodels, text_font, emoji_collection, extra
     
     if multinet_model_info:
         index_data["multinet_model"] = multinet_model_info
+
+    if sounds:
+        index_data["sounds"] = {"language": language, "files": sounds}
     
     # Write index.json
     index_path = os.path.join(assets_dir, "index.json")
@@ -747,7 +774,8 @@ def get_emoji_collection_path(default_emoji_collection, xiaozhi_fonts_path, proj
     return None
 
 
-def build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font_path, emoji_collection_path, extra_files_path, output_path, multinet_model_info=None):
+def build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font_path, emoji_collection_path, extra_files_path, output_path, multinet_model_info=None,
+                            locales_dir=None, language=None):
     """
     Build assets using integrated functions (no external dependencies)
     """
@@ -769,9 +797,11 @@ def build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font
         text_font = process_text_font(text_font_path, assets_dir) if text_font_path else None
         emoji_collection = process_emoji_collection(emoji_collection_path, assets_dir) if emoji_collection_path else None
         extra_files = process_extra_files(extra_files_path, assets_dir) if extra_files_path else None
+        sounds = process_locale_sounds(locales_dir, language, assets_dir)
         
         # Generate index.json
-        generate_index_json(assets_dir, srmodels, text_font, emoji_collection, extra_files, multinet_model_info)
+        generate_index_json(assets_dir, srmodels, text_font, emoji_collection, extra_files, multinet_model_info,
+                            sounds, language)
         
         # Generate config.json for packing
         config_path = generate_config_json(temp_build_dir, assets_dir)
@@ -817,6 +847,8 @@ def main():
     parser.add_argument('--esp_sr_model_path', help='Path to ESP-SR model directory')
     parser.add_argument('--xiaozhi_fonts_path', help='Path to xiaozhi-fonts component directory')
     parser.add_argument('--extra_files', help='Path to extra files directory to be included in assets')
+    parser.add_argument('--locales_dir', help='Path to main/assets/locales, to include the sounds of --language')
+    parser.add_argument('--language', help='Language code of the sounds to include (e.g., zh-CN)')
     
     args = parser.parse_args()
     
@@ -911,7 +943,8 @@ def main():
         print(f"  wake word threshold: {custom_wake_word_config['threshold']}")
     
     # Check if we have anything to build
-    if not wakenet_model_paths and not multinet_model_paths and not text_font_path and not emoji_collection_path and not extra_files_path and not multinet_model_info:
+    if not wakenet_model_paths and not multinet_model_paths and not text_font_path and not emoji_collection_path and not extra_files_path and not multinet_model_info \
+            and not (args.locales_dir and args.language):
         print("Warning: No assets to build (no SR models, text font, emoji collection, extra files, or custom wake word)")
         # Create an empty assets.bin file
         os.makedirs(os.path.dirname(args.output), exist_ok=True)
@@ -922,7 +955,7 @@ def main():
     
     # Build the assets
     success = build_assets_integrated(wakenet_model_paths, multinet_model_paths, text_font_path, emoji_collection_path, 
-                                     extra_files_path, args.output, multinet_model_info)
+                                     extra_files_path, args.output, multinet_model_info, args.locales_dir, args.language)
     
     if not success:
         sys.exit(1)
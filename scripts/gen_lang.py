@@ -8,7 +8,7 @@ HEADER_TEMPLATE = """// Auto-generated language config
 #pragma once
 
 #include <string_view>
-
+{sound_include}
 #ifndef {lang_code_for_font}
     #define {lang_code_for_font}  // 預設語言
 #endif
@@ -50,7 +50,7 @@ def get_sound_files(directory):
         return []
     return [f for f in os.listdir(directory) if f.endswith('.ogg')]
 
-def generate_header(lang_code, output_path):
+def generate_header(lang_code, output_path, sounds_in_assets=False):
     # 从输出路径推导项目结构
     # output_path 通常是 main/assets/lang_config.h
     main_dir = os.path.dirname(output_path)  # main/assets
@@ -140,6 +140,12 @@ def generate_header(lang_code, output_path):
             sound_lang = lang_code.replace('-', '_').lower()
         else:
             sound_lang = 'en_us'
+
+        # 音效在 assets 分区中，运行时按文件名查找
+        if sounds_in_assets:
+            sounds.append(f'''
+        inline constexpr LangSound OGG_{base_name.upper()} {{"{file}"}};''')
+            continue
             
         sounds.append(f'''
         extern const char ogg_{base_name}_start[] asm("_binary_{base_name}_ogg_start");
@@ -164,6 +170,7 @@ def generate_header(lang_code, output_path):
     content = HEADER_TEMPLATE.format(
         lang_code=lang_code,
         lang_code_for_font=lang_code.replace('-', '_').lower(),
+        sound_include='#include "lang_sound.h"\n' if sounds_in_assets else '',
         strings="\n".join(sorted(strings)),
         sounds="\n".join(sorted(sounds))
     )
@@ -177,10 +184,12 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Generate language configuration header file with en-US fallback")
     parser.add_argument("--language", required=True, help="Language code (e.g: zh-CN, en-US, ja-JP)")
     parser.add_argument("--output", required=True, help="Output header file path")
+    parser.add_argument("--sounds-in-assets", action="store_true",
+                        help="Look the language sounds up in the assets partition, only the common sounds are embedded")
     args = parser.parse_args()
 
     try:
-        generate_header(args.language, args.output)
+        generate_header(args.language, args.output, args.sounds_in_assets)
         print(f"Successfully generated language config file: {args.output}")
     except Exception as e:
         print(f"Error: {e}")
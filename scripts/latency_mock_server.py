@@ -0,0 +1,704 @@
+import argparse
+import asyncio
+import base64
+import hashlib
+import json
+import os
+import socket
+import statistics
+import struct
+import sys
+import time
+import wave
+
+
+'''
+  Mock server for end-to-end latency regression runs.
+
+  Serves the OTA check, then plays the server side of the conversation over the
+  websocket protocol (version 1/2/3) or MQTT + UDP: every utterance of the device is
+  answered with the same TTS, replayed from an Ogg Opus file at real time pace.
+  Every message in both directions is timestamped into a JSON lines log.
+
+  Build the firmware with CONFIG_USE_AUDIO_INJECTION, with CONFIG_AUDIO_INJECTION_URL
+  pointing at this server, and CONFIG_OTA_URL at http://HOST:8002/ota/. The device then
+  plays the PCM file given here as its microphone every time it is idle, and posts the
+  timeline of each run, which is turned into latencies measured on the device clock:
+    wake_detect_ms          wake word detected, from the end of the wake word in the file
+    wake_to_listen_ms       listening state entered, from the end of the wake word
+    eos_to_first_audio_ms   first answer audio written to the speaker, from the end of speech
+    barge_in_ms             abort sent, from the end of the wake word spoken over the answer
+
+    python latency_mock_server.py --pcm question.wav --tts answer.ogg \\
+        --wake-end-ms 900 --speech-end-ms 3200 --barge-end-ms 6500 --runs 20
+
+  The PCM file is 16 kHz mono 16-bit, raw or WAV. The end of speech is found like a
+  server VAD would: after --silence-ms with only DTX sized packets, so that window is
+  part of eos_to_first_audio_ms.
+'''
+
+WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+
+# ---- AES-128, only the forward cipher needed by CTR mode ----
+
+def _rotl8(x, shift):
+    return ((x << shift) | (x >> (8 - shift))) & 0xFF
+
+
+def _build_sbox():
+    sbox = [0] * 256
+    p = q = 1
+    while True:
+        p = p ^ ((p << 1) & 0xFF) ^ (0x1B if p & 0x80 else 0)
+        q ^= q << 1
+        q ^= q << 2
+        q ^= q << 4
+        q &= 0xFF
+        if q & 0x80:
+            q ^= 0x09
+        sbox[p] = q ^ _rotl8(q, 1) ^ _rotl8(q, 2) ^ _rotl8(q, 3) ^ _rotl8(q, 4) ^ 0x63
+        if p == 1:
+            break
+    sbox[0] = 0x63
+    return sbox
+
+
+SBOX = _build_sbox()
+
+
+def _xtime(a):
+    return ((a << 1) ^ 0x1B) & 0xFF if a & 0x80 else a << 1
+
+
+class Aes128:
+    def __init__(self, key):
+        words = [list(key[i:i + 4]) for i in range(0, 16, 4)]
+        rcon = 1
+        for i in range(4, 44):
+            word = list(words[i - 1])
+            if i % 4 == 0:
+                word = [SBOX[b] for b in word[1:] + word[:1]]
+                word[0] ^= rcon
+                rcon = _xtime(rcon)
+            words.append([a ^ b for a, b in zip(words[i - 4], word)])
+        self.round_keys = [sum(words[r * 4:r * 4 + 4], []) for r in range(11)]
+
+    def encrypt_block(self, block):
+        s = [a ^ b for a, b in zip(block, self.round_keys[0])]
+        for r in range(1, 11):
+            s = [SBOX[b] for b in s]
+            # State is column major, row i of column c is s[c * 4 + i]
+            s = [s[(c * 4 + i * 5) % 16] for c in range(4) for i in range(4)]
+            if r != 10:
+                mixed = []
+                for c in range(4):
+                    a = s[c * 4:c * 4 + 4]
+                    t = a[0] ^ a[1] ^ a[2] ^ a[3]
+                    mixed += [a[i] ^ t ^ _xtime(a[i] ^ a[(i + 1) % 4]) for i in range(4)]
+                s = mixed
+            s = [a ^ b for a, b in zip(s, self.round_keys[r])]
+        return bytes(s)
+
+    def ctr(self, counter, data):
+        # Same as mbedtls_aes_crypt_ctr: the whole block is a big endian counter
+        value = int.from_bytes(counter, "big")
+        out = bytearray()
+        for offset in range(0, len(data), 16):
+            stream = self.encrypt_block(value.to_bytes(16, "big"))
+            out += bytes(a ^ b for a, b in zip(data[offset:offset + 16], stream))
+            value = (value + 1) & ((1 << 128) - 1)
+        return bytes(out)
+
+
+# ---- Ogg Opus ----
+
+def opus_packet_ms(packet):
+    config = packet[0] >> 3
+    if config < 12:
+        frame_ms = [10, 20, 40, 60][config % 4]
+    elif config < 16:
+        frame_ms = [10, 20][config % 2]
+    else:
+        frame_ms = [2.5, 5, 10, 20][config % 4]
+    code = packet[0] & 3
+    frames = 1 if code == 0 else 2 if code < 3 else packet[1] & 0x3F
+    return frame_ms * frames
+
+
+def read_ogg_opus(path):
+    data = open(path, "rb").read()
+    packets = []
+    partial = b""
+    offset = 0
+    while offset + 27 <= len(data):
+        if data[offset:offset + 4] != b"OggS":
+            sys.exit(f"{path}: not an Ogg file")
+        segments = data[offset + 26]
+        table = data[offset + 27:offset + 27 + segments]
+        offset += 27 + segments
+        for lacing in table:
+            partial += data[offset:offset + lacing]
+            offset += lacing
+            if lacing < 255:
+                packets.append(partial)
+                partial = b""
+    audio = [p for p in packets if not p.startswith(b"OpusHead") and not p.startswith(b"OpusTags")]
+    if not audio:
+        sys.exit(f"{path}: no Opus packets")
+    return [(p, opus_packet_ms(p)) for p in audio]
+
+
+def read_pcm(path):
+    if path.lower().endswith(".wav"):
+        with wave.open(path, "rb") as wav:
+            if wav.getframerate() != 16000 or wav.getnchannels() != 1 or wav.getsampwidth() != 2:
+                sys.exit(f"{path}: must be 16 kHz mono 16-bit")
+            return wav.readframes(wav.getnframes())
+    return open(path, "rb").read()
+
+
+# ---- Conversation ----
+
+class Session:
+    '''One audio channel, from the device hello to the goodbye or the closed connection'''
+
+    def __init__(self, server, name, transport):
+        self.server = server
+        self.name = name
+        self.transport = transport
+        self.listening = False
+        self.speech_seen = False
+        self.last_speech = 0
+        self.responding = None
+        self.aborted = False
+        self.close_task = None
+        self.vad_task = asyncio.ensure_future(self.vad())
+
+    def log(self, direction, kind, detail):
+        self.server.log(self.name, direction, kind, detail)
+
+    async def send_json(self, message):
+        message.setdefault("session_id", self.name)
+        self.log("tx", "json", message)
+        await self.transport.send_json(message)
+
+    async def on_json(self, message):
+        self.log("rx", "json", message)
+        kind = message.get("type")
+        if kind == "hello":
+            await self.transport.send_hello(self)
+        elif kind == "listen":
+            state = message.get("state")
+            if state == "start":
+                self.listening = True
+                self.speech_seen = False
+            elif state == "stop" and self.listening:
+                await self.respond()
+        elif kind == "abort":
+            self.aborted = True
+        elif kind == "goodbye":
+            self.stop()
+
+    def on_audio(self, opus):
+        self.log("rx", "audio", len(opus))
+        if not self.listening:
+            return
+        if len(opus) > self.server.args.speech_bytes:
+            self.speech_seen = True
+            self.last_speech = time.monotonic()
+            if self.close_task is not None:
+                self.close_task.cancel()
+                self.close_task = None
+
+    async def vad(self):
+        while True:
+            await asyncio.sleep(0.01)
+            if self.listening and self.speech_seen and \
+                    time.monotonic() - self.last_speech >= self.server.args.silence_ms / 1000:
+                await self.respond()
+
+    async def respond(self):
+        self.listening = False
+        self.speech_seen = False
+        self.aborted = False
+        self.responding = asyncio.ensure_future(self.play_tts())
+
+    async def play_tts(self):
+        await self.send_json({"type": "stt", "text": "mock question"})
+        await self.send_json({"type": "tts", "state": "start"})
+        await self.send_json({"type": "tts", "state": "sentence_start", "text": "mock answer"})
+        start = time.monotonic()
+        sent_ms = 0
+        for packet, duration in self.server.tts:
+            if self.aborted:
+                break
+            # Runs ahead of real time by the lead, like a streaming TTS server
+            delay = start + (sent_ms - self.server.args.lead_ms) / 1000 - time.monotonic()
+            if delay > 0:
+                await asyncio.sleep(delay)
+            self.log("tx", "audio", len(packet))
+            await self.transport.send_audio(packet, int(sent_ms))
+            sent_ms += duration
+        if not self.aborted:
+            # Let the device play out what it holds
+            await asyncio.sleep(max(0, start + sent_ms / 1000 - time.monotonic()))
+        await self.send_json({"type": "tts", "state": "stop"})
+        self.close_task = asyncio.ensure_future(self.close_when_quiet())
+
+    async def close_when_quiet(self):
+        await asyncio.sleep(self.server.args.close_after_ms / 1000)
+        if not self.speech_seen:
+            self.log("tx", "close", None)
+            await self.transport.close_session(self)
+
+    def stop(self):
+        self.vad_task.cancel()
+        for task in (self.responding, self.close_task):
+            if task is not None:
+                task.cancel()
+
+
+class MockServer:
+    def __init__(self, args):
+        self.args = args
+        self.tts = read_ogg_opus(args.tts)
+        self.tts_frame_ms = int(self.tts[0][1])
+        self.pcm = read_pcm(args.pcm) if args.pcm else b""
+        self.start = time.monotonic()
+        self.log_file = open(args.log, "a", buffering=1) if args.log else None
+        self.results_file = open(args.results, "a") if args.results else None
+        self.results = []
+        self.session_count = 0
+        self.udp = None
+        self.done = asyncio.get_running_loop().create_future()
+
+    def new_session_name(self):
+        self.session_count += 1
+        return f"mock-{self.session_count}"
+
+    def log(self, session, direction, kind, detail):
+        if self.log_file is None:
+            return
+        entry = {"t": round((time.monotonic() - self.start) * 1000, 1), "session": session,
+                 "dir": direction, "kind": kind, "detail": detail}
+        self.log_file.write(json.dumps(entry) + "\n")
+
+    def audio_params(self):
+        return {"format": "opus", "sample_rate": self.args.tts_sample_rate, "channels": 1,
+                "frame_duration": self.tts_frame_ms}
+
+    def ota_response(self):
+        host = self.args.host_ip
+        response = {
+            "server_time": {"timestamp": int(time.time() * 1000), "timezone_offset": 0},
+            "firmware": {"version": "0.0.0", "url": ""},
+        }
+        if self.args.transport == "mqtt":
+            response["mqtt"] = {"endpoint": f"{host}:{self.args.mqtt_port}", "client_id": "latency-mock",
+                                "username": "", "password": "", "publish_topic": "device-server",
+                                "keepalive": 240}
+        else:
+            response["websocket"] = {"url": f"ws://{host}:{self.args.port}/ws/", "token": "mock",
+                                     "version": self.args.version}
+        return response
+
+    def on_report(self, report):
+        metrics = compute_metrics(report, self.args)
+        self.results.append(metrics)
+        print(f"Run {len(self.results)}: " + ", ".join(f"{k}={v}" for k, v in metrics.items()))
+        if self.results_file is not None:
+            self.results_file.write(json.dumps({"metrics": metrics, "report": report}) + "\n")
+            self.results_file.flush()
+        if self.log_file is not None:
+            self.log_file.flush()
+        if self.args.runs and len(self.results) >= self.args.runs and not self.done.done():
+            self.done.set_result(True)
+
+
+def compute_metrics(report, args):
+    events = report.get("events", [])
+
+    def first(name, after, state=None):
+        for event in events:
+            if event[1] == name and event[0] >= after and (state is None or event[2] == state):
+                return event[0]
+        return None
+
+    metrics = {}
+    wake = first("wake_word", 0)
+    if wake is not None:
+        metrics["wake_detect_ms"] = wake - args.wake_end_ms
+        listen = first("state", wake, "listening")
+        if listen is not None:
+            metrics["wake_to_listen_ms"] = listen - args.wake_end_ms
+    playback = None
+    if args.speech_end_ms:
+        playback = first("playback", args.speech_end_ms)
+        if playback is not None:
+            metrics["eos_to_first_audio_ms"] = playback - args.speech_end_ms
+    if args.barge_end_ms:
+        abort = first("abort", playback if playback is not None else 0)
+        if abort is not None:
+            metrics["barge_in_ms"] = abort - args.barge_end_ms
+    return metrics
+
+
+def print_summary(results):
+    print(f"\n{len(results)} runs")
+    names = sorted({name for metrics in results for name in metrics})
+    for name in names:
+        values = sorted(metrics[name] for metrics in results if name in metrics)
+        p90 = values[min(len(values) - 1, int(len(values) * 0.9))]
+        print(f"  {name:24s} n={len(values):3d} min={values[0]:6d} median={int(statistics.median(values)):6d} "
+              f"p90={p90:6d} max={values[-1]:6d}")
+
+
+# ---- HTTP and websocket ----
+
+async def read_http_request(reader):
+    head = await reader.readuntil(b"\r\n\r\n")
+    lines = head.decode(errors="replace").split("\r\n")
+    method, path, _ = lines[0].split(" ", 2)
+    headers = {}
+    for line in lines[1:]:
+        if ":" in line:
+            key, value = line.split(":", 1)
+            headers[key.strip().lower()] = value.strip()
+    body = b""
+    if "content-length" in headers:
+        body = await reader.readexactly(int(headers["content-length"]))
+    return method, path, headers, body
+
+
+def http_response(writer, status, body=b"", content_type="application/json"):
+    writer.write(f"HTTP/1.1 {status}\r\nContent-Type: {content_type}\r\nContent-Length: {len(body)}\r\n"
+                 f"Connection: close\r\n\r\n".encode() + body)
+
+
+class WebsocketTransport:
+    def __init__(self, server, reader, writer, version):
+        self.server = server
+        self.reader = reader
+        self.writer = writer
+        self.version = version
+
+    async def write_frame(self, opcode, payload):
+        header = bytes([0x80 | opcode])
+        if len(payload) < 126:
+            header += bytes([len(payload)])
+        elif len(payload) < 65536:
+            header += bytes([126]) + struct.pack(">H", len(payload))
+        else:
+            header += bytes([127]) + struct.pack(">Q", len(payload))
+        self.writer.write(header + payload)
+        await self.writer.drain()
+
+    async def read_message(self):
+        message = b""
+        while True:
+            b0, b1 = await self.reader.readexactly(2)
+            length = b1 & 0x7F
+            if length == 126:
+                (length,) = struct.unpack(">H", await self.reader.readexactly(2))
+            elif length == 127:
+                (length,) = struct.unpack(">Q", await self.reader.readexactly(8))
+            mask = await self.reader.readexactly(4) if b1 & 0x80 else b"\0\0\0\0"
+            data = await self.reader.readexactly(length)
+            data = bytes(b ^ mask[i % 4] for i, b in enumerate(data))
+            opcode = b0 & 0x0F
+            if opcode == 0x8:
+                return None, None
+            if opcode == 0x9:
+                await self.write_frame(0xA, data)
+                continue
+            if opcode == 0xA:
+                continue
+            if opcode != 0:
+                first_opcode = opcode
+            message += data
+            if b0 & 0x80:
+                return first_opcode, message
+
+    async def send_json(self, message):
+        await self.write_frame(0x1, json.dumps(message).encode())
+
+    async def send_hello(self, session):
+        await session.send_json({"type": "hello", "transport": "websocket",
+                                 "audio_params": self.server.audio_params()})
+
+    async def send_audio(self, opus, timestamp):
+        if self.version == 2:
+            frame = struct.pack(">HHIII", 2, 0, 0, timestamp, len(opus)) + opus
+        elif self.version >= 3:
+            frame = struct.pack(">BBH", 0, 0, len(opus)) + opus
+        else:
+            frame = opus
+        await self.write_frame(0x2, frame)
+
+    def unpack_audio(self, frame):
+        if self.version == 2:
+            _, kind, _, _, size = struct.unpack_from(">HHIII", frame)
+            return frame[16:16 + size] if kind == 0 else None
+        if self.version >= 3:
+            kind, _, size = struct.unpack_from(">BBH", frame)
+            return frame[4:4 + size] if kind == 0 else None
+        return frame
+
+    async def close_session(self, session):
+        await self.write_frame(0x8, b"")
+        self.writer.close()
+
+    async def run(self):
+        session = Session(self.server, self.server.new_session_name(), self)
+        try:
+            while True:
+                opcode, message = await self.read_message()
+                if opcode is None:
+                    break
+                if opcode == 0x1:
+                    await session.on_json(json.loads(message))
+                else:
+                    opus = self.unpack_audio(message)
+                    if opus is not None:
+                        session.on_audio(opus)
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            session.log("rx", "closed", None)
+            session.stop()
+
+
+async def handle_http(server, reader, writer):
+    try:
+        method, path, headers, body = await read_http_request(reader)
+    except (asyncio.IncompleteReadError, asyncio.LimitOverrunError, ValueError):
+        writer.close()
+        return
+
+    if headers.get("upgrade", "").lower() == "websocket":
+        key = headers.get("sec-websocket-key", "")
+        accept = base64.b64encode(hashlib.sha1((key + WS_GUID).encode()).digest()).decode()
+        writer.write(("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                      f"Sec-WebSocket-Accept: {accept}\r\n\r\n").encode())
+        version = int(headers.get("protocol-version", "1"))
+        server.log(None, "rx", "connect", {"device": headers.get("device-id"), "version": version})
+        await WebsocketTransport(server, reader, writer, version).run()
+        return
+
+    if path.startswith("/ota"):
+        http_response(writer, "200 OK", json.dumps(server.ota_response()).encode())
+    elif path.endswith(".pcm"):
+        http_response(writer, "200 OK", server.pcm, "application/octet-stream")
+    elif path.endswith("/report") and method == "POST":
+        server.on_report(json.loads(body))
+        http_response(writer, "200 OK", b"{}")
+    else:
+        http_response(writer, "404 Not Found")
+    await writer.drain()
+    writer.close()
+
+
+# ---- MQTT + UDP ----
+
+class UdpAudio(asyncio.DatagramProtocol):
+    def __init__(self):
+        self.sessions = {}
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def datagram_received(self, data, address):
+        if len(data) < 16:
+            return
+        bound = self.sessions.get(data[4:8])
+        if bound is None:
+            return
+        bound.address = address
+        size = struct.unpack_from(">H", data, 2)[0]
+        opus = bound.aes.ctr(data[:16], data[16:16 + size])
+        bound.session.on_audio(opus)
+
+
+class UdpBinding:
+    def __init__(self, session, ssrc):
+        self.session = session
+        self.key = os.urandom(16)
+        self.aes = Aes128(self.key)
+        self.ssrc = ssrc
+        self.nonce = bytes([1, 0, 0, 0]) + ssrc + bytes(8)
+        self.address = None
+        self.sequence = 0
+
+
+class MqttTransport:
+    def __init__(self, server, reader, writer):
+        self.server = server
+        self.reader = reader
+        self.writer = writer
+        self.client_id = ""
+        self.session = None
+        self.binding = None
+
+    async def read_packet(self):
+        header = (await self.reader.readexactly(1))[0]
+        length = 0
+        for shift in range(0, 28, 7):
+            byte = (await self.reader.readexactly(1))[0]
+            length |= (byte & 0x7F) << shift
+            if not byte & 0x80:
+                break
+        return header, await self.reader.readexactly(length)
+
+    def write_packet(self, header, body):
+        length = len(body)
+        encoded = bytearray()
+        while True:
+            byte = length & 0x7F
+            length >>= 7
+            encoded.append(byte | (0x80 if length else 0))
+            if not length:
+                break
+        self.writer.write(bytes([header]) + bytes(encoded) + body)
+
+    async def send_json(self, message):
+        topic = f"devices/p2p/{self.client_id}".encode()
+        self.write_packet(0x30, struct.pack(">H", len(topic)) + topic + json.dumps(message).encode())
+        await self.writer.drain()
+
+    async def send_hello(self, session):
+        ssrc = os.urandom(4)
+        self.binding = UdpBinding(session, ssrc)
+        self.server.udp.sessions[ssrc] = self.binding
+        await session.send_json({"type": "hello", "transport": "udp", "audio_params": self.server.audio_params(),
+                                 "udp": {"server": self.server.args.host_ip, "port": self.server.args.udp_port,
+                                         "key": self.binding.key.hex(), "nonce": self.binding.nonce.hex()}})
+
+    async def send_audio(self, opus, timestamp):
+        binding = self.binding
+        if binding is None or binding.address is None:
+            # The device has not sent a datagram yet, so there is no address to answer
+            return
+        binding.sequence += 1
+        header = bytes([1, 0]) + struct.pack(">H", len(opus)) + binding.ssrc + \
+            struct.pack(">II", timestamp, binding.sequence)
+        self.server.udp.transport.sendto(header + binding.aes.ctr(header, opus), binding.address)
+
+    async def close_session(self, session):
+        await self.send_json({"type": "goodbye", "session_id": session.name})
+        self.end_session()
+
+    def end_session(self):
+        if self.session is not None:
+            self.session.stop()
+            self.session = None
+        if self.binding is not None:
+            self.server.udp.sessions.pop(self.binding.ssrc, None)
+            self.binding = None
+
+    async def run(self):
+        try:
+            while True:
+                header, body = await self.read_packet()
+                kind = header >> 4
+                if kind == 1:  # CONNECT
+                    (name_length,) = struct.unpack_from(">H", body, 0)
+                    offset = 2 + name_length + 4
+                    (id_length,) = struct.unpack_from(">H", body, offset)
+                    self.client_id = body[offset + 2:offset + 2 + id_length].decode()
+                    self.server.log(None, "rx", "connect", {"client_id": self.client_id})
+                    self.write_packet(0x20, b"\0\0")
+                elif kind == 3:  # PUBLISH
+                    qos = (header >> 1) & 3
+                    (topic_length,) = struct.unpack_from(">H", body, 0)
+                    offset = 2 + topic_length
+                    if qos:
+                        packet_id = body[offset:offset + 2]
+                        offset += 2
+                        self.write_packet(0x40, packet_id)
+                    message = json.loads(body[offset:])
+                    if message.get("type") == "hello":
+                        self.end_session()
+                        self.session = Session(self.server, self.server.new_session_name(), self)
+                    if self.session is not None:
+                        await self.session.on_json(message)
+                        if message.get("type") == "goodbye":
+                            self.end_session()
+                elif kind == 8:  # SUBSCRIBE
+                    count = 0
+                    offset = 2
+                    while offset < len(body):
+                        (topic_length,) = struct.unpack_from(">H", body, offset)
+                        offset += 2 + topic_length + 1
+                        count += 1
+                    self.write_packet(0x90, body[:2] + bytes(count))
+                elif kind == 12:  # PINGREQ
+                    self.write_packet(0xD0, b"")
+                elif kind == 14:  # DISCONNECT
+                    break
+                await self.writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            self.server.log(None, "rx", "closed", {"client_id": self.client_id})
+            self.end_session()
+            self.writer.close()
+
+
+def local_ip():
+    # No packet is sent, connecting only picks the outgoing interface
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        s.connect(("8.8.8.8", 80))
+        return s.getsockname()[0]
+
+
+async def serve(args):
+    server = MockServer(args)
+    http = await asyncio.start_server(lambda r, w: handle_http(server, r, w), "0.0.0.0", args.port)
+    print(f"HTTP / websocket v{args.version} on {args.host_ip}:{args.port}, OTA url http://{args.host_ip}:{args.port}/ota/")
+    if args.transport == "mqtt":
+        loop = asyncio.get_running_loop()
+        _, server.udp = await loop.create_datagram_endpoint(UdpAudio, local_addr=("0.0.0.0", args.udp_port))
+        await asyncio.start_server(lambda r, w: MqttTransport(server, r, w).run(), "0.0.0.0", args.mqtt_port)
+        print(f"MQTT on {args.host_ip}:{args.mqtt_port}, UDP audio on port {args.udp_port}")
+    try:
+        await server.done
+    finally:
+        http.close()
+        if server.results:
+            print_summary(server.results)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Mock server for end-to-end latency regression runs")
+    parser.add_argument("--tts", required=True, help="Ogg Opus file replayed as the answer to every utterance")
+    parser.add_argument("--tts-sample-rate", type=int, default=24000, help="sample rate announced in the server hello")
+    parser.add_argument("--pcm", help="16 kHz mono 16-bit PCM (raw or WAV) served as the device microphone input")
+    parser.add_argument("--transport", choices=["websocket", "mqtt"], default="websocket")
+    parser.add_argument("--version", type=int, default=3, choices=[1, 2, 3], help="websocket protocol version")
+    parser.add_argument("--host-ip", default=None, help="address the device reaches this host at")
+    parser.add_argument("--port", type=int, default=8002, help="HTTP and websocket port")
+    parser.add_argument("--mqtt-port", type=int, default=1883)
+    parser.add_argument("--udp-port", type=int, default=8003)
+    parser.add_argument("--wake-end-ms", type=int, default=0, help="end of the wake word in the PCM file")
+    parser.add_argument("--speech-end-ms", type=int, default=0, help="end of the question in the PCM file")
+    parser.add_argument("--barge-end-ms", type=int, default=0, help="end of the wake word spoken over the answer")
+    parser.add_argument("--speech-bytes", type=int, default=10, help="uplink packets above this size count as speech")
+    parser.add_argument("--silence-ms", type=int, default=500, help="silence that ends an utterance")
+    parser.add_argument("--lead-ms", type=int, default=180, help="how far the TTS runs ahead of real time")
+    parser.add_argument("--close-after-ms", type=int, default=2000, help="close the session after this long without speech")
+    parser.add_argument("--runs", type=int, default=0, help="stop and print the summary after this many reports")
+    parser.add_argument("--log", default="latency_messages.jsonl", help="timestamped log of every message")
+    parser.add_argument("--results", default="latency_results.jsonl", help="metrics and timeline of every run")
+    args = parser.parse_args()
+    if args.host_ip is None:
+        args.host_ip = local_ip()
+
+    try:
+        asyncio.run(serve(args))
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
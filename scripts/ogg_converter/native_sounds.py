@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""
+Re-encode the built-in sounds (main/assets/common and main/assets/locales/*) at a board's
+native output sample rate and the firmware's Opus frame duration.
+
+The sound player decodes an OGG at the input sample rate of its OpusHead and only resamples
+when that differs from the codec's output rate, so sounds encoded at the board rate play
+with neither a resampler nor a decoder reopen. The frame duration needs no header field,
+every Opus packet carries it in its TOC byte; it is checked after encoding.
+
+    python native_sounds.py --board bread-compact-wifi
+    python native_sounds.py --sample-rate 24000 --output build/sounds
+    python native_sounds.py --board esp-box-3 --source-dir wav_sources --in-place
+
+Sources are the existing .ogg files unless --source-dir holds a lossless file of the same
+name (.wav / .flac), re-encoding Opus from Opus costs some quality. Requires ffmpeg.
+"""
+import argparse
+import json
+import os
+import re
+import struct
+import subprocess
+import sys
+
+ROOT_DIR = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+MAIN_DIR = os.path.join(ROOT_DIR, 'main')
+ASSETS_DIR = os.path.join(MAIN_DIR, 'assets')
+
+# Rates the Opus decoder can output, any other board rate still needs the resampler
+OPUS_SAMPLE_RATES = (8000, 12000, 16000, 24000, 48000)
+OPUS_FRAME_DURATIONS = (2.5, 5, 10, 20, 40, 60, 80, 100, 120)
+
+
+def read_define(path, name):
+    with open(path, 'r', encoding='utf-8') as f:
+        match = re.search(r'#define\s+' + name + r'\s+(\d+)', f.read())
+    return int(match.group(1)) if match else None
+
+
+def find_board_dir(board):
+    """A board directory, or the directory whose config.json has a build of that name"""
+    boards_dir = os.path.join(MAIN_DIR, 'boards')
+    if os.path.isfile(os.path.join(boards_dir, board, 'config.h')):
+        return os.path.join(boards_dir, board)
+    for name in sorted(os.listdir(boards_dir)):
+        config_json = os.path.join(boards_dir, name, 'config.json')
+        if not os.path.isfile(config_json):
+            continue
+        with open(config_json, 'r', encoding='utf-8') as f:
+            builds = json.load(f).get('builds', [])
+        if any(build.get('name') == board for build in builds):
+            return os.path.join(boards_dir, name)
+    return None
+
+
+def board_sample_rate(board):
+    board_dir = find_board_dir(board)
+    if board_dir is None:
+        sys.exit(f"Board {board} not found in {os.path.join(MAIN_DIR, 'boards')}")
+    rate = read_define(os.path.join(board_dir, 'config.h'), 'AUDIO_OUTPUT_SAMPLE_RATE')
+    if rate is None:
+        sys.exit(f"AUDIO_OUTPUT_SAMPLE_RATE is not defined in {board_dir}/config.h")
+    return rate
+
+
+def firmware_frame_duration():
+    return read_define(os.path.join(MAIN_DIR, 'audio', 'audio_service.h'), 'OPUS_FRAME_DURATION_MS') or 60
+
+
+def find_sounds():
+    """Paths of the built-in sounds relative to main/assets"""
+    sounds = []
+    for dirpath, _, filenames in os.walk(ASSETS_DIR):
+        for filename in sorted(filenames):
+            if filename.endswith('.ogg'):
+                sounds.append(os.path.relpath(os.path.join(dirpath, filename), ASSETS_DIR))
+    return sorted(sounds)
+
+
+def find_source(sound, source_dir):
+    if source_dir:
+        base = os.path.splitext(os.path.join(source_dir, sound))[0]
+        for ext in ('.wav', '.flac'):
+            if os.path.isfile(base + ext):
+                return base + ext
+    return os.path.join(ASSETS_DIR, sound)
+
+
+def read_ogg_packets(path):
+    """Packets of the first logical stream, reassembled from the page segments"""
+    with open(path, 'rb') as f:
+        data = f.read()
+    packets = []
+    packet = b''
+    offset = 0
+    while offset + 27 <= len(data):
+        if data[offset:offset + 4] != b'OggS':
+            raise ValueError(f"{path}: bad page at {offset}")
+        segment_count = data[offset + 26]
+        lacing = data[offset + 27:offset + 27 + segment_count]
+        offset += 27 + segment_count
+        for size in lacing:
+            packet += data[offset:offset + size]
+            offset += size
+            if size < 255:
+                packets.append(packet)
+                packet = b''
+    return packets
+
+
+def packet_duration_ms(packet):
+    """Duration of an Opus packet from its TOC byte, RFC 6716 section 3.1"""
+    toc = packet[0]
+    config = toc >> 3
+    if config < 12:
+        frame_ms = (10, 20, 40, 60)[config % 4]
+    elif config < 16:
+        frame_ms = (10, 20)[config % 2]
+    else:
+        frame_ms = (2.5, 5, 10, 20)[config % 4]
+    code = toc & 0x03
+    if code == 0:
+        frames = 1
+    elif code in (1, 2):
+        frames = 2
+    else:
+        frames = packet[1] & 0x3F
+    return frame_ms * frames
+
+
+def check_ogg(path, sample_rate, frame_duration):
+    packets = read_ogg_packets(path)
+    if len(packets) < 3 or not packets[0].startswith(b'OpusHead'):
+        return "not an Opus stream"
+    header_rate = struct.unpack_from('<I', packets[0], 12)[0]
+    if header_rate != sample_rate:
+        return f"OpusHead rate is {header_rate}"
+    # The last packet may be shorter
+    durations = {packet_duration_ms(p) for p in packets[2:-1] if p}
+    if durations and durations != {frame_duration}:
+        return f"packet durations {sorted(durations)} ms"
+    return None
+
+
+def encode(source, output, sample_rate, frame_duration, bitrate):
+    os.makedirs(os.path.dirname(output), exist_ok=True)
+    temp = output + '.tmp.ogg'
+    command = [
+        'ffmpeg', '-y', '-loglevel', 'error', '-i', source,
+        '-c:a', 'libopus', '-b:a', bitrate, '-ac', '1', '-ar', str(sample_rate),
+        '-frame_duration', str(frame_duration), '-map_metadata', '-1', temp,
+    ]
+    subprocess.run(command, check=True)
+    os.replace(temp, output)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Re-encode the built-in sounds at a board's native output rate")
+    target = parser.add_mutually_exclusive_group(required=True)
+    target.add_argument('--board', help="Board directory or build name, its AUDIO_OUTPUT_SAMPLE_RATE is used")
+    target.add_argument('--sample-rate', type=int, help="Output sample rate in Hz")
+    parser.add_argument('--frame-duration', type=float, default=None,
+                        help="Opus frame duration in ms, defaults to OPUS_FRAME_DURATION_MS of the firmware")
+    parser.add_argument('--bitrate', default='16k', help="Opus bitrate, default 16k")
+    parser.add_argument('--source-dir', help="Lossless sources laid out like main/assets, used where present")
+    output = parser.add_mutually_exclusive_group()
+    output.add_argument('--output', default='output', help="Output directory, laid out like main/assets")
+    output.add_argument('--in-place', action='store_true', help="Replace the sounds in main/assets")
+    args = parser.parse_args()
+
+    sample_rate = args.sample_rate or board_sample_rate(args.board)
+    frame_duration = args.frame_duration or firmware_frame_duration()
+    if frame_duration == int(frame_duration):
+        frame_duration = int(frame_duration)
+    if frame_duration not in OPUS_FRAME_DURATIONS:
+        sys.exit(f"Opus has no {frame_duration} ms frames")
+    if sample_rate not in OPUS_SAMPLE_RATES:
+        nearest = min((r for r in OPUS_SAMPLE_RATES if r >= sample_rate), default=48000)
+        print(f"Warning: Opus cannot decode at {sample_rate} Hz, encoding at {nearest} Hz, the firmware resamples")
+        sample_rate = nearest
+
+    output_dir = ASSETS_DIR if args.in_place else os.path.abspath(args.output)
+    print(f"Encoding at {sample_rate} Hz, {frame_duration} ms frames into {output_dir}")
+
+    failed = 0
+    for sound in find_sounds():
+        source = find_source(sound, args.source_dir)
+        target_path = os.path.join(output_dir, sound)
+        encode(source, target_path, sample_rate, frame_duration, args.bitrate)
+        problem = check_ogg(target_path, sample_rate, frame_duration)
+        if problem:
+            failed += 1
+            print(f"  {sound}: {problem}")
+        else:
+            print(f"  {sound}: {os.path.getsize(target_path)} bytes")
+
+    if failed:
+        sys.exit(f"{failed} sounds did not come out at {sample_rate} Hz / {frame_duration} ms")
+
+
+if __name__ == '__main__':
+    main()
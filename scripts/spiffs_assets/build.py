@@ -86,7 +86,7 @@ def process_text_font(text_font_file, assets_dir):
     return font_filename
 
 
-def process_emoji_collection(emoji_collection_dir, assets_dir):
+def process_emoji_collection(emoji_collection_dir, assets_dir, emoji_format="gif"):
     """Process emoji_collection parameter"""
     if not emoji_collection_dir:
         return []
@@ -97,13 +97,18 @@ def process_emoji_collection(emoji_collection_dir, assets_dir):
     for root, dirs, files in os.walk(emoji_collection_dir):
         for file in files:
             if file.lower().endswith(('.png', '.gif')):
-                # Copy file
                 src_file = os.path.join(root, file)
-                dst_file = os.path.join(assets_dir, file)
-                copy_file(src_file, dst_file)
-                
                 # Get filename without extension
                 filename_without_ext = os.path.splitext(file)[0]
+
+                if emoji_format == "anim" and file.lower().endswith('.gif'):
+                    # Played by LvglAnimation on the device, without decoding the GIF
+                    from emoji_anim import convert_gif
+                    file = filename_without_ext + ".anim"
+                    convert_gif(src_file, os.path.join(assets_dir, file))
+                else:
+                    # Copy file
+                    copy_file(src_file, os.path.join(assets_dir, file))
                 
                 # Add to emoji list
                 emoji_list.append({
@@ -305,7 +310,7 @@ def generate_index_json(assets_dir, srmodels, text_font, emoji_collection, icon_
     print(f"Generated: {index_path}")
 
 
-def generate_config_json(build_dir, assets_dir):
+def generate_config_json(build_dir, assets_dir, compress_format="", compress_exclude=None):
     """Generate config.json file"""
     # Get absolute path of current working directory
     workspace_dir = os.path.abspath(os.path.join(os.path.dirname(__file__)))
@@ -316,7 +321,7 @@ def generate_config_json(build_dir, assets_dir):
         "image_file": os.path.join(workspace_dir, "build/output/assets.bin"),
         "lvgl_ver": "9.3.0",
         "assets_size": "0x400000",
-        "support_format": ".png, .gif, .jpg, .bin, .json, .eaf",
+        "support_format": ".png, .gif, .jpg, .bin, .json, .eaf, .anim",
         "name_length": "32",
         "split_height": "0",
         "support_qoi": False,
@@ -325,7 +330,9 @@ def generate_config_json(build_dir, assets_dir):
         "support_sqoi": False,
         "support_raw": False,
         "support_raw_dither": False,
-        "support_raw_bgr": False
+        "support_raw_bgr": False,
+        "compress_format": compress_format,
+        "compress_exclude": compress_exclude or []
     }
     
     # Write config.json
@@ -345,6 +352,12 @@ def main():
 
     parser.add_argument('--res_path', help='Path to res directory')
     parser.add_argument('--target_board', help='Path to target board directory')
+    parser.add_argument('--emoji_format', choices=['gif', 'anim'], default='gif',
+                        help='Keep GIF emojis as they are, or convert them to RGB565 delta frames (anim) '
+                             'that the device copies instead of decoding')
+    parser.add_argument('--compress', default='',
+                        help='Extensions of the assets to store deflated, e.g. ".bin,.json". '
+                             'The text font and srmodels always stay stored so they run from flash')
     
     args = parser.parse_args()
     
@@ -370,7 +383,7 @@ def main():
     if(args.target_board):
         emoji_collection, icon_collection, layout_json = process_board_collection(args.target_board, args.res_path, assets_dir)
     else:
-        emoji_collection = process_emoji_collection(args.emoji_collection, assets_dir)
+        emoji_collection = process_emoji_collection(args.emoji_collection, assets_dir, args.emoji_format)
         icon_collection = []
         layout_json = []
     
@@ -378,7 +391,9 @@ def main():
     generate_index_json(assets_dir, srmodels, text_font, emoji_collection, icon_collection, layout_json)
     
     # Generate config.json
-    config_path = generate_config_json(build_dir, assets_dir)
+    # Fonts and models are used in place from the mapped partition, inflating them would cost their size in PSRAM
+    compress_exclude = [name for name in (srmodels, text_font) if name]
+    config_path = generate_config_json(build_dir, assets_dir, args.compress, compress_exclude)
     
     # Use spiffs_assets_gen.py to package final build/assets.bin
     try:
@@ -393,6 +408,7 @@ def main():
     
     # Copy build/output/assets.bin to build/assets.bin
     shutil.copy(os.path.join(build_dir, "output", "assets.bin"), os.path.join(build_dir, "assets.bin"))
+    shutil.copy(os.path.join(build_dir, "output", "assets.json"), os.path.join(build_dir, "assets.json"))
     print("Build completed!")
 
 
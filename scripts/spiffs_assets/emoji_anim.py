@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+Convert a GIF into the animation format played by LvglAnimation (main/display/lvgl_display/lvgl_animation.h).
+
+Frame 0 is the whole image, every later frame only the rectangle that changed since the previous one,
+as RGB565 pixels followed by an alpha plane when the GIF has transparency (RGB565A8). The device copies
+the rectangles into its canvas instead of decoding LZW and blending every frame.
+
+Usage: emoji_anim.py input.gif output.anim
+"""
+
+import struct
+import sys
+
+import numpy as np
+from PIL import Image, ImageSequence
+
+MAGIC = b'XZAN'
+VERSION = 1
+LV_COLOR_FORMAT_RGB565 = 0x12
+LV_COLOR_FORMAT_RGB565A8 = 0x14
+HEADER_SIZE = 16
+FRAME_SIZE = 16
+
+
+def load_frames(gif_path):
+    """Composed RGBA frames with their delays in milliseconds, and the loop count of the GIF"""
+    frames = []
+    with Image.open(gif_path) as im:
+        # Pillow reports loop 0 for endless GIFs and no loop at all for ones that play once
+        loop = im.info.get('loop', 1)
+        for frame in ImageSequence.Iterator(im):
+            delay = frame.info.get('duration', 100) or 100
+            frames.append((np.array(frame.convert('RGBA')), max(int(delay), 10)))
+    return frames, loop
+
+
+def to_rgb565(rgba):
+    r = rgba[:, :, 0].astype(np.uint16)
+    g = rgba[:, :, 1].astype(np.uint16)
+    b = rgba[:, :, 2].astype(np.uint16)
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3)
+
+
+def changed_rect(previous, current):
+    """Bounding box (x, y, w, h) of the pixels that differ, None when nothing changed"""
+    diff = np.any(previous != current, axis=2)
+    rows = np.flatnonzero(diff.any(axis=1))
+    if rows.size == 0:
+        return None
+    cols = np.flatnonzero(diff.any(axis=0))
+    return int(cols[0]), int(rows[0]), int(cols[-1] - cols[0] + 1), int(rows[-1] - rows[0] + 1)
+
+
+def convert_gif(gif_path, anim_path):
+    frames, loop = load_frames(gif_path)
+    if not frames:
+        raise ValueError(f'{gif_path} has no frames')
+    height, width = frames[0][0].shape[:2]
+    has_alpha = any(np.any(rgba[:, :, 3] != 255) for rgba, _ in frames)
+    color_format = LV_COLOR_FORMAT_RGB565A8 if has_alpha else LV_COLOR_FORMAT_RGB565
+
+    # Fully transparent pixels compare equal whatever their color, so they do not grow the rectangles
+    planes = []
+    for rgba, _ in frames:
+        rgb565 = to_rgb565(rgba)
+        alpha = rgba[:, :, 3] if has_alpha else np.full((height, width), 255, dtype=np.uint8)
+        rgb565 = np.where(alpha == 0, 0, rgb565).astype(np.uint16)
+        planes.append(np.dstack([rgb565, alpha.astype(np.uint16)]))
+
+    table = bytearray()
+    data = bytearray()
+    data_start = HEADER_SIZE + FRAME_SIZE * len(frames)
+    for i, (_, delay) in enumerate(frames):
+        if i == 0:
+            rect = (0, 0, width, height)
+        else:
+            rect = changed_rect(planes[i - 1], planes[i]) or (0, 0, 0, 0)
+        x, y, w, h = rect
+        region = planes[i][y:y + h, x:x + w]
+        offset = data_start + len(data)
+        data.extend(region[:, :, 0].astype('<u2').tobytes())
+        if has_alpha:
+            data.extend(region[:, :, 1].astype(np.uint8).tobytes())
+        table.extend(struct.pack('<IHHHHHH', offset, min(delay, 0xFFFF), x, y, w, h, 0))
+
+    header = MAGIC + struct.pack('<BBHHHHH', VERSION, color_format, len(frames), width, height, min(loop, 0xFFFF), 0)
+    with open(anim_path, 'wb') as f:
+        f.write(header + table + data)
+
+    full_size = width * height * (3 if has_alpha else 2) * len(frames)
+    print(f'Converted {gif_path}: {len(frames)} frames {width}x{height}, '
+          f'{HEADER_SIZE + len(table) + len(data)} bytes ({full_size} as full frames)')
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+    convert_gif(sys.argv[1], sys.argv[2])
@@ -2,6 +2,7 @@
 # SPDX-License-Identifier: Apache-2.0
 import io
 import os
+import hashlib
 import argparse
 import json
 import shutil
@@ -12,6 +13,7 @@ import numpy as np
 import importlib
 import subprocess
 import urllib.request
+import zlib
 
 from PIL import Image
 from datetime import datetime
@@ -45,6 +47,21 @@ class PackModelsConfig:
     image_file: str
     assets_path: str
     name_length: int
+    compress_format: List[str]
+    compress_exclude: List[str]
+
+# A compressed asset has the prefix 0x5A43 instead of 0x5A5A and is stored as
+# |inflated size 4u|raw deflate|, its table entry has the stored size
+COMPRESSED_PREFIX = b'\x5A\x43'
+# Below this saving an asset stays stored, inflating costs the PSRAM copy
+COMPRESS_MIN_SAVING = 0.125
+
+def compress_asset(data):
+    compressor = zlib.compressobj(9, zlib.DEFLATED, -15)
+    deflated = compressor.compress(data) + compressor.flush()
+    if len(deflated) + 4 > len(data) * (1 - COMPRESS_MIN_SAVING):
+        return None
+    return len(data).to_bytes(4, byteorder='little') + deflated
 
 def generate_header_filename(path):
     asset_name = os.path.basename(path)
@@ -398,6 +415,7 @@ def pack_assets(config: PackModelsConfig):
     out_file = config.image_file
     assets_path = config.assets_path
     max_name_len = config.name_length
+    compress_format = tuple(fmt.lower() for fmt in config.compress_format if fmt)
 
     merged_data = bytearray()
     file_info_list = []
@@ -429,17 +447,30 @@ def pack_assets(config: PackModelsConfig):
             else:
                 width, height = 0, 0
 
-        file_info_list.append((file_name, len(merged_data), file_size, width, height))
-        # Add 0x5A5A prefix to merged_data
-        merged_data.extend(b'\x5A' * 2)
-
         with open(file_path, 'rb') as bin_file:
             bin_data = bin_file.read()
 
+        prefix = b'\x5A' * 2
+        if compress_format and file_name.lower().endswith(compress_format) and file_name not in config.compress_exclude:
+            compressed = compress_asset(bin_data)
+            if compressed is not None:
+                print(f'Compressed {file_name}: {file_size} -> {len(compressed)} bytes')
+                prefix = COMPRESSED_PREFIX
+                bin_data = compressed
+                file_size = len(compressed)
+
+        file_info_list.append((file_name, len(merged_data), file_size, width, height))
+        # Add the 0x5A5A (stored) or 0x5A43 (compressed) prefix to merged_data
+        merged_data.extend(prefix)
         merged_data.extend(bin_data)
 
     total_files = len(file_info_list)
 
+    # The firmware binary searches the table, keep it sorted by the stored name bytes
+    def table_key(info):
+        return info[0].ljust(int(max_name_len), '\0')[:int(max_name_len)].encode('utf-8')
+    file_info_list.sort(key=table_key)
+
     mmap_table = bytearray()
     for file_name, offset, file_size, width, height in file_info_list:
         if len(file_name) > int(max_name_len):
@@ -460,6 +491,23 @@ def pack_assets(config: PackModelsConfig):
     with open(out_file, 'wb') as output_bin:
         output_bin.write(final_data)
 
+    # Manifest for differential updates: the device only fetches the entries whose sha256 changed,
+    # with Range requests against the image at "url"
+    data_start = len(header_data) + len(combined_data_length) + len(mmap_table)
+    manifest = {'url': os.path.basename(out_file), 'size': len(final_data), 'files': []}
+    for file_name, offset, file_size, width, height in file_info_list:
+        start = data_start + offset + 2
+        manifest['files'].append({
+            'name': file_name[:int(max_name_len)],
+            'offset': data_start + offset,
+            'size': file_size,
+            'width': width,
+            'height': height,
+            'sha256': hashlib.sha256(final_data[start:start + file_size]).hexdigest(),
+        })
+    with open(os.path.splitext(out_file)[0] + '.json', 'w') as output_manifest:
+        json.dump(manifest, output_manifest, indent=2)
+
     os.makedirs(assets_include_path, exist_ok=True)
     current_year = datetime.now().year
 
@@ -539,6 +587,7 @@ def process_assets_build(config_data):
     name_length = config_data['name_length']
     split_height = config_data['split_height']
     support_format = [fmt.strip() for fmt in config_data['support_format'].split(',')]
+    compress_format = [fmt.strip() for fmt in config_data.get('compress_format', '').split(',') if fmt.strip()]
 
     copy_config = AssetCopyConfig(
         assets_path=assets_path,
@@ -557,7 +606,9 @@ def process_assets_build(config_data):
         include_path=include_path,
         image_file=image_file,
         assets_path=assets_path,
-        name_length=name_length
+        name_length=name_length,
+        compress_format=compress_format,
+        compress_exclude=config_data.get('compress_exclude', [])
     )
 
     print('--support_format:', support_format)
@@ -0,0 +1,174 @@
+import argparse
+import base64
+import json
+import socket
+import struct
+import sys
+
+
+'''
+  Convert a trace dump of the firmware (CONFIG_USE_TRACE, MCP tool self.trace.dump)
+  into Chrome trace JSON, open it in https://ui.perfetto.dev or chrome://tracing.
+
+  Receive the dump over UDP (CONFIG_TRACE_UDP_SERVER):
+    python trace_viewer.py --udp 8001 -o trace.json
+  Or extract it from a serial monitor log, when no server is configured:
+    python trace_viewer.py --log monitor.log -o trace.json
+'''
+
+MAGIC = b"XZTR"
+EVENT = struct.Struct("<IHBBiHH")
+
+
+def read_names(data, offset, count):
+    names = []
+    for _ in range(count):
+        end = data.index(b"\0", offset)
+        names.append(data[offset:end].decode(errors="replace"))
+        offset = end + 1
+    return names, offset
+
+
+class Dump:
+    def __init__(self):
+        self.header = None
+        self.events = []
+        self.finished = False
+
+    def feed(self, record):
+        if not record.startswith(MAGIC) or len(record) < 5:
+            return
+        kind = record[4:5]
+        if kind == b"H":
+            self.parse_header(record)
+        elif kind == b"E":
+            core, count = struct.unpack_from("<BH", record, 5)
+            for i in range(count):
+                self.events.append(EVENT.unpack_from(record, 8 + i * EVENT.size))
+        elif kind == b"F":
+            self.finished = True
+
+    def parse_header(self, record):
+        version, cores, _, ring_size, now_us = struct.unpack_from("<BBBII", record, 5)
+        if version != 1:
+            sys.exit(f"Unsupported trace version {version}")
+        offset = 16
+        points, offset = read_names(record, offset + 1, record[offset])
+        states, offset = read_names(record, offset + 1, record[offset])
+        (task_count,) = struct.unpack_from("<H", record, offset)
+        offset += 2
+        tasks = {}
+        for _ in range(task_count):
+            (number,) = struct.unpack_from("<H", record, offset)
+            names, offset = read_names(record, offset + 2, 1)
+            tasks[number] = names[0]
+        self.header = {"cores": cores, "ring_size": ring_size, "now_us": now_us,
+                       "points": points, "states": states, "tasks": tasks}
+
+
+def receive_udp(port):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("0.0.0.0", port))
+    print(f"Waiting for a trace dump on 0.0.0.0:{port}...")
+    dump = Dump()
+    while not dump.finished:
+        record, _ = sock.recvfrom(4096)
+        if record.startswith(MAGIC + b"H"):
+            # A new dump starts over
+            dump = Dump()
+        dump.feed(record)
+    sock.close()
+    return dump
+
+
+def read_log(path):
+    dump = None
+    with open(path, errors="replace") as f:
+        for line in f:
+            start = line.find("XZTRACE:")
+            if start < 0:
+                continue
+            record = base64.b64decode(line[start + 8:].strip())
+            if record.startswith(MAGIC + b"H"):
+                # Keep the last dump of the log
+                dump = Dump()
+            if dump is not None:
+                dump.feed(record)
+    return dump
+
+
+def convert(dump):
+    header = dump.header
+    points = header["points"]
+    states = header["states"]
+    now = header["now_us"]
+
+    # Times are the low 32 bits of the microsecond clock, count them back from the dump time
+    events = []
+    for time_us, point, kind, core, value, task, _ in dump.events:
+        age = (now - time_us) & 0xFFFFFFFF
+        events.append((-age, point, chr(kind), core, value, task))
+    events.sort(key=lambda e: e[0])
+    if not events:
+        return {"traceEvents": []}
+    origin = events[0][0]
+
+    trace = []
+    task_ids = set()
+    state_name = points.index("state") if "state" in points else -1
+    last_state = None
+    for t, point, kind, core, value, task in events:
+        ts = t - origin
+        name = points[point] if point < len(points) else f"point_{point}"
+        task_ids.add(task)
+        common = {"name": name, "cat": "xiaozhi", "ts": ts, "pid": 1, "tid": task}
+        if point == state_name:
+            # Device states become back to back slices on their own track
+            if last_state is not None:
+                trace.append({"name": last_state[1], "cat": "state", "ph": "X", "ts": last_state[0],
+                              "dur": ts - last_state[0], "pid": 1, "tid": 0})
+            last_state = (ts, states[value] if 0 <= value < len(states) else str(value))
+            trace.append(dict(common, ph="i", s="t", args={"state": last_state[1], "core": core}))
+        elif kind == "B":
+            # Async so begin and end may come from different tasks, as the hello does
+            trace.append(dict(common, ph="b", id=point, args={"core": core}))
+        elif kind == "E":
+            trace.append(dict(common, ph="e", id=point, args={"core": core}))
+        elif kind == "C":
+            trace.append({"name": name, "ph": "C", "ts": ts, "pid": 1, "args": {"value": value}})
+        else:
+            trace.append(dict(common, ph="i", s="t", args={"value": value, "core": core}))
+    if last_state is not None:
+        trace.append({"name": last_state[1], "cat": "state", "ph": "X", "ts": last_state[0],
+                      "dur": events[-1][0] - origin - last_state[0], "pid": 1, "tid": 0})
+
+    # One track per task, the core each event ran on is in its args
+    trace.append({"name": "process_name", "ph": "M", "pid": 1, "args": {"name": "xiaozhi"}})
+    trace.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": 0, "args": {"name": "device state"}})
+    for task in task_ids:
+        trace.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": task,
+                      "args": {"name": header["tasks"].get(task, f"task {task}")}})
+    return {"traceEvents": trace, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a firmware trace dump to Chrome trace JSON")
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--udp", type=int, metavar="PORT", help="receive the dump on this UDP port")
+    source.add_argument("--log", metavar="FILE", help="extract the dump from a serial monitor log")
+    parser.add_argument("-o", "--output", default="trace.json", help="output file")
+    args = parser.parse_args()
+
+    dump = receive_udp(args.udp) if args.udp else read_log(args.log)
+    if dump is None or dump.header is None:
+        sys.exit("No trace dump found")
+    if not dump.finished:
+        print("Warning: the dump is incomplete")
+
+    with open(args.output, "w") as f:
+        json.dump(convert(dump), f)
+    print(f"Wrote {len(dump.events)} events to {args.output}")
+
+
+if __name__ == "__main__":
+    main()